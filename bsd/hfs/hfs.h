@@ -241,6 +241,10 @@ typedef struct hfsmount {
 	
 	u_int32_t 			scan_var;			/* For initializing the summary table */
 
+	/* In-memory tree of free extents, built by the bitmap scan */
+	struct hfs_extent_tree		*hfs_extent_tree;
+	lck_mtx_t			hfs_extent_tree_lock;
+
 
 	u_int32_t		reserveBlocks;		/* free block reserve */
 	u_int32_t		loanedBlocks;		/* blocks on loan for delayed allocations */
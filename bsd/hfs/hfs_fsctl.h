@@ -65,6 +65,25 @@ struct hfsinfo_metadata {
 };
 
 
+/*
+ * Journal statistics since the volume was mounted.  commit_latency[i]
+ * counts the journal writes that took less than 2^(i+5) usecs, the
+ * last bucket the rest.
+ */
+#define HFS_JOURNAL_LATENCY_BUCKETS	16
+
+struct hfs_journal_stats {
+	uint64_t commits;		/* journal writes */
+	uint64_t transactions;		/* transactions carried by those writes */
+	uint64_t sync_commits;		/* journal writes a caller waited for */
+	uint64_t group_waits;		/* flushes satisfied by another thread's write */
+	uint64_t ckpt_waits;		/* checkpoint writes held back by earlier ones */
+	uint32_t ckpt_max;		/* most transactions checkpointing at once */
+	uint32_t reserved;
+	uint64_t commit_latency[HFS_JOURNAL_LATENCY_BUCKETS];
+};
+
+
 /* HFS FS CONTROL COMMANDS */
 
 #define HFSIOC_RESIZE_PROGRESS  _IOR('h', 1, u_int32_t)
@@ -178,6 +197,10 @@ struct hfsinfo_metadata {
 #define HFSIOC_CS_FREESPACE_TRIM _IOWR('h', 39, u_int32_t)
 #define HFS_CS_FREESPACE_TRIM    IOCBASECMD(HFSIOC_CS_FREESPACE_TRIM)
 
+/* Get the journal statistics, see struct hfs_journal_stats */
+#define HFSIOC_GET_JOURNAL_STATS _IOR('h', 40, struct hfs_journal_stats)
+#define HFS_GET_JOURNAL_STATS    IOCBASECMD(HFSIOC_GET_JOURNAL_STATS)
+
 #endif /* __APPLE_API_UNSTABLE */
 
 #endif /* ! _HFS_FSCTL_H_ */
@@ -38,7 +38,8 @@ enum {
 	HFSDBG_SYNCER        		= HFSDBG_CODE(21),	/* 0x03080054 */
 	HFSDBG_SYNCER_TIMED   		= HFSDBG_CODE(22),	/* 0x03080058 */
 	HFSDBG_UNMAP_SCAN    		= HFSDBG_CODE(23),	/* 0x0308005C */	
-	HFSDBG_UNMAP_SCAN_TRIM   	= HFSDBG_CODE(24)	/* 0x03080060 */
+	HFSDBG_UNMAP_SCAN_TRIM   	= HFSDBG_CODE(24),	/* 0x03080060 */
+	HFSDBG_ALLOC_RBTREE		= HFSDBG_CODE(25)	/* 0x03080064 */
 };
 
 /*
@@ -79,4 +80,6 @@ enum {
     22      HFSDBG_SYNCER_TIMED         now, last_write_completed, hfs_mp->mnt_last_write_issued_timestamp, mnt_pending_write_size, 0 ... now, mnt_last_write_completed_timestamp, mnt_last_write_issued_timestamp, hfs_mp->mnt_pending_write_size, 0 
     23      HFSDBG_UNMAP_SCAN           hfs_raw_dev, 0, 0, 0, 0 ... hfs_raw_dev, error, 0, 0, 0
     24      HFSDBG_UNMAP_TRIM           hfs_raw_dev, 0, 0, 0, 0 ... hfs_raw_dev, error, 0, 0, 0  
+    25      HFSDBG_ALLOC_RBTREE         startingBlock, minBlocks, maxBlocks, flags, 0 ... err, actualStartBlock, actualBlockCount, tries, 0
+                                        (tries: candidates rejected, summed over the metazone and general passes)
 */
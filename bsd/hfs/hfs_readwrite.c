@@ -2639,6 +2639,30 @@ fail_change_next_allocation:
 	}
 
 
+	case HFS_GET_JOURNAL_STATS: {
+		struct hfs_journal_stats *hjs;
+		struct journal_stats js;
+		int i;
+
+		hjs = (struct hfs_journal_stats *)ap->a_data;
+
+		if (hfsmp->jnl == NULL)
+			return (ENOTSUP);
+
+		journal_get_stats(hfsmp->jnl, &js);
+
+		bzero(hjs, sizeof(*hjs));
+		hjs->commits = js.js_commits;
+		hjs->transactions = js.js_transactions;
+		hjs->sync_commits = js.js_sync_commits;
+		hjs->group_waits = js.js_group_waits;
+		hjs->ckpt_waits = js.js_ckpt_waits;
+		hjs->ckpt_max = js.js_ckpt_max;
+		for (i = 0; i < HFS_JOURNAL_LATENCY_BUCKETS && i < JOURNAL_LATENCY_BUCKETS; i++)
+			hjs->commit_latency[i] = js.js_commit_latency[i];
+		break;
+	}
+
 	case HFS_FSINFO_METADATA_BLOCKS: {
 		int error;
 		struct hfsinfo_metadata *hinfo;
@@ -371,6 +371,9 @@ hfs_mount(struct mount *mp, vnode_t devvp, user_addr_t data, vfs_context_t conte
 				}
 			}
 
+			/* Read-only volumes don't allocate, so drop the free extent tree */
+			hfs_extent_tree_destroy(hfsmp);
+
 			hfsmp->hfs_downgrading_thread = NULL;
 		}
 
@@ -1428,6 +1431,7 @@ hfs_mountfs(struct vnode *devvp, struct mount *mp, struct hfs_mount_args *args,
 	
 	lck_mtx_init(&hfsmp->hfs_mutex, hfs_mutex_group, hfs_lock_attr);
 	lck_mtx_init(&hfsmp->hfc_mutex, hfs_mutex_group, hfs_lock_attr);
+	lck_mtx_init(&hfsmp->hfs_extent_tree_lock, hfs_mutex_group, hfs_lock_attr);
 	lck_rw_init(&hfsmp->hfs_global_lock, hfs_rwlock_group, hfs_lock_attr);
 	lck_spin_init(&hfsmp->vcbFreeExtLock, hfs_spinlock_group, hfs_lock_attr);
 	
@@ -2057,6 +2061,8 @@ hfs_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 
 		}
 	}
+
+	hfs_extent_tree_destroy(hfsmp);
 	
 	/*
 	 * Flush out the b-trees, volume bitmap and Volume Header
@@ -2730,6 +2736,7 @@ hfs_locks_destroy(struct hfsmount *hfsmp)
 
 	lck_mtx_destroy(&hfsmp->hfs_mutex, hfs_mutex_group);
 	lck_mtx_destroy(&hfsmp->hfc_mutex, hfs_mutex_group);
+	lck_mtx_destroy(&hfsmp->hfs_extent_tree_lock, hfs_mutex_group);
 	lck_rw_destroy(&hfsmp->hfs_global_lock, hfs_rwlock_group);
 	lck_spin_destroy(&hfsmp->vcbFreeExtLock, hfs_spinlock_group);
 
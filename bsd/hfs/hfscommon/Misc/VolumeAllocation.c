@@ -67,14 +67,17 @@ Public routines:
 					Adjusts the AllocLimit field in the hfs mount point.  This is used when we need to prevent
 					allocations from occupying space in the region we are modifying during a filesystem resize.  
 					At other times, it should be consistent with the total number of allocation blocks in the 
-					filesystem.  It is also used to shrink or grow the number of blocks that the red-black tree should
-					know about. If growing, scan the new range of bitmap, and if shrinking, reduce the
-					number of items in the tree that we can allocate from.
+					filesystem.  The free extent tree is thrown away when the limit moves, and allocations
+					scan the bitmap until it is rebuilt.
 
 	ScanUnmapBlocks	
 					Traverse the entire allocation bitmap.  Potentially issue DKIOCUNMAPs to the device as it 
 					tracks unallocated ranges when iterating the volume bitmap.  Additionally, build up the in-core
-					summary table of the allocation bitmap.
+					summary table of the allocation bitmap, and the free extent tree.
+
+	hfs_extent_tree_destroy
+					Throw away the free extent tree.  Allocations go back to scanning the bitmap
+					until the tree is built again by the next full bitmap scan.
  
 Internal routines:
 	BlockMarkFreeInternal
@@ -108,6 +111,9 @@ Internal routines:
 	BlockAllocateKnown
 					Try to allocate space from known free space in the volume's
 					free extent cache.
+	BlockAllocateRBTree
+					Find and allocate the best fitting free extent from the
+					free extent tree, without looking at the bitmap.
 	ReadBitmapBlock
 					Given an allocation block number, read the bitmap block that
 					contains that allocation block into a caller-supplied buffer.
@@ -136,6 +142,13 @@ Internal routines:
 					Check whether or not the current transaction
 					has allocated blocks that were recently freed. This may have data safety implications.
 
+	hfs_extent_tree_add
+					Add a range of free blocks to the free extent tree, merging it
+					with the free extents it overlaps or touches.
+	hfs_extent_tree_remove
+					Remove a range of newly allocated blocks from the free extent
+					tree, trimming or splitting the free extents it overlaps.
+
 
  
 Debug/Test Routines
@@ -166,6 +179,7 @@ Optimization Routines
 #include <sys/uio.h>
 #include <kern/kalloc.h>
 #include <sys/malloc.h>
+#include <libkern/tree.h>
 
 /* For VM Page size */
 #include <libkern/libkern.h>
@@ -234,6 +248,64 @@ enum {
 
 #define ALLOC_DEBUG 0
 
+/*
+ * Free extent tree
+ *
+ * The bitmap scan at mount time also builds an in-memory copy of the
+ * volume's free space: every run of free blocks becomes one extent, kept
+ * in two red-black trees, one sorted by starting block (to find the
+ * neighbours of an extent being added or removed) and one by length and
+ * then starting block (for best fit searches).  Allocations take blocks
+ * out of the tree in BlockMarkAllocatedInternal.  Freed blocks go back in
+ * once they may be reused: right away without a journal, otherwise from
+ * hfs_trim_callback once the transaction that freed them is on disk, the
+ * same rule the free extent cache follows.
+ *
+ * So the tree holds the free space that can be handed out without a
+ * journal flush, and once the scan has finished BlockAllocate trusts it
+ * over the bitmap except when the caller allows a flush.
+ *
+ * Everything in the tree is protected by hfs_extent_tree_lock, which is
+ * only held around the tree operations themselves since the trim callback
+ * runs without the bitmap lock.  If we ever fail to allocate a node, or
+ * the volume has more free extents than HFS_EXTENT_TREE_MAX_EXTENTS, the
+ * tree is thrown away and the allocator falls back to the bitmap until
+ * the next full scan.
+ *
+ * Use sysctl vfs.generic.hfs.extent_tree to stop building the tree; it
+ * takes effect on the next mount.
+ */
+struct hfs_free_extent {
+	RB_ENTRY(hfs_free_extent)	fe_offset_link;
+	RB_ENTRY(hfs_free_extent)	fe_size_link;
+	u_int32_t			fe_start;
+	u_int32_t			fe_count;
+};
+
+RB_HEAD(hfs_fe_offset_tree, hfs_free_extent);
+RB_HEAD(hfs_fe_size_tree, hfs_free_extent);
+
+struct hfs_extent_tree {
+	struct hfs_fe_offset_tree	et_offset;
+	struct hfs_fe_size_tree		et_size;
+	u_int32_t			et_extents;	/* number of free extents in the tree */
+	int				et_active;	/* scan done, allocations may use it */
+};
+
+static int hfs_fe_offset_cmp(struct hfs_free_extent *a, struct hfs_free_extent *b);
+static int hfs_fe_size_cmp(struct hfs_free_extent *a, struct hfs_free_extent *b);
+
+RB_PROTOTYPE_SC(static, hfs_fe_offset_tree, hfs_free_extent, fe_offset_link, hfs_fe_offset_cmp);
+RB_PROTOTYPE_SC(static, hfs_fe_size_tree, hfs_free_extent, fe_size_link, hfs_fe_size_cmp);
+
+#define HFS_EXTENT_TREE_MAX_EXTENTS	(256 * 1024)
+
+/* Candidates BlockAllocateRBTree may turn down before it gives up */
+#define HFS_EXTENT_TREE_TRIES		16
+
+static int hfs_extent_tree_enabled = 1;
+SYSCTL_INT(_vfs_generic_hfs, OID_AUTO, extent_tree, CTLFLAG_RW|CTLFLAG_LOCKED, &hfs_extent_tree_enabled, 0, "Keep the free extents of HFS volumes in memory");
+
 static OSErr ReadBitmapBlock(
 		ExtendedVCB		*vcb,
 		u_int32_t		bit,
@@ -290,6 +362,15 @@ static OSErr BlockAllocateKnown(
 		u_int32_t		*actualStartBlock,
 		u_int32_t		*actualNumBlocks);
 
+static OSErr BlockAllocateRBTree(
+		ExtendedVCB		*vcb,
+		u_int32_t		startingBlock,
+		u_int32_t		minBlocks,
+		u_int32_t		maxBlocks,
+		u_int32_t		flags,
+		u_int32_t		*actualStartBlock,
+		u_int32_t		*actualNumBlocks);
+
 static OSErr BlockMarkAllocatedInternal (
 		ExtendedVCB		*vcb,
 		u_int32_t		startingBlock,
@@ -357,6 +438,18 @@ static void remove_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBloc
 static Boolean add_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
 static void sanity_check_free_ext(struct hfsmount *hfsmp, int check_allocated);
 
+/* Functions for manipulating the free extent tree */
+static void hfs_extent_tree_create(struct hfsmount *hfsmp);
+static void hfs_extent_tree_activate(struct hfsmount *hfsmp);
+static void hfs_extent_tree_add(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
+static void hfs_extent_tree_remove(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
+static struct hfs_free_extent *hfs_extent_tree_first(struct hfs_extent_tree *tree,
+		u_int32_t startBlock, int touching);
+static struct hfs_free_extent *hfs_extent_tree_next(struct hfs_extent_tree *tree, int order,
+		u_int32_t keyCount, u_int32_t keyStart);
+static u_int32_t hfs_extent_tree_clip(struct hfsmount *hfsmp, u_int32_t flags,
+		u_int32_t *startBlock, u_int32_t blockCount);
+
 #if ALLOC_DEBUG
 /*
  * Validation Routine to verify that the TRIM list maintained by the journal
@@ -417,6 +510,12 @@ int trim_validate_bitmap (struct hfsmount *hfsmp) {
  ;				being freed is passed to the journal code, and the extent will
  ;				be unmapped after the current transaction is written to disk.
  ;
+ ;				The extent also goes back into the free extent tree.  Once
+ ;				the journal has taken it, hfs_trim_callback does that after
+ ;				the transaction is on disk.  Otherwise (no journal, or the
+ ;				journal did not take it) nothing else will, so it is added
+ ;				here.
+ ;
  ; Input Arguments:
  ;	hfsmp			- The volume containing the allocation blocks.
  ;	startingBlock	- The first allocation block of the extent being freed.
@@ -458,6 +557,9 @@ static void hfs_unmap_free_extent(struct hfsmount *hfsmp, u_int32_t startingBloc
 		}
 	}
 
+	if (hfsmp->jnl == NULL || err != 0)
+		hfs_extent_tree_add(hfsmp, startingBlock, numBlocks);
+
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_UNMAP_FREE | DBG_FUNC_END, err, 0, 0, 0, 0);
 }
@@ -618,14 +720,16 @@ static void hfs_unmap_alloc_extent(struct hfsmount *hfsmp, u_int32_t startingBlo
 ; Function:		This function is called when a transaction that freed extents
 ;				(via hfs_unmap_free_extent/journal_trim_add_extent) has been
 ;				written to the on-disk journal.  This routine will add those
-;				extents to the free extent cache so that they can be reused.
+;				extents to the free extent cache and the free extent tree so
+;				that they can be reused.
 ;
 ;				CAUTION: This routine is called while the journal's trim lock
 ;				is held shared, so that no other thread can reuse any portion
 ;				of those extents.  We must be very careful about which locks
 ;				we take from within this callback, to avoid deadlock.  The
 ;				call to add_free_extent_cache will end up taking the cache's
-;				lock (just long enough to add these extents to the cache).
+;				lock (just long enough to add these extents to the cache), and
+;				hfs_extent_tree_add takes the tree's lock the same way.
 ;
 ;				CAUTION: If the journal becomes invalid (eg., due to an I/O
 ;				error when trying to write to the journal), this callback
@@ -654,6 +758,7 @@ hfs_trim_callback(void *arg, uint32_t extent_count, const dk_extent_t *extents)
 		startBlock = (extents[i].offset - hfsmp->hfsPlusIOPosOffset) / hfsmp->blockSize;
 		numBlocks = extents[i].length / hfsmp->blockSize;
 		(void) add_free_extent_cache(hfsmp, startBlock, numBlocks);
+		hfs_extent_tree_add(hfsmp, startBlock, numBlocks);
 	}
 
 	if (hfs_kdebug_allocation & HFSDBG_UNMAP_ENABLED)
@@ -750,7 +855,8 @@ CheckUnmappedBytes (struct hfsmount *hfsmp, uint64_t blockno, uint64_t numblocks
  ; Function:	Traverse the bitmap, and potentially issue DKIOCUNMAPs to the underlying
  ;				device as needed so that the underlying disk device is as
  ;				up-to-date as possible with which blocks are unmapped.
- ;				Additionally build up the summary table as needed.
+ ;				Additionally build up the summary table as needed, and
+ ;				rebuild the free extent tree from scratch.
  ;
  ;				This function reads the bitmap in large block size 
  ; 				(up to 1MB) unlink the runtime which reads the bitmap 
@@ -812,6 +918,12 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
 		trimlist.extent_count = 0;
 	}
 
+	/*
+	 * Start a new free extent tree; hfs_alloc_scan_range fills it in as it
+	 * finds free blocks.  Nothing allocates from it until the scan is done.
+	 */
+	hfs_extent_tree_create(hfsmp);
+
 	while ((blocks_scanned < hfsmp->totalBlocks) && (error == 0)){
 
 		error = hfs_alloc_scan_range (hfsmp, blocks_scanned, &blocks_scanned, &trimlist);
@@ -822,6 +934,13 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
 		}
 	}
 
+	if (error == 0) {
+		hfs_extent_tree_activate(hfsmp);
+	}
+	else {
+		hfs_extent_tree_destroy(hfsmp);
+	}
+
 	if ((hfsmp->hfs_flags & HFS_UNMAP) && 
 			((hfsmp->hfs_flags & HFS_READ_ONLY) == 0)) {
 		if (error == 0) {
@@ -905,6 +1024,7 @@ OSErr BlockAllocate (
  */
 {
 	u_int32_t  freeBlocks;
+	u_int32_t  hintBlock;		//	caller's own startingBlock, for the extent tree
 	OSErr			err;
 	Boolean			updateAllocPtr = false;		//	true if nextAllocation needs to be updated
 	struct hfsmount	*hfsmp;
@@ -978,6 +1098,12 @@ OSErr BlockAllocate (
 		}
 	}
 
+	//
+	//	The extent tree only tries to allocate in place at a block the caller
+	//	asked for; the roving pointer is just where the bitmap scan begins.
+	//
+	hintBlock = startingBlock;
+
 	//
 	//	If caller didn't specify a starting block number, then use the volume's
 	//	next block to allocate from.
@@ -1000,14 +1126,33 @@ OSErr BlockAllocate (
 	if (startingBlock >= vcb->allocLimit) {
 		startingBlock = 0; /* overflow so start at beginning */
 	}
+	if (hintBlock >= vcb->allocLimit) {
+		hintBlock = 0;
+	}
 
 	//
 	//	If the request must be contiguous, then find a sequence of free blocks
 	//	that is long enough.  Otherwise, find the first free block.
 	//
 	if (forceContiguous) {
-		err = BlockAllocateContig(vcb, startingBlock, minBlocks, maxBlocks,
-				flags, actualStartBlock, actualNumBlocks);
+		if (hfs_isrbtree_active(hfsmp)) {
+			/*
+			 * The free extent tree knows every free extent we can use
+			 * without flushing the journal.  If none of them is big
+			 * enough, only a caller that allows a flush has any reason
+			 * to search the bitmap as well.
+			 */
+			err = BlockAllocateRBTree(vcb, hintBlock, minBlocks, maxBlocks, flags,
+					actualStartBlock, actualNumBlocks);
+			if (err == dskFulErr && forceFlush) {
+				err = BlockAllocateContig(vcb, startingBlock, minBlocks, maxBlocks,
+						flags, actualStartBlock, actualNumBlocks);
+			}
+		}
+		else {
+			err = BlockAllocateContig(vcb, startingBlock, minBlocks, maxBlocks,
+					flags, actualStartBlock, actualNumBlocks);
+		}
 		/*
 		 * If we allocated from a new position then also update the roving allocator.  
 		 * This will keep the roving allocation pointer up-to-date even 
@@ -1039,6 +1184,24 @@ OSErr BlockAllocate (
 			flags &= ~HFS_ALLOC_FLUSHTXN;
 		}
 
+		if (hfs_isrbtree_active(hfsmp)) {
+			/*
+			 * Take the smallest free extent that holds maxBlocks, or
+			 * the largest one there is.  As above, the bitmap is only
+			 * worth scanning if we may flush the journal to reuse
+			 * recently freed blocks.
+			 */
+			err = BlockAllocateRBTree(vcb, hintBlock, 1, maxBlocks, flags,
+					actualStartBlock, actualNumBlocks);
+			if (err == dskFulErr && forceFlush) {
+				flags |= HFS_ALLOC_FLUSHTXN;
+				err = BlockAllocateAny(vcb, 1, vcb->allocLimit, maxBlocks,
+						flags, false, 
+						actualStartBlock, actualNumBlocks);
+			}
+			goto Exit;
+		}
+
 		/* 
 		 * BlockAllocateKnown only examines the free extent cache; anything in there will
 		 * have been committed to stable storage already.
@@ -2253,6 +2416,243 @@ static OSErr BlockAllocateKnown(
 	return err;
 }
 
+/*
+_______________________________________________________________________
+
+Routine:	BlockAllocateRBTree
+
+Function:	Allocate from the free extent tree.  If the caller names a
+			starting block and the free extent holding it has at least
+			minBlocks from there on, the space is taken in place, so a
+			growing file stays in one piece as it does with the bitmap
+			allocators.  Otherwise HFS_ALLOC_METAZONE requests take the
+			lowest free extent in the metadata zone that holds
+			minBlocks, if any.  After that the smallest free extent
+			that holds maxBlocks is used; if there is none, the largest
+			free extent of at least minBlocks.  On sparse devices the
+			lowest free extent of at least minBlocks is used instead,
+			so the backing store stays compact.
+
+			Extents, or the parts of them, that are in the metadata
+			zone (unless HFS_ALLOC_METAZONE is set) or past allocLimit
+			are passed over, and so are extents that were freed in a
+			transaction that has not reached the disk yet unless
+			HFS_ALLOC_FLUSHTXN is set.
+
+Inputs:
+	vcb				Pointer to volume where space is to be allocated
+	startingBlock	Block to allocate in place at, or 0 for no preference
+	minBlocks		Minimum number of contiguous blocks to allocate
+	maxBlocks		Maximum number of contiguous blocks to allocate
+	flags
+
+Outputs:
+	actualStartBlock	First block of range allocated, or 0 if error
+	actualNumBlocks		Number of blocks allocated, or 0 if error
+
+Returns:
+	dskFulErr		No free extent in the tree was suitable
+_______________________________________________________________________
+*/
+
+enum {
+	kTreeBestFit,		/* smallest extent of at least maxBlocks */
+	kTreeLargest,		/* largest extent, if at least minBlocks */
+	kTreeLowest,		/* lowest extent of at least minBlocks */
+	kTreeMetazone		/* lowest extent in the metadata zone */
+};
+
+/*
+ * A range from the tree can't be handed out without a journal flush if
+ * some of it was freed by a transaction that is still in flight.
+ */
+static Boolean
+hfs_extent_tree_usable(struct hfsmount *hfsmp, u_int32_t flags,
+		u_int32_t startBlock, u_int32_t blockCount)
+{
+	int recently_deleted = 0;
+	uint32_t nextStart;
+
+	if (hfsmp->jnl == NULL || (flags & HFS_ALLOC_FLUSHTXN)) {
+		return true;
+	}
+	if (CheckUnmappedBytes(hfsmp, (uint64_t)startBlock, (uint64_t)blockCount,
+				&recently_deleted, &nextStart) != 0 || recently_deleted) {
+		return false;
+	}
+	return true;
+}
+
+static OSErr BlockAllocateRBTree(
+		ExtendedVCB		*vcb,
+		u_int32_t		startingBlock,
+		u_int32_t		minBlocks,
+		u_int32_t		maxBlocks,
+		u_int32_t		flags,
+		u_int32_t		*actualStartBlock,
+		u_int32_t		*actualNumBlocks)
+{
+	OSErr			err = dskFulErr;
+	struct hfsmount *hfsmp = VCBTOHFS(vcb);
+	struct hfs_extent_tree *tree;
+	struct hfs_free_extent *fe;
+	u_int32_t		keyStart, keyCount;
+	u_int32_t		foundStart = 0, foundCount = 0;
+	u_int32_t		wanted;
+	int				orders[3];
+	int				norders = 0;
+	int				order, i;
+	int				orderTries;
+	int				tries = 0;
+
+	if (hfs_kdebug_allocation & HFSDBG_ALLOC_ENABLED)
+		KERNEL_DEBUG_CONSTANT(HFSDBG_ALLOC_RBTREE | DBG_FUNC_START, startingBlock, minBlocks, maxBlocks, flags, 0);
+
+	*actualStartBlock = 0;
+	*actualNumBlocks = 0;
+
+	/*
+	 * Extending in place is a single offset tree lookup for the free
+	 * extent that starts at or contains startingBlock.
+	 */
+	if (startingBlock != 0) {
+		u_int32_t start = 0, count = 0;
+
+		lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+		tree = hfsmp->hfs_extent_tree;
+		if (tree == NULL || tree->et_active == 0) {
+			lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+			goto Exit;
+		}
+		fe = hfs_extent_tree_first(tree, startingBlock, 0);
+		if (fe != NULL && fe->fe_start <= startingBlock) {
+			start = startingBlock;
+			count = fe->fe_start + fe->fe_count - startingBlock;
+		}
+		lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+
+		if (count != 0) {
+			u_int32_t clipped = start;
+
+			/* Only if the clip leaves it where the caller asked */
+			count = hfs_extent_tree_clip(hfsmp, flags, &clipped, count);
+			if (clipped == start && count >= minBlocks &&
+					hfs_extent_tree_usable(hfsmp, flags, start, count)) {
+				foundStart = start;
+				foundCount = MIN(count, maxBlocks);
+			}
+		}
+	}
+
+	if ((flags & HFS_ALLOC_METAZONE) && (hfsmp->hfs_flags & HFS_METADATA_ZONE)) {
+		orders[norders++] = kTreeMetazone;
+	}
+	if (hfsmp->hfs_flags & HFS_HAS_SPARSE_DEVICE) {
+		orders[norders++] = kTreeLowest;
+	} else {
+		orders[norders++] = kTreeBestFit;
+		orders[norders++] = kTreeLargest;
+	}
+
+	for (i = 0; i < norders && foundCount == 0; i++) {
+		order = orders[i];
+		orderTries = 0;
+
+		/*
+		 * Walk the candidates for this order one at a time.  The tree
+		 * lock is dropped while a candidate is checked against the
+		 * journal's trim list, so each step looks the next one up again
+		 * from a key just past the last one we saw.
+		 */
+		if (order == kTreeLargest) {
+			keyCount = keyStart = 0xFFFFFFFF;
+			wanted = minBlocks;
+		} else if (order == kTreeMetazone) {
+			keyCount = 0;
+			keyStart = hfsmp->hfs_metazone_start;
+			wanted = minBlocks;
+		} else {
+			keyCount = (order == kTreeBestFit) ? maxBlocks : 0;
+			keyStart = 0;
+			wanted = (order == kTreeBestFit) ? maxBlocks : minBlocks;
+		}
+
+		while (orderTries < HFS_EXTENT_TREE_TRIES) {
+			u_int32_t start = 0, count = 0;
+
+			lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+			tree = hfsmp->hfs_extent_tree;
+			if (tree == NULL || tree->et_active == 0) {
+				/* Thrown away since our caller looked */
+				lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+				goto Exit;
+			}
+			fe = hfs_extent_tree_next(tree, order, keyCount, keyStart);
+			if (fe != NULL) {
+				start = fe->fe_start;
+				count = fe->fe_count;
+			}
+			lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+
+			/* Extents only get smaller from here on when walking by size */
+			if (fe == NULL || (order == kTreeLargest && count < wanted)) {
+				break;
+			}
+			if (order == kTreeMetazone && start > hfsmp->hfs_metazone_end) {
+				break;
+			}
+			keyCount = count;
+			if (order == kTreeMetazone) {
+				keyStart = start + count;
+			} else {
+				keyStart = (order == kTreeLargest) ? start : start + 1;
+			}
+
+			if (order == kTreeMetazone) {
+				/* Just the part inside the zone */
+				if (start < hfsmp->hfs_metazone_start) {
+					count -= hfsmp->hfs_metazone_start - start;
+					start = hfsmp->hfs_metazone_start;
+				}
+				if (start + count > hfsmp->hfs_metazone_end + 1) {
+					count = hfsmp->hfs_metazone_end + 1 - start;
+				}
+			}
+
+			count = hfs_extent_tree_clip(hfsmp, flags, &start, count);
+			if (count < wanted || !hfs_extent_tree_usable(hfsmp, flags, start, count)) {
+				tries++;
+				orderTries++;
+				continue;
+			}
+
+			foundStart = start;
+			foundCount = MIN(count, maxBlocks);
+			break;
+		}
+	}
+
+	if (foundCount == 0) {
+		goto Exit;
+	}
+
+	if (ALLOC_DEBUG) {
+		if (hfs_isallocated(hfsmp, foundStart, foundCount)) {
+			panic("hfs: %p: (%u,%u) from the free extent tree is allocated", hfsmp, foundStart, foundCount);
+		}
+	}
+
+	*actualStartBlock = foundStart;
+	*actualNumBlocks = foundCount;
+	err = BlockMarkAllocatedInternal(vcb, foundStart, foundCount);
+
+Exit:
+	if (hfs_kdebug_allocation & HFSDBG_ALLOC_ENABLED)
+		KERNEL_DEBUG_CONSTANT(HFSDBG_ALLOC_RBTREE | DBG_FUNC_END, err, *actualStartBlock, *actualNumBlocks, tries, 0);
+
+	return err;
+}
+
 /*
  * BlockMarkAllocated
  * 
@@ -2287,8 +2687,8 @@ Function:	Mark a contiguous group of blocks as allocated (set in the
 			deallocated (clear in the bitmap).  Note that this function
 			must be called regardless of whether or not the bitmap or
 			tree-based allocator is used, as all allocations must correctly
-			be marked on-disk.  If the tree-based approach is running, then
-			this will be done before the node is removed from the tree.
+			be marked on-disk.  It also takes the blocks out of the free
+			extent tree, however they were found.
 
 Inputs:
 	vcb				Pointer to volume where space is to be allocated
@@ -2339,6 +2739,12 @@ OSErr BlockMarkAllocatedInternal (
 
 	hfs_unmap_alloc_extent(vcb, startingBlock, numBlocks);
 
+	/*
+	 * Only now that the blocks are out of the journal's trim list can
+	 * the trim callback no longer put them back in the tree behind us.
+	 */
+	hfs_extent_tree_remove(hfsmp, startingBlock, numBlocks);
+
 	//
 	//	Pre-read the bitmap block containing the first word of allocation
 	//
@@ -2816,9 +3222,8 @@ Exit:
 	if (buffer)
 		(void)ReleaseBitmapBlock(vcb, blockRef, true);
 
-	if (err == noErr) {
+	if (err == noErr)
 		hfs_unmap_free_extent(vcb, unmapStart, unmapCount);
-	}
 
 	if (hfs_kdebug_allocation & HFSDBG_BITMAP_ENABLED)
 		KERNEL_DEBUG_CONSTANT(HFSDBG_MARK_FREE_BITMAP | DBG_FUNC_END, err, 0, 0, 0, 0);
@@ -3507,19 +3912,21 @@ hfs_isallocated(struct hfsmount *hfsmp, u_int32_t startingBlock, u_int32_t numBl
 } 
 
 /*
- * CONFIG_HFS_RBTREE
- * Check to see if the red-black tree is live.  Allocation file lock must be held
- * shared or exclusive to call this function. Note that we may call this even if
- * HFS is built without activating the red-black tree code.
+ * Check to see if the free extent tree is live, i.e. the bitmap scan that
+ * builds it has finished and it has not been thrown away since.  Allocation
+ * file lock should be held shared or exclusive to call this function, or
+ * the answer may be stale by the time the caller looks at it.
  */
 __private_extern__
 int 
 hfs_isrbtree_active(struct hfsmount *hfsmp){
+	int active;
 
-#pragma unused (hfsmp)
+	lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+	active = (hfsmp->hfs_extent_tree != NULL && hfsmp->hfs_extent_tree->et_active);
+	lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
 
-	/* Just return 0 for now */
-	return 0;
+	return active;
 }
 
 
@@ -4423,6 +4830,7 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 						hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
 					}
 					add_free_extent_cache (hfsmp, free_offset, size);
+					hfs_extent_tree_add (hfsmp, free_offset, size);
 					size = 0;
 					free_offset = 0;
 				}
@@ -4491,6 +4899,7 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
 			hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
 		}
 		add_free_extent_cache (hfsmp, free_offset, size);
+		hfs_extent_tree_add (hfsmp, free_offset, size);
 	}
 
 	/* 
@@ -4727,9 +5136,7 @@ void ResetVCBFreeExtCache(struct hfsmount *hfsmp)
  * The bitmap lock must be held when calling this function.  This function also modifies the
  * allocLimit field in the hfs mount point structure in the general case. 
  * 
- * In the shrinking case, we'll have to remove all free extents from the red-black
- * tree past the specified offset new_end_block.  In the growth case, we'll have to force
- * a re-scan of the new allocation blocks from our current allocLimit to the new end block.
+ * The free extent tree is thrown away in either case.
  * 
  * new_end_block represents the total number of blocks available for allocation in the resized
  * filesystem.  Block #new_end_block should not be allocatable in the resized filesystem since it
@@ -4752,6 +5159,13 @@ u_int32_t UpdateAllocLimit (struct hfsmount *hfsmp, u_int32_t new_end_block) {
 	 */
 	ResetVCBFreeExtCache(hfsmp);
 
+	/*
+	 * Resizes are rare, so rather than follow allocLimit around, drop
+	 * the free extent tree and let the bitmap serve allocations until
+	 * the next full scan of the bitmap builds it again.
+	 */
+	hfs_extent_tree_destroy(hfsmp);
+
 	/* Force a rebuild of the summary table. */
 	(void) hfs_rebuild_summary (hfsmp);
 
@@ -5153,3 +5567,406 @@ static void sanity_check_free_ext(struct hfsmount *hfsmp, int check_allocated)
 	lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 }
 
+
+/*
+ * Free extent tree routines.  See the comment at the top of this file for
+ * how the tree is kept in step with the bitmap.  The helpers that take a
+ * struct hfs_extent_tree expect hfs_extent_tree_lock to be held.
+ */
+static int
+hfs_fe_offset_cmp(struct hfs_free_extent *a, struct hfs_free_extent *b)
+{
+	if (a->fe_start < b->fe_start)
+		return -1;
+	if (a->fe_start > b->fe_start)
+		return 1;
+	return 0;
+}
+
+static int
+hfs_fe_size_cmp(struct hfs_free_extent *a, struct hfs_free_extent *b)
+{
+	if (a->fe_count < b->fe_count)
+		return -1;
+	if (a->fe_count > b->fe_count)
+		return 1;
+	return hfs_fe_offset_cmp(a, b);
+}
+
+RB_GENERATE(hfs_fe_offset_tree, hfs_free_extent, fe_offset_link, hfs_fe_offset_cmp);
+RB_GENERATE(hfs_fe_size_tree, hfs_free_extent, fe_size_link, hfs_fe_size_cmp);
+
+static void
+hfs_extent_tree_insert_node(struct hfs_extent_tree *tree, struct hfs_free_extent *fe)
+{
+	RB_INSERT(hfs_fe_offset_tree, &tree->et_offset, fe);
+	RB_INSERT(hfs_fe_size_tree, &tree->et_size, fe);
+	tree->et_extents++;
+}
+
+static void
+hfs_extent_tree_remove_node(struct hfs_extent_tree *tree, struct hfs_free_extent *fe)
+{
+	RB_REMOVE(hfs_fe_offset_tree, &tree->et_offset, fe);
+	RB_REMOVE(hfs_fe_size_tree, &tree->et_size, fe);
+	tree->et_extents--;
+}
+
+/*
+ * Find the first extent that ends at or after startBlock (or strictly
+ * after it, if !touching), which is where a walk over everything that
+ * overlaps a range starting at startBlock has to begin.
+ */
+static struct hfs_free_extent *
+hfs_extent_tree_first(struct hfs_extent_tree *tree, u_int32_t startBlock, int touching)
+{
+	struct hfs_free_extent *fe = RB_ROOT(&tree->et_offset);
+	struct hfs_free_extent *floor = NULL;
+	u_int32_t end;
+
+	/* Last extent that starts at or before startBlock */
+	while (fe != NULL) {
+		if (fe->fe_start <= startBlock) {
+			floor = fe;
+			fe = RB_RIGHT(fe, fe_offset_link);
+		} else {
+			fe = RB_LEFT(fe, fe_offset_link);
+		}
+	}
+	if (floor == NULL) {
+		return RB_MIN(hfs_fe_offset_tree, &tree->et_offset);
+	}
+
+	end = floor->fe_start + floor->fe_count;
+	if (end > startBlock || (touching && end == startBlock)) {
+		return floor;
+	}
+	return RB_NEXT(hfs_fe_offset_tree, &tree->et_offset, floor);
+}
+
+/*
+ * Look up the next candidate for BlockAllocateRBTree.  For kTreeBestFit
+ * that is the first extent at or after (keyCount, keyStart) in size order,
+ * for kTreeLargest the last one before it, for kTreeLowest the first
+ * extent starting at or after keyStart, and for kTreeMetazone the first
+ * one ending after keyStart.
+ */
+static struct hfs_free_extent *
+hfs_extent_tree_next(struct hfs_extent_tree *tree, int order, u_int32_t keyCount, u_int32_t keyStart)
+{
+	struct hfs_free_extent *fe;
+	struct hfs_free_extent *found = NULL;
+
+	if (order == kTreeMetazone) {
+		return hfs_extent_tree_first(tree, keyStart, 0);
+	}
+	if (order == kTreeLowest) {
+		fe = RB_ROOT(&tree->et_offset);
+		while (fe != NULL) {
+			if (fe->fe_start >= keyStart) {
+				found = fe;
+				fe = RB_LEFT(fe, fe_offset_link);
+			} else {
+				fe = RB_RIGHT(fe, fe_offset_link);
+			}
+		}
+		return found;
+	}
+
+	fe = RB_ROOT(&tree->et_size);
+	while (fe != NULL) {
+		int before = (fe->fe_count < keyCount) ||
+			((fe->fe_count == keyCount) && (fe->fe_start < keyStart));
+
+		if (order == kTreeLargest) {
+			if (before) {
+				found = fe;
+				fe = RB_RIGHT(fe, fe_size_link);
+			} else {
+				fe = RB_LEFT(fe, fe_size_link);
+			}
+		} else {
+			if (before) {
+				fe = RB_RIGHT(fe, fe_size_link);
+			} else {
+				found = fe;
+				fe = RB_LEFT(fe, fe_size_link);
+			}
+		}
+	}
+	return found;
+}
+
+/*
+ * Trim a free extent down to the part this allocation may use: nothing
+ * at or past allocLimit, and nothing in the metadata zone unless the
+ * caller asked for it.  If the extent straddles the zone, the bigger of
+ * the pieces on either side is kept.  Returns the usable block count and
+ * moves *startBlock to the start of the usable part.
+ */
+static u_int32_t
+hfs_extent_tree_clip(struct hfsmount *hfsmp, u_int32_t flags, u_int32_t *startBlock, u_int32_t blockCount)
+{
+	u_int32_t start = *startBlock;
+	u_int32_t end = start + blockCount;
+	u_int32_t before, after;
+
+	if (end > hfsmp->allocLimit) {
+		end = hfsmp->allocLimit;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	if ((flags & HFS_ALLOC_METAZONE) == 0 &&
+			(hfsmp->hfs_flags & HFS_METADATA_ZONE) &&
+			(start <= hfsmp->hfs_metazone_end) &&
+			(end > hfsmp->hfs_metazone_start)) {
+		before = (start < hfsmp->hfs_metazone_start) ? hfsmp->hfs_metazone_start - start : 0;
+		after = (end > hfsmp->hfs_metazone_end + 1) ? end - (hfsmp->hfs_metazone_end + 1) : 0;
+		if (after >= before) {
+			*startBlock = hfsmp->hfs_metazone_end + 1;
+			return after;
+		}
+		return before;
+	}
+
+	return end - start;
+}
+
+/*
+ * Free every node of a tree that is no longer reachable from the mount.
+ */
+static void
+hfs_extent_tree_free(struct hfs_extent_tree *tree)
+{
+	struct hfs_free_extent *fe;
+
+	while ((fe = RB_MIN(hfs_fe_offset_tree, &tree->et_offset)) != NULL) {
+		RB_REMOVE(hfs_fe_offset_tree, &tree->et_offset, fe);
+		kfree(fe, sizeof(struct hfs_free_extent));
+	}
+	kfree(tree, sizeof(struct hfs_extent_tree));
+}
+
+/*
+ * Give up on a tree we could not keep up to date.  Called with the tree
+ * lock held; the caller frees the tree once it has dropped the lock.
+ */
+static struct hfs_extent_tree *
+hfs_extent_tree_jettison(struct hfsmount *hfsmp)
+{
+	struct hfs_extent_tree *tree = hfsmp->hfs_extent_tree;
+
+	hfsmp->hfs_extent_tree = NULL;
+	printf("hfs: dropping the free extent tree of %s (%u extents), allocations will scan the bitmap\n",
+			hfsmp->vcbVN, tree->et_extents);
+	return tree;
+}
+
+/*
+ * Start a new, empty free extent tree for the bitmap scan to fill in,
+ * replacing any existing one.  If the tree is turned off, or this is a
+ * read-only mount, there will be no tree at all.
+ */
+static void
+hfs_extent_tree_create(struct hfsmount *hfsmp)
+{
+	struct hfs_extent_tree *tree = NULL;
+	struct hfs_extent_tree *old;
+
+	if (hfs_extent_tree_enabled && (hfsmp->hfs_flags & HFS_READ_ONLY) == 0) {
+		tree = (struct hfs_extent_tree *)kalloc(sizeof(struct hfs_extent_tree));
+		if (tree != NULL) {
+			RB_INIT(&tree->et_offset);
+			RB_INIT(&tree->et_size);
+			tree->et_extents = 0;
+			tree->et_active = 0;
+		}
+	}
+
+	lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+	old = hfsmp->hfs_extent_tree;
+	hfsmp->hfs_extent_tree = tree;
+	lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+
+	if (old != NULL) {
+		hfs_extent_tree_free(old);
+	}
+}
+
+/*
+ * The bitmap scan has finished, so the tree now holds all of the free
+ * space and allocations may start using it.
+ */
+static void
+hfs_extent_tree_activate(struct hfsmount *hfsmp)
+{
+	lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+	if (hfsmp->hfs_extent_tree != NULL) {
+		hfsmp->hfs_extent_tree->et_active = 1;
+	}
+	lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+}
+
+/*
+ * Throw away the free extent tree, if there is one.  Used when allocLimit
+ * moves, when a scan fails, and on unmount or downgrade to read-only.
+ */
+__private_extern__
+void
+hfs_extent_tree_destroy(struct hfsmount *hfsmp)
+{
+	struct hfs_extent_tree *tree;
+
+	lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+	tree = hfsmp->hfs_extent_tree;
+	hfsmp->hfs_extent_tree = NULL;
+	lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+
+	if (tree != NULL) {
+		hfs_extent_tree_free(tree);
+	}
+}
+
+/*
+ * Add a range of free blocks to the tree.  Any free extents it overlaps
+ * or touches are merged into it, so the range may well include blocks
+ * the tree already knows about (the trim list extends freed ranges to
+ * their free neighbours, and the bitmap scan hands us adjacent pieces of
+ * one run at I/O boundaries).
+ */
+static void
+hfs_extent_tree_add(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount)
+{
+	struct hfs_extent_tree *tree;
+	struct hfs_extent_tree *dead = NULL;
+	struct hfs_free_extent *fe, *next, *spare;
+	u_int32_t endBlock;
+
+	/* As with the free extent cache, nothing at or past allocLimit */
+	if (blockCount == 0 || startBlock >= hfsmp->allocLimit) {
+		return;
+	}
+	if (blockCount > hfsmp->allocLimit - startBlock) {
+		blockCount = hfsmp->allocLimit - startBlock;
+	}
+	endBlock = startBlock + blockCount;
+
+	/* Allocate the node we may need before taking the lock */
+	spare = (struct hfs_free_extent *)kalloc(sizeof(struct hfs_free_extent));
+
+	lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+	tree = hfsmp->hfs_extent_tree;
+	if (tree == NULL) {
+		goto out;
+	}
+
+	fe = hfs_extent_tree_first(tree, startBlock, 1);
+	while (fe != NULL && fe->fe_start <= endBlock) {
+		next = RB_NEXT(hfs_fe_offset_tree, &tree->et_offset, fe);
+		if (fe->fe_start < startBlock) {
+			startBlock = fe->fe_start;
+		}
+		if (fe->fe_start + fe->fe_count > endBlock) {
+			endBlock = fe->fe_start + fe->fe_count;
+		}
+		hfs_extent_tree_remove_node(tree, fe);
+		if (spare == NULL) {
+			spare = fe;
+		} else {
+			kfree(fe, sizeof(struct hfs_free_extent));
+		}
+		fe = next;
+	}
+
+	if (spare == NULL || tree->et_extents >= HFS_EXTENT_TREE_MAX_EXTENTS) {
+		dead = hfs_extent_tree_jettison(hfsmp);
+		goto out;
+	}
+	spare->fe_start = startBlock;
+	spare->fe_count = endBlock - startBlock;
+	hfs_extent_tree_insert_node(tree, spare);
+	spare = NULL;
+
+out:
+	lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+
+	if (spare != NULL) {
+		kfree(spare, sizeof(struct hfs_free_extent));
+	}
+	if (dead != NULL) {
+		hfs_extent_tree_free(dead);
+	}
+}
+
+/*
+ * Remove a range of blocks that is being allocated from the tree.  The
+ * range need not be in the tree at all, or only partly: the bitmap
+ * allocator may have found blocks still waiting for their transaction to
+ * commit, and callers like hfs_truncatefs mark blocks allocated directly.
+ */
+static void
+hfs_extent_tree_remove(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount)
+{
+	struct hfs_extent_tree *tree;
+	struct hfs_extent_tree *dead = NULL;
+	struct hfs_free_extent *fe, *next, *spare;
+	u_int32_t endBlock = startBlock + blockCount;
+	u_int32_t feEnd;
+
+	if (blockCount == 0) {
+		return;
+	}
+
+	/* Cutting the middle out of a free extent leaves two of them */
+	spare = (struct hfs_free_extent *)kalloc(sizeof(struct hfs_free_extent));
+
+	lck_mtx_lock(&hfsmp->hfs_extent_tree_lock);
+	tree = hfsmp->hfs_extent_tree;
+	if (tree == NULL) {
+		goto out;
+	}
+
+	fe = hfs_extent_tree_first(tree, startBlock, 0);
+	while (fe != NULL && fe->fe_start < endBlock) {
+		next = RB_NEXT(hfs_fe_offset_tree, &tree->et_offset, fe);
+		feEnd = fe->fe_start + fe->fe_count;
+		hfs_extent_tree_remove_node(tree, fe);
+
+		if (fe->fe_start < startBlock && feEnd > endBlock) {
+			if (spare == NULL) {
+				kfree(fe, sizeof(struct hfs_free_extent));
+				dead = hfs_extent_tree_jettison(hfsmp);
+				goto out;
+			}
+			spare->fe_start = endBlock;
+			spare->fe_count = feEnd - endBlock;
+			hfs_extent_tree_insert_node(tree, spare);
+			spare = NULL;
+
+			fe->fe_count = startBlock - fe->fe_start;
+			hfs_extent_tree_insert_node(tree, fe);
+		} else if (fe->fe_start < startBlock) {
+			fe->fe_count = startBlock - fe->fe_start;
+			hfs_extent_tree_insert_node(tree, fe);
+		} else if (feEnd > endBlock) {
+			fe->fe_start = endBlock;
+			fe->fe_count = feEnd - endBlock;
+			hfs_extent_tree_insert_node(tree, fe);
+		} else {
+			kfree(fe, sizeof(struct hfs_free_extent));
+		}
+		fe = next;
+	}
+
+out:
+	lck_mtx_unlock(&hfsmp->hfs_extent_tree_lock);
+
+	if (spare != NULL) {
+		kfree(spare, sizeof(struct hfs_free_extent));
+	}
+	if (dead != NULL) {
+		hfs_extent_tree_free(dead);
+	}
+}
@@ -255,6 +255,9 @@ ScanUnmapBlocks(struct hfsmount *hfsmp);
 EXTERN_API_C( int )
 hfs_init_summary (struct hfsmount *hfsmp);
 
+EXTERN_API_C( void )
+hfs_extent_tree_destroy (struct hfsmount *hfsmp);
+
 /*	File Extent Mapping routines*/
 EXTERN_API_C( OSErr )
 FlushExtentFile					(ExtendedVCB *			vcb);
@@ -2821,6 +2821,7 @@ knote_init(void)
 {
 	knote_zone = zinit(sizeof(struct knote), 8192*sizeof(struct knote),
 	    8192, "knote zone");
+	zone_change(knote_zone, Z_CACHING_ENABLED, TRUE);
 
 	/* allocate kq lock group attribute and group */
 	kq_lck_grp_attr = lck_grp_attr_alloc_init();
@@ -1743,6 +1743,10 @@ SYSCTL_INT(_kern, OID_AUTO, namecache_disabled,
 		CTLFLAG_RW | CTLFLAG_LOCKED, 
 		&nc_disabled, 0, ""); 
 
+SYSCTL_INT(_kern, OID_AUTO, namecache_lockless, 
+		CTLFLAG_RW | CTLFLAG_LOCKED, 
+		&nc_lockless, 0, "Search the name cache without its lock"); 
+
 SYSCTL_PROC(_kern, KERN_MAXVNODES, maxvnodes,
 		CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
 		0, 0, sysctl_maxvnodes, "I", "");
@@ -2686,6 +2690,68 @@ SYSCTL_INT(_vm, OID_AUTO, compressor_majorcompact_threshold_divisor, CTLFLAG_RW
 SYSCTL_INT(_vm, OID_AUTO, compressor_unthrottle_threshold_divisor, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_unthrottle_threshold_divisor, 0, "");
 SYSCTL_INT(_vm, OID_AUTO, compressor_catchup_threshold_divisor, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_catchup_threshold_divisor, 0, "");
 
+/*
+ * Number of active compressor worker threads
+ */
+STATIC int
+sysctl_compressor_thread_count
+(__unused struct sysctl_oid *oidp, __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	int new_value, changed;
+	int error = sysctl_io_number(req, vm_compressor_thread_count, sizeof(int), &new_value, &changed);
+	if (error == 0 && changed) {
+		switch (vm_pageout_compressor_thread_count_set(new_value)) {
+		case KERN_SUCCESS:
+			break;
+		case KERN_NOT_SUPPORTED:
+			error = ENOTSUP;
+			break;
+		case KERN_INVALID_ARGUMENT:
+			error = EINVAL;
+			break;
+		default:
+			error = ENOMEM;
+			break;
+		}
+	}
+	return(error);
+}
+
+SYSCTL_PROC(_vm, OID_AUTO, compressor_thread_count,
+		CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+		0, 0, sysctl_compressor_thread_count, "I", "");
+SYSCTL_INT(_vm, OID_AUTO, compressor_thread_max, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_compressor_thread_max, 0, "");
+
+/*
+ * Per worker compression throughput, an array of
+ * struct vm_compressor_thread_stats
+ */
+STATIC int
+sysctl_compressor_thread_stats
+(__unused struct sysctl_oid *oidp, __unused void *arg1, __unused int arg2, struct sysctl_req *req)
+{
+	struct vm_compressor_thread_stats stats[MAX_COMRPESSOR_THREAD_COUNT];
+	int n;
+
+	n = vm_pageout_compressor_thread_stats(stats, MAX_COMRPESSOR_THREAD_COUNT);
+
+	return sysctl_io_opaque(req, stats, n * sizeof(stats[0]), NULL);
+}
+
+SYSCTL_PROC(_vm, OID_AUTO, compressor_thread_stats,
+		CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+		0, 0, sysctl_compressor_thread_stats, "S,vm_compressor_thread_stats", "");
+
+SYSCTL_INT(_vm, OID_AUTO, compressor_codec, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_codec, 0, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_wkdm_pages, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_WKDM].pages, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_wkdm_failed, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_WKDM].failed, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_wkdm_input_bytes, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_WKDM].input_bytes, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_wkdm_compressed_bytes, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_WKDM].compressed_bytes, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_lz_pages, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_LZ].pages, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_lz_failed, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_LZ].failed, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_lz_input_bytes, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_LZ].input_bytes, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_lz_compressed_bytes, CTLFLAG_RD | CTLFLAG_LOCKED, &c_codec_stats[C_CODEC_LZ].compressed_bytes, "");
+
 SYSCTL_STRING(_vm, OID_AUTO, swapfileprefix, CTLFLAG_RW | CTLFLAG_KERN | CTLFLAG_LOCKED, swapfilename, sizeof(swapfilename) - SWAPFILENAME_INDEX_LEN, "");
 
 #if CONFIG_PHANTOM_CACHE
@@ -1369,3 +1369,15 @@ mbuf_get_driver_scratch(mbuf_t m, u_int8_t **area, size_t *area_len)
 	*area_len = m_scratch_get(m, area);
 	return (0);
 }
+
+errno_t
+mbuf_pkthdr_set_flowhash(mbuf_t m, u_int32_t flowhash)
+{
+	if (m == NULL || !(m->m_flags & M_PKTHDR) || flowhash == 0)
+		return (EINVAL);
+
+	m->m_pkthdr.pkt_flowsrc = FLOWSRC_IFNET;
+	m->m_pkthdr.pkt_flowid = flowhash;
+	m->m_pkthdr.pkt_flags |= PKTF_FLOW_ID;
+	return (0);
+}
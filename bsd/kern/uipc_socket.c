@@ -1717,6 +1717,73 @@ defunct:
 	return (0);
 }
 
+/*
+ * uiomove() for sosend() that also returns the 16-bit 1's complement
+ * sum of the data copied, which starts at byte offset off of the
+ * datagram.  Each span is copied and summed in a single pass, with
+ * copyin_cksum() for data in user space and b_sum16_copy() for data
+ * in kernel buffers; physical spans are moved by uiomove() and then
+ * summed.
+ */
+static int
+sosend_uiomove_cksum(caddr_t cp, int n, struct uio *uio, int off,
+    uint32_t *sump)
+{
+	user_size_t acnt;
+	uint32_t sum = 0, psum = 0;
+	int error = 0, done = 0;
+
+	while (done < n && uio_resid(uio) > 0) {
+		uio_update(uio, 0);
+		acnt = uio_curriovlen(uio);
+		if (acnt == 0)
+			continue;
+		if (acnt > (user_size_t)(n - done))
+			acnt = n - done;
+
+		switch ((int)uio->uio_segflg) {
+		case UIO_USERSPACE64:
+		case UIO_USERISPACE64:
+		case UIO_USERSPACE32:
+		case UIO_USERISPACE32:
+		case UIO_USERSPACE:
+		case UIO_USERISPACE:
+			error = copyin_cksum(uio->uio_iovs.uiovp->iov_base,
+			    cp + done, acnt, &psum);
+			if (error == 0)
+				uio_update(uio, acnt);
+			break;
+
+		case UIO_SYSSPACE32:
+		case UIO_SYSSPACE:
+			psum = b_sum16_copy(CAST_DOWN(caddr_t,
+			    uio->uio_iovs.kiovp->iov_base), cp + done, acnt);
+			uio_update(uio, acnt);
+			break;
+
+		default:
+			error = uiomove(cp + done, acnt, uio);
+			if (error == 0)
+				psum = b_sum16(cp + done, acnt);
+			break;
+		}
+		if (error != 0)
+			break;
+
+		/* a span at an odd offset sums byte-swapped */
+		if (done & 1)
+			psum = ((psum & 0xff) << 8) | (psum >> 8);
+		sum += psum;
+		done += acnt;
+	}
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	if (off & 1)
+		sum = ((sum & 0xff) << 8) | (sum >> 8);
+	*sump = sum;
+	return (error);
+}
+
 /*
  * Send on a socket.
  * If send must go all at once and message is larger than
@@ -1789,6 +1856,8 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 	int sblocked = 0;
 	struct proc *p = current_proc();
 	struct mbuf *control_copy = NULL;
+	int presum = 0, poff = 0;
+	uint32_t psum = 0, msum;
 
 	if (uio != NULL)
 		resid = uio_resid(uio);
@@ -1875,6 +1944,23 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 
 				bytes_to_copy = imin(resid, space);
 
+				/*
+				 * Sum the payload of a datagram as it is
+				 * copied in if the protocol has to checksum
+				 * it in software anyway; see SOF1_PRECKSUM.
+				 * Only atomic (datagram) sends qualify: a
+				 * stream protocol cuts its segments from the
+				 * send buffer at offsets of its own choosing,
+				 * so a sum of what one sosend() copied in
+				 * does not cover any segment it sends.
+				 */
+				presum = atomic && top == NULL &&
+				    (so->so_flags1 & SOF1_PRECKSUM) &&
+				    so->so_filt == NULL &&
+				    !(flags & (MSG_OOB|MSG_HOLD|MSG_SEND));
+				psum = 0;
+				poff = 0;
+
 				if (sosendminchain > 0)
 					chainlength = 0;
 				else
@@ -2026,8 +2112,16 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 
 					space -= len;
 
-					error = uiomove(mtod(m, caddr_t),
-					    len, uio);
+					if (presum) {
+						error = sosend_uiomove_cksum(
+						    mtod(m, caddr_t), len, uio,
+						    poff, &msum);
+						psum += msum;
+						poff += len;
+					} else {
+						error = uiomove(mtod(m, caddr_t),
+						    len, uio);
+					}
 
 					resid = uio_resid(uio);
 
@@ -2125,6 +2219,13 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 				}
 #endif /* CONTENT_FILTER */
 			}
+			if (presum && top != NULL && so->so_filt == NULL) {
+				/* hand the payload sum to the protocol */
+				psum = (psum >> 16) + (psum & 0xffff);
+				psum = (psum >> 16) + (psum & 0xffff);
+				top->m_pkthdr.csum_data = psum;
+				top->m_pkthdr.pkt_flags |= PKTF_PAYLOAD_CSUM;
+			}
 			if (so->so_flags & SOF_ENABLE_MSGS) {
 				/*
 				 * Make a copy of control mbuf,
@@ -5879,6 +5980,20 @@ soif2kcl(struct socket *so, boolean_t set)
 		so->so_flags1 &= ~SOF1_IF_2KCL;
 }
 
+/*
+ * Set or clear SOF1_PRECKSUM, which has sosend() sum the payload of
+ * each datagram as it copies it in, for protocols that will have to
+ * checksum it in software.  Caller must hold the socket lock.
+ */
+void
+soprecksum(struct socket *so, boolean_t set)
+{
+	if (set)
+		so->so_flags1 |= SOF1_PRECKSUM;
+	else
+		so->so_flags1 &= ~SOF1_PRECKSUM;
+}
+
 int
 so_isdstlocal(struct socket *so) {
 
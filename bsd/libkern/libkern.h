@@ -174,6 +174,9 @@ int	copystr(const void *kfaddr, void *kdaddr, size_t len, size_t *done);
 int	copyinstr(const user_addr_t uaddr, void *kaddr, size_t len, size_t *done);
 int	copyoutstr(const void *kaddr, user_addr_t udaddr, size_t len, size_t *done);
 int	copyin(const user_addr_t uaddr, void *kaddr, size_t len);
+#ifdef BSD_KERNEL_PRIVATE
+int	copyin_cksum(const user_addr_t uaddr, void *kaddr, size_t len, uint32_t *sum);
+#endif /* BSD_KERNEL_PRIVATE */
 int	copyout(const void *kaddr, user_addr_t udaddr, size_t len);
 
 int vsscanf(const char *, char const *, va_list);
@@ -106,6 +106,7 @@
 #include <net/if.h>
 #include <net/bpf.h>
 #include <net/bpfdesc.h>
+#include <net/bpf_jit.h>
 
 #include <netinet/in.h>
 #include <netinet/in_pcb.h>
@@ -126,6 +127,13 @@
 
 #include <kern/locks.h>
 #include <kern/thread_call.h>
+#include <libkern/OSAtomic.h>
+
+#include <mach/vm_map.h>
+#include <mach/mach_vm.h>
+#include <vm/vm_kern.h>
+#include <vm/vm_map.h>
+#include <vm/vm_protos.h>
 
 #if CONFIG_MACF_NET
 #include <security/mac_framework.h>
@@ -148,6 +156,15 @@ SYSCTL_INT(_debug, OID_AUTO, bpf_bufsize, CTLFLAG_RW | CTLFLAG_LOCKED,
 __private_extern__ unsigned int bpf_maxbufsize = BPF_MAXBUFSIZE;
 SYSCTL_INT(_debug, OID_AUTO, bpf_maxbufsize, CTLFLAG_RW | CTLFLAG_LOCKED,
 	&bpf_maxbufsize, 0, "");
+SYSCTL_INT(_debug, OID_AUTO, bpf_jit, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&bpf_jit_enable, 0, "Compile filters set while enabled to native code");
+/*
+ * Bounds on the data area of a shared ring (BIOCSETRING).
+ */
+#define	BPF_RING_MINSIZE	(64 * 1024)
+static unsigned int bpf_maxringsize = 16 * 1024 * 1024;
+SYSCTL_UINT(_debug, OID_AUTO, bpf_maxringsize, CTLFLAG_RW | CTLFLAG_LOCKED,
+	&bpf_maxringsize, 0, "");
 static unsigned int bpf_maxdevices = 256;
 SYSCTL_UINT(_debug, OID_AUTO, bpf_maxdevices, CTLFLAG_RW | CTLFLAG_LOCKED,
 	&bpf_maxdevices, 0, "");
@@ -206,6 +223,10 @@ static int	bpf_setf(struct bpf_d *, u_int , user_addr_t , dev_t, u_long);
 static int	bpf_getdltlist(struct bpf_d *, caddr_t, struct proc *);
 static int	bpf_setdlt(struct bpf_d *, u_int, dev_t);
 static int	bpf_set_traffic_class(struct bpf_d *, int);
+static int	bpf_ring_alloc(struct bpf_ring_req *, struct bpf_ring **,
+		    vm_size_t *, void **);
+static void	bpf_ring_release(struct bpf_ring *, vm_size_t, void *);
+static u_int64_t bpf_ring_used(struct bpf_d *);
 static void	bpf_set_packet_service_class(struct mbuf *, int);
 
 /*static  void *bpf_devfs_token[MAXBPFILTER];*/
@@ -867,6 +888,14 @@ bpfread(dev_t dev, struct uio *uio, int ioflag)
 		return (ENXIO);
 	}
 
+	/*
+	 * Packets go to the shared ring instead of the buffers.
+	 */
+	if (d->bd_ring != NULL) {
+		lck_mtx_unlock(bpf_mlock);
+		return (EINVAL);
+	}
+
 	/*
 	 * Restrict application to use a buffer the same size as
 	 * as kernel buffers.
@@ -1143,7 +1172,8 @@ bpf_timed_out(void *arg, __unused void *dummy)
 		 * now stuff to read, wake it up.
 		 */
 		d->bd_state = BPF_TIMED_OUT;
-		if (d->bd_slen != 0)
+		if (d->bd_slen != 0 ||
+		    (d->bd_ring != NULL && bpf_ring_used(d) != 0))
 			bpf_wakeup(d);
 	} else if (d->bd_state == BPF_DRAINING) {
 		/*
@@ -1282,6 +1312,8 @@ reset_d(struct bpf_d *d)
 	d->bd_hlen = 0;
 	d->bd_rcount = 0;
 	d->bd_dcount = 0;
+	if (d->bd_ring != NULL)
+		d->bd_ring->br_tail = d->bd_ring_head;
 }
 
 /*
@@ -1306,6 +1338,7 @@ reset_d(struct bpf_d *d)
  *  BIOCSETTC		Set traffic class.
  *  BIOCGETTC		Get traffic class.
  *  BIOCSEXTHDR		Set "extended header" flag
+ *  BIOCSETRING		Map a shared capture ring
  */
 /* ARGSUSED */
 int
@@ -1345,6 +1378,8 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
 			n = d->bd_slen;
 			if (d->bd_hbuf && d->bd_hbuf_read == 0)
 				n += d->bd_hlen;
+			if (d->bd_ring != NULL)
+				n = (int)bpf_ring_used(d);
 
 			bcopy(&n, addr, sizeof (n));
 			break;
@@ -1733,6 +1768,51 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, __unused int flags,
                 else
                         d->bd_flags &= ~BPF_WANT_PKTAP;
 		break;
+
+	case BIOCSETRING: {			/* struct bpf_ring_req */
+		struct bpf_ring_req brr;
+		struct bpf_ring *br;
+		vm_size_t mapsize;
+		void *entry;
+
+		if (d->bd_ring != NULL) {
+			error = EBUSY;
+			break;
+		}
+		bcopy(addr, &brr, sizeof (brr));
+
+		/*
+		 * Creating and wiring the ring can take a while; don't
+		 * hold up the packet path meanwhile.
+		 */
+		lck_mtx_unlock(bpf_mlock);
+		error = bpf_ring_alloc(&brr, &br, &mapsize, &entry);
+		lck_mtx_lock(bpf_mlock);
+		if (error != 0)
+			break;
+
+		d = bpf_dtab[minor(dev)];
+		if (d == 0 || d == (void *)1 || d->bd_ring != NULL) {
+			bpf_ring_release(br, mapsize, entry);
+			(void) mach_vm_deallocate(current_map(), brr.brr_addr,
+			    mapsize);
+			error = (d == 0 || d == (void *)1) ? ENXIO : EBUSY;
+			lck_mtx_unlock(bpf_mlock);
+			return (error);
+		}
+		/*
+		 * The ring header is writable by the process, so the
+		 * geometry comes from what bpf_ring_alloc() returned.
+		 */
+		d->bd_ring_head = 0;
+		d->bd_ring_size = brr.brr_size;
+		d->bd_ring_off = PAGE_SIZE;
+		d->bd_ring_mapsize = mapsize;
+		d->bd_ring_entry = entry;
+		d->bd_ring = br;
+		bcopy(&brr, addr, sizeof (brr));
+		break;
+	}
 #endif
 	}
 
@@ -1749,6 +1829,7 @@ static int
 bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns, dev_t dev, u_long cmd)
 {
 	struct bpf_insn *fcode, *old;
+	struct bpf_jit *oldjit;
 	u_int flen, size;
 
 	while (d->bd_hbuf_read) 
@@ -1759,13 +1840,16 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns, dev_t dev, u_long
 		return (ENXIO);
 	
 	old = d->bd_filter;
+	oldjit = d->bd_jit;
 	if (bf_insns == USER_ADDR_NULL) {
 		if (bf_len != 0)
 			return (EINVAL);
 		d->bd_filter = NULL;
+		d->bd_jit = NULL;
 		reset_d(d);
 		if (old != 0)
 			FREE((caddr_t)old, M_DEVBUF);
+		bpf_jit_free(oldjit);
 		return (0);
 	}
 	flen = bf_len;
@@ -1781,12 +1865,14 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns, dev_t dev, u_long
 	if (copyin(bf_insns, (caddr_t)fcode, size) == 0 &&
 	    bpf_validate(fcode, (int)flen)) {
 		d->bd_filter = fcode;
+		d->bd_jit = bpf_jit_enable ? bpf_jit_compile(fcode, flen) : NULL;
 	
 		if (cmd == BIOCSETF32 || cmd == BIOCSETF64)
 			reset_d(d);
 	
 		if (old != 0)
 			FREE((caddr_t)old, M_DEVBUF);
+		bpf_jit_free(oldjit);
 
 		return (0);
 	}
@@ -2016,11 +2102,20 @@ bpfselect(dev_t dev, int which, void * wql, struct proc *p)
 
 	switch (which) {
 		case FREAD:
-			if (d->bd_hlen != 0 ||
+			if (d->bd_ring != NULL) {
+				u_int64_t used = bpf_ring_used(d);
+
+				if (used >= d->bd_ring_size / 2 ||
+				    ((d->bd_immediate ||
+				    d->bd_state == BPF_TIMED_OUT) && used != 0))
+					ret = 1;
+				else if (d->bd_state == BPF_TIMED_OUT)
+					d->bd_state = BPF_IDLE;
+			} else if (d->bd_hlen != 0 ||
 					((d->bd_immediate || d->bd_state == BPF_TIMED_OUT) &&
 					 d->bd_slen != 0))
 				ret = 1; /* read has data to return */
-			else {
+			if (ret == 0) {
 				/*
 				 * Read has no data to return.
 				 * Make the select wait, and start a timer if
@@ -2110,7 +2205,31 @@ filt_bpfread(struct knote *kn, long hint)
 	if (hint == 0)
 		lck_mtx_lock(bpf_mlock);
 	
-	if (d->bd_immediate) {
+	if (d->bd_ring != NULL) {
+		/*
+		 * The records in the shared ring are all there is;
+		 * without immediate mode wait for it to be half full
+		 * or for the timeout, as for the hold buffer.
+		 */
+		kn->kn_data = bpf_ring_used(d);
+		if (d->bd_immediate) {
+			int64_t lowwat = 1;
+
+			if (kn->kn_sfflags & NOTE_LOWAT) {
+				if (kn->kn_sdata > d->bd_ring_size)
+					lowwat = d->bd_ring_size;
+				else if (kn->kn_sdata > lowwat)
+					lowwat = kn->kn_sdata;
+			}
+			ready = (kn->kn_data >= lowwat);
+		} else {
+			ready = (kn->kn_data >= d->bd_ring_size / 2 ||
+			    (d->bd_state == BPF_TIMED_OUT && kn->kn_data > 0));
+		}
+		/* drained since the timeout: arm the timer again */
+		if (!ready && d->bd_state == BPF_TIMED_OUT)
+			d->bd_state = BPF_IDLE;
+	} else if (d->bd_immediate) {
 		/*
 		 * If there's data in the hold buffer, it's the 
 		 * amount of data a read will return.
@@ -2258,7 +2377,17 @@ bpf_tap_imp(
 			if (outbound && !d->bd_seesent)
 				continue;
 			++d->bd_rcount;
-			slen = bpf_filter(d->bd_filter, (u_char *)m, pktlen, 0);
+			/*
+			 * Compiled filters only handle contiguous data; a
+			 * single mbuf (so no link header either) qualifies.
+			 */
+			if (d->bd_jit != NULL && m->m_next == NULL &&
+			    m->m_len > 0)
+				slen = bpf_jit_filter(d->bd_jit,
+				    mtod(m, u_char *), pktlen, m->m_len);
+			else
+				slen = bpf_filter(d->bd_filter, (u_char *)m,
+				    pktlen, 0);
 			if (slen != 0) {
 #if CONFIG_MACF_NET
 				if (mac_bpfdesc_check_receive(d, bp->bif_ifp) != 0)
@@ -2302,6 +2431,147 @@ static int bpf_tap_callback(struct ifnet *ifp, struct mbuf *m)
 	return 0;
 }
 
+/*
+ * Create a shared ring with a data area of about brr_size bytes and map
+ * it, wired, into the kernel and into the calling process.  On return
+ * brr holds the actual size and the user address.
+ */
+static int
+bpf_ring_alloc(struct bpf_ring_req *brr, struct bpf_ring **brp,
+    vm_size_t *mapsizep, void **entryp)
+{
+	memory_object_size_t mapsize;
+	vm_map_offset_t kaddr = 0, uaddr = 0;
+	ipc_port_t entry = IPC_PORT_NULL;
+	struct bpf_ring *br;
+	u_int32_t size;
+	kern_return_t kr;
+
+	size = BPF_RING_MINSIZE;
+	while (size < brr->brr_size && size <= bpf_maxringsize / 2)
+		size <<= 1;
+	mapsize = PAGE_SIZE + size;
+
+	kr = mach_make_memory_entry_64(VM_MAP_NULL, &mapsize, 0,
+	    MAP_MEM_NAMED_CREATE | VM_PROT_DEFAULT, &entry, IPC_PORT_NULL);
+	if (kr != KERN_SUCCESS)
+		return (ENOMEM);
+
+	kr = vm_map_enter_mem_object(kernel_map, &kaddr, mapsize, 0,
+	    VM_FLAGS_ANYWHERE, entry, 0, FALSE, VM_PROT_DEFAULT,
+	    VM_PROT_DEFAULT, VM_INHERIT_NONE);
+	if (kr != KERN_SUCCESS)
+		goto fail;
+	/* catchpacket() must never fault on the ring */
+	kr = vm_map_wire(kernel_map, kaddr, kaddr + mapsize, VM_PROT_DEFAULT,
+	    FALSE);
+	if (kr != KERN_SUCCESS) {
+		(void) mach_vm_deallocate(kernel_map, kaddr, mapsize);
+		goto fail;
+	}
+	kr = vm_map_enter_mem_object(current_map(), &uaddr, mapsize, 0,
+	    VM_FLAGS_ANYWHERE, entry, 0, FALSE, VM_PROT_DEFAULT,
+	    VM_PROT_DEFAULT, VM_INHERIT_NONE);
+	if (kr != KERN_SUCCESS) {
+		bpf_ring_release((struct bpf_ring *)kaddr, mapsize, NULL);
+		goto fail;
+	}
+
+	br = (struct bpf_ring *)kaddr;
+	br->br_size = size;
+	br->br_off = PAGE_SIZE;
+
+	brr->brr_size = size;
+	brr->brr_addr = uaddr;
+	*brp = br;
+	*mapsizep = mapsize;
+	*entryp = entry;
+	return (0);
+fail:
+	mach_memory_entry_port_release(entry);
+	return (ENOMEM);
+}
+
+/*
+ * Undo the kernel side of bpf_ring_alloc().  The process keeps its
+ * mapping, and with it the memory, until it unmaps it or exits.
+ */
+static void
+bpf_ring_release(struct bpf_ring *br, vm_size_t mapsize, void *entry)
+{
+	vm_map_offset_t kaddr = (vm_map_offset_t)br;
+
+	(void) vm_map_unwire(kernel_map, kaddr, kaddr + mapsize, FALSE);
+	(void) mach_vm_deallocate(kernel_map, kaddr, mapsize);
+	if (entry != NULL)
+		mach_memory_entry_port_release(entry);
+}
+
+/*
+ * Bytes of records the reader has yet to consume.  br_tail belongs to
+ * the process and is only trusted as far as it is consistent; the
+ * header's br_size and br_off are never read back at all.
+ */
+static u_int64_t
+bpf_ring_used(struct bpf_d *d)
+{
+	u_int64_t used = d->bd_ring_head - d->bd_ring->br_tail;
+
+	return (used > d->bd_ring_size ? d->bd_ring_size : used);
+}
+
+/*
+ * Find room for a record of totlen bytes at the head of the ring.  If
+ * it would run past the end of the data area it goes at the start
+ * instead, and the bytes skipped are returned in *skipp.  Returns NULL
+ * if the ring is full.
+ */
+static caddr_t
+bpf_ring_reserve(struct bpf_d *d, int totlen, u_int32_t *skipp)
+{
+	caddr_t data = (caddr_t)d->bd_ring + d->bd_ring_off;
+	u_int64_t used = bpf_ring_used(d);
+	u_int32_t size = d->bd_ring_size;
+	u_int32_t off = d->bd_ring_head & (size - 1);
+	u_int32_t len = BPF_WORDALIGN(totlen), skip = 0;
+
+	if (off + len > size)
+		skip = size - off;
+	if (len > size || used + skip + len > size)
+		return (NULL);
+	if (skip != 0) {
+		if (skip >= BPF_RING_MINREC)
+			((struct bpf_hdr *)(void *)(data + off))->bh_hdrlen = 0;
+		off = 0;
+	}
+	*skipp = skip;
+	return (data + off);
+}
+
+/*
+ * Publish a record reserved with bpf_ring_reserve(); len covers the
+ * aligned record and any bytes skipped.  Returns 1 if the reader
+ * should be woken up.
+ */
+static int
+bpf_ring_commit(struct bpf_d *d, u_int32_t len)
+{
+	struct bpf_ring *br = d->bd_ring;
+	u_int64_t used;
+
+	d->bd_ring_head += len;
+	/* the record must be visible before the new head */
+	OSMemoryBarrier();
+	br->br_head = d->bd_ring_head;
+
+	if (d->bd_immediate || d->bd_state == BPF_TIMED_OUT)
+		return (1);
+	/* wake up once when crossing the half-full mark */
+	used = bpf_ring_used(d);
+	return (used >= d->bd_ring_size / 2 &&
+	    used - len < d->bd_ring_size / 2);
+}
+
 /*
  * Move the packet data from interface memory (pkt) into the
  * store buffer.  Return 1 if it's time to wakeup a listener (buffer full),
@@ -2317,10 +2587,12 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 {
 	struct bpf_hdr *hp;
 	struct bpf_hdr_ext *ehp;
-	int totlen, curlen;
+	int totlen, curlen = 0;
 	int hdrlen, caplen;
 	int do_wakeup = 0;
 	u_char *payload;
+	caddr_t dst;
+	u_int32_t skip = 0;
 	struct timeval tv;
 	struct m_tag *mt = NULL;
 	struct bpf_mtag *bt = NULL;
@@ -2337,6 +2609,15 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 	if (totlen > d->bd_bufsize)
 		totlen = d->bd_bufsize;
 
+	if (d->bd_ring != NULL) {
+		dst = bpf_ring_reserve(d, totlen, &skip);
+		if (dst == NULL) {
+			++d->bd_dcount;
+			return;
+		}
+		goto fill;
+	}
+
 	/*
 	 * Round up the end of the previous packet to the next longword.
 	 */
@@ -2366,13 +2647,15 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 		 * arrived, so the reader should be woken up.
 		 */
 		do_wakeup = 1;
+	dst = d->bd_sbuf + curlen;
 
+fill:
 	/*
 	 * Append the bpf header.
 	 */
 	microtime(&tv);
  	if (d->bd_flags & BPF_EXTENDED_HDR) {
- 		ehp = (struct bpf_hdr_ext *)(void *)(d->bd_sbuf + curlen);
+ 		ehp = (struct bpf_hdr_ext *)(void *)dst;
  		memset(ehp, 0, sizeof(*ehp));
  		ehp->bh_tstamp.tv_sec = tv.tv_sec;
  		ehp->bh_tstamp.tv_usec = tv.tv_usec;
@@ -2407,7 +2690,7 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
  		payload = (u_char *)ehp + hdrlen;
  		caplen = ehp->bh_caplen;
  	} else {
- 		hp = (struct bpf_hdr *)(void *)(d->bd_sbuf + curlen);
+ 		hp = (struct bpf_hdr *)(void *)dst;
  		hp->bh_tstamp.tv_sec = tv.tv_sec;
  		hp->bh_tstamp.tv_usec = tv.tv_usec;
  		hp->bh_datalen = pktlen;
@@ -2420,7 +2703,10 @@ catchpacket(struct bpf_d *d, u_char *pkt, struct mbuf *m, u_int pktlen,
 	 * Copy the packet data into the store buffer and update its length.
 	 */
 	(*cpfn)(pkt, payload, caplen);
-	d->bd_slen = curlen + totlen;
+	if (d->bd_ring != NULL)
+		do_wakeup = bpf_ring_commit(d, skip + BPF_WORDALIGN(totlen));
+	else
+		d->bd_slen = curlen + totlen;
 
 	if (do_wakeup)
 		bpf_wakeup(d);
@@ -2470,6 +2756,13 @@ bpf_freed(struct bpf_d *d)
 	}
 	if (d->bd_filter)
 		FREE((caddr_t)d->bd_filter, M_DEVBUF);
+	bpf_jit_free(d->bd_jit);
+	d->bd_jit = NULL;
+	if (d->bd_ring != NULL) {
+		bpf_ring_release(d->bd_ring, d->bd_ring_mapsize,
+		    d->bd_ring_entry);
+		d->bd_ring = NULL;
+	}
 }
 
 /*
@@ -209,6 +209,7 @@ struct bpf_version {
 #ifdef PRIVATE
 #define	BIOCGWANTPKTAP	_IOR('B', 127, u_int)
 #define	BIOCSWANTPKTAP	_IOWR('B', 127, u_int)
+#define	BIOCSETRING	_IOWR('B', 128, struct bpf_ring_req)
 #endif /* PRIVATE */
 /*
  * Structure prepended to each packet.
@@ -250,6 +251,48 @@ struct bpf_hdr_ext {
 	bpf_u_int32	bh_flowid;	/* kernel reserved; 0 in userland */
 };
 
+/*
+ * Shared ring capture (BIOCSETRING).
+ *
+ * Instead of being copied to the store buffer and read(2) out, packets
+ * are written by the kernel straight into a ring that is mapped into
+ * the calling process.  The ring starts with a struct bpf_ring; the
+ * data area begins br_off bytes in and is br_size bytes long, a power
+ * of 2.  br_head and br_tail count bytes produced by the kernel and
+ * consumed by the reader; head - tail bytes of records are ready at
+ * offset (tail & (br_size - 1)) of the data area.  The reader processes
+ * them and then stores the new tail.
+ *
+ * Records have the same layout as in read(2) buffers: a struct bpf_hdr,
+ * or a struct bpf_hdr_ext if BIOCSEXTHDR is set, followed by the data,
+ * padded to BPF_WORDALIGN(bh_hdrlen + bh_caplen).  A record never
+ * wraps around; when fewer than BPF_RING_MINREC bytes are left before
+ * the end of the data area, or when the record there has a bh_hdrlen
+ * of 0, the next record is at the start of the data area.  In ring
+ * mode the extended header is not completed with the process of a
+ * socket flow, and read(2) fails with EINVAL.
+ *
+ * The descriptor becomes readable for select(2) and kevent(2) when
+ * the ring is half full, or as soon as it is not empty in immediate
+ * mode or once the read timeout has expired.
+ */
+struct bpf_ring {
+	volatile u_int64_t	br_head;	/* written by the kernel */
+	u_int64_t		_br_pad0[7];
+	volatile u_int64_t	br_tail;	/* written by the reader */
+	u_int64_t		_br_pad1[7];
+	u_int32_t		br_size;	/* size of the data area */
+	u_int32_t		br_off;		/* offset of the data area */
+};
+
+#define	BPF_RING_MINREC		20	/* aligned size of struct bpf_hdr */
+
+struct bpf_ring_req {
+	u_int32_t	brr_size;	/* in: wanted data size, out: actual */
+	u_int32_t	brr_pad;
+	u_int64_t	brr_addr;	/* out: address of the struct bpf_ring */
+};
+
 #define BPF_CONTROL_NAME	"com.apple.net.bpf"
 
 struct bpf_mtag {
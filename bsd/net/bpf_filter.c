@@ -272,6 +272,8 @@ bpf_filter(const struct bpf_insn *pc, u_char *p, u_int wirelen, u_int buflen)
 				if (buflen != 0)
 					return 0;
 				A = m_xhalf((struct mbuf *)(void *)p, k, &merr);
+				if (merr != 0)
+					return 0;
 				continue;
 #else
 				return 0;
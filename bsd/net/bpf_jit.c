@@ -0,0 +1,652 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * x86_64 code generator for BPF filter programs.
+ *
+ * A program that has passed bpf_validate() is translated, one BPF
+ * instruction at a time, into a leaf function that follows the
+ * bpf_filter() contract for a contiguous packet buffer.  Register use:
+ *
+ *	%eax	A accumulator
+ *	%r10d	X index register
+ *	%rdi	packet pointer
+ *	%esi	wire length
+ *	%r9d	buffer length
+ *	%ecx, %edx, %r8, %r11	scratch
+ *
+ * The scratch memory store lives in a 64-byte frame that is zeroed on
+ * entry, and is only set up when the program references it.  Every
+ * packet load is bounds checked against the buffer length; a failed
+ * check, a division by zero or an opcode the interpreter would reject
+ * jumps to a common stub that returns 0, exactly as bpf_filter() does.
+ *
+ * Since every branch is emitted in its rel32 form the size of each
+ * instruction's translation does not depend on where its targets are,
+ * so two passes suffice: the first records the offset of every BPF
+ * instruction, the second emits the code.
+ *
+ * This file also builds in user space, where it is used by the
+ * differential test in tools/tests/bpf_jit_test.
+ */
+
+#include <sys/param.h>
+#ifdef KERNEL
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <mach/vm_map.h>
+#include <vm/vm_map.h>
+#include <vm/vm_kern.h>
+#include <kern/kext_alloc.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#endif /* KERNEL */
+
+#include <net/bpf.h>
+#include <net/bpf_jit.h>
+
+#ifdef KERNEL
+/*
+ * Off by default; programs installed while it is set are compiled.
+ */
+int bpf_jit_enable = 0;
+#endif /* KERNEL */
+
+#if defined(__x86_64__)
+
+struct bpf_jit_ctx {
+	u_char		*buf;		/* NULL while sizing */
+	u_int		len;		/* bytes emitted so far */
+	u_int		*addrs;		/* offset of each instruction */
+	u_int		ninsns;
+	int		frame;		/* scratch memory frame in use */
+};
+
+#define	BPF_JIT_FRAME	(BPF_MEMWORDS * sizeof (int32_t))
+
+static void
+bpf_jit_emit1(struct bpf_jit_ctx *ctx, u_char b)
+{
+	if (ctx->buf != NULL)
+		ctx->buf[ctx->len] = b;
+	ctx->len++;
+}
+
+static void
+bpf_jit_emit_imm32(struct bpf_jit_ctx *ctx, u_int32_t k)
+{
+	bpf_jit_emit1(ctx, k & 0xff);
+	bpf_jit_emit1(ctx, (k >> 8) & 0xff);
+	bpf_jit_emit1(ctx, (k >> 16) & 0xff);
+	bpf_jit_emit1(ctx, (k >> 24) & 0xff);
+}
+
+#define	EMIT1(a)		bpf_jit_emit1(ctx, (a))
+#define	EMIT2(a, b)		do { EMIT1(a); EMIT1(b); } while (0)
+#define	EMIT3(a, b, c)		do { EMIT2(a, b); EMIT1(c); } while (0)
+#define	EMIT4(a, b, c, d)	do { EMIT3(a, b, c); EMIT1(d); } while (0)
+#define	EMIT5(a, b, c, d, e)	do { EMIT4(a, b, c, d); EMIT1(e); } while (0)
+#define	EMIT_IMM32(k)		bpf_jit_emit_imm32(ctx, (k))
+
+/* Condition code bytes of the two-byte Jcc rel32 forms */
+#define	JCC_JB		0x82
+#define	JCC_JAE		0x83
+#define	JCC_JE		0x84
+#define	JCC_JNE		0x85
+#define	JCC_JBE		0x86
+#define	JCC_JA		0x87
+
+/* Branch to the start of BPF instruction 'to'; ninsns is the return-0 stub */
+static void
+bpf_jit_jcc(struct bpf_jit_ctx *ctx, u_char cc, u_int to)
+{
+	EMIT2(0x0f, cc);
+	EMIT_IMM32(ctx->addrs[to] - (ctx->len + 4));
+}
+
+static void
+bpf_jit_jmp(struct bpf_jit_ctx *ctx, u_int to)
+{
+	EMIT1(0xe9);
+	EMIT_IMM32(ctx->addrs[to] - (ctx->len + 4));
+}
+
+#define	JCC(cc, to)		bpf_jit_jcc(ctx, (cc), (to))
+#define	JMP(to)			bpf_jit_jmp(ctx, (to))
+#define	JMP_RET0(cc)		JCC((cc), ctx->ninsns)
+
+static void
+bpf_jit_epilogue(struct bpf_jit_ctx *ctx)
+{
+	if (ctx->frame)
+		EMIT4(0x48, 0x83, 0xc4, BPF_JIT_FRAME);	/* add $64, %rsp */
+	EMIT1(0xc3);					/* ret */
+}
+
+/*
+ * Leave in %r11 the 64-bit sum X + k and branch to the return-0 stub
+ * unless X + k + size <= buflen.  Done in 64 bits this is equivalent
+ * to the chain of 32-bit comparisons bpf_filter() makes.
+ */
+static void
+bpf_jit_ind_check(struct bpf_jit_ctx *ctx, u_int32_t k, u_char size)
+{
+	EMIT3(0x45, 0x89, 0xd3);		/* mov %r10d, %r11d */
+	EMIT1(0xb9); EMIT_IMM32(k);		/* mov $k, %ecx */
+	EMIT3(0x49, 0x01, 0xcb);		/* add %rcx, %r11 */
+	EMIT4(0x4d, 0x8d, 0x43, size);		/* lea size(%r11), %r8 */
+	EMIT3(0x44, 0x89, 0xc9);		/* mov %r9d, %ecx */
+	EMIT3(0x49, 0x39, 0xc8);		/* cmp %rcx, %r8 */
+	JMP_RET0(JCC_JA);
+}
+
+/*
+ * Branch to the return-0 stub unless k + size <= buflen, then leave
+ * k in %rcx for the load.
+ */
+static void
+bpf_jit_abs_check(struct bpf_jit_ctx *ctx, u_int32_t k, u_char size)
+{
+	if (size == 1) {
+		EMIT3(0x41, 0x81, 0xf9); EMIT_IMM32(k);	/* cmp $k, %r9d */
+		JMP_RET0(JCC_JBE);
+	} else {
+		EMIT3(0x41, 0x83, 0xf9); EMIT1(size);	/* cmp $size, %r9d */
+		JMP_RET0(JCC_JB);
+		EMIT3(0x44, 0x89, 0xc9);		/* mov %r9d, %ecx */
+		EMIT3(0x83, 0xe9, size);		/* sub $size, %ecx */
+		EMIT2(0x81, 0xf9); EMIT_IMM32(k);	/* cmp $k, %ecx */
+		JMP_RET0(JCC_JB);
+	}
+	EMIT1(0xb9); EMIT_IMM32(k);			/* mov $k, %ecx */
+}
+
+static void
+bpf_jit_cond(struct bpf_jit_ctx *ctx, u_int i, const struct bpf_insn *pc,
+    u_char cc, u_char ncc)
+{
+	u_int jt = i + 1 + pc->jt, jf = i + 1 + pc->jf;
+
+	if (jt == jf) {
+		JMP(jt);
+	} else if (jf == i + 1) {
+		JCC(cc, jt);
+	} else if (jt == i + 1) {
+		JCC(ncc, jf);
+	} else {
+		JCC(cc, jt);
+		JMP(jf);
+	}
+}
+
+/*
+ * Emit the whole program into ctx.  Returns 0 if the program cannot
+ * be compiled and must be left to the interpreter.
+ */
+static int
+bpf_jit_gen(struct bpf_jit_ctx *ctx, const struct bpf_insn *prog)
+{
+	const struct bpf_insn *pc;
+	u_int i, n = ctx->ninsns;
+	u_int32_t k;
+
+	ctx->len = 0;
+	if (ctx->frame) {
+		/* push $0 eight times: a zeroed 64-byte frame */
+		for (i = 0; i < BPF_JIT_FRAME / 8; i++)
+			EMIT2(0x6a, 0x00);
+	}
+	EMIT2(0x31, 0xc0);			/* xor %eax, %eax */
+	EMIT3(0x45, 0x31, 0xd2);		/* xor %r10d, %r10d */
+	EMIT3(0x41, 0x89, 0xd1);		/* mov %edx, %r9d */
+
+	for (i = 0; i < n; i++) {
+		pc = &prog[i];
+		k = pc->k;
+		if (ctx->buf == NULL)
+			ctx->addrs[i] = ctx->len;
+		else if (ctx->addrs[i] != ctx->len)
+			return (0);
+
+		switch (pc->code) {
+		default:
+			JMP(n);
+			break;
+
+		case BPF_RET|BPF_K:
+			EMIT1(0xb8); EMIT_IMM32(k);	/* mov $k, %eax */
+			bpf_jit_epilogue(ctx);
+			break;
+
+		case BPF_RET|BPF_A:
+			bpf_jit_epilogue(ctx);
+			break;
+
+		case BPF_LD|BPF_W|BPF_ABS:
+			bpf_jit_abs_check(ctx, k, 4);
+			EMIT3(0x8b, 0x04, 0x0f);	/* mov (%rdi,%rcx), %eax */
+			EMIT2(0x0f, 0xc8);		/* bswap %eax */
+			break;
+
+		case BPF_LD|BPF_H|BPF_ABS:
+			bpf_jit_abs_check(ctx, k, 2);
+			EMIT4(0x0f, 0xb7, 0x04, 0x0f);	/* movzwl (%rdi,%rcx), %eax */
+			EMIT4(0x66, 0xc1, 0xc0, 0x08);	/* rol $8, %ax */
+			break;
+
+		case BPF_LD|BPF_B|BPF_ABS:
+			bpf_jit_abs_check(ctx, k, 1);
+			EMIT4(0x0f, 0xb6, 0x04, 0x0f);	/* movzbl (%rdi,%rcx), %eax */
+			break;
+
+		case BPF_LD|BPF_W|BPF_IND:
+			bpf_jit_ind_check(ctx, k, 4);
+			EMIT4(0x42, 0x8b, 0x04, 0x1f);	/* mov (%rdi,%r11), %eax */
+			EMIT2(0x0f, 0xc8);		/* bswap %eax */
+			break;
+
+		case BPF_LD|BPF_H|BPF_IND:
+			bpf_jit_ind_check(ctx, k, 2);
+			EMIT5(0x42, 0x0f, 0xb7, 0x04, 0x1f); /* movzwl (%rdi,%r11), %eax */
+			EMIT4(0x66, 0xc1, 0xc0, 0x08);	/* rol $8, %ax */
+			break;
+
+		case BPF_LD|BPF_B|BPF_IND:
+			bpf_jit_ind_check(ctx, k, 1);
+			EMIT5(0x42, 0x0f, 0xb6, 0x04, 0x1f); /* movzbl (%rdi,%r11), %eax */
+			break;
+
+		case BPF_LDX|BPF_MSH|BPF_B:
+			bpf_jit_abs_check(ctx, k, 1);
+			EMIT5(0x44, 0x0f, 0xb6, 0x14, 0x0f); /* movzbl (%rdi,%rcx), %r10d */
+			EMIT4(0x41, 0x83, 0xe2, 0x0f);	/* and $0xf, %r10d */
+			EMIT4(0x41, 0xc1, 0xe2, 0x02);	/* shl $2, %r10d */
+			break;
+
+		case BPF_LD|BPF_W|BPF_LEN:
+			EMIT2(0x89, 0xf0);		/* mov %esi, %eax */
+			break;
+
+		case BPF_LDX|BPF_W|BPF_LEN:
+			EMIT3(0x41, 0x89, 0xf2);	/* mov %esi, %r10d */
+			break;
+
+		case BPF_LD|BPF_IMM:
+			EMIT1(0xb8); EMIT_IMM32(k);	/* mov $k, %eax */
+			break;
+
+		case BPF_LDX|BPF_IMM:
+			EMIT2(0x41, 0xba); EMIT_IMM32(k); /* mov $k, %r10d */
+			break;
+
+		case BPF_LD|BPF_MEM:
+			if (k >= BPF_MEMWORDS)
+				return (0);
+			EMIT4(0x8b, 0x44, 0x24, k * 4);	/* mov k*4(%rsp), %eax */
+			break;
+
+		case BPF_LDX|BPF_MEM:
+			if (k >= BPF_MEMWORDS)
+				return (0);
+			EMIT5(0x44, 0x8b, 0x54, 0x24, k * 4); /* mov k*4(%rsp), %r10d */
+			break;
+
+		case BPF_ST:
+			if (k >= BPF_MEMWORDS) {
+				JMP(n);
+				break;
+			}
+			EMIT4(0x89, 0x44, 0x24, k * 4);	/* mov %eax, k*4(%rsp) */
+			break;
+
+		case BPF_STX:
+			if (k >= BPF_MEMWORDS) {
+				JMP(n);
+				break;
+			}
+			EMIT5(0x44, 0x89, 0x54, 0x24, k * 4); /* mov %r10d, k*4(%rsp) */
+			break;
+
+		case BPF_JMP|BPF_JA:
+			if (k >= n - i - 1)
+				return (0);
+			JMP(i + 1 + k);
+			break;
+
+		case BPF_JMP|BPF_JGT|BPF_K:
+		case BPF_JMP|BPF_JGE|BPF_K:
+		case BPF_JMP|BPF_JEQ|BPF_K:
+		case BPF_JMP|BPF_JSET|BPF_K:
+		case BPF_JMP|BPF_JGT|BPF_X:
+		case BPF_JMP|BPF_JGE|BPF_X:
+		case BPF_JMP|BPF_JEQ|BPF_X:
+		case BPF_JMP|BPF_JSET|BPF_X:
+			if (pc->jt >= n - i - 1 || pc->jf >= n - i - 1)
+				return (0);
+			if (BPF_OP(pc->code) == BPF_JSET) {
+				if (BPF_SRC(pc->code) == BPF_K) {
+					EMIT1(0xa9);	/* test $k, %eax */
+					EMIT_IMM32(k);
+				} else {
+					EMIT3(0x44, 0x85, 0xd0); /* test %r10d, %eax */
+				}
+			} else {
+				if (BPF_SRC(pc->code) == BPF_K) {
+					EMIT1(0x3d);	/* cmp $k, %eax */
+					EMIT_IMM32(k);
+				} else {
+					EMIT3(0x44, 0x39, 0xd0); /* cmp %r10d, %eax */
+				}
+			}
+			switch (BPF_OP(pc->code)) {
+			case BPF_JGT:
+				bpf_jit_cond(ctx, i, pc, JCC_JA, JCC_JBE);
+				break;
+			case BPF_JGE:
+				bpf_jit_cond(ctx, i, pc, JCC_JAE, JCC_JB);
+				break;
+			case BPF_JEQ:
+				bpf_jit_cond(ctx, i, pc, JCC_JE, JCC_JNE);
+				break;
+			case BPF_JSET:
+				bpf_jit_cond(ctx, i, pc, JCC_JNE, JCC_JE);
+				break;
+			}
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_X:
+			EMIT3(0x44, 0x01, 0xd0);	/* add %r10d, %eax */
+			break;
+
+		case BPF_ALU|BPF_SUB|BPF_X:
+			EMIT3(0x44, 0x29, 0xd0);	/* sub %r10d, %eax */
+			break;
+
+		case BPF_ALU|BPF_MUL|BPF_X:
+			EMIT4(0x41, 0x0f, 0xaf, 0xc2);	/* imul %r10d, %eax */
+			break;
+
+		case BPF_ALU|BPF_DIV|BPF_X:
+			EMIT3(0x45, 0x85, 0xd2);	/* test %r10d, %r10d */
+			JMP_RET0(JCC_JE);
+			EMIT2(0x31, 0xd2);		/* xor %edx, %edx */
+			EMIT3(0x41, 0xf7, 0xf2);	/* div %r10d */
+			break;
+
+		case BPF_ALU|BPF_AND|BPF_X:
+			EMIT3(0x44, 0x21, 0xd0);	/* and %r10d, %eax */
+			break;
+
+		case BPF_ALU|BPF_OR|BPF_X:
+			EMIT3(0x44, 0x09, 0xd0);	/* or %r10d, %eax */
+			break;
+
+		/*
+		 * Variable shift counts are taken modulo 32 by the
+		 * hardware, as they are for the interpreter on x86.
+		 */
+		case BPF_ALU|BPF_LSH|BPF_X:
+			EMIT3(0x44, 0x89, 0xd1);	/* mov %r10d, %ecx */
+			EMIT2(0xd3, 0xe0);		/* shl %cl, %eax */
+			break;
+
+		case BPF_ALU|BPF_RSH|BPF_X:
+			EMIT3(0x44, 0x89, 0xd1);	/* mov %r10d, %ecx */
+			EMIT2(0xd3, 0xe8);		/* shr %cl, %eax */
+			break;
+
+		case BPF_ALU|BPF_ADD|BPF_K:
+			EMIT1(0x05); EMIT_IMM32(k);	/* add $k, %eax */
+			break;
+
+		case BPF_ALU|BPF_SUB|BPF_K:
+			EMIT1(0x2d); EMIT_IMM32(k);	/* sub $k, %eax */
+			break;
+
+		case BPF_ALU|BPF_MUL|BPF_K:
+			EMIT2(0x69, 0xc0); EMIT_IMM32(k); /* imul $k, %eax, %eax */
+			break;
+
+		case BPF_ALU|BPF_DIV|BPF_K:
+			/* bpf_validate() rejects a constant zero divisor */
+			if (k == 0) {
+				JMP(n);
+				break;
+			}
+			EMIT1(0xb9); EMIT_IMM32(k);	/* mov $k, %ecx */
+			EMIT2(0x31, 0xd2);		/* xor %edx, %edx */
+			EMIT2(0xf7, 0xf1);		/* div %ecx */
+			break;
+
+		case BPF_ALU|BPF_AND|BPF_K:
+			EMIT1(0x25); EMIT_IMM32(k);	/* and $k, %eax */
+			break;
+
+		case BPF_ALU|BPF_OR|BPF_K:
+			EMIT1(0x0d); EMIT_IMM32(k);	/* or $k, %eax */
+			break;
+
+		case BPF_ALU|BPF_LSH|BPF_K:
+			EMIT3(0xc1, 0xe0, k & 0xff);	/* shl $k, %eax */
+			break;
+
+		case BPF_ALU|BPF_RSH|BPF_K:
+			EMIT3(0xc1, 0xe8, k & 0xff);	/* shr $k, %eax */
+			break;
+
+		case BPF_ALU|BPF_NEG:
+			EMIT2(0xf7, 0xd8);		/* neg %eax */
+			break;
+
+		case BPF_MISC|BPF_TAX:
+			EMIT3(0x41, 0x89, 0xc2);	/* mov %eax, %r10d */
+			break;
+
+		case BPF_MISC|BPF_TXA:
+			EMIT3(0x44, 0x89, 0xd0);	/* mov %r10d, %eax */
+			break;
+		}
+	}
+
+	/* Falling off the end and every failed check land here */
+	if (ctx->buf == NULL)
+		ctx->addrs[n] = ctx->len;
+	else if (ctx->addrs[n] != ctx->len)
+		return (0);
+	EMIT2(0x31, 0xc0);			/* xor %eax, %eax */
+	bpf_jit_epilogue(ctx);
+
+	return (1);
+}
+
+static int
+bpf_jit_uses_mem(const struct bpf_insn *prog, u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		switch (prog[i].code) {
+		case BPF_LD|BPF_MEM:
+		case BPF_LDX|BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+			return (1);
+		}
+	}
+	return (0);
+}
+
+#ifdef KERNEL
+extern vm_map_t g_kext_map;
+
+/*
+ * Code is placed in the kext submap so that it is mapped executable
+ * and within reach of kernel text; it is wired so that the filter can
+ * run with bpf_mlock held from any context.
+ */
+static void *
+bpf_jit_alloc(size_t size)
+{
+	vm_offset_t addr;
+
+	if (kext_alloc(&addr, size, FALSE) != KERN_SUCCESS)
+		return (NULL);
+	if (vm_map_wire(g_kext_map, addr, addr + size,
+	    VM_PROT_READ | VM_PROT_WRITE, FALSE) != KERN_SUCCESS) {
+		kext_free(addr, size);
+		return (NULL);
+	}
+	return ((void *)addr);
+}
+
+static int
+bpf_jit_seal(void *p, size_t size)
+{
+	vm_offset_t addr = (vm_offset_t)p;
+
+	return (vm_map_protect(g_kext_map, addr, addr + size,
+	    VM_PROT_READ | VM_PROT_EXECUTE, FALSE) == KERN_SUCCESS);
+}
+
+static void
+bpf_jit_release(void *p, size_t size)
+{
+	vm_offset_t addr = (vm_offset_t)p;
+
+	(void) vm_map_unwire(g_kext_map, addr, addr + size, FALSE);
+	kext_free(addr, size);
+}
+
+#define	BPF_JIT_MALLOC(size)	_MALLOC((size), M_DEVBUF, M_WAITOK)
+#define	BPF_JIT_FREE(p)		_FREE((p), M_DEVBUF)
+#define	BPF_JIT_PAGE_SIZE	PAGE_SIZE
+#else
+static void *
+bpf_jit_alloc(size_t size)
+{
+	void *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE,
+	    -1, 0);
+	return (p == MAP_FAILED ? NULL : p);
+}
+
+static int
+bpf_jit_seal(void *p, size_t size)
+{
+	return (mprotect(p, size, PROT_READ | PROT_EXEC) == 0);
+}
+
+static void
+bpf_jit_release(void *p, size_t size)
+{
+	munmap(p, size);
+}
+
+#define	BPF_JIT_MALLOC(size)	malloc(size)
+#define	BPF_JIT_FREE(p)		free(p)
+#define	BPF_JIT_PAGE_SIZE	4096
+#endif /* KERNEL */
+
+/*
+ * Translate a validated filter program.  Returns NULL if the program
+ * cannot be compiled; the caller then keeps using bpf_filter().
+ */
+struct bpf_jit *
+bpf_jit_compile(const struct bpf_insn *prog, u_int n)
+{
+	struct bpf_jit_ctx ctx;
+	struct bpf_jit *bj = NULL;
+	size_t size;
+
+	if (prog == NULL || n == 0 || n > BPF_MAXINSNS)
+		return (NULL);
+
+	bzero(&ctx, sizeof (ctx));
+	ctx.ninsns = n;
+	ctx.frame = bpf_jit_uses_mem(prog, n);
+	ctx.addrs = BPF_JIT_MALLOC((n + 1) * sizeof (u_int));
+	if (ctx.addrs == NULL)
+		return (NULL);
+	bzero(ctx.addrs, (n + 1) * sizeof (u_int));
+
+	if (!bpf_jit_gen(&ctx, prog))
+		goto done;
+
+	size = (ctx.len + BPF_JIT_PAGE_SIZE - 1) & ~(size_t)(BPF_JIT_PAGE_SIZE - 1);
+	bj = BPF_JIT_MALLOC(sizeof (*bj));
+	if (bj == NULL)
+		goto done;
+	bj->bj_size = size;
+	bj->bj_addr = bpf_jit_alloc(size);
+	if (bj->bj_addr == NULL) {
+		BPF_JIT_FREE(bj);
+		bj = NULL;
+		goto done;
+	}
+
+	ctx.buf = bj->bj_addr;
+	if (!bpf_jit_gen(&ctx, prog) || !bpf_jit_seal(bj->bj_addr, size)) {
+		bpf_jit_release(bj->bj_addr, size);
+		BPF_JIT_FREE(bj);
+		bj = NULL;
+		goto done;
+	}
+	bj->bj_func = (bpf_jit_func_t)bj->bj_addr;
+done:
+	BPF_JIT_FREE(ctx.addrs);
+	return (bj);
+}
+
+void
+bpf_jit_free(struct bpf_jit *bj)
+{
+	if (bj == NULL)
+		return;
+	bpf_jit_release(bj->bj_addr, bj->bj_size);
+	BPF_JIT_FREE(bj);
+}
+
+#else /* !__x86_64__ */
+
+struct bpf_jit *
+bpf_jit_compile(const struct bpf_insn *prog, u_int n)
+{
+#pragma unused(prog, n)
+	return (NULL);
+}
+
+void
+bpf_jit_free(struct bpf_jit *bj)
+{
+#pragma unused(bj)
+}
+
+#endif /* __x86_64__ */
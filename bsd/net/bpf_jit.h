@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NET_BPF_JIT_H_
+#define _NET_BPF_JIT_H_
+
+#include <sys/types.h>
+
+/*
+ * Native code generated for a validated filter program.  The compiled
+ * function has the same contract as bpf_filter() on a contiguous buffer
+ * (buflen != 0); mbuf chains must still go through the interpreter.
+ */
+typedef u_int (*bpf_jit_func_t)(u_char *p, u_int wirelen, u_int buflen);
+
+struct bpf_jit {
+	bpf_jit_func_t	bj_func;	/* entry point */
+	void		*bj_addr;	/* executable mapping */
+	size_t		bj_size;	/* size of the mapping */
+};
+
+struct bpf_insn;
+
+#ifdef KERNEL
+extern int bpf_jit_enable;
+#endif /* KERNEL */
+
+extern struct bpf_jit *bpf_jit_compile(const struct bpf_insn *, u_int);
+extern void bpf_jit_free(struct bpf_jit *);
+
+#define	bpf_jit_filter(bj, p, wirelen, buflen) \
+	((*(bj)->bj_func)((p), (wirelen), (buflen)))
+
+#endif /* _NET_BPF_JIT_H_ */
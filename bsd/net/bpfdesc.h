@@ -104,6 +104,7 @@ struct bpf_d {
 	struct bpf_if  *bd_bif;		/* interface descriptor */
 	u_int32_t		bd_rtout;	/* Read timeout in 'ticks' */
 	struct bpf_insn *bd_filter; 	/* filter code */
+	struct bpf_jit	*bd_jit;	/* native bd_filter, if compiled */
 	u_int32_t		bd_rcount;	/* number of packets received */
 	u_int32_t		bd_dcount;	/* number of packets dropped */
 
@@ -135,6 +136,13 @@ struct bpf_d {
 #endif
 	int		bd_traffic_class; /* traffic service class */
 	int		bd_flags;	/* flags */
+
+	struct bpf_ring	*bd_ring;	/* shared ring (BIOCSETRING) or NULL */
+	u_int64_t	bd_ring_head;	/* kernel copy of br_head */
+	u_int32_t	bd_ring_size;	/* size of the data area */
+	u_int32_t	bd_ring_off;	/* offset of the data area */
+	vm_size_t	bd_ring_mapsize; /* ring header page and data area */
+	void		*bd_ring_entry;	/* named entry backing the ring */
 };
 
 /* Values for bd_state */
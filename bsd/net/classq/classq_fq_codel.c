@@ -0,0 +1,1047 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/mbuf.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/sysctl.h>
+#include <sys/syslog.h>
+#include <sys/errno.h>
+#include <sys/kernel.h>
+
+#include <kern/zalloc.h>
+
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/dlil.h>
+#include <net/flowadv.h>
+
+#include <netinet/in.h>
+
+#include <net/classq/classq_sfb.h>
+#include <net/classq/classq_fq_codel.h>
+#include <net/flowhash.h>
+#include <net/net_osdep.h>
+#include <dev/random/randomdev.h>
+
+/*
+ * Flow Queue CoDel
+ *
+ * K. Nichols, V. Jacobson, "Controlling Queue Delay", ACM Queue 10(5)
+ * T. Hoeiland-Joergensen et al., "The Flow Queue CoDel Packet Scheduler
+ * and Active Queue Management Algorithm", RFC 8290
+ *
+ * Packets are hashed by their flow id (see pf_flowhash and the
+ * PKTF_FLOW_ID tagging done by the transports) into FQ_CODEL_FLOWS
+ * buckets, each holding its own packet queue.  Buckets with packets are
+ * served deficit round robin with a quantum of one MTU; a bucket that
+ * wakes up goes on the new flows list, which is served ahead of the old
+ * flows list, so that sparse flows (interactive traffic, DNS, TCP ACKs)
+ * see little queueing behind bulk transfers.
+ *
+ * Each bucket runs CoDel on the sojourn time of its head packet: once the
+ * sojourn time has stayed above target for an interval, packets are
+ * dropped (or ECN marked) from the head at a rate that grows with the
+ * square root of the drop count, until it goes back below target.  On
+ * overflow of the class queue limit the head of the most backlogged
+ * bucket is dropped instead of the arriving packet.
+ *
+ * The class queue's counters (qlen, qsize) are kept current for the
+ * scheduler, but its own packet list stays empty; packets live in the
+ * buckets.  Since CoDel drops on dequeue, getq and pollq return the
+ * number of packets they dropped so the scheduler can account for them,
+ * and pollq remembers the bucket it picked so that the next getq returns
+ * the same packet.
+ */
+
+#define	FQ_CODEL_HASH		net_flowhash_mh3_x86_32
+#define	FQ_CODEL_FLOWMASK	(FQ_CODEL_FLOWS - 1)
+#define	FQ_CODEL_FLOW(_fp, _i)	(&(*(_fp)->fqc_flows)[(_i)])
+
+/* delay based queues only bound the backlog to this many packets */
+#define	FQ_CODEL_DELAYBASED_MAXSIZE	2048
+
+/* CoDel interval bounds */
+#define	INTERVAL_MIN	(10ULL * 1000 * 1000)		/* 10ms */
+#define	INTERVAL_MAX	(10ULL * 1000 * 1000 * 1000)	/* 10s */
+
+#define	SOJOURN_DECAY	4		/* ilog2 of EWMA decay rate, (16) */
+
+#define	FQ_CODEL_ZONE_MAX	32		/* maximum elements in zone */
+#define	FQ_CODEL_ZONE_NAME	"classq_fq_codel" /* zone name */
+
+#define	FQ_CODEL_FLOWS_ZONE_MAX	32		/* maximum elements in zone */
+#define	FQ_CODEL_FLOWS_ZONE_NAME "classq_fq_codel_flows" /* zone name */
+
+static unsigned int fq_codel_size;	/* size of zone element */
+static struct zone *fq_codel_zone;	/* zone for fq_codel */
+
+static unsigned int fq_codel_flows_size; /* size of zone element */
+static struct zone *fq_codel_flows_zone; /* zone for fq_codel_flows */
+
+/* internal function prototypes */
+static void fq_codel_resetq(struct fq_codel *, cqev_t);
+static void fq_codel_reset_flows(struct fq_codel *);
+static void fq_codel_calc_params(struct fq_codel *);
+static inline u_int64_t fq_codel_now(void);
+static inline struct fq_codel_flow *fq_codel_classify(struct fq_codel *,
+    struct pkthdr *);
+static struct fq_codel_flow *fq_codel_fattest(struct fq_codel *);
+static void fq_codel_flow_remove(struct fq_codel *, class_queue_t *,
+    struct fq_codel_flow *, struct mbuf *);
+static void fq_codel_drop(struct fq_codel *, class_queue_t *,
+    struct fq_codel_flow *, u_int32_t *, u_int32_t *);
+static boolean_t fq_codel_should_drop(struct fq_codel *, class_queue_t *,
+    struct fq_codel_flow *, u_int64_t);
+static boolean_t fq_codel_mark_or_drop(struct fq_codel *, class_queue_t *,
+    struct fq_codel_flow *, u_int32_t *, u_int32_t *);
+static boolean_t fq_codel_flow_codel(struct fq_codel *, class_queue_t *,
+    struct fq_codel_flow *, u_int64_t, u_int32_t *, u_int32_t *);
+static struct fq_codel_flow *fq_codel_select(struct fq_codel *,
+    class_queue_t *, u_int32_t *, u_int32_t *);
+static u_int64_t fq_codel_control_law(struct fq_codel *, u_int64_t,
+    u_int32_t);
+static u_int32_t fq_codel_isqrt(u_int32_t);
+static boolean_t fq_codel_addfcentry(struct fq_codel *,
+    struct fq_codel_flow *, struct pkthdr *);
+static void fq_codel_fclist_append(struct fq_codel *, struct fq_codel_flow *);
+static void fq_codel_fclists_clean(struct fq_codel *);
+
+SYSCTL_NODE(_net_classq, OID_AUTO, fq_codel, CTLFLAG_RW|CTLFLAG_LOCKED, 0,
+    "FQ-CoDel");
+
+static u_int64_t fq_codel_target_qdelay = 0;	/* 0 indicates "automatic" */
+SYSCTL_QUAD(_net_classq_fq_codel, OID_AUTO, target_qdelay,
+    CTLFLAG_RW|CTLFLAG_LOCKED, &fq_codel_target_qdelay,
+    "FQ-CoDel target queue delay in nanoseconds");
+
+static u_int64_t fq_codel_interval = 0;		/* 0 indicates "automatic" */
+SYSCTL_QUAD(_net_classq_fq_codel, OID_AUTO, interval,
+    CTLFLAG_RW|CTLFLAG_LOCKED, &fq_codel_interval,
+    "FQ-CoDel interval in nanoseconds");
+
+static u_int32_t fq_codel_quantum = 0;		/* 0 indicates "automatic" */
+SYSCTL_UINT(_net_classq_fq_codel, OID_AUTO, quantum,
+    CTLFLAG_RW|CTLFLAG_LOCKED, &fq_codel_quantum, 0,
+    "FQ-CoDel quantum in bytes");
+
+void
+fq_codel_init(void)
+{
+	_CASSERT(FQCODELF_ECN4 == CLASSQF_ECN4);
+	_CASSERT(FQCODELF_ECN6 == CLASSQF_ECN6);
+	/* shares the scheduler class stats union with SFB */
+	_CASSERT(sizeof (struct fq_codel_stats) <= sizeof (struct sfb_stats));
+
+	fq_codel_size = sizeof (struct fq_codel);
+	fq_codel_zone = zinit(fq_codel_size,
+	    FQ_CODEL_ZONE_MAX * fq_codel_size, 0, FQ_CODEL_ZONE_NAME);
+	if (fq_codel_zone == NULL) {
+		panic("%s: failed allocating %s", __func__,
+		    FQ_CODEL_ZONE_NAME);
+		/* NOTREACHED */
+	}
+	zone_change(fq_codel_zone, Z_EXPAND, TRUE);
+	zone_change(fq_codel_zone, Z_CALLERACCT, TRUE);
+
+	fq_codel_flows_size = sizeof (*((struct fq_codel *)0)->fqc_flows);
+	fq_codel_flows_zone = zinit(fq_codel_flows_size,
+	    FQ_CODEL_FLOWS_ZONE_MAX * fq_codel_flows_size, 0,
+	    FQ_CODEL_FLOWS_ZONE_NAME);
+	if (fq_codel_flows_zone == NULL) {
+		panic("%s: failed allocating %s", __func__,
+		    FQ_CODEL_FLOWS_ZONE_NAME);
+		/* NOTREACHED */
+	}
+	zone_change(fq_codel_flows_zone, Z_EXPAND, TRUE);
+	zone_change(fq_codel_flows_zone, Z_CALLERACCT, TRUE);
+}
+
+static inline u_int64_t
+fq_codel_now(void)
+{
+	struct timespec now;
+	u_int64_t ns;
+
+	nanouptime(&now);
+	net_timernsec(&now, &ns);
+	return (ns);
+}
+
+static void
+fq_codel_calc_params(struct fq_codel *fp)
+{
+	struct ifnet *ifp = fp->fqc_ifp;
+	u_int64_t target, interval;
+
+	target = IFCQ_TARGET_QDELAY(&ifp->if_snd);
+	if (fq_codel_target_qdelay != 0)
+		target = fq_codel_target_qdelay;
+	if (target == 0)
+		target = IFQ_TARGET_DELAY;
+
+	/*
+	 * The interval should cover the RTT of most flows through the
+	 * queue, and must leave room for the target in it.
+	 */
+	interval = fq_codel_interval;
+	if (interval == 0)
+		interval = IFQ_UPDATE_INTERVAL;
+	if (interval < (target << 1))
+		interval = (target << 1);
+	if (interval < INTERVAL_MIN)
+		interval = INTERVAL_MIN;
+	else if (interval > INTERVAL_MAX)
+		interval = INTERVAL_MAX;
+
+	fp->fqc_target = target;
+	fp->fqc_interval = interval;
+
+	if (fq_codel_quantum != 0)
+		fp->fqc_quantum = fq_codel_quantum;
+	else
+		fp->fqc_quantum = ifp->if_mtu + ifp->if_hdrlen;
+	if (fp->fqc_quantum < 256)
+		fp->fqc_quantum = 256;
+}
+
+/*
+ * fq_codel support routines
+ */
+struct fq_codel *
+fq_codel_alloc(struct ifnet *ifp, u_int32_t qid, u_int32_t qlim,
+    u_int32_t flags)
+{
+	struct fq_codel *fp;
+	int i;
+
+	VERIFY(ifp != NULL && qlim > 0);
+
+	fp = zalloc(fq_codel_zone);
+	if (fp == NULL) {
+		log(LOG_ERR, "%s: FQ-CoDel unable to allocate\n",
+		    if_name(ifp));
+		return (NULL);
+	}
+	bzero(fp, fq_codel_size);
+
+	if ((fp->fqc_flows = zalloc(fq_codel_flows_zone)) == NULL) {
+		log(LOG_ERR, "%s: FQ-CoDel unable to allocate flows\n",
+		    if_name(ifp));
+		fq_codel_destroy(fp);
+		return (NULL);
+	}
+	bzero(fp->fqc_flows, fq_codel_flows_size);
+
+	for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+		struct fq_codel_flow *fl = FQ_CODEL_FLOW(fp, i);
+
+		MBUFQ_INIT(&fl->fqf_q);
+		STAILQ_INIT(&fl->fqf_fclist);
+	}
+	STAILQ_INIT(&fp->fqc_new);
+	STAILQ_INIT(&fp->fqc_old);
+
+	fp->fqc_ifp = ifp;
+	fp->fqc_qlim = qlim;
+	fp->fqc_qid = qid;
+	fp->fqc_flags = (flags & FQCODELF_USERFLAGS);
+#if !PF_ECN
+	if (fp->fqc_flags & FQCODELF_ECN) {
+		fp->fqc_flags &= ~FQCODELF_ECN;
+		log(LOG_ERR, "%s: FQ-CoDel qid=%d, ECN not available; "
+		    "ignoring FQCODELF_ECN flag!\n", if_name(ifp),
+		    fp->fqc_qid);
+	}
+#endif /* !PF_ECN */
+
+	fq_codel_resetq(fp, -1);
+
+	return (fp);
+}
+
+static void
+fq_codel_fclist_append(struct fq_codel *fp, struct fq_codel_flow *fl)
+{
+	IFCQ_CONVERT_LOCK(&fp->fqc_ifp->if_snd);
+
+	VERIFY(STAILQ_EMPTY(&fl->fqf_fclist) || fl->fqf_fccnt > 0);
+	fp->fqc_stats.flow_feedback += fl->fqf_fccnt;
+	fl->fqf_fccnt = 0;
+
+	flowadv_add(&fl->fqf_fclist);
+	VERIFY(STAILQ_EMPTY(&fl->fqf_fclist));
+}
+
+static void
+fq_codel_fclists_clean(struct fq_codel *fp)
+{
+	int i;
+
+	/* Move all the flow control entries to the flowadv list */
+	for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+		struct fq_codel_flow *fl = FQ_CODEL_FLOW(fp, i);
+
+		if (!STAILQ_EMPTY(&fl->fqf_fclist))
+			fq_codel_fclist_append(fp, fl);
+	}
+}
+
+void
+fq_codel_destroy(struct fq_codel *fp)
+{
+	if (fp->fqc_flows != NULL) {
+		fq_codel_fclists_clean(fp);
+		zfree(fq_codel_flows_zone, fp->fqc_flows);
+		fp->fqc_flows = NULL;
+	}
+	zfree(fq_codel_zone, fp);
+}
+
+static void
+fq_codel_reset_flows(struct fq_codel *fp)
+{
+	int i;
+
+	for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+		struct fq_codel_flow *fl = FQ_CODEL_FLOW(fp, i);
+
+		fl->fqf_flags &= ~FQFF_DROPPING;
+		fl->fqf_count = 0;
+		fl->fqf_lastcount = 0;
+		fl->fqf_first_above = 0;
+		fl->fqf_drop_next = 0;
+	}
+}
+
+static void
+fq_codel_resetq(struct fq_codel *fp, cqev_t ev)
+{
+	struct ifnet *ifp = fp->fqc_ifp;
+
+	VERIFY(ifp != NULL);
+
+	/* a fresh hash only while nothing is queued under the old one */
+	if (fp->fqc_active == 0) {
+		IFCQ_CONVERT_LOCK(&ifp->if_snd);
+		fp->fqc_fudge = RandomULong();
+	}
+
+	fp->fqc_eff_rate = ifnet_output_linkrate(ifp);
+	fq_codel_calc_params(fp);
+
+	if (ev == CLASSQ_EV_LINK_DOWN ||
+	    ev == CLASSQ_EV_LINK_UP)
+		fq_codel_fclists_clean(fp);
+
+	/* forget the congestion state; the link is a different one now */
+	fq_codel_reset_flows(fp);
+	bzero(&fp->fqc_stats, sizeof (fp->fqc_stats));
+
+	if (ev == CLASSQ_EV_LINK_DOWN || !classq_verbose)
+		return;
+
+	log(LOG_DEBUG, "%s: FQ-CoDel qid=%d, target=%llu nsec, "
+	    "interval=%llu nsec, quantum=%u, flows=%d, eff_rate=%llu bps "
+	    "flags=0x%x\n", if_name(ifp), fp->fqc_qid, fp->fqc_target,
+	    fp->fqc_interval, fp->fqc_quantum, FQ_CODEL_FLOWS,
+	    fp->fqc_eff_rate, fp->fqc_flags);
+}
+
+void
+fq_codel_getstats(struct fq_codel *fp, struct fq_codel_stats *fps)
+{
+	struct fq_codel_flowstats *fs;
+	struct fq_codel_flow *fl;
+	u_int32_t i, j, n = 0;
+
+	fps->target_qdelay = fp->fqc_target;
+	fps->interval = fp->fqc_interval;
+	fps->quantum = fp->fqc_quantum;
+	fps->flags = fp->fqc_flags;
+	fps->nflows = FQ_CODEL_FLOWS;
+	fps->active = fp->fqc_active;
+	bcopy(&fp->fqc_stats, &fps->fqstats, sizeof (fps->fqstats));
+
+	/* keep the FQ_CODEL_STATS_FLOWS most backlogged buckets, by bytes */
+	for (i = 0; i < FQ_CODEL_FLOWS; i++) {
+		fl = FQ_CODEL_FLOW(fp, i);
+		if (fl->fqf_qlen == 0)
+			continue;
+		for (j = n; j > 0 &&
+		    fps->flowstats[j - 1].bytes < fl->fqf_bytes; j--) {
+			if (j < FQ_CODEL_STATS_FLOWS)
+				fps->flowstats[j] = fps->flowstats[j - 1];
+		}
+		if (j >= FQ_CODEL_STATS_FLOWS)
+			continue;
+		fs = &fps->flowstats[j];
+		fs->flowid = fl->fqf_flowid;
+		fs->qlen = fl->fqf_qlen;
+		fs->bytes = fl->fqf_bytes;
+		fs->deficit = fl->fqf_deficit;
+		fs->sojourn = fl->fqf_sojourn;
+		fs->dropcount = fl->fqf_count;
+		fs->flags = fl->fqf_flags;
+		fs->drops = fl->fqf_drops;
+		fs->marks = fl->fqf_marks;
+		if (n < FQ_CODEL_STATS_FLOWS)
+			n++;
+	}
+	fps->nflowstats = n;
+	if (n < FQ_CODEL_STATS_FLOWS) {
+		bzero(&fps->flowstats[n],
+		    (FQ_CODEL_STATS_FLOWS - n) * sizeof (fps->flowstats[0]));
+	}
+}
+
+static inline struct fq_codel_flow *
+fq_codel_classify(struct fq_codel *fp, struct pkthdr *pkt)
+{
+	struct fq_codel_flow *fl;
+	u_int32_t i = 0;
+
+	/* packets without a flow id share the first bucket */
+	if (pkt->pkt_flowid == 0)
+		fp->fqc_stats.null_flowid++;
+	else
+		i = (FQ_CODEL_HASH(&pkt->pkt_flowid,
+		    sizeof (pkt->pkt_flowid), fp->fqc_fudge) &
+		    FQ_CODEL_FLOWMASK);
+
+	fl = FQ_CODEL_FLOW(fp, i);
+	fl->fqf_flowid = pkt->pkt_flowid;
+	return (fl);
+}
+
+static struct fq_codel_flow *
+fq_codel_fattest(struct fq_codel *fp)
+{
+	struct fq_codel_flow *fl, *fat = NULL;
+
+	/* every bucket with packets is on one of the two lists */
+	STAILQ_FOREACH(fl, &fp->fqc_new, fqf_link) {
+		if (fat == NULL || fl->fqf_bytes > fat->fqf_bytes)
+			fat = fl;
+	}
+	STAILQ_FOREACH(fl, &fp->fqc_old, fqf_link) {
+		if (fat == NULL || fl->fqf_bytes > fat->fqf_bytes)
+			fat = fl;
+	}
+	return ((fat != NULL && fat->fqf_qlen > 0) ? fat : NULL);
+}
+
+static void
+fq_codel_flow_remove(struct fq_codel *fp, class_queue_t *q,
+    struct fq_codel_flow *fl, struct mbuf *m)
+{
+	u_int32_t len = m_pktlen(m);
+
+	MBUFQ_REMOVE(&fl->fqf_q, m);
+	MBUFQ_NEXT(m) = NULL;
+
+	VERIFY(fl->fqf_qlen > 0 && qlen(q) > 0);
+	if (--fl->fqf_qlen == 0) {
+		VERIFY(fp->fqc_active > 0);
+		fp->fqc_active--;
+		fl->fqf_bytes = 0;
+	} else if (fl->fqf_bytes > len) {
+		fl->fqf_bytes -= len;
+	} else {
+		fl->fqf_bytes = 0;
+	}
+
+	qlen(q)--;
+	/* qsize is an approximation, so adjust if necessary */
+	if (((int)qsize(q) - m_length(m)) > 0)
+		qsize(q) -= m_length(m);
+	else if (qsize(q) != 0)
+		qsize(q) = 0;
+
+	/* See comments in <rdar://problem/14040693> */
+	m->m_pkthdr.pkt_flags &= ~PKTF_PRIV_GUARDED;
+}
+
+static void
+fq_codel_drop(struct fq_codel *fp, class_queue_t *q,
+    struct fq_codel_flow *fl, u_int32_t *cnt, u_int32_t *len)
+{
+	struct mbuf *m = MBUFQ_FIRST(&fl->fqf_q);
+
+	VERIFY(m != NULL);
+	fq_codel_flow_remove(fp, q, fl, m);
+	fl->fqf_drops++;
+	(*cnt)++;
+	*len += m_pktlen(m);
+
+	IFCQ_CONVERT_LOCK(&fp->fqc_ifp->if_snd);
+	m_freem(m);
+}
+
+int
+fq_codel_addq(struct fq_codel *fp, class_queue_t *q, struct mbuf *m,
+    struct pf_mtag *t, u_int32_t *cnt, u_int32_t *len)
+{
+#pragma unused(t)
+	struct pkthdr *pkt = &m->m_pkthdr;
+	struct fq_codel_flow *fl, *fat;
+	u_int32_t limit;
+	int ret = CLASSQEQ_SUCCESS;
+
+	*cnt = *len = 0;
+
+	/* See comments in <rdar://problem/14040693> */
+	VERIFY(!(pkt->pkt_flags & PKTF_PRIV_GUARDED));
+
+	fl = fq_codel_classify(fp, pkt);
+
+	if (fp->fqc_flags & FQCODELF_SUSPENDED) {
+		fp->fqc_stats.drop_suspended++;
+		if ((fp->fqc_flags & FQCODELF_FLOWCTL) &&
+		    (pkt->pkt_flags & PKTF_FLOW_ADV) &&
+		    fq_codel_addfcentry(fp, fl, pkt))
+			ret = CLASSQEQ_DROPPED_SP;
+		else
+			ret = CLASSQEQ_DROPPED;
+		goto drop;
+	}
+
+	limit = qlimit(q);
+	if ((fp->fqc_flags & FQCODELF_DELAYBASED) &&
+	    limit < FQ_CODEL_DELAYBASED_MAXSIZE)
+		limit = FQ_CODEL_DELAYBASED_MAXSIZE;
+
+	if (qlen(q) >= limit) {
+		/*
+		 * Make room at the head of the most backlogged flow, unless
+		 * that is this packet's own flow, or the one whose head
+		 * pollq has already shown; then this packet goes instead.
+		 */
+		fp->fqc_stats.drop_overflow++;
+		fat = fq_codel_fattest(fp);
+		if (fat == NULL || fat == fl || fat == fp->fqc_polled) {
+			ret = CLASSQEQ_DROPPED;
+			goto drop;
+		}
+		fq_codel_drop(fp, q, fat, cnt, len);
+	}
+
+	/*
+	 * A local TCP flow that CoDel is already dropping from is asked
+	 * to back off through a flow advisory instead.
+	 */
+	if ((fl->fqf_flags & FQFF_DROPPING) &&
+	    (fp->fqc_flags & FQCODELF_FLOWCTL) &&
+	    (pkt->pkt_flags & PKTF_FLOW_ADV) &&
+	    pkt->pkt_proto == IPPROTO_TCP &&
+	    fq_codel_addfcentry(fp, fl, pkt))
+		ret = CLASSQEQ_SUCCESS_FC;
+
+	pkt->pkt_flags |= PKTF_PRIV_GUARDED;
+	pkt->pkt_enqueue_ts = fq_codel_now();
+
+	MBUFQ_ENQUEUE(&fl->fqf_q, m);
+	if (fl->fqf_qlen++ == 0)
+		fp->fqc_active++;
+	fl->fqf_bytes += m_pktlen(m);
+	qlen(q)++;
+	VERIFY(qlen(q) != 0);
+	qsize(q) += m_length(m);
+
+	if (!(fl->fqf_flags & (FQFF_NEW | FQFF_OLD))) {
+		fl->fqf_flags |= FQFF_NEW;
+		fl->fqf_deficit = fp->fqc_quantum;
+		STAILQ_INSERT_TAIL(&fp->fqc_new, fl, fqf_link);
+		fp->fqc_stats.new_flows++;
+	}
+
+	/* successfully queued */
+	return (ret);
+
+drop:
+	IFCQ_CONVERT_LOCK(&fp->fqc_ifp->if_snd);
+	m_freem(m);
+	return (ret);
+}
+
+static u_int32_t
+fq_codel_isqrt(u_int32_t x)
+{
+	u_int32_t r = 0, b = (1U << 30);
+
+	while (b > x)
+		b >>= 2;
+	while (b != 0) {
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+		b >>= 2;
+	}
+	return (r);
+}
+
+/*
+ * CoDel control law: the next drop is interval / sqrt(count) after t.
+ * sqrt(count << 16) is sqrt(count) with 8 fractional bits.
+ */
+static u_int64_t
+fq_codel_control_law(struct fq_codel *fp, u_int64_t t, u_int32_t count)
+{
+	if (count == 0)
+		count = 1;
+	else if (count > 0xffff)
+		count = 0xffff;
+	return (t + ((fp->fqc_interval << 8) / fq_codel_isqrt(count << 16)));
+}
+
+static boolean_t
+fq_codel_should_drop(struct fq_codel *fp, class_queue_t *q,
+    struct fq_codel_flow *fl, u_int64_t now)
+{
+	struct mbuf *m = MBUFQ_FIRST(&fl->fqf_q);
+	u_int64_t sojourn = 0;
+
+	if (m == NULL) {
+		fl->fqf_first_above = 0;
+		return (FALSE);
+	}
+
+	if (now > m->m_pkthdr.pkt_enqueue_ts)
+		sojourn = now - m->m_pkthdr.pkt_enqueue_ts;
+	fl->fqf_sojourn = sojourn;
+
+	/*
+	 * Nothing to gain below target, or with less than a packet's
+	 * worth queued in the flow.  The last packet of the class is
+	 * never dropped either, so that a dequeue of a non-empty class
+	 * always returns a packet.
+	 */
+	if (sojourn < fp->fqc_target || fl->fqf_bytes <= fp->fqc_quantum ||
+	    qlen(q) <= 1) {
+		fl->fqf_first_above = 0;
+		return (FALSE);
+	}
+
+	if (fl->fqf_first_above == 0) {
+		/* give it an interval to come back below target */
+		fl->fqf_first_above = now + fp->fqc_interval;
+		return (FALSE);
+	}
+	return (now >= fl->fqf_first_above);
+}
+
+/*
+ * Signal congestion with the packet at the head of the flow: mark it if
+ * it can carry ECN, drop it otherwise.  Returns TRUE if it was marked.
+ */
+static boolean_t
+fq_codel_mark_or_drop(struct fq_codel *fp, class_queue_t *q,
+    struct fq_codel_flow *fl, u_int32_t *cnt, u_int32_t *len)
+{
+#if PF_ECN
+	struct mbuf *m = MBUFQ_FIRST(&fl->fqf_q);
+
+	if ((fp->fqc_flags & FQCODELF_ECN) &&
+	    m->m_pkthdr.pkt_proto == IPPROTO_TCP &&	/* only for TCP */
+	    mark_ecn(m, m_pftag(m), fp->fqc_flags)) {
+		/* successfully marked; do not drop. */
+		fl->fqf_marks++;
+		fp->fqc_stats.marked_packets++;
+		return (TRUE);
+	}
+#endif /* PF_ECN */
+	fq_codel_drop(fp, q, fl, cnt, len);
+	fp->fqc_stats.drop_codel++;
+	return (FALSE);
+}
+
+/*
+ * Run CoDel on a flow, dropping from its head as the control law
+ * dictates, and leave the packet to send next at its head.  Returns
+ * FALSE if the flow is empty.
+ */
+static boolean_t
+fq_codel_flow_codel(struct fq_codel *fp, class_queue_t *q,
+    struct fq_codel_flow *fl, u_int64_t now, u_int32_t *cnt, u_int32_t *len)
+{
+	boolean_t drop;
+	u_int32_t delta;
+
+	if (MBUFQ_EMPTY(&fl->fqf_q)) {
+		fl->fqf_flags &= ~FQFF_DROPPING;
+		goto done;
+	}
+
+	drop = fq_codel_should_drop(fp, q, fl, now);
+	if (fl->fqf_flags & FQFF_DROPPING) {
+		if (!drop) {
+			/* sojourn time went below target */
+			fl->fqf_flags &= ~FQFF_DROPPING;
+			goto done;
+		}
+		while (now >= fl->fqf_drop_next &&
+		    (fl->fqf_flags & FQFF_DROPPING)) {
+			fl->fqf_count++;
+			if (fq_codel_mark_or_drop(fp, q, fl, cnt, len)) {
+				fl->fqf_drop_next = fq_codel_control_law(fp,
+				    fl->fqf_drop_next, fl->fqf_count);
+				break;
+			}
+			if (!fq_codel_should_drop(fp, q, fl, now)) {
+				fl->fqf_flags &= ~FQFF_DROPPING;
+			} else {
+				fl->fqf_drop_next = fq_codel_control_law(fp,
+				    fl->fqf_drop_next, fl->fqf_count);
+			}
+		}
+	} else if (drop) {
+		(void) fq_codel_mark_or_drop(fp, q, fl, cnt, len);
+		fl->fqf_flags |= FQFF_DROPPING;
+
+		/*
+		 * If we were dropping not long ago, pick up near the
+		 * drop rate that controlled the queue last time.
+		 */
+		delta = fl->fqf_count - fl->fqf_lastcount;
+		if (delta > 1 && (int64_t)(now - fl->fqf_drop_next) <
+		    (int64_t)(fp->fqc_interval << 4))
+			fl->fqf_count = delta;
+		else
+			fl->fqf_count = 1;
+		fl->fqf_lastcount = fl->fqf_count;
+		fl->fqf_drop_next = fq_codel_control_law(fp, now,
+		    fl->fqf_count);
+	}
+
+done:
+	/* resume the flows we asked to back off */
+	if (!(fl->fqf_flags & FQFF_DROPPING) &&
+	    !STAILQ_EMPTY(&fl->fqf_fclist))
+		fq_codel_fclist_append(fp, fl);
+
+	return (!MBUFQ_EMPTY(&fl->fqf_q));
+}
+
+/*
+ * Pick the flow to send from next: deficit round robin over the new
+ * flows, then the old ones, running CoDel on each flow as it comes up.
+ * Packets dropped on the way are counted in cnt and len.
+ */
+static struct fq_codel_flow *
+fq_codel_select(struct fq_codel *fp, class_queue_t *q, u_int32_t *cnt,
+    u_int32_t *len)
+{
+	struct fq_codel_flowlist *head;
+	struct fq_codel_flow *fl;
+	u_int64_t now = fq_codel_now();
+
+	for (;;) {
+		head = &fp->fqc_new;
+		if ((fl = STAILQ_FIRST(head)) == NULL) {
+			head = &fp->fqc_old;
+			if ((fl = STAILQ_FIRST(head)) == NULL)
+				return (NULL);
+		}
+
+		if (fl->fqf_deficit <= 0) {
+			/* quantum used up; to the back of the old flows */
+			fl->fqf_deficit += fp->fqc_quantum;
+			STAILQ_REMOVE_HEAD(head, fqf_link);
+			fl->fqf_flags = (fl->fqf_flags & ~FQFF_NEW) | FQFF_OLD;
+			STAILQ_INSERT_TAIL(&fp->fqc_old, fl, fqf_link);
+			continue;
+		}
+
+		if (fq_codel_flow_codel(fp, q, fl, now, cnt, len))
+			return (fl);
+
+		/*
+		 * The flow ran dry.  A new flow still takes its turn on
+		 * the old list, so that going idle briefly cannot buy it
+		 * priority over the old flows; an old flow is retired.
+		 */
+		STAILQ_REMOVE_HEAD(head, fqf_link);
+		if (head == &fp->fqc_new && !STAILQ_EMPTY(&fp->fqc_old)) {
+			fl->fqf_flags = (fl->fqf_flags & ~FQFF_NEW) | FQFF_OLD;
+			STAILQ_INSERT_TAIL(&fp->fqc_old, fl, fqf_link);
+		} else {
+			fl->fqf_flags &= ~(FQFF_NEW | FQFF_OLD);
+		}
+	}
+}
+
+struct mbuf *
+fq_codel_getq(struct fq_codel *fp, class_queue_t *q, u_int32_t *cnt,
+    u_int32_t *len)
+{
+	struct fq_codel_flow *fl;
+	struct mbuf *m;
+	u_int64_t avg, sojourn;
+
+	*cnt = *len = 0;
+
+	if (fp->fqc_flags & FQCODELF_SUSPENDED)
+		return (NULL);
+
+	/* hand out what pollq showed, if anything */
+	if ((fl = fp->fqc_polled) != NULL)
+		fp->fqc_polled = NULL;
+	else if ((fl = fq_codel_select(fp, q, cnt, len)) == NULL)
+		return (NULL);
+
+	m = MBUFQ_FIRST(&fl->fqf_q);
+	VERIFY(m != NULL && (m->m_flags & M_PKTHDR));
+	VERIFY(m->m_pkthdr.pkt_flags & PKTF_PRIV_GUARDED);
+	fq_codel_flow_remove(fp, q, fl, m);
+	fl->fqf_deficit -= m_pktlen(m);
+
+	sojourn = fl->fqf_sojourn;
+	avg = fp->fqc_stats.sojourn_avg;
+	if (avg > 0)
+		avg = (((avg << SOJOURN_DECAY) - avg) + sojourn) >>
+		    SOJOURN_DECAY;
+	else
+		avg = sojourn;
+	fp->fqc_stats.sojourn_avg = avg;
+	if (sojourn > fp->fqc_stats.sojourn_max)
+		fp->fqc_stats.sojourn_max = sojourn;
+
+	if (fl->fqf_qlen == 0 && !STAILQ_EMPTY(&fl->fqf_fclist))
+		fq_codel_fclist_append(fp, fl);
+
+	return (m);
+}
+
+/*
+ * Returns the packet the next getq will, without removing it; any
+ * packets CoDel drops to get there are gone already and are counted in
+ * cnt and len.
+ */
+struct mbuf *
+fq_codel_pollq(struct fq_codel *fp, class_queue_t *q, u_int32_t *cnt,
+    u_int32_t *len)
+{
+	*cnt = *len = 0;
+
+	if (fp->fqc_flags & FQCODELF_SUSPENDED)
+		return (NULL);
+
+	if (fp->fqc_polled == NULL)
+		fp->fqc_polled = fq_codel_select(fp, q, cnt, len);
+
+	return ((fp->fqc_polled != NULL) ?
+	    MBUFQ_FIRST(&fp->fqc_polled->fqf_q) : NULL);
+}
+
+/*
+ * Length of the packet likely to be sent next, for schedulers that need
+ * it to compute finish times; unlike pollq, this does not run CoDel.
+ */
+u_int32_t
+fq_codel_headlen(struct fq_codel *fp)
+{
+	struct fq_codel_flow *fl;
+
+	if ((fl = fp->fqc_polled) != NULL)
+		return (m_pktlen(MBUFQ_FIRST(&fl->fqf_q)));
+
+	STAILQ_FOREACH(fl, &fp->fqc_new, fqf_link) {
+		if (!MBUFQ_EMPTY(&fl->fqf_q))
+			return (m_pktlen(MBUFQ_FIRST(&fl->fqf_q)));
+	}
+	STAILQ_FOREACH(fl, &fp->fqc_old, fqf_link) {
+		if (!MBUFQ_EMPTY(&fl->fqf_q))
+			return (m_pktlen(MBUFQ_FIRST(&fl->fqf_q)));
+	}
+	return (0);
+}
+
+void
+fq_codel_purgeq(struct fq_codel *fp, class_queue_t *q, u_int32_t flow,
+    u_int32_t *packets, u_int32_t *bytes)
+{
+	u_int32_t cnt = 0, len = 0, i, first, last;
+	struct fq_codel_flow *fl;
+	struct mbuf *m, *m_tmp;
+
+	IFCQ_CONVERT_LOCK(&fp->fqc_ifp->if_snd);
+
+	fp->fqc_polled = NULL;
+
+	/* flow of 0 means all flows; otherwise only its bucket */
+	if (flow == 0) {
+		first = 0;
+		last = FQ_CODEL_FLOWS - 1;
+	} else {
+		first = last = (FQ_CODEL_HASH(&flow, sizeof (flow),
+		    fp->fqc_fudge) & FQ_CODEL_FLOWMASK);
+	}
+
+	for (i = first; i <= last; i++) {
+		fl = FQ_CODEL_FLOW(fp, i);
+		MBUFQ_FOREACH_SAFE(m, &fl->fqf_q, m_tmp) {
+			if (flow != 0 && m->m_pkthdr.pkt_flowid != flow)
+				continue;
+			fq_codel_flow_remove(fp, q, fl, m);
+			cnt++;
+			len += m_pktlen(m);
+			m_freem(m);
+		}
+		if (fl->fqf_qlen == 0) {
+			fl->fqf_flags &= ~FQFF_DROPPING;
+			fl->fqf_first_above = 0;
+			if (!STAILQ_EMPTY(&fl->fqf_fclist))
+				fq_codel_fclist_append(fp, fl);
+		}
+	}
+
+	if (packets != NULL)
+		*packets = cnt;
+	if (bytes != NULL)
+		*bytes = len;
+}
+
+void
+fq_codel_updateq(struct fq_codel *fp, cqev_t ev)
+{
+	struct ifnet *ifp = fp->fqc_ifp;
+
+	VERIFY(ifp != NULL);
+
+	switch (ev) {
+	case CLASSQ_EV_LINK_BANDWIDTH: {
+		u_int64_t eff_rate = ifnet_output_linkrate(ifp);
+
+		/* update parameters only if rate has changed */
+		if (eff_rate == fp->fqc_eff_rate)
+			break;
+
+		if (classq_verbose) {
+			log(LOG_DEBUG, "%s: FQ-CoDel qid=%d, adapting to new "
+			    "eff_rate=%llu bps\n", if_name(ifp), fp->fqc_qid,
+			    eff_rate);
+		}
+		fp->fqc_eff_rate = eff_rate;
+		fq_codel_calc_params(fp);
+		break;
+	}
+
+	case CLASSQ_EV_LINK_MTU:
+		fq_codel_calc_params(fp);
+		break;
+
+	case CLASSQ_EV_LINK_UP:
+	case CLASSQ_EV_LINK_DOWN:
+		if (classq_verbose) {
+			log(LOG_DEBUG, "%s: FQ-CoDel qid=%d, resetting due to "
+			    "link %s\n", if_name(ifp), fp->fqc_qid,
+			    (ev == CLASSQ_EV_LINK_UP) ? "UP" : "DOWN");
+		}
+		fq_codel_resetq(fp, ev);
+		break;
+
+	case CLASSQ_EV_LINK_LATENCY:
+	default:
+		break;
+	}
+}
+
+int
+fq_codel_suspendq(struct fq_codel *fp, class_queue_t *q, boolean_t on)
+{
+#pragma unused(q)
+	struct ifnet *ifp = fp->fqc_ifp;
+
+	VERIFY(ifp != NULL);
+
+	if ((on && (fp->fqc_flags & FQCODELF_SUSPENDED)) ||
+	    (!on && !(fp->fqc_flags & FQCODELF_SUSPENDED)))
+		return (0);
+
+	if (!(fp->fqc_flags & FQCODELF_FLOWCTL)) {
+		log(LOG_ERR, "%s: FQ-CoDel qid=%d, unable to %s queue since "
+		    "flow-control is not enabled", if_name(ifp), fp->fqc_qid,
+		    (on ? "suspend" : "resume"));
+		return (ENOTSUP);
+	}
+
+	if (classq_verbose) {
+		log(LOG_DEBUG, "%s: FQ-CoDel qid=%d, setting state to %s",
+		    if_name(ifp), fp->fqc_qid, (on ? "SUSPENDED" : "RUNNING"));
+	}
+
+	if (on) {
+		fp->fqc_flags |= FQCODELF_SUSPENDED;
+	} else {
+		fp->fqc_flags &= ~FQCODELF_SUSPENDED;
+		/* the backlog waited out the suspension; don't punish it */
+		fq_codel_reset_flows(fp);
+		fq_codel_fclists_clean(fp);
+	}
+
+	return (0);
+}
+
+static boolean_t
+fq_codel_addfcentry(struct fq_codel *fp, struct fq_codel_flow *fl,
+    struct pkthdr *pkt)
+{
+	struct flowadv_fcentry *fce;
+	u_int32_t flowsrc, flowid;
+
+	flowsrc = pkt->pkt_flowsrc;
+	flowid = pkt->pkt_flowid;
+
+	if (flowid == 0)
+		return (FALSE);
+
+	STAILQ_FOREACH(fce, &fl->fqf_fclist, fce_link) {
+		if (fce->fce_flowsrc == flowsrc &&
+		    fce->fce_flowid == flowid) {
+			/* Already on flow control list; just return */
+			return (TRUE);
+		}
+	}
+
+	IFCQ_CONVERT_LOCK(&fp->fqc_ifp->if_snd);
+	fce = flowadv_alloc_entry(M_WAITOK);
+	if (fce != NULL) {
+		fce->fce_flowsrc = flowsrc;
+		fce->fce_flowid = flowid;
+		STAILQ_INSERT_TAIL(&fl->fqf_fclist, fce, fce_link);
+		fl->fqf_fccnt++;
+		fp->fqc_stats.flow_controlled++;
+	}
+
+	return (fce != NULL);
+}
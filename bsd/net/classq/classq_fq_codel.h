@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NET_CLASSQ_CLASSQ_FQ_CODEL_H_
+#define	_NET_CLASSQ_CLASSQ_FQ_CODEL_H_
+
+#ifdef PRIVATE
+#ifdef BSD_KERNEL_PRIVATE
+#include <net/flowadv.h>
+#include <net/classq/if_classq.h>
+#endif /* BSD_KERNEL_PRIVATE */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define	FQ_CODEL_FLOWS_SHIFT	8
+#define	FQ_CODEL_FLOWS		(1 << FQ_CODEL_FLOWS_SHIFT)
+#define	FQ_CODEL_STATS_FLOWS	16	/* flows reported in fq_codel_stats */
+
+struct fqcodelstats {
+	u_int64_t		drop_codel;	/* dropped for sojourn time */
+	u_int64_t		drop_overflow;	/* dropped at the queue limit */
+	u_int64_t		drop_suspended;
+	u_int64_t		marked_packets;	/* ECN marked instead */
+	u_int64_t		new_flows;	/* flows that became active */
+	u_int64_t		null_flowid;
+	u_int64_t		flow_controlled;
+	u_int64_t		flow_feedback;
+	u_int64_t		sojourn_avg;	/* EWMA of sojourn time, nsec */
+	u_int64_t		sojourn_max;
+};
+
+/* per-flow state flags */
+#define	FQFF_NEW	0x01	/* on the new flows list */
+#define	FQFF_OLD	0x02	/* on the old flows list */
+#define	FQFF_DROPPING	0x04	/* CoDel is in the dropping state */
+
+struct fq_codel_flowstats {
+	u_int32_t		flowid;		/* last flow id hashed here */
+	u_int32_t		qlen;		/* packets queued */
+	u_int32_t		bytes;		/* bytes queued */
+	int32_t			deficit;	/* DRR deficit */
+	u_int64_t		sojourn;	/* last sojourn time, nsec */
+	u_int32_t		dropcount;	/* CoDel drop count */
+	u_int32_t		flags;
+	u_int64_t		drops;
+	u_int64_t		marks;
+};
+
+struct fq_codel_stats {
+	u_int64_t		target_qdelay;
+	u_int64_t		interval;
+	u_int32_t		quantum;
+	u_int32_t		flags;
+	u_int32_t		nflows;		/* flow buckets */
+	u_int32_t		active;		/* buckets with packets queued */
+	struct fqcodelstats	fqstats;
+	/* the most backlogged flows, largest first */
+	u_int32_t		nflowstats;
+	struct fq_codel_flowstats flowstats[FQ_CODEL_STATS_FLOWS]
+	    __attribute__((aligned(8)));
+};
+
+#ifdef BSD_KERNEL_PRIVATE
+struct fq_codel_flow {
+	MBUFQ_HEAD(fqf_head)	fqf_q;		/* packets of this flow */
+	STAILQ_ENTRY(fq_codel_flow) fqf_link;	/* new or old flows list */
+	u_int32_t		fqf_qlen;
+	u_int32_t		fqf_bytes;
+	int32_t			fqf_deficit;
+	u_int32_t		fqf_flags;
+	u_int32_t		fqf_flowid;
+
+	/* CoDel state */
+	u_int32_t		fqf_count;	/* drops in this interval */
+	u_int32_t		fqf_lastcount;
+	u_int64_t		fqf_first_above; /* when sojourn went high */
+	u_int64_t		fqf_drop_next;	/* next drop or mark */
+	u_int64_t		fqf_sojourn;
+
+	u_int64_t		fqf_drops;
+	u_int64_t		fqf_marks;
+	u_int32_t		fqf_fccnt;
+	struct flowadv_fclist	fqf_fclist;	/* flow controlled entries */
+};
+
+STAILQ_HEAD(fq_codel_flowlist, fq_codel_flow);
+
+/* FQ-CoDel flags */
+#define	FQCODELF_ECN4		0x01	/* use packet marking for IPv4 packets */
+#define	FQCODELF_ECN6		0x02	/* use packet marking for IPv6 packets */
+#define	FQCODELF_ECN		(FQCODELF_ECN4 | FQCODELF_ECN6)
+#define	FQCODELF_FLOWCTL	0x04	/* enable flow control advisories */
+#define	FQCODELF_DELAYBASED	0x08	/* queue limit is only a memory bound */
+#define	FQCODELF_SUSPENDED	0x1000	/* queue is suspended */
+
+#define	FQCODELF_USERFLAGS						\
+	(FQCODELF_ECN4 | FQCODELF_ECN6 | FQCODELF_FLOWCTL |		\
+	FQCODELF_DELAYBASED)
+
+typedef struct fq_codel {
+	u_int32_t	fqc_flags;	/* FQ-CoDel flags */
+	u_int32_t	fqc_qlim;
+	u_int32_t	fqc_qid;
+	u_int32_t	fqc_fudge;	/* flow hash perturbation */
+	u_int32_t	fqc_quantum;	/* DRR quantum in bytes */
+	u_int32_t	fqc_active;	/* flows with packets queued */
+	u_int64_t	fqc_target;	/* CoDel target sojourn time, nsec */
+	u_int64_t	fqc_interval;	/* CoDel interval, nsec */
+	u_int64_t	fqc_eff_rate;	/* last known effective rate */
+	struct ifnet	*fqc_ifp;	/* back pointer to ifnet */
+
+	struct fq_codel_flowlist fqc_new;	/* flows that just woke up */
+	struct fq_codel_flowlist fqc_old;	/* flows that used a quantum */
+	struct fq_codel_flow	*fqc_polled;	/* flow picked by pollq */
+
+	struct fq_codel_flow	(*fqc_flows)[FQ_CODEL_FLOWS];
+
+	/* statistics */
+	struct fqcodelstats	fqc_stats __attribute__((aligned(8)));
+} fq_codel_t;
+
+extern void fq_codel_init(void);
+extern struct fq_codel *fq_codel_alloc(struct ifnet *, u_int32_t, u_int32_t,
+    u_int32_t);
+extern void fq_codel_destroy(struct fq_codel *);
+extern int fq_codel_addq(struct fq_codel *, class_queue_t *, struct mbuf *,
+    struct pf_mtag *, u_int32_t *, u_int32_t *);
+extern struct mbuf *fq_codel_getq(struct fq_codel *, class_queue_t *,
+    u_int32_t *, u_int32_t *);
+extern struct mbuf *fq_codel_pollq(struct fq_codel *, class_queue_t *,
+    u_int32_t *, u_int32_t *);
+extern u_int32_t fq_codel_headlen(struct fq_codel *);
+extern void fq_codel_purgeq(struct fq_codel *, class_queue_t *, u_int32_t,
+    u_int32_t *, u_int32_t *);
+extern void fq_codel_getstats(struct fq_codel *, struct fq_codel_stats *);
+extern void fq_codel_updateq(struct fq_codel *, cqev_t);
+extern int fq_codel_suspendq(struct fq_codel *, class_queue_t *, boolean_t);
+#endif /* BSD_KERNEL_PRIVATE */
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PRIVATE */
+#endif /* _NET_CLASSQ_CLASSQ_FQ_CODEL_H_ */
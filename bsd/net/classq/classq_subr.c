@@ -49,6 +49,7 @@
 #include <net/classq/classq_blue.h>
 #endif /* CLASSQ_BLUE */
 #include <net/classq/classq_sfb.h>
+#include <net/classq/classq_fq_codel.h>
 #include <net/pktsched/pktsched.h>
 
 #include <libkern/libkern.h>
@@ -82,6 +83,7 @@ classq_init(void)
 	blue_init();
 #endif /* CLASSQ_BLUE */
 	sfb_init();
+	fq_codel_init();
 }
 
 int
@@ -77,6 +77,7 @@
 #if INET
 #include <netinet/in_var.h>
 #include <netinet/igmp_var.h>
+#include <netinet/ip.h>
 #include <netinet/ip_var.h>
 #include <netinet/tcp.h>
 #include <netinet/tcp_var.h>
@@ -84,9 +85,11 @@
 #include <netinet/udp_var.h>
 #include <netinet/if_ether.h>
 #include <netinet/in_pcb.h>
+#include <netinet/lro_ext.h>
 #endif /* INET */
 
 #if INET6
+#include <netinet/ip6.h>
 #include <netinet6/in6_var.h>
 #include <netinet6/nd6.h>
 #include <netinet6/mld6_var.h>
@@ -122,6 +125,8 @@
 #define DBG_FNC_DLIL_INPUT      DLILDBG_CODE(DBG_DLIL_STATIC, (1 << 8))
 #define DBG_FNC_DLIL_OUTPUT     DLILDBG_CODE(DBG_DLIL_STATIC, (2 << 8))
 #define DBG_FNC_DLIL_IFOUT      DLILDBG_CODE(DBG_DLIL_STATIC, (3 << 8))
+#define DBG_FNC_DLIL_RSS_ENQ    DLILDBG_CODE(DBG_DLIL_STATIC, (4 << 8))
+#define DBG_FNC_DLIL_RSS_DEQ    DLILDBG_CODE(DBG_DLIL_STATIC, (5 << 8))
 
 #define MAX_FRAME_TYPE_SIZE 4 /* LONGWORDS */
 #define MAX_LINKADDR	    4 /* LONGWORDS */
@@ -379,6 +384,7 @@ static __inline void ifp_inc_traffic_class_out(struct ifnet *, struct mbuf *);
 static void dlil_main_input_thread_func(void *, wait_result_t);
 static void dlil_input_thread_func(void *, wait_result_t);
 static void dlil_rxpoll_input_thread_func(void *, wait_result_t);
+static void dlil_rss_input_thread_func(void *, wait_result_t);
 static int dlil_create_input_thread(ifnet_t, struct dlil_threading_info *);
 static void dlil_terminate_input_thread(struct dlil_threading_info *);
 static void dlil_input_stats_add(const struct ifnet_stat_increment_param *,
@@ -388,6 +394,8 @@ static void dlil_input_packet_list_common(struct ifnet *, struct mbuf *,
     u_int32_t, ifnet_model_t, boolean_t);
 static errno_t ifnet_input_common(struct ifnet *, struct mbuf *, struct mbuf *,
     const struct ifnet_stat_increment_param *, boolean_t, boolean_t);
+static u_int32_t dlil_rss_flowhash(struct mbuf *);
+static void dlil_rss_input(struct ifnet *, struct mbuf *);
 
 #if DEBUG
 static void dlil_verify_sum16(void);
@@ -595,6 +603,28 @@ SYSCTL_UINT(_net_link_generic_system, OID_AUTO, dlil_input_threads,
     CTLFLAG_RD | CTLFLAG_LOCKED, &cur_dlil_input_threads , 0,
     "Current number of DLIL input threads");
 
+/*
+ * Receive-side steering: when enabled (via the "dlil_rss" boot-arg),
+ * inbound packets of lo0 and of interfaces using the legacy input model
+ * are spread across this many input threads by flow hash, rather than
+ * being serialized on the interface's own input thread.  Every packet
+ * of a flow maps to the same queue, which preserves in-flow ordering.
+ */
+#define	DLIL_RSS_MAXQ	32
+static u_int32_t dlil_rss_queues = 0;		/* 0 (disabled) */
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, dlil_rss_queues,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &dlil_rss_queues, 0,
+    "Number of DLIL receive-side steering input threads");
+
+static struct dlil_main_threading_info *dlil_rss_inputs;
+static u_int32_t dlil_rss_seed;
+
+#define	DLIL_RSS_INPUT(inp)						\
+	(dlil_rss_inputs != NULL &&					\
+	(struct dlil_main_threading_info *)(void *)(inp) >= dlil_rss_inputs && \
+	(struct dlil_main_threading_info *)(void *)(inp) <		\
+	dlil_rss_inputs + dlil_rss_queues)
+
 #if IFNET_INPUT_SANITY_CHK
 SYSCTL_UINT(_net_link_generic_system, OID_AUTO, dlil_input_sanity_check,
     CTLFLAG_RW | CTLFLAG_LOCKED, &dlil_input_sanity_check , 0,
@@ -611,6 +641,11 @@ SYSCTL_UINT(_net_link_generic_system, OID_AUTO, delaybased_queue,
     CTLFLAG_RW | CTLFLAG_LOCKED, &if_delaybased_queue, 1,
     "enable delay based dynamic queue sizing");
 
+static u_int32_t if_fq_codel = 0;
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, fq_codel,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &if_fq_codel, 0,
+    "use FQ-CoDel instead of SFB for new transmit queues");
+
 static uint64_t hwcksum_in_invalidated = 0;
 SYSCTL_QUAD(_net_link_generic_system, OID_AUTO,
     hwcksum_in_invalidated, CTLFLAG_RD | CTLFLAG_LOCKED,
@@ -1075,12 +1110,20 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp)
 	u_int32_t limit;
 	int error;
 
-	/* NULL ifp indicates the main input thread, called at dlil_init time */
-	if (ifp == NULL) {
+	/*
+	 * NULL ifp indicates the main input thread or one of the RSS
+	 * input threads, called at dlil_init time.
+	 */
+	if (ifp == NULL && inp == dlil_main_input_thread) {
 		func = dlil_main_input_thread_func;
-		VERIFY(inp == dlil_main_input_thread);
 		(void) strlcat(inp->input_name,
 		    "main_input", DLIL_THREADNAME_LEN);
+	} else if (ifp == NULL) {
+		func = dlil_rss_input_thread_func;
+		VERIFY(DLIL_RSS_INPUT(inp));
+		(void) snprintf(inp->input_name, DLIL_THREADNAME_LEN,
+		    "rss_input%d", (int)((struct dlil_main_threading_info *)
+		    (void *)inp - dlil_rss_inputs));
 	} else if (net_rxpoll && (ifp->if_eflags & IFEF_RXPOLL)) {
 		func = dlil_rxpoll_input_thread_func;
 		VERIFY(inp != dlil_main_input_thread);
@@ -1091,6 +1134,8 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp)
 		VERIFY(inp != dlil_main_input_thread);
 		(void) snprintf(inp->input_name, DLIL_THREADNAME_LEN,
 		    "%s_input", if_name(ifp));
+		/* Inbound packets are steered to the RSS input threads */
+		inp->rss = (dlil_rss_inputs != NULL);
 	}
 	VERIFY(inp->input_thr == THREAD_NULL);
 
@@ -1120,7 +1165,7 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp)
 	}
 
 	_qinit(&inp->rcvq_pkts, Q_DROPTAIL, limit);
-	if (inp == dlil_main_input_thread) {
+	if (inp == dlil_main_input_thread || DLIL_RSS_INPUT(inp)) {
 		struct dlil_main_threading_info *inpm =
 		    (struct dlil_main_threading_info *)inp;
 		_qinit(&inpm->lo_rcvq_pkts, Q_DROPTAIL, limit);
@@ -1152,6 +1197,10 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp)
 	} else if (inp == dlil_main_input_thread) {
 		panic_plain("%s: couldn't create main input thread", __func__);
 		/* NOTREACHED */
+	} else if (ifp == NULL) {
+		panic_plain("%s: couldn't create %s thread", __func__,
+		    inp->input_name);
+		/* NOTREACHED */
 	} else {
 		panic_plain("%s: couldn't create %s input thread", __func__,
 		    if_name(ifp));
@@ -1189,6 +1238,7 @@ dlil_terminate_input_thread(struct dlil_threading_info *inp)
 	VERIFY(inp->wloop_thr == THREAD_NULL);
 	VERIFY(inp->poll_thr == THREAD_NULL);
 	VERIFY(inp->tag == 0);
+	inp->rss = FALSE;
 
 	inp->mode = IFNET_MODEL_INPUT_POLL_OFF;
 	bzero(&inp->tstats, sizeof (inp->tstats));
@@ -1347,6 +1397,9 @@ dlil_init(void)
 
 	PE_parse_boot_argn("net_rxpoll", &net_rxpoll, sizeof (net_rxpoll));
 
+	PE_parse_boot_argn("dlil_rss", &dlil_rss_queues,
+	    sizeof (dlil_rss_queues));
+
 	PE_parse_boot_argn("net_rtref", &net_rtref, sizeof (net_rtref));
 
 	PE_parse_boot_argn("ifnet_debug", &ifnet_debug, sizeof (ifnet_debug));
@@ -1507,6 +1560,30 @@ dlil_init(void)
 	 */
 	dlil_create_input_thread(NULL, dlil_main_input_thread);
 
+	/*
+	 * Create the RSS input threads, if requested; these are never
+	 * terminated.  The count is fixed here, since changing it later
+	 * would remap flows and could reorder packets within a flow.
+	 */
+	if (dlil_rss_queues > 0) {
+		u_int32_t i;
+
+		dlil_rss_queues = MIN(dlil_rss_queues,
+		    MIN(DLIL_RSS_MAXQ, (u_int32_t)ml_get_max_cpus()));
+		dlil_rss_seed = RandomULong();
+		dlil_rss_inputs = _MALLOC(dlil_rss_queues *
+		    sizeof (*dlil_rss_inputs), M_NKE, M_WAITOK | M_ZERO);
+		if (dlil_rss_inputs == NULL) {
+			panic_plain("%s: couldn't allocate RSS input threads",
+			    __func__);
+			/* NOTREACHED */
+		}
+		for (i = 0; i < dlil_rss_queues; i++) {
+			dlil_create_input_thread(NULL,
+			    (struct dlil_threading_info *)&dlil_rss_inputs[i]);
+		}
+	}
+
 	if (kernel_thread_start(ifnet_detacher_thread_func,
 	    NULL, &thread) != KERN_SUCCESS) {
 		panic_plain("%s: couldn't create detacher thread", __func__);
@@ -1717,7 +1794,7 @@ dlil_detach_filter(interface_filter_t filter)
 /*
  * Main input thread:
  *
- *   a) handles all inbound packets for lo0
+ *   a) handles all inbound packets for lo0 (unless RSS is enabled)
  *   b) handles all inbound packets for interfaces with no dedicated
  *	input thread (e.g. anything but Ethernet/PDP or those that support
  *	opportunistic polling.)
@@ -1791,6 +1868,70 @@ dlil_main_input_thread_func(void *v, wait_result_t w)
 	VERIFY(0);	/* we should never get here */
 }
 
+/*
+ * RSS input thread: handles the inbound packets of lo0 and of the
+ * interfaces with legacy input model whose flow hash maps to this queue.
+ * Like the main input thread, lo0 packets are kept on a separate list
+ * so that they can be associated with lo_ifp on their way up.
+ */
+static void
+dlil_rss_input_thread_func(void *v, wait_result_t w)
+{
+#pragma unused(w)
+	struct dlil_main_threading_info *inpm = v;
+	struct dlil_threading_info *inp = v;
+	u_int32_t qidx = (u_int32_t)(inpm - dlil_rss_inputs);
+
+	VERIFY(DLIL_RSS_INPUT(inp));
+	VERIFY(inp->ifp == NULL);
+	VERIFY(inp->mode == IFNET_MODEL_INPUT_POLL_OFF);
+
+	while (1) {
+		struct mbuf *m = NULL, *m_loop = NULL;
+		u_int32_t m_cnt, m_cnt_loop;
+
+		lck_mtx_lock_spin(&inp->input_lck);
+
+		/* Wait until there is work to be done */
+		while (!(inp->input_waiting & ~DLIL_INPUT_RUNNING)) {
+			inp->input_waiting &= ~DLIL_INPUT_RUNNING;
+			(void) msleep(&inp->input_waiting, &inp->input_lck,
+			    (PZERO - 1) | PSPIN, inp->input_name, NULL);
+		}
+
+		inp->input_waiting |= DLIL_INPUT_RUNNING;
+		inp->input_waiting &= ~DLIL_INPUT_WAITING;
+
+		/* RSS input threads only ever see packets */
+		VERIFY(!(inp->input_waiting & (DLIL_INPUT_TERMINATE |
+		    DLIL_PROTO_WAITING | DLIL_PROTO_REGISTER)));
+
+		m_cnt = qlen(&inp->rcvq_pkts);
+		m = _getq_all(&inp->rcvq_pkts);
+
+		m_cnt_loop = qlen(&inpm->lo_rcvq_pkts);
+		m_loop = _getq_all(&inpm->lo_rcvq_pkts);
+
+		inp->wtot = 0;
+
+		lck_mtx_unlock(&inp->input_lck);
+
+		KERNEL_DEBUG(DBG_FNC_DLIL_RSS_DEQ, qidx, m_cnt, m_cnt_loop,
+		    0, 0);
+
+		if (m_loop != NULL)
+			dlil_input_packet_list_extended(lo_ifp, m_loop,
+			    m_cnt_loop, inp->mode);
+
+		if (m != NULL)
+			dlil_input_packet_list_extended(NULL, m,
+			    m_cnt, inp->mode);
+	}
+
+	/* NOTREACHED */
+	VERIFY(0);	/* we should never get here */
+}
+
 /*
  * Input thread for interfaces with legacy input model.
  */
@@ -2358,6 +2499,29 @@ ifnet_input_common(struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
 	if ((inp = ifp->if_inp) == NULL)
 		inp = dlil_main_input_thread;
 
+	/*
+	 * With receive-side steering, the packets are spread across the
+	 * RSS input threads by flow hash instead of being queued to this
+	 * interface's input thread; its stats are synchronized now, as
+	 * is done for the main input thread.
+	 */
+	if (!poll && (inp->rss || (ifp == lo_ifp && dlil_rss_inputs != NULL))) {
+		if (s != NULL) {
+			lck_mtx_lock_spin(&inp->input_lck);
+			dlil_input_stats_add(s, inp, FALSE);
+			dlil_input_stats_sync(ifp, inp);
+			lck_mtx_unlock(&inp->input_lck);
+		}
+
+		dlil_rss_input(ifp, m_head);
+
+		if (ifp != lo_ifp) {
+			/* Release the IO refcnt */
+			ifnet_decr_iorefcnt(ifp);
+		}
+		return (0);
+	}
+
 	/*
 	 * If there is a matching DLIL input thread associated with an
 	 * affinity set, associate this thread with the same set.  We
@@ -2457,6 +2621,148 @@ ifnet_input_common(struct ifnet *ifp, struct mbuf *m_head, struct mbuf *m_tail,
 	return (0);
 }
 
+/*
+ * Compute the RSS flow hash of an inbound packet; its data pointer is
+ * at the network-layer header.  A hash supplied by the driver through
+ * mbuf_pkthdr_set_flowhash() is used as is, except for looped back
+ * packets, which may still carry the flow ID of their sender.
+ * Otherwise IPv4 and IPv6 packets are hashed on their addresses and
+ * protocol, plus the ports for TCP and UDP unless the packet is a
+ * fragment.  Anything else hashes to 0.
+ */
+static u_int32_t
+dlil_rss_flowhash(struct mbuf *m)
+{
+	struct {
+		u_int32_t	addr[8];
+		u_int16_t	port[2];
+		u_int8_t	proto;
+		u_int8_t	pad[3];
+	} key __attribute__((aligned(8)));
+	u_int32_t len = m_pktlen(m), off = 0;
+	u_int8_t vers;
+
+	if ((m->m_pkthdr.pkt_flags & (PKTF_FLOW_ID | PKTF_LOOP)) ==
+	    PKTF_FLOW_ID && m->m_pkthdr.pkt_flowsrc == FLOWSRC_IFNET &&
+	    m->m_pkthdr.pkt_flowid != 0)
+		return (m->m_pkthdr.pkt_flowid);
+
+	if (len == 0)
+		return (0);
+
+	m_copydata(m, 0, sizeof (vers), (caddr_t)&vers);
+	bzero(&key, sizeof (key));
+
+	switch (vers >> 4) {
+#if INET
+	case IPVERSION: {
+		struct ip ip;
+
+		if (len < sizeof (ip))
+			return (0);
+		m_copydata(m, 0, sizeof (ip), (caddr_t)&ip);
+		key.addr[0] = ip.ip_src.s_addr;
+		key.addr[1] = ip.ip_dst.s_addr;
+		key.proto = ip.ip_p;
+		/* ip_off is still in network byte order */
+		if (!(ip.ip_off & htons(IP_MF | IP_OFFMASK)))
+			off = ip.ip_hl << 2;
+		break;
+	}
+#endif /* INET */
+#if INET6
+	case (IPV6_VERSION >> 4): {
+		struct ip6_hdr ip6;
+
+		if (len < sizeof (ip6))
+			return (0);
+		m_copydata(m, 0, sizeof (ip6), (caddr_t)&ip6);
+		bcopy(&ip6.ip6_src, &key.addr[0], sizeof (ip6.ip6_src));
+		bcopy(&ip6.ip6_dst, &key.addr[4], sizeof (ip6.ip6_dst));
+		key.proto = ip6.ip6_nxt;
+		off = sizeof (ip6);
+		break;
+	}
+#endif /* INET6 */
+	default:
+		return (0);
+	}
+
+	if (off != 0 && len >= off + sizeof (key.port) &&
+	    (key.proto == IPPROTO_TCP || key.proto == IPPROTO_UDP))
+		m_copydata(m, off, sizeof (key.port), (caddr_t)key.port);
+
+	return (net_flowhash(&key, sizeof (key), dlil_rss_seed));
+}
+
+/*
+ * Split a packet chain by flow hash and hand each part to its RSS
+ * input thread.  The relative order of the packets mapping to the
+ * same queue is preserved.
+ */
+static void
+dlil_rss_input(struct ifnet *ifp, struct mbuf *m_head)
+{
+	struct {
+		struct mbuf	*head;
+		struct mbuf	*tail;
+		u_int32_t	cnt;
+		u_int32_t	size;
+	} q[DLIL_RSS_MAXQ];
+	u_int32_t qmap = 0, i;
+	struct mbuf *m, *n;
+
+	_CASSERT(DLIL_RSS_MAXQ <= 32);	/* qmap bits */
+	VERIFY(dlil_rss_queues > 0 && dlil_rss_queues <= DLIL_RSS_MAXQ);
+
+	for (m = m_head; m != NULL; m = n) {
+		n = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, NULL);
+
+		i = (u_int32_t)(((u_int64_t)dlil_rss_flowhash(m) *
+		    dlil_rss_queues) >> 32);
+		if (!(qmap & (1U << i))) {
+			qmap |= (1U << i);
+			q[i].head = m;
+			q[i].cnt = 0;
+			q[i].size = 0;
+		} else {
+			mbuf_setnextpkt(q[i].tail, m);
+		}
+		q[i].tail = m;
+		q[i].cnt++;
+		q[i].size += m_pktlen(m);
+	}
+
+	while (qmap != 0) {
+		struct dlil_main_threading_info *inpm;
+		struct dlil_threading_info *inp;
+
+		i = ffs(qmap) - 1;
+		qmap &= ~(1U << i);
+		inpm = &dlil_rss_inputs[i];
+		inp = &inpm->inp;
+
+		lck_mtx_lock_spin(&inp->input_lck);
+		if (ifp == lo_ifp) {
+			_addq_multi(&inpm->lo_rcvq_pkts, q[i].head, q[i].tail,
+			    q[i].cnt, q[i].size);
+		} else {
+			_addq_multi(&inp->rcvq_pkts, q[i].head, q[i].tail,
+			    q[i].cnt, q[i].size);
+		}
+		KERNEL_DEBUG(DBG_FNC_DLIL_RSS_ENQ, i, q[i].cnt,
+		    qlen(&inp->rcvq_pkts), qlen(&inpm->lo_rcvq_pkts), 0);
+
+		inp->input_waiting |= DLIL_INPUT_WAITING;
+		if (!(inp->input_waiting & DLIL_INPUT_RUNNING)) {
+			inp->wtot++;
+			wakeup_one((caddr_t)&inp->input_waiting);
+		}
+		lck_mtx_unlock(&inp->input_lck);
+	}
+}
+
 static void
 ifnet_start_common(struct ifnet *ifp, int resetfc)
 {
@@ -4997,8 +5303,8 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 	VERIFY(ifp->if_output_sched_model == IFNET_SCHED_MODEL_NORMAL ||
 	    ifp->if_output_sched_model == IFNET_SCHED_MODEL_DRIVER_MANAGED);
 
-	/* By default, use SFB and enable flow advisory */
-	sflags = PKTSCHEDF_QALG_SFB;
+	/* By default, use SFB (or FQ-CoDel) and enable flow advisory */
+	sflags = if_fq_codel ? PKTSCHEDF_QALG_FQ_CODEL : PKTSCHEDF_QALG_SFB;
 	if (if_flowadv)
 		sflags |= PKTSCHEDF_QALG_FLOWCTL;
 
@@ -5754,6 +6060,11 @@ ifnet_detach_final(struct ifnet *ifp)
 	pf_ifnet_hook(ifp, 0);
 #endif /* PF */
 
+#if INET
+	/* Drop any segments LRO is still holding for this interface */
+	tcp_lro_detach(ifp);
+#endif /* INET */
+
 	/* Filter list should be empty */
 	lck_mtx_lock_spin(&ifp->if_flt_lock);
 	VERIFY(TAILQ_EMPTY(&ifp->if_flt_head));
@@ -141,6 +141,7 @@ struct dlil_threading_info {
 	struct thread	*wloop_thr;	/* workloop thread */
 	struct thread	*poll_thr;	/* poll thread */
 	u_int32_t	tag;		/* affinity tag */
+	boolean_t	rss;		/* steer input to the RSS queues */
 	/*
 	 * Opportunistic polling.
 	 */
@@ -181,7 +182,8 @@ struct dlil_threading_info {
 };
 
 /*
- * DLIL input thread info (for main/loopback input thread)
+ * DLIL input thread info (for main/loopback input thread, and for
+ * the receive-side steering (RSS) input threads)
  */
 struct dlil_main_threading_info {
 	struct dlil_threading_info	inp;
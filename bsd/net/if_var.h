@@ -456,6 +456,7 @@ struct proto_hash_entry;
 struct dlil_threading_info;
 struct tcpstat_local;
 struct udpstat_local;
+struct lro_table;
 #if PF
 struct pfi_kif;
 #endif /* PF */
@@ -670,6 +671,9 @@ struct ifnet {
 #endif /* MEASURE_BW */
 	struct tcpstat_local	*if_tcp_stat;	/* TCP specific stats */
 	struct udpstat_local	*if_udp_stat;	/* UDP specific stats */
+#if INET
+	struct lro_table	*if_lro;	/* TCP LRO flow table */
+#endif /* INET */
 
 	struct {
 		int32_t		level;		/* cached logging level */
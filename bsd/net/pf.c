@@ -4056,6 +4056,7 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 	sa_family_t		 af = pd->af;
 	struct pf_rule		*r, *a = NULL;
 	struct pf_ruleset	*ruleset = NULL;
+	struct pf_rule_index	*ri;
 	struct pf_src_node	*nsn = NULL;
 	struct tcphdr		*th = pd->hdr.tcp;
 	u_short			 reason;
@@ -4342,7 +4343,19 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 	if (nr && nr->tag > 0)
 		tag = nr->tag;
 
+	/* new packet for the rule indexes */
+	pf_rule_index_gen++;
+
 	while (r != NULL) {
+		/* jump over the rules the index rules out for this packet */
+		ri = (ruleset != NULL ? ruleset : &pf_main_ruleset)->
+		    rules[PF_RULESET_FILTER].index;
+		if (ri != NULL && (r = pf_rule_index_next(ri, r, pd)) == NULL) {
+			if (pf_step_out_of_anchor(&asd, &ruleset,
+			    PF_RULESET_FILTER, &r, &a, &match))
+				break;
+			continue;
+		}
 		r->evaluations++;
 		if (pfi_kif_match(r->kif, kif) == r->ifnot)
 			r = r->skip[PF_SKIP_IFP].ptr;
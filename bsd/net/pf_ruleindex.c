@@ -0,0 +1,796 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Filter rule index.
+ *
+ * pf_test_rule() evaluates a ruleset in order and can only jump over
+ * runs of consecutive rules sharing a field, using the skip steps.  In
+ * large rulesets most rules are rejected on their addresses or on their
+ * destination port, so when a filter ruleset is committed an index of
+ * those fields is built as well:
+ *
+ *   - per address family, the source and the destination prefixes of
+ *     the rules, grouped by prefix length and sorted, so that all the
+ *     prefixes containing an address are found with one binary search
+ *     per distinct prefix length;
+ *
+ *   - a segment tree over the destination port ranges of the TCP and
+ *     UDP rules, which yields the ranges containing a port in
+ *     O(log n) plus the number of ranges found.
+ *
+ * Rules whose field is anything but a plain address/mask or port range
+ * (tables, dynamic addresses, negation, ...) are kept in a per-field
+ * wildcard set.  The first time a packet reaches an indexed ruleset,
+ * the three lookups are intersected into a bitmap of candidate rules,
+ * and the walk then steps from candidate to candidate, evaluating each
+ * of them exactly as before.  A rule left out of the bitmap would fail
+ * one of the address or port tests, so the outcome, including quick,
+ * last-match and anchor evaluation, is the same as the linear walk.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
+
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include <net/if.h>
+#include <net/pfvar.h>
+
+#if INET6
+#include <netinet/ip6.h>
+#endif /* INET6 */
+
+/* rulesets smaller than this are walked linearly */
+#define	PF_RULE_INDEX_MIN	64
+
+#define	PF_RI_INET		0
+#define	PF_RI_INET6		1
+#define	PF_RI_NAF		2
+#define	PF_RI_MAXPLEN		128
+#define	PF_RI_SPARSE		0xffffffffU
+
+struct pf_rule_index_prefix {
+	struct pf_addr		 addr;		/* masked address */
+	u_int32_t		 first;		/* rules, in atab nrs */
+	u_int32_t		 count;
+	u_int32_t		 dense;		/* or bitmap, if not sparse */
+};
+
+/* prefixes of one address field and family, grouped by length */
+struct pf_rule_index_atab {
+	u_int32_t		 nlens;
+	u_int8_t		 plen[PF_RI_MAXPLEN + 1];
+	u_int32_t		 start[PF_RI_MAXPLEN + 2];
+	struct pf_rule_index_prefix *prefix;
+	u_int32_t		*nrs;
+	u_int32_t		*bitmaps;
+};
+
+/* segment tree over the destination port ranges */
+struct pf_rule_index_ports {
+	u_int32_t		 nsegs;
+	u_int32_t		 size;		/* leaves, power of 2 >= nsegs */
+	u_int16_t		*lo;		/* first port of each segment */
+	u_int32_t		*node;		/* node i: nrs[node[i]..node[i+1]) */
+	u_int32_t		*nrs;
+	u_int32_t		*dense;		/* node i: bitmap dense[i], if any */
+	u_int32_t		*bitmaps;
+};
+
+struct pf_rule_index {
+	u_int32_t		 nrules;
+	u_int32_t		 words;		/* bitmap size */
+	struct pf_rule		**rules;	/* by rule number */
+	struct pf_rule_index_atab src[PF_RI_NAF];
+	struct pf_rule_index_atab dst[PF_RI_NAF];
+	struct pf_rule_index_ports dport;
+	u_int32_t		*bits;		/* storage of the bitmaps below */
+	u_int32_t		*src_any;	/* rules not indexed on a field */
+	u_int32_t		*dst_any;
+	u_int32_t		*dport_any;
+	u_int32_t		*cand;		/* candidates for current packet */
+	u_int32_t		*tmp;
+	u_int64_t		 gen;		/* packet cand was computed for */
+};
+
+/* temporary entry used while sorting the prefixes */
+struct pf_rule_index_ent {
+	struct pf_addr		 addr;
+	u_int32_t		 nr;
+	u_int8_t		 plen;
+};
+
+/* temporary port range used while building the segment tree */
+struct pf_rule_index_range {
+	u_int32_t		 lo, hi;	/* inclusive, host order */
+	u_int32_t		 nr;
+};
+
+int pf_rule_index_enabled = 1;
+u_int64_t pf_rule_index_gen;
+
+__private_extern__ void qsort(void *, size_t, size_t,
+    int (*)(const void *, const void *));
+
+static struct pf_rule_index *pf_rule_index_build(struct pf_rulequeue *,
+    u_int32_t);
+static void pf_rule_index_free(struct pf_rule_index *);
+static int pf_rule_index_prefix(struct pf_rule_addr *, sa_family_t,
+    struct pf_addr *, u_int8_t *);
+static int pf_rule_index_build_atab(struct pf_rule_index *,
+    struct pf_rule_index_atab *, struct pf_rule_index_ent *, u_int32_t);
+static int pf_rule_index_build_ports(struct pf_rule_index *,
+    struct pf_rule_index_range *, u_int32_t);
+static int pf_rule_index_ent_cmp(const void *, const void *);
+static int pf_rule_index_port_cmp(const void *, const void *);
+static void pf_rule_index_compute(struct pf_rule_index *, struct pf_pdesc *);
+
+#define	PF_RI_SETBIT(b, n)	((b)[(n) >> 5] |= (1U << ((n) & 31)))
+
+static inline int
+pf_rule_index_af(sa_family_t af)
+{
+	switch (af) {
+#if INET
+	case AF_INET:
+		return (PF_RI_INET);
+#endif /* INET */
+#if INET6
+	case AF_INET6:
+		return (PF_RI_INET6);
+#endif /* INET6 */
+	}
+	return (-1);
+}
+
+/*
+ * Rebuild the index of a ruleset after its active filter rules changed.
+ * Called with pf_lock held wherever the skip steps are recomputed.
+ */
+void
+pf_rule_index_update(struct pf_ruleset *rs, int rs_num)
+{
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rs_num != PF_RULESET_FILTER)
+		return;
+
+	pf_rule_index_remove(rs, rs_num);
+	if (!pf_rule_index_enabled ||
+	    rs->rules[rs_num].active.rcount < PF_RULE_INDEX_MIN)
+		return;
+
+	rs->rules[rs_num].index = pf_rule_index_build(
+	    rs->rules[rs_num].active.ptr, rs->rules[rs_num].active.rcount);
+}
+
+/*
+ * Drop the index of a ruleset; it is walked linearly until the next
+ * pf_rule_index_update().
+ */
+void
+pf_rule_index_remove(struct pf_ruleset *rs, int rs_num)
+{
+	lck_mtx_assert(pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rs->rules[rs_num].index != NULL) {
+		pf_rule_index_free(rs->rules[rs_num].index);
+		rs->rules[rs_num].index = NULL;
+	}
+}
+
+static struct pf_rule_index *
+pf_rule_index_build(struct pf_rulequeue *rules, u_int32_t n)
+{
+	struct pf_rule_index		*ri;
+	struct pf_rule_index_ent	*ent = NULL;
+	struct pf_rule_index_range	*range = NULL;
+	struct pf_rule			*r;
+	u_int32_t			 nr, nent[2][PF_RI_NAF], nrange;
+	int				 f;
+
+	ri = _MALLOC(sizeof (*ri), M_TEMP, M_WAITOK | M_ZERO);
+	if (ri == NULL)
+		return (NULL);
+	ri->nrules = n;
+	ri->words = (n + 31) >> 5;
+	ri->rules = _MALLOC(n * sizeof (*ri->rules), M_TEMP, M_WAITOK);
+	ri->bits = _MALLOC(5 * ri->words * sizeof (u_int32_t), M_TEMP,
+	    M_WAITOK | M_ZERO);
+	ent = _MALLOC(2 * n * sizeof (*ent), M_TEMP, M_WAITOK | M_ZERO);
+	range = _MALLOC(2 * n * sizeof (*range), M_TEMP, M_WAITOK);
+	if (ri->rules == NULL || ri->bits == NULL || ent == NULL ||
+	    range == NULL)
+		goto fail;
+	ri->src_any = ri->bits;
+	ri->dst_any = ri->src_any + ri->words;
+	ri->dport_any = ri->dst_any + ri->words;
+	ri->cand = ri->dport_any + ri->words;
+	ri->tmp = ri->cand + ri->words;
+
+	/*
+	 * Source prefixes are collected from the front of ent and
+	 * destination prefixes from the back; each family is sorted
+	 * separately below.
+	 */
+	bzero(nent, sizeof (nent));
+	nrange = 0;
+	nr = 0;
+	TAILQ_FOREACH(r, rules, entries) {
+		struct pf_rule_index_ent	*e;
+		u_int16_t			 a1, a2;
+
+		/* pf_test_rule() relies on nr being the rule's position */
+		if (nr >= n || r->nr != nr)
+			goto fail;
+		ri->rules[nr] = r;
+
+		f = pf_rule_index_af(r->af);
+		e = &ent[nent[0][0] + nent[0][1]];
+		if (f >= 0 && pf_rule_index_prefix(&r->src, r->af, &e->addr,
+		    &e->plen)) {
+			e->nr = nr | ((u_int32_t)f << 31);
+			nent[0][f]++;
+		} else {
+			PF_RI_SETBIT(ri->src_any, nr);
+		}
+		e = &ent[2 * n - 1 - nent[1][0] - nent[1][1]];
+		if (f >= 0 && pf_rule_index_prefix(&r->dst, r->af, &e->addr,
+		    &e->plen)) {
+			e->nr = nr | ((u_int32_t)f << 31);
+			nent[1][f]++;
+		} else {
+			PF_RI_SETBIT(ri->dst_any, nr);
+		}
+
+		/* see the port tests in pf_test_rule() */
+		if ((r->proto != IPPROTO_TCP && r->proto != IPPROTO_UDP) ||
+		    r->dst.xport.range.op == PF_OP_NONE) {
+			PF_RI_SETBIT(ri->dport_any, nr);
+			nr++;
+			continue;
+		}
+		a1 = ntohs(r->dst.xport.range.port[0]);
+		a2 = ntohs(r->dst.xport.range.port[1]);
+#define	PF_RI_RANGE(l, h) do {						\
+	if ((int)(l) <= (int)(h)) {					\
+		range[nrange].lo = (l);					\
+		range[nrange].hi = (h);					\
+		range[nrange].nr = nr;					\
+		nrange++;						\
+	}								\
+} while (0)
+		switch (r->dst.xport.range.op) {
+		case PF_OP_IRG:
+			PF_RI_RANGE(a1 + 1, a2 - 1);
+			break;
+		case PF_OP_XRG:
+			PF_RI_RANGE(0, a1 - 1);
+			PF_RI_RANGE(a2 + 1, 65535);
+			break;
+		case PF_OP_RRG:
+			PF_RI_RANGE(a1, a2);
+			break;
+		case PF_OP_EQ:
+			PF_RI_RANGE(a1, a1);
+			break;
+		case PF_OP_NE:
+			PF_RI_RANGE(0, a1 - 1);
+			PF_RI_RANGE(a1 + 1, 65535);
+			break;
+		case PF_OP_LT:
+			PF_RI_RANGE(0, a1 - 1);
+			break;
+		case PF_OP_LE:
+			PF_RI_RANGE(0, a1);
+			break;
+		case PF_OP_GT:
+			PF_RI_RANGE(a1 + 1, 65535);
+			break;
+		case PF_OP_GE:
+			PF_RI_RANGE(a1, 65535);
+			break;
+		default:
+			PF_RI_SETBIT(ri->dport_any, nr);
+			break;
+		}
+#undef PF_RI_RANGE
+		nr++;
+	}
+	if (nr != n)
+		goto fail;
+
+	/* split each field's entries by family: INET sorts first */
+	qsort(ent, nent[0][0] + nent[0][1], sizeof (*ent),
+	    pf_rule_index_ent_cmp);
+	qsort(&ent[2 * n - nent[1][0] - nent[1][1]], nent[1][0] + nent[1][1],
+	    sizeof (*ent), pf_rule_index_ent_cmp);
+
+	if (pf_rule_index_build_atab(ri, &ri->src[PF_RI_INET], ent,
+	    nent[0][PF_RI_INET]) ||
+	    pf_rule_index_build_atab(ri, &ri->src[PF_RI_INET6],
+	    &ent[nent[0][PF_RI_INET]], nent[0][PF_RI_INET6]) ||
+	    pf_rule_index_build_atab(ri, &ri->dst[PF_RI_INET],
+	    &ent[2 * n - nent[1][0] - nent[1][1]], nent[1][PF_RI_INET]) ||
+	    pf_rule_index_build_atab(ri, &ri->dst[PF_RI_INET6],
+	    &ent[2 * n - nent[1][PF_RI_INET6]], nent[1][PF_RI_INET6]) ||
+	    pf_rule_index_build_ports(ri, range, nrange))
+		goto fail;
+
+	_FREE(ent, M_TEMP);
+	_FREE(range, M_TEMP);
+	return (ri);
+
+fail:
+	if (ent != NULL)
+		_FREE(ent, M_TEMP);
+	if (range != NULL)
+		_FREE(range, M_TEMP);
+	pf_rule_index_free(ri);
+	return (NULL);
+}
+
+static void
+pf_rule_index_free(struct pf_rule_index *ri)
+{
+	int	f;
+
+	for (f = 0; f < PF_RI_NAF; f++) {
+		if (ri->src[f].prefix != NULL)
+			_FREE(ri->src[f].prefix, M_TEMP);
+		if (ri->src[f].nrs != NULL)
+			_FREE(ri->src[f].nrs, M_TEMP);
+		if (ri->dst[f].prefix != NULL)
+			_FREE(ri->dst[f].prefix, M_TEMP);
+		if (ri->dst[f].nrs != NULL)
+			_FREE(ri->dst[f].nrs, M_TEMP);
+		if (ri->src[f].bitmaps != NULL)
+			_FREE(ri->src[f].bitmaps, M_TEMP);
+		if (ri->dst[f].bitmaps != NULL)
+			_FREE(ri->dst[f].bitmaps, M_TEMP);
+	}
+	if (ri->dport.lo != NULL)
+		_FREE(ri->dport.lo, M_TEMP);
+	if (ri->dport.node != NULL)
+		_FREE(ri->dport.node, M_TEMP);
+	if (ri->dport.nrs != NULL)
+		_FREE(ri->dport.nrs, M_TEMP);
+	if (ri->dport.dense != NULL)
+		_FREE(ri->dport.dense, M_TEMP);
+	if (ri->dport.bitmaps != NULL)
+		_FREE(ri->dport.bitmaps, M_TEMP);
+	if (ri->bits != NULL)
+		_FREE(ri->bits, M_TEMP);
+	if (ri->rules != NULL)
+		_FREE(ri->rules, M_TEMP);
+	_FREE(ri, M_TEMP);
+}
+
+/*
+ * Return 1 and the masked address and prefix length if the address
+ * test of a rule is a plain, non-negated, contiguous address/mask,
+ * i.e. the part of PF_MISMATCHAW() that can be indexed.
+ */
+static int
+pf_rule_index_prefix(struct pf_rule_addr *ra, sa_family_t af,
+    struct pf_addr *addr, u_int8_t *plen)
+{
+	u_int32_t	m;
+	int		i, nw, bits;
+
+	if (ra->neg || ra->addr.type != PF_ADDR_ADDRMASK)
+		return (0);
+
+	nw = (af == AF_INET) ? 1 : 4;
+	bzero(addr, sizeof (*addr));
+	*plen = 0;
+	for (i = 0; i < nw; i++) {
+		m = ntohl(ra->addr.v.a.mask.addr32[i]);
+		if (m == 0xffffffff) {
+			*plen += 32;
+			addr->addr32[i] = ra->addr.v.a.addr.addr32[i];
+			continue;
+		}
+		for (bits = 0; bits < 32 && (m & (0x80000000U >> bits));
+		    bits++)
+			;
+		if (bits != 0 && m != (0xffffffffU << (32 - bits)))
+			return (0);
+		if (bits == 0 && m != 0)
+			return (0);
+		*plen += bits;
+		addr->addr32[i] = ra->addr.v.a.addr.addr32[i] &
+		    ra->addr.v.a.mask.addr32[i];
+		/* the remaining words of the mask must be empty */
+		for (i++; i < nw; i++)
+			if (ra->addr.v.a.mask.addr32[i] != 0)
+				return (0);
+		break;
+	}
+
+	/* a zero mask matches any address */
+	return (*plen != 0);
+}
+
+/* by family, then longest prefix first, then address, then rule */
+static int
+pf_rule_index_ent_cmp(const void *a, const void *b)
+{
+	const struct pf_rule_index_ent *ea = a, *eb = b;
+	int	c;
+
+	if ((ea->nr >> 31) != (eb->nr >> 31))
+		return ((ea->nr >> 31) < (eb->nr >> 31) ? -1 : 1);
+	if (ea->plen != eb->plen)
+		return (ea->plen > eb->plen ? -1 : 1);
+	if ((c = memcmp(&ea->addr, &eb->addr, sizeof (ea->addr))) != 0)
+		return (c);
+	if (ea->nr != eb->nr)
+		return (ea->nr < eb->nr ? -1 : 1);
+	return (0);
+}
+
+static int
+pf_rule_index_build_atab(struct pf_rule_index *ri,
+    struct pf_rule_index_atab *at, struct pf_rule_index_ent *ent, u_int32_t n)
+{
+	u_int32_t	i, np;
+
+	bzero(at, sizeof (*at));
+	if (n == 0)
+		return (0);
+
+	at->prefix = _MALLOC(n * sizeof (*at->prefix), M_TEMP, M_WAITOK);
+	at->nrs = _MALLOC(n * sizeof (*at->nrs), M_TEMP, M_WAITOK);
+	if (at->prefix == NULL || at->nrs == NULL)
+		return (ENOMEM);
+
+	np = 0;
+	for (i = 0; i < n; i++) {
+		at->nrs[i] = ent[i].nr & ~(1U << 31);
+		VERIFY(at->nrs[i] < ri->nrules);
+		if (i > 0 && ent[i].plen == ent[i - 1].plen &&
+		    memcmp(&ent[i].addr, &ent[i - 1].addr,
+		    sizeof (ent[i].addr)) == 0) {
+			at->prefix[np - 1].count++;
+			continue;
+		}
+		if (i == 0 || ent[i].plen != ent[i - 1].plen) {
+			at->plen[at->nlens] = ent[i].plen;
+			at->start[at->nlens] = np;
+			at->nlens++;
+		}
+		at->prefix[np].addr = ent[i].addr;
+		at->prefix[np].first = i;
+		at->prefix[np].count = 1;
+		np++;
+	}
+	at->start[at->nlens] = np;
+
+	/* prefixes shared by more rules than a bitmap has words get one */
+	for (i = 0, n = 0; i < np; i++)
+		at->prefix[i].dense = (at->prefix[i].count > ri->words) ?
+		    n++ : PF_RI_SPARSE;
+	if (n == 0)
+		return (0);
+	at->bitmaps = _MALLOC(n * ri->words * sizeof (u_int32_t), M_TEMP,
+	    M_WAITOK | M_ZERO);
+	if (at->bitmaps == NULL)
+		return (ENOMEM);
+	for (i = 0; i < np; i++) {
+		struct pf_rule_index_prefix *p = &at->prefix[i];
+		u_int32_t j;
+
+		if (p->dense == PF_RI_SPARSE)
+			continue;
+		for (j = p->first; j < p->first + p->count; j++)
+			PF_RI_SETBIT(&at->bitmaps[p->dense * ri->words],
+			    at->nrs[j]);
+	}
+
+	return (0);
+}
+
+/* set a list of rules, or or in their bitmap if they have one */
+static inline void
+pf_rule_index_set(struct pf_rule_index *ri, u_int32_t dense,
+    u_int32_t *bitmaps, u_int32_t *nrs, u_int32_t count, u_int32_t *bits)
+{
+	u_int32_t	*b, i;
+
+	if (dense != PF_RI_SPARSE) {
+		b = &bitmaps[dense * ri->words];
+		for (i = 0; i < ri->words; i++)
+			bits[i] |= b[i];
+		return;
+	}
+	for (i = 0; i < count; i++)
+		PF_RI_SETBIT(bits, nrs[i]);
+}
+
+/* set the rules whose prefix in at contains addr */
+static void
+pf_rule_index_atab_lookup(struct pf_rule_index *ri,
+    struct pf_rule_index_atab *at,
+    struct pf_addr *addr, int nw, u_int32_t *bits)
+{
+	struct pf_rule_index_prefix	*p;
+	struct pf_addr			 key;
+	u_int32_t			 l, lo, hi, mid;
+	int				 c, w, plen;
+
+	bzero(&key, sizeof (key));
+	for (l = 0; l < at->nlens; l++) {
+		plen = at->plen[l];
+		for (w = 0; w < nw && plen > 0; w++, plen -= 32) {
+			key.addr32[w] = addr->addr32[w];
+			if (plen < 32)
+				key.addr32[w] &= htonl(0xffffffffU << (32 - plen));
+		}
+
+		lo = at->start[l];
+		hi = at->start[l + 1];
+		while (lo < hi) {
+			mid = (lo + hi) >> 1;
+			p = &at->prefix[mid];
+			/* the words past nw are zero in both */
+			c = memcmp(&key, &p->addr, nw * sizeof (u_int32_t));
+			if (c == 0) {
+				pf_rule_index_set(ri, p->dense, at->bitmaps,
+				    &at->nrs[p->first], p->count, bits);
+				break;
+			}
+			if (c < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+	}
+}
+
+static int
+pf_rule_index_port_cmp(const void *a, const void *b)
+{
+	u_int32_t	pa = *(const u_int32_t *)a, pb = *(const u_int32_t *)b;
+
+	return (pa < pb ? -1 : (pa > pb ? 1 : 0));
+}
+
+/* index of the segment containing port */
+static u_int32_t
+pf_rule_index_segment(struct pf_rule_index_ports *pt, u_int32_t port)
+{
+	u_int32_t	lo = 0, hi = pt->nsegs, mid;
+
+	/* last segment starting at or below port; lo[0] is 0 */
+	while (hi - lo > 1) {
+		mid = (lo + hi) >> 1;
+		if (pt->lo[mid] <= port)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static int
+pf_rule_index_build_ports(struct pf_rule_index *ri,
+    struct pf_rule_index_range *range, u_int32_t nrange)
+{
+	struct pf_rule_index_ports	*pt = &ri->dport;
+	u_int32_t			*bounds, *fill;
+	u_int32_t			 i, n, l, h, pass;
+
+	bzero(pt, sizeof (*pt));
+	if (nrange == 0)
+		return (0);
+
+	/* segment boundaries: 0 and the start and end + 1 of each range */
+	bounds = _MALLOC((2 * nrange + 1) * sizeof (*bounds), M_TEMP,
+	    M_WAITOK);
+	if (bounds == NULL)
+		return (ENOMEM);
+	n = 0;
+	bounds[n++] = 0;
+	for (i = 0; i < nrange; i++) {
+		bounds[n++] = range[i].lo;
+		if (range[i].hi < 65535)
+			bounds[n++] = range[i].hi + 1;
+	}
+	qsort(bounds, n, sizeof (*bounds), pf_rule_index_port_cmp);
+
+	pt->lo = _MALLOC(n * sizeof (*pt->lo), M_TEMP, M_WAITOK);
+	if (pt->lo == NULL) {
+		_FREE(bounds, M_TEMP);
+		return (ENOMEM);
+	}
+	for (i = 0; i < n; i++)
+		if (i == 0 || bounds[i] != bounds[i - 1])
+			pt->lo[pt->nsegs++] = bounds[i];
+	_FREE(bounds, M_TEMP);
+
+	for (pt->size = 1; pt->size < pt->nsegs; pt->size <<= 1)
+		;
+	pt->node = _MALLOC((2 * pt->size + 1) * sizeof (*pt->node), M_TEMP,
+	    M_WAITOK | M_ZERO);
+	fill = _MALLOC(2 * pt->size * sizeof (*fill), M_TEMP,
+	    M_WAITOK | M_ZERO);
+	if (pt->node == NULL || fill == NULL) {
+		if (fill != NULL)
+			_FREE(fill, M_TEMP);
+		return (ENOMEM);
+	}
+
+	/*
+	 * Each range is stored in the O(log n) nodes covering exactly its
+	 * segments; the first pass counts them, the second fills nrs.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nrange; i++) {
+			l = pf_rule_index_segment(pt, range[i].lo) + pt->size;
+			h = pf_rule_index_segment(pt, range[i].hi) + pt->size + 1;
+			for (; l < h; l >>= 1, h >>= 1) {
+				if (l & 1) {
+					if (pass == 0)
+						pt->node[l + 1]++;
+					else
+						pt->nrs[fill[l]++] = range[i].nr;
+					l++;
+				}
+				if (h & 1) {
+					h--;
+					if (pass == 0)
+						pt->node[h + 1]++;
+					else
+						pt->nrs[fill[h]++] = range[i].nr;
+				}
+			}
+		}
+		if (pass == 0) {
+			for (i = 1; i <= 2 * pt->size; i++)
+				pt->node[i] += pt->node[i - 1];
+			pt->nrs = _MALLOC((pt->node[2 * pt->size] + 1) *
+			    sizeof (*pt->nrs), M_TEMP, M_WAITOK);
+			if (pt->nrs == NULL) {
+				_FREE(fill, M_TEMP);
+				return (ENOMEM);
+			}
+			bcopy(pt->node, fill, 2 * pt->size * sizeof (*fill));
+		}
+	}
+	_FREE(fill, M_TEMP);
+
+	/*
+	 * Wide ranges (port > 1023, != 80, ...) pile up in the nodes near
+	 * the root; nodes with more rules than a bitmap has words also get
+	 * a bitmap, which is or'ed in rather than set bit by bit.
+	 */
+	pt->dense = _MALLOC(2 * pt->size * sizeof (*pt->dense), M_TEMP,
+	    M_WAITOK);
+	if (pt->dense == NULL)
+		return (ENOMEM);
+	for (i = 0, n = 0; i < 2 * pt->size; i++)
+		pt->dense[i] = (pt->node[i + 1] - pt->node[i] > ri->words) ?
+		    n++ : PF_RI_SPARSE;
+	if (n == 0)
+		return (0);
+	pt->bitmaps = _MALLOC(n * ri->words * sizeof (u_int32_t), M_TEMP,
+	    M_WAITOK | M_ZERO);
+	if (pt->bitmaps == NULL)
+		return (ENOMEM);
+	for (i = 0; i < 2 * pt->size; i++) {
+		if (pt->dense[i] == PF_RI_SPARSE)
+			continue;
+		for (l = pt->node[i]; l < pt->node[i + 1]; l++)
+			PF_RI_SETBIT(&pt->bitmaps[pt->dense[i] * ri->words],
+			    pt->nrs[l]);
+	}
+
+	return (0);
+}
+
+/* set the rules whose port range contains port */
+static void
+pf_rule_index_ports_lookup(struct pf_rule_index *ri, u_int32_t port,
+    u_int32_t *bits)
+{
+	struct pf_rule_index_ports	*pt = &ri->dport;
+	u_int32_t			 i;
+
+	if (pt->nsegs == 0)
+		return;
+	for (i = pf_rule_index_segment(pt, port) + pt->size; i > 0; i >>= 1) {
+		pf_rule_index_set(ri, pt->dense[i], pt->bitmaps,
+		    &pt->nrs[pt->node[i]], pt->node[i + 1] - pt->node[i], bits);
+	}
+}
+
+static void
+pf_rule_index_compute(struct pf_rule_index *ri, struct pf_pdesc *pd)
+{
+	u_int32_t	w, port;
+	int		f, nw;
+
+	bcopy(ri->src_any, ri->cand, ri->words * sizeof (u_int32_t));
+	bcopy(ri->dst_any, ri->tmp, ri->words * sizeof (u_int32_t));
+	if ((f = pf_rule_index_af(pd->af)) >= 0) {
+		nw = (f == PF_RI_INET) ? 1 : 4;
+		pf_rule_index_atab_lookup(ri, &ri->src[f], pd->src, nw, ri->cand);
+		pf_rule_index_atab_lookup(ri, &ri->dst[f], pd->dst, nw, ri->tmp);
+	}
+	for (w = 0; w < ri->words; w++)
+		ri->cand[w] &= ri->tmp[w];
+
+	if (pd->proto != IPPROTO_TCP && pd->proto != IPPROTO_UDP)
+		return;
+	if (pd->proto == IPPROTO_TCP)
+		port = ntohs(pd->hdr.tcp->th_dport);
+	else
+		port = ntohs(pd->hdr.udp->uh_dport);
+	bcopy(ri->dport_any, ri->tmp, ri->words * sizeof (u_int32_t));
+	pf_rule_index_ports_lookup(ri, port, ri->tmp);
+	for (w = 0; w < ri->words; w++)
+		ri->cand[w] &= ri->tmp[w];
+}
+
+/*
+ * Return the first rule at or after r that can match the packet, or
+ * NULL if none is left in r's ruleset.  The candidates are computed
+ * once per pf_rule_index_gen, which pf_test_rule() bumps per packet.
+ */
+struct pf_rule *
+pf_rule_index_next(struct pf_rule_index *ri, struct pf_rule *r,
+    struct pf_pdesc *pd)
+{
+	u_int32_t	nr = r->nr, w, bits;
+
+	if (nr >= ri->nrules || ri->rules[nr] != r)
+		return (r);
+
+	if (ri->gen != pf_rule_index_gen) {
+		pf_rule_index_compute(ri, pd);
+		ri->gen = pf_rule_index_gen;
+	}
+
+	w = nr >> 5;
+	bits = ri->cand[w] & (0xffffffffU << (nr & 31));
+	while (bits == 0) {
+		if (++w == ri->words)
+			return (NULL);
+		bits = ri->cand[w];
+	}
+	return (ri->rules[(w << 5) + ffs(bits) - 1]);
+}
@@ -1182,6 +1182,7 @@ struct pfsync_state {
 TAILQ_HEAD(pf_rulequeue, pf_rule);
 
 struct pf_anchor;
+struct pf_rule_index;
 
 struct pf_ruleset {
 	struct {
@@ -1193,6 +1194,7 @@ struct pf_ruleset {
 			u_int32_t		 ticket;
 			int			 open;
 		}			 active, inactive;
+		struct pf_rule_index	*index;		/* of active rules */
 	}			 rules[PF_RULESET_MAX];
 	struct pf_anchor	*anchor;
 	u_int32_t		 tticket;
@@ -2166,6 +2168,12 @@ __private_extern__ int pf_tbladdr_setup(struct pf_ruleset *,
 __private_extern__ void pf_tbladdr_remove(struct pf_addr_wrap *);
 __private_extern__ void pf_tbladdr_copyout(struct pf_addr_wrap *);
 __private_extern__ void pf_calc_skip_steps(struct pf_rulequeue *);
+__private_extern__ void pf_rule_index_update(struct pf_ruleset *, int);
+__private_extern__ void pf_rule_index_remove(struct pf_ruleset *, int);
+__private_extern__ struct pf_rule *pf_rule_index_next(struct pf_rule_index *,
+    struct pf_rule *, struct pf_pdesc *);
+extern int pf_rule_index_enabled;
+extern u_int64_t pf_rule_index_gen;
 __private_extern__ u_int32_t pf_calc_state_key_flowhash(struct pf_state_key *);
 
 extern struct pool pf_src_tree_pl, pf_rule_pl;
@@ -143,13 +143,15 @@ pktsched_setup(struct ifclassq *ifq, u_int32_t scheduler, u_int32_t sflags)
 		return (0);
 
 	qflags &= (PKTSCHEDF_QALG_RED | PKTSCHEDF_QALG_RIO |
-	    PKTSCHEDF_QALG_BLUE | PKTSCHEDF_QALG_SFB);
+	    PKTSCHEDF_QALG_BLUE | PKTSCHEDF_QALG_SFB | PKTSCHEDF_QALG_FQ_CODEL);
 
 	/* These are mutually exclusive */
 	if (qflags != 0 &&
 	    qflags != PKTSCHEDF_QALG_RED && qflags != PKTSCHEDF_QALG_RIO &&
-	    qflags != PKTSCHEDF_QALG_BLUE && qflags != PKTSCHEDF_QALG_SFB) {
-		panic("%s: RED|RIO|BLUE|SFB mutually exclusive\n", __func__);
+	    qflags != PKTSCHEDF_QALG_BLUE && qflags != PKTSCHEDF_QALG_SFB &&
+	    qflags != PKTSCHEDF_QALG_FQ_CODEL) {
+		panic("%s: RED|RIO|BLUE|SFB|FQ_CODEL mutually exclusive\n",
+		    __func__);
 		/* NOTREACHED */
 	}
 
@@ -92,6 +92,7 @@ static int qfq_destroy_locked(struct qfq_if *);
 static inline int qfq_addq(struct qfq_class *, struct mbuf *, struct pf_mtag *);
 static inline struct mbuf *qfq_getq(struct qfq_class *);
 static inline struct mbuf *qfq_pollq(struct qfq_class *);
+static inline void qfq_qalg_dropped(struct qfq_class *, u_int32_t, u_int32_t);
 static void qfq_purgeq(struct qfq_if *, struct qfq_class *, u_int32_t,
     u_int32_t *, u_int32_t *);
 static void qfq_purge_sc(struct qfq_if *, cqrq_purge_sc_t *);
@@ -423,7 +424,7 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 	struct qfq_group *grp;
 	struct qfq_class *cl;
 	u_int32_t w;			/* approximated weight */
-	int i;
+	int i, qalg;
 
 	IFCQ_LOCK_ASSERT_HELD(qif->qif_ifq);
 
@@ -463,12 +464,10 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 
 	/* These are mutually exclusive */
-	if ((flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_RED &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_RIO &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_BLUE &&
-	    (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) != QFCF_SFB) {
-		log(LOG_ERR, "%s: %s more than one RED|RIO|BLUE|SFB\n",
+	qalg = (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL));
+	if (qalg != 0 && qalg != QFCF_RED && qalg != QFCF_RIO &&
+	    qalg != QFCF_BLUE && qalg != QFCF_SFB && qalg != QFCF_FQ_CODEL) {
+		log(LOG_ERR, "%s: %s more than one RED|RIO|BLUE|SFB|FQ_CODEL\n",
 		    if_name(QFQIF_IFP(qif)), qfq_style(qif));
 		return (NULL);
 	}
@@ -561,7 +560,7 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 	if (flags & QFCF_DEFAULTCLASS)
 		qif->qif_default = cl;
 
-	if (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB)) {
+	if (flags & (QFCF_RED|QFCF_RIO|QFCF_BLUE|QFCF_SFB|QFCF_FQ_CODEL)) {
 #if CLASSQ_RED || CLASSQ_RIO
 		u_int64_t ifbandwidth = ifnet_output_linkrate(ifp);
 		int pkttime;
@@ -573,6 +572,8 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 				cl->cl_qflags |= BLUEF_ECN;
 			else if (flags & QFCF_SFB)
 				cl->cl_qflags |= SFBF_ECN;
+			else if (flags & QFCF_FQ_CODEL)
+				cl->cl_qflags |= FQCODELF_ECN;
 			else if (flags & QFCF_RED)
 				cl->cl_qflags |= REDF_ECN;
 			else if (flags & QFCF_RIO)
@@ -581,10 +582,14 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 		if (flags & QFCF_FLOWCTL) {
 			if (flags & QFCF_SFB)
 				cl->cl_qflags |= SFBF_FLOWCTL;
+			else if (flags & QFCF_FQ_CODEL)
+				cl->cl_qflags |= FQCODELF_FLOWCTL;
 		}
 		if (flags & QFCF_DELAYBASED) {
 			if (flags & QFCF_SFB)
 				cl->cl_qflags |= SFBF_DELAYBASED;
+			else if (flags & QFCF_FQ_CODEL)
+				cl->cl_qflags |= FQCODELF_DELAYBASED;
 		}
 		if (flags & QFCF_CLEARDSCP) {
 			if (flags & QFCF_RIO)
@@ -635,6 +640,15 @@ qfq_class_create(struct qfq_if *qif, u_int32_t weight, u_int32_t qlimit,
 			if (cl->cl_sfb != NULL || (cl->cl_flags & QFCF_LAZY))
 				qtype(&cl->cl_q) = Q_SFB;
 		}
+		if (flags & QFCF_FQ_CODEL) {
+			if (!(cl->cl_flags & QFCF_LAZY))
+				cl->cl_fq_codel = fq_codel_alloc(ifp,
+				    cl->cl_handle, qlimit(&cl->cl_q),
+				    cl->cl_qflags);
+			if (cl->cl_fq_codel != NULL ||
+			    (cl->cl_flags & QFCF_LAZY))
+				qtype(&cl->cl_q) = Q_FQ_CODEL;
+		}
 	}
 
 	if (pktsched_verbose) {
@@ -698,6 +712,8 @@ qfq_class_destroy(struct qfq_if *qif, struct qfq_class *cl)
 #endif /* CLASSQ_BLUE */
 		if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 			sfb_destroy(cl->cl_sfb);
+		if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+			fq_codel_destroy(cl->cl_fq_codel);
 		cl->cl_qalg.ptr = NULL;
 		qtype(&cl->cl_q) = Q_DROPTAIL;
 		qstate(&cl->cl_q) = QS_RUNNING;
@@ -911,7 +927,10 @@ qfq_update_class(struct qfq_if *qif, struct qfq_group *grp,
 		u_int32_t len;
 		u_int64_t roundedS;
 
-		len = m_pktlen(qhead(&cl->cl_q));
+		if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+			len = fq_codel_headlen(cl->cl_fq_codel);
+		else
+			len = m_pktlen(qhead(&cl->cl_q));
 		cl->cl_F = cl->cl_S + (u_int64_t)len * cl->cl_inv_w;
 		roundedS = qfq_round_down(cl->cl_S, grp->qfg_slot_shift);
 		if (roundedS == grp->qfg_S)
@@ -1367,6 +1386,50 @@ qfq_addq(struct qfq_class *cl, struct mbuf *m, struct pf_mtag *t)
 		}
 		if (cl->cl_sfb != NULL)
 			return (sfb_addq(cl->cl_sfb, &cl->cl_q, m, t));
+	} else if (q_is_fq_codel(&cl->cl_q)) {
+		if (cl->cl_fq_codel == NULL) {
+			struct ifnet *ifp = QFQIF_IFP(qif);
+
+			VERIFY(cl->cl_flags & QFCF_LAZY);
+			cl->cl_flags &= ~QFCF_LAZY;
+			IFCQ_CONVERT_LOCK(ifq);
+
+			cl->cl_fq_codel = fq_codel_alloc(ifp, cl->cl_handle,
+			    qlimit(&cl->cl_q), cl->cl_qflags);
+			if (cl->cl_fq_codel == NULL) {
+				/* fall back to droptail */
+				qtype(&cl->cl_q) = Q_DROPTAIL;
+				cl->cl_flags &= ~QFCF_FQ_CODEL;
+				cl->cl_qflags &= ~(FQCODELF_ECN |
+				    FQCODELF_FLOWCTL);
+
+				log(LOG_ERR, "%s: %s FQ-CoDel lazy allocation "
+				    "failed for qid=%d grp=%d, falling back "
+				    "to DROPTAIL\n", if_name(ifp),
+				    qfq_style(qif), cl->cl_handle,
+				    cl->cl_grp->qfg_index);
+			} else if (qif->qif_throttle != IFNET_THROTTLE_OFF) {
+				/* if there's pending throttling, set it */
+				cqrq_throttle_t tr = { 1, qif->qif_throttle };
+				int err = qfq_throttle(qif, &tr);
+
+				if (err == EALREADY)
+					err = 0;
+				if (err != 0) {
+					tr.level = IFNET_THROTTLE_OFF;
+					(void) qfq_throttle(qif, &tr);
+				}
+			}
+		}
+		if (cl->cl_fq_codel != NULL) {
+			u_int32_t cnt, len;
+			int ret;
+
+			ret = fq_codel_addq(cl->cl_fq_codel, &cl->cl_q, m, t,
+			    &cnt, &len);
+			qfq_qalg_dropped(cl, cnt, len);
+			return (ret);
+		}
 	} else if (qlen(&cl->cl_q) >= qlimit(&cl->cl_q)) {
 		IFCQ_CONVERT_LOCK(ifq);
 		m_freem(m);
@@ -1405,6 +1468,14 @@ qfq_getq(struct qfq_class *cl)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		return (sfb_getq(cl->cl_sfb, &cl->cl_q));
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL) {
+		u_int32_t cnt, len;
+		struct mbuf *m;
+
+		m = fq_codel_getq(cl->cl_fq_codel, &cl->cl_q, &cnt, &len);
+		qfq_qalg_dropped(cl, cnt, len);
+		return (m);
+	}
 
 	return (_getq(&cl->cl_q));
 }
@@ -1414,9 +1485,36 @@ qfq_pollq(struct qfq_class *cl)
 {
 	IFCQ_LOCK_ASSERT_HELD(cl->cl_qif->qif_ifq);
 
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL) {
+		u_int32_t cnt, len;
+		struct mbuf *m;
+
+		m = fq_codel_pollq(cl->cl_fq_codel, &cl->cl_q, &cnt, &len);
+		qfq_qalg_dropped(cl, cnt, len);
+		return (m);
+	}
+
 	return (qhead(&cl->cl_q));
 }
 
+/*
+ * Account for packets the queue algorithm dropped on its own, other
+ * than the one being enqueued; they were counted in the interface queue.
+ */
+static inline void
+qfq_qalg_dropped(struct qfq_class *cl, u_int32_t cnt, u_int32_t len)
+{
+	struct ifclassq *ifq = cl->cl_qif->qif_ifq;
+
+	if (cnt == 0)
+		return;
+
+	PKTCNTR_ADD(&cl->cl_dropcnt, cnt, len);
+	IFCQ_DROP_ADD(ifq, cnt, len);
+	VERIFY(((signed)IFCQ_LEN(ifq) - cnt) >= 0);
+	IFCQ_LEN(ifq) -= cnt;
+}
+
 static void
 qfq_purgeq(struct qfq_if *qif, struct qfq_class *cl, u_int32_t flow,
     u_int32_t *packets, u_int32_t *bytes)
@@ -1449,6 +1547,8 @@ qfq_purgeq(struct qfq_if *qif, struct qfq_class *cl, u_int32_t flow,
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		sfb_purgeq(cl->cl_sfb, &cl->cl_q, flow, &cnt, &len);
+	else if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		fq_codel_purgeq(cl->cl_fq_codel, &cl->cl_q, flow, &cnt, &len);
 	else
 		_flushq_flow(&cl->cl_q, flow, &cnt, &len);
 
@@ -1510,6 +1610,8 @@ qfq_updateq(struct qfq_if *qif, struct qfq_class *cl, cqev_t ev)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		return (sfb_updateq(cl->cl_sfb, ev));
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		return (fq_codel_updateq(cl->cl_fq_codel, ev));
 }
 
 int
@@ -1549,6 +1651,8 @@ qfq_get_class_stats(struct qfq_if *qif, u_int32_t qid,
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		sfb_getstats(cl->cl_sfb, &sp->sfb);
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		fq_codel_getstats(cl->cl_fq_codel, &sp->fq_codel);
 
 	return (0);
 }
@@ -1814,6 +1918,8 @@ qfq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 		qflags |= QFCF_BLUE;
 	if (flags & PKTSCHEDF_QALG_SFB)
 		qflags |= QFCF_SFB;
+	if (flags & PKTSCHEDF_QALG_FQ_CODEL)
+		qflags |= QFCF_FQ_CODEL;
 	if (flags & PKTSCHEDF_QALG_ECN)
 		qflags |= QFCF_ECN;
 	if (flags & PKTSCHEDF_QALG_FLOWCTL)
@@ -2029,6 +2135,8 @@ qfq_resumeq(struct qfq_if *qif, struct qfq_class *cl)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		err = sfb_suspendq(cl->cl_sfb, &cl->cl_q, FALSE);
+	else if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		err = fq_codel_suspendq(cl->cl_fq_codel, &cl->cl_q, FALSE);
 
 	if (err == 0)
 		qstate(&cl->cl_q) = QS_RUNNING;
@@ -2066,6 +2174,14 @@ qfq_suspendq(struct qfq_if *qif, struct qfq_class *cl)
 			VERIFY(cl->cl_flags & QFCF_LAZY);
 			err = ENXIO;	/* delayed throttling */
 		}
+	} else if (q_is_fq_codel(&cl->cl_q)) {
+		if (cl->cl_fq_codel != NULL) {
+			err = fq_codel_suspendq(cl->cl_fq_codel, &cl->cl_q,
+			    TRUE);
+		} else {
+			VERIFY(cl->cl_flags & QFCF_LAZY);
+			err = ENXIO;	/* delayed throttling */
+		}
 	}
 
 	if (err == 0 || err == ENXIO)
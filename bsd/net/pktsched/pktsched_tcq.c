@@ -63,6 +63,7 @@ static inline int tcq_addq(struct tcq_class *, struct mbuf *,
     struct pf_mtag *);
 static inline struct mbuf *tcq_getq(struct tcq_class *);
 static inline struct mbuf *tcq_pollq(struct tcq_class *);
+static inline void tcq_qalg_dropped(struct tcq_class *, u_int32_t, u_int32_t);
 static void tcq_purgeq(struct tcq_if *, struct tcq_class *, u_int32_t,
     u_int32_t *, u_int32_t *);
 static void tcq_purge_sc(struct tcq_if *, cqrq_purge_sc_t *);
@@ -287,6 +288,7 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 	struct ifnet *ifp;
 	struct ifclassq *ifq;
 	struct tcq_class *cl;
+	int qalg;
 
 	IFCQ_LOCK_ASSERT_HELD(tif->tif_ifq);
 
@@ -319,12 +321,10 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 
 	/* These are mutually exclusive */
-	if ((flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB)) &&
-	    (flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB)) != TQCF_RED &&
-	    (flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB)) != TQCF_RIO &&
-	    (flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB)) != TQCF_BLUE &&
-	    (flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB)) != TQCF_SFB) {
-		log(LOG_ERR, "%s: %s more than one RED|RIO|BLUE|SFB\n",
+	qalg = (flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB|TQCF_FQ_CODEL));
+	if (qalg != 0 && qalg != TQCF_RED && qalg != TQCF_RIO &&
+	    qalg != TQCF_BLUE && qalg != TQCF_SFB && qalg != TQCF_FQ_CODEL) {
+		log(LOG_ERR, "%s: %s more than one RED|RIO|BLUE|SFB|FQ_CODEL\n",
 		    if_name(TCQIF_IFP(tif)), tcq_style(tif));
 		return (NULL);
 	}
@@ -350,6 +350,8 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 #endif /* CLASSQ_BLUE */
 		if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 			sfb_destroy(cl->cl_sfb);
+		if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+			fq_codel_destroy(cl->cl_fq_codel);
 		cl->cl_qalg.ptr = NULL;
 		qtype(&cl->cl_q) = Q_DROPTAIL;
 		qstate(&cl->cl_q) = QS_RUNNING;
@@ -377,7 +379,7 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 	cl->cl_tif = tif;
 	cl->cl_handle = qid;
 
-	if (flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB)) {
+	if (flags & (TQCF_RED|TQCF_RIO|TQCF_BLUE|TQCF_SFB|TQCF_FQ_CODEL)) {
 #if CLASSQ_RED || CLASSQ_RIO
 		u_int64_t ifbandwidth = ifnet_output_linkrate(ifp);
 		int pkttime;
@@ -389,6 +391,8 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 				cl->cl_qflags |= BLUEF_ECN;
 			else if (flags & TQCF_SFB)
 				cl->cl_qflags |= SFBF_ECN;
+			else if (flags & TQCF_FQ_CODEL)
+				cl->cl_qflags |= FQCODELF_ECN;
 			else if (flags & TQCF_RED)
 				cl->cl_qflags |= REDF_ECN;
 			else if (flags & TQCF_RIO)
@@ -397,10 +401,14 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 		if (flags & TQCF_FLOWCTL) {
 			if (flags & TQCF_SFB)
 				cl->cl_qflags |= SFBF_FLOWCTL;
+			else if (flags & TQCF_FQ_CODEL)
+				cl->cl_qflags |= FQCODELF_FLOWCTL;
 		}
 		if (flags & TQCF_DELAYBASED) {
 			if (flags & TQCF_SFB)
 				cl->cl_qflags |= SFBF_DELAYBASED;
+			else if (flags & TQCF_FQ_CODEL)
+				cl->cl_qflags |= FQCODELF_DELAYBASED;
 		}
 		if (flags & TQCF_CLEARDSCP) {
 			if (flags & TQCF_RIO)
@@ -451,6 +459,15 @@ tcq_class_create(struct tcq_if *tif, int pri, u_int32_t qlimit,
 			if (cl->cl_sfb != NULL || (cl->cl_flags & TQCF_LAZY))
 				qtype(&cl->cl_q) = Q_SFB;
 		}
+		if (flags & TQCF_FQ_CODEL) {
+			if (!(cl->cl_flags & TQCF_LAZY))
+				cl->cl_fq_codel = fq_codel_alloc(ifp,
+				    cl->cl_handle, qlimit(&cl->cl_q),
+				    cl->cl_qflags);
+			if (cl->cl_fq_codel != NULL ||
+			    (cl->cl_flags & TQCF_LAZY))
+				qtype(&cl->cl_q) = Q_FQ_CODEL;
+		}
 	}
 
 	if (pktsched_verbose) {
@@ -515,6 +532,8 @@ tcq_class_destroy(struct tcq_if *tif, struct tcq_class *cl)
 #endif /* CLASSQ_BLUE */
 		if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 			sfb_destroy(cl->cl_sfb);
+		if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+			fq_codel_destroy(cl->cl_fq_codel);
 		cl->cl_qalg.ptr = NULL;
 		qtype(&cl->cl_q) = Q_DROPTAIL;
 		qstate(&cl->cl_q) = QS_RUNNING;
@@ -692,6 +711,50 @@ tcq_addq(struct tcq_class *cl, struct mbuf *m, struct pf_mtag *t)
 		}
 		if (cl->cl_sfb != NULL)
 			return (sfb_addq(cl->cl_sfb, &cl->cl_q, m, t));
+	} else if (q_is_fq_codel(&cl->cl_q)) {
+		if (cl->cl_fq_codel == NULL) {
+			struct ifnet *ifp = TCQIF_IFP(tif);
+
+			VERIFY(cl->cl_flags & TQCF_LAZY);
+			cl->cl_flags &= ~TQCF_LAZY;
+			IFCQ_CONVERT_LOCK(ifq);
+
+			cl->cl_fq_codel = fq_codel_alloc(ifp, cl->cl_handle,
+			    qlimit(&cl->cl_q), cl->cl_qflags);
+			if (cl->cl_fq_codel == NULL) {
+				/* fall back to droptail */
+				qtype(&cl->cl_q) = Q_DROPTAIL;
+				cl->cl_flags &= ~TQCF_FQ_CODEL;
+				cl->cl_qflags &= ~(FQCODELF_ECN |
+				    FQCODELF_FLOWCTL);
+
+				log(LOG_ERR, "%s: %s FQ-CoDel lazy allocation "
+				    "failed for qid=%d pri=%d, falling back "
+				    "to DROPTAIL\n", if_name(ifp),
+				    tcq_style(tif), cl->cl_handle,
+				    cl->cl_pri);
+			} else if (tif->tif_throttle != IFNET_THROTTLE_OFF) {
+				/* if there's pending throttling, set it */
+				cqrq_throttle_t tr = { 1, tif->tif_throttle };
+				int err = tcq_throttle(tif, &tr);
+
+				if (err == EALREADY)
+					err = 0;
+				if (err != 0) {
+					tr.level = IFNET_THROTTLE_OFF;
+					(void) tcq_throttle(tif, &tr);
+				}
+			}
+		}
+		if (cl->cl_fq_codel != NULL) {
+			u_int32_t cnt, len;
+			int ret;
+
+			ret = fq_codel_addq(cl->cl_fq_codel, &cl->cl_q, m, t,
+			    &cnt, &len);
+			tcq_qalg_dropped(cl, cnt, len);
+			return (ret);
+		}
 	} else if (qlen(&cl->cl_q) >= qlimit(&cl->cl_q)) {
 		IFCQ_CONVERT_LOCK(ifq);
 		m_freem(m);
@@ -730,6 +793,14 @@ tcq_getq(struct tcq_class *cl)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		return (sfb_getq(cl->cl_sfb, &cl->cl_q));
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL) {
+		u_int32_t cnt, len;
+		struct mbuf *m;
+
+		m = fq_codel_getq(cl->cl_fq_codel, &cl->cl_q, &cnt, &len);
+		tcq_qalg_dropped(cl, cnt, len);
+		return (m);
+	}
 
 	return (_getq(&cl->cl_q));
 }
@@ -739,9 +810,36 @@ tcq_pollq(struct tcq_class *cl)
 {
 	IFCQ_LOCK_ASSERT_HELD(cl->cl_tif->tif_ifq);
 
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL) {
+		u_int32_t cnt, len;
+		struct mbuf *m;
+
+		m = fq_codel_pollq(cl->cl_fq_codel, &cl->cl_q, &cnt, &len);
+		tcq_qalg_dropped(cl, cnt, len);
+		return (m);
+	}
+
 	return (qhead(&cl->cl_q));
 }
 
+/*
+ * Account for packets the queue algorithm dropped on its own, other
+ * than the one being enqueued; they were counted in the interface queue.
+ */
+static inline void
+tcq_qalg_dropped(struct tcq_class *cl, u_int32_t cnt, u_int32_t len)
+{
+	struct ifclassq *ifq = cl->cl_tif->tif_ifq;
+
+	if (cnt == 0)
+		return;
+
+	PKTCNTR_ADD(&cl->cl_dropcnt, cnt, len);
+	IFCQ_DROP_ADD(ifq, cnt, len);
+	VERIFY(((signed)IFCQ_LEN(ifq) - cnt) >= 0);
+	IFCQ_LEN(ifq) -= cnt;
+}
+
 static void
 tcq_purgeq(struct tcq_if *tif, struct tcq_class *cl, u_int32_t flow,
     u_int32_t *packets, u_int32_t *bytes)
@@ -774,6 +872,8 @@ tcq_purgeq(struct tcq_if *tif, struct tcq_class *cl, u_int32_t flow,
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		sfb_purgeq(cl->cl_sfb, &cl->cl_q, flow, &cnt, &len);
+	else if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		fq_codel_purgeq(cl->cl_fq_codel, &cl->cl_q, flow, &cnt, &len);
 	else
 		_flushq_flow(&cl->cl_q, flow, &cnt, &len);
 
@@ -826,6 +926,8 @@ tcq_updateq(struct tcq_if *tif, struct tcq_class *cl, cqev_t ev)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		return (sfb_updateq(cl->cl_sfb, ev));
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		return (fq_codel_updateq(cl->cl_fq_codel, ev));
 }
 
 int
@@ -863,6 +965,8 @@ tcq_get_class_stats(struct tcq_if *tif, u_int32_t qid,
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		sfb_getstats(cl->cl_sfb, &sp->sfb);
+	if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		fq_codel_getstats(cl->cl_fq_codel, &sp->fq_codel);
 
 	return (0);
 }
@@ -1012,6 +1116,8 @@ tcq_setup_ifclassq(struct ifclassq *ifq, u_int32_t flags)
 		qflags |= TQCF_BLUE;
 	if (flags & PKTSCHEDF_QALG_SFB)
 		qflags |= TQCF_SFB;
+	if (flags & PKTSCHEDF_QALG_FQ_CODEL)
+		qflags |= TQCF_FQ_CODEL;
 	if (flags & PKTSCHEDF_QALG_ECN)
 		qflags |= TQCF_ECN;
 	if (flags & PKTSCHEDF_QALG_FLOWCTL)
@@ -1207,6 +1313,8 @@ tcq_resumeq(struct tcq_if *tif, struct tcq_class *cl)
 #endif /* CLASSQ_BLUE */
 	if (q_is_sfb(&cl->cl_q) && cl->cl_sfb != NULL)
 		err = sfb_suspendq(cl->cl_sfb, &cl->cl_q, FALSE);
+	else if (q_is_fq_codel(&cl->cl_q) && cl->cl_fq_codel != NULL)
+		err = fq_codel_suspendq(cl->cl_fq_codel, &cl->cl_q, FALSE);
 
 	if (err == 0)
 		qstate(&cl->cl_q) = QS_RUNNING;
@@ -1244,6 +1352,14 @@ tcq_suspendq(struct tcq_if *tif, struct tcq_class *cl)
 			VERIFY(cl->cl_flags & TQCF_LAZY);
 			err = ENXIO;	/* delayed throttling */
 		}
+	} else if (q_is_fq_codel(&cl->cl_q)) {
+		if (cl->cl_fq_codel != NULL) {
+			err = fq_codel_suspendq(cl->cl_fq_codel, &cl->cl_q,
+			    TRUE);
+		} else {
+			VERIFY(cl->cl_flags & TQCF_LAZY);
+			err = ENXIO;	/* delayed throttling */
+		}
 	}
 
 	if (err == 0 || err == ENXIO)
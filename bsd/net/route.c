@@ -75,6 +75,9 @@
 #include <sys/kernel.h>
 #include <kern/locks.h>
 #include <kern/zalloc.h>
+#include <kern/cpu_number.h>
+#include <kern/thread_call.h>
+#include <machine/machine_routines.h>
 
 #include <net/dlil.h>
 #include <net/if.h>
@@ -320,12 +323,76 @@ static void rt_str4(struct rtentry *, char *, uint32_t, char *, uint32_t);
 #if INET6
 static void rt_str6(struct rtentry *, char *, uint32_t, char *, uint32_t);
 #endif /* INET6 */
+static void rtcache_init(void);
+static uint32_t rtcache_genid(int);
+static struct rtentry *rtcache_lookup(struct sockaddr *, int, uint32_t,
+    unsigned int);
+static void rtcache_enter(struct sockaddr *, int, uint32_t, unsigned int,
+    uint32_t, struct rtentry *);
+static void rtcache_purge(thread_call_param_t, thread_call_param_t);
+static boolean_t rtalloc_cached(struct route *, uint32_t, unsigned int);
+static int sysctl_rtcache_enabled SYSCTL_HANDLER_ARGS;
+static int sysctl_rtcache_stats SYSCTL_HANDLER_ARGS;
 
 uint32_t route_genid_inet = 0;
 #if INET6
 uint32_t route_genid_inet6 = 0;
 #endif /* INET6 */
 
+/*
+ * Per-CPU route lookup cache.
+ *
+ * rtalloc1{,_scoped}() and rtalloc{,_scoped}_ign() first look in a small
+ * direct-mapped table of recent results on the current CPU, before taking
+ * rnh_lock.  Unconnected sockets and forwarding, which have no route held
+ * in a pcb, then mostly skip both the global lock and the radix lookup.
+ *
+ * An entry holds a reference on its route and the cache generation of
+ * the route's family at the time of the lookup.  Deleting or changing a
+ * route, and address and interface changes, bump that generation along
+ * with route_genid_* (routegenid_*_update), which makes all entries of
+ * the family stale at once, and so does adding a route other than a
+ * neighbour's link-layer entry.  Stale entries are replaced on the next
+ * miss; a thread call releases the rest so that they do not keep deleted
+ * routes around.
+ *
+ * Cloned routes are never cached, as a reference held here would keep
+ * them from expiring; neither are destinations with an embedded scope.
+ */
+#define	RTCACHE_SIZE	256			/* entries per CPU */
+#define	RTCACHE_MASK	(RTCACHE_SIZE - 1)
+
+struct rtcache_ent {
+	struct rtentry	*rce_rt;		/* referenced route, or NULL */
+	uint32_t	rce_genid;		/* route_genid_* when filled */
+	uint32_t	rce_ignflags;		/* lookup flags ignored */
+	unsigned int	rce_ifscope;		/* lookup scope */
+	uint8_t		rce_af;
+	uint8_t		rce_report;		/* lookup could clone */
+	union {
+		struct in_addr	rce_dst4;
+		struct in6_addr	rce_dst6;
+	} rce_dst;
+};
+
+struct rtcache_cpu {
+	decl_lck_mtx_data(, rcc_lock);
+	struct rtcache_stat	rcc_stat;
+	struct rtcache_ent	rcc_ent[RTCACHE_SIZE];
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE)));
+
+static struct rtcache_cpu *rtcache;		/* one per CPU */
+static unsigned int rtcache_ncpu;
+static thread_call_t rtcache_purge_tcall;
+static lck_grp_t *rtcache_lock_grp;
+
+static unsigned int rtcache_enabled = 1;
+
+static uint32_t rtcache_genid_inet;		/* see rtcache_genid() */
+#if INET6
+static uint32_t rtcache_genid_inet6;
+#endif /* INET6 */
+
 #define	ASSERT_SINIFSCOPE(sa) {						\
 	if ((sa)->sa_family != AF_INET ||				\
 	    (sa)->sa_len < sizeof (struct sockaddr_in))			\
@@ -384,6 +451,14 @@ unsigned int rt_verbose;	/* verbosity level (0 to disable) */
 SYSCTL_UINT(_net_route, OID_AUTO, verbose, CTLFLAG_RW | CTLFLAG_LOCKED,
 	&rt_verbose, 0, "");
 
+SYSCTL_PROC(_net_route, OID_AUTO, cache, CTLTYPE_INT | CTLFLAG_RW |
+	CTLFLAG_LOCKED, &rtcache_enabled, 0, sysctl_rtcache_enabled, "IU",
+	"Per-CPU route lookup cache");
+
+SYSCTL_PROC(_net_route, OID_AUTO, cache_stats, CTLTYPE_STRUCT | CTLFLAG_RD |
+	CTLFLAG_LOCKED, NULL, 0, sysctl_rtcache_stats, "S,rtcache_stat",
+	"Per-CPU route lookup cache statistics");
+
 static void
 rtable_init(void **table)
 {
@@ -450,6 +525,8 @@ route_init(void)
 	zone_change(rte_zone, Z_NOENCRYPT, TRUE);
 
 	TAILQ_INIT(&rttrash_head);
+
+	rtcache_init();
 }
 
 /*
@@ -821,6 +898,9 @@ void
 routegenid_inet_update(void)
 {
 	atomic_add_32(&route_genid_inet, 1);
+	atomic_add_32(&rtcache_genid_inet, 1);
+	if (rtcache_purge_tcall != NULL)
+		thread_call_enter(rtcache_purge_tcall);
 }
 
 #if INET6
@@ -828,8 +908,292 @@ void
 routegenid_inet6_update(void)
 {
 	atomic_add_32(&route_genid_inet6, 1);
+	atomic_add_32(&rtcache_genid_inet6, 1);
+	if (rtcache_purge_tcall != NULL)
+		thread_call_enter(rtcache_purge_tcall);
+}
+#endif /* INET6 */
+
+static void
+rtcache_init(void)
+{
+	lck_grp_attr_t *grp_attr;
+	lck_attr_t *attr;
+	unsigned int i;
+	size_t size;
+	void *buf;
+
+	rtcache_ncpu = ml_get_max_cpus();
+	size = rtcache_ncpu * sizeof (struct rtcache_cpu);
+	buf = _MALLOC(size + MAX_CPU_CACHE_LINE_SIZE, M_RTABLE,
+	    M_WAITOK | M_ZERO);
+	if (buf == NULL) {
+		panic("%s: failed allocating route cache", __func__);
+		/* NOTREACHED */
+	}
+	/* never freed; align so that CPUs do not share cache lines */
+	rtcache = (struct rtcache_cpu *)P2ROUNDUP((intptr_t)buf,
+	    MAX_CPU_CACHE_LINE_SIZE);
+
+	grp_attr = lck_grp_attr_alloc_init();
+	rtcache_lock_grp = lck_grp_alloc_init("rtcache", grp_attr);
+	attr = lck_attr_alloc_init();
+	for (i = 0; i < rtcache_ncpu; i++)
+		lck_mtx_init(&rtcache[i].rcc_lock, rtcache_lock_grp, attr);
+
+	rtcache_purge_tcall = thread_call_allocate(rtcache_purge, NULL);
+	if (rtcache_purge_tcall == NULL) {
+		panic("%s: failed allocating thread call", __func__);
+		/* NOTREACHED */
+	}
 }
+
+/*
+ * The cache's own generation count for a family.  It follows
+ * route_genid_*, except that adding a route does not bump it.
+ */
+static uint32_t
+rtcache_genid(int af)
+{
+#if INET6
+	if (af == AF_INET6)
+		return (rtcache_genid_inet6);
+#endif /* INET6 */
+	return (rtcache_genid_inet);
+}
+
+/*
+ * Build the cache key for a lookup; returns FALSE if the lookup is not
+ * one that can be cached.
+ */
+static boolean_t
+rtcache_key(struct sockaddr *dst, int report, uint32_t ignflags,
+    unsigned int ifscope, struct rtcache_ent *key)
+{
+	if (!rtcache_enabled || rtcache == NULL)
+		return (FALSE);
+
+	switch (dst->sa_family) {
+	case AF_INET:
+		if (dst->sa_len < sizeof (struct sockaddr_in) ||
+		    SINIFSCOPE(dst)->sin_scope_id != IFSCOPE_NONE)
+			return (FALSE);
+		key->rce_dst.rce_dst4 = SIN(dst)->sin_addr;
+		break;
+#if INET6
+	case AF_INET6:
+		if (dst->sa_len < sizeof (struct sockaddr_in6) ||
+		    SIN6(dst)->sin6_scope_id != IFSCOPE_NONE ||
+		    IN6_IS_SCOPE_EMBED(&SIN6(dst)->sin6_addr))
+			return (FALSE);
+		key->rce_dst.rce_dst6 = SIN6(dst)->sin6_addr;
+		break;
 #endif /* INET6 */
+	default:
+		return (FALSE);
+	}
+	key->rce_af = dst->sa_family;
+	key->rce_report = (report != 0);
+	key->rce_ignflags = ignflags;
+	key->rce_ifscope = ifscope;
+	return (TRUE);
+}
+
+static inline struct rtcache_ent *
+rtcache_slot(struct rtcache_cpu *rcc, struct rtcache_ent *key)
+{
+	uint32_t h;
+
+	if (key->rce_af == AF_INET) {
+		h = key->rce_dst.rce_dst4.s_addr;
+	} else {
+		h = key->rce_dst.rce_dst6.s6_addr32[0] ^
+		    key->rce_dst.rce_dst6.s6_addr32[1] ^
+		    key->rce_dst.rce_dst6.s6_addr32[2] ^
+		    key->rce_dst.rce_dst6.s6_addr32[3];
+	}
+	h ^= key->rce_ifscope;
+	h *= 0x9e3779b1;		/* golden ratio, mixes the high bits down */
+	return (&rcc->rcc_ent[(h >> 24) & RTCACHE_MASK]);
+}
+
+static inline boolean_t
+rtcache_match(struct rtcache_ent *rce, struct rtcache_ent *key)
+{
+	if (rce->rce_af != key->rce_af ||
+	    rce->rce_ifscope != key->rce_ifscope ||
+	    rce->rce_ignflags != key->rce_ignflags ||
+	    rce->rce_report != key->rce_report)
+		return (FALSE);
+	if (key->rce_af == AF_INET)
+		return (rce->rce_dst.rce_dst4.s_addr ==
+		    key->rce_dst.rce_dst4.s_addr);
+	return (IN6_ARE_ADDR_EQUAL(&rce->rce_dst.rce_dst6,
+	    &key->rce_dst.rce_dst6));
+}
+
+/*
+ * Return the cached result of a lookup with a reference held, or NULL.
+ * Called without rnh_lock.
+ */
+static struct rtentry *
+rtcache_lookup(struct sockaddr *dst, int report, uint32_t ignflags,
+    unsigned int ifscope)
+{
+	struct rtcache_cpu *rcc;
+	struct rtcache_ent key, *rce;
+	struct rtentry *rt = NULL;
+
+	if (!rtcache_key(dst, report, ignflags, ifscope, &key))
+		return (NULL);
+
+	rcc = &rtcache[cpu_number()];
+	lck_mtx_lock_spin(&rcc->rcc_lock);
+	rce = rtcache_slot(rcc, &key);
+	if (rce->rce_rt == NULL || !rtcache_match(rce, &key)) {
+		rcc->rcc_stat.rcs_misses++;
+	} else if (rce->rce_genid != rtcache_genid(key.rce_af)) {
+		rcc->rcc_stat.rcs_stale++;
+	} else {
+		rt = rce->rce_rt;
+		RT_LOCK_SPIN(rt);
+		if ((rt->rt_flags & (RTF_UP|RTF_CONDEMNED)) == RTF_UP &&
+		    rt->rt_ifp != NULL) {
+			/* nothing changed since it was looked up */
+			RT_GENID_SYNC(rt);
+			RT_ADDREF_LOCKED(rt);
+			rcc->rcc_stat.rcs_hits++;
+		} else {
+			rcc->rcc_stat.rcs_stale++;
+			rt = NULL;
+		}
+		RT_UNLOCK(rce->rce_rt);
+	}
+	lck_mtx_unlock(&rcc->rcc_lock);
+
+	return (rt);
+}
+
+/*
+ * Install the result of a lookup done at generation genid; called with
+ * rnh_lock held, which the release of the replaced route needs.
+ */
+static void
+rtcache_enter(struct sockaddr *dst, int report, uint32_t ignflags,
+    unsigned int ifscope, uint32_t genid, struct rtentry *rt)
+{
+	struct rtcache_cpu *rcc;
+	struct rtcache_ent key, *rce;
+	struct rtentry *ort;
+	uint32_t flags;
+
+	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (rt == NULL ||
+	    !rtcache_key(dst, report, ignflags, ifscope, &key))
+		return;
+
+	RT_LOCK_SPIN(rt);
+	flags = rt->rt_flags;
+	if ((flags & RTF_WASCLONED) || (report &&
+	    (flags & ~ignflags & (RTF_CLONING | RTF_PRCLONING)))) {
+		/* cloned, or cloning failed and it would be retried */
+		RT_UNLOCK(rt);
+		return;
+	}
+	RT_ADDREF_LOCKED(rt);
+	RT_UNLOCK(rt);
+
+	key.rce_rt = rt;
+	key.rce_genid = genid;
+
+	rcc = &rtcache[cpu_number()];
+	lck_mtx_lock_spin(&rcc->rcc_lock);
+	rce = rtcache_slot(rcc, &key);
+	ort = rce->rce_rt;
+	*rce = key;
+	rcc->rcc_stat.rcs_fills++;
+	lck_mtx_unlock(&rcc->rcc_lock);
+
+	if (ort != NULL)
+		rtfree_locked(ort);
+}
+
+/*
+ * Release the routes held by stale entries on all CPUs; runs after a
+ * generation count has been bumped.
+ */
+static void
+rtcache_purge(thread_call_param_t arg0, thread_call_param_t arg1)
+{
+#pragma unused(arg0, arg1)
+	struct rtcache_cpu *rcc;
+	struct rtcache_ent *rce;
+	struct rtentry *rt;
+	unsigned int i, j;
+
+	lck_mtx_lock(rnh_lock);
+	for (i = 0; i < rtcache_ncpu; i++) {
+		rcc = &rtcache[i];
+		for (j = 0; j < RTCACHE_SIZE; j++) {
+			rce = &rcc->rcc_ent[j];
+			lck_mtx_lock_spin(&rcc->rcc_lock);
+			rt = rce->rce_rt;
+			if (rt != NULL && (!rtcache_enabled ||
+			    rce->rce_genid != rtcache_genid(rce->rce_af))) {
+				rce->rce_rt = NULL;
+				rcc->rcc_stat.rcs_purged++;
+			} else {
+				rt = NULL;
+			}
+			lck_mtx_unlock(&rcc->rcc_lock);
+			if (rt != NULL)
+				rtfree_locked(rt);
+		}
+	}
+	lck_mtx_unlock(rnh_lock);
+}
+
+static int
+sysctl_rtcache_enabled SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	unsigned int i;
+	int error;
+
+	i = rtcache_enabled;
+	error = sysctl_handle_int(oidp, &i, 0, req);
+	if (error != 0 || req->newptr == USER_ADDR_NULL)
+		return (error);
+
+	rtcache_enabled = (i != 0);
+	/* let the purge drop whatever is held while disabled */
+	if (!rtcache_enabled && rtcache_purge_tcall != NULL)
+		thread_call_enter(rtcache_purge_tcall);
+	return (0);
+}
+
+static int
+sysctl_rtcache_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct rtcache_stat stat;
+	struct rtcache_cpu *rcc;
+	unsigned int i;
+
+	bzero(&stat, sizeof (stat));
+	for (i = 0; i < rtcache_ncpu; i++) {
+		rcc = &rtcache[i];
+		lck_mtx_lock_spin(&rcc->rcc_lock);
+		stat.rcs_hits += rcc->rcc_stat.rcs_hits;
+		stat.rcs_misses += rcc->rcc_stat.rcs_misses;
+		stat.rcs_stale += rcc->rcc_stat.rcs_stale;
+		stat.rcs_fills += rcc->rcc_stat.rcs_fills;
+		stat.rcs_purged += rcc->rcc_stat.rcs_purged;
+		lck_mtx_unlock(&rcc->rcc_lock);
+	}
+	return (SYSCTL_OUT(req, &stat, MIN(sizeof (stat), req->oldlen)));
+}
 
 /*
  * Packet routing routines.
@@ -868,21 +1232,59 @@ rtalloc_ign_common_locked(struct route *ro, uint32_t ignore,
 	}
 }
 
+/*
+ * Unlocked front end of rtalloc_ign_common_locked(): keep a usable route,
+ * or take one from the per-CPU cache.  Returns FALSE if the caller has
+ * to do the lookup.
+ */
+static boolean_t
+rtalloc_cached(struct route *ro, uint32_t ignore, unsigned int ifscope)
+{
+	struct rtentry *rt;
+
+	if ((rt = ro->ro_rt) != NULL) {
+		RT_LOCK_SPIN(rt);
+		if (rt->rt_ifp != NULL && !ROUTE_UNUSABLE(ro)) {
+			RT_UNLOCK(rt);
+			return (TRUE);
+		}
+		RT_UNLOCK(rt);
+		ROUTE_RELEASE(ro);
+	}
+	if ((rt = rtcache_lookup(&ro->ro_dst, 1, ignore, ifscope)) == NULL)
+		return (FALSE);
+
+	ro->ro_rt = rt;
+	return (TRUE);
+}
+
 void
 rtalloc_ign(struct route *ro, uint32_t ignore)
 {
+	uint32_t genid;
+
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if (rtalloc_cached(ro, ignore, IFSCOPE_NONE))
+		return;
+	genid = rtcache_genid(ro->ro_dst.sa_family);
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, IFSCOPE_NONE);
+	rtcache_enter(&ro->ro_dst, 1, ignore, IFSCOPE_NONE, genid, ro->ro_rt);
 	lck_mtx_unlock(rnh_lock);
 }
 
 void
 rtalloc_scoped_ign(struct route *ro, uint32_t ignore, unsigned int ifscope)
 {
+	uint32_t genid;
+
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if (rtalloc_cached(ro, ignore, ifscope))
+		return;
+	genid = rtcache_genid(ro->ro_dst.sa_family);
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, ifscope);
+	rtcache_enter(&ro->ro_dst, 1, ignore, ifscope, genid, ro->ro_rt);
 	lck_mtx_unlock(rnh_lock);
 }
 
@@ -988,9 +1390,16 @@ struct rtentry *
 rtalloc1(struct sockaddr *dst, int report, uint32_t ignflags)
 {
 	struct rtentry *entry;
+	uint32_t genid;
+
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if ((entry = rtcache_lookup(dst, report, ignflags,
+	    IFSCOPE_NONE)) != NULL)
+		return (entry);
+	genid = rtcache_genid(dst->sa_family);
 	lck_mtx_lock(rnh_lock);
 	entry = rtalloc1_locked(dst, report, ignflags);
+	rtcache_enter(dst, report, ignflags, IFSCOPE_NONE, genid, entry);
 	lck_mtx_unlock(rnh_lock);
 	return (entry);
 }
@@ -1000,9 +1409,15 @@ rtalloc1_scoped(struct sockaddr *dst, int report, uint32_t ignflags,
     unsigned int ifscope)
 {
 	struct rtentry *entry;
+	uint32_t genid;
+
 	lck_mtx_assert(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if ((entry = rtcache_lookup(dst, report, ignflags, ifscope)) != NULL)
+		return (entry);
+	genid = rtcache_genid(dst->sa_family);
 	lck_mtx_lock(rnh_lock);
 	entry = rtalloc1_scoped_locked(dst, report, ignflags, ifscope);
+	rtcache_enter(dst, report, ignflags, ifscope, genid, entry);
 	lck_mtx_unlock(rnh_lock);
 	return (entry);
 }
@@ -2143,12 +2558,31 @@ makeroute:
 			RT_ADDREF_LOCKED(rt);
 		}
 
-		if (af == AF_INET)
+		/*
+		 * A neighbour's link-layer entry (ARP, ND) is a host route
+		 * under the prefix route it is reached through, on the same
+		 * interface.  A cached lookup that still answers with that
+		 * prefix route sends the packet the same way, and the link
+		 * layer finds the entry itself, so these spare the route
+		 * cache; hosts with many neighbours add them all the time.
+		 * Any other new route may change what a cached lookup
+		 * should find, so it stales the cache as deletes do.
+		 */
+		if ((rt->rt_flags & (RTF_HOST | RTF_LLINFO)) ==
+		    (RTF_HOST | RTF_LLINFO)) {
+			if (af == AF_INET)
+				atomic_add_32(&route_genid_inet, 1);
+#if INET6
+			else if (af == AF_INET6)
+				atomic_add_32(&route_genid_inet6, 1);
+#endif /* INET6 */
+		} else if (af == AF_INET) {
 			routegenid_inet_update();
 #if INET6
-		else if (af == AF_INET6)
+		} else if (af == AF_INET6) {
 			routegenid_inet6_update();
 #endif /* INET6 */
+		}
 
 		RT_GENID_SYNC(rt);
 
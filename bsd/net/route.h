@@ -339,6 +339,17 @@ struct rt_msghdr_ext {
 	struct rt_metrics rtm_rmx;	/* metrics themselves */
 	struct rt_reach_info rtm_ri;	/* route reachability info */
 };
+
+/*
+ * Per-CPU route lookup cache statistics (net.route.cache_stats).
+ */
+struct rtcache_stat {
+	u_int64_t	rcs_hits;	/* lookups answered from the cache */
+	u_int64_t	rcs_misses;	/* no entry for the destination */
+	u_int64_t	rcs_stale;	/* entry from an older generation */
+	u_int64_t	rcs_fills;	/* entries installed */
+	u_int64_t	rcs_purged;	/* stale entries released */
+};
 #endif /* PRIVATE */
 
 #define	RTM_VERSION	5	/* Up the ante and ignore older versions */
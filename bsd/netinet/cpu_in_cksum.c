@@ -62,6 +62,9 @@
 #include <sys/mbuf.h>
 #include <kern/debug.h>
 #include <netinet/in.h>
+#if defined(__x86_64__)
+#include <netinet/in_cksum_simd.h>
+#endif /* __x86_64__ */
 #include <libkern/libkern.h>
 
 int cpu_in_cksum(struct mbuf *, int, int, uint32_t);
@@ -303,6 +306,22 @@ post_initial_offset:
 			data += 2;
 			mlen -= 2;
 		}
+#if defined(__x86_64__)
+		if (mlen >= IN_CKSUM_SIMD_MIN) {
+			uint64_t vsum;
+			int vlen;
+
+			/* the leading 64-byte blocks, with SSE2/AVX2 */
+			vlen = in_cksum_simd_block(data, mlen, &vsum);
+			if (vlen > 0) {
+				if (needs_swap)
+					vsum = (vsum << 8) + (vsum >> 56);
+				sum += (vsum >> 32) + (vsum & 0xffffffff);
+				data += vlen;
+				mlen -= vlen;
+			}
+		}
+#endif /* __x86_64__ */
 		while (mlen >= 64) {
 			__builtin_prefetch(data + 32);
 			__builtin_prefetch(data + 64);
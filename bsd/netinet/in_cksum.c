@@ -69,6 +69,9 @@
 #define	_IP_VHL
 #include <netinet/ip.h>
 #include <netinet/ip_var.h>
+#if defined(__x86_64__)
+#include <netinet/in_cksum_simd.h>
+#endif /* __x86_64__ */
 
 /*
  * Checksum routine for Internet Protocol family headers (Portable Version).
@@ -258,6 +261,21 @@ in_cksumdata(const void *buf, int mlen)
 		data += 2;
 		mlen -= 2;
 	}
+#if defined(__x86_64__)
+	if (mlen >= IN_CKSUM_SIMD_MIN) {
+		uint64_t vsum;
+		int vlen;
+
+		/* the leading 64-byte blocks, with SSE2/AVX2 */
+		if ((vlen = in_cksum_simd_block(data, mlen, &vsum)) > 0) {
+			if (needs_swap)
+				vsum = (vsum << 8) + (vsum >> 56);
+			sum += (vsum >> 32) + (vsum & 0xffffffff);
+			data += vlen;
+			mlen -= vlen;
+		}
+	}
+#endif /* __x86_64__ */
 	while (mlen >= 64) {
 		__builtin_prefetch(data + 32);
 		__builtin_prefetch(data + 64);
@@ -356,6 +374,42 @@ b_sum16(const void *buf, int len)
 	return (in_cksumdata(buf, len));
 }
 
+/*
+ * Copy a contiguous span and return its 16-bit 1's complement sum, as
+ * b_sum16() would of either copy.  With vectors available the data is
+ * summed while it is copied; otherwise the copy is summed right after,
+ * while it is still in the cache.
+ */
+uint16_t
+b_sum16_copy(const void *src, void *dst, int len)
+{
+#if defined(__x86_64__)
+	uint64_t sum;
+	int vlen;
+
+	VERIFY(len >= 0);
+
+	vlen = in_cksum_simd_copy_block(src, dst, len, &sum);
+	if (vlen > 0) {
+		/* vlen is even, so the tail sums without a byte swap */
+		if (vlen < len) {
+			bcopy((const uint8_t *)src + vlen,
+			    (uint8_t *)dst + vlen, len - vlen);
+			sum += in_cksumdata((const uint8_t *)src + vlen,
+			    len - vlen);
+		}
+		sum = (sum >> 32) + (sum & 0xffffffff);
+		sum = (sum >> 32) + (sum & 0xffffffff);
+		sum = (sum >> 16) + (sum & 0xffff);
+		sum = (sum >> 16) + (sum & 0xffff);
+		sum = (sum >> 16) + (sum & 0xffff);
+		return (sum);
+	}
+#endif /* __x86_64__ */
+	bcopy(src, dst, len);
+	return (in_cksumdata(dst, len));
+}
+
 uint16_t inet_cksum_simple(struct mbuf *, int);
 /*
  * For the exported _in_cksum symbol in BSDKernel symbol set.
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * SSE2 and AVX2 versions of the Internet checksum inner loop.
+ *
+ * The one's complement sum of a span can be computed from the sum of
+ * its 32-bit words as long as no carry is lost, which is what the
+ * integer loop in in_cksumdata() does with its 64-bit accumulator.  The
+ * vector loops do the same in every lane: each 32-bit word is widened
+ * to 64 bits against a zero register and added into a 64-bit lane,
+ * where it takes 2^32 words to overflow, so no carry handling is needed
+ * inside the loop.  The lanes are added together at the end; the caller
+ * folds the result as it would its own accumulator.
+ *
+ * Loads are unaligned, so a span may start anywhere; its first byte is
+ * the low-order byte of the first 16-bit word, exactly as for the
+ * integer loop.  The copy variants store each block at the destination
+ * as it is summed, so the data is only read once.
+ *
+ * This file also builds in user space, where it is used by the test
+ * and benchmark in tools/tests/in_cksum_simd_test.
+ */
+
+#include <sys/param.h>
+#ifdef KERNEL
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <netinet/in_var.h>
+#include <machine/machine_routines.h>
+#include <i386/cpuid.h>
+#include <pexpert/pexpert.h>
+#endif /* KERNEL */
+
+#include <netinet/in_cksum_simd.h>
+
+#if defined(__x86_64__)
+
+/* widen the dwords of r into 64-bit lanes and accumulate them */
+#define	SSE2_ADD(r)							\
+	"movdqa		%%" r ", %%xmm6\n\t"				\
+	"punpckldq	%%xmm7, %%" r "\n\t"				\
+	"punpckhdq	%%xmm7, %%xmm6\n\t"				\
+	"paddq		%%" r ", %%xmm0\n\t"				\
+	"paddq		%%xmm6, %%xmm1\n\t"
+
+#define	SSE2_FOLD							\
+	"paddq		%%xmm1, %%xmm0\n\t"				\
+	"movq		%%xmm0, %[lo]\n\t"				\
+	"punpckhqdq	%%xmm0, %%xmm0\n\t"				\
+	"movq		%%xmm0, %[hi]\n\t"
+
+#define	AVX2_ADD(r, t)							\
+	"vpunpckldq	%%ymm7, %%" r ", %%" t "\n\t"			\
+	"vpunpckhdq	%%ymm7, %%" r ", %%" r "\n\t"			\
+	"vpaddq		%%" t ", %%ymm0, %%ymm0\n\t"			\
+	"vpaddq		%%" r ", %%ymm1, %%ymm1\n\t"
+
+#define	AVX2_FOLD							\
+	"vpaddq		%%ymm1, %%ymm0, %%ymm0\n\t"			\
+	"vextracti128	$1, %%ymm0, %%xmm1\n\t"				\
+	"vpaddq		%%xmm1, %%xmm0, %%xmm0\n\t"			\
+	"vmovq		%%xmm0, %[lo]\n\t"				\
+	"vpextrq	$1, %%xmm0, %[hi]\n\t"				\
+	"vzeroupper\n\t"
+
+#define	VEC_CLOBBERS							\
+	"xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",	\
+	"cc", "memory"
+
+uint64_t
+in_cksum_sse2(const void *buf, int len)
+{
+	const uint8_t *p = buf;
+	long n = len & ~63;
+	uint64_t lo, hi;
+
+	if (n == 0)
+		return (0);
+
+	__asm__ __volatile__(
+	    "pxor	%%xmm0, %%xmm0\n\t"
+	    "pxor	%%xmm1, %%xmm1\n\t"
+	    "pxor	%%xmm7, %%xmm7\n\t"
+	    "1:\n\t"
+	    "movdqu	(%[p]), %%xmm2\n\t"
+	    "movdqu	16(%[p]), %%xmm3\n\t"
+	    "movdqu	32(%[p]), %%xmm4\n\t"
+	    "movdqu	48(%[p]), %%xmm5\n\t"
+	    SSE2_ADD("xmm2")
+	    SSE2_ADD("xmm3")
+	    SSE2_ADD("xmm4")
+	    SSE2_ADD("xmm5")
+	    "add	$64, %[p]\n\t"
+	    "sub	$64, %[n]\n\t"
+	    "jnz	1b\n\t"
+	    SSE2_FOLD
+	    : [p] "+r" (p), [n] "+r" (n), [lo] "=r" (lo), [hi] "=r" (hi)
+	    :
+	    : VEC_CLOBBERS);
+
+	return (lo + hi);
+}
+
+uint64_t
+in_cksum_copy_sse2(const void *src, void *dst, int len)
+{
+	const uint8_t *p = src;
+	uint8_t *d = dst;
+	long n = len & ~63;
+	uint64_t lo, hi;
+
+	if (n == 0)
+		return (0);
+
+	__asm__ __volatile__(
+	    "pxor	%%xmm0, %%xmm0\n\t"
+	    "pxor	%%xmm1, %%xmm1\n\t"
+	    "pxor	%%xmm7, %%xmm7\n\t"
+	    "1:\n\t"
+	    "movdqu	(%[p]), %%xmm2\n\t"
+	    "movdqu	16(%[p]), %%xmm3\n\t"
+	    "movdqu	32(%[p]), %%xmm4\n\t"
+	    "movdqu	48(%[p]), %%xmm5\n\t"
+	    "movdqu	%%xmm2, (%[d])\n\t"
+	    "movdqu	%%xmm3, 16(%[d])\n\t"
+	    "movdqu	%%xmm4, 32(%[d])\n\t"
+	    "movdqu	%%xmm5, 48(%[d])\n\t"
+	    SSE2_ADD("xmm2")
+	    SSE2_ADD("xmm3")
+	    SSE2_ADD("xmm4")
+	    SSE2_ADD("xmm5")
+	    "add	$64, %[p]\n\t"
+	    "add	$64, %[d]\n\t"
+	    "sub	$64, %[n]\n\t"
+	    "jnz	1b\n\t"
+	    SSE2_FOLD
+	    : [p] "+r" (p), [d] "+r" (d), [n] "+r" (n), [lo] "=r" (lo),
+	      [hi] "=r" (hi)
+	    :
+	    : VEC_CLOBBERS);
+
+	return (lo + hi);
+}
+
+uint64_t
+in_cksum_avx2(const void *buf, int len)
+{
+	const uint8_t *p = buf;
+	long n = len & ~63;
+	uint64_t lo, hi;
+
+	if (n == 0)
+		return (0);
+
+	__asm__ __volatile__(
+	    "vpxor	%%ymm0, %%ymm0, %%ymm0\n\t"
+	    "vpxor	%%ymm1, %%ymm1, %%ymm1\n\t"
+	    "vpxor	%%ymm7, %%ymm7, %%ymm7\n\t"
+	    "1:\n\t"
+	    "vmovdqu	(%[p]), %%ymm2\n\t"
+	    "vmovdqu	32(%[p]), %%ymm3\n\t"
+	    AVX2_ADD("ymm2", "ymm4")
+	    AVX2_ADD("ymm3", "ymm5")
+	    "add	$64, %[p]\n\t"
+	    "sub	$64, %[n]\n\t"
+	    "jnz	1b\n\t"
+	    AVX2_FOLD
+	    : [p] "+r" (p), [n] "+r" (n), [lo] "=r" (lo), [hi] "=r" (hi)
+	    :
+	    : VEC_CLOBBERS);
+
+	return (lo + hi);
+}
+
+uint64_t
+in_cksum_copy_avx2(const void *src, void *dst, int len)
+{
+	const uint8_t *p = src;
+	uint8_t *d = dst;
+	long n = len & ~63;
+	uint64_t lo, hi;
+
+	if (n == 0)
+		return (0);
+
+	__asm__ __volatile__(
+	    "vpxor	%%ymm0, %%ymm0, %%ymm0\n\t"
+	    "vpxor	%%ymm1, %%ymm1, %%ymm1\n\t"
+	    "vpxor	%%ymm7, %%ymm7, %%ymm7\n\t"
+	    "1:\n\t"
+	    "vmovdqu	(%[p]), %%ymm2\n\t"
+	    "vmovdqu	32(%[p]), %%ymm3\n\t"
+	    "vmovdqu	%%ymm2, (%[d])\n\t"
+	    "vmovdqu	%%ymm3, 32(%[d])\n\t"
+	    AVX2_ADD("ymm2", "ymm4")
+	    AVX2_ADD("ymm3", "ymm5")
+	    "add	$64, %[p]\n\t"
+	    "add	$64, %[d]\n\t"
+	    "sub	$64, %[n]\n\t"
+	    "jnz	1b\n\t"
+	    AVX2_FOLD
+	    : [p] "+r" (p), [d] "+r" (d), [n] "+r" (n), [lo] "=r" (lo),
+	      [hi] "=r" (hi)
+	    :
+	    : VEC_CLOBBERS);
+
+	return (lo + hi);
+}
+
+#ifdef KERNEL
+/*
+ * Bytes summed per FPU bracket; bounds the time spent with preemption
+ * disabled.
+ */
+#define	IN_CKSUM_SIMD_CHUNK	(16 * 1024)
+
+/* best implementation the CPU supports */
+static int in_cksum_simd_max = IN_CKSUM_SCALAR;
+
+/* implementation in use; scalar until in_cksum_simd_init() has run */
+int in_cksum_simd = IN_CKSUM_SCALAR;
+
+static int sysctl_cksum_simd SYSCTL_HANDLER_ARGS;
+
+SYSCTL_PROC(_net_inet_ip, OID_AUTO, cksum_simd,
+	CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &in_cksum_simd, 0,
+	sysctl_cksum_simd, "I",
+	"Checksum implementation (0: integer, 1: SSE2, 2: AVX2)");
+
+static int
+sysctl_cksum_simd SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	int error, i;
+
+	i = in_cksum_simd;
+	error = sysctl_handle_int(oidp, &i, 0, req);
+	if (error || req->newptr == USER_ADDR_NULL)
+		return (error);
+	if (i < IN_CKSUM_SCALAR || i > in_cksum_simd_max)
+		return (EINVAL);
+	in_cksum_simd = i;
+	return (0);
+}
+
+void
+in_cksum_simd_init(void)
+{
+	int impl = IN_CKSUM_SCALAR, i;
+
+	if (cpuid_features() & CPUID_FEATURE_SSE2)
+		impl = IN_CKSUM_SSE2;
+	/* the YMM registers must also be part of the saved thread state */
+	if (impl == IN_CKSUM_SSE2 &&
+	    (cpuid_leaf7_features() & CPUID_LEAF7_FEATURE_AVX2) &&
+	    ml_fpu_avx_enabled())
+		impl = IN_CKSUM_AVX2;
+
+	in_cksum_simd_max = impl;
+	if (PE_parse_boot_argn("cksum_simd", &i, sizeof (i)) &&
+	    i >= IN_CKSUM_SCALAR && i < impl)
+		impl = i;
+	in_cksum_simd = impl;
+}
+
+/*
+ * Sum, and copy to dst unless it is NULL, the leading 64-byte blocks
+ * of a span.  Returns the number of bytes done, with their sum in *sum,
+ * or 0 if the span is left entirely to the caller: vectors are turned
+ * off, the span is too short, or the FPU is not available in this
+ * context.
+ */
+static int
+in_cksum_simd_run(const void *src, void *dst, int len, uint64_t *sum)
+{
+	const uint8_t *p = src;
+	uint8_t *d = dst;
+	int impl = in_cksum_simd, done, n;
+	uint64_t s = 0;
+
+	len &= ~63;
+	if (impl == IN_CKSUM_SCALAR || len < IN_CKSUM_SIMD_MIN)
+		return (0);
+
+	for (done = 0; done < len; done += n) {
+		n = MIN(len - done, IN_CKSUM_SIMD_CHUNK);
+		if (!ml_fpu_kernel_enter())
+			return (0);
+		if (d == NULL) {
+			s += (impl == IN_CKSUM_AVX2) ?
+			    in_cksum_avx2(p + done, n) :
+			    in_cksum_sse2(p + done, n);
+		} else {
+			s += (impl == IN_CKSUM_AVX2) ?
+			    in_cksum_copy_avx2(p + done, d + done, n) :
+			    in_cksum_copy_sse2(p + done, d + done, n);
+		}
+		ml_fpu_kernel_exit();
+	}
+	*sum = s;
+	return (done);
+}
+
+int
+in_cksum_simd_block(const void *buf, int len, uint64_t *sum)
+{
+	return (in_cksum_simd_run(buf, NULL, len, sum));
+}
+
+int
+in_cksum_simd_copy_block(const void *src, void *dst, int len, uint64_t *sum)
+{
+	return (in_cksum_simd_run(src, dst, len, sum));
+}
+#endif /* KERNEL */
+
+#endif /* __x86_64__ */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NETINET_IN_CKSUM_SIMD_H_
+#define	_NETINET_IN_CKSUM_SIMD_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * Implementations of the checksum inner loop; the kernel picks the best
+ * one the CPU supports at boot, see in_cksum_simd_init().
+ */
+#define	IN_CKSUM_SCALAR		0	/* integer loop in in_cksumdata() */
+#define	IN_CKSUM_SSE2		1	/* 128-bit SSE2 */
+#define	IN_CKSUM_AVX2		2	/* 256-bit AVX2 */
+
+/*
+ * Spans shorter than this are left to the integer loop, for which the
+ * cost of saving the FPU state would not pay off.
+ */
+#define	IN_CKSUM_SIMD_MIN	256
+
+/*
+ * The vector routines work on a multiple of 64 bytes at any alignment.
+ * Each returns the sum of the span's 32-bit words, loaded in memory
+ * order, as a 64-bit value; like the "partial" accumulator of the
+ * integer loop, it folds down to the 16-bit one's complement sum of the
+ * span.  The copy variants also store the span at dst.  They use the
+ * vector registers without saving them and so must be bracketed by
+ * ml_fpu_kernel_enter()/ml_fpu_kernel_exit() in the kernel.
+ */
+extern uint64_t in_cksum_sse2(const void *buf, int len);
+extern uint64_t in_cksum_avx2(const void *buf, int len);
+extern uint64_t in_cksum_copy_sse2(const void *src, void *dst, int len);
+extern uint64_t in_cksum_copy_avx2(const void *src, void *dst, int len);
+
+#ifdef KERNEL
+extern int in_cksum_simd;
+
+extern void in_cksum_simd_init(void);
+extern int in_cksum_simd_block(const void *buf, int len, uint64_t *sum);
+extern int in_cksum_simd_copy_block(const void *src, void *dst, int len,
+    uint64_t *sum);
+#endif /* KERNEL */
+
+#endif /* _NETINET_IN_CKSUM_SIMD_H_ */
@@ -484,6 +484,14 @@ void
 in_pcbinfo_attach(struct inpcbinfo *ipi)
 {
 	struct inpcbinfo *ipi0;
+	int i;
+
+	for (i = 0; i < INPCB_HASHLOCKS; i++) {
+		lck_mtx_init(&ipi->ipi_hashlock[i], ipi->ipi_lock_grp,
+		    ipi->ipi_lock_attr);
+		lck_mtx_init(&ipi->ipi_porthashlock[i], ipi->ipi_lock_grp,
+		    ipi->ipi_lock_attr);
+	}
 
 	lck_mtx_lock(&inpcb_lock);
 	TAILQ_FOREACH(ipi0, &inpcb_head, ipi_entry) {
@@ -622,11 +630,11 @@ in_pcballoc(struct socket *so, struct inpcbinfo *pcbinfo, struct proc *p)
 /*
  * in_pcblookup_local_and_cleanup does everything
  * in_pcblookup_local does but it checks for a socket
- * that's going away. Since we know that the lock is
- * held read+write when this funciton is called, we
- * can safely dispose of this socket like the slow
- * timer would usually do and return NULL. This is
- * great for bind.
+ * that's going away.  Such a pcb is left for the slow
+ * timer to dispose of and NULL is returned, as its port
+ * is about to be released.  This is great for bind.
+ *
+ * The caller must hold the port hash lock for lport_arg.
  */
 struct inpcb *
 in_pcblookup_local_and_cleanup(struct inpcbinfo *pcbinfo, struct in_addr laddr,
@@ -638,20 +646,8 @@ in_pcblookup_local_and_cleanup(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 	inp = in_pcblookup_local(pcbinfo, laddr, lport_arg, wild_okay);
 
 	/* Check if we found a match but it's waiting to be disposed */
-	if (inp != NULL && inp->inp_wantcnt == WNT_STOPUSING) {
-		struct socket *so = inp->inp_socket;
-
-		lck_mtx_lock(&inp->inpcb_mtx);
-
-		if (so->so_usecount == 0) {
-			if (inp->inp_state != INPCB_STATE_DEAD)
-				in_pcbdetach(inp);
-			in_pcbdispose(inp);	/* will unlock & destroy */
-			inp = NULL;
-		} else {
-			lck_mtx_unlock(&inp->inpcb_mtx);
-		}
-	}
+	if (inp != NULL && inp->inp_wantcnt == WNT_STOPUSING)
+		inp = NULL;
 
 	return (inp);
 }
@@ -700,6 +696,7 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 	struct socket *so = inp->inp_socket;
 	unsigned short *lastport;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	lck_mtx_t *phlock = NULL;
 	u_short lport = 0, rand_port = 0;
 	int wild = 0, reuseport = (so->so_options & SO_REUSEPORT);
 	int error, randomport, conflict = 0;
@@ -714,28 +711,20 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		return (EINVAL);
 	if (!(so->so_options & (SO_REUSEADDR|SO_REUSEPORT)))
 		wild = 1;
-	socket_unlock(so, 0); /* keep reference on socket */
-	lck_rw_lock_exclusive(pcbinfo->ipi_lock);
 
 	bzero(&laddr, sizeof(laddr));
 
 	if (nam != NULL) {
 
-		if (nam->sa_len != sizeof (struct sockaddr_in)) {
-			lck_rw_done(pcbinfo->ipi_lock);
-			socket_lock(so, 0);
+		if (nam->sa_len != sizeof (struct sockaddr_in))
 			return (EINVAL);
-		}
 #if 0
 		/*
 		 * We should check the family, but old programs
 		 * incorrectly fail to initialize it.
 		 */
-		if (nam->sa_family != AF_INET) {
-			lck_rw_done(pcbinfo->ipi_lock);
-			socket_lock(so, 0);
+		if (nam->sa_family != AF_INET)
 			return (EAFNOSUPPORT);
-		}
 #endif /* 0 */
 		lport = SIN(nam)->sin_port;
 
@@ -761,8 +750,6 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 
 			ifa = ifa_ifwithaddr(SA(&sin));
 			if (ifa == NULL) {
-				lck_rw_done(pcbinfo->ipi_lock);
-				socket_lock(so, 0);
 				return (EADDRNOTAVAIL);
 			} else {
 				/*
@@ -788,12 +775,16 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				error = priv_check_cred(cred,
 				    PRIV_NETINET_RESERVEDPORT, 0);
 				kauth_cred_unref(&cred);
-				if (error != 0) {
-					lck_rw_done(pcbinfo->ipi_lock);
-					socket_lock(so, 0);
+				if (error != 0)
 					return (EACCES);
-				}
 			}
+			/*
+			 * Hold the port's hash lock until the pcb is
+			 * inserted, so that the port cannot be taken
+			 * by someone else after it is found to be free.
+			 */
+			phlock = INP_PORTHASHLOCK(pcbinfo, lport);
+			lck_mtx_lock(phlock);
 			if (!IN_MULTICAST(ntohl(SIN(nam)->sin_addr.s_addr)) &&
 			    (u = kauth_cred_getuid(so->so_cred)) != 0 &&
 			    (t = in_pcblookup_local_and_cleanup(
@@ -811,12 +802,11 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				    !(so->so_flags & SOF_NOTIFYCONFLICT))
 					conflict = 1;
 
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(phlock);
 
 				if (conflict)
 					in_pcb_conflict_post_msg(lport);
 
-				socket_lock(so, 0);
 				return (EADDRINUSE);
 			}
 			t = in_pcblookup_local_and_cleanup(pcbinfo,
@@ -836,11 +826,10 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 					    !(so->so_flags & SOF_NOTIFYCONFLICT))
 						conflict = 1;
 
-					lck_rw_done(pcbinfo->ipi_lock);
+					lck_mtx_unlock(phlock);
 
 					if (conflict)
 						in_pcb_conflict_post_msg(lport);
-					socket_lock(so, 0);
 					return (EADDRINUSE);
 				}
 			}
@@ -848,7 +837,7 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		laddr = SIN(nam)->sin_addr;
 	}
 	if (lport == 0) {
-		u_short first, last;
+		u_short first, last, aport;
 		int count;
 
 		randomport = (so->so_flags & SOF_BINDRANDOMPORT) ||
@@ -869,11 +858,8 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 			error = priv_check_cred(cred,
 			    PRIV_NETINET_RESERVEDPORT, 0);
 			kauth_cred_unref(&cred);
-			if (error != 0) {
-				lck_rw_done(pcbinfo->ipi_lock);
-				socket_lock(so, 0);
+			if (error != 0)
 				return (error);
-			}
 			first = ipport_lowfirstauto;	/* 1023 */
 			last  = ipport_lowlastauto;	/* 600 */
 			lastport = &pcbinfo->ipi_lastlow;
@@ -892,6 +878,10 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		 *
 		 * We split the two cases (up and down) so that the direction
 		 * is not being tested on each round of the loop.
+		 *
+		 * *lastport is only a hint shared by concurrent binds, so it
+		 * is advanced through a local copy; a candidate port is
+		 * checked and, if free, claimed under its hash lock.
 		 */
 		if (first > last) {
 			/*
@@ -904,19 +894,22 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 			}
 			count = first - last;
 
-			do {
-				if (count-- < 0) {	/* completely used? */
-					lck_rw_done(pcbinfo->ipi_lock);
-					socket_lock(so, 0);
+			for (;;) {
+				if (count-- < 0)	/* completely used? */
 					return (EADDRNOTAVAIL);
-				}
-				--*lastport;
-				if (*lastport > first || *lastport < last)
-					*lastport = first;
-				lport = htons(*lastport);
-			} while (in_pcblookup_local_and_cleanup(pcbinfo,
-			    ((laddr.s_addr != INADDR_ANY) ? laddr : 
-			    inp->inp_laddr), lport, wild));
+				aport = *lastport - 1;
+				if (aport > first || aport < last)
+					aport = first;
+				*lastport = aport;
+				lport = htons(aport);
+				phlock = INP_PORTHASHLOCK(pcbinfo, lport);
+				lck_mtx_lock(phlock);
+				if (in_pcblookup_local_and_cleanup(pcbinfo,
+				    ((laddr.s_addr != INADDR_ANY) ? laddr :
+				    inp->inp_laddr), lport, wild) == NULL)
+					break;
+				lck_mtx_unlock(phlock);
+			}
 		} else {
 			/*
 			 * counting up
@@ -928,27 +921,24 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 			}
 			count = last - first;
 
-			do {
-				if (count-- < 0) {	/* completely used? */
-					lck_rw_done(pcbinfo->ipi_lock);
-					socket_lock(so, 0);
+			for (;;) {
+				if (count-- < 0)	/* completely used? */
 					return (EADDRNOTAVAIL);
-				}
-				++*lastport;
-				if (*lastport < first || *lastport > last)
-					*lastport = first;
-				lport = htons(*lastport);
-			} while (in_pcblookup_local_and_cleanup(pcbinfo,
-			    ((laddr.s_addr != INADDR_ANY) ? laddr :
-			    inp->inp_laddr), lport, wild));
+				aport = *lastport + 1;
+				if (aport < first || aport > last)
+					aport = first;
+				*lastport = aport;
+				lport = htons(aport);
+				phlock = INP_PORTHASHLOCK(pcbinfo, lport);
+				lck_mtx_lock(phlock);
+				if (in_pcblookup_local_and_cleanup(pcbinfo,
+				    ((laddr.s_addr != INADDR_ANY) ? laddr :
+				    inp->inp_laddr), lport, wild) == NULL)
+					break;
+				lck_mtx_unlock(phlock);
+			}
 		}
 	}
-	socket_lock(so, 0);
-	if (inp->inp_lport != 0 || inp->inp_laddr.s_addr != INADDR_ANY) {
-		lck_rw_done(pcbinfo->ipi_lock);
-		return (EINVAL);
-	}
-
 	if (laddr.s_addr != INADDR_ANY) {
 		inp->inp_laddr = laddr;
 		inp->inp_last_outifp = outif;
@@ -964,10 +954,10 @@ in_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		inp->inp_lport = 0;
 		if (anonport)
 			inp->inp_flags &= ~INP_ANONPORT;
-		lck_rw_done(pcbinfo->ipi_lock);
+		lck_mtx_unlock(phlock);
 		return (EAGAIN);
 	}
-	lck_rw_done(pcbinfo->ipi_lock);
+	lck_mtx_unlock(phlock);
 	sflt_notify(so, sock_evt_bound, NULL);
 	return (0);
 }
@@ -1282,36 +1272,16 @@ in_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p,
 			if (error)
 				return (error);
 		}
-		if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
-			/*
-			 * Lock inversion issue, mostly with udp
-			 * multicast packets.
-			 */
-			socket_unlock(so, 0);
-			lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
-			socket_lock(so, 0);
-		}
 		inp->inp_laddr = laddr;
 		/* no reference needed */
 		inp->inp_last_outifp = (outif != NULL) ? *outif : NULL;
 		inp->inp_flags |= INP_INADDR_ANY;
-	} else {
-		if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
-			/*
-			 * Lock inversion issue, mostly with udp
-			 * multicast packets.
-			 */
-			socket_unlock(so, 0);
-			lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
-			socket_lock(so, 0);
-		}
 	}
 	inp->inp_faddr = sin->sin_addr;
 	inp->inp_fport = sin->sin_port;
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP)
 		nstat_pcb_invalidate_cache(inp);
 	in_pcbrehash(inp);
-	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 	return (0);
 }
 
@@ -1326,15 +1296,7 @@ in_pcbdisconnect(struct inpcb *inp)
 	inp->inp_faddr.s_addr = INADDR_ANY;
 	inp->inp_fport = 0;
 
-	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
-		/* lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(so, 0);
-		lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
-		socket_lock(so, 0);
-	}
-
 	in_pcbrehash(inp);
-	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 	/*
 	 * A multipath subflow socket would have its SS_NOFDREF set by default,
 	 * so check for SOF_MP_SUBFLOW socket flag before detaching the PCB;
@@ -1691,6 +1653,9 @@ in_rtchange(struct inpcb *inp, int errno)
 
 /*
  * Lookup a PCB based on the local address and port.
+ *
+ * The caller must hold the port hash lock for lport_arg, which keeps the
+ * returned pcb from being disposed of until it is dropped.
  */
 struct inpcb *
 in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
@@ -1704,12 +1669,16 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 
 	if (!wild_okay) {
 		struct inpcbhead *head;
+		lck_mtx_t *hlock;
+		u_int32_t idx;
 		/*
 		 * Look for an unconnected (wildcard foreign addr) PCB that
 		 * matches the local address and port we're looking for.
 		 */
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
+		idx = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[idx];
+		hlock = INP_HASHLOCK(pcbinfo, idx);
+		lck_mtx_lock(hlock);
 		LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 			if (!(inp->inp_vflag & INP_IPV4))
@@ -1721,9 +1690,11 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 				/*
 				 * Found.
 				 */
+				lck_mtx_unlock(hlock);
 				return (inp);
 			}
 		}
+		lck_mtx_unlock(hlock);
 		/*
 		 * Not found.
 		 */
@@ -1793,6 +1764,8 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 {
 	struct inpcbhead *head;
 	struct inpcb *inp;
+	lck_mtx_t *hlock;
+	u_int32_t idx;
 	u_short fport = fport_arg, lport = lport_arg;
 	int found = 0;
 	struct inpcb *local_wild = NULL;
@@ -1804,16 +1777,14 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	*gid = GID_MAX;
 
 	/*
-	 * We may have found the pcb in the last lookup - check this first.
+	 * First look for an exact match.  Only the lock of the bucket
+	 * being scanned is held; a pcb found there stays on it, and
+	 * hence is not disposed of, until the lock is dropped.
 	 */
-
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
-
-	/*
-	 * First look for an exact match.
-	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
-	    pcbinfo->ipi_hashmask)];
+	idx = INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[idx];
+	hlock = INP_HASHLOCK(pcbinfo, idx);
+	lck_mtx_lock(hlock);
 	LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 		if (!(inp->inp_vflag & INP_IPV4))
@@ -1835,21 +1806,24 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 				*gid = kauth_cred_getgid(
 				    inp->inp_socket->so_cred);
 			}
-			lck_rw_done(pcbinfo->ipi_lock);
+			lck_mtx_unlock(hlock);
 			return (found);
 		}
 	}
 
+	lck_mtx_unlock(hlock);
+
 	if (!wildcard) {
 		/*
 		 * Not found.
 		 */
-		lck_rw_done(pcbinfo->ipi_lock);
 		return (0);
 	}
 
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-	    pcbinfo->ipi_hashmask)];
+	idx = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[idx];
+	hlock = INP_HASHLOCK(pcbinfo, idx);
+	lck_mtx_lock(hlock);
 	LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 		if (!(inp->inp_vflag & INP_IPV4))
@@ -1867,7 +1841,7 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 					*gid = kauth_cred_getgid(
 					    inp->inp_socket->so_cred);
 				}
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(hlock);
 				return (found);
 			} else if (inp->inp_laddr.s_addr == INADDR_ANY) {
 #if INET6
@@ -1889,11 +1863,11 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 				*gid = kauth_cred_getgid(
 				    local_wild_mapped->inp_socket->so_cred);
 			}
-			lck_rw_done(pcbinfo->ipi_lock);
+			lck_mtx_unlock(hlock);
 			return (found);
 		}
 #endif /* INET6 */
-		lck_rw_done(pcbinfo->ipi_lock);
+		lck_mtx_unlock(hlock);
 		return (0);
 	}
 	if ((found = (local_wild->inp_socket != NULL))) {
@@ -1902,7 +1876,7 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 		*gid = kauth_cred_getgid(
 		    local_wild->inp_socket->so_cred);
 	}
-	lck_rw_done(pcbinfo->ipi_lock);
+	lck_mtx_unlock(hlock);
 	return (found);
 }
 
@@ -1916,6 +1890,8 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 {
 	struct inpcbhead *head;
 	struct inpcb *inp;
+	lck_mtx_t *hlock;
+	u_int32_t idx;
 	u_short fport = fport_arg, lport = lport_arg;
 	struct inpcb *local_wild = NULL;
 #if INET6
@@ -1923,16 +1899,14 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 #endif /* INET6 */
 
 	/*
-	 * We may have found the pcb in the last lookup - check this first.
+	 * First look for an exact match.  Only the lock of the bucket
+	 * being scanned is held; a pcb found there stays on it, and
+	 * hence is not disposed of, until the lock is dropped.
 	 */
-
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
-
-	/*
-	 * First look for an exact match.
-	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
-	    pcbinfo->ipi_hashmask)];
+	idx = INP_PCBHASH(faddr.s_addr, lport, fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[idx];
+	hlock = INP_HASHLOCK(pcbinfo, idx);
+	lck_mtx_lock(hlock);
 	LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 		if (!(inp->inp_vflag & INP_IPV4))
@@ -1950,26 +1924,29 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(hlock);
 				return (inp);
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(hlock);
 				return (NULL);
 			}
 		}
 	}
 
+	lck_mtx_unlock(hlock);
+
 	if (!wildcard) {
 		/*
 		 * Not found.
 		 */
-		lck_rw_done(pcbinfo->ipi_lock);
 		return (NULL);
 	}
 
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-	    pcbinfo->ipi_hashmask)];
+	idx = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[idx];
+	hlock = INP_HASHLOCK(pcbinfo, idx);
+	lck_mtx_lock(hlock);
 	LIST_FOREACH(inp, head, inp_hash) {
 #if INET6
 		if (!(inp->inp_vflag & INP_IPV4))
@@ -1983,11 +1960,11 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			if (inp->inp_laddr.s_addr == laddr.s_addr) {
 				if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 				    WNT_STOPUSING) {
-					lck_rw_done(pcbinfo->ipi_lock);
+					lck_mtx_unlock(hlock);
 					return (inp);
 				} else {
 					/* it's dead; say it isn't found */
-					lck_rw_done(pcbinfo->ipi_lock);
+					lck_mtx_unlock(hlock);
 					return (NULL);
 				}
 			} else if (inp->inp_laddr.s_addr == INADDR_ANY) {
@@ -2005,31 +1982,33 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 		if (local_wild_mapped != NULL) {
 			if (in_pcb_checkstate(local_wild_mapped,
 			    WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(hlock);
 				return (local_wild_mapped);
 			} else {
 				/* it's dead; say it isn't found */
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(hlock);
 				return (NULL);
 			}
 		}
 #endif /* INET6 */
-		lck_rw_done(pcbinfo->ipi_lock);
+		lck_mtx_unlock(hlock);
 		return (NULL);
 	}
 	if (in_pcb_checkstate(local_wild, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-		lck_rw_done(pcbinfo->ipi_lock);
+		lck_mtx_unlock(hlock);
 		return (local_wild);
 	}
 	/*
 	 * It's either not found or is already dead.
 	 */
-	lck_rw_done(pcbinfo->ipi_lock);
+	lck_mtx_unlock(hlock);
 	return (NULL);
 }
 
 /*
- * Insert PCB onto various hash lists.
+ * Insert PCB onto various hash lists.  If locked is set, the caller holds
+ * the port hash lock for the pcb's local port, e.g. to keep the port from
+ * being claimed by another pcb between its conflict check and the insert.
  */
 int
 in_pcbinshash(struct inpcb *inp, int locked)
@@ -2038,27 +2017,14 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	struct inpcbporthead *pcbporthash;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbport *phd;
+	lck_mtx_t *phlock, *hlock;
 	u_int32_t hashkey_faddr;
 
-	if (!locked) {
-		if (!lck_rw_try_lock_exclusive(pcbinfo->ipi_lock)) {
-			/*
-			 * Lock inversion issue, mostly with udp
-			 * multicast packets
-			 */
-			socket_unlock(inp->inp_socket, 0);
-			lck_rw_lock_exclusive(pcbinfo->ipi_lock);
-			socket_lock(inp->inp_socket, 0);
-			if (inp->inp_state == INPCB_STATE_DEAD) {
-				/*
-				 * The socket got dropped when
-				 * it was unlocked
-				 */
-				lck_rw_done(pcbinfo->ipi_lock);
-				return (ECONNABORTED);
-			}
-		}
-	}
+	phlock = INP_PORTHASHLOCK(pcbinfo, inp->inp_lport);
+	if (!locked)
+		lck_mtx_lock(phlock);
+	else
+		lck_mtx_assert(phlock, LCK_MTX_ASSERT_OWNED);
 
 #if INET6
 	if (inp->inp_vflag & INP_IPV6)
@@ -2071,6 +2037,7 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	    inp->inp_fport, pcbinfo->ipi_hashmask);
 
 	pcbhash = &pcbinfo->ipi_hashbase[inp->inp_hash_element];
+	hlock = INP_HASHLOCK(pcbinfo, inp->inp_hash_element);
 
 	pcbporthash = &pcbinfo->ipi_porthashbase[INP_PCBPORTHASH(inp->inp_lport,
 	    pcbinfo->ipi_porthashmask)];
@@ -2093,7 +2060,7 @@ in_pcbinshash(struct inpcb *inp, int locked)
 		    M_PCB, M_WAITOK);
 		if (phd == NULL) {
 			if (!locked)
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(phlock);
 			return (ENOBUFS); /* XXX */
 		}
 		phd->phd_port = inp->inp_lport;
@@ -2104,11 +2071,13 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
 	inp->inp_phd = phd;
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
+	lck_mtx_lock(hlock);
 	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
+	lck_mtx_unlock(hlock);
 
 	if (!locked)
-		lck_rw_done(pcbinfo->ipi_lock);
+		lck_mtx_unlock(phlock);
 	
 #if NECP
 	// This call catches the original setting of the local address
@@ -2118,17 +2087,53 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	return (0);
 }
 
+/*
+ * Lock the hash buckets of a pcb's current and new hash elements, in
+ * array order; one lock is taken if both map to the same one.
+ */
+static void
+in_pcbhash_lock2(struct inpcbinfo *pcbinfo, u_int32_t idx1, u_int32_t idx2)
+{
+	lck_mtx_t *l1 = INP_HASHLOCK(pcbinfo, idx1);
+	lck_mtx_t *l2 = INP_HASHLOCK(pcbinfo, idx2);
+
+	if (l1 == l2) {
+		lck_mtx_lock(l1);
+	} else if (l1 < l2) {
+		lck_mtx_lock(l1);
+		lck_mtx_lock(l2);
+	} else {
+		lck_mtx_lock(l2);
+		lck_mtx_lock(l1);
+	}
+}
+
+static void
+in_pcbhash_unlock2(struct inpcbinfo *pcbinfo, u_int32_t idx1, u_int32_t idx2)
+{
+	lck_mtx_t *l1 = INP_HASHLOCK(pcbinfo, idx1);
+	lck_mtx_t *l2 = INP_HASHLOCK(pcbinfo, idx2);
+
+	lck_mtx_unlock(l1);
+	if (l2 != l1)
+		lck_mtx_unlock(l2);
+}
+
 /*
  * Move PCB to the proper hash bucket when { faddr, fport } have  been
  * changed. NOTE: This does not handle the case of the lport changing (the
  * hashed port list would have to be updated as well), so the lport must
  * not change after in_pcbinshash() has been called.
+ *
+ * The move is done with both the old and the new bucket locked, so that
+ * lookups never miss the pcb while it is in transit.
  */
 void
 in_pcbrehash(struct inpcb *inp)
 {
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbhead *head;
-	u_int32_t hashkey_faddr;
+	u_int32_t hashkey_faddr, oidx, idx;
 
 #if INET6
 	if (inp->inp_vflag & INP_IPV6)
@@ -2137,18 +2142,22 @@ in_pcbrehash(struct inpcb *inp)
 #endif /* INET6 */
 		hashkey_faddr = inp->inp_faddr.s_addr;
 
-	inp->inp_hash_element = INP_PCBHASH(hashkey_faddr, inp->inp_lport,
-	    inp->inp_fport, inp->inp_pcbinfo->ipi_hashmask);
-	head = &inp->inp_pcbinfo->ipi_hashbase[inp->inp_hash_element];
+	oidx = inp->inp_hash_element;
+	idx = INP_PCBHASH(hashkey_faddr, inp->inp_lport,
+	    inp->inp_fport, pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[idx];
 
+	in_pcbhash_lock2(pcbinfo, oidx, idx);
 	if (inp->inp_flags2 & INP2_INHASHLIST) {
 		LIST_REMOVE(inp, inp_hash);
 		inp->inp_flags2 &= ~INP2_INHASHLIST;
 	}
 
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
+	inp->inp_hash_element = idx;
 	LIST_INSERT_HEAD(head, inp, inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
+	in_pcbhash_unlock2(pcbinfo, oidx, idx);
 	
 #if NECP
 	// This call catches updates to the remote addresses
@@ -2158,12 +2167,15 @@ in_pcbrehash(struct inpcb *inp)
 
 /*
  * Remove PCB from various lists.
- * Must be called pcbinfo lock is held in exclusive mode.
+ * Must be called pcbinfo lock is held in exclusive mode; the hash
+ * bucket locks are taken here.
  */
 void
 in_pcbremlists(struct inpcb *inp)
 {
-	inp->inp_gencnt = ++inp->inp_pcbinfo->ipi_gencnt;
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+
+	inp->inp_gencnt = ++pcbinfo->ipi_gencnt;
 
 	/*
 	 * Check if it's in hashlist -- an inp is placed in hashlist when
@@ -2172,12 +2184,18 @@ in_pcbremlists(struct inpcb *inp)
 	 */
 	if (inp->inp_flags2 & INP2_INHASHLIST) {
 		struct inpcbport *phd = inp->inp_phd;
+		lck_mtx_t *phlock, *hlock;
 
 		VERIFY(phd != NULL && inp->inp_lport > 0);
 
+		phlock = INP_PORTHASHLOCK(pcbinfo, inp->inp_lport);
+		hlock = INP_HASHLOCK(pcbinfo, inp->inp_hash_element);
+		lck_mtx_lock(phlock);
+		lck_mtx_lock(hlock);
 		LIST_REMOVE(inp, inp_hash);
 		inp->inp_hash.le_next = NULL;
 		inp->inp_hash.le_prev = NULL;
+		lck_mtx_unlock(hlock);
 
 		LIST_REMOVE(inp, inp_portlist);
 		inp->inp_portlist.le_next = NULL;
@@ -2188,6 +2206,7 @@ in_pcbremlists(struct inpcb *inp)
 		}
 		inp->inp_phd = NULL;
 		inp->inp_flags2 &= ~INP2_INHASHLIST;
+		lck_mtx_unlock(phlock);
 	}
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
 
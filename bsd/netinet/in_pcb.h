@@ -163,6 +163,7 @@ struct inpcb {
 
 	u_char inp_ip_ttl;		/* time to live proto */
 	u_char inp_ip_p;		/* protocol proto */
+	u_int16_t inp_udp_segsz;	/* UDP_SEGMENT datagram payload size */
 
 	struct ifnet *inp_boundifp;	/* interface for INP_BOUND_IF */
 	struct ifnet *inp_last_outifp;	/* last known outgoing interface */
@@ -509,10 +510,22 @@ struct intimercount {
 
 typedef void (*inpcb_timer_func_t)(struct inpcbinfo *);
 
+/* number of locks for each of the pcb hashes; must be a power of 2 */
+#define	INPCB_HASHLOCKS		64
+
 /*
  * Global data structure for each high-level protocol (UDP, TCP, ...) in both
- * IPv4 and IPv6.  Holds inpcb lists and information for managing them.  Each
- * pcbinfo is protected by a RW lock: ipi_lock.
+ * IPv4 and IPv6.  Holds inpcb lists and information for managing them.  The
+ * pcb list is protected by a RW lock, ipi_lock; the lookup hash and the port
+ * hash are instead protected by arrays of mutexes, each covering the buckets
+ * whose index maps to it (see INP_HASHLOCK and INP_PORTHASHLOCK.)  This lets
+ * binds, connects and lookups on unrelated ports proceed in parallel.
+ *
+ * Lock ordering is ipi_lock, then the socket (pcb) lock, then a port hash
+ * lock, then hash lock(s); when two hash locks are needed they are taken in
+ * array order.  The bucket locks are leaves: nothing else is acquired while
+ * holding them.  A pcb on a port hash chain is not disposed of while that
+ * chain's lock is held, since in_pcbremlists needs it to unlink the pcb.
  *
  * All INPCB pcbinfo entries are linked together via ipi_entry.
  */
@@ -575,6 +588,12 @@ struct inpcbinfo {
 	struct inpcbporthead	*ipi_porthashbase;
 	u_long			ipi_porthashmask;
 
+	/*
+	 * Locks for the buckets of the above hashes.
+	 */
+	decl_lck_mtx_data(, ipi_hashlock[INPCB_HASHLOCKS]);
+	decl_lck_mtx_data(, ipi_porthashlock[INPCB_HASHLOCKS]);
+
 	/*
 	 * Misc.
 	 */
@@ -588,6 +607,12 @@ struct inpcbinfo {
 #define	INP_PCBPORTHASH(lport, mask) \
 	(ntohs((lport)) & (mask))
 
+#define	INP_HASHLOCK(ipi, idx) \
+	(&(ipi)->ipi_hashlock[(idx) & (INPCB_HASHLOCKS - 1)])
+#define	INP_PORTHASHLOCK(ipi, lport) \
+	(&(ipi)->ipi_porthashlock[INP_PCBPORTHASH(lport, \
+	    (ipi)->ipi_porthashmask) & (INPCB_HASHLOCKS - 1)])
+
 #define	INP_IS_FLOW_CONTROLLED(_inp_) \
 	((_inp_)->inp_flags & INP_FLOW_CONTROLLED)
 #define	INP_IS_FLOW_SUSPENDED(_inp_) \
@@ -89,6 +89,7 @@
 #include <netinet/udp_var.h>
 #include <netinet/ip_encap.h>
 #include <netinet/ip_divert.h>
+#include <netinet/lro_ext.h>
 
 
 /*
@@ -326,8 +327,14 @@ ip_proto_input(protocol_family_t protocol, mbuf_t packet_list)
 {
 #pragma unused(protocol)
 	mbuf_t	packet;
+	struct ifnet *ifp;
+	struct udp_rcvbatch urb;
 	int how_many = 0 ;
 
+	/* DLIL hands up one interface's packets per list */
+	ifp = (packet_list != NULL) ? packet_list->m_pkthdr.rcvif : NULL;
+	udp_rcvbatch_begin(&urb);
+
 	/* ip_input should handle a list of packets but does not yet */
 	for (packet = packet_list; packet; packet = packet_list) {
 		how_many++;
@@ -335,6 +342,11 @@ ip_proto_input(protocol_family_t protocol, mbuf_t packet_list)
 		mbuf_setnextpkt(packet, NULL);
 		ip_input(packet);
 	}
+
+	/* deliver what LRO coalesced from this batch */
+	if (sw_lro)
+		tcp_lro_flush(ifp);
+	udp_rcvbatch_end(&urb);
 }
 
 SYSCTL_NODE(_net, PF_INET, inet,
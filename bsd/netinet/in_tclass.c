@@ -1151,10 +1151,7 @@ so_set_lro(struct socket *so, int optval)
 			if (inp) {
 				tp = intotcpcb(inp);
 				if (tp && (tp->t_flagsext & TF_LRO_OFFLOADED)) {
-					tcp_lro_remove_state(inp->inp_laddr,
-						inp->inp_faddr,
-						inp->inp_lport, 
-						inp->inp_fport);
+					tcp_lro_remove_state(tp);
 					tp->t_flagsext &= ~TF_LRO_OFFLOADED;	
 				}
 			}
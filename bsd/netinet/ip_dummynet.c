@@ -66,7 +66,9 @@
  *  + scheduler and dummynet functions;
  *  + configuration and initialization.
  *
- * NOTA BENE: critical sections are protected by the "dummynet lock".
+ * NOTA BENE: critical sections are protected by the "dummynet lock",
+ * which guards the pipe and flow_set tables, and by the lock of the
+ * pipe being worked on; see the comment above dn_lock.
  *
  * Most important Changes:
  *
@@ -89,6 +91,7 @@
 #include <sys/socketvar.h>
 #include <sys/time.h>
 #include <sys/sysctl.h>
+#include <libkern/OSAtomic.h>
 #include <net/if.h>
 #include <net/route.h>
 #include <net/kpi_protocol.h>
@@ -116,7 +119,7 @@ static dn_key curr_time = 0 ; /* current simulation time */
 
 /* this is for the timer that fires to call dummynet() - we only enable the timer when
 	there are packets to process, otherwise it's disabled */
-static int timer_enabled = 0;	
+static volatile UInt32 timer_enabled = 0;
 
 static int dn_hash_size = 64 ;	/* default hash size */
 
@@ -129,24 +132,57 @@ static int red_lookup_depth = 256;	/* RED - default lookup table depth */
 static int red_avg_pkt_size = 512;      /* RED - default medium packet size */
 static int red_max_pkt_size = 1500;     /* RED - default max packet size */
 
-static int serialize = 0;
-
 /*
- * Three heaps contain queues and pipes that the scheduler handles:
+ * The scheduler keeps its events on a calendar queue: a wheel of
+ * DN_WHEEL_SLOTS lists, one per tick, each with its own lock.  An event
+ * due at tick t sits on slot (t & DN_WHEEL_MASK); one due more than a
+ * turn of the wheel away stays on its slot until its turn comes round.
+ * There are three kinds of events:
  *
- * ready_heap contains all dn_flow_queue related to fixed-rate pipes.
+ * DN_EV_READY is the finish time of a dn_flow_queue of a fixed-rate pipe.
  *
- * wfq_ready_heap contains the pipes associated with WF2Q flows
+ * DN_EV_WFQ is the next transmit time of a pipe with WF2Q flows.
  *
- * extract_heap contains pipes associated with delay lines.
+ * DN_EV_TX is the delivery time of the head of a pipe's delay line.
  *
+ * dn_wheel_tick is the last tick the scheduler has run.  It only changes
+ * with the lock of its slot held, so an event is never added to a slot
+ * after the scheduler has emptied it for that tick.
  */
-static struct dn_heap ready_heap, extract_heap, wfq_ready_heap ;
+#define	DN_WHEEL_SLOTS	1024		/* must be a power of 2 */
+#define	DN_WHEEL_MASK	(DN_WHEEL_SLOTS - 1)
+#define	DN_WHEEL_BATCH	64		/* events fired per dn_lock hold */
+
+#define	DN_EV_READY	0
+#define	DN_EV_WFQ	1
+#define	DN_EV_TX	2
+#define	DN_EV_MAX	3
+
+#define	DN_EV_IDLE	(-1)		/* ev_slot: not scheduled */
+#define	DN_EV_FIRING	(-2)		/* ev_slot: taken off by dummynet() */
+
+#define	DN_EV_CONTAINER(ev, type, field)				\
+	((type *)(void *)((char *)(ev) - offsetof(type, field)))
+
+struct dn_wheel_slot {
+	decl_lck_mtx_data(, ws_lock);
+	TAILQ_HEAD(, dn_event) ws_events;
+};
+
+static struct dn_wheel_slot dn_wheel[DN_WHEEL_SLOTS];
+static dn_key dn_wheel_tick;
+static int dn_wheel_events[DN_EV_MAX];	/* events scheduled, by type */
 
 static int heap_init(struct dn_heap *h, int size) ;
 static int heap_insert (struct dn_heap *h, dn_key key1, void *p);
 static void heap_extract(struct dn_heap *h, void *obj);
 
+static dn_key	dn_update_time(void);
+static void	dn_event_init(struct dn_event *ev, int type);
+static void	dn_event_schedule(struct dn_event *ev, dn_key key);
+static void	dn_event_cancel(struct dn_event *ev);
+static void	dn_pipe_unserialize(struct dn_pipe *pipe);
+static void	dn_pipe_release(struct dn_pipe *pipe);
 
 static void	transmit_event(struct dn_pipe *pipe, struct mbuf **head,
 		    struct mbuf **tail);
@@ -176,9 +212,11 @@ SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, hash_size,
 SYSCTL_QUAD(_net_inet_ip_dummynet, OID_AUTO, curr_time,
 	    CTLFLAG_RD | CTLFLAG_LOCKED, &curr_time, "Current tick");
 SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, ready_heap,
-	    CTLFLAG_RD | CTLFLAG_LOCKED, &ready_heap.size, 0, "Size of ready heap");
+	    CTLFLAG_RD | CTLFLAG_LOCKED, &dn_wheel_events[DN_EV_READY], 0,
+	    "Number of fixed-rate queues scheduled");
 SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, extract_heap,
-	    CTLFLAG_RD | CTLFLAG_LOCKED, &extract_heap.size, 0, "Size of extract heap");
+	    CTLFLAG_RD | CTLFLAG_LOCKED, &dn_wheel_events[DN_EV_TX], 0,
+	    "Number of delay lines scheduled");
 SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, searches,
 	    CTLFLAG_RD | CTLFLAG_LOCKED, &searches, 0, "Number of queue searches");
 SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, search_steps,
@@ -214,12 +252,19 @@ SYSCTL_INT(_net_inet_ip_dummynet, OID_AUTO, debug, CTLFLAG_RW | CTLFLAG_LOCKED,
  */
 #define MY_RANDOM (random() & 0x7FFFFFFF)
 
-/* dummynet lock */
+/*
+ * dummynet locks.  dn_lock protects the pipe and flow_set tables: the
+ * packet path and the scheduler hold it shared, configuration holds it
+ * exclusive.  Each pipe's lock protects the pipe, its delay line and
+ * WF2Q+ heaps, and the flow_sets feeding it along with their queues and
+ * events.  The lock order is dn_lock, then a pipe lock, then a wheel
+ * slot lock.
+ */
 static lck_grp_t         *dn_mutex_grp;
 static lck_grp_attr_t    *dn_mutex_grp_attr;
 static lck_attr_t        *dn_mutex_attr;
-decl_lck_mtx_data(static, dn_mutex_data);
-static lck_mtx_t         *dn_mutex = &dn_mutex_data;
+decl_lck_rw_data(static, dn_lock_data);
+static lck_rw_t          *dn_lock = &dn_lock_data;
 
 static int config_pipe(struct dn_pipe *p);
 static int ip_dn_ctl(struct sockopt *sopt);
@@ -705,6 +750,188 @@ dn_tag_get(struct mbuf *m)
     return (struct dn_pkt_tag *)(mtag+1);
 }
 
+/*
+ * Calendar queue functions.
+ *
+ * dn_event_schedule() puts an event on the wheel, or moves it earlier if
+ * it is already there, and dn_event_cancel() takes it off.  Both are
+ * called with the lock of the pipe owning the event held, or with
+ * dn_lock held exclusive.
+ */
+
+/*
+ * make all time measurements in milliseconds (ms) - here we convert
+ * secs and usecs to msecs (just divide the usecs and take the closest
+ * whole number).  Several threads may update the time at once, so it
+ * is only ever moved forward.
+ */
+static dn_key
+dn_update_time(void)
+{
+	struct timeval tv;
+	dn_key now, old;
+
+	microuptime(&tv);
+	now = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	do {
+		old = curr_time;
+		if (DN_KEY_GEQ(old, now))
+			return (old);
+	} while (!OSCompareAndSwap64(old, now, (volatile UInt64 *)&curr_time));
+
+	return (now);
+}
+
+static void
+dn_timer_arm(void)
+{
+	struct timespec ts;
+
+	if (OSCompareAndSwap(0, 1, &timer_enabled)) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 1 * 1000000;	// 1ms
+		bsd_timeout(dummynet, NULL, &ts);
+	}
+}
+
+static void
+dn_event_init(struct dn_event *ev, int type)
+{
+	ev->ev_slot = DN_EV_IDLE;
+	ev->ev_type = type;
+}
+
+static void
+dn_event_schedule(struct dn_event *ev, dn_key key)
+{
+	struct dn_wheel_slot *ws;
+	dn_key t;
+
+	if (ev->ev_slot >= 0) {
+		if (DN_KEY_LEQ(ev->ev_key, key))
+			return;		/* already due no later than that */
+		dn_event_cancel(ev);
+	}
+	ev->ev_key = key;
+
+	/* an event due on a tick that has already run goes on the next one */
+	for (t = key; ; t = dn_wheel_tick + 1) {
+		ws = &dn_wheel[t & DN_WHEEL_MASK];
+		lck_mtx_lock_spin(&ws->ws_lock);
+		if (DN_KEY_GT(t, dn_wheel_tick))
+			break;
+		lck_mtx_unlock(&ws->ws_lock);
+	}
+	TAILQ_INSERT_TAIL(&ws->ws_events, ev, ev_link);
+	ev->ev_slot = (int)(t & DN_WHEEL_MASK);
+	lck_mtx_unlock(&ws->ws_lock);
+
+	OSIncrementAtomic((volatile SInt32 *)&dn_wheel_events[ev->ev_type]);
+	dn_timer_arm();
+}
+
+static void
+dn_event_cancel(struct dn_event *ev)
+{
+	struct dn_wheel_slot *ws;
+	int slot = ev->ev_slot;
+
+	if (slot == DN_EV_IDLE)
+		return;
+	if (slot >= 0) {
+		ws = &dn_wheel[slot];
+		lck_mtx_lock_spin(&ws->ws_lock);
+		/* dummynet() may have taken it off in the meantime */
+		if (ev->ev_slot == slot) {
+			TAILQ_REMOVE(&ws->ws_events, ev, ev_link);
+			OSDecrementAtomic(
+			    (volatile SInt32 *)&dn_wheel_events[ev->ev_type]);
+		}
+		lck_mtx_unlock(&ws->ws_lock);
+	}
+	/* a firing event is skipped once dummynet() sees it is idle */
+	ev->ev_slot = DN_EV_IDLE;
+}
+
+/*
+ * Return the pipe whose lock protects an event.
+ */
+static struct dn_pipe *
+dn_event_pipe(struct dn_event *ev)
+{
+	switch (ev->ev_type) {
+	case DN_EV_READY:
+		return (DN_EV_CONTAINER(ev, struct dn_flow_queue, ev)->fs->pipe);
+	case DN_EV_WFQ:
+		return (DN_EV_CONTAINER(ev, struct dn_pipe, wfq_ev));
+	default:
+		return (DN_EV_CONTAINER(ev, struct dn_pipe, tx_ev));
+	}
+}
+
+static void
+dn_event_fire(struct dn_event *ev, struct mbuf **head, struct mbuf **tail)
+{
+	struct dn_pipe *pipe;
+
+	ev->ev_slot = DN_EV_IDLE;
+	switch (ev->ev_type) {
+	case DN_EV_READY:
+		ready_event(DN_EV_CONTAINER(ev, struct dn_flow_queue, ev),
+		    head, tail);
+		break;
+	case DN_EV_WFQ:
+		pipe = DN_EV_CONTAINER(ev, struct dn_pipe, wfq_ev);
+		if (pipe->if_name[0] != '\0')
+			printf("dummynet: bad ready_event_wfq for pipe %s\n",
+			    pipe->if_name);
+		else
+			ready_event_wfq(pipe, head, tail);
+		break;
+	default:
+		transmit_event(DN_EV_CONTAINER(ev, struct dn_pipe, tx_ev),
+		    head, tail);
+		break;
+	}
+}
+
+/*
+ * Pipes being sent from are kept alive by their serialize count, so
+ * delete_pipe() leaves the last sender to free them.
+ */
+static void
+dn_pipe_free(struct dn_pipe *pipe)
+{
+	lck_mtx_destroy(&pipe->lock, dn_mutex_grp);
+	FREE(pipe, M_DUMMYNET);
+}
+
+static void
+dn_pipe_unserialize(struct dn_pipe *pipe)
+{
+	int dead;
+
+	lck_mtx_lock(&pipe->lock);
+	ASSERT(pipe->serialize > 0);
+	dead = (--pipe->serialize == 0 && (pipe->pipe_flags & DN_PIPE_DEAD));
+	lck_mtx_unlock(&pipe->lock);
+	if (dead)
+		dn_pipe_free(pipe);
+}
+
+static void
+dn_pipe_release(struct dn_pipe *pipe)
+{
+	int busy;
+
+	lck_mtx_lock(&pipe->lock);
+	pipe->pipe_flags |= DN_PIPE_DEAD;
+	busy = pipe->serialize;
+	lck_mtx_unlock(&pipe->lock);
+	if (busy == 0)
+		dn_pipe_free(pipe);
+}
+
 /*
  * Scheduler functions:
  *
@@ -730,9 +957,9 @@ transmit_event(struct dn_pipe *pipe, struct mbuf **head, struct mbuf **tail)
 	struct dn_pkt_tag *pkt = NULL;
 	u_int64_t schedule_time;
 
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
-        ASSERT(serialize >= 0);
-	if (serialize == 0) {
+	lck_mtx_assert(&pipe->lock, LCK_MTX_ASSERT_OWNED);
+	ASSERT(pipe->serialize >= 0);
+	if (pipe->serialize == 0) {
 		while ((m = pipe->head) != NULL) {
 			pkt = dn_tag_get(m);
 			if (!DN_KEY_LEQ(pkt->dn_output_time, curr_time))
@@ -753,14 +980,9 @@ transmit_event(struct dn_pipe *pipe, struct mbuf **head, struct mbuf **tail)
 	schedule_time = pkt == NULL || DN_KEY_LEQ(pkt->dn_output_time, curr_time) ?
 		curr_time + 1 : pkt->dn_output_time;
 
-	/* if there are leftover packets, put the pipe into the heap for next ready event */
-	if ((m = pipe->head) != NULL) {
-		pkt = dn_tag_get(m);
-		/* XXX should check errors on heap_insert, by draining the
-		 * whole pipe p and hoping in the future we are more successful
-		 */
-		heap_insert(&extract_heap, schedule_time, pipe);
-	}
+	/* if there are leftover packets, schedule the next delivery */
+	if (pipe->head != NULL)
+		dn_event_schedule(&pipe->tx_ev, schedule_time);
 }
 
 /*
@@ -817,12 +1039,12 @@ ready_event(struct dn_flow_queue *q, struct mbuf **head, struct mbuf **tail)
     struct dn_pipe *p = q->fs->pipe ;
     int p_was_empty ;
 
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
-	
     if (p == NULL) {
 		printf("dummynet: ready_event pipe is gone\n");
 		return ;
     }
+	lck_mtx_assert(&p->lock, LCK_MTX_ASSERT_OWNED);
+
     p_was_empty = (p->head == NULL) ;
 
     /*
@@ -852,10 +1074,7 @@ ready_event(struct dn_flow_queue *q, struct mbuf **head, struct mbuf **tail)
     if ( (pkt = q->head) != NULL ) { /* this implies bandwidth != 0 */
 	dn_key t = SET_TICKS(pkt, q, p); /* ticks i have to wait */
 	q->sched_time = curr_time ;
-	heap_insert(&ready_heap, curr_time + t, (void *)q );
-	/* XXX should check errors on heap_insert, and drain the whole
-	 * queue on error hoping next time we are luckier.
-	 */
+	dn_event_schedule(&q->ev, curr_time + t);
     } else {	/* RED needs to know when the queue becomes empty */
 	q->q_time = curr_time;
 	q->numbytes = 0;
@@ -884,7 +1103,7 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
     struct dn_heap *neh = &(p->not_eligible_heap) ;
 	int64_t p_numbytes = p->numbytes;
 
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
+	lck_mtx_assert(&p->lock, LCK_MTX_ASSERT_OWNED);
 
     if (p->if_name[0] == 0) /* tx clock is simulated */
 	p_numbytes += ( curr_time - p->sched_time ) * p->bandwidth;
@@ -951,6 +1170,15 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 	    break ;
 	}
     }
+    /* expire idle flow_queues whose finish time V has passed */
+    while (p->idle_heap.elements > 0 &&
+	    DN_KEY_LT(p->idle_heap.p[0].key, p->V) ) {
+	struct dn_flow_queue *q = p->idle_heap.p[0].object ;
+
+	heap_extract(&(p->idle_heap), NULL);
+	q->S = q->F + 1 ; /* mark timestamp as invalid */
+	p->sum -= q->fs->weight ;
+    }
     if (sch->elements == 0 && neh->elements == 0 && p_numbytes >= 0
 	    && p->idle_heap.elements > 0) {
 	/*
@@ -980,10 +1208,7 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 	    t = ( p->bandwidth -1 - p_numbytes) / p->bandwidth ;
 	dn_tag_get(p->tail)->dn_output_time += t ;
 	p->sched_time = curr_time ;
-	heap_insert(&wfq_ready_heap, curr_time + t, (void *)p);
-	/* XXX should check errors on heap_insert, and drain the whole
-	 * queue on error hoping next time we are luckier.
-	 */
+	dn_event_schedule(&p->wfq_ev, curr_time + t);
     }
 		
 	/* Fit (adjust if necessary) 64bit result into 32bit variable. */
@@ -1006,93 +1231,109 @@ ready_event_wfq(struct dn_pipe *p, struct mbuf **head, struct mbuf **tail)
 /*
  * This is called every 1ms. It is used to
  * increment the current tick counter and schedule expired events.
+ *
+ * Each wheel slot up to the current tick is emptied in batches: the
+ * due events are taken off the slot, then each is fired with its pipe
+ * locked.  The chains of packets that come out are sent once dn_lock
+ * is dropped, keeping their pipes busy (serialized) until then.
  */
 static void
 dummynet(__unused void * unused)
 {
-    void *p ; /* generic parameter to handler */
-    struct dn_heap *h ;
-    struct dn_heap *heaps[3];
-    struct mbuf *head = NULL, *tail = NULL;
-    int i;
-    struct dn_pipe *pe ;
-    struct timespec ts;
-    struct timeval	tv;
-
-    heaps[0] = &ready_heap ;		/* fixed-rate queues */
-    heaps[1] = &wfq_ready_heap ;	/* wfq queues */
-    heaps[2] = &extract_heap ;		/* delay line */
+    struct dn_event *evs[DN_WHEEL_BATCH], *ev, *next;
+    struct dn_pipe *pipes[DN_WHEEL_BATCH], *pipe;
+    struct mbuf *heads[DN_WHEEL_BATCH], *tails[DN_WHEEL_BATCH];
+    struct mbuf *head, *tail;
+    struct dn_wheel_slot *ws;
+    dn_key now, tick;
+    int i, j, n, nsend, empty;
+
+    now = dn_update_time();
+    tick = dn_wheel_tick;
+    /* after a long stall, a single turn of the wheel visits every slot */
+    if (DN_KEY_LT(tick + DN_WHEEL_SLOTS, now))
+	tick = now - DN_WHEEL_SLOTS;
+
+    while (DN_KEY_LT(tick, now)) {
+	tick++;
+	ws = &dn_wheel[tick & DN_WHEEL_MASK];
+	lck_mtx_lock_spin(&ws->ws_lock);
+	dn_wheel_tick = tick;
+	empty = TAILQ_EMPTY(&ws->ws_events);
+	lck_mtx_unlock(&ws->ws_lock);
+	if (empty)
+	    continue;
+
+	do {
+	    n = nsend = 0;
+	    lck_rw_lock_shared(dn_lock);
+
+	    lck_mtx_lock_spin(&ws->ws_lock);
+	    for (ev = TAILQ_FIRST(&ws->ws_events);
+		ev != NULL && n < DN_WHEEL_BATCH; ev = next) {
+		next = TAILQ_NEXT(ev, ev_link);
+		if (DN_KEY_GT(ev->ev_key, now))
+		    continue;		/* due on a later turn */
+		TAILQ_REMOVE(&ws->ws_events, ev, ev_link);
+		ev->ev_slot = DN_EV_FIRING;
+		OSDecrementAtomic(
+		    (volatile SInt32 *)&dn_wheel_events[ev->ev_type]);
+		evs[n++] = ev;
+	    }
+	    lck_mtx_unlock(&ws->ws_lock);
 
-	lck_mtx_lock(dn_mutex);
-	
-        /* make all time measurements in milliseconds (ms) -  
-         * here we convert secs and usecs to msecs (just divide the 
-	 * usecs and take the closest whole number).
-         */
-        microuptime(&tv);
-        curr_time = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-
-    for (i=0; i < 3 ; i++) {
-	h = heaps[i];
-	while (h->elements > 0 && DN_KEY_LEQ(h->p[0].key, curr_time) ) {
-		if (h->p[0].key > curr_time)
-			printf("dummynet: warning, heap %d is %d ticks late\n",
-				i, (int)(curr_time - h->p[0].key));
-		p = h->p[0].object ; /* store a copy before heap_extract */
-		heap_extract(h, NULL); /* need to extract before processing */
-		if (i == 0)
-			ready_event(p, &head, &tail) ;
-		else if (i == 1) {
-			struct dn_pipe *pipe = p;
-			if (pipe->if_name[0] != '\0')
-				printf("dummynet: bad ready_event_wfq for pipe %s\n",
-				pipe->if_name);
-			else
-				ready_event_wfq(p, &head, &tail) ;
-		} else {
-			transmit_event(p, &head, &tail);
+	    for (i = 0; i < n; i++) {
+		ev = evs[i];
+		if ((pipe = dn_event_pipe(ev)) == NULL)
+		    continue;
+		/*
+		 * A pipe that already has a chain in this batch is ours to
+		 * extend, in order, so lift its serialization while firing.
+		 */
+		for (j = 0; j < nsend && pipes[j] != pipe; j++)
+		    ;
+		head = tail = NULL;
+		lck_mtx_lock(&pipe->lock);
+		if (j < nsend)
+		    pipe->serialize--;
+		if (ev->ev_slot == DN_EV_FIRING)
+		    dn_event_fire(ev, &head, &tail);
+		if (j < nsend) {
+		    pipe->serialize++;
+		    if (head != NULL) {
+			tails[j]->m_nextpkt = head;
+			tails[j] = tail;
+		    }
+		} else if (head != NULL) {
+		    pipe->serialize++;
+		    pipes[nsend] = pipe;
+		    heads[nsend] = head;
+		    tails[nsend++] = tail;
 		}
-	}
+		lck_mtx_unlock(&pipe->lock);
+	    }
+	    lck_rw_done(dn_lock);
+
+	    /* Send out the de-queued lists of ready-to-send packets */
+	    for (i = 0; i < nsend; i++) {
+		dummynet_send(heads[i]);
+		dn_pipe_unserialize(pipes[i]);
+	    }
+	} while (n == DN_WHEEL_BATCH);
     }
-    /* sweep pipes trying to expire idle flow_queues */
-    for (i = 0; i < HASHSIZE; i++)
-	SLIST_FOREACH(pe, &pipehash[i], next)
-	if (pe->idle_heap.elements > 0 &&
-		DN_KEY_LT(pe->idle_heap.p[0].key, pe->V) ) {
-	    struct dn_flow_queue *q = pe->idle_heap.p[0].object ;
-
-	    heap_extract(&(pe->idle_heap), NULL);
-	    q->S = q->F + 1 ; /* mark timestamp as invalid */
-	    pe->sum -= q->fs->weight ;
-	}
 
-	/* check the heaps to see if there's still stuff in there, and 
-	 * only set the timer if there are packets to process 
+	/*
+	 * Only keep the timer running while there are events on the wheel.
+	 * An event scheduled while it is still enabled has its count raised
+	 * by now, so it is not missed.
 	 */
-	timer_enabled = 0;
-	for (i=0; i < 3 ; i++) {
-		h = heaps[i];
-		if (h->elements > 0) { // set the timer
-			ts.tv_sec = 0;
-			ts.tv_nsec = 1 * 1000000;	// 1ms
-			timer_enabled = 1;
-			bsd_timeout(dummynet, NULL, &ts);
+	OSCompareAndSwap(1, 0, &timer_enabled);
+	for (i = 0; i < DN_EV_MAX; i++) {
+		if (dn_wheel_events[i] > 0) {
+			dn_timer_arm();
 			break;
 		}
 	}
- 
-	if (head != NULL)
-		serialize++;
-	
-	lck_mtx_unlock(dn_mutex);
-
-	/* Send out the de-queued list of ready-to-send packets */
-	if (head != NULL) {
-		dummynet_send(head);
-		lck_mtx_lock(dn_mutex);
-		serialize--;
-		lck_mtx_unlock(dn_mutex);
-	}
 }
 
 
@@ -1157,7 +1398,7 @@ if_tx_rdy(struct ifnet *ifp)
 	struct mbuf *head = NULL, *tail = NULL;
 	int i;
 	
-	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_shared(dn_lock);
 	
 	for (i = 0; i < HASHSIZE; i++)
 		SLIST_FOREACH(p, &pipehash[i], next)
@@ -1169,30 +1410,28 @@ if_tx_rdy(struct ifnet *ifp)
 	for (i = 0; i < HASHSIZE; i++)
 		SLIST_FOREACH(p, &pipehash[i], next)
 	    if (!strcmp(p->if_name, buf) ) {
-		p->ifp = ifp ;
 		DPRINTF(("dummynet: ++ tx rdy from %s (now found)\n", buf));
 		break ;
 	    }
     }
     if (p != NULL) {
+	lck_mtx_lock(&p->lock);
+	p->ifp = ifp ;
 	DPRINTF(("dummynet: ++ tx rdy from %s - qlen %d\n", if_name(ifp),
 		IFCQ_LEN(&ifp->if_snd)));
 	p->numbytes = 0 ; /* mark ready for I/O */
 	ready_event_wfq(p, &head, &tail);
+	if (head != NULL)
+		p->serialize++;
+	lck_mtx_unlock(&p->lock);
     }
 	
-	if (head != NULL) {
-		serialize++;
-	}
-	
-	lck_mtx_unlock(dn_mutex);
+	lck_rw_done(dn_lock);
 
 	/* Send out the de-queued list of ready-to-send packets */
 	if (head != NULL) {
 		dummynet_send(head);
-		lck_mtx_lock(dn_mutex);
-		serialize--;
-		lck_mtx_unlock(dn_mutex);
+		dn_pipe_unserialize(p);
 	}
     return 0;
 }
@@ -1216,7 +1455,8 @@ expire_queues(struct dn_flow_set *fs)
     fs->last_expired = timenow.tv_sec ;
     for (i = 0 ; i <= fs->rq_size ; i++) /* last one is overflow */
 	for (prev=NULL, q = fs->rq[i] ; q != NULL ; )
-	    if (q->head != NULL || q->S != q->F+1) {
+	    if (q->head != NULL || q->S != q->F+1 ||
+		q->ev.ev_slot != DN_EV_IDLE) {
   		prev = q ;
   	        q = q->next ;
   	    } else { /* entry is idle, expire it */
@@ -1257,6 +1497,7 @@ create_queue(struct dn_flow_set *fs, int i)
     }
     q->fs = fs ;
     q->hash_slot = i ;
+    dn_event_init(&q->ev, DN_EV_READY);
     q->next = fs->rq[i] ;
     q->S = q->F + 1;   /* hack - mark timestamp as invalid */
     fs->rq[i] = q ;
@@ -1527,12 +1768,10 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa, int cl
     struct dn_pkt_tag *pkt;
     struct m_tag *mtag;
     struct dn_flow_set *fs = NULL;
-    struct dn_pipe *pipe ;
+    struct dn_pipe *pipe = NULL ;	/* locked once found; dropit unlocks it */
     u_int64_t len = m->m_pkthdr.len ;
     struct dn_flow_queue *q = NULL ;
     int is_pipe = 0;
-    struct timespec ts;
-    struct timeval	tv;
 
     DPRINTF(("dummynet_io m: 0x%llx pipe: %d dir: %d client: %d\n",
         (uint64_t)VM_KERNEL_ADDRPERM(m), pipe_nr, dir, client));
@@ -1559,22 +1798,16 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa, int cl
 
     pipe_nr &= 0xffff ;
 
- 	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_shared(dn_lock);
+	dn_update_time();
 
-	/* make all time measurements in milliseconds (ms) - 
-         * here we convert secs and usecs to msecs (just divide the 
-         * usecs and take the closest whole number).
-	 */
-    microuptime(&tv);
-	curr_time = (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-	
    /*
      * This is a dummynet rule, so we expect an O_PIPE or O_QUEUE rule.
      */
     if (is_pipe) {
-		pipe = locate_pipe(pipe_nr);
-		if (pipe != NULL)
-			fs = &(pipe->fs);
+		struct dn_pipe *p = locate_pipe(pipe_nr);
+		if (p != NULL)
+			fs = &(p->fs);
 	} else
 		fs = locate_flowset(pipe_nr);
 	
@@ -1594,6 +1827,8 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa, int cl
 	    goto dropit ;
 	}
     }
+    /* the pipe lock covers the flow_set and its queues as well */
+    lck_mtx_lock(&pipe->lock);
     q = find_queue(fs, &(fwa->fwa_id));
     if ( q == NULL )
 	goto dropit ;		/* cannot allocate queue		*/
@@ -1702,7 +1937,7 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa, int cl
      */
     if (is_pipe) {
 	/*
-	 * Fixed-rate queue: just insert into the ready_heap.
+	 * Fixed-rate queue: just schedule its ready event.
 	 */
 	dn_key t = 0 ;
 	if (pipe->bandwidth)
@@ -1711,7 +1946,7 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa, int cl
 	if (t == 0)	/* must process it now */
 	    ready_event( q , &head, &tail );
 	else
-	    heap_insert(&ready_heap, curr_time + t , q );
+	    dn_event_schedule(&q->ev, curr_time + t);
     } else {
 	/*
 	 * WF2Q. First, compute start time S: if the flow was idle (S=F+1)
@@ -1765,18 +2000,14 @@ dummynet_io(struct mbuf *m, int pipe_nr, int dir, struct ip_fw_args *fwa, int cl
 	}
     }
 done:
-	/* start the timer and set global if not already set */
-	if (!timer_enabled) {
-		ts.tv_sec = 0;
-		ts.tv_nsec = 1 * 1000000;	// 1ms
-		timer_enabled = 1;
-		bsd_timeout(dummynet, NULL, &ts);
-	}
-
-	lck_mtx_unlock(dn_mutex);
+	if (head != NULL)
+		pipe->serialize++;
+	lck_mtx_unlock(&pipe->lock);
+	lck_rw_done(dn_lock);
 	
 	if (head != NULL) {
 		dummynet_send(head);
+		dn_pipe_unserialize(pipe);
 	}
 
     return 0;
@@ -1784,7 +2015,9 @@ done:
 dropit:
     if (q)
 	q->drops++ ;
-	lck_mtx_unlock(dn_mutex);
+	if (pipe != NULL)
+		lck_mtx_unlock(&pipe->lock);
+	lck_rw_done(dn_lock);
     m_freem(m);
     return ( (fs && (fs->flags_fs & DN_NOERROR)) ? 0 : ENOBUFS);
 }
@@ -1807,7 +2040,7 @@ dropit:
  * Dispose all packets and flow_queues on a flow_set.
  * If all=1, also remove red lookup table and other storage,
  * including the descriptor itself.
- * For the one in dn_pipe MUST also cleanup ready_heap...
+ * Pending ready events of the queues are cancelled as well.
  */
 static void
 purge_flow_set(struct dn_flow_set *fs, int all)
@@ -1815,7 +2048,7 @@ purge_flow_set(struct dn_flow_set *fs, int all)
     struct dn_flow_queue *q, *qn ;
     int i ;
 
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
+	lck_rw_assert(dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 
     for (i = 0 ; i <= fs->rq_size ; i++ ) {
 	for (q = fs->rq[i] ; q ; q = qn ) {
@@ -1827,6 +2060,7 @@ purge_flow_set(struct dn_flow_set *fs, int all)
 		DN_FREE_PKT(m);
 	    }
 	    qn = q->next ;
+	    dn_event_cancel(&q->ev);
 	    FREE(q, M_DUMMYNET);
 	}
 	fs->rq[i] = NULL ;
@@ -1855,6 +2089,8 @@ purge_pipe(struct dn_pipe *pipe)
     struct mbuf *m, *mnext;
 
     purge_flow_set( &(pipe->fs), 1 );
+    dn_event_cancel(&pipe->tx_ev);
+    dn_event_cancel(&pipe->wfq_ev);
 
     mnext = pipe->head;
     while ((m = mnext) != NULL) {
@@ -1878,20 +2114,16 @@ dummynet_flush(void)
 	struct dn_flow_set *fs, *fs1;
 	int i;
 
-	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_exclusive(dn_lock);
 
 #if IPFW2
 	/* remove all references to pipes ...*/
 	flush_pipe_ptrs(NULL);
 #endif /* IPFW2 */
 
-	/* Free heaps so we don't have unwanted events. */
-	heap_free(&ready_heap);
-	heap_free(&wfq_ready_heap);
-	heap_free(&extract_heap);
-
 	/*
-	 * Now purge all queued pkts and delete all pipes.
+	 * Now purge all queued pkts and delete all pipes; purging
+	 * also cancels their events.
 	 *
 	 * XXXGL: can we merge the for(;;) cycles into one or not?
 	 */
@@ -1904,9 +2136,9 @@ dummynet_flush(void)
 		SLIST_FOREACH_SAFE(pipe, &pipehash[i], next, pipe1) {
 			SLIST_REMOVE(&pipehash[i], pipe, dn_pipe, next);
 			purge_pipe(pipe);
-			FREE(pipe, M_DUMMYNET);
+			dn_pipe_release(pipe);
 		}
-	lck_mtx_unlock(dn_mutex);
+	lck_rw_done(dn_lock);
 }
 
 
@@ -1938,7 +2170,7 @@ dn_ipfw_rule_delete(void *r)
     struct mbuf *m ;
     int i;
 
-	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_exclusive(dn_lock);
 
     /*
      * If the rule references a queue (dn_flow_set), then scan
@@ -1959,7 +2191,7 @@ dn_ipfw_rule_delete(void *r)
 				pkt->dn_ipfw_rule = &default_rule;
 		}
 	}
-	lck_mtx_unlock(dn_mutex);
+	lck_rw_done(dn_lock);
 }
 
 /*
@@ -2088,7 +2320,7 @@ config_pipe(struct dn_pipe *p)
     if (p->pipe_nr != 0) { /* this is a pipe */
 	struct dn_pipe *x, *b;
 
-	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_exclusive(dn_lock);
 
 	/* locate pipe */
 	b = locate_pipe(p->pipe_nr);
@@ -2096,12 +2328,15 @@ config_pipe(struct dn_pipe *p)
 	if (b == NULL || b->pipe_nr != p->pipe_nr) { /* new pipe */
 	    x = _MALLOC(sizeof(struct dn_pipe), M_DUMMYNET, M_DONTWAIT | M_ZERO) ;
 	    if (x == NULL) {
-	    lck_mtx_unlock(dn_mutex);
+	    lck_rw_done(dn_lock);
 		printf("dummynet: no memory for new pipe\n");
 		return ENOSPC;
 	    }
 	    x->pipe_nr = p->pipe_nr;
 	    x->fs.pipe = x ;
+	    lck_mtx_init(&x->lock, dn_mutex_grp, dn_mutex_attr);
+	    dn_event_init(&x->wfq_ev, DN_EV_WFQ);
+	    dn_event_init(&x->tx_ev, DN_EV_TX);
 	    /* idle_heap is the only one from which we extract from the middle.
 	     */
 	    x->idle_heap.size = x->idle_heap.elements = 0 ;
@@ -2125,29 +2360,29 @@ config_pipe(struct dn_pipe *p)
 	if ( x->fs.rq == NULL ) { /* a new pipe */
 	    r = alloc_hash(&(x->fs), pfs) ;
 	    if (r) {
-		lck_mtx_unlock(dn_mutex);
-		FREE(x, M_DUMMYNET);
+		lck_rw_done(dn_lock);
+		dn_pipe_free(x);
 		return r ;
 	    }
 	    SLIST_INSERT_HEAD(&pipehash[HASH(x->pipe_nr)],
 			    x, next);
 	}
-	lck_mtx_unlock(dn_mutex);
+	lck_rw_done(dn_lock);
     } else { /* config queue */
 	struct dn_flow_set *x, *b ;
 
-	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_exclusive(dn_lock);
 	/* locate flow_set */
 	b = locate_flowset(pfs->fs_nr);
 
 	if (b == NULL || b->fs_nr != pfs->fs_nr) { /* new  */
 	    if (pfs->parent_nr == 0) {	/* need link to a pipe */
-	    	lck_mtx_unlock(dn_mutex);
+	    	lck_rw_done(dn_lock);
 			return EINVAL ;
 		}
 	    x = _MALLOC(sizeof(struct dn_flow_set), M_DUMMYNET, M_DONTWAIT | M_ZERO);
 	    if (x == NULL) {
-	    	lck_mtx_unlock(dn_mutex);
+	    	lck_rw_done(dn_lock);
 			printf("dummynet: no memory for new flow_set\n");
 			return ENOSPC;
 	    }
@@ -2161,7 +2396,7 @@ config_pipe(struct dn_pipe *p)
 	} else {
 	    /* Change parent pipe not allowed; must delete and recreate */
 	    if (pfs->parent_nr != 0 && b->parent_nr != pfs->parent_nr) {
-	    	lck_mtx_unlock(dn_mutex);
+	    	lck_rw_done(dn_lock);
 			return EINVAL ;
 		}
 	    x = b;
@@ -2171,14 +2406,14 @@ config_pipe(struct dn_pipe *p)
 	if ( x->rq == NULL ) { /* a new flow_set */
 	    r = alloc_hash(x, pfs) ;
 	    if (r) {
-		lck_mtx_unlock(dn_mutex);
+		lck_rw_done(dn_lock);
 		FREE(x, M_DUMMYNET);
 		return r ;
 	    }
 	    SLIST_INSERT_HEAD(&flowsethash[HASH(x->fs_nr)],
 			    x, next);
 	}
-	lck_mtx_unlock(dn_mutex);
+	lck_rw_done(dn_lock);
     }
     return 0 ;
 }
@@ -2202,25 +2437,6 @@ fs_remove_from_heap(struct dn_heap *h, struct dn_flow_set *fs)
 	heapify(h);
 }
 
-/*
- * helper function to remove a pipe from a heap (can be there at most once)
- */
-static void
-pipe_remove_from_heap(struct dn_heap *h, struct dn_pipe *p)
-{
-    if (h->elements > 0) {
-	int i = 0 ;
-	for (i=0; i < h->elements ; i++ ) {
-	    if (h->p[i].object == p) { /* found it */
-		h->elements-- ;
-		h->p[i] = h->p[h->elements] ;
-		heapify(h);
-		break ;
-	    }
-	}
-    }
-}
-
 /*
  * drain all queues. Called in case of severe mbuf shortage.
  */
@@ -2232,11 +2448,8 @@ dummynet_drain(void)
     struct mbuf *m, *mnext;
 	int i;
 
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
+	lck_rw_assert(dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 
-    heap_free(&ready_heap);
-    heap_free(&wfq_ready_heap);
-    heap_free(&extract_heap);
     /* remove all references to this pipe from flow_sets */
     for (i = 0; i < HASHSIZE; i++)
 	SLIST_FOREACH(fs, &flowsethash[i], next)
@@ -2246,6 +2459,16 @@ dummynet_drain(void)
 	SLIST_FOREACH(p, &pipehash[i], next) {
 		purge_flow_set(&(p->fs), 0);	
 
+	/* the queues are gone, so is the WF2Q state that pointed at them */
+	p->scheduler_heap.elements = 0 ;
+	p->not_eligible_heap.elements = 0 ;
+	p->idle_heap.elements = 0 ;
+	p->sum = 0 ;
+	p->V = 0 ;
+	p->numbytes = 0 ;
+	dn_event_cancel(&p->wfq_ev);
+	dn_event_cancel(&p->tx_ev);
+
 	mnext = p->head;
 	while ((m = mnext) != NULL) {
 	    mnext = m->m_nextpkt;
@@ -2270,11 +2493,11 @@ delete_pipe(struct dn_pipe *p)
 	struct dn_flow_set *fs;
 	int i;
 
-	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_exclusive(dn_lock);
 	/* locate pipe */
 	b = locate_pipe(p->pipe_nr);
 	if(b == NULL){
-		lck_mtx_unlock(dn_mutex);
+		lck_rw_done(dn_lock);
 	    return EINVAL ; /* not found */
 	}
 
@@ -2295,23 +2518,19 @@ delete_pipe(struct dn_pipe *p)
 			fs->pipe = NULL ;
 			purge_flow_set(fs, 0);
 		}
-	fs_remove_from_heap(&ready_heap, &(b->fs));
 
-	purge_pipe(b);	/* remove all data associated to this pipe */
-	/* remove reference to here from extract_heap and wfq_ready_heap */
-	pipe_remove_from_heap(&extract_heap, b);
-	pipe_remove_from_heap(&wfq_ready_heap, b);
-	lck_mtx_unlock(dn_mutex);
+	purge_pipe(b);	/* remove all data and events of this pipe */
+	lck_rw_done(dn_lock);
 	
-	FREE(b, M_DUMMYNET);
+	dn_pipe_release(b);
     } else { /* this is a WF2Q queue (dn_flow_set) */
 	struct dn_flow_set *b;
 
-	lck_mtx_lock(dn_mutex);
+	lck_rw_lock_exclusive(dn_lock);
 	/* locate set */
 	b = locate_flowset(p->fs.fs_nr);
 	if (b == NULL) {
-		lck_mtx_unlock(dn_mutex);
+		lck_rw_done(dn_lock);
 	    return EINVAL ; /* not found */
 	}
 
@@ -2333,7 +2552,7 @@ delete_pipe(struct dn_pipe *p)
 #endif
 	}
 	purge_flow_set(b, 1);
-	lck_mtx_unlock(dn_mutex);
+	lck_rw_done(dn_lock);
     }
     return 0 ;
 }
@@ -2348,7 +2567,7 @@ char* dn_copy_set_32(struct dn_flow_set *set, char *bp)
     struct dn_flow_queue *q;
 	struct dn_flow_queue_32 *qp = (struct dn_flow_queue_32 *)bp;
 	
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
+	lck_rw_assert(dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 	
     for (i = 0 ; i <= set->rq_size ; i++)
 		for (q = set->rq[i] ; q ; q = q->next, qp++ ) {
@@ -2380,7 +2599,7 @@ char* dn_copy_set_64(struct dn_flow_set *set, char *bp)
     struct dn_flow_queue *q;
 	struct dn_flow_queue_64 *qp = (struct dn_flow_queue_64 *)bp;
 	
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
+	lck_rw_assert(dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 	
     for (i = 0 ; i <= set->rq_size ; i++)
 		for (q = set->rq[i] ; q ; q = q->next, qp++ ) {
@@ -2417,7 +2636,7 @@ dn_calc_size(int is64user)
 	size_t setsize;
 	int i;
 
-	lck_mtx_assert(dn_mutex, LCK_MTX_ASSERT_OWNED);
+	lck_rw_assert(dn_lock, LCK_RW_ASSERT_EXCLUSIVE);
 	if ( is64user ){
 		pipesize = sizeof(struct dn_pipe_64);
 		queuesize = sizeof(struct dn_flow_queue_64);
@@ -2453,7 +2672,7 @@ dummynet_get(struct sockopt *sopt)
 	int	is64user = 0;
 
     /* XXX lock held too long */
-    lck_mtx_lock(dn_mutex);
+    lck_rw_lock_exclusive(dn_lock);
     /*
      * XXX: Ugly, but we need to allocate memory with M_WAITOK flag and we
      *      cannot use this flag while holding a mutex.
@@ -2462,18 +2681,18 @@ dummynet_get(struct sockopt *sopt)
 		is64user = 1;
     for (i = 0; i < 10; i++) {
 		size = dn_calc_size(is64user);
-		lck_mtx_unlock(dn_mutex);
+		lck_rw_done(dn_lock);
 		buf = _MALLOC(size, M_TEMP, M_WAITOK);
 		if (buf == NULL)
 			return ENOBUFS;
-		lck_mtx_lock(dn_mutex);
+		lck_rw_lock_exclusive(dn_lock);
 		if (size == dn_calc_size(is64user))
 			break;
 		FREE(buf, M_TEMP);
 		buf = NULL;
     }
     if (buf == NULL) {
-		lck_mtx_unlock(dn_mutex);
+		lck_rw_done(dn_lock);
 		return ENOBUFS ;
     }
 
@@ -2504,7 +2723,7 @@ dummynet_get(struct sockopt *sopt)
 		bp += sizeof(struct dn_flow_set_64);
 		bp = dn_copy_set_64( set, bp );
     }
-    lck_mtx_unlock(dn_mutex);
+    lck_rw_done(dn_lock);
 
     error = sooptcopyout(sopt, buf, size);
     FREE(buf, M_TEMP);
@@ -2567,20 +2786,21 @@ ip_dn_ctl(struct sockopt *sopt)
 void
 ip_dn_init(void)
 {
+	int i;
+
 	/* setup locks */
 	dn_mutex_grp_attr = lck_grp_attr_alloc_init();
 	dn_mutex_grp = lck_grp_alloc_init("dn", dn_mutex_grp_attr);
 	dn_mutex_attr = lck_attr_alloc_init();
-	lck_mtx_init(dn_mutex, dn_mutex_grp, dn_mutex_attr);
+	lck_rw_init(dn_lock, dn_mutex_grp, dn_mutex_attr);
 
-	ready_heap.size = ready_heap.elements = 0 ;
-	ready_heap.offset = 0 ;
-
-	wfq_ready_heap.size = wfq_ready_heap.elements = 0 ;
-	wfq_ready_heap.offset = 0 ;
+	for (i = 0; i < DN_WHEEL_SLOTS; i++) {
+		lck_mtx_init(&dn_wheel[i].ws_lock, dn_mutex_grp,
+		    dn_mutex_attr);
+		TAILQ_INIT(&dn_wheel[i].ws_events);
+	}
+	dn_wheel_tick = dn_update_time();
 
-	extract_heap.size = extract_heap.elements = 0 ;
-	extract_heap.offset = 0 ;
 	ip_dn_ctl_ptr = ip_dn_ctl;
 	ip_dn_io_ptr = dummynet_io;
 
@@ -62,6 +62,10 @@
 #ifdef PRIVATE
 
 #include <netinet/ip_flowid.h>
+#ifdef BSD_KERNEL_PRIVATE
+#include <sys/queue.h>
+#include <kern/locks.h>
+#endif /* BSD_KERNEL_PRIVATE */
 
 /* Apply ipv6 mask on ipv6 addr */
 #define APPLY_MASK(addr,mask)                          \
@@ -229,11 +233,12 @@ to a PIPE) according to the WF2Q+ scheduling algorithm and the
 configured weights.
 
 In general, incoming packets are stored in the appropriate queue,
-which is then placed into one of a few heaps managed by a scheduler
-to decide when the packet should be extracted.
+which is then scheduled on a calendar queue (a timer wheel with one
+slot per tick) to decide when the packet should be extracted.
 The scheduler (a function called dummynet()) is run at every timer
-tick, and grabs queues from the head of the heaps when they are
-ready for processing.
+tick, and fires the events on the slot for that tick which are due.
+Each pipe has its own lock, which covers the pipe, the flow sets
+feeding it and their queues, so separate pipes do not contend.
 
 There are three data structures definining a pipe and associated queues:
 
@@ -264,6 +269,20 @@ flow using a number of heaps defined into the pipe itself.
  *
  */
 
+#ifdef BSD_KERNEL_PRIVATE
+/*
+ * An event on the scheduler's calendar queue.  Objects embed one for
+ * each kind of event they can wait for, so each is scheduled at most
+ * once per kind.
+ */
+struct dn_event {
+	TAILQ_ENTRY(dn_event)	ev_link;	/* on a wheel slot */
+	dn_key			ev_key;		/* tick the event is due */
+	int			ev_slot;	/* wheel slot, or DN_EV_IDLE */
+	int			ev_type;	/* DN_EV_READY, WFQ or TX */
+};
+#endif /* BSD_KERNEL_PRIVATE */
+
 /*
  * per flow queue. This contains the flow identifier, the queue
  * of packets, counters, and parameters used to support both RED and
@@ -303,6 +322,9 @@ struct dn_flow_queue {
      * Setting F < S means the timestamp is invalid. We only need
      * to test this when the queue is empty.
      */
+#ifdef BSD_KERNEL_PRIVATE
+    struct dn_event ev ;	/* ready event, for fixed-rate queues */
+#endif /* BSD_KERNEL_PRIVATE */
 } ;
 
 /*
@@ -413,6 +435,15 @@ struct dn_pipe {		/* a pipe */
     int ready ; /* set if ifp != NULL and we got a signal from it */
 
     struct dn_flow_set fs ; /* used with fixed-rate flows */
+
+#ifdef BSD_KERNEL_PRIVATE
+    decl_lck_mtx_data(, lock);	/* pipe, its flow sets and their queues */
+    struct dn_event wfq_ev ;	/* WF2Q+ ready event */
+    struct dn_event tx_ev ;	/* delay line event */
+    int serialize ;		/* chains off the delay line being sent */
+    int pipe_flags ;
+#define	DN_PIPE_DEAD	0x1	/* deleted, to be freed by the last sender */
+#endif /* BSD_KERNEL_PRIVATE */
 };
 
 SLIST_HEAD(dn_pipe_head, dn_pipe);
@@ -121,6 +121,9 @@
 #include <netinet/udp_var.h>
 #include <netinet/bootp.h>
 #include <netinet/lro_ext.h>
+#if defined(__x86_64__)
+#include <netinet/in_cksum_simd.h>
+#endif /* __x86_64__ */
 
 #if DUMMYNET
 #include <netinet/ip_dummynet.h>
@@ -423,6 +426,11 @@ ip_init(struct protosw *pp, struct domain *dp)
 	PE_parse_boot_argn("net.inet.ip.scopedroute",
 	    &ip_doscopedroute, sizeof (ip_doscopedroute));
 
+#if defined(__x86_64__)
+	/* pick the SSE2/AVX2 checksum loop, if the CPU has one */
+	in_cksum_simd_init();
+#endif /* __x86_64__ */
+
 	in_ifaddr_init();
 
 	in_ifaddr_rwlock_grp_attr = lck_grp_attr_alloc_init();
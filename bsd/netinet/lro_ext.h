@@ -42,23 +42,32 @@ extern unsigned int coalesc_sz;
 #define TCP_LRO_CONSUMED 	0x01	/* LRO consumed the packet */	
 #define TCP_LRO_EJECT_FLOW 	0x02	/* LRO ejected the flow */
 #define TCP_LRO_COALESCE	0x03	/* LRO to coalesce the packet */
-#define TCP_LRO_COLLISION	0x04	/* Two flows map to the same slot */
+
+struct ifnet;
+struct tcpcb;
 
 void tcp_lro_init(void);
 
 /* When doing LRO in IP call this function */
 struct mbuf* tcp_lro(struct mbuf *m, unsigned int hlen);
+#if INET6
+struct mbuf* tcp_lro6(struct mbuf *m, unsigned int hlen);
+#endif /* INET6 */
+
+/* IP calls this at the end of an input batch to push coalesced packets */
+void tcp_lro_flush(struct ifnet *);
+
+/* DLIL calls this to drop any coalesced packets of a detaching interface */
+void tcp_lro_detach(struct ifnet *);
 
 /* TCP calls this to start coalescing a flow */
-int tcp_start_coalescing(struct ip *, struct tcphdr *, int tlen);
+int tcp_start_coalescing(struct tcpcb *, struct ifnet *, __uint32_t);
 
 /* TCP calls this to stop coalescing a flow */
-int tcp_lro_remove_state(struct in_addr, struct in_addr, unsigned short, 
-	unsigned short);
+int tcp_lro_remove_state(struct tcpcb *);
 
 /* TCP calls this to keep the seq number updated */
-void tcp_update_lro_seq(__uint32_t, struct in_addr, struct in_addr,
-                unsigned short, unsigned short);
+void tcp_update_lro_seq(struct tcpcb *, __uint32_t);
 
 #endif
 
@@ -730,8 +730,7 @@ present:
 	if (!q || q->tqe_th->th_seq != tp->rcv_nxt) {
 		/* Stop using LRO once out of order packets arrive */
 		if (tp->t_flagsext & TF_LRO_OFFLOADED) {
-			tcp_lro_remove_state(inp->inp_laddr, inp->inp_faddr,
-				th->th_dport, th->th_sport);
+			tcp_lro_remove_state(tp);
 			tp->t_flagsext &= ~TF_LRO_OFFLOADED;	
 		}
 
@@ -774,9 +773,7 @@ present:
 			    q->tqe_th->th_seq - (tp->irs + 1), 0))
 				dowakeup = 1;
 			if (tp->t_flagsext & TF_LRO_OFFLOADED) {	
-				tcp_update_lro_seq(tp->rcv_nxt, 
-				 inp->inp_laddr, inp->inp_faddr,
-				 th->th_dport, th->th_sport);
+				tcp_update_lro_seq(tp, tp->rcv_nxt);
 			}
 		}
 		zfree(tcp_reass_zone, q);
@@ -2587,13 +2584,10 @@ findpcb:
 			 * coalescing packets belonging to this flow.
 			 */
 			if (turnoff_lro) {
-				tcp_lro_remove_state(tp->t_inpcb->inp_laddr,
-					tp->t_inpcb->inp_faddr,
-					tp->t_inpcb->inp_lport, 
-					tp->t_inpcb->inp_fport);
+				tcp_lro_remove_state(tp);
 				tp->t_flagsext &= ~TF_LRO_OFFLOADED;
 				tp->t_idleat = tp->rcv_nxt;
-			} else if (sw_lro && !pktf_sw_lro_pkt && !isipv6 &&
+			} else if (sw_lro && !pktf_sw_lro_pkt &&
 			    (so->so_flags & SOF_USELRO) &&	
 			    !IFNET_IS_CELLULAR(m->m_pkthdr.rcvif) &&
   			    (m->m_pkthdr.rcvif->if_type != IFT_LOOP) &&
@@ -2602,7 +2596,8 @@ findpcb:
 			    ((tp->t_idleat == 0) || ((th->th_seq - 
 			     tp->t_idleat) > (tp->t_maxseg << lro_start)))) {
 				tp->t_flagsext |= TF_LRO_OFFLOADED;
-				tcp_start_coalescing(ip, th, tlen);
+				tcp_start_coalescing(tp,
+				    m->m_pkthdr.rcvif, th->th_seq + tlen);
 				tp->t_idleat = 0;
 			}
 
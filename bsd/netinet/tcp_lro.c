@@ -29,6 +29,7 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/sysctl.h>
+#include <sys/malloc.h>
 #include <sys/mbuf.h>
 #include <sys/mcache.h>
 #include <sys/socket.h>
@@ -38,10 +39,17 @@
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
 #include <net/if.h>
+#include <net/if_var.h>
 #include <net/dlil.h>
 #include <netinet/ip.h>
 #include <netinet/ip_var.h>
 #include <netinet/in_var.h>
+#include <netinet/in_pcb.h>
+#include <netinet/ip6.h>
+#if INET6
+#include <netinet6/ip6_var.h>
+#include <netinet6/tcp6_var.h>
+#endif /* INET6 */
 #include <netinet/tcp.h>
 #include <netinet/tcp_seq.h>
 #include <netinet/tcpip.h>
@@ -49,6 +57,7 @@
 #include <netinet/tcp_lro.h>
 #include <netinet/lro_ext.h>
 #include <kern/locks.h>
+#include <libkern/OSAtomic.h>
 
 unsigned int lrocount = 0; /* A counter used for debugging only */
 unsigned int lro_seq_outoforder = 0; /* Counter for debugging */
@@ -66,14 +75,23 @@ unsigned int coalesc_time = LRO_MX_TIME_TO_BUFFER;
 SYSCTL_INT(_net_inet_tcp, OID_AUTO, lro_time, CTLFLAG_RW | CTLFLAG_LOCKED,
 		&coalesc_time, 0, "Max coalescing time");
 
-struct lro_flow lro_flow_list[TCP_LRO_NUM_FLOWS]; 
+unsigned int tcp_lro_flows = TCP_LRO_NUM_FLOWS;
+SYSCTL_UINT(_net_inet_tcp, OID_AUTO, lro_flows, CTLFLAG_RW | CTLFLAG_LOCKED,
+		&tcp_lro_flows, 0, "Flow entries per interface LRO table");
 
-char lro_flow_map[TCP_LRO_FLOW_MAP]; 
+static int sysctl_lro_stats SYSCTL_HANDLER_ARGS;
+SYSCTL_PROC(_net_inet_tcp, OID_AUTO, lro_stats,
+		CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED, 0, 0,
+		sysctl_lro_stats, "S,tcp_lro_stat", "LRO statistics");
+
+/* All the flow tables; they live as long as their (recycled) ifnet */
+static TAILQ_HEAD(, lro_table) lro_tables =
+    TAILQ_HEAD_INITIALIZER(lro_tables);
 
 static lck_attr_t *tcp_lro_mtx_attr = NULL;		/* mutex attributes */
 static lck_grp_t *tcp_lro_mtx_grp = NULL;		/* mutex group */
 static lck_grp_attr_t *tcp_lro_mtx_grp_attr = NULL;	/* mutex group attrs */
-decl_lck_mtx_data( ,tcp_lro_lock);	/* Used to synchronize updates */
+decl_lck_mtx_data( ,tcp_lro_lock);	/* protects lro_tables and the timer */
 
 unsigned int lro_byte_count = 0;
 
@@ -90,24 +108,18 @@ static void	tcp_lro_timer_proc(void*, void*);
 static void	lro_update_stats(struct mbuf*);
 static void	lro_update_flush_stats(struct mbuf *);
 static void	tcp_lro_flush_flows(void);
+static void	tcp_lro_flush_table(struct lro_table *, boolean_t);
 static void	tcp_lro_sched_timer(uint64_t);
 static void	lro_proto_input(struct mbuf *);
 
-static struct mbuf *lro_tcp_xsum_validate(struct mbuf*,  struct ip *,
-				struct tcphdr*);
-static struct mbuf *tcp_lro_process_pkt(struct mbuf*, struct ip*, struct tcphdr*,
-				int);
+static struct mbuf *lro_tcp_xsum_validate(struct mbuf*, int, struct tcphdr*,
+				unsigned int, int);
+static struct mbuf *tcp_lro_process_pkt(struct mbuf*, int, struct tcphdr*,
+				unsigned int, int, u_int8_t);
 
 void
 tcp_lro_init(void)
 {
-	int i;
-
-	bzero(lro_flow_list, sizeof (struct lro_flow) * TCP_LRO_NUM_FLOWS);
-	for (i = 0; i < TCP_LRO_FLOW_MAP; i++) {
-		lro_flow_map[i] = TCP_LRO_FLOW_UNINIT;
-	}
-
 	/*
 	 * allocate lock group attribute, group and attribute for tcp_lro_lock
 	 */
@@ -124,113 +136,219 @@ tcp_lro_init(void)
 	return;
 }
 
+/*
+ * Allocate the flow table of an interface, sized from tcp_lro_flows.
+ * Input threads may race here; the loser frees its copy.
+ */
+static struct lro_table *
+tcp_lro_table_alloc(struct ifnet *ifp)
+{
+	struct lro_table *lt;
+	u_int32_t nflows, nbuckets, i;
+	size_t tblsize;
+
+	nflows = MIN(MAX(tcp_lro_flows, TCP_LRO_MIN_FLOWS), TCP_LRO_MAX_FLOWS);
+	for (nbuckets = 1; nbuckets < nflows; nbuckets <<= 1)
+		;
+
+	tblsize = P2ROUNDUP(sizeof (*lt), sizeof (u_int64_t));
+	lt = _MALLOC(tblsize + nflows * sizeof (struct lro_flow) +
+	    nbuckets * sizeof (*lt->lt_hash), M_TEMP, M_NOWAIT | M_ZERO);
+	if (lt == NULL)
+		return (NULL);
+
+	lck_mtx_init(&lt->lt_lock, tcp_lro_mtx_grp, tcp_lro_mtx_attr);
+	lt->lt_ifp = ifp;
+	lt->lt_nflows = nflows;
+	lt->lt_hashmask = nbuckets - 1;
+	lt->lt_flows = (struct lro_flow *)(void *)((caddr_t)lt + tblsize);
+	lt->lt_hash = (void *)(lt->lt_flows + nflows);
+	for (i = 0; i < nbuckets; i++)
+		LIST_INIT(&lt->lt_hash[i]);
+	TAILQ_INIT(&lt->lt_lru);
+	TAILQ_INIT(&lt->lt_free);
+	TAILQ_INIT(&lt->lt_pend);
+	for (i = 0; i < nflows; i++)
+		TAILQ_INSERT_TAIL(&lt->lt_free, &lt->lt_flows[i], lr_link);
+
+	if (!OSCompareAndSwapPtr(NULL, lt, (void * volatile *)&ifp->if_lro)) {
+		lck_mtx_destroy(&lt->lt_lock, tcp_lro_mtx_grp);
+		_FREE(lt, M_TEMP);
+		return (ifp->if_lro);
+	}
+
+	lck_mtx_lock(&tcp_lro_lock);
+	TAILQ_INSERT_TAIL(&lro_tables, lt, lt_link);
+	lck_mtx_unlock(&tcp_lro_lock);
+
+	if (lrodebug)
+		printf("%s: %s %u flows %u buckets\n", __func__,
+		    if_name(ifp), nflows, nbuckets);
+	return (lt);
+}
+
+static inline struct lro_table *
+tcp_lro_table(struct ifnet *ifp)
+{
+	struct lro_table *lt = ifp->if_lro;
+
+	if (lt == NULL)
+		lt = tcp_lro_table_alloc(ifp);
+	return (lt);
+}
+
+/* Flow key of a received segment; the foreign end is the source */
+static void
+tcp_lro_key_pkt(struct lro_key *key, int af, void *hdr, struct tcphdr *th)
+{
+	bzero(key, sizeof (*key));
+#if INET6
+	if (af == AF_INET6) {
+		struct ip6_hdr *ip6 = hdr;
+
+		key->lk_faddr.lku_addr6 = ip6->ip6_src;
+		key->lk_laddr.lku_addr6 = ip6->ip6_dst;
+	} else
+#endif /* INET6 */
+	{
+		struct ip *ip = hdr;
+
+		key->lk_faddr.lku_addr4 = ip->ip_src;
+		key->lk_laddr.lku_addr4 = ip->ip_dst;
+	}
+	key->lk_fport = th->th_sport;
+	key->lk_lport = th->th_dport;
+	key->lk_af = af;
+}
+
+/* Flow key of a connection */
+static void
+tcp_lro_key_inp(struct lro_key *key, struct inpcb *inp)
+{
+	bzero(key, sizeof (*key));
+#if INET6
+	if (inp->inp_vflag & INP_IPV6) {
+		key->lk_faddr.lku_addr6 = inp->in6p_faddr;
+		key->lk_laddr.lku_addr6 = inp->in6p_laddr;
+		key->lk_af = AF_INET6;
+	} else
+#endif /* INET6 */
+	{
+		key->lk_faddr.lku_addr4 = inp->inp_faddr;
+		key->lk_laddr.lku_addr4 = inp->inp_laddr;
+		key->lk_af = AF_INET;
+	}
+	key->lk_fport = inp->inp_fport;
+	key->lk_lport = inp->inp_lport;
+}
+
+static inline u_int32_t
+tcp_lro_key_hash(const struct lro_key *key, u_int32_t mask)
+{
+	const u_int32_t *fa = key->lk_faddr.lku_addr32;
+	const u_int32_t *la = key->lk_laddr.lku_addr32;
+
+	return (LRO_HASH(fa[0] ^ fa[1] ^ fa[2] ^ fa[3],
+	    la[0] ^ la[1] ^ la[2] ^ la[3], key->lk_fport, key->lk_lport,
+	    mask));
+}
+
+/*
+ * Must be called with the table lock held.
+ */
+static struct lro_flow *
+tcp_lro_lookup(struct lro_table *lt, const struct lro_key *key)
+{
+	struct lro_flow *flow;
+	u_int64_t depth = 0;
+
+	LIST_FOREACH(flow, &lt->lt_hash[tcp_lro_key_hash(key,
+	    lt->lt_hashmask)], lr_hash_link) {
+		depth++;
+		if (bcmp(&flow->lr_key, key, sizeof (*key)) == 0)
+			break;
+	}
+	if (depth > lt->lt_stat.lro_chain_max)
+		lt->lt_stat.lro_chain_max = depth;
+	return (flow);
+}
+
 static int
-tcp_lro_matching_tuple(struct ip* ip_hdr, struct tcphdr *tcp_hdr, int *hash, 
-			int *flow_id )
+tcp_lro_matching_tuple(struct lro_table *lt, struct lro_key *key,
+			struct tcphdr *tcp_hdr, struct lro_flow **flowp)
 {
 	struct lro_flow *flow;
 	tcp_seq seqnum;
-	unsigned int off = 0;
-	int payload_len = 0;
-
-	*hash = LRO_HASH(ip_hdr->ip_src.s_addr, ip_hdr->ip_dst.s_addr, 
-		tcp_hdr->th_sport, tcp_hdr->th_dport, (TCP_LRO_FLOW_MAP - 1));
 
-	*flow_id = lro_flow_map[*hash];
-	if (*flow_id == TCP_LRO_FLOW_NOTFOUND) {
+	*flowp = flow = tcp_lro_lookup(lt, key);
+	if (flow == NULL) {
 		return TCP_LRO_NAN;
 	}
 
-	seqnum = tcp_hdr->th_seq;
-	off = tcp_hdr->th_off << 2;
-	payload_len = ip_hdr->ip_len - off;
-
-	flow = &lro_flow_list[*flow_id];
+	/* keep active flows away from eviction */
+	TAILQ_REMOVE(&lt->lt_lru, flow, lr_link);
+	TAILQ_INSERT_TAIL(&lt->lt_lru, flow, lr_link);
 
-	if ((flow->lr_faddr.s_addr == ip_hdr->ip_src.s_addr) &&
-			(flow->lr_laddr.s_addr == ip_hdr->ip_dst.s_addr) &&
-			(flow->lr_fport == tcp_hdr->th_sport) &&
-			(flow->lr_lport == tcp_hdr->th_dport)) {
-		if (flow->lr_tcphdr == NULL) {
-			if (ntohl(seqnum) == flow->lr_seq) {
-				return TCP_LRO_COALESCE;
-			}
-			if (lrodebug >= 4) {
-				printf("%s: seqnum = %x, lr_seq = %x\n",
-					__func__, ntohl(seqnum), flow->lr_seq);
-			}
-			lro_seq_mismatch++;
-			if (SEQ_GT(ntohl(seqnum), flow->lr_seq)) {
-				lro_seq_outoforder++;
-				/* 
-				 * Whenever we receive out of order packets it
-				 * signals loss and recovery and LRO doesn't 
-				 * let flows recover quickly. So eject.
-				 */
-				 flow->lr_flags |= LRO_EJECT_REQ;
-
-			}
-			return TCP_LRO_NAN;
-		}
+	seqnum = tcp_hdr->th_seq;
 
-		if (flow->lr_flags & LRO_EJECT_REQ) {
-			if (lrodebug)
-				printf("%s: eject. \n", __func__);
-			return TCP_LRO_EJECT_FLOW;
+	if (flow->lr_tcphdr == NULL) {
+		if (ntohl(seqnum) == flow->lr_seq) {
+			return TCP_LRO_COALESCE;
 		}
-		if (SEQ_GT(tcp_hdr->th_ack, flow->lr_tcphdr->th_ack)) { 
-			if (lrodebug) {
-				printf("%s: th_ack = %x flow_ack = %x \n", 
-					__func__, tcp_hdr->th_ack, 
-					flow->lr_tcphdr->th_ack);
-			}
-			return TCP_LRO_EJECT_FLOW;
+		if (lrodebug >= 4) {
+			printf("%s: seqnum = %x, lr_seq = %x\n",
+				__func__, ntohl(seqnum), flow->lr_seq);
 		}
+		lro_seq_mismatch++;
+		if (SEQ_GT(ntohl(seqnum), flow->lr_seq)) {
+			lro_seq_outoforder++;
+			/*
+			 * Whenever we receive out of order packets it
+			 * signals loss and recovery and LRO doesn't
+			 * let flows recover quickly. So eject.
+			 */
+			 flow->lr_flags |= LRO_EJECT_REQ;
 
-		if (ntohl(seqnum) == (ntohl(lro_flow_list[*flow_id].lr_tcphdr->th_seq) + lro_flow_list[*flow_id].lr_len)) { 
-			return TCP_LRO_COALESCE;
-		} else {
-			/* LRO does not handle loss recovery well, eject */
-			flow->lr_flags |= LRO_EJECT_REQ;
-			return TCP_LRO_EJECT_FLOW;
 		}
+		return TCP_LRO_NAN;
 	}
-	if (lrodebug) printf("tcp_lro_matching_tuple: collision \n");
-	return TCP_LRO_COLLISION;
-}
-
-static void
-tcp_lro_init_flow(int flow_id, struct ip* ip_hdr, struct tcphdr *tcp_hdr, 
-			int hash, u_int32_t timestamp, int payload_len)
-{
-	struct lro_flow *flow = NULL;
 
-	flow = &lro_flow_list[flow_id];
+	if (flow->lr_flags & LRO_EJECT_REQ) {
+		if (lrodebug)
+			printf("%s: eject. \n", __func__);
+		return TCP_LRO_EJECT_FLOW;
+	}
+	if (SEQ_GT(tcp_hdr->th_ack, flow->lr_tcphdr->th_ack)) {
+		if (lrodebug) {
+			printf("%s: th_ack = %x flow_ack = %x \n",
+				__func__, tcp_hdr->th_ack,
+				flow->lr_tcphdr->th_ack);
+		}
+		return TCP_LRO_EJECT_FLOW;
+	}
 
-	flow->lr_hash_map = hash;
-	flow->lr_faddr.s_addr = ip_hdr->ip_src.s_addr;
-	flow->lr_laddr.s_addr = ip_hdr->ip_dst.s_addr;
-	flow->lr_fport = tcp_hdr->th_sport;
-	flow->lr_lport = tcp_hdr->th_dport;
-	lro_flow_map[hash] = flow_id;
-	flow->lr_timestamp = timestamp;
-	flow->lr_seq = ntohl(tcp_hdr->th_seq) + payload_len;
-	flow->lr_flags = 0;
-	return;
+	if (ntohl(seqnum) == (ntohl(flow->lr_tcphdr->th_seq) + flow->lr_len)) {
+		return TCP_LRO_COALESCE;
+	} else {
+		/* LRO does not handle loss recovery well, eject */
+		flow->lr_flags |= LRO_EJECT_REQ;
+		return TCP_LRO_EJECT_FLOW;
+	}
 }
 
+/*
+ * Must be called with the table lock held.
+ */
 static void
-tcp_lro_coalesce(int flow_id, struct mbuf *lro_mb, struct tcphdr *tcphdr, 
-			int payload_len, int drop_hdrlen, struct tcpopt *topt, 
+tcp_lro_coalesce(struct lro_table *lt, struct lro_flow *flow,
+			struct mbuf *lro_mb, struct tcphdr *tcphdr,
+			int payload_len, int drop_hdrlen, struct tcpopt *topt,
 			u_int32_t* tsval, u_int32_t* tsecr, int thflags)
 {
-	struct lro_flow *flow = NULL;
 	struct mbuf *last;
-	struct ip *ip = NULL;
 
-	flow =  &lro_flow_list[flow_id];
 	if (flow->lr_mhead) {
-		if (lrodebug) 
+		if (lrodebug)
 			printf("%s: lr_mhead %x %d \n", __func__, flow->lr_seq,
 				payload_len);
 		m_adj(lro_mb, drop_hdrlen);
@@ -243,8 +361,20 @@ tcp_lro_coalesce(int flow_id, struct mbuf *lro_mb, struct tcphdr *tcphdr,
 
 		flow->lr_mtail = lro_mb;
 
-		ip = mtod(flow->lr_mhead, struct ip *);
-		ip->ip_len += lro_mb->m_pkthdr.len;
+#if INET6
+		if (flow->lr_key.lk_af == AF_INET6) {
+			struct ip6_hdr *ip6 = mtod(flow->lr_mhead,
+			    struct ip6_hdr *);
+
+			ip6->ip6_plen = htons(ntohs(ip6->ip6_plen) +
+			    lro_mb->m_pkthdr.len);
+		} else
+#endif /* INET6 */
+		{
+			struct ip *ip = mtod(flow->lr_mhead, struct ip *);
+
+			ip->ip_len += lro_mb->m_pkthdr.len;
+		}
 		flow->lr_mhead->m_pkthdr.len += lro_mb->m_pkthdr.len;
 
 		if (flow->lr_len == 0) {
@@ -252,24 +382,24 @@ tcp_lro_coalesce(int flow_id, struct mbuf *lro_mb, struct tcphdr *tcphdr,
 		}
 		flow->lr_len += payload_len;
 		flow->lr_seq += payload_len;
-		/* 
-		 * This bit is re-OR'd each time a packet is added to the 
+		/*
+		 * This bit is re-OR'd each time a packet is added to the
 		 * large coalesced packet.
 		 */
 		flow->lr_mhead->m_pkthdr.pkt_flags |= PKTF_SW_LRO_PKT;
 		flow->lr_mhead->m_pkthdr.lro_npkts++; /* for tcpstat.tcps_rcvpack */
-		if (flow->lr_mhead->m_pkthdr.lro_pktlen < 
+		if (flow->lr_mhead->m_pkthdr.lro_pktlen <
 				lro_mb->m_pkthdr.lro_pktlen) {
-			/* 
-			 * For TCP Inter Arrival Jitter calculation, return max  
+			/*
+			 * For TCP Inter Arrival Jitter calculation, return max
 			 * size encountered while coalescing a stream of pkts.
 			 */
-			flow->lr_mhead->m_pkthdr.lro_pktlen = 
+			flow->lr_mhead->m_pkthdr.lro_pktlen =
 						lro_mb->m_pkthdr.lro_pktlen;
 		}
         	/* Update the timestamp value */
 		if (topt->to_flags & TOF_TS) {
-			if ((flow->lr_tsval) && 
+			if ((flow->lr_tsval) &&
 				(TSTMP_GT(topt->to_tsval, ntohl(*(flow->lr_tsval))))) {
 				*(flow->lr_tsval) = htonl(topt->to_tsval);
 			}
@@ -277,7 +407,7 @@ tcp_lro_coalesce(int flow_id, struct mbuf *lro_mb, struct tcphdr *tcphdr,
 				(topt->to_tsecr != 0) &&
 				(TSTMP_GT(topt->to_tsecr, ntohl(*(flow->lr_tsecr))))) {
 				if (lrodebug >= 2) {
-					printf("%s: instantaneous RTT = %d \n", __func__, 
+					printf("%s: instantaneous RTT = %d \n", __func__,
 						topt->to_tsecr - ntohl(*(flow->lr_tsecr)));
 				}
 				*(flow->lr_tsecr) = htonl(topt->to_tsecr);
@@ -289,6 +419,7 @@ tcp_lro_coalesce(int flow_id, struct mbuf *lro_mb, struct tcphdr *tcphdr,
 		}
 		/* Update receive window */
 		flow->lr_tcphdr->th_win = tcphdr->th_win;
+		lt->lt_stat.lro_segs_coalesced++;
 	} else {
 		if (lro_mb) {
 			flow->lr_mhead = flow->lr_mtail = lro_mb;
@@ -297,147 +428,143 @@ tcp_lro_coalesce(int flow_id, struct mbuf *lro_mb, struct tcphdr *tcphdr,
 			if ((topt) && (topt->to_flags & TOF_TS)) {
 				ASSERT(tsval != NULL);
 				ASSERT(tsecr != NULL);
-				flow->lr_tsval = tsval; 
+				flow->lr_tsval = tsval;
 				flow->lr_tsecr = tsecr;
-			}        
+			}
 			flow->lr_len = payload_len;
-			calculate_tcp_clock();
 			flow->lr_timestamp = tcp_now;
+			TAILQ_INSERT_TAIL(&lt->lt_pend, flow, lr_pend_link);
+			lt->lt_npend++;
 			tcp_lro_sched_timer(0);
-		}	
+		}
 		flow->lr_seq = ntohl(tcphdr->th_seq) + payload_len;
 	}
-	if (lro_mb) { 
+	if (lro_mb) {
 		tcpstat.tcps_coalesced_pack++;
-	}	
+	}
 	return;
 }
 
-static struct mbuf *
-tcp_lro_eject_flow(int flow_id)
+/*
+ * Detach the coalesced packet, if any, from a flow; the flow itself
+ * stays in the table.  Must be called with the table lock held.
+ */
+static struct mbuf*
+tcp_lro_eject_coalesced_pkt(struct lro_table *lt, struct lro_flow *flow)
 {
 	struct mbuf *mb = NULL;
 
-	mb = lro_flow_list[flow_id].lr_mhead;
-	ASSERT(lro_flow_map[lro_flow_list[flow_id].lr_hash_map] == flow_id);
-	lro_flow_map[lro_flow_list[flow_id].lr_hash_map] = TCP_LRO_FLOW_UNINIT;
-	bzero(&lro_flow_list[flow_id], sizeof(struct lro_flow));
-	
+	mb = flow->lr_mhead;
+	if (mb != NULL) {
+		mb->m_pkthdr.lro_elapsed = tcp_now - flow->lr_timestamp;
+		TAILQ_REMOVE(&lt->lt_pend, flow, lr_pend_link);
+		VERIFY(lt->lt_npend > 0);
+		lt->lt_npend--;
+	}
+	flow->lr_mhead = flow->lr_mtail = NULL;
+	flow->lr_tcphdr = NULL;
+	flow->lr_tsval = flow->lr_tsecr = NULL;
+	flow->lr_len = 0;
 	return mb;
 }
 
-static struct mbuf*
-tcp_lro_eject_coalesced_pkt(int flow_id)
+/*
+ * Remove a flow from the table, returning its coalesced packet if any.
+ * Must be called with the table lock held.
+ */
+static struct mbuf *
+tcp_lro_eject_flow(struct lro_table *lt, struct lro_flow *flow)
 {
-	struct mbuf *mb = NULL;
-	mb = lro_flow_list[flow_id].lr_mhead;
-	lro_flow_list[flow_id].lr_mhead = 
-		lro_flow_list[flow_id].lr_mtail = NULL;
-	lro_flow_list[flow_id].lr_tcphdr = NULL;
+	struct mbuf *mb;
+
+	VERIFY(flow->lr_flags & LRO_INUSE);
+	mb = tcp_lro_eject_coalesced_pkt(lt, flow);
+	LIST_REMOVE(flow, lr_hash_link);
+	TAILQ_REMOVE(&lt->lt_lru, flow, lr_link);
+	bzero(&flow->lr_key, sizeof (flow->lr_key));
+	flow->lr_seq = 0;
+	flow->lr_timestamp = 0;
+	flow->lr_flags = 0;
+	TAILQ_INSERT_HEAD(&lt->lt_free, flow, lr_link);
+
 	return mb;
 }
 
-static struct mbuf*
-tcp_lro_insert_flow(struct mbuf *lro_mb, struct ip *ip_hdr, 
-			struct tcphdr *tcp_hdr, int payload_len, 
-			int drop_hdrlen, int hash, struct tcpopt *topt, 
-			u_int32_t *tsval, u_int32_t *tsecr)
+/*
+ * Take a free flow entry, or else evict the least recently used flow
+ * that holds no packet, so that nothing needs to be delivered by the
+ * caller.  Returns NULL when every flow is holding a packet.
+ * Must be called with the table lock held.
+ */
+static struct lro_flow *
+tcp_lro_insert_flow(struct lro_table *lt, struct lro_key *key)
 {
-	int i;
-	int slot_available = 0;
-	int candidate_flow = 0; 
-	u_int32_t oldest_timestamp;
-	struct mbuf *mb = NULL;
-	int collision = 0;
-
-	oldest_timestamp = tcp_now;
-	
-	/* handle collision */
-	if (lro_flow_map[hash] != TCP_LRO_FLOW_UNINIT) {
-		if (lrodebug) {
-			collision = 1;
-		}
-		candidate_flow = lro_flow_map[hash];
-		tcpstat.tcps_flowtbl_collision++;
-		goto kick_flow;
-	}
+	struct lro_flow *flow;
 
-	for (i = 0; i < TCP_LRO_NUM_FLOWS; i++) {
-		if (lro_flow_list[i].lr_mhead == NULL) {
-			candidate_flow = i;
-			slot_available = 1;
-			break;
+	if ((flow = TAILQ_FIRST(&lt->lt_free)) == NULL) {
+		tcpstat.tcps_flowtbl_full++;
+		TAILQ_FOREACH(flow, &lt->lt_lru, lr_link) {
+			if (flow->lr_mhead == NULL)
+				break;
 		}
-		if (oldest_timestamp >= lro_flow_list[i].lr_timestamp) {
-			candidate_flow = i;
-			oldest_timestamp = lro_flow_list[i].lr_timestamp;
+		if (flow == NULL) {
+			if (lrodebug)
+				printf("%s: slot unavailable.\n", __func__);
+			return (NULL);
 		}
+		(void) tcp_lro_eject_flow(lt, flow);
+		lt->lt_stat.lro_flows_evicted++;
+	} else if (lrodebug && tcp_lro_lookup(lt, key) != NULL) {
+		printf("%s: duplicate flow.\n", __func__);
 	}
+	TAILQ_REMOVE(&lt->lt_free, flow, lr_link);
 
-	if (!slot_available) {
-		tcpstat.tcps_flowtbl_full++;
-kick_flow:
-		/* kick the oldest flow */
-		mb = tcp_lro_eject_flow(candidate_flow);
-
-		if (lrodebug) {
-			if (!slot_available) {
-				printf("%s: slot unavailable.\n",__func__);
-			}
-			if (collision) {
-				printf("%s: collision.\n",__func__);
-			}
-		}
-	} else {
-		candidate_flow = i; /* this is now the flow to be used */
+	if (!LIST_EMPTY(&lt->lt_hash[tcp_lro_key_hash(key, lt->lt_hashmask)]))
+		tcpstat.tcps_flowtbl_collision++;
 
-	}
+	flow->lr_key = *key;
+	flow->lr_flags = LRO_INUSE;
+	flow->lr_timestamp = tcp_now;
+	LIST_INSERT_HEAD(&lt->lt_hash[tcp_lro_key_hash(key, lt->lt_hashmask)],
+	    flow, lr_hash_link);
+	TAILQ_INSERT_TAIL(&lt->lt_lru, flow, lr_link);
+	lt->lt_stat.lro_flows_added++;
 
-	tcp_lro_init_flow(candidate_flow, ip_hdr, tcp_hdr, hash, 
-				tcp_now, payload_len);
-	tcp_lro_coalesce(candidate_flow, lro_mb, tcp_hdr, payload_len, 
-				drop_hdrlen, topt, tsval, tsecr, 0);
-	return mb;
+	return (flow);
 }
 
-struct mbuf*
-tcp_lro_process_pkt(struct mbuf *lro_mb, struct ip *ip_hdr, 
-				struct tcphdr *tcp_hdr, int drop_hdrlen)
+/*
+ * Coalesce, hold or deliver a segment.  hlen is the length of the IP
+ * header and tlen that of the TCP segment; both have been pulled up.
+ */
+static struct mbuf*
+tcp_lro_process_pkt(struct mbuf *lro_mb, int af, struct tcphdr *tcp_hdr,
+				unsigned int hlen, int tlen, u_int8_t ecn)
 {
-	int flow_id = TCP_LRO_FLOW_UNINIT;
-	int hash;
+	struct lro_table *lt;
+	struct lro_flow *flow = NULL;
+	struct lro_key key;
 	unsigned int off = 0;
 	int eject_flow = 0;
 	int optlen;
 	int retval = 0;
 	struct mbuf *mb = NULL;
 	int payload_len = 0;
+	int drop_hdrlen;
 	u_char *optp = NULL;
 	int thflags = 0;
 	struct tcpopt to;
-	int ret_response = TCP_LRO_CONSUMED;
 	int coalesced = 0, tcpflags = 0, unknown_tcpopts = 0;
-	u_int8_t ecn;
-	
-	if (lro_mb->m_len < (int32_t)sizeof (struct tcpiphdr)) {
-		if ((lro_mb = m_pullup(lro_mb, sizeof(struct tcpiphdr))) == 0) {
-			tcpstat.tcps_rcvshort++;
-			m_freem(lro_mb); 
-			if (lrodebug) {
-				printf("tcp_lro_process_pkt:mbuf too short.\n");
-			}
-			return NULL;
-		}
-	}
 
 	/* Just in case */
 	lro_mb->m_pkthdr.pkt_flags &= ~PKTF_SW_LRO_DID_CSUM;
 
-	if ((lro_mb = lro_tcp_xsum_validate(lro_mb, ip_hdr, tcp_hdr)) == NULL) {
+	if ((lro_mb = lro_tcp_xsum_validate(lro_mb, af, tcp_hdr, hlen,
+	    tlen)) == NULL) {
 		if (lrodebug) {
 			printf("tcp_lro_process_pkt: TCP xsum failed.\n");
 		}
-		return NULL; 
+		return NULL;
 	}
 
 	/* Update stats */
@@ -448,8 +575,10 @@ tcp_lro_process_pkt(struct mbuf *lro_mb, struct ip *ip_hdr,
 
 	off = tcp_hdr->th_off << 2;
 	optlen = off - sizeof (struct tcphdr);
-	payload_len = ip_hdr->ip_len - off;
+	payload_len = tlen - off;
+	drop_hdrlen = hlen + off;
 	optp = (u_char *)(tcp_hdr + 1);
+	bzero(&to, sizeof (to));
 	/*
 	 * Do quick retrieval of timestamp options ("options
 	 * prediction?").  If timestamp is the only option and it's
@@ -467,33 +596,31 @@ tcp_lro_process_pkt(struct mbuf *lro_mb, struct ip *ip_hdr,
 			to.to_tsecr = ntohl(*(u_int32_t *)(void *)(optp + 8));
 	} else {
 		/*
-		 * If TCP timestamps are not in use, or not the first option, 
-		 * skip LRO path since timestamps are used to avoid LRO 
+		 * If TCP timestamps are not in use, or not the first option,
+		 * skip LRO path since timestamps are used to avoid LRO
 		 * from introducing additional latencies for retransmissions
 		 * and other slow-paced transmissions.
 		 */
-		to.to_flags = to.to_tsecr = 0;
 		eject_flow = 1;
 	}
 
 	/* list all the conditions that can trigger a flow ejection here */
-	
+
 	thflags = tcp_hdr->th_flags;
-	if (thflags & (TH_SYN | TH_URG | TH_ECE | TH_CWR | TH_PUSH | TH_RST | TH_FIN)) { 
+	if (thflags & (TH_SYN | TH_URG | TH_ECE | TH_CWR | TH_PUSH | TH_RST | TH_FIN)) {
 		eject_flow = tcpflags = 1;
-	} 
-	
-	if (optlen && !((optlen == TCPOLEN_TSTAMP_APPA) && 
+	}
+
+	if (optlen && !((optlen == TCPOLEN_TSTAMP_APPA) &&
 			(to.to_flags & TOF_TS))) {
 		eject_flow = unknown_tcpopts = 1;
-	} 
-	
+	}
+
 	if (payload_len <= LRO_MIN_COALESC_SZ) { /* zero payload ACK */
 		eject_flow = 1;
 	}
 
 	/* Can't coalesce ECN marked packets. */
-	ecn = ip_hdr->ip_tos & IPTOS_ECN_MASK;
 	if (ecn == IPTOS_ECN_CE) {
 		/*
 		 * ECN needs quick notification
@@ -504,45 +631,55 @@ tcp_lro_process_pkt(struct mbuf *lro_mb, struct ip *ip_hdr,
 		eject_flow = 1;
 	}
 
-	lck_mtx_lock_spin(&tcp_lro_lock);
+	if ((lt = tcp_lro_table(lro_mb->m_pkthdr.rcvif)) == NULL) {
+		lro_proto_input(lro_mb);
+		return NULL;
+	}
 
-	retval = tcp_lro_matching_tuple(ip_hdr, tcp_hdr, &hash, &flow_id);
+	tcp_lro_key_pkt(&key, af, mtod(lro_mb, void *), tcp_hdr);
+	calculate_tcp_clock();
+
+	lck_mtx_lock_spin(&lt->lt_lock);
+
+	lt->lt_stat.lro_segs_in++;
+	retval = tcp_lro_matching_tuple(lt, &key, tcp_hdr, &flow);
 
 	switch (retval) {
 	case TCP_LRO_NAN:
-		lck_mtx_unlock(&tcp_lro_lock);
-		ret_response = TCP_LRO_FLOW_NOTFOUND;
+		lck_mtx_unlock(&lt->lt_lock);
+		lro_proto_input(lro_mb);
 		break;
 
 	case TCP_LRO_COALESCE:
-		if ((payload_len != 0) && (unknown_tcpopts == 0) && 
-			(tcpflags == 0) && (ecn != IPTOS_ECN_CE) && (to.to_flags & TOF_TS)) { 
-			tcp_lro_coalesce(flow_id, lro_mb, tcp_hdr, payload_len,
-				drop_hdrlen, &to, 
+		if (flow->lr_mhead != NULL &&
+		    flow->lr_len + payload_len > LRO_MX_COALESCE_BYTES) {
+			/* the coalesced packet is full; start over */
+			eject_flow = 1;
+		} else if ((payload_len != 0) && (unknown_tcpopts == 0) &&
+			(tcpflags == 0) && (ecn != IPTOS_ECN_CE) && (to.to_flags & TOF_TS)) {
+			tcp_lro_coalesce(lt, flow, lro_mb, tcp_hdr, payload_len,
+				drop_hdrlen, &to,
 				(to.to_flags & TOF_TS) ? (u_int32_t *)(void *)(optp + 4) : NULL,
 				(to.to_flags & TOF_TS) ? (u_int32_t *)(void *)(optp + 8) : NULL,
 				thflags);
-			if (lrodebug >= 2) { 
-				printf("tcp_lro_process_pkt: coalesce len = %d. flow_id = %d payload_len = %d drop_hdrlen = %d optlen = %d lport = %d seqnum = %x.\n",
-					lro_flow_list[flow_id].lr_len, flow_id, 
-					payload_len, drop_hdrlen, optlen,
-					ntohs(lro_flow_list[flow_id].lr_lport),
+			if (lrodebug >= 2) {
+				printf("tcp_lro_process_pkt: coalesce len = %d. payload_len = %d drop_hdrlen = %d optlen = %d lport = %d seqnum = %x.\n",
+					flow->lr_len, payload_len, drop_hdrlen,
+					optlen, ntohs(flow->lr_key.lk_lport),
 					ntohl(tcp_hdr->th_seq));
 			}
-			if (lro_flow_list[flow_id].lr_mhead->m_pkthdr.lro_npkts >= coalesc_sz) {
+			if (flow->lr_mhead->m_pkthdr.lro_npkts >= coalesc_sz) {
 				eject_flow = 1;
 			}
 			coalesced = 1;
 		}
 		if (eject_flow) {
-			mb = tcp_lro_eject_coalesced_pkt(flow_id);
-			lro_flow_list[flow_id].lr_seq = ntohl(tcp_hdr->th_seq) +
-								payload_len;
-			calculate_tcp_clock();					
-			u_int8_t timestamp = tcp_now - lro_flow_list[flow_id].lr_timestamp;					
-			lck_mtx_unlock(&tcp_lro_lock);
+			mb = tcp_lro_eject_coalesced_pkt(lt, flow);
+			flow->lr_seq = ntohl(tcp_hdr->th_seq) + payload_len;
+			if (mb != NULL)
+				lt->lt_stat.lro_flush_eject++;
+			lck_mtx_unlock(&lt->lt_lock);
 			if (mb) {
-				mb->m_pkthdr.lro_elapsed = timestamp;
 				lro_proto_input(mb);
 			}
 			if (!coalesced) {
@@ -552,39 +689,30 @@ tcp_lro_process_pkt(struct mbuf *lro_mb, struct ip *ip_hdr,
 				lro_proto_input(lro_mb);
 			}
 		} else {
-			lck_mtx_unlock(&tcp_lro_lock);
+			lck_mtx_unlock(&lt->lt_lock);
 		}
 		break;
 
 	case TCP_LRO_EJECT_FLOW:
-		mb = tcp_lro_eject_coalesced_pkt(flow_id);
-		calculate_tcp_clock();
-		u_int8_t timestamp = tcp_now - lro_flow_list[flow_id].lr_timestamp;
-		lck_mtx_unlock(&tcp_lro_lock);
+		mb = tcp_lro_eject_coalesced_pkt(lt, flow);
+		if (mb != NULL)
+			lt->lt_stat.lro_flush_eject++;
+		lck_mtx_unlock(&lt->lt_lock);
 		if (mb) {
-			if (lrodebug) 
+			if (lrodebug)
 				printf("tcp_lro_process_pkt eject_flow, len = %d\n", mb->m_pkthdr.len);
-			mb->m_pkthdr.lro_elapsed = timestamp;
 			lro_proto_input(mb);
 		}
 
 		lro_proto_input(lro_mb);
 		break;
 
-	case TCP_LRO_COLLISION:
-		lck_mtx_unlock(&tcp_lro_lock);
-		ret_response = TCP_LRO_FLOW_NOTFOUND;
-		break;
-
 	default:
-		lck_mtx_unlock(&tcp_lro_lock);
+		lck_mtx_unlock(&lt->lt_lock);
 		panic_plain("%s: unrecognized type %d", __func__, retval);
-		break; 
+		break;
 	}
 
-	if (ret_response == TCP_LRO_FLOW_NOTFOUND) {
-		lro_proto_input(lro_mb);
-	}
 	return NULL;
 }
 
@@ -599,70 +727,132 @@ tcp_lro_timer_proc(void *arg1, void *arg2)
 	tcp_lro_flush_flows();
 }
 
+/*
+ * Deliver the coalesced packets of every table.  Tables are never
+ * removed from lro_tables, so the walk may drop tcp_lro_lock while a
+ * table is being flushed.
+ */
 static void
 tcp_lro_flush_flows(void)
 {
-	int i = 0;
-	struct mbuf *mb;
+	struct lro_table *lt;
+
+	lck_mtx_lock_spin(&tcp_lro_lock);
+	lt = TAILQ_FIRST(&lro_tables);
+	lck_mtx_unlock(&tcp_lro_lock);
+
+	while (lt != NULL) {
+		if (lt->lt_npend != 0)
+			tcp_lro_flush_table(lt, TRUE);
+
+		lck_mtx_lock_spin(&tcp_lro_lock);
+		lt = TAILQ_NEXT(lt, lt_link);
+		lck_mtx_unlock(&tcp_lro_lock);
+	}
+}
+
+static void
+tcp_lro_flush_table(struct lro_table *lt, boolean_t timer)
+{
+	struct mbuf *mb, *mlist = NULL, **mtailp = &mlist;
 	struct lro_flow *flow;
-	int tcpclock_updated = 0;
 
-	lck_mtx_lock(&tcp_lro_lock);
+	calculate_tcp_clock();
+
+	lck_mtx_lock_spin(&lt->lt_lock);
+	while ((flow = TAILQ_FIRST(&lt->lt_pend)) != NULL) {
+		if (lrodebug >= 2)
+			printf("tcp_lro_flush_table: len =%d n_pkts = %d %d %d \n",
+				flow->lr_len,
+				flow->lr_mhead->m_pkthdr.lro_npkts,
+				flow->lr_timestamp, tcp_now);
+
+		mb = tcp_lro_eject_coalesced_pkt(lt, flow);
+		*mtailp = mb;
+		mtailp = &mb->m_nextpkt;
+		if (timer)
+			lt->lt_stat.lro_flush_timer++;
+		else
+			lt->lt_stat.lro_flush_batch++;
+	}
+	lck_mtx_unlock(&lt->lt_lock);
 
-	while (i < TCP_LRO_NUM_FLOWS) {
-		flow = &lro_flow_list[i];
-		if (flow->lr_mhead != NULL) {
-			
-			if (!tcpclock_updated) {
-				calculate_tcp_clock();
-				tcpclock_updated = 1;
-			}
+	while ((mb = mlist) != NULL) {
+		mlist = mb->m_nextpkt;
+		mb->m_nextpkt = NULL;
+		lro_update_flush_stats(mb);
+		lro_proto_input(mb);
+	}
+}
 
-			if (lrodebug >= 2) 
-				printf("tcp_lro_flush_flows: len =%d n_pkts = %d %d %d \n",
-					flow->lr_len, 
-					flow->lr_mhead->m_pkthdr.lro_npkts, 
-					flow->lr_timestamp, tcp_now);
+/*
+ * Deliver what has been coalesced on an interface; called by the
+ * protocol input handlers at the end of each batch of packets.
+ */
+void
+tcp_lro_flush(struct ifnet *ifp)
+{
+	struct lro_table *lt;
 
-			u_int8_t timestamp = tcp_now - flow->lr_timestamp;
+	if (ifp == NULL || (lt = ifp->if_lro) == NULL || lt->lt_npend == 0)
+		return;
 
-			mb = tcp_lro_eject_flow(i);
+	tcp_lro_flush_table(lt, FALSE);
+}
 
-			if (mb) {
-				mb->m_pkthdr.lro_elapsed = timestamp;
-				lck_mtx_unlock(&tcp_lro_lock);
-				lro_update_flush_stats(mb);
-				lro_proto_input(mb);
-				lck_mtx_lock(&tcp_lro_lock);
-			}
+/*
+ * Called when an interface is detached.  Its packets are dropped and
+ * its flows forgotten, but the table stays with the ifnet for reuse.
+ */
+void
+tcp_lro_detach(struct ifnet *ifp)
+{
+	struct lro_table *lt;
+	struct lro_flow *flow;
+	struct mbuf *mb, *mlist = NULL;
+
+	if ((lt = ifp->if_lro) == NULL)
+		return;
+
+	lck_mtx_lock(&lt->lt_lock);
+	while ((flow = TAILQ_FIRST(&lt->lt_lru)) != NULL) {
+		if ((mb = tcp_lro_eject_flow(lt, flow)) != NULL) {
+			mb->m_nextpkt = mlist;
+			mlist = mb;
 		}
-		i++;
 	}
-	lck_mtx_unlock(&tcp_lro_lock);
+	VERIFY(lt->lt_npend == 0);
+	lck_mtx_unlock(&lt->lt_lock);
+
+	if (mlist != NULL)
+		m_freem_list(mlist);
 }
 
 /*
- * Must be called with tcp_lro_lock held.
+ * Called with the table lock held.
  * The hint is non-zero for longer waits. The wait time dictated by coalesc_time
  * takes precedence, so lro_timer_set is not set for the hint case
  */
 static void
 tcp_lro_sched_timer(uint64_t hint)
 {
+	lck_mtx_lock_spin(&tcp_lro_lock);
 	if (lro_timer_set) {
+		lck_mtx_unlock(&tcp_lro_lock);
 		return;
 	}
 
 	lro_timer_set = 1;
 	if (!hint) {
 		/* the intent is to wake up every coalesc_time msecs */
-		clock_interval_to_deadline(coalesc_time, 
+		clock_interval_to_deadline(coalesc_time,
 			(NSEC_PER_SEC / TCP_RETRANSHZ), &lro_deadline);
 	} else {
 		clock_interval_to_deadline(hint, NSEC_PER_SEC / TCP_RETRANSHZ,
                         &lro_deadline);
 	}
 	thread_call_enter_delayed(tcp_lro_timer, lro_deadline);
+	lck_mtx_unlock(&tcp_lro_lock);
 }
 
 struct mbuf*
@@ -673,14 +863,14 @@ tcp_lro(struct mbuf *m, unsigned int hlen)
 	struct tcphdr * tcp_hdr = NULL;
 	unsigned int off = 0;
 
-	if (kipf_count != 0) 
+	if (kipf_count != 0)
 		return m;
 
-	/* 
-	 * Experiments on cellular show that the RTT is much higher  
+	/*
+	 * Experiments on cellular show that the RTT is much higher
 	 * than the coalescing time of 5 msecs, causing lro to flush
-	 * 80% of the time on a single packet. Increasing 
-	 * coalescing time for cellular does not show marked 
+	 * 80% of the time on a single packet. Increasing
+	 * coalescing time for cellular does not show marked
 	 * improvement to throughput either. Loopback perf is hurt
 	 * by the 5 msec latency and it already sends large packets.
 	 */
@@ -703,12 +893,13 @@ tcp_lro(struct mbuf *m, unsigned int hlen)
 	if (m->m_len < (int32_t) sizeof (struct tcpiphdr)) {
 		if (lrodebug) printf("tcp_lro m_pullup \n");
 		if ((m = m_pullup(m, sizeof (struct tcpiphdr))) == 0) {
-			tcpstat.tcps_rcvshort++; 
+			tcpstat.tcps_rcvshort++;
 			if (lrodebug) {
 				printf("ip_lro: rcvshort.\n");
 			}
 			return NULL;
 		}
+		ip_hdr = mtod(m, struct ip*);
 	}
 
 	tcp_hdr = (struct tcphdr *)((caddr_t)ip_hdr + hlen);
@@ -718,37 +909,122 @@ tcp_lro(struct mbuf *m, unsigned int hlen)
 	m->m_pkthdr.lro_elapsed = 0; /* Initialize the field to carry elapsed time */
 	off = tcp_hdr->th_off << 2;
 	if (off < sizeof (struct tcphdr) || off > tlen) {
-		tcpstat.tcps_rcvbadoff++; 
+		tcpstat.tcps_rcvbadoff++;
 		if (lrodebug) {
 			printf("ip_lro: TCP off greater than TCP header.\n");
 		}
 		return m;
 	}
 
-	return (tcp_lro_process_pkt(m, ip_hdr, tcp_hdr, hlen + off));
+	/* the options are parsed in place */
+	if (m->m_len < (int32_t)(hlen + off)) {
+		if ((m = m_pullup(m, hlen + off)) == NULL) {
+			tcpstat.tcps_rcvshort++;
+			return NULL;
+		}
+		ip_hdr = mtod(m, struct ip*);
+		tcp_hdr = (struct tcphdr *)((caddr_t)ip_hdr + hlen);
+	}
+
+	return (tcp_lro_process_pkt(m, AF_INET, tcp_hdr, hlen, tlen,
+	    ip_hdr->ip_tos & IPTOS_ECN_MASK));
 }
 
+#if INET6
+/*
+ * IPv6 counterpart of tcp_lro(), called by ip6_input() once the IPv6
+ * filters have run; only segments without extension headers are
+ * coalesced.
+ */
+struct mbuf*
+tcp_lro6(struct mbuf *m, unsigned int hlen)
+{
+	struct ip6_hdr *ip6;
+	unsigned int tlen;
+	struct tcphdr * tcp_hdr = NULL;
+	unsigned int off = 0;
+
+	/* see tcp_lro() */
+	if (IFNET_IS_CELLULAR(m->m_pkthdr.rcvif) ||
+		(m->m_pkthdr.rcvif->if_type == IFT_LOOP)) {
+		return m;
+	}
+
+	if (hlen != sizeof (struct ip6_hdr))
+		return (m);
+
+	if (m->m_len < (int32_t)(hlen + sizeof (struct tcphdr))) {
+		if ((m = m_pullup(m, hlen + sizeof (struct tcphdr))) == NULL) {
+			tcpstat.tcps_rcvshort++;
+			return NULL;
+		}
+	}
+
+	ip6 = mtod(m, struct ip6_hdr *);
+	if (ip6->ip6_nxt != IPPROTO_TCP)
+		return m;
+
+	tcp_hdr = (struct tcphdr *)(void *)((caddr_t)ip6 + hlen);
+	tlen = ntohs(ip6->ip6_plen);
+	m->m_pkthdr.lro_pktlen = tlen;
+	m->m_pkthdr.lro_npkts = 1;
+	m->m_pkthdr.lro_elapsed = 0;
+	off = tcp_hdr->th_off << 2;
+	if (off < sizeof (struct tcphdr) || off > tlen) {
+		/* includes jumbograms, whose payload length is 0 */
+		tcpstat.tcps_rcvbadoff++;
+		return m;
+	}
+
+	if (m->m_len < (int32_t)(hlen + off)) {
+		if ((m = m_pullup(m, hlen + off)) == NULL) {
+			tcpstat.tcps_rcvshort++;
+			return NULL;
+		}
+		ip6 = mtod(m, struct ip6_hdr *);
+		tcp_hdr = (struct tcphdr *)(void *)((caddr_t)ip6 + hlen);
+	}
+
+	return (tcp_lro_process_pkt(m, AF_INET6, tcp_hdr, hlen, tlen,
+	    (ntohl(ip6->ip6_flow) >> 20) & IPTOS_ECN_MASK));
+}
+#endif /* INET6 */
+
 static void
 lro_proto_input(struct mbuf *m)
 {
 	struct ip* ip_hdr = mtod(m, struct ip*);
 
+	lro_update_stats(m);
+#if INET6
+	if (ip_hdr->ip_v == 6) {
+		int off = sizeof (struct ip6_hdr);
+
+		if (lrodebug >= 3) {
+			printf("lro_proto_input: ip6_plen = %d \n",
+				ntohs(mtod(m, struct ip6_hdr *)->ip6_plen));
+		}
+		(void) tcp6_input(&m, &off, IPPROTO_TCP);
+		return;
+	}
+#endif /* INET6 */
+
 	if (lrodebug >= 3) {
-		printf("lro_proto_input: ip_len = %d \n", 
+		printf("lro_proto_input: ip_len = %d \n",
 			ip_hdr->ip_len);
 	}
-	lro_update_stats(m);
 	ip_proto_dispatch_in_wrapper(m, ip_hdr->ip_hl << 2, ip_hdr->ip_p);
 }
 
 static struct mbuf *
-lro_tcp_xsum_validate(struct mbuf *m, struct ip *ip, struct tcphdr * th)
+lro_tcp_xsum_validate(struct mbuf *m, int af, struct tcphdr * th,
+	unsigned int hlen, int tlen)
 {
 	/* Expect 32-bit aligned data pointer on strict-align platforms */
 	MBUF_STRICT_DATA_ALIGNMENT_CHECK_32(m);
 
-	/* we shouldn't get here for IP with options; hence sizeof (ip) */
-	if (tcp_input_checksum(AF_INET, m, th, sizeof (*ip), ip->ip_len)) {
+	/* we shouldn't get here for IP with options or extension headers */
+	if (tcp_input_checksum(af, m, th, hlen, tlen)) {
 		if (lrodebug)
 			printf("%s: bad xsum and drop m = 0x%llx.\n", __func__,
 			(uint64_t)VM_KERNEL_ADDRPERM(m));
@@ -760,138 +1036,141 @@ lro_tcp_xsum_validate(struct mbuf *m, struct ip *ip, struct tcphdr * th)
 }
 
 /*
- * When TCP detects a stable, steady flow without out of ordering, 
- * with a sufficiently high cwnd, it invokes LRO.
+ * When TCP detects a stable, steady flow without out of ordering,
+ * with a sufficiently high cwnd, it invokes LRO on the interface
+ * the flow arrives on.  rcv_nxt is the next expected sequence number.
  */
 int
-tcp_start_coalescing(struct ip *ip_hdr, struct tcphdr *tcp_hdr, int tlen) 
+tcp_start_coalescing(struct tcpcb *tp, struct ifnet *ifp, __uint32_t rcv_nxt)
 {
-	int hash;
-	int flow_id;
-	struct mbuf *eject_mb;
+	struct lro_table *lt;
 	struct lro_flow *lf;
+	struct lro_key key;
 
-	hash = LRO_HASH(ip_hdr->ip_src.s_addr, ip_hdr->ip_dst.s_addr, 
-		tcp_hdr->th_sport, tcp_hdr->th_dport,
-		(TCP_LRO_FLOW_MAP - 1));
-
-	
-	lck_mtx_lock_spin(&tcp_lro_lock);
-	flow_id = lro_flow_map[hash];
-	if (flow_id != TCP_LRO_FLOW_NOTFOUND) {
-		lf = &lro_flow_list[flow_id];
-		if ((lf->lr_faddr.s_addr == ip_hdr->ip_src.s_addr) &&
-		    (lf->lr_laddr.s_addr == ip_hdr->ip_dst.s_addr) &&
-		    (lf->lr_fport == tcp_hdr->th_sport) &&
-		    (lf->lr_lport == tcp_hdr->th_dport)) {
-		    	if ((lf->lr_tcphdr == NULL) &&
-		    		(lf->lr_seq != (tcp_hdr->th_seq + tlen))) {
-				lf->lr_seq = tcp_hdr->th_seq + tlen;
-			}	
-			lf->lr_flags &= ~LRO_EJECT_REQ;
-		}
-		lck_mtx_unlock(&tcp_lro_lock); 
+	if (ifp == NULL || (lt = tcp_lro_table(ifp)) == NULL)
 		return 0;
-	}
 
-	HTONL(tcp_hdr->th_seq);
-	HTONL(tcp_hdr->th_ack);
-	eject_mb = 
-		tcp_lro_insert_flow(NULL, ip_hdr, tcp_hdr, tlen, 0, hash, 
-		NULL, NULL, NULL);
+	tcp_lro_key_inp(&key, tp->t_inpcb);
+	calculate_tcp_clock();
 
-	lck_mtx_unlock(&tcp_lro_lock);
+	lck_mtx_lock_spin(&lt->lt_lock);
+	if ((lf = tcp_lro_lookup(lt, &key)) != NULL) {
+		if ((lf->lr_tcphdr == NULL) && (lf->lr_seq != rcv_nxt)) {
+			lf->lr_seq = rcv_nxt;
+		}
+		lf->lr_flags &= ~LRO_EJECT_REQ;
+	} else if ((lf = tcp_lro_insert_flow(lt, &key)) != NULL) {
+		lf->lr_seq = rcv_nxt;
+	}
+	lck_mtx_unlock(&lt->lt_lock);
+	tp->t_lrotbl = lt;
 
-	NTOHL(tcp_hdr->th_seq);
-	NTOHL(tcp_hdr->th_ack);
 	if (lrodebug >= 3) {
-		printf("%s: src = %x dst = %x sport = %d dport = %d seq %x \n",
-			__func__, ip_hdr->ip_src.s_addr, ip_hdr->ip_dst.s_addr,
-			tcp_hdr->th_sport, tcp_hdr->th_dport, tcp_hdr->th_seq);
+		printf("%s: %s fport = %d lport = %d seq %x \n", __func__,
+			if_name(ifp), ntohs(key.lk_fport), ntohs(key.lk_lport),
+			rcv_nxt);
 	}
-	ASSERT(eject_mb == NULL);
 	return 0;
 }
 
 /*
  * When TCP detects loss or idle condition, it stops offloading
- * to LRO. 
+ * to LRO.
  */
 int
-tcp_lro_remove_state(struct in_addr saddr, struct in_addr daddr, 
-		unsigned short sport, unsigned short dport)
+tcp_lro_remove_state(struct tcpcb *tp)
 {
-	int hash, flow_id;
+	struct lro_table *lt;
 	struct lro_flow *lf;
+	struct lro_key key;
 
-	hash = LRO_HASH(daddr.s_addr, saddr.s_addr, dport, sport,
-		(TCP_LRO_FLOW_MAP - 1));
-	lck_mtx_lock_spin(&tcp_lro_lock);
-	flow_id = lro_flow_map[hash];
-	if (flow_id == TCP_LRO_FLOW_UNINIT) {
-		lck_mtx_unlock(&tcp_lro_lock);
+	if ((lt = tp->t_lrotbl) == NULL)
 		return 0;
-	}
-	lf = &lro_flow_list[flow_id];
-	if ((lf->lr_faddr.s_addr == daddr.s_addr) && 
-	    (lf->lr_laddr.s_addr == saddr.s_addr) &&
-	    (lf->lr_fport == dport) &&
-	    (lf->lr_lport == sport)) {
+
+	tcp_lro_key_inp(&key, tp->t_inpcb);
+	lck_mtx_lock_spin(&lt->lt_lock);
+	if ((lf = tcp_lro_lookup(lt, &key)) != NULL) {
 		if (lrodebug) {
-			printf("%s: %x %x\n", __func__, 
+			printf("%s: %x %x\n", __func__,
 				lf->lr_flags, lf->lr_seq);
 		}
 		lf->lr_flags |= LRO_EJECT_REQ;
 	}
-	lck_mtx_unlock(&tcp_lro_lock);
+	lck_mtx_unlock(&lt->lt_lock);
 	return 0;
 }
 
 void
-tcp_update_lro_seq(__uint32_t rcv_nxt, struct in_addr saddr, struct in_addr daddr,
-		unsigned short sport, unsigned short dport)
+tcp_update_lro_seq(struct tcpcb *tp, __uint32_t rcv_nxt)
 {
-	int hash, flow_id;
+	struct lro_table *lt;
 	struct lro_flow *lf;
+	struct lro_key key;
 
-	hash = LRO_HASH(daddr.s_addr, saddr.s_addr, dport, sport, 
-		(TCP_LRO_FLOW_MAP - 1));
-	lck_mtx_lock_spin(&tcp_lro_lock);
-	flow_id = lro_flow_map[hash];
-	if (flow_id == TCP_LRO_FLOW_UNINIT) {
-		lck_mtx_unlock(&tcp_lro_lock);
+	if ((lt = tp->t_lrotbl) == NULL)
 		return;
-	}
-	lf = &lro_flow_list[flow_id];
-	if ((lf->lr_faddr.s_addr == daddr.s_addr) &&
-	    (lf->lr_laddr.s_addr == saddr.s_addr) &&
-	    (lf->lr_fport == dport) &&
-	    (lf->lr_lport == sport) &&
+
+	tcp_lro_key_inp(&key, tp->t_inpcb);
+	lck_mtx_lock_spin(&lt->lt_lock);
+	if ((lf = tcp_lro_lookup(lt, &key)) != NULL &&
 	    (lf->lr_tcphdr == NULL)) {
 		lf->lr_seq = (tcp_seq)rcv_nxt;
 	}
-	lck_mtx_unlock(&tcp_lro_lock);
+	lck_mtx_unlock(&lt->lt_lock);
 	return;
 }
 
+static int
+sysctl_lro_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct tcp_lro_stat stat;
+	struct lro_table *lt;
+
+	if (req->newptr != USER_ADDR_NULL)
+		return (EPERM);
+
+	bzero(&stat, sizeof (stat));
+	lck_mtx_lock(&tcp_lro_lock);
+	TAILQ_FOREACH(lt, &lro_tables, lt_link) {
+		stat.lro_segs_in += lt->lt_stat.lro_segs_in;
+		stat.lro_segs_coalesced += lt->lt_stat.lro_segs_coalesced;
+		stat.lro_flush_batch += lt->lt_stat.lro_flush_batch;
+		stat.lro_flush_timer += lt->lt_stat.lro_flush_timer;
+		stat.lro_flush_eject += lt->lt_stat.lro_flush_eject;
+		stat.lro_flows_added += lt->lt_stat.lro_flows_added;
+		stat.lro_flows_evicted += lt->lt_stat.lro_flows_evicted;
+		stat.lro_chain_max = MAX(stat.lro_chain_max,
+		    lt->lt_stat.lro_chain_max);
+		stat.lro_tables++;
+		stat.lro_flows += lt->lt_nflows;
+	}
+	lck_mtx_unlock(&tcp_lro_lock);
+
+	/* every segment not appended to another one goes up on its own */
+	stat.lro_pkts_out = stat.lro_segs_in - stat.lro_segs_coalesced;
+
+	return (SYSCTL_OUT(req, &stat, sizeof (stat)));
+}
+
 static void
 lro_update_stats(struct mbuf *m)
 {
 	switch(m->m_pkthdr.lro_npkts) {
 	case 0: /* fall through */
-	case 1: 
+	case 1:
 		break;
-	
-	case 2: 
+
+	case 2:
 		tcpstat.tcps_lro_twopack++;
 		break;
-	
+
 	case 3: /* fall through */
 	case 4:
 		tcpstat.tcps_lro_multpack++;
 		break;
-	
-	default: 
+
+	default:
 		tcpstat.tcps_lro_largepack++;
 		break;
 	}
@@ -31,10 +31,36 @@
 
 #ifdef BSD_KERNEL_PRIVATE
 
-#define TCP_LRO_NUM_FLOWS (16)	/* must be <= 255 for char lro_flow_map */
-#define TCP_LRO_FLOW_MAP  (1024)
+#include <sys/queue.h>
+#include <kern/locks.h>
+
+/*
+ * Number of flow entries per interface flow table; the default may be
+ * changed with the net.inet.tcp.lro_flows sysctl, and applies to the
+ * tables allocated afterwards.
+ */
+#define TCP_LRO_NUM_FLOWS	(64)
+#define TCP_LRO_MIN_FLOWS	(4)
+#define TCP_LRO_MAX_FLOWS	(4096)
+
+/* TCP 4-tuple of a flow, as seen on the receive side */
+struct lro_key {
+	union {
+		struct in_addr	lku_addr4;
+		struct in6_addr	lku_addr6;
+		u_int32_t	lku_addr32[4];
+	} lk_faddr, lk_laddr;		/* foreign and local addresses */
+	u_int16_t		lk_fport;	/* foreign port */
+	u_int16_t		lk_lport;	/* local port */
+	u_int8_t		lk_af;		/* AF_INET or AF_INET6 */
+	u_int8_t		lk_pad[3];
+};
 
 struct lro_flow {
+	LIST_ENTRY(lro_flow)	lr_hash_link;	/* hash chain link */
+	TAILQ_ENTRY(lro_flow)	lr_link;	/* LRU or free list link */
+	TAILQ_ENTRY(lro_flow)	lr_pend_link;	/* pending list link */
+	struct lro_key		lr_key;		/* flow 4-tuple */
 	struct mbuf		*lr_mhead;	/* coalesced mbuf chain head */
 	struct mbuf		*lr_mtail;	/* coalesced mbuf chain tail */
 	struct tcphdr		*lr_tcphdr;	/* ptr to TCP hdr in frame */
@@ -42,25 +68,45 @@ struct lro_flow {
 	u_int32_t		*lr_tsecr;	/* tsecr field in TCP header */
 	tcp_seq			lr_seq;		/* next expected seq num */
 	unsigned int	 	lr_len;		/* length of LRO frame */
-	struct in_addr		lr_faddr;	/* foreign address */
-	struct in_addr		lr_laddr;	/* local address */
-	unsigned short int 	lr_fport;	/* foreign port */
-	unsigned short int	lr_lport;	/* local port */
 	u_int32_t		lr_timestamp;	/* for ejecting the flow */
-	unsigned short int	lr_hash_map;	/* back pointer to hash map */
-	unsigned short int	lr_flags;	/* pad */
+	unsigned short int	lr_flags;	/* see below */
 } __attribute__((aligned(8)));
 
 /* lr_flags - only 16 bits available */
 #define LRO_EJECT_REQ	0x1 
+#define LRO_INUSE	0x2	/* flow is on a hash chain */
 
-
-#define TCP_LRO_FLOW_UNINIT TCP_LRO_NUM_FLOWS+1
-#define TCP_LRO_FLOW_NOTFOUND TCP_LRO_FLOW_UNINIT
+/*
+ * Per-interface flow table.  Flows hash on their 4-tuple into chains
+ * of lt_hash, so that colliding flows coexist; when all entries are
+ * in use the least recently used flow is evicted.  Flows holding a
+ * coalesced packet are also on lt_pend, which is what gets flushed.
+ */
+struct lro_table {
+	decl_lck_mtx_data(, lt_lock);
+	TAILQ_ENTRY(lro_table)	lt_link;	/* global list of tables */
+	struct ifnet		*lt_ifp;	/* owning interface */
+	u_int32_t		lt_nflows;	/* # of flow entries */
+	u_int32_t		lt_hashmask;	/* hash buckets - 1 */
+	u_int32_t		lt_npend;	/* # of flows on lt_pend */
+	LIST_HEAD(, lro_flow)	*lt_hash;	/* hash buckets */
+	TAILQ_HEAD(, lro_flow)	lt_lru;		/* flows in use, LRU first */
+	TAILQ_HEAD(, lro_flow)	lt_free;	/* unused flow entries */
+	TAILQ_HEAD(, lro_flow)	lt_pend;	/* flows holding packets */
+	struct lro_flow		*lt_flows;	/* flow entries */
+	struct tcp_lro_stat	lt_stat;	/* statistics */
+};
 
 /* Max packets to be coalesced before pushing to app */
 #define LRO_MX_COALESCE_PKTS (8)
 
+/*
+ * Max TCP payload of a coalesced packet, so that the IPv4 and IPv6
+ * length fields cannot overflow.
+ */
+#define LRO_MX_COALESCE_BYTES \
+	(IP_MAXPACKET - sizeof (struct ip6_hdr) - TCP_MAXHLEN)
+
 /*
  * Min num of bytes in a packet to trigger coalescing
  */
@@ -155,7 +155,6 @@
 
 extern int tcp_lq_overflow;
 
-extern struct tcptimerlist tcp_timer_list;
 extern struct tcptailq tcp_tw_tailq;
 
 int 	tcp_mssdflt = TCP_MSS;
@@ -468,20 +467,7 @@ tcp_init(struct protosw *pp, struct domain *dp)
 	/* Initialize time wait and timer lists */
 	TAILQ_INIT(&tcp_tw_tailq);
 
-	bzero(&tcp_timer_list, sizeof(tcp_timer_list));
-	LIST_INIT(&tcp_timer_list.lhead);
-	/*
-	 * allocate lock group attribute, group and attribute for the tcp timer list
-	 */
-	tcp_timer_list.mtx_grp_attr = lck_grp_attr_alloc_init();
-	tcp_timer_list.mtx_grp = lck_grp_alloc_init("tcptimerlist", tcp_timer_list.mtx_grp_attr);
-	tcp_timer_list.mtx_attr = lck_attr_alloc_init();
-	if ((tcp_timer_list.mtx = lck_mtx_alloc_init(tcp_timer_list.mtx_grp, tcp_timer_list.mtx_attr)) == NULL) {
-		panic("failed to allocate memory for tcp_timer_list.mtx\n");
-	};
-	if ((tcp_timer_list.call = thread_call_allocate(tcp_run_timerlist, NULL)) == NULL) {
-		panic("failed to allocate call entry 1 in tcp_init\n");
-	}
+	tcp_timerlist_init();
 
 	/*
 	 * allocate lock group attribute, group and attribute for tcp_uptime_lock
@@ -1234,8 +1220,7 @@ no_valid_rt:
 	 * Clean up any LRO state 
 	 */
 	if (tp->t_flagsext & TF_LRO_OFFLOADED) {
-		tcp_lro_remove_state(inp->inp_laddr, inp->inp_faddr,
-		    inp->inp_lport, inp->inp_fport);
+		tcp_lro_remove_state(tp);
 		tp->t_flagsext &= ~TF_LRO_OFFLOADED;
 	}
 
@@ -75,7 +75,10 @@
 #include <sys/queue.h>
 #include <kern/locks.h>
 #include <kern/cpu_number.h>	/* before tcp_seq.h, for tcp_random18() */
+#include <kern/clock.h>
 #include <mach/boolean.h>
+#include <machine/machine_routines.h>
+#include <pexpert/pexpert.h>
 
 #include <net/route.h>
 #include <net/if_var.h>
@@ -131,8 +134,24 @@
 /* Max number of times a stretch ack can be delayed on a connection */
 #define	TCP_STRETCHACK_DELAY_THRESHOLD	5
 
-/* tcp timer list */
-struct tcptimerlist tcp_timer_list;
+/* tcp timer lists; only the first tcp_ntimerlists are used */
+static struct tcptimerlist tcp_timer_lists[TCP_TIMERLIST_MAX];
+static u_int32_t tcp_ntimerlists = 1;	/* power of 2 */
+
+SYSCTL_UINT(_net_inet_tcp, OID_AUTO, timer_lists,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_ntimerlists, 0,
+    "Number of TCP timer lists");
+
+static int sysctl_tcp_timerlist_stats SYSCTL_HANDLER_ARGS;
+SYSCTL_PROC(_net_inet_tcp, OID_AUTO, timer_list_stats,
+    CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED, 0, 0,
+    sysctl_tcp_timerlist_stats, "S,tcp_timerlist_stat",
+    "TCP timer list statistics");
+
+/* The timer list of a connection, fixed for the life of its tcpcb */
+#define TCP_TIMERLIST(tp)						\
+	(&tcp_timer_lists[(((uintptr_t)(tp) >> 8) ^			\
+	    ((uintptr_t)(tp) >> 16)) & (tcp_ntimerlists - 1)])
 
 /* List of pcbs in timewait state, protected by tcbinfo's ipi_lock */
 struct tcptailq tcp_tw_tailq;
@@ -275,7 +294,7 @@ int	tcp_jack_rxmt = TCP_RETRANSHZ / 2;
 #endif /* MPTCP */
 
 static void tcp_remove_timer(struct tcpcb *tp);
-static void tcp_sched_timerlist(uint32_t offset);
+static void tcp_sched_timerlist(struct tcptimerlist *listp, uint32_t offset);
 static u_int32_t tcp_run_conn_timer(struct tcpcb *tp, u_int16_t *mode);
 static void tcp_sched_timers(struct tcpcb *tp);
 static inline void tcp_set_lotimer_index(struct tcpcb *);
@@ -1256,21 +1275,91 @@ fc_output:
 	return (tp);
 }
 
+void
+tcp_timerlist_init(void)
+{
+	struct tcptimerlist *listp;
+	lck_grp_attr_t *grp_attr;
+	lck_grp_t *grp;
+	lck_attr_t *attr;
+	u_int32_t n, i;
+
+	n = ml_get_max_cpus();
+	PE_parse_boot_argn("tcp_timerlists", &n, sizeof (n));
+	n = MAX(1, MIN(n, TCP_TIMERLIST_MAX));
+	/* round down to a power of 2, for TCP_TIMERLIST() */
+	while (n & (n - 1))
+		n &= (n - 1);
+	tcp_ntimerlists = n;
+
+	/*
+	 * allocate lock group attribute, group and attribute for the tcp
+	 * timer lists
+	 */
+	grp_attr = lck_grp_attr_alloc_init();
+	grp = lck_grp_alloc_init("tcptimerlist", grp_attr);
+	attr = lck_attr_alloc_init();
+
+	for (i = 0; i < tcp_ntimerlists; i++) {
+		listp = &tcp_timer_lists[i];
+		bzero(listp, sizeof (*listp));
+		LIST_INIT(&listp->lhead);
+		listp->mtx_grp_attr = grp_attr;
+		listp->mtx_grp = grp;
+		listp->mtx_attr = attr;
+		if ((listp->mtx = lck_mtx_alloc_init(grp, attr)) == NULL) {
+			panic("failed to allocate memory for tcp timer "
+			    "list %u mtx\n", i);
+		}
+		if ((listp->call = thread_call_allocate(tcp_run_timerlist,
+		    listp)) == NULL) {
+			panic("failed to allocate call entry for tcp timer "
+			    "list %u\n", i);
+		}
+	}
+}
+
+/*
+ * Timer list lock wrappers, which account for contention and for how
+ * long the lock is held.
+ */
+static inline void
+tcp_timerlist_lock(struct tcptimerlist *listp)
+{
+	if (!lck_mtx_try_lock(listp->mtx)) {
+		lck_mtx_lock(listp->mtx);
+		listp->lock_contended++;
+	}
+	listp->lock_acquires++;
+	listp->lock_start = mach_absolute_time();
+}
+
+static inline void
+tcp_timerlist_unlock(struct tcptimerlist *listp)
+{
+	uint64_t held = mach_absolute_time() - listp->lock_start;
+
+	listp->lock_held_total += held;
+	if (held > listp->lock_held_max)
+		listp->lock_held_max = held;
+	lck_mtx_unlock(listp->mtx);
+}
+
 /* Remove a timer entry from timer list */
 void
 tcp_remove_timer(struct tcpcb *tp)
 {
-	struct tcptimerlist *listp = &tcp_timer_list;
+	struct tcptimerlist *listp = TCP_TIMERLIST(tp);
 
 	lck_mtx_assert(&tp->t_inpcb->inpcb_mtx, LCK_MTX_ASSERT_OWNED);
 	if (!(TIMER_IS_ON_LIST(tp))) {
 		return;
 	}
-	lck_mtx_lock(listp->mtx);
+	tcp_timerlist_lock(listp);
 	
 	/* Check if pcb is on timer list again after acquiring the lock */
 	if (!(TIMER_IS_ON_LIST(tp))) {
-		lck_mtx_unlock(listp->mtx);
+		tcp_timerlist_unlock(listp);
 		return;
 	}
 	
@@ -1284,7 +1373,7 @@ tcp_remove_timer(struct tcpcb *tp)
 
 	tp->tentry.le.le_next = NULL;
 	tp->tentry.le.le_prev = NULL;
-	lck_mtx_unlock(listp->mtx);
+	tcp_timerlist_unlock(listp);
 }
 
 /*
@@ -1294,9 +1383,9 @@ tcp_remove_timer(struct tcpcb *tp)
  */
 
 static boolean_t
-need_to_resched_timerlist(u_int32_t runtime, u_int16_t mode)
+need_to_resched_timerlist(struct tcptimerlist *listp, u_int32_t runtime,
+    u_int16_t mode)
 {
-	struct tcptimerlist *listp = &tcp_timer_list;
 	int32_t diff;
 
 	/*
@@ -1330,11 +1419,10 @@ need_to_resched_timerlist(u_int32_t runtime, u_int16_t mode)
 }
 
 void
-tcp_sched_timerlist(uint32_t offset) 
+tcp_sched_timerlist(struct tcptimerlist *listp, uint32_t offset) 
 {
 
 	uint64_t deadline = 0;
-	struct tcptimerlist *listp = &tcp_timer_list;
 
 	lck_mtx_assert(listp->mtx, LCK_MTX_ASSERT_OWNED);
 
@@ -1484,9 +1572,9 @@ done:
 
 void
 tcp_run_timerlist(void * arg1, void * arg2) {
-#pragma unused(arg1, arg2)
+#pragma unused(arg2)
 	struct tcptimerentry *te, *next_te;
-	struct tcptimerlist *listp = &tcp_timer_list;
+	struct tcptimerlist *listp = arg1;
 	struct tcpcb *tp;
 	uint32_t next_timer = 0; /* offset of the next timer on the list */
 	u_int16_t te_mode = 0;	/* modes of all active timers in a tcpcb */
@@ -1495,9 +1583,10 @@ tcp_run_timerlist(void * arg1, void * arg2) {
 
 	calculate_tcp_clock();
 
-	lck_mtx_lock(listp->mtx);
+	tcp_timerlist_lock(listp);
 
 	listp->running = TRUE;
+	listp->runs++;
 	
 	LIST_FOREACH_SAFE(te, &listp->lhead, le, next_te) {
 		uint32_t offset = 0;
@@ -1549,11 +1638,11 @@ tcp_run_timerlist(void * arg1, void * arg2) {
 		VERIFY_NEXT_LINK(&tp->tentry, le);
 		VERIFY_PREV_LINK(&tp->tentry, le);
 
-		lck_mtx_unlock(listp->mtx);
+		tcp_timerlist_unlock(listp);
 
 		offset = tcp_run_conn_timer(tp, &te_mode);
 		
-		lck_mtx_lock(listp->mtx);
+		tcp_timerlist_lock(listp);
 
 		next_te = listp->next_te;
 		listp->next_te = NULL;
@@ -1605,20 +1694,20 @@ tcp_run_timerlist(void * arg1, void * arg2) {
 			next_timer = max(next_timer,
 				TCP_TIMER_500MS_QUANTUM);
 
-		tcp_sched_timerlist(next_timer);
+		tcp_sched_timerlist(listp, next_timer);
 	} else {
 		/*
 		 * No need to reschedule this timer, but always run
 		 * periodically at a much higher granularity.
 		 */
-		tcp_sched_timerlist(TCP_TIMERLIST_MAX_OFFSET);
+		tcp_sched_timerlist(listp, TCP_TIMERLIST_MAX_OFFSET);
 	}
 
 	listp->running = FALSE;
 	listp->pref_mode = 0;
 	listp->pref_offset = 0;
 
-	lck_mtx_unlock(listp->mtx);
+	tcp_timerlist_unlock(listp);
 }
 
 /*
@@ -1631,7 +1720,7 @@ tcp_sched_timers(struct tcpcb *tp)
 	struct tcptimerentry *te = &tp->tentry;
 	u_int16_t index = te->index;
 	u_int16_t mode = te->mode;
-	struct tcptimerlist *listp = &tcp_timer_list;
+	struct tcptimerlist *listp = TCP_TIMERLIST(tp);
 	int32_t offset = 0;
 	boolean_t list_locked = FALSE;
 
@@ -1661,7 +1750,7 @@ tcp_sched_timers(struct tcpcb *tp)
 
 	if (!TIMER_IS_ON_LIST(tp)) {
 		if (!list_locked) {
-			lck_mtx_lock(listp->mtx);
+			tcp_timerlist_lock(listp);
 			list_locked = TRUE;
 		}
 
@@ -1682,11 +1771,11 @@ tcp_sched_timers(struct tcpcb *tp)
 	 * Timer entry is currently on the list, check if the list needs
 	 * to be rescheduled.
 	 */
-	if (need_to_resched_timerlist(te->runtime, mode)) {
+	if (need_to_resched_timerlist(listp, te->runtime, mode)) {
 		tcp_resched_timerlist++;
 	
 		if (!list_locked) {
-			lck_mtx_lock(listp->mtx);
+			tcp_timerlist_lock(listp);
 			list_locked = TRUE;
 		}
 
@@ -1735,11 +1824,11 @@ schedule:
 		listp->idleruns = 0;
 		offset = min(offset, TCP_TIMER_100MS_QUANTUM);
 	}
-	tcp_sched_timerlist(offset);
+	tcp_sched_timerlist(listp, offset);
 
 done:
 	if (list_locked)
-		lck_mtx_unlock(listp->mtx);
+		tcp_timerlist_unlock(listp);
 
 	return;
 }
@@ -1783,6 +1872,45 @@ tcp_check_timer_state(struct tcpcb *tp) {
 	return;
 }
 
+static int
+sysctl_tcp_timerlist_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct tcp_timerlist_stat stat;
+	struct tcptimerlist *listp;
+	u_int32_t i;
+	int error = 0;
+
+	if (req->newptr != USER_ADDR_NULL)
+		return (EPERM);
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		req->oldidx = tcp_ntimerlists * sizeof (stat);
+		return (0);
+	}
+
+	for (i = 0; i < tcp_ntimerlists && error == 0; i++) {
+		listp = &tcp_timer_lists[i];
+		bzero(&stat, sizeof (stat));
+
+		lck_mtx_lock(listp->mtx);
+		stat.tls_entries = listp->entries;
+		stat.tls_maxentries = listp->maxentries;
+		stat.tls_mode = listp->mode;
+		stat.tls_runs = listp->runs;
+		stat.tls_lock_acquires = listp->lock_acquires;
+		stat.tls_lock_contended = listp->lock_contended;
+		absolutetime_to_nanoseconds(listp->lock_held_total,
+		    &stat.tls_lock_held_total);
+		absolutetime_to_nanoseconds(listp->lock_held_max,
+		    &stat.tls_lock_held_max);
+		lck_mtx_unlock(listp->mtx);
+
+		error = SYSCTL_OUT(req, &stat, sizeof (stat));
+	}
+	return (error);
+}
+
 __private_extern__ void
 tcp_report_stats(void)
 {
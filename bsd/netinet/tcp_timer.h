@@ -263,8 +263,22 @@ struct tcptimerlist {
 	uint32_t idleruns;	/* Number of times the list has been idle in fast mode */
 	struct tcptimerentry *next_te;	/* next timer entry pointer to process */
 
+	/* Lock statistics; times are in mach absolute time units */
+	uint64_t lock_start;	/* when the lock was last acquired */
+	uint64_t lock_acquires;	/* number of times the lock was acquired */
+	uint64_t lock_contended; /* acquisitions that found the lock held */
+	uint64_t lock_held_total; /* total time the lock was held */
+	uint64_t lock_held_max;	/* longest time the lock was held */
+	uint64_t runs;		/* number of times the list was processed */
 };
 
+/*
+ * Connections are spread over up to TCP_TIMERLIST_MAX timer lists by a
+ * hash of their tcpcb, each with its own lock and thread call.  The
+ * default is one list per CPU; the tcp_timerlists boot-arg overrides it.
+ */
+#define TCP_TIMERLIST_MAX 16
+
 /* number of idle runs allowed for TCP timer list in fast or quick modes */
 #define TCP_FASTMODE_IDLERUN_MAX 10
 
@@ -1274,12 +1274,6 @@ skip_oinp:
 		error = EINVAL;
 		goto done;
 	}
-	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
-		/*lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(inp->inp_socket, 0);
-		lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
-		socket_lock(inp->inp_socket, 0);
-	}
 	if (inp->inp_laddr.s_addr == INADDR_ANY) {
 		inp->inp_laddr = laddr;
 		/* no reference needed */
@@ -1289,7 +1283,6 @@ skip_oinp:
 	inp->inp_faddr = sin->sin_addr;
 	inp->inp_fport = sin->sin_port;
 	in_pcbrehash(inp);
-	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 
 	if (inp->inp_flowhash == 0)
 		inp->inp_flowhash = inp_calc_flowhash(inp);
@@ -1384,12 +1377,6 @@ tcp6_connect(tp, nam, p)
 			goto done;
 		}
 	}
-	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
-		/*lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(inp->inp_socket, 0);
-		lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
-		socket_lock(inp->inp_socket, 0);
-	}
 	if (IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_laddr)) {
 		inp->in6p_laddr = addr6;
 		inp->in6p_last_outifp = outif;	/* no reference needed */
@@ -1400,7 +1387,6 @@ tcp6_connect(tp, nam, p)
 	if ((sin6->sin6_flowinfo & IPV6_FLOWINFO_MASK) != 0)
 		inp->inp_flow = sin6->sin6_flowinfo;
 	in_pcbrehash(inp);
-	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 
 	if (inp->inp_flowhash == 0)
 		inp->inp_flowhash = inp_calc_flowhash(inp);
@@ -271,7 +271,7 @@ struct tcpcb {
 #define	TF_CLOSING	0x8000000	/* pending tcp close */
 #define TF_TSO		0x10000000	/* TCP Segment Offloading is enable on this connection */
 #define TF_BLACKHOLE	0x20000000	/* Path MTU Discovery Black Hole detection */
-#define TF_TIMER_ONLIST 0x40000000	/* pcb is on tcp_timer_list */
+#define TF_TIMER_ONLIST 0x40000000	/* pcb is on a tcp timer list */
 #define TF_STRETCHACK	0x80000000	/* receiver is going to delay acks */
 
 	tcp_seq	snd_una;		/* send unacknowledged */
@@ -460,6 +460,7 @@ struct tcpcb {
 	struct bwmeas	*t_bwmeas;		/* State for bandwidth measurement */ 
 	uint32_t	t_lropktlen;		/* Bytes in a LRO frame */
 	tcp_seq		t_idleat;		/* rcv_nxt at idle time */
+	struct lro_table *t_lrotbl;		/* LRO flow table, if offloaded */
 	TAILQ_ENTRY(tcpcb) t_twentry;		/* link for time wait queue */
 	struct tcp_ccstate	*t_ccstate;	/* congestion control related state */
 /* Tail loss probe related state */
@@ -954,6 +955,43 @@ struct tcpstat_local {
 	u_int64_t synwindow;
 };
 
+#ifdef PRIVATE
+/*
+ * Software LRO statistics (net.inet.tcp.lro_stats), summed over the
+ * per-interface flow tables.  The coalescing ratio is lro_segs_in
+ * divided by lro_pkts_out.
+ */
+struct tcp_lro_stat {
+	u_int64_t	lro_segs_in;		/* segments examined */
+	u_int64_t	lro_pkts_out;		/* packets passed up to TCP */
+	u_int64_t	lro_segs_coalesced;	/* segments appended */
+	u_int64_t	lro_flush_batch;	/* flushed at end of batch */
+	u_int64_t	lro_flush_timer;	/* flushed by the timer */
+	u_int64_t	lro_flush_eject;	/* ejected by the flow */
+	u_int64_t	lro_flows_added;	/* flows entered */
+	u_int64_t	lro_flows_evicted;	/* flows evicted (table full) */
+	u_int64_t	lro_chain_max;		/* longest hash chain seen */
+	u_int32_t	lro_tables;		/* interface flow tables */
+	u_int32_t	lro_flows;		/* flow entries in all tables */
+};
+
+/*
+ * TCP timer list statistics (net.inet.tcp.timer_list_stats), one entry
+ * per timer list.  Lock hold times are in nanoseconds.
+ */
+struct tcp_timerlist_stat {
+	u_int32_t	tls_entries;		/* connections on the list */
+	u_int32_t	tls_maxentries;		/* most connections at once */
+	u_int32_t	tls_mode;		/* TCP_TIMERLIST_*_MODE */
+	u_int32_t	tls_pad;
+	u_int64_t	tls_runs;		/* times the list was run */
+	u_int64_t	tls_lock_acquires;	/* times the lock was taken */
+	u_int64_t	tls_lock_contended;	/* ... and found to be held */
+	u_int64_t	tls_lock_held_total;	/* total lock hold time */
+	u_int64_t	tls_lock_held_max;	/* longest lock hold time */
+};
+#endif /* PRIVATE */
+
 #pragma pack(4)
 
 /*
@@ -1257,6 +1295,7 @@ void	 tcp_setpersist(struct tcpcb *);
 void	 tcp_gc(struct inpcbinfo *);
 void 	 tcp_check_timer_state(struct tcpcb *tp);
 void	 tcp_run_timerlist(void *arg1, void *arg2);
+void	 tcp_timerlist_init(void);
 
 struct tcptemp *tcp_maketemplate(struct tcpcb *);
 void	 tcp_fillheaders(struct tcpcb *, void *, void *);
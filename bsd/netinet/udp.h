@@ -80,4 +80,7 @@ struct udphdr {
  * User-settable options (used with setsockopt).
  */
 #define	UDP_NOCKSUM	0x01	/* don't checksum outbound payloads */
+#ifdef PRIVATE
+#define	UDP_SEGMENT	0x02	/* split sends into datagrams of this size */
+#endif /* PRIVATE */
 #endif
@@ -73,9 +73,11 @@
 #include <sys/sysctl.h>
 #include <sys/syslog.h>
 #include <sys/mcache.h>
+#include <sys/user.h>
 #include <net/ntstat.h>
 
 #include <kern/zalloc.h>
+#include <kern/thread.h>
 #include <mach/boolean.h>
 
 #include <net/if.h>
@@ -110,6 +112,11 @@ extern int ipsec_bypass;
 extern int esp_udp_encap_port;
 #endif /* IPSEC */
 
+#if IPFIREWALL
+extern int fw_enable;		/* firewall check for packet chaining */
+extern int fw_bypass;		/* firewall check: disable packet chaining if there is rules */
+#endif /* IPFIREWALL */
+
 #if NECP
 #include <net/necp.h>
 #endif /* NECP */
@@ -187,6 +194,10 @@ SYSCTL_INT(_net_inet_udp, OID_AUTO, randomize_ports,
     CTLFLAG_RW | CTLFLAG_LOCKED, &udp_use_randomport, 0,
     "Randomize UDP port numbers");
 
+static int udp_rcv_coalesce = 1;
+SYSCTL_INT(_net_inet_udp, OID_AUTO, rcv_coalesce, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &udp_rcv_coalesce, 0, "Wake up UDP readers once per input batch");
+
 #if INET6
 struct udp_in6 {
 	struct sockaddr_in6	uin6_sin;
@@ -218,6 +229,9 @@ static void udp_append(struct inpcb *, struct ip *, struct mbuf *, int,
 static int udp_input_checksum(struct mbuf *, struct udphdr *, int, int);
 static int udp_output(struct inpcb *, struct mbuf *, struct sockaddr *,
     struct mbuf *, struct proc *);
+static int udp_segment(struct mbuf *, int);
+static int udp_send_list(struct socket *, int, struct mbuf *,
+    struct sockaddr *, struct mbuf *, struct proc *);
 static void ip_2_ip6_hdr(struct ip6_hdr *ip6, struct ip *ip);
 static void udp_gc(struct inpcbinfo *);
 
@@ -233,10 +247,13 @@ struct pr_usrreqs udp_usrreqs = {
 	.pru_disconnectx =	udp_disconnectx,
 	.pru_peeraddr =		in_getpeeraddr,
 	.pru_send =		udp_send,
+	.pru_send_list =	udp_send_list,
 	.pru_shutdown =		udp_shutdown,
 	.pru_sockaddr =		in_getsockaddr,
 	.pru_sosend =		sosend,
+	.pru_sosend_list =	sosend_list,
 	.pru_soreceive =	soreceive,
+	.pru_soreceive_list =	soreceive_list,
 };
 
 void
@@ -741,7 +758,7 @@ udp_input(struct mbuf *m, int iphlen)
 	    m, opts, NULL) == 0) {
 		udpstat.udps_fullsock++;
 	} else {
-		sorwakeup(inp->inp_socket);
+		udp_rcv_wakeup(inp);
 	}
 	udp_unlock(inp->inp_socket, 1, 0);
 	KERNEL_DEBUG(DBG_FNC_UDP_INPUT | DBG_FUNC_END, 0,0,0,0,0);
@@ -849,7 +866,7 @@ udp_append(struct inpcb *last, struct ip *ip, struct mbuf *n, int off,
 	    n, opts, NULL) == 0) {
 		udpstat.udps_fullsock++;
 	} else {
-		sorwakeup(last->inp_socket);
+		udp_rcv_wakeup(last);
 	}
 	return;
 error:
@@ -858,6 +875,72 @@ error:
 	return;
 }
 
+/*
+ * Start collecting the receive wakeups of the input batch processed by
+ * the current thread; udp_rcvbatch_end() issues them.  Batches nest,
+ * e.g. when a tunnel hands up decapsulated packets during a batch.
+ */
+void
+udp_rcvbatch_begin(struct udp_rcvbatch *urb)
+{
+	struct uthread *uth = get_bsdthread_info(current_thread());
+
+	urb->urb_count = 0;
+	urb->urb_prev = uth->uu_udp_rcvbatch;
+	uth->uu_udp_rcvbatch = urb;
+}
+
+void
+udp_rcvbatch_end(struct udp_rcvbatch *urb)
+{
+	struct uthread *uth = get_bsdthread_info(current_thread());
+	struct inpcb *inp;
+	struct socket *so;
+	u_int32_t i;
+
+	VERIFY(uth->uu_udp_rcvbatch == urb);
+	uth->uu_udp_rcvbatch = urb->urb_prev;
+
+	for (i = 0; i < urb->urb_count; i++) {
+		inp = urb->urb_inp[i];
+		so = inp->inp_socket;
+		udp_lock(so, 1, 0);
+		if (in_pcb_checkstate(inp, WNT_RELEASE, 1) != WNT_STOPUSING)
+			sorwakeup(so);
+		udp_unlock(so, 1, 0);
+	}
+}
+
+/*
+ * Wake up the reader of a locked socket that was just handed a
+ * datagram.  Within an input batch the wakeup is deferred to the end
+ * of the batch, so that a reader draining its socket with recvmsg_x()
+ * picks up all the datagrams of the batch at once.
+ */
+void
+udp_rcv_wakeup(struct inpcb *inp)
+{
+	struct uthread *uth = get_bsdthread_info(current_thread());
+	struct udp_rcvbatch *urb = uth->uu_udp_rcvbatch;
+	u_int32_t i;
+
+	if (!udp_rcv_coalesce || urb == NULL)
+		goto now;
+
+	for (i = 0; i < urb->urb_count; i++) {
+		if (urb->urb_inp[i] == inp)
+			return;
+	}
+	/* the pcb is held until the wakeup is issued */
+	if (urb->urb_count < UDP_RCVBATCH_MAX &&
+	    in_pcb_checkstate(inp, WNT_ACQUIRE, 1) != WNT_STOPUSING) {
+		urb->urb_inp[urb->urb_count++] = inp;
+		return;
+	}
+now:
+	sorwakeup(inp->inp_socket);
+}
+
 /*
  * Notify a udp user of an asynchronous error;
  * just wake up so that he can collect error status.
@@ -945,6 +1028,26 @@ udp_ctloutput(struct socket *so, struct sockopt *sopt)
 				inp->inp_flags &= ~INP_UDP_NOCKSUM;
 			break;
 
+		case UDP_SEGMENT:
+			/* This option is settable only for UDP over IPv4 */
+			if (!(inp->inp_vflag & INP_IPV4)) {
+				error = EINVAL;
+				break;
+			}
+
+			if ((error = sooptcopyin(sopt, &optval, sizeof (optval),
+			    sizeof (optval))) != 0)
+				break;
+
+			/* 0 turns segmentation off */
+			if (optval < 0 || optval > IP_MAXPACKET -
+			    (int)sizeof (struct udpiphdr)) {
+				error = EINVAL;
+				break;
+			}
+			inp->inp_udp_segsz = optval;
+			break;
+
 		case SO_FLUSH:
 			if ((error = sooptcopyin(sopt, &optval, sizeof (optval),
 			    sizeof (optval))) != 0)
@@ -965,6 +1068,10 @@ udp_ctloutput(struct socket *so, struct sockopt *sopt)
 			optval = inp->inp_flags & INP_UDP_NOCKSUM;
 			break;
 
+		case UDP_SEGMENT:
+			optval = inp->inp_udp_segsz;
+			break;
+
 		default:
 			error = ENOPROTOOPT;
 			break;
@@ -1291,12 +1398,77 @@ udp_check_pktinfo(struct mbuf *control, struct ifnet **outif,
 	return (0);
 }
 
+/*
+ * Split each datagram of the list at m into datagrams carrying at most
+ * segsz bytes of payload, in place.  On failure the list is left
+ * consistent, for the caller to free.  A datagram that gets split loses
+ * the payload sum sosend() left in it, which covers the whole send.
+ */
+static int
+udp_segment(struct mbuf *m, int segsz)
+{
+	struct mbuf *n, *nextpkt;
+
+	for (; m != NULL; m = nextpkt) {
+		nextpkt = m->m_nextpkt;
+		if (m->m_pkthdr.len > segsz &&
+		    (m->m_pkthdr.pkt_flags & PKTF_PAYLOAD_CSUM)) {
+			m->m_pkthdr.pkt_flags &= ~PKTF_PAYLOAD_CSUM;
+			m->m_pkthdr.csum_data = 0;
+		}
+		while (m->m_pkthdr.len > segsz) {
+			if ((n = m_split(m, segsz, M_DONTWAIT)) == NULL)
+				return (ENOBUFS);
+			n->m_nextpkt = nextpkt;
+			m->m_nextpkt = n;
+			m = n;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Check whether IP packets of size bytes to faddr fit the MTU of the
+ * cached route ro, so that ip_output_list() can send them as a chain
+ * without having to fragment any.  Without a usable route to faddr
+ * there is no telling, and the answer is no.
+ */
+static boolean_t
+udp_chain_fits(struct route *ro, struct in_addr faddr, int size)
+{
+	struct rtentry *rt = ro->ro_rt;
+	boolean_t fits;
+
+	if (ROUTE_UNUSABLE(ro) || ((struct sockaddr_in *)(void *)
+	    &ro->ro_dst)->sin_addr.s_addr != faddr.s_addr)
+		return (FALSE);
+
+	RT_LOCK_SPIN(rt);
+	fits = (size <= (int)(rt->rt_rmx.rmx_mtu != 0 ?
+	    rt->rt_rmx.rmx_mtu : rt->rt_ifp->if_mtu));
+	RT_UNLOCK(rt);
+
+	return (fits);
+}
+
+/*
+ * Send the datagram m, or the list of datagrams linked through
+ * m_nextpkt that sosend_list() hands down.  With UDP_SEGMENT, a send
+ * larger than the segment size is first split into a list of datagrams
+ * of that size.  A list goes down to ip_output_list() as one packet
+ * chain, sharing the route lookup and the release of the socket lock,
+ * when nothing on the way needs to see the packets one at a time and
+ * none of them needs fragmenting; otherwise the datagrams are sent
+ * one after the other.
+ */
 static int
 udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
     struct mbuf *control, struct proc *p)
 {
 	struct udpiphdr *ui;
-	int len = m->m_pkthdr.len;
+	struct mbuf *n, *nextpkt, **mp;
+	int len = 0, dlen, maxlen = 0, npkts = 0;
+	boolean_t chain;
 	struct sockaddr_in *sin;
 	struct in_addr origladdr, laddr, faddr, pi_laddr;
 	u_short lport, fport;
@@ -1313,6 +1485,11 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 	mbuf_svc_class_t msc = MBUF_SC_UNSPEC;
 	struct ifnet *origoutifp = NULL;
 	int flowadv = 0;
+	int32_t presum;
+	u_int32_t sum;
+#if NECP
+	necp_kernel_policy_id policy_id;
+#endif /* NECP */
 
 	/* Enable flow advisory only when connected */
 	flowadv = (so->so_state & SS_ISCONNECTED) ? 1 : 0;
@@ -1334,14 +1511,29 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 			ipoa.ipoa_boundif = outif->if_index;
 	}
 
+	if (inp->inp_udp_segsz != 0) {
+		if (m->m_nextpkt == NULL && m->m_pkthdr.len >
+		    inp->inp_udp_segsz * UDP_MAX_SEGMENTS) {
+			error = EMSGSIZE;
+			goto release;
+		}
+		if ((error = udp_segment(m, inp->inp_udp_segsz)) != 0)
+			goto release;
+	}
+	for (n = m; n != NULL; n = n->m_nextpkt) {
+		if (n->m_pkthdr.len + sizeof (struct udpiphdr) > IP_MAXPACKET) {
+			error = EMSGSIZE;
+			goto release;
+		}
+		len += n->m_pkthdr.len;
+		if (n->m_pkthdr.len > maxlen)
+			maxlen = n->m_pkthdr.len;
+		npkts++;
+	}
+
 	KERNEL_DEBUG(DBG_LAYER_OUT_BEG, inp->inp_fport, inp->inp_lport,
 	    inp->inp_laddr.s_addr, inp->inp_faddr.s_addr,
-	    (htons((u_short)len + sizeof (struct udphdr))));
-
-	if (len + sizeof (struct udpiphdr) > IP_MAXPACKET) {
-		error = EMSGSIZE;
-		goto release;
-	}
+	    (htons((u_short)m->m_pkthdr.len + sizeof (struct udphdr))));
 
 	if (flowadv && INP_WAIT_FOR_IF_FEEDBACK(inp)) {
 		/*
@@ -1505,81 +1697,126 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 		}
 	}
 
-#if CONFIG_MACF_NET
-	mac_mbuf_label_associate_inpcb(inp, m);
-#endif /* CONFIG_MACF_NET */
-
 	if (inp->inp_flowhash == 0)
 		inp->inp_flowhash = inp_calc_flowhash(inp);
 
-	/*
-	 * Calculate data length and get a mbuf
-	 * for UDP and IP headers.
-	 */
-	M_PREPEND(m, sizeof (struct udpiphdr), M_DONTWAIT);
-	if (m == 0) {
-		error = ENOBUFS;
+#if NECP
+	if (!necp_socket_is_allowed_to_send_recv_v4(inp, lport, fport,
+	    &laddr, &faddr, NULL, &policy_id)) {
+		error = EHOSTUNREACH;
 		goto abort;
 	}
+#endif /* NECP */
 
-	/*
-	 * Fill in mbuf with extended UDP header
-	 * and addresses and length put into network format.
-	 */
-	ui = mtod(m, struct udpiphdr *);
-	bzero(ui->ui_x1, sizeof (ui->ui_x1));	/* XXX still needed? */
-	ui->ui_pr = IPPROTO_UDP;
-	ui->ui_src = laddr;
-	ui->ui_dst = faddr;
-	ui->ui_sport = lport;
-	ui->ui_dport = fport;
-	ui->ui_ulen = htons((u_short)len + sizeof (struct udphdr));
+	for (mp = &m; *mp != NULL; mp = &n->m_nextpkt) {
+		n = *mp;
+		nextpkt = n->m_nextpkt;
+		n->m_nextpkt = NULL;
+		dlen = n->m_pkthdr.len;
+
+		/* payload sum computed by sosend(); see SOF1_PRECKSUM */
+		presum = -1;
+		if (n->m_pkthdr.pkt_flags & PKTF_PAYLOAD_CSUM) {
+			presum = n->m_pkthdr.csum_data & 0xffff;
+			n->m_pkthdr.pkt_flags &= ~PKTF_PAYLOAD_CSUM;
+			n->m_pkthdr.csum_data = 0;
+		}
 
-	/*
-	 * Set up checksum and output datagram.
-	 */
-	if (udpcksum && !(inp->inp_flags & INP_UDP_NOCKSUM)) {
-		ui->ui_sum = in_pseudo(ui->ui_src.s_addr, ui->ui_dst.s_addr,
-		    htons((u_short)len + sizeof (struct udphdr) + IPPROTO_UDP));
-		m->m_pkthdr.csum_flags = CSUM_UDP;
-		m->m_pkthdr.csum_data = offsetof(struct udphdr, uh_sum);
-	} else {
-		ui->ui_sum = 0;
-	}
-	((struct ip *)ui)->ip_len = sizeof (struct udpiphdr) + len;
-	((struct ip *)ui)->ip_ttl = inp->inp_ip_ttl;	/* XXX */
-	((struct ip *)ui)->ip_tos = inp->inp_ip_tos;	/* XXX */
-	udpstat.udps_opackets++;
+#if CONFIG_MACF_NET
+		mac_mbuf_label_associate_inpcb(inp, n);
+#endif /* CONFIG_MACF_NET */
 
-	KERNEL_DEBUG(DBG_LAYER_OUT_END, ui->ui_dport, ui->ui_sport,
-		     ui->ui_src.s_addr, ui->ui_dst.s_addr, ui->ui_ulen);
-	
-#if NECP
-	{
-		necp_kernel_policy_id policy_id;
-		if (!necp_socket_is_allowed_to_send_recv_v4(inp, lport, fport, &laddr, &faddr, NULL, &policy_id)) {
-			error = EHOSTUNREACH;
+		/*
+		 * Calculate data length and get a mbuf
+		 * for UDP and IP headers.
+		 */
+		M_PREPEND(n, sizeof (struct udpiphdr), M_DONTWAIT);
+		if (n == NULL) {
+			*mp = nextpkt;
+			error = ENOBUFS;
 			goto abort;
 		}
+		n->m_nextpkt = nextpkt;
+		*mp = n;
 
-		necp_mark_packet_from_socket(m, inp, policy_id);
-	}
+		/*
+		 * Fill in mbuf with extended UDP header
+		 * and addresses and length put into network format.
+		 */
+		ui = mtod(n, struct udpiphdr *);
+		bzero(ui->ui_x1, sizeof (ui->ui_x1));	/* XXX still needed? */
+		ui->ui_pr = IPPROTO_UDP;
+		ui->ui_src = laddr;
+		ui->ui_dst = faddr;
+		ui->ui_sport = lport;
+		ui->ui_dport = fport;
+		ui->ui_ulen = htons((u_short)dlen + sizeof (struct udphdr));
+
+		/*
+		 * Set up checksum and output datagram.
+		 */
+		if (udpcksum && !(inp->inp_flags & INP_UDP_NOCKSUM)) {
+			ui->ui_sum = in_pseudo(ui->ui_src.s_addr,
+			    ui->ui_dst.s_addr, htons((u_short)dlen +
+			    sizeof (struct udphdr) + IPPROTO_UDP));
+			if (presum != -1) {
+				/*
+				 * Only the header is left to add; finish
+				 * the checksum rather than have IP sum the
+				 * whole datagram again.
+				 */
+				sum = ui->ui_sum + ui->ui_sport +
+				    ui->ui_dport + ui->ui_ulen + presum;
+				sum = (sum >> 16) + (sum & 0xffff);
+				sum = (sum >> 16) + (sum & 0xffff);
+				ui->ui_sum = ~sum & 0xffff;
+				if (ui->ui_sum == 0)
+					ui->ui_sum = 0xffff;
+				udp_out_cksum_stats(dlen);
+			} else {
+				n->m_pkthdr.csum_flags = CSUM_UDP;
+				n->m_pkthdr.csum_data =
+				    offsetof(struct udphdr, uh_sum);
+			}
+		} else {
+			ui->ui_sum = 0;
+		}
+		((struct ip *)ui)->ip_len = sizeof (struct udpiphdr) + dlen;
+		((struct ip *)ui)->ip_ttl = inp->inp_ip_ttl;	/* XXX */
+		((struct ip *)ui)->ip_tos = inp->inp_ip_tos;	/* XXX */
+		udpstat.udps_opackets++;
+
+		KERNEL_DEBUG(DBG_LAYER_OUT_END, ui->ui_dport, ui->ui_sport,
+		    ui->ui_src.s_addr, ui->ui_dst.s_addr, ui->ui_ulen);
+
+#if NECP
+		necp_mark_packet_from_socket(n, inp, policy_id);
 #endif /* NECP */
-	
+
 #if IPSEC
-	if (inp->inp_sp != NULL && ipsec_setsocket(m, inp->inp_socket) != 0) {
-		error = ENOBUFS;
-		goto abort;
-	}
+		if (inp->inp_sp != NULL &&
+		    ipsec_setsocket(n, inp->inp_socket) != 0) {
+			error = ENOBUFS;
+			goto abort;
+		}
 #endif /* IPSEC */
 
+		set_packet_service_class(n, so, msc, 0);
+		n->m_pkthdr.pkt_flowsrc = FLOWSRC_INPCB;
+		n->m_pkthdr.pkt_flowid = inp->inp_flowhash;
+		n->m_pkthdr.pkt_proto = IPPROTO_UDP;
+		n->m_pkthdr.pkt_flags |= (PKTF_FLOW_ID | PKTF_FLOW_LOCALSRC);
+		if (flowadv)
+			n->m_pkthdr.pkt_flags |= PKTF_FLOW_ADV;
+	}
+
 	inpopts = inp->inp_options;
 	soopts |= (inp->inp_socket->so_options & (SO_DONTROUTE | SO_BROADCAST));
 	mopts = inp->inp_moptions;
 	if (mopts != NULL) {
 		IMO_LOCK(mopts);
 		IMO_ADDREF_LOCKED(mopts);
-		if (IN_MULTICAST(ntohl(ui->ui_dst.s_addr)) &&
+		if (IN_MULTICAST(ntohl(faddr.s_addr)) &&
 		    mopts->imo_multicast_ifp != NULL) {
 			/* no reference needed */
 			inp->inp_last_outifp = mopts->imo_multicast_ifp;
@@ -1590,25 +1827,50 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 	/* Copy the cached route and take an extra reference */
 	inp_route_copyout(inp, &ro);
 
-	set_packet_service_class(m, so, msc, 0);
-	m->m_pkthdr.pkt_flowsrc = FLOWSRC_INPCB;
-	m->m_pkthdr.pkt_flowid = inp->inp_flowhash;
-	m->m_pkthdr.pkt_proto = IPPROTO_UDP;
-	m->m_pkthdr.pkt_flags |= (PKTF_FLOW_ID | PKTF_FLOW_LOCALSRC);
-	if (flowadv)
-		m->m_pkthdr.pkt_flags |= PKTF_FLOW_ADV;
-
 	if (ipoa.ipoa_boundif != IFSCOPE_NONE)
 		ipoa.ipoa_flags |= IPOAF_BOUND_IF;
 
 	if (laddr.s_addr != INADDR_ANY)
 		ipoa.ipoa_flags |= IPOAF_BOUND_SRCADDR;
 
+	/*
+	 * Don't send down a chain of packets when:
+	 * - there is an IPsec rule set
+	 * - there is a non default rule set for the firewall
+	 * - a datagram is too big for the route and must be fragmented,
+	 *   which ip_output_list() cannot do within a chain
+	 */
+	chain = (npkts > 1)
+#if IPSEC
+		&& ipsec_bypass
+#endif
+#if IPFIREWALL
+		&& (fw_enable == 0 || fw_bypass)
+#endif
+		&& udp_chain_fits(&ro, faddr, maxlen +
+		    (int)sizeof (struct udpiphdr) +
+		    (inpopts != NULL ? inpopts->m_len : 0));
+
 	inp->inp_sndinprog_cnt++;
 
 	socket_unlock(so, 0);
-	error = ip_output(m, inpopts, &ro, soopts, mopts, &ipoa);
-	m = NULL;
+	if (chain) {
+		error = ip_output_list(m, npkts, inpopts, &ro, soopts, mopts,
+		    &ipoa);
+		m = NULL;
+	} else {
+		while (m != NULL && error == 0) {
+			n = m;
+			m = n->m_nextpkt;
+			n->m_nextpkt = NULL;
+			error = ip_output_list(n, 0, inpopts, &ro, soopts,
+			    mopts, &ipoa);
+		}
+		if (m != NULL) {
+			m_freem_list(m);
+			m = NULL;
+		}
+	}
 	socket_lock(so, 0);
 	if (mopts != NULL)
 		IMO_REMREF(mopts);
@@ -1623,7 +1885,7 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 		} else {
 			cell = wifi = wired = FALSE;
 		}
-		INP_ADD_STAT(inp, cell, wifi, wired, txpackets, 1);
+		INP_ADD_STAT(inp, cell, wifi, wired, txpackets, npkts);
 		INP_ADD_STAT(inp, cell, wifi, wired, txbytes, len);
 	}
 
@@ -1669,6 +1931,15 @@ abort:
 		 */
 		if (rt != NULL && (outifp = rt->rt_ifp) != inp->inp_last_outifp)
 			inp->inp_last_outifp = outifp;	/* no reference needed */
+
+		/*
+		 * Have sosend() sum the payload of the following datagrams
+		 * if this interface cannot checksum them.
+		 */
+		if (rt != NULL)
+			soprecksum(so, udpcksum &&
+			    !(inp->inp_flags & INP_UDP_NOCKSUM) &&
+			    !(rt->rt_ifp->if_hwassist & CSUM_UDP));
 	} else {
 		ROUTE_RELEASE(&inp->inp_route);
 	}
@@ -1685,7 +1956,7 @@ release:
 	KERNEL_DEBUG(DBG_FNC_UDP_OUTPUT | DBG_FUNC_END, error, 0, 0, 0, 0);
 
 	if (m != NULL)
-		m_freem(m);
+		m_freem_list(m);
 
 	if (outif != NULL)
 		ifnet_release(outif);
@@ -1985,6 +2256,33 @@ udp_send(struct socket *so, int flags, struct mbuf *m,
 	return (udp_output(inp, m, addr, control, p));
 }
 
+/*
+ * Send a list of datagrams built by sosend_list(); udp_output() takes
+ * care of lists.
+ */
+static int
+udp_send_list(struct socket *so, int flags, struct mbuf *m,
+    struct sockaddr *addr, struct mbuf *control, struct proc *p)
+{
+#pragma unused(flags)
+	struct inpcb *inp;
+
+	inp = sotoinpcb(so);
+	if (inp == NULL
+#if NECP
+		|| (necp_socket_should_use_flow_divert(inp))
+#endif /* NECP */
+		) {
+		if (m != NULL)
+			m_freem_list(m);
+		if (control != NULL)
+			m_freem(control);
+		return (inp == NULL ? EINVAL : EPROTOTYPE);
+	}
+
+	return (udp_output(inp, m, addr, control, p));
+}
+
 int
 udp_shutdown(struct socket *so)
 {
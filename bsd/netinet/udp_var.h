@@ -154,6 +154,23 @@ struct udpstat_local {
 	u_int64_t	badipsec;
 };
 
+/*
+ * Most datagrams a single send may be split into with UDP_SEGMENT.
+ */
+#define	UDP_MAX_SEGMENTS	64
+
+/*
+ * Receive wakeups deferred to the end of an input batch; a socket
+ * getting several datagrams from the same batch is woken up once.
+ */
+#define	UDP_RCVBATCH_MAX	16
+
+struct udp_rcvbatch {
+	struct udp_rcvbatch	*urb_prev;	/* enclosing batch, if any */
+	u_int32_t		urb_count;	/* # of entries in urb_inp */
+	struct inpcb		*urb_inp[UDP_RCVBATCH_MAX];
+};
+
 extern struct pr_usrreqs udp_usrreqs;
 extern struct inpcbhead udb;
 extern struct inpcbinfo udbinfo;
@@ -178,6 +195,9 @@ extern lck_mtx_t *udp_getlock(struct socket *, int);
 extern void udp_get_ports_used(u_int32_t, int, u_int32_t, bitstr_t *);
 extern uint32_t udp_count_opportunistic(unsigned int, u_int32_t);
 extern uint32_t udp_find_anypcb_byaddr(struct ifaddr *);
+extern void udp_rcvbatch_begin(struct udp_rcvbatch *);
+extern void udp_rcvbatch_end(struct udp_rcvbatch *);
+extern void udp_rcv_wakeup(struct inpcb *);
 __END_DECLS
 #endif /* BSD_KERNEL_PRIVATE */
 #endif /* _NETINET_UDP_VAR_H_ */
@@ -144,11 +144,11 @@
 /*
  * in6_pcblookup_local_and_cleanup does everything
  * in6_pcblookup_local does but it checks for a socket
- * that's going away. Since we know that the lock is
- * held read+write when this function is called, we
- * can safely dispose of this socket like the slow
- * timer would usually do and return NULL. This is
- * great for bind.
+ * that's going away.  Such a pcb is left for the slow
+ * timer to dispose of and NULL is returned, as its port
+ * is about to be released.  This is great for bind.
+ *
+ * The caller must hold the port hash lock for lport_arg.
  */
 static struct inpcb *
 in6_pcblookup_local_and_cleanup(struct inpcbinfo *pcbinfo,
@@ -160,20 +160,8 @@ in6_pcblookup_local_and_cleanup(struct inpcbinfo *pcbinfo,
 	inp = in6_pcblookup_local(pcbinfo, laddr, lport_arg, wild_okay);
 
 	/* Check if we found a match but it's waiting to be disposed */
-	if (inp != NULL && inp->inp_wantcnt == WNT_STOPUSING) {
-		struct socket *so = inp->inp_socket;
-
-		lck_mtx_lock(&inp->inpcb_mtx);
-
-		if (so->so_usecount == 0) {
-			if (inp->inp_state != INPCB_STATE_DEAD)
-				in6_pcbdetach(inp);
-			in_pcbdispose(inp);	/* will unlock & destroy */
-			inp = NULL;
-		} else {
-			lck_mtx_unlock(&inp->inpcb_mtx);
-		}
-	}
+	if (inp != NULL && inp->inp_wantcnt == WNT_STOPUSING)
+		inp = NULL;
 
 	return (inp);
 }
@@ -187,6 +175,7 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 {
 	struct socket *so = inp->inp_socket;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	lck_mtx_t *phlock = NULL;
 	u_short	lport = 0;
 	int wild = 0, reuseport = (so->so_options & SO_REUSEPORT);
 	struct ifnet *outif = NULL;
@@ -200,35 +189,24 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		return (EINVAL);
 	if (!(so->so_options & (SO_REUSEADDR|SO_REUSEPORT)))
 		wild = 1;
-	socket_unlock(so, 0); /* keep reference */
-	lck_rw_lock_exclusive(pcbinfo->ipi_lock);
 
 	bzero(&sin6, sizeof (sin6));
 	if (nam != NULL) {
-		if (nam->sa_len != sizeof (struct sockaddr_in6)) {
-			lck_rw_done(pcbinfo->ipi_lock);
-			socket_lock(so, 0);
+		if (nam->sa_len != sizeof (struct sockaddr_in6))
 			return (EINVAL);
-		}
 		/*
 		 * family check.
 		 */
-		if (nam->sa_family != AF_INET6) {
-			lck_rw_done(pcbinfo->ipi_lock);
-			socket_lock(so, 0);
+		if (nam->sa_family != AF_INET6)
 			return (EAFNOSUPPORT);
-		}
 		lport = SIN6(nam)->sin6_port;
 
 		*(&sin6) = *SIN6(nam);
 
 		/* KAME hack: embed scopeid */
 		if (in6_embedscope(&sin6.sin6_addr, &sin6, inp, NULL,
-		    NULL) != 0) {
-			lck_rw_done(pcbinfo->ipi_lock);
-			socket_lock(so, 0);
+		    NULL) != 0)
 			return (EINVAL);
-		}
 
 		/* Sanitize local copy for address searches */
                 sin6.sin6_flowinfo = 0;
@@ -250,8 +228,6 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 
 			ifa = ifa_ifwithaddr(SA(&sin6));
 			if (ifa == NULL) {
-				lck_rw_done(pcbinfo->ipi_lock);
-				socket_lock(so, 0);
 				return (EADDRNOTAVAIL);
 			} else {
 				/*
@@ -267,8 +243,6 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				    IN6_IFF_DETACHED)) {
 					IFA_UNLOCK(ifa);
 					IFA_REMREF(ifa);
-					lck_rw_done(pcbinfo->ipi_lock);
-					socket_lock(so, 0);
 					return (EADDRNOTAVAIL);
 				}
 				/*
@@ -294,12 +268,15 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				error = priv_check_cred(cred,
 				    PRIV_NETINET_RESERVEDPORT, 0);
 				kauth_cred_unref(&cred);
-				if (error != 0) {
-					lck_rw_done(pcbinfo->ipi_lock);
-					socket_lock(so, 0);
+				if (error != 0)
 					return (EACCES);
-				}
 			}
+			/*
+			 * Hold the port's hash lock until the pcb is
+			 * inserted; see in_pcbbind().
+			 */
+			phlock = INP_PORTHASHLOCK(pcbinfo, lport);
+			lck_mtx_lock(phlock);
 			if (!IN6_IS_ADDR_MULTICAST(&sin6.sin6_addr) &&
 			    (u = kauth_cred_getuid(so->so_cred)) != 0) {
 				t = in6_pcblookup_local_and_cleanup(pcbinfo,
@@ -313,8 +290,7 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				    t->inp_socket->so_cred)) &&
 				    !(t->inp_socket->so_flags &
 				    SOF_REUSESHAREUID)) {
-					lck_rw_done(pcbinfo->ipi_lock);
-					socket_lock(so, 0);
+					lck_mtx_unlock(phlock);
 					return (EADDRINUSE);
 				}
 				if (!(inp->inp_flags & IN6P_IPV6_V6ONLY) &&
@@ -333,8 +309,7 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 					    so_cred)) && (t->inp_laddr.s_addr !=
 					    INADDR_ANY || SOCK_DOM(so) ==
 					    SOCK_DOM(t->inp_socket))) {
-						lck_rw_done(pcbinfo->ipi_lock);
-						socket_lock(so, 0);
+						lck_mtx_unlock(phlock);
 						return (EADDRINUSE);
 					}
 				}
@@ -343,8 +318,7 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 			    &sin6.sin6_addr, lport, wild);
 			if (t != NULL &&
 			    (reuseport & t->inp_socket->so_options) == 0) {
-				lck_rw_done(pcbinfo->ipi_lock);
-				socket_lock(so, 0);
+				lck_mtx_unlock(phlock);
 				return (EADDRINUSE);
 			}
 			if (!(inp->inp_flags & IN6P_IPV6_V6ONLY) &&
@@ -358,21 +332,13 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 				    t->inp_socket->so_options) == 0 &&
 				    (t->inp_laddr.s_addr != INADDR_ANY ||
 				    SOCK_DOM(so) == SOCK_DOM(t->inp_socket))) {
-					lck_rw_done(pcbinfo->ipi_lock);
-					socket_lock(so, 0);
+					lck_mtx_unlock(phlock);
 					return (EADDRINUSE);
 				}
 			}
 		}
 	}
 
-	socket_lock(so, 0);
-	/* check if the socket got bound when the lock was released */
-	if (inp->inp_lport || !IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_laddr)) {
-		lck_rw_done(pcbinfo->ipi_lock);
-		return (EINVAL);
-	}
-
 	if (!IN6_IS_ADDR_UNSPECIFIED(&sin6.sin6_addr)) {
 		inp->in6p_laddr = sin6.sin6_addr;
 		inp->in6p_last_outifp = outif;
@@ -380,11 +346,10 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 
 	if (lport == 0) {
 		int e;
-		if ((e = in6_pcbsetport(&inp->in6p_laddr, inp, p, 1)) != 0) {
+		if ((e = in6_pcbsetport(&inp->in6p_laddr, inp, p)) != 0) {
 			/* Undo any address bind from above. */
 			inp->in6p_laddr = in6addr_any;
 			inp->in6p_last_outifp = NULL;	
-			lck_rw_done(pcbinfo->ipi_lock);
 			return (e);
 		}
 	} else {
@@ -393,11 +358,11 @@ in6_pcbbind(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 			inp->in6p_laddr = in6addr_any;
 			inp->inp_lport = 0;
 			inp->in6p_last_outifp = NULL;
-			lck_rw_done(pcbinfo->ipi_lock);
+			lck_mtx_unlock(phlock);
 			return (EAGAIN);
 		}
+		lck_mtx_unlock(phlock);
 	}
-	lck_rw_done(pcbinfo->ipi_lock);
 	sflt_notify(so, sock_evt_bound, NULL);
 	return (0);
 }
@@ -548,18 +513,11 @@ in6_pcbconnect(struct inpcb *inp, struct sockaddr *nam, struct proc *p)
 		inp->in6p_last_outifp = outif;	/* no reference needed */
 		inp->in6p_flags |= INP_IN6ADDR_ANY;
 	}
-	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
-		/* lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(so, 0);
-		lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
-		socket_lock(so, 0);
-	}
 	inp->in6p_faddr = sin6->sin6_addr;
 	inp->inp_fport = sin6->sin6_port;
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP)
 		nstat_pcb_invalidate_cache(inp);
 	in_pcbrehash(inp);
-	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 
 done:
 	if (outif != NULL)
@@ -573,12 +531,6 @@ in6_pcbdisconnect(struct inpcb *inp)
 {
 	struct socket *so = inp->inp_socket;
 
-	if (!lck_rw_try_lock_exclusive(inp->inp_pcbinfo->ipi_lock)) {
-		/* lock inversion issue, mostly with udp multicast packets */
-		socket_unlock(so, 0);
-		lck_rw_lock_exclusive(inp->inp_pcbinfo->ipi_lock);
-		socket_lock(so, 0);
-	}
 	if (nstat_collect && SOCK_PROTO(so) == IPPROTO_UDP)
 		nstat_pcb_cache(inp);
 	bzero((caddr_t)&inp->in6p_faddr, sizeof (inp->in6p_faddr));
@@ -586,7 +538,6 @@ in6_pcbdisconnect(struct inpcb *inp)
 	/* clear flowinfo - RFC 6437 */
 	inp->inp_flow &= ~IPV6_FLOWLABEL_MASK;
 	in_pcbrehash(inp);
-	lck_rw_done(inp->inp_pcbinfo->ipi_lock);
 	/*
 	 * A multipath subflow socket would have its SS_NOFDREF set by default,
 	 * so check for SOF_MP_SUBFLOW socket flag before detaching the PCB;
@@ -949,6 +900,8 @@ do_notify:
 
 /*
  * Lookup a PCB based on the local address and port.
+ *
+ * The caller must hold the port hash lock for lport_arg.
  */
 struct inpcb *
 in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
@@ -963,12 +916,16 @@ in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
 
 	if (!wild_okay) {
 		struct inpcbhead *head;
+		lck_mtx_t *hlock;
+		u_int32_t idx;
 		/*
 		 * Look for an unconnected (wildcard foreign addr) PCB that
 		 * matches the local address and port we're looking for.
 		 */
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
+		idx = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[idx];
+		hlock = INP_HASHLOCK(pcbinfo, idx);
+		lck_mtx_lock(hlock);
 		LIST_FOREACH(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6))
 				continue;
@@ -978,9 +935,11 @@ in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
 				/*
 				 * Found.
 				 */
+				lck_mtx_unlock(hlock);
 				return (inp);
 			}
 		}
+		lck_mtx_unlock(hlock);
 		/*
 		 * Not found.
 		 */
@@ -1097,19 +1056,23 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 {
 	struct inpcbhead *head;
 	struct inpcb *inp;
+	lck_mtx_t *hlock;
+	u_int32_t idx;
 	u_short fport = fport_arg, lport = lport_arg;
 	int found;
 
 	*uid = UID_MAX;
 	*gid = GID_MAX;
 
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
-
 	/*
-	 * First look for an exact match.
+	 * First look for an exact match, holding only the lock of the
+	 * bucket being scanned (see in_pcblookup_hash.)
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
-	    lport, fport, pcbinfo->ipi_hashmask)];
+	idx = INP_PCBHASH(faddr->s6_addr32[3] /* XXX */, lport, fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[idx];
+	hlock = INP_HASHLOCK(pcbinfo, idx);
+	lck_mtx_lock(hlock);
 	LIST_FOREACH(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6))
 			continue;
@@ -1130,15 +1093,19 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				*gid = kauth_cred_getgid(
 				    inp->inp_socket->so_cred);
 			}
-			lck_rw_done(pcbinfo->ipi_lock);
+			lck_mtx_unlock(hlock);
 			return (found);
 		}
 	}
+	lck_mtx_unlock(hlock);
+
 	if (wildcard) {
 		struct inpcb *local_wild = NULL;
 
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
+		idx = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[idx];
+		hlock = INP_HASHLOCK(pcbinfo, idx);
+		lck_mtx_lock(hlock);
 		LIST_FOREACH(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6))
 				continue;
@@ -1157,7 +1124,7 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 						*gid = kauth_cred_getgid(
 						    inp->inp_socket->so_cred);
 					}
-					lck_rw_done(pcbinfo->ipi_lock);
+					lck_mtx_unlock(hlock);
 					return (found);
 				} else if (IN6_IS_ADDR_UNSPECIFIED(
 				    &inp->in6p_laddr)) {
@@ -1172,7 +1139,7 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				*gid = kauth_cred_getgid(
 				    local_wild->inp_socket->so_cred);
 			}
-			lck_rw_done(pcbinfo->ipi_lock);
+			lck_mtx_unlock(hlock);
 			return (found);
 		}
 	}
@@ -1180,7 +1147,6 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	/*
 	 * Not found.
 	 */
-	lck_rw_done(pcbinfo->ipi_lock);
 	return (0);
 }
 
@@ -1194,15 +1160,19 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 {
 	struct inpcbhead *head;
 	struct inpcb *inp;
+	lck_mtx_t *hlock;
+	u_int32_t idx;
 	u_short fport = fport_arg, lport = lport_arg;
 
-	lck_rw_lock_shared(pcbinfo->ipi_lock);
-
 	/*
-	 * First look for an exact match.
+	 * First look for an exact match, holding only the lock of the
+	 * bucket being scanned (see in_pcblookup_hash.)
 	 */
-	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
-	    lport, fport, pcbinfo->ipi_hashmask)];
+	idx = INP_PCBHASH(faddr->s6_addr32[3] /* XXX */, lport, fport,
+	    pcbinfo->ipi_hashmask);
+	head = &pcbinfo->ipi_hashbase[idx];
+	hlock = INP_HASHLOCK(pcbinfo, idx);
+	lck_mtx_lock(hlock);
 	LIST_FOREACH(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6))
 			continue;
@@ -1219,20 +1189,24 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 			 */
 			if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) !=
 			    WNT_STOPUSING) {
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(hlock);
 				return (inp);
 			} else {
 				/* it's there but dead, say it isn't found */
-				lck_rw_done(pcbinfo->ipi_lock);
+				lck_mtx_unlock(hlock);
 				return (NULL);
 			}
 		}
 	}
+	lck_mtx_unlock(hlock);
+
 	if (wildcard) {
 		struct inpcb *local_wild = NULL;
 
-		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
-		    pcbinfo->ipi_hashmask)];
+		idx = INP_PCBHASH(INADDR_ANY, lport, 0, pcbinfo->ipi_hashmask);
+		head = &pcbinfo->ipi_hashbase[idx];
+		hlock = INP_HASHLOCK(pcbinfo, idx);
+		lck_mtx_lock(hlock);
 		LIST_FOREACH(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6))
 				continue;
@@ -1246,11 +1220,11 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				    laddr)) {
 					if (in_pcb_checkstate(inp, WNT_ACQUIRE,
 					    0) != WNT_STOPUSING) {
-						lck_rw_done(pcbinfo->ipi_lock);
+						lck_mtx_unlock(hlock);
 						return (inp);
 					} else {
 						/* dead; say it isn't found */
-						lck_rw_done(pcbinfo->ipi_lock);
+						lck_mtx_unlock(hlock);
 						return (NULL);
 					}
 				} else if (IN6_IS_ADDR_UNSPECIFIED(
@@ -1261,10 +1235,10 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 		}
 		if (local_wild && in_pcb_checkstate(local_wild,
 		    WNT_ACQUIRE, 0) != WNT_STOPUSING) {
-			lck_rw_done(pcbinfo->ipi_lock);
+			lck_mtx_unlock(hlock);
 			return (local_wild);
 		} else {
-			lck_rw_done(pcbinfo->ipi_lock);
+			lck_mtx_unlock(hlock);
 			return (NULL);
 		}
 	}
@@ -1272,7 +1246,6 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	/*
 	 * Not found.
 	 */
-	lck_rw_done(pcbinfo->ipi_lock);
 	return (NULL);
 }
 
@@ -121,7 +121,7 @@ extern int in6_mapped_sockaddr(struct socket *so, struct sockaddr **nam);
 extern int in6_mapped_peeraddr(struct socket *so, struct sockaddr **nam);
 extern int in6_selecthlim(struct in6pcb *, struct ifnet *);
 extern int in6_pcbsetport(struct in6_addr *, struct inpcb *,
-    struct proc *, int);
+    struct proc *);
 extern void init_sin6(struct sockaddr_in6 *sin6, struct mbuf *m);
 extern void in6p_route_copyout(struct inpcb *, struct route_in6 *);
 extern void in6p_route_copyin(struct inpcb *, struct route_in6 *);
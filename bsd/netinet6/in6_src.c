@@ -1261,37 +1261,15 @@ in6_selecthlim(struct in6pcb *in6p, struct ifnet *ifp)
  * share this function by all *bsd*...
  */
 int
-in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p,
-    int locked)
+in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p)
 {
 #pragma unused(laddr)
 	struct socket *so = inp->inp_socket;
-	u_int16_t lport = 0, first, last, *lastport;
+	u_int16_t lport = 0, first, last, *lastport, aport;
 	int count, error = 0, wild = 0;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	lck_mtx_t *phlock;
 	kauth_cred_t cred;
-	if (!locked) { /* Make sure we don't run into a deadlock: 4052373 */
-		if (!lck_rw_try_lock_exclusive(pcbinfo->ipi_lock)) {
-			socket_unlock(inp->inp_socket, 0);
-			lck_rw_lock_exclusive(pcbinfo->ipi_lock);
-			socket_lock(inp->inp_socket, 0);
-		}
-
-		/*
-		 * Check if a local port was assigned to the inp while
-		 * this thread was waiting for the pcbinfo lock
-		 */
-		if (inp->inp_lport != 0) {
-			VERIFY(inp->inp_flags2 & INP2_INHASHLIST);
-			lck_rw_done(pcbinfo->ipi_lock);
-
-			/*
-			 * It is not an error if another thread allocated
-			 * a port
-			 */
-			return (0);
-		}
-	}
 
 	/* XXX: this is redundant when called from in6_pcbbind */
 	if ((so->so_options & (SO_REUSEADDR|SO_REUSEPORT)) == 0)
@@ -1305,11 +1283,8 @@ in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p,
 		cred = kauth_cred_proc_ref(p);
 		error = priv_check_cred(cred, PRIV_NETINET_RESERVEDPORT, 0);
 		kauth_cred_unref(&cred);
-		if (error != 0) {
-			if (!locked)
-				lck_rw_done(pcbinfo->ipi_lock);
+		if (error != 0)
 			return (error);
-		}
 		first = ipport_lowfirstauto;	/* 1023 */
 		last  = ipport_lowlastauto;	/* 600 */
 		lastport = &pcbinfo->ipi_lastlow;
@@ -1324,6 +1299,9 @@ in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p,
 	 *
 	 * We split the two cases (up and down) so that the direction
 	 * is not being tested on each round of the loop.
+	 *
+	 * As in in_pcbbind(), *lastport is only a hint, and a candidate
+	 * port is checked and claimed under its port hash lock.
 	 */
 	if (first > last) {
 		/*
@@ -1331,7 +1309,7 @@ in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p,
 		 */
 		count = first - last;
 
-		do {
+		for (;;) {
 			if (count-- < 0) {	/* completely used? */
 				/*
 				 * Undo any address bind that may have
@@ -1339,21 +1317,25 @@ in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p,
 				 */
 				inp->in6p_laddr = in6addr_any;
 				inp->in6p_last_outifp = NULL;
-				if (!locked)
-					lck_rw_done(pcbinfo->ipi_lock);
 				return (EAGAIN);
 			}
-			--*lastport;
-			if (*lastport > first || *lastport < last)
-				*lastport = first;
-			lport = htons(*lastport);
-		} while (in6_pcblookup_local(pcbinfo, &inp->in6p_laddr, lport,
-		    wild));
+			aport = *lastport - 1;
+			if (aport > first || aport < last)
+				aport = first;
+			*lastport = aport;
+			lport = htons(aport);
+			phlock = INP_PORTHASHLOCK(pcbinfo, lport);
+			lck_mtx_lock(phlock);
+			if (in6_pcblookup_local(pcbinfo, &inp->in6p_laddr,
+			    lport, wild) == NULL)
+				break;
+			lck_mtx_unlock(phlock);
+		}
 	} else {
 		/* counting up */
 		count = last - first;
 
-		do {
+		for (;;) {
 			if (count-- < 0) {	/* completely used? */
 				/*
 				 * Undo any address bind that may have
@@ -1361,16 +1343,20 @@ in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p,
 				 */
 				inp->in6p_laddr = in6addr_any;
 				inp->in6p_last_outifp = NULL;
-				if (!locked)
-					lck_rw_done(pcbinfo->ipi_lock);
 				return (EAGAIN);
 			}
-			++*lastport;
-			if (*lastport < first || *lastport > last)
-				*lastport = first;
-			lport = htons(*lastport);
-		} while (in6_pcblookup_local(pcbinfo, &inp->in6p_laddr, lport,
-		    wild));
+			aport = *lastport + 1;
+			if (aport < first || aport > last)
+				aport = first;
+			*lastport = aport;
+			lport = htons(aport);
+			phlock = INP_PORTHASHLOCK(pcbinfo, lport);
+			lck_mtx_lock(phlock);
+			if (in6_pcblookup_local(pcbinfo, &inp->in6p_laddr,
+			    lport, wild) == NULL)
+				break;
+			lck_mtx_unlock(phlock);
+		}
 	}
 
 	inp->inp_lport = lport;
@@ -1382,13 +1368,11 @@ in6_pcbsetport(struct in6_addr *laddr, struct inpcb *inp, struct proc *p,
 
 		inp->inp_lport = 0;
 		inp->inp_flags &= ~INP_ANONPORT;
-		if (!locked)
-			lck_rw_done(pcbinfo->ipi_lock);
+		lck_mtx_unlock(phlock);
 		return (EAGAIN);
 	}
 
-	if (!locked)
-		lck_rw_done(pcbinfo->ipi_lock);
+	lck_mtx_unlock(phlock);
 	return (0);
 }
 
@@ -138,6 +138,11 @@
 #include <netinet6/nd6.h>
 #include <netinet6/scope6_var.h>
 #include <netinet6/ip6protosw.h>
+#if INET
+#include <netinet/udp.h>
+#include <netinet/udp_var.h>
+#include <netinet/lro_ext.h>
+#endif /* INET */
 
 #if IPSEC
 #include <netinet6/ipsec.h>
@@ -260,10 +265,30 @@ SYSCTL_UINT(_net_inet6_ip6, OID_AUTO, adj_clear_hwcksum,
 #endif /* !__i386__ && !__x86_64__ */
 
 static void
-ip6_proto_input(protocol_family_t protocol, mbuf_t packet)
+ip6_proto_input(protocol_family_t protocol, mbuf_t packet_list)
 {
 #pragma unused(protocol)
-	ip6_input(packet);
+	mbuf_t packet;
+#if INET
+	struct udp_rcvbatch urb;
+	/* DLIL hands up one interface's packets per list */
+	struct ifnet *ifp = (packet_list != NULL) ?
+	    packet_list->m_pkthdr.rcvif : NULL;
+
+	udp_rcvbatch_begin(&urb);
+#endif /* INET */
+	for (packet = packet_list; packet != NULL; packet = packet_list) {
+		packet_list = mbuf_nextpkt(packet);
+		mbuf_setnextpkt(packet, NULL);
+		ip6_input(packet);
+	}
+
+#if INET
+	/* deliver what LRO coalesced from this batch */
+	if (sw_lro)
+		tcp_lro_flush(ifp);
+	udp_rcvbatch_end(&urb);
+#endif /* INET */
 }
 
 /*
@@ -416,7 +441,7 @@ ip6_init(struct ip6protosw *pp, struct domain *dp)
 	net_init_add(ip6_init_delayed);
 
 	unguard = domain_unguard_deploy();
-	i = proto_register_input(PF_INET6, ip6_proto_input, NULL, 0);
+	i = proto_register_input(PF_INET6, ip6_proto_input, NULL, 1);
 	if (i != 0) {
 		panic("%s: failed to register PF_INET6 protocol: %d\n",
 		    __func__, i);
@@ -1168,6 +1193,15 @@ injectit:
 		    struct ip6_hdr *, ip6, struct ifnet *, inifp,
 		    struct ip *, NULL, struct ip6_hdr *, ip6);
 
+#if INET
+		/* coalesce TCP segments that carry no extension headers */
+		if (sw_lro && nxt == IPPROTO_TCP &&
+		    off == sizeof (struct ip6_hdr)) {
+			if ((m = tcp_lro6(m, off)) == NULL)
+				goto done;
+		}
+#endif /* INET */
+
 		if ((pr_input = ip6_protox[nxt]->pr_input) == NULL) {
 			m_freem(m);
 			m = NULL;
@@ -262,7 +262,7 @@ udp6_output(struct in6pcb *in6p, struct mbuf *m, struct sockaddr *addr6,
 			goto release;
 		}
 		if (in6p->in6p_lport == 0 &&
-		    (error = in6_pcbsetport(laddr, in6p, p, 0)) != 0)
+		    (error = in6_pcbsetport(laddr, in6p, p)) != 0)
 			goto release;
 	} else {
 		if (IN6_IS_ADDR_UNSPECIFIED(&in6p->in6p_faddr)) {
@@ -343,6 +343,8 @@ udp6_output(struct in6pcb *in6p, struct mbuf *m, struct sockaddr *addr6,
 		    htonl(plen + IPPROTO_UDP));
 		m->m_pkthdr.csum_flags = CSUM_UDPIPV6;
 		m->m_pkthdr.csum_data = offsetof(struct udphdr, uh_sum);
+		/* a payload sum from sosend() is only used for IPv4 */
+		m->m_pkthdr.pkt_flags &= ~PKTF_PAYLOAD_CSUM;
 
 		if (!IN6_IS_ADDR_UNSPECIFIED(laddr))
 			ip6oa.ip6oa_flags |= IP6OAF_BOUND_SRCADDR;
@@ -193,6 +193,7 @@ struct pr_usrreqs udp6_usrreqs = {
 	.pru_sockaddr =		in6_mapped_sockaddr,
 	.pru_sosend =		sosend,
 	.pru_soreceive =	soreceive,
+	.pru_soreceive_list =	soreceive_list,
 };
 
 /*
@@ -235,7 +236,7 @@ udp6_append(struct inpcb *last, struct ip6_hdr *ip6,
 	    (struct sockaddr *)udp_in6, n, opts, NULL) == 0)
 		udpstat.udps_fullsock++;
 	else
-		sorwakeup(last->in6p_socket);
+		udp_rcv_wakeup(last);
 }
 
 int
@@ -560,7 +561,7 @@ udp6_input(struct mbuf **mp, int *offp, int proto)
 		udp_unlock(in6p->in6p_socket, 1, 0);
 		goto bad;
 	}
-	sorwakeup(in6p->in6p_socket);
+	udp_rcv_wakeup(in6p);
 	udp_unlock(in6p->in6p_socket, 1, 0);
 	return (IPPROTO_DONE);
 bad:
@@ -101,13 +101,15 @@ struct buf {
 	TAILQ_ENTRY(buf) b_freelist;	/* Free list position if not active. */
 	int	b_timestamp;		/* timestamp for queuing operation */
 	int	b_whichq;		/* the free list the buffer belongs to */
+	int	b_whichcpu;		/* and its CPU, for the per-CPU lists */
 	volatile uint32_t	b_flags;	/* B_* flags. */
-	volatile uint32_t	b_lflags;	/* BL_BUSY | BL_WANTED flags... protected by buf_mtx */
+	volatile uint32_t	b_lflags;	/* BL_BUSY | BL_WANTED flags... protected by the hash bucket lock */
 	int	b_error;		/* errno value. */
 	int	b_bufsize;		/* Allocated buffer size. */
 	int	b_bcount;		/* Valid bytes in buffer. */
 	int	b_resid;		/* Remaining I/O. */
 	dev_t	b_dev;			/* Device associated with buffer. */
+	uint32_t	b_hashval;	/* hash of (b_vp, b_lblkno) when hashed */
 	uintptr_t	b_datap;	/* Memory, superblocks, indirect etc.*/
 	daddr64_t	b_lblkno;	/* Logical block number. */
 	daddr64_t	b_blkno;	/* Underlying physical block number. */
@@ -162,7 +164,8 @@ extern vm_offset_t buf_kernel_addrperm;
 
 /*
  * These flags are kept in b_lflags...
- * buf_mtxp must be held before examining/updating
+ * the lock of the buffer's hash bucket must be held before
+ * examining/updating them; see vfs_bio.c for unhashed buffers
  */
 #define	BL_BUSY		0x00000001	/* I/O in progress. */
 #define	BL_WANTED	0x00000002	/* Process wants this buffer. */
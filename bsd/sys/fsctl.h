@@ -284,8 +284,23 @@ typedef struct package_ext_info {
 /* 14 was used for NAMESPACE_HANDLER_GETDATA which has now been
    removed as it is no longer used. */
 
+/*
+ * Cluster read ahead statistics for the volume, since it was mounted.
+ */
+typedef struct fsctl_readahead_stats {
+	uint64_t	ra_pages;	/* pages read ahead */
+	uint64_t	ra_hits;	/* read ahead pages that were then read */
+	uint64_t	ra_waste;	/* read ahead pages dropped unread */
+	uint64_t	ra_streams;	/* sequential or strided read streams detected */
+	uint32_t	ra_latency;	/* average time a read waited for I/O, usecs */
+	uint32_t	ra_reserved;
+} fsctl_readahead_stats_t;
+
+#define FSIOC_READAHEAD_STATS			  _IOR('A', 15, struct fsctl_readahead_stats)
+#define	FSCTL_READAHEAD_STATS			  IOCBASECMD(FSIOC_READAHEAD_STATS)
+
 //
-// IO commands 15, 16, and 17 are currently unused
+// IO commands 16 and 17 are currently unused
 //
 
 //
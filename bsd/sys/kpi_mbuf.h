@@ -1628,6 +1628,20 @@ extern errno_t mbuf_pkthdr_aux_flags(mbuf_t mbuf,
 */
 extern errno_t mbuf_get_driver_scratch(mbuf_t m, u_int8_t **area,
     size_t *area_ln);
+
+/*
+	@function mbuf_pkthdr_set_flowhash
+	@discussion Records the flow hash computed by the hardware (e.g.
+		the Toeplitz hash of a multi-queue NIC) for a received
+		packet.  When receive-side steering is enabled, ifnet_input()
+		uses it to pick the input thread for the packet instead of
+		hashing the packet headers.  Packets of the same flow must
+		be given the same hash.
+	@param mbuf The mbuf containing the packet header.
+	@param flowhash The non-zero flow hash.
+	@result 0 upon success otherwise the errno error.
+*/
+extern errno_t mbuf_pkthdr_set_flowhash(mbuf_t mbuf, u_int32_t flowhash);
 #endif /* KERNEL_PRIVATE */
 
 #ifdef XNU_KERNEL_PRIVATE
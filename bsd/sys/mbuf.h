@@ -436,6 +436,7 @@ struct	pkthdr {
 #define	PKTF_FORWARDED		0x10000	/* pkt was forwarded from another i/f */
 #define	PKTF_PRIV_GUARDED	0x20000	/* pkt_mpriv area guard enabled */
 #define	PKTF_KEEPALIVE		0x40000	/* pkt is kernel-generated keepalive */
+#define	PKTF_PAYLOAD_CSUM	0x80000	/* csum_data has sum of payload */
 /* flags related to flow control/advisory and identification */
 #define	PKTF_FLOW_MASK	\
 	(PKTF_FLOW_ID | PKTF_FLOW_ADV | PKTF_FLOW_LOCALSRC | PKTF_FLOW_RAWSOCK)
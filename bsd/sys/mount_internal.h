@@ -137,6 +137,12 @@ struct mount {
 	pending_io_t	mnt_pending_read_size  __attribute__((aligned(sizeof(pending_io_t))));	/* byte count of pending reads */
 	struct timeval	mnt_last_write_issued_timestamp;
 	struct timeval	mnt_last_write_completed_timestamp;
+	/* cluster read ahead statistics, see FSCTL_READAHEAD_STATS */
+	uint64_t	mnt_ra_pages __attribute__((aligned(sizeof(uint64_t))));	/* pages read ahead */
+	uint64_t	mnt_ra_hits;		/* read ahead pages that were then read */
+	uint64_t	mnt_ra_waste;		/* read ahead pages dropped unread */
+	uint64_t	mnt_ra_streams;		/* read streams detected */
+	uint32_t	mnt_ra_latency;		/* average read wait for I/O, usecs */
 	
 	lck_rw_t	mnt_rwlock;		/* mutex readwrite lock */
 	lck_mtx_t	mnt_renamelock;		/* mutex that serializes renames that change shape of tree */
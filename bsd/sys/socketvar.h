@@ -323,6 +323,7 @@ struct socket {
 #define	SOF1_AWDL_PRIVILEGED	0x00000002
 #define	SOF1_IF_2KCL		0x00000004 /* interface prefers 2 KB clusters */
 #define	SOF1_DEFUNCTINPROG	0x00000008
+#define	SOF1_PRECKSUM		0x00000010 /* sum payload in sosend() */
 };
 
 /* Control message accessor in mbufs */
@@ -790,6 +791,7 @@ extern void soreference(struct socket *so);
 extern void sodereference(struct socket *so);
 extern void somultipages(struct socket *, boolean_t);
 extern void soif2kcl(struct socket *, boolean_t);
+extern void soprecksum(struct socket *, boolean_t);
 extern int sosetdefunct(struct proc *, struct socket *, int level, boolean_t);
 extern int sodefunct(struct proc *, struct socket *, int level);
 extern void sohasoutofband(struct socket *so);
@@ -77,11 +77,29 @@ struct cl_wextent {
         int		io_flags;
 };
 
-struct cl_readahead {
-	lck_mtx_t	cl_lockr;
+/*
+ * Maximum number of concurrent sequential or strided
+ * read streams tracked per vnode
+ */
+#define CL_RASTREAMS	8
+
+struct cl_rastream {
+	daddr64_t	cl_firstr;			/* first block of the last read by client */
 	daddr64_t	cl_lastr;			/* last block read by client */
 	daddr64_t	cl_maxra;			/* last block prefetched by the read ahead */
 	int		cl_ralen;			/* length of last prefetch */
+	int		cl_rawin;			/* current limit on cl_ralen, in pages */
+	int		cl_stride;			/* blocks between strided reads, 0 if sequential */
+	int		cl_strideseq;			/* reads in a row cl_stride apart, up to 2 */
+	int		cl_pending;			/* pages prefetched but not yet read */
+	int		cl_busy;			/* a reader owns this stream */
+	uint32_t	cl_lastuse;			/* cl_clock at the last read */
+};
+
+struct cl_readahead {
+	lck_mtx_t	cl_lockr;			/* protects stream ownership */
+	uint32_t	cl_clock;
+	struct cl_rastream cl_streams[CL_RASTREAMS];
 };
 
 struct cl_writebehind {
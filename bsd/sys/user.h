@@ -222,6 +222,7 @@ struct uthread {
 	boolean_t	uu_throttle_bc;
 
 	u_int32_t	uu_network_marks;	/* network control flow marks */
+	void	*	uu_udp_rcvbatch;	/* UDP input batch in progress */
 
 	struct kern_sigaltstack uu_sigstk;
         vnode_t		uu_vreclaims;
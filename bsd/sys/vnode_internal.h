@@ -491,6 +491,7 @@ const char *cache_enter_create(vnode_t dvp, vnode_t vp, struct componentname *cn
 
 int vn_pathconf(vnode_t, int, int32_t *, vfs_context_t);
 extern int nc_disabled; 	
+extern int nc_lockless;
 
 #define	vnode_lock_convert(v)	lck_mtx_convert_spin(&(v)->v_lock)
 
@@ -108,16 +108,28 @@
 #include <libkern/OSAtomic.h>
 #include <libkern/OSDebug.h>
 #include <sys/ubc_internal.h>
+#include <sys/mcache.h>
+#include <kern/cpu_number.h>
+#include <machine/machine_routines.h>
 
 #include <sys/sdt.h>
 #include <sys/cprotect.h>
 
-int	bcleanbuf(buf_t bp, boolean_t discard);
+struct bufhashbucket;
+struct bufqueue;
+
+int	bcleanbuf(buf_t bp, struct bufhashbucket *bhb, boolean_t discard);
 static int	brecover_data(buf_t bp);
 static boolean_t incore(vnode_t vp, daddr64_t blkno);
 /* timeout is in msecs */
 static buf_t	getnewbuf(int slpflag, int slptimeo, int *queue);
 static void	bremfree_locked(buf_t bp);
+static void	bufq_remove(struct bufqueue *bq, buf_t bp);
+static void	binsfree(buf_t bp, int whichq, boolean_t athead);
+static buf_t	bufq_take(int whichq, int cpu, struct bufhashbucket **bhbp);
+static boolean_t bufq_peek(int whichq, int cpu, int *qcpu, int *timestamp);
+static boolean_t bufq_empty(void);
+static void	buf_wakeup_needbuffer(void);
 static void	buf_reassign(buf_t bp, vnode_t newvp);
 static errno_t	buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo);
 static int	buf_iterprepare(vnode_t vp, struct buflists *, int flags);
@@ -143,11 +155,61 @@ static int	buf_hdr_count;
 
 /*
  * Definitions for the buffer hash lists.
+ *
+ * Every bucket has its own lock.  It protects the chain and the BL_*
+ * flags of the buffers on it, and a thread waiting for a hashed buffer
+ * sleeps on it.  Buffers are only added to or removed from the hash with
+ * buf_mtxp held as well, so code holding buf_mtxp sees a stable hash; the
+ * b_lflags of a buffer that isn't hashed are protected by buf_mtxp.  The
+ * lock order is buf_mtxp, then a bucket lock, then a free list lock, and
+ * no more than one bucket lock is held at a time.
+ *
+ * The table grows with the number of buffers in it.  The larger table is
+ * allocated with no locks held, and threads inserting buffers then move
+ * the chains over a few buckets at a time.  A bucket whose chain has been
+ * moved is marked, so a lookup that lands on it follows bht_next to the
+ * new table; old tables stay around for such lookups and are never freed.
  */
-#define	BUFHASH(dvp, lbn)	\
-	(&bufhashtbl[((long)(dvp) / sizeof(*(dvp)) + (int)(lbn)) & bufhash])
-LIST_HEAD(bufhashhdr, buf) *bufhashtbl, invalhash;
-u_long	bufhash;
+#define	BUFHASHVAL(dvp, lbn)	\
+	((uint32_t)((uintptr_t)(dvp) / sizeof(*(dvp)) + (int)(lbn)))
+
+LIST_HEAD(bufhashhdr, buf);
+
+struct bufhashbucket {
+	struct bufhashhdr	bhb_head;
+	lck_mtx_t		bhb_lock;
+	int			bhb_moved;	/* the chain is in the next table */
+};
+
+struct bufhashtbl {
+	struct bufhashbucket	*bht_buckets;
+	uint32_t		bht_mask;
+	uint32_t		bht_moved;	/* buckets moved to bht_next */
+	struct bufhashtbl	*bht_next;	/* the table we're growing into */
+};
+
+static struct bufhashtbl * volatile bufhashtbl;
+static uint32_t	bufhash_count;		/* buffers in the hash */
+static int	bufhash_growing;	/* allocating a larger table */
+
+#define	BUFHASH_LOAD	2	/* grow past this many buffers per bucket */
+#define	BUFHASH_MOVE	8	/* buckets moved per insertion while growing */
+
+#define	BUF_ISHASHED(bp)						\
+	((bp)->b_hash.le_prev != NULL &&				\
+	 (bp)->b_hash.le_prev != (struct buf **)0xdeadbeef)
+
+#define	bufhash_unlock(bhb)	lck_mtx_unlock(&(bhb)->bhb_lock)
+
+static struct bufhashtbl *bufhash_alloc(uint32_t nbuckets);
+static struct bufhashbucket *bufhash_lock(uint32_t hashval);
+static boolean_t bufhash_trylock(uint32_t hashval, struct bufhashbucket **bhbp);
+static struct bufhashbucket *buf_hash_lock(buf_t bp);
+static boolean_t buf_hash_trylock(buf_t bp, struct bufhashbucket **bhbp);
+static struct bufhashbucket *buf_lock_owned(buf_t bp);
+static void	buf_unlock_owned(struct bufhashbucket *bhb);
+static void	bufhash_move(void);
+static void	bufhash_grow(void);
 
 static buf_t	incore_locked(vnode_t vp, daddr64_t blkno, struct bufhashhdr *dp);
 
@@ -162,7 +224,6 @@ static int boot_nbuf_headers = 0;
 static TAILQ_HEAD(delayqueue, buf) delaybufqueue;
 
 static TAILQ_HEAD(ioqueue, buf) iobufqueue;
-static TAILQ_HEAD(bqueues, buf) bufqueues[BQUEUES];
 static int needbuffer;
 static int need_iobuffer;
 
@@ -174,6 +235,40 @@ static lck_mtx_t	*buf_mtxp;
 
 static int buf_busycount;
 
+/*
+ * Definitions for the buffer free lists.
+ *
+ * BQ_EMPTY, BQ_AGE and BQ_LRU are kept per CPU: a buffer goes back on
+ * the lists of the CPU that releases it, and getnewbuf() reclaims from
+ * its own CPU's lists before it looks at the others'.  BQ_LOCKED, BQ_META
+ * and BQ_LAUNDRY are global.  Each list has its own lock.
+ *
+ * A buffer on a free list is never BL_BUSY.  A hashed buffer is taken off
+ * its list and made busy under its bucket lock, so code walking a free
+ * list can only try for the bucket lock of a buffer it wants.  Buffers
+ * on BQ_EMPTY aren't hashed and are taken with buf_mtxp held.
+ */
+TAILQ_HEAD(bqueues, buf);
+
+struct bufqueue {
+	struct bqueues	bq_head;
+	lck_mtx_t	bq_lock;
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE)));
+
+#define	BQ_PERCPU(q)	((q) == BQ_EMPTY || (q) == BQ_AGE || (q) == BQ_LRU)
+
+static struct bufqueue	bufqueues[BQUEUES];	/* the global lists */
+static struct bufqueue	*bufqueues_cpu;		/* BQUEUES per CPU */
+static unsigned int	bufq_ncpus;
+
+static __inline__ struct bufqueue *
+bufqueue(int whichq, int cpu)
+{
+	if (BQ_PERCPU(whichq))
+		return (&bufqueues_cpu[cpu * BQUEUES + whichq]);
+	return (&bufqueues[whichq]);
+}
+
 static __inline__ int
 buf_timestamp(void)
 {
@@ -183,16 +278,12 @@ buf_timestamp(void)
 }
 
 /*
- * Insq/Remq for the buffer free lists.
+ * Insq/Remq for the io buffer list.
  */
 #define	binsheadfree(bp, dp, whichq)	do { \
 				    TAILQ_INSERT_HEAD(dp, bp, b_freelist); \
 				} while (0)
 
-#define	binstailfree(bp, dp, whichq)	do { \
-				    TAILQ_INSERT_TAIL(dp, bp, b_freelist); \
-				} while (0)
-
 #define BHASHENTCHECK(bp)	\
 	if ((bp)->b_hash.le_prev != (struct buf **)0xdeadbeef)	\
 		panic("%p: b_hash.le_prev is not deadbeef", (bp));
@@ -236,8 +327,11 @@ blistenterhead(struct bufhashhdr * head, buf_t bp)
 		panic("blistenterhead: le_prev is deadbeef");
 }
 
+/*
+ * buf_mtxp and the bucket lock held.
+ */
 static __inline__ void 
-binshash(buf_t bp, struct bufhashhdr *dp)
+binshash(buf_t bp, struct bufhashbucket *bhb, uint32_t hashval)
 {
 #if DIAGNOSTIC
 	buf_t	nbp;
@@ -246,16 +340,21 @@ binshash(buf_t bp, struct bufhashhdr *dp)
 	BHASHENTCHECK(bp);
 
 #if DIAGNOSTIC
-	nbp = dp->lh_first;
+	nbp = bhb->bhb_head.lh_first;
 	for(; nbp != NULL; nbp = nbp->b_hash.le_next) {
 		if(nbp == bp) 
 			panic("buf already in hashlist");
 	}
 #endif /* DIAGNOSTIC */
 
-	blistenterhead(dp, bp);
+	bp->b_hashval = hashval;
+	blistenterhead(&bhb->bhb_head, bp);
+	bufhash_count++;
 }
 
+/*
+ * buf_mtxp and the bucket lock held.
+ */
 static __inline__ void 
 bremhash(buf_t	bp) 
 {
@@ -267,18 +366,352 @@ bremhash(buf_t	bp)
 	if (bp->b_hash.le_next != NULL)
 		bp->b_hash.le_next->b_hash.le_prev = bp->b_hash.le_prev;
 	*bp->b_hash.le_prev = (bp)->b_hash.le_next;
+	bufhash_count--;
 }
 
 /*
- * buf_mtxp held.
+ * Allocate a hash table of nbuckets, a power of 2.
+ */
+static struct bufhashtbl *
+bufhash_alloc(uint32_t nbuckets)
+{
+	struct bufhashtbl *ht;
+	uint32_t i;
+
+	MALLOC(ht, struct bufhashtbl *, sizeof(*ht), M_CACHE, M_WAITOK | M_ZERO);
+	if (ht != NULL)
+		MALLOC(ht->bht_buckets, struct bufhashbucket *,
+		    nbuckets * sizeof(struct bufhashbucket), M_CACHE, M_WAITOK | M_ZERO);
+	if (ht == NULL || ht->bht_buckets == NULL)
+		panic("bufhash_alloc: no memory for %u buckets", nbuckets);
+
+	for (i = 0; i < nbuckets; i++) {
+		LIST_INIT(&ht->bht_buckets[i].bhb_head);
+		lck_mtx_init(&ht->bht_buckets[i].bhb_lock, buf_mtx_grp, buf_mtx_attr);
+	}
+	ht->bht_mask = nbuckets - 1;
+
+	return (ht);
+}
+
+/*
+ * Lock and return the bucket that holds the chain for hashval.
+ */
+static struct bufhashbucket *
+bufhash_lock(uint32_t hashval)
+{
+	struct bufhashtbl *ht;
+	struct bufhashbucket *bhb;
+
+	for (ht = bufhashtbl; ; ht = ht->bht_next) {
+		bhb = &ht->bht_buckets[hashval & ht->bht_mask];
+
+		lck_mtx_lock_spin(&bhb->bhb_lock);
+		if (!bhb->bhb_moved)
+			return (bhb);
+		lck_mtx_unlock(&bhb->bhb_lock);
+	}
+}
+
+static boolean_t
+bufhash_trylock(uint32_t hashval, struct bufhashbucket **bhbp)
+{
+	struct bufhashtbl *ht;
+	struct bufhashbucket *bhb;
+
+	for (ht = bufhashtbl; ; ht = ht->bht_next) {
+		bhb = &ht->bht_buckets[hashval & ht->bht_mask];
+
+		if (!lck_mtx_try_lock_spin(&bhb->bhb_lock))
+			return (FALSE);
+		if (!bhb->bhb_moved) {
+			*bhbp = bhb;
+			return (TRUE);
+		}
+		lck_mtx_unlock(&bhb->bhb_lock);
+	}
+}
+
+/*
+ * Lock the bucket of bp, which the caller owns or holds buf_mtxp for,
+ * so it can't be hashed or unhashed under us.  Returns NULL if bp
+ * isn't hashed.
+ */
+static struct bufhashbucket *
+buf_hash_lock(buf_t bp)
+{
+	if (!BUF_ISHASHED(bp))
+		return (NULL);
+	return (bufhash_lock(bp->b_hashval));
+}
+
+/*
+ * The same for a buffer seen on a free list whose lock we hold:
+ * the bucket lock comes first in the lock order, so only try for it.
+ */
+static boolean_t
+buf_hash_trylock(buf_t bp, struct bufhashbucket **bhbp)
+{
+	*bhbp = NULL;
+
+	if (!BUF_ISHASHED(bp))
+		return (TRUE);
+	return (bufhash_trylock(bp->b_hashval, bhbp));
+}
+
+/*
+ * Lock the b_lflags of bp, which we own, without holding buf_mtxp:
+ * take its bucket lock if it's hashed and buf_mtxp if it isn't.
+ */
+static struct bufhashbucket *
+buf_lock_owned(buf_t bp)
+{
+	struct bufhashbucket *bhb;
+
+	if ((bhb = buf_hash_lock(bp)) == NULL)
+		lck_mtx_lock_spin(buf_mtxp);
+	return (bhb);
+}
+
+static void
+buf_unlock_owned(struct bufhashbucket *bhb)
+{
+	if (bhb != NULL)
+		bufhash_unlock(bhb);
+	else
+		lck_mtx_unlock(buf_mtxp);
+}
+
+/*
+ * Move a few more chains to the table we're growing into, and switch
+ * to it once they have all been moved.  Nothing can reach the new
+ * buckets of a chain until its old bucket is marked, so they are filled
+ * under the old bucket lock alone.
+ *
+ * buf_mtxp held, and no bucket lock.
+ */
+static void
+bufhash_move(void)
+{
+	struct bufhashtbl *ht = bufhashtbl;
+	struct bufhashtbl *nht = ht->bht_next;
+	struct bufhashbucket *bhb;
+	buf_t	bp;
+	int	n;
+
+	if (nht == NULL)
+		return;
+
+	for (n = 0; n < BUFHASH_MOVE && ht->bht_moved <= ht->bht_mask; n++) {
+		bhb = &ht->bht_buckets[ht->bht_moved++];
+
+		lck_mtx_lock_spin(&bhb->bhb_lock);
+
+		while ((bp = bhb->bhb_head.lh_first) != NULL) {
+			bhb->bhb_head.lh_first = bp->b_hash.le_next;
+			blistenterhead(&nht->bht_buckets[bp->b_hashval & nht->bht_mask].bhb_head, bp);
+		}
+		bhb->bhb_moved = 1;
+
+		lck_mtx_unlock(&bhb->bhb_lock);
+	}
+	if (ht->bht_moved > ht->bht_mask)
+		bufhashtbl = nht;
+}
+
+/*
+ * Start growing the hash if the chains have become long.  The new
+ * table is allocated here, so no locks may be held.
+ */
+static void
+bufhash_grow(void)
+{
+	struct bufhashtbl *ht;
+	struct bufhashtbl *nht;
+	uint32_t nbuckets;
+
+	lck_mtx_lock_spin(buf_mtxp);
+
+	ht = bufhashtbl;
+	if (bufhash_growing || ht->bht_next != NULL ||
+	    bufhash_count <= BUFHASH_LOAD * (ht->bht_mask + 1)) {
+		lck_mtx_unlock(buf_mtxp);
+		return;
+	}
+	nbuckets = 2 * (ht->bht_mask + 1);
+	bufhash_growing = 1;
+
+	lck_mtx_unlock(buf_mtxp);
+
+	nht = bufhash_alloc(nbuckets);
+
+	lck_mtx_lock_spin(buf_mtxp);
+
+	ht->bht_next = nht;
+	bufhash_growing = 0;
+
+	lck_mtx_unlock(buf_mtxp);
+}
+
+/*
+ * Put bp on free list whichq, of this CPU if the list is per CPU.
+ * The caller holds the bucket lock of bp, or buf_mtxp if bp isn't
+ * hashed.
+ */
+static void
+binsfree(buf_t bp, int whichq, boolean_t athead)
+{
+	struct bufqueue *bq;
+	int	cpu = 0;
+
+	if (BQ_PERCPU(whichq))
+		cpu = cpu_number();
+	bq = bufqueue(whichq, cpu);
+
+	lck_mtx_lock_spin(&bq->bq_lock);
+
+	bp->b_whichq = whichq;
+	bp->b_whichcpu = cpu;
+	if (athead)
+		TAILQ_INSERT_HEAD(&bq->bq_head, bp, b_freelist);
+	else
+		TAILQ_INSERT_TAIL(&bq->bq_head, bp, b_freelist);
+
+	if (whichq == BQ_LAUNDRY)
+		blaundrycnt++;
+
+	lck_mtx_unlock(&bq->bq_lock);
+}
+
+/*
+ * buf_mtxp and the bucket lock held.
  */
 static __inline__ void
 bmovelaundry(buf_t bp)
 {
-	bp->b_whichq = BQ_LAUNDRY;
 	bp->b_timestamp = buf_timestamp();
-	binstailfree(bp, &bufqueues[BQ_LAUNDRY], BQ_LAUNDRY);
-	blaundrycnt++;
+	binsfree(bp, BQ_LAUNDRY, FALSE);
+}
+
+/*
+ * Take the first buffer we can lock off free list whichq, looking at
+ * the lists of the other CPUs after cpu's for a per-CPU list.  Returns
+ * it off the list with its bucket lock held in *bhbp, which is NULL if
+ * the buffer isn't hashed, or NULL if there was nothing to take.
+ *
+ * buf_mtxp held.
+ */
+static buf_t
+bufq_take(int whichq, int cpu, struct bufhashbucket **bhbp)
+{
+	struct bufqueue *bq;
+	buf_t	bp;
+	unsigned int i, n;
+
+	n = BQ_PERCPU(whichq) ? bufq_ncpus : 1;
+
+	for (i = 0; i < n; i++) {
+		bq = bufqueue(whichq, (cpu + i) % bufq_ncpus);
+
+		if (TAILQ_EMPTY(&bq->bq_head))
+			continue;
+
+		lck_mtx_lock_spin(&bq->bq_lock);
+
+		TAILQ_FOREACH(bp, &bq->bq_head, b_freelist) {
+			if (buf_hash_trylock(bp, bhbp))
+				break;
+		}
+		if (bp != NULL)
+			bufq_remove(bq, bp);
+
+		lck_mtx_unlock(&bq->bq_lock);
+
+		if (bp != NULL)
+			return (bp);
+	}
+	return (NULL);
+}
+
+/*
+ * Find the first non-empty list for whichq, starting with cpu's, and
+ * return its CPU and the timestamp of the buffer at its head.
+ */
+static boolean_t
+bufq_peek(int whichq, int cpu, int *qcpu, int *timestamp)
+{
+	struct bufqueue *bq;
+	buf_t	bp;
+	unsigned int i, n;
+
+	n = BQ_PERCPU(whichq) ? bufq_ncpus : 1;
+
+	for (i = 0; i < n; i++) {
+		bq = bufqueue(whichq, (cpu + i) % bufq_ncpus);
+
+		if (TAILQ_EMPTY(&bq->bq_head))
+			continue;
+
+		lck_mtx_lock_spin(&bq->bq_lock);
+
+		if ((bp = TAILQ_FIRST(&bq->bq_head)) != NULL)
+			*timestamp = bp->b_timestamp;
+
+		lck_mtx_unlock(&bq->bq_lock);
+
+		if (bp != NULL) {
+			*qcpu = (cpu + i) % bufq_ncpus;
+			return (TRUE);
+		}
+	}
+	return (FALSE);
+}
+
+/*
+ * TRUE if there is nothing getnewbuf() could reclaim.
+ */
+static boolean_t
+bufq_empty(void)
+{
+	unsigned int cpu;
+
+	if (!TAILQ_EMPTY(&bufqueues[BQ_META].bq_head))
+		return (FALSE);
+
+	for (cpu = 0; cpu < bufq_ncpus; cpu++) {
+		if (!TAILQ_EMPTY(&bufqueue(BQ_EMPTY, cpu)->bq_head) ||
+		    !TAILQ_EMPTY(&bufqueue(BQ_AGE, cpu)->bq_head) ||
+		    !TAILQ_EMPTY(&bufqueue(BQ_LRU, cpu)->bq_head))
+			return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * Wake up getnewbuf() if it's waiting for a buffer to become free.
+ * needbuffer is protected by buf_mtxp, but buf_brelse() releases most
+ * buffers without it: it calls us after putting the buffer on a free
+ * list, and getnewbuf() looks at the lists again after setting
+ * needbuffer, so one of the two sees the other.
+ */
+static void
+buf_wakeup_needbuffer(void)
+{
+	OSMemoryBarrier();
+
+	if (needbuffer == 0)
+		return;
+
+	lck_mtx_lock_spin(buf_mtxp);
+
+	if (needbuffer) {
+		needbuffer = 0;
+		lck_mtx_unlock(buf_mtxp);
+
+		wakeup(&needbuffer);
+		return;
+	}
+	lck_mtx_unlock(buf_mtxp);
 }
 
 static __inline__ void
@@ -1805,10 +2238,14 @@ buf_itercomplete(vnode_t vp, struct buflists *iterheadp, int flags)
 }
 
 
+/*
+ * Take bp off its free list.  The caller holds the bucket lock of bp,
+ * or buf_mtxp if bp isn't hashed.
+ */
 static void
 bremfree_locked(buf_t bp)
 {
-	struct bqueues *dp = NULL;
+	struct bufqueue *bq;
 	int whichq;
 
 	whichq = bp->b_whichq;
@@ -1823,22 +2260,29 @@ bremfree_locked(buf_t bp)
 		 */
 		return;
 	}
+	bq = bufqueue(whichq, bp->b_whichcpu);
+
+	lck_mtx_lock_spin(&bq->bq_lock);
+	bufq_remove(bq, bp);
+	lck_mtx_unlock(&bq->bq_lock);
+}
+
+/*
+ * The lock of free list bq held.
+ */
+static void
+bufq_remove(struct bufqueue *bq, buf_t bp)
+{
 	/*
-	 * We only calculate the head of the freelist when removing
-	 * the last element of the list as that is the only time that
-	 * it is needed (e.g. to reset the tail pointer).
-	 *
 	 * NB: This makes an assumption about how tailq's are implemented.
 	 */
-	if (bp->b_freelist.tqe_next == NULL) {
-	        dp = &bufqueues[whichq];
+	if (bp->b_freelist.tqe_next == NULL &&
+	    bq->bq_head.tqh_last != &bp->b_freelist.tqe_next)
+		panic("bremfree: lost tail");
 
-		if (dp->tqh_last != &bp->b_freelist.tqe_next)
-			panic("bremfree: lost tail");
-	}
-	TAILQ_REMOVE(dp, bp, b_freelist);
+	TAILQ_REMOVE(&bq->bq_head, bp, b_freelist);
 
-	if (whichq == BQ_LAUNDRY)
+	if (bp->b_whichq == BQ_LAUNDRY)
 	        blaundrycnt--;
 
 	bp->b_whichq = -1;
@@ -1937,14 +2381,62 @@ __private_extern__ void
 bufinit(void)
 {
 	buf_t	bp;
-	struct bqueues *dp;
+	struct bufqueue *bq;
+	void	*buf;
+	vm_size_t size;
+	uint32_t nbuckets;
+	unsigned int n;
 	int	i;
 
+	/*
+	 * allocate lock group attribute and group
+	 */
+	buf_mtx_grp_attr = lck_grp_attr_alloc_init();
+	buf_mtx_grp = lck_grp_alloc_init("buffer cache", buf_mtx_grp_attr);
+		
+	/*
+	 * allocate the lock attribute
+	 */
+	buf_mtx_attr = lck_attr_alloc_init();
+
+	/*
+	 * allocate and initialize mutex's for the buffer and iobuffer pools
+	 */
+	buf_mtxp	= lck_mtx_alloc_init(buf_mtx_grp, buf_mtx_attr);
+	iobuffer_mtxp	= lck_mtx_alloc_init(buf_mtx_grp, buf_mtx_attr);
+
+	if (iobuffer_mtxp == NULL)
+	        panic("couldn't create iobuffer mutex");
+
+	if (buf_mtxp == NULL)
+	        panic("couldn't create buf mutex");
+
 	nbuf_headers = 0;
 	/* Initialize the buffer queues ('freelists') and the hash table */
-	for (dp = bufqueues; dp < &bufqueues[BQUEUES]; dp++)
-		TAILQ_INIT(dp);
-	bufhashtbl = hashinit(nbuf_hashelements, M_CACHE, &bufhash);
+	bufq_ncpus = ml_get_max_cpus();
+	size = bufq_ncpus * BQUEUES * sizeof(struct bufqueue);
+	buf = _MALLOC(size + MAX_CPU_CACHE_LINE_SIZE, M_CACHE, M_WAITOK | M_ZERO);
+	if (buf == NULL)
+		panic("couldn't allocate the per-cpu buffer queues");
+	bufqueues_cpu = (struct bufqueue *)P2ROUNDUP((intptr_t)buf,
+	    MAX_CPU_CACHE_LINE_SIZE);
+
+	for (n = 0; n < bufq_ncpus * BQUEUES; n++) {
+		bq = &bufqueues_cpu[n];
+		TAILQ_INIT(&bq->bq_head);
+		lck_mtx_init(&bq->bq_lock, buf_mtx_grp, buf_mtx_attr);
+	}
+	for (bq = bufqueues; bq < &bufqueues[BQUEUES]; bq++) {
+		TAILQ_INIT(&bq->bq_head);
+		lck_mtx_init(&bq->bq_lock, buf_mtx_grp, buf_mtx_attr);
+	}
+	/*
+	 * the hash grows with the number of buffers in it, so
+	 * don't start out with more buckets than buffer headers
+	 */
+	for (nbuckets = 1; nbuckets <= (uint32_t)MIN(nbuf_hashelements, max_nbuf_headers); nbuckets <<= 1)
+		continue;
+	bufhashtbl = bufhash_alloc(MAX(nbuckets >> 1, 1));
 
 	buf_busycount = 0;
 
@@ -1955,11 +2447,8 @@ bufinit(void)
 		bufhdrinit(bp);
 
 		BLISTNONE(bp);
-		dp = &bufqueues[BQ_EMPTY];
-		bp->b_whichq = BQ_EMPTY;
 		bp->b_timestamp = buf_timestamp();
-		binsheadfree(bp, dp, BQ_EMPTY);
-		binshash(bp, &invalhash);
+		binsfree(bp, BQ_EMPTY, TRUE);
 	}
 	boot_nbuf_headers = nbuf_headers;
 
@@ -1973,29 +2462,6 @@ bufinit(void)
 		binsheadfree(bp, &iobufqueue, -1);
 	}
 
-	/*
-	 * allocate lock group attribute and group
-	 */
-	buf_mtx_grp_attr = lck_grp_attr_alloc_init();
-	buf_mtx_grp = lck_grp_alloc_init("buffer cache", buf_mtx_grp_attr);
-		
-	/*
-	 * allocate the lock attribute
-	 */
-	buf_mtx_attr = lck_attr_alloc_init();
-
-	/*
-	 * allocate and initialize mutex's for the buffer and iobuffer pools
-	 */
-	buf_mtxp	= lck_mtx_alloc_init(buf_mtx_grp, buf_mtx_attr);
-	iobuffer_mtxp	= lck_mtx_alloc_init(buf_mtx_grp, buf_mtx_attr);
-
-	if (iobuffer_mtxp == NULL)
-	        panic("couldn't create iobuffer mutex");
-
-	if (buf_mtxp == NULL)
-	        panic("couldn't create buf mutex");
-
 	/*
 	 * allocate and initialize cluster specific global locks...
 	 */
@@ -2444,10 +2910,16 @@ buf_brelse_shadow(buf_t bp)
 	int	data_ref = 0;
 #endif
 	int need_wakeup = 0;
+	struct bufhashbucket *bhb;
 
 	lck_mtx_lock_spin(buf_mtxp);
 
 	bp_head = (buf_t)bp->b_orig;
+	/*
+	 * b_shadow_ref only drops with both buf_mtxp and the bucket lock
+	 * held, so buf_brelse can look at it under the bucket lock alone
+	 */
+	bhb = buf_hash_lock(bp_head);
 
 	if (bp_head->b_whichq != -1)
 		panic("buf_brelse_shadow: bp_head on freelist %d\n", bp_head->b_whichq);
@@ -2500,13 +2972,10 @@ buf_brelse_shadow(buf_t bp)
 			CLR(bp_head->b_flags, B_AGE);
 			bp_head->b_timestamp = buf_timestamp();
 
-			if (ISSET(bp_head->b_flags, B_LOCKED)) {
-				bp_head->b_whichq = BQ_LOCKED;
-				binstailfree(bp_head, &bufqueues[BQ_LOCKED], BQ_LOCKED);
-			} else {
-				bp_head->b_whichq = BQ_META;
-				binstailfree(bp_head, &bufqueues[BQ_META], BQ_META);
-			}
+			if (ISSET(bp_head->b_flags, B_LOCKED))
+				binsfree(bp_head, BQ_LOCKED, FALSE);
+			else
+				binsfree(bp_head, BQ_META, FALSE);
 		} else if (ISSET(bp_head->b_lflags, BL_WAITSHADOW)) {
 			CLR(bp_head->b_lflags, BL_WAITSHADOW);
 
@@ -2517,6 +2986,8 @@ buf_brelse_shadow(buf_t bp)
 			need_wakeup = 1;
 		}
 	}
+	if (bhb != NULL)
+		bufhash_unlock(bhb);
 	lck_mtx_unlock(buf_mtxp);
 
 	if (need_wakeup)
@@ -2541,11 +3012,10 @@ buf_brelse_shadow(buf_t bp)
 void
 buf_brelse(buf_t bp)
 {
-	struct bqueues *bufq;
 	long	whichq;
 	upl_t	upl;
-	int need_wakeup = 0;
 	int need_bp_wakeup = 0;
+	struct bufhashbucket *bhb;
 
 
 	if (bp->b_whichq != -1 || !(bp->b_lflags & BL_BUSY))
@@ -2697,7 +3167,11 @@ buf_brelse(buf_t bp)
 		lck_mtx_lock_spin(buf_mtxp);
 
 		if (bp->b_shadow_ref) {
-			SET(bp->b_lflags, BL_WAITSHADOW);
+			if ((bhb = buf_hash_lock(bp)) != NULL) {
+				SET(bp->b_lflags, BL_WAITSHADOW);
+				bufhash_unlock(bhb);
+			} else
+				SET(bp->b_lflags, BL_WAITSHADOW);
 			
 			lck_mtx_unlock(buf_mtxp);
 			
@@ -2716,12 +3190,18 @@ finish_shadow_master:
 		if (bp->b_vp)
 			brelvp_locked(bp);
 
-		bremhash(bp);
-		BLISTNONE(bp);
-		binshash(bp, &invalhash);
+		/*
+		 * once it's off the hash, buf_mtxp protects b_lflags...
+		 * nobody can find bp to set BL_WANTED after this
+		 */
+		if ((bhb = buf_hash_lock(bp)) != NULL) {
+			bremhash(bp);
+			BLISTNONE(bp);
+			bufhash_unlock(bhb);
+		}
+		bhb = NULL;
 
-		bp->b_whichq = BQ_EMPTY;
-		binsheadfree(bp, &bufqueues[BQ_EMPTY], BQ_EMPTY);
+		binsfree(bp, BQ_EMPTY, TRUE);
 	} else {
 
 		/*
@@ -2736,25 +3216,24 @@ finish_shadow_master:
 			whichq = BQ_AGE;		/* stale but valid data */
 		else
 			whichq = BQ_LRU;		/* valid data */
-		bufq = &bufqueues[whichq];
 
 		bp->b_timestamp = buf_timestamp();
 
-		lck_mtx_lock_spin(buf_mtxp);
+		bhb = buf_lock_owned(bp);
 		
 		/*
 		 * the buf_brelse_shadow routine doesn't take 'ownership'
 		 * of the parent buf_t... it updates state that is protected by
-		 * the buf_mtxp, and checks for BL_BUSY to determine whether to
-		 * put the buf_t back on a free list.  b_shadow_ref is protected
-		 * by the lock, and since we have not yet cleared B_BUSY, we need
-		 * to check it while holding the lock to insure that one of us
-		 * puts this buf_t back on a free list when it is safe to do so
+		 * the buf_mtxp and the bucket lock, and checks for BL_BUSY to
+		 * determine whether to put the buf_t back on a free list.
+		 * b_shadow_ref can't drop without the bucket lock, and since we
+		 * have not yet cleared B_BUSY, we need to check it while holding
+		 * the lock to insure that one of us puts this buf_t back on a
+		 * free list when it is safe to do so
 		 */
 		if (bp->b_shadow_ref == 0) {
 			CLR(bp->b_flags, (B_AGE | B_ASYNC | B_NOCACHE));
-			bp->b_whichq = whichq;
-			binstailfree(bp, bufq, whichq);
+			binsfree(bp, whichq, FALSE);
 		} else {
 			/*
 			 * there are still cloned buf_t's pointing
@@ -2765,20 +3244,10 @@ finish_shadow_master:
 			CLR(bp->b_flags, (B_ASYNC | B_NOCACHE));
 		}
 	}
-	if (needbuffer) {
-	        /*
-		 * needbuffer is a global
-		 * we're currently using buf_mtxp to protect it
-		 * delay doing the actual wakeup until after
-		 * we drop buf_mtxp
-		 */
-		needbuffer = 0;
-		need_wakeup = 1;
-	}
 	if (ISSET(bp->b_lflags, BL_WANTED)) {
 	        /*	
 		 * delay the actual wakeup until after we
-		 * clear BL_BUSY and we've dropped buf_mtxp
+		 * clear BL_BUSY and we've dropped the lock
 		 */
 		need_bp_wakeup = 1;
 	}
@@ -2786,16 +3255,15 @@ finish_shadow_master:
 	 * Unlock the buffer.
 	 */
 	CLR(bp->b_lflags, (BL_BUSY | BL_WANTED));
-	buf_busycount--;
+	OSAddAtomic(-1, &buf_busycount);
 
-	lck_mtx_unlock(buf_mtxp);
+	buf_unlock_owned(bhb);
+
+	/*
+	 * Wake up any processes waiting for any buffer to become free.
+	 */
+	buf_wakeup_needbuffer();
 
-	if (need_wakeup) {
-	        /*
-		 * Wake up any processes waiting for any buffer to become free.
-		 */
-	        wakeup(&needbuffer);
-	}
 	if (need_bp_wakeup) {
 	        /*
 		 * Wake up any proceeses waiting for _this_ buffer to become free.
@@ -2817,17 +3285,15 @@ static boolean_t
 incore(vnode_t vp, daddr64_t blkno)
 {
         boolean_t retval;
-	struct	bufhashhdr *dp;
-
-	dp = BUFHASH(vp, blkno);
+	struct	bufhashbucket *bhb;
 
-	lck_mtx_lock_spin(buf_mtxp);
+	bhb = bufhash_lock(BUFHASHVAL(vp, blkno));
 
-	if (incore_locked(vp, blkno, dp))
+	if (incore_locked(vp, blkno, &bhb->bhb_head))
 	        retval = TRUE;
 	else
 	        retval = FALSE;
-	lck_mtx_unlock(buf_mtxp);
+	bufhash_unlock(bhb);
 
 	return (retval);
 }
@@ -2853,21 +3319,26 @@ void
 buf_wait_for_shadow_io(vnode_t vp, daddr64_t blkno)
 {
 	buf_t bp;
-	struct	bufhashhdr *dp;
-
-	dp = BUFHASH(vp, blkno);
+	struct	bufhashbucket *bhb;
 
+	/*
+	 * b_shadow_ref drops under buf_mtxp, which buf_brelse_shadow
+	 * holds when it wakes us, so sleep on that rather than the bucket
+	 */
 	lck_mtx_lock_spin(buf_mtxp);
 
 	for (;;) {
-		if ((bp = incore_locked(vp, blkno, dp)) == NULL)
-			break;
+		bhb = bufhash_lock(BUFHASHVAL(vp, blkno));
 
-		if (bp->b_shadow_ref == 0)
+		if ((bp = incore_locked(vp, blkno, &bhb->bhb_head)) == NULL ||
+		    bp->b_shadow_ref == 0) {
+			bufhash_unlock(bhb);
 			break;
-
+		}
 		SET(bp->b_lflags, BL_WANTED_REF);
 
+		bufhash_unlock(bhb);
+
 		(void) msleep(bp, buf_mtxp, PSPIN | (PRIBIO+1), "buf_wait_for_shadow", NULL);
 	}
 	lck_mtx_unlock(buf_mtxp);
@@ -2893,18 +3364,23 @@ buf_getblk(vnode_t vp, daddr64_t blkno, int size, int slpflag, int slptimeo, int
 	int ret_only_valid;
 	struct timespec ts;
 	int upl_flags;
-	struct	bufhashhdr *dp;
+	uint32_t hashval;
+	struct	bufhashbucket *bhb;
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 386)) | DBG_FUNC_START,
 		     (uintptr_t)(blkno * PAGE_SIZE), size, operation, 0, 0);
 
 	ret_only_valid = operation & BLK_ONLYVALID;
 	operation &= ~BLK_ONLYVALID;
-	dp = BUFHASH(vp, blkno);
+	hashval = BUFHASHVAL(vp, blkno);
 start:
-	lck_mtx_lock_spin(buf_mtxp);
+	/*
+	 * a hit only needs the bucket lock... buf_mtxp is
+	 * taken on a miss, to reclaim a buffer and hash it
+	 */
+	bhb = bufhash_lock(hashval);
 
-	if ((bp = incore_locked(vp, blkno, dp))) {
+	if ((bp = incore_locked(vp, blkno, &bhb->bhb_head))) {
 		/*
 		 * Found in the Buffer Cache
 		 */
@@ -2917,7 +3393,7 @@ start:
 			case BLK_WRITE:
 			case BLK_META:
 				SET(bp->b_lflags, BL_WANTED);
-				bufstats.bufs_busyincore++;
+				OSAddAtomicLong(1, &bufstats.bufs_busyincore);
 
 				/*
 				 * don't retake the mutex after being awakened...
@@ -2929,7 +3405,7 @@ start:
 				KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 396)) | DBG_FUNC_NONE,
 					     (uintptr_t)blkno, size, operation, 0, 0);
 
-				err = msleep(bp, buf_mtxp, slpflag | PDROP | (PRIBIO + 1), "buf_getblk", &ts);
+				err = msleep(bp, &bhb->bhb_lock, slpflag | PDROP | (PRIBIO + 1), "buf_getblk", &ts);
 
 				/*
 				 * Callers who call with PCATCH or timeout are
@@ -2955,12 +3431,12 @@ start:
 			 */
 			SET(bp->b_lflags, BL_BUSY);
 			SET(bp->b_flags, B_CACHE);
-			buf_busycount++;
+			OSAddAtomic(1, &buf_busycount);
 
 			bremfree_locked(bp);
-			bufstats.bufs_incore++;
+			OSAddAtomicLong(1, &bufstats.bufs_incore);
 			
-			lck_mtx_unlock(buf_mtxp);
+			bufhash_unlock(bhb);
 #ifdef JOE_DEBUG
 			bp->b_owner = current_thread();
 			bp->b_tag   = 1;
@@ -3025,13 +3501,16 @@ start:
 	} else { /* not incore() */
 		int queue = BQ_EMPTY; /* Start with no preference */
 		
-		if (ret_only_valid) {
-			lck_mtx_unlock(buf_mtxp);
+		bufhash_unlock(bhb);
+
+		if (ret_only_valid)
 			return (NULL);
-		}
+
 		if ((vnode_isreg(vp) == 0) || (UBCINFOEXISTS(vp) == 0) /*|| (vnode_issystem(vp) == 1)*/)
 			operation = BLK_META;
 
+		lck_mtx_lock_spin(buf_mtxp);
+
 		if ((bp = getnewbuf(slpflag, slptimeo, &queue)) == NULL)
 			goto start;
 
@@ -3042,9 +3521,12 @@ start:
 		 * the hash... if we see it incore at this point we dump
 		 * the buffer we were working on and start over
 		 */
-		if (incore_locked(vp, blkno, dp)) {
+		bhb = bufhash_lock(hashval);
+
+		if (incore_locked(vp, blkno, &bhb->bhb_head)) {
+			bufhash_unlock(bhb);
+
 			SET(bp->b_flags, B_INVAL);
-			binshash(bp, &invalhash);
 
 			lck_mtx_unlock(buf_mtxp);
 
@@ -3069,12 +3551,19 @@ start:
 		/*
 		 * Insert in the hash so that incore() can find it 
 		 */
-		binshash(bp, BUFHASH(vp, blkno)); 
+		binshash(bp, bhb, hashval); 
+
+		bufhash_unlock(bhb);
 
 		bgetvp_locked(vp, bp);
 
+		bufhash_move();
+
 		lck_mtx_unlock(buf_mtxp);
 
+		if (bufhash_count > BUFHASH_LOAD * (bufhashtbl->bht_mask + 1))
+			bufhash_grow();
+
 		allocbuf(bp, size);
 
 		upl_flags = 0;
@@ -3084,8 +3573,8 @@ start:
 			 * buffer data is invalid...
 			 *
 			 * I don't want to have to retake buf_mtxp,
-			 * so the miss and vmhits counters are done
-			 * with Atomic updates... all other counters
+			 * so the miss, vmhits and incore counters are
+			 * done with Atomic updates... all other counters
 			 * in bufstats are protected with either
 			 * buf_mtxp or iobuffer_mtxp
 			 */
@@ -3209,7 +3698,6 @@ buf_geteblk(int size)
 #endif /* DIAGNOSTIC */
 	/* XXX need to implement logic to deal with other queues */
 
-	binshash(bp, &invalhash);
 	bufstats.bufs_eblk++;
 
 	lck_mtx_unlock(buf_mtxp);
@@ -3244,17 +3732,27 @@ recycle_buf_from_pool(int nsize)
 {
 	buf_t	bp;
 	void	*ptr = NULL;
+	struct bufqueue *bq = &bufqueues[BQ_META];
+	struct bufhashbucket *bhb;
 
 	lck_mtx_lock_spin(buf_mtxp);
+	lck_mtx_lock_spin(&bq->bq_lock);
 
-	TAILQ_FOREACH(bp, &bufqueues[BQ_META], b_freelist) {
+	TAILQ_FOREACH(bp, &bq->bq_head, b_freelist) {
 		if (ISSET(bp->b_flags, B_DELWRI) || bp->b_bufsize != nsize)
 			continue;
+		if (!buf_hash_trylock(bp, &bhb))
+			continue;
+		bufq_remove(bq, bp);
+		break;
+	}
+	lck_mtx_unlock(&bq->bq_lock);
+
+	if (bp != NULL) {
 		ptr = (void *)bp->b_datap;
 		bp->b_bufsize = 0;
 
-		bcleanbuf(bp, TRUE);
-		break;
+		bcleanbuf(bp, bhb, TRUE);
 	}
 	lck_mtx_unlock(buf_mtxp);
 
@@ -3422,11 +3920,13 @@ static buf_t
 getnewbuf(int slpflag, int slptimeo, int * queue)
 {
 	buf_t	bp;
-	buf_t	lru_bp;
-	buf_t	age_bp;
-	buf_t	meta_bp;
 	int	age_time, lru_time, bp_time, meta_time;
+	int	age_stamp, lru_stamp, meta_stamp, bp_stamp;
+	int	age_cpu, lru_cpu, meta_cpu, bp_cpu;
+	boolean_t age_ok, lru_ok, meta_ok;
 	int	req = *queue;	/* save it for restarts */
+	int	cpu;
+	struct bufhashbucket *bhb;
 	struct timespec ts;
 
 start:
@@ -3437,8 +3937,9 @@ start:
 		|| (*queue == BQ_LAUNDRY) || (*queue == BQ_LOCKED))
 		*queue = BQ_EMPTY;
 
+	cpu = cpu_number();
 
-	if (*queue == BQ_EMPTY && (bp = bufqueues[*queue].tqh_first))
+	if (*queue == BQ_EMPTY && (bp = bufq_take(BQ_EMPTY, cpu, &bhb)))
 	        goto found;
 
 	/*
@@ -3454,22 +3955,23 @@ start:
 		goto add_newbufs;
 	}
 	/* Try for the requested queue first */
-	bp = bufqueues[*queue].tqh_first;
-	if (bp)
+	if ((bp = bufq_take(*queue, cpu, &bhb)))
 	        goto found;
 
-	/* Unable to use requested queue */
-	age_bp = bufqueues[BQ_AGE].tqh_first;
-	lru_bp = bufqueues[BQ_LRU].tqh_first;
-	meta_bp = bufqueues[BQ_META].tqh_first;
+	/*
+	 * Unable to use requested queue... the heads of the lists
+	 * are only looked at here, the one we pick is taken below
+	 */
+	age_ok = bufq_peek(BQ_AGE, cpu, &age_cpu, &age_stamp);
+	lru_ok = bufq_peek(BQ_LRU, cpu, &lru_cpu, &lru_stamp);
+	meta_ok = bufq_peek(BQ_META, cpu, &meta_cpu, &meta_stamp);
 
-	if (!age_bp && !lru_bp && !meta_bp) {
+	if (!age_ok && !lru_ok && !meta_ok) {
 		/*
 		 * Unavailble on AGE or LRU or META queues
 		 * Try the empty list first
 		 */
-		bp = bufqueues[BQ_EMPTY].tqh_first;
-		if (bp) {
+		if ((bp = bufq_take(BQ_EMPTY, cpu, &bhb))) {
 			*queue = BQ_EMPTY;
 			goto found;
 		}
@@ -3487,8 +3989,8 @@ add_newbufs:
 		
 		if (bp) {
 			bufhdrinit(bp);
-			bp->b_whichq = BQ_EMPTY;
-			bp->b_timestamp = buf_timestamp();
+			bp->b_whichq = -1;
+			bp->b_timestamp = 0;
 			BLISTNONE(bp);
 			SET(bp->b_flags, B_HDRALLOC);
 			*queue = BQ_EMPTY;
@@ -3496,18 +3998,32 @@ add_newbufs:
 		lck_mtx_lock_spin(buf_mtxp);
 
 		if (bp) {
-			binshash(bp, &invalhash);
-			binsheadfree(bp, &bufqueues[BQ_EMPTY], BQ_EMPTY);
+			/*
+			 * it was never on a free list, so
+			 * there's nothing to take it off
+			 */
+			bhb = NULL;
 			buf_hdr_count++;
 			goto found;
 		}
 		/* subtract already accounted bufcount */
 		nbuf_headers--;
 
-		bufstats.bufs_sleeps++;
-
 		/* wait for a free buffer of any kind */
 		needbuffer = 1;
+
+		/*
+		 * buf_brelse() frees buffers without buf_mtxp, so
+		 * look at the lists again now that needbuffer is set
+		 */
+		OSMemoryBarrier();
+
+		if (!bufq_empty()) {
+			*queue = req;
+			goto start;
+		}
+		bufstats.bufs_sleeps++;
+
 		/* hz value is 100 */
 		ts.tv_sec = (slptimeo/1000);
 		/* the hz value is 100; which leads to 10ms */
@@ -3518,23 +4034,21 @@ add_newbufs:
 	}
 
 	/* Buffer available either on AGE or LRU or META */
-	bp = NULL;
 	*queue = -1;
+	bp_cpu = 0;
+	bp_stamp = 0;
 
 	/* Buffer available either on AGE or LRU */
-	if (!age_bp) {
-		bp = lru_bp;
+	if (!age_ok && lru_ok) {
 		*queue = BQ_LRU;
-	} else if (!lru_bp) {
-		bp = age_bp;
+	} else if (age_ok && !lru_ok) {
 		*queue = BQ_AGE;
-	} else { /* buffer available on both AGE and LRU */
+	} else if (age_ok && lru_ok) { /* buffer available on both AGE and LRU */
 		int		t = buf_timestamp();
 
-		age_time = t - age_bp->b_timestamp;
-		lru_time = t - lru_bp->b_timestamp;
+		age_time = t - age_stamp;
+		lru_time = t - lru_stamp;
 		if ((age_time < 0) || (lru_time < 0)) { /* time set backwards */
-			bp = age_bp;
 			*queue = BQ_AGE;
 			/*
 			 * we should probably re-timestamp eveything in the
@@ -3542,23 +4056,27 @@ add_newbufs:
 			 */
 		} else {
 			if ((lru_time >= lru_is_stale) && (age_time < age_is_stale)) {
-				bp = lru_bp;
 				*queue = BQ_LRU;
 			} else {
-				bp = age_bp;
 				*queue = BQ_AGE;
 			}
 		}
 	}
+	if (*queue == BQ_LRU) {
+		bp_cpu = lru_cpu;
+		bp_stamp = lru_stamp;
+	} else if (*queue == BQ_AGE) {
+		bp_cpu = age_cpu;
+		bp_stamp = age_stamp;
+	}
 
-	if (!bp) { /* Neither on AGE nor on LRU */
-		bp = meta_bp;
+	if (*queue == -1) { /* Neither on AGE nor on LRU */
 		*queue = BQ_META;
-	}  else if (meta_bp) {
+	}  else if (meta_ok) {
 		int		t = buf_timestamp();
 
-		bp_time = t - bp->b_timestamp;
-		meta_time = t - meta_bp->b_timestamp;
+		bp_time = t - bp_stamp;
+		meta_time = t - meta_stamp;
 
 		if (!(bp_time < 0) && !(meta_time < 0)) {
 			/* time not set backwards */
@@ -3568,17 +4086,27 @@ add_newbufs:
 
 			if ((meta_time >= meta_is_stale) && 
 					(bp_time < bp_is_stale)) {
-				bp = meta_bp;
 				*queue = BQ_META;
 			}
 		}
 	}
+	if (*queue == BQ_META)
+		bp_cpu = meta_cpu;
+
+	if ((bp = bufq_take(*queue, bp_cpu, &bhb)) == NULL) {
+		/*
+		 * the list emptied or its buffers were all
+		 * in use while we were deciding... start over
+		 */
+		*queue = req;
+		goto start;
+	}
 found:
 	if (ISSET(bp->b_flags, B_LOCKED) || ISSET(bp->b_lflags, BL_BUSY))
 	        panic("getnewbuf: bp @ %p is LOCKED or BUSY! (flags 0x%x)\n", bp, bp->b_flags);
 
 	/* Clean it */
-	if (bcleanbuf(bp, FALSE)) {
+	if (bcleanbuf(bp, bhb, FALSE)) {
 		/*
 		 * moved to the laundry thread, buffer not ready
 		 */
@@ -3590,20 +4118,18 @@ found:
 
 
 /* 
- * Clean a buffer.
+ * Clean a buffer, which the caller has taken off its free list.
  * Returns 0 if buffer is ready to use,
  * Returns 1 if issued a buf_bawrite() to indicate 
  * that the buffer is not ready.
  * 
- * buf_mtxp is held upon entry
+ * buf_mtxp is held upon entry, and bhb, the bucket lock of bp
+ * if it's hashed, which is dropped
  * returns with buf_mtxp locked
  */
 int
-bcleanbuf(buf_t bp, boolean_t discard)
+bcleanbuf(buf_t bp, struct bufhashbucket *bhb, boolean_t discard)
 {
-	/* Remove from the queue */
-	bremfree_locked(bp);
-
 #ifdef JOE_DEBUG
 	bp->b_owner = current_thread();
 	bp->b_tag   = 2;
@@ -3619,6 +4145,8 @@ bcleanbuf(buf_t bp, boolean_t discard)
 
 		bmovelaundry(bp);
 
+		if (bhb != NULL)
+			bufhash_unlock(bhb);
 		lck_mtx_unlock(buf_mtxp);
 
 		wakeup(&bufqueues[BQ_LAUNDRY]);
@@ -3639,9 +4167,13 @@ bcleanbuf(buf_t bp, boolean_t discard)
 	 * Buffer is no longer on any free list... we own it
 	 */
 	SET(bp->b_lflags, BL_BUSY);
-	buf_busycount++;
+	OSAddAtomic(1, &buf_busycount);
 	
-	bremhash(bp);
+	if (bhb != NULL) {
+		bremhash(bp);
+		BLISTNONE(bp);
+		bufhash_unlock(bhb);
+	}
 
 	/*
 	 * disassociate us from our vnode, if we had one...
@@ -3651,8 +4183,6 @@ bcleanbuf(buf_t bp, boolean_t discard)
 
 	lck_mtx_unlock(buf_mtxp);
 
-	BLISTNONE(bp);
-
 	if (ISSET(bp->b_flags, B_META))
 		buf_free_meta_store(bp);
 
@@ -3666,11 +4196,9 @@ bcleanbuf(buf_t bp, boolean_t discard)
 	if (discard) {
 		lck_mtx_lock_spin(buf_mtxp);
 		CLR(bp->b_flags, (B_META | B_ZALLOC | B_DELWRI | B_LOCKED | B_AGE | B_ASYNC | B_NOCACHE | B_FUA));
-		bp->b_whichq = BQ_EMPTY;
-		binshash(bp, &invalhash);
-		binsheadfree(bp, &bufqueues[BQ_EMPTY], BQ_EMPTY);
+		binsfree(bp, BQ_EMPTY, TRUE);
 		CLR(bp->b_lflags, BL_BUSY);
-		buf_busycount--;
+		OSAddAtomic(-1, &buf_busycount);
 	} else {
 		/* Not discarding: clean up and prepare for reuse */
 		bp->b_bufsize = 0;
@@ -3710,25 +4238,23 @@ buf_invalblkno(vnode_t vp, daddr64_t lblkno, int flags)
 {
         buf_t	bp;
 	errno_t	error;
-	struct bufhashhdr *dp;
-
-	dp = BUFHASH(vp, lblkno);
+	struct bufhashbucket *bhb;
 
 relook:	
-	lck_mtx_lock_spin(buf_mtxp);
+	bhb = bufhash_lock(BUFHASHVAL(vp, lblkno));
 
-	if ((bp = incore_locked(vp, lblkno, dp)) == (struct buf *)0) {
-	        lck_mtx_unlock(buf_mtxp);
+	if ((bp = incore_locked(vp, lblkno, &bhb->bhb_head)) == (struct buf *)0) {
+	        bufhash_unlock(bhb);
 		return (0);
 	}
 	if (ISSET(bp->b_lflags, BL_BUSY)) {
 	        if ( !ISSET(flags, BUF_WAIT)) {
-		        lck_mtx_unlock(buf_mtxp);
+		        bufhash_unlock(bhb);
 			return (EBUSY);
 		}
 	        SET(bp->b_lflags, BL_WANTED);
 
-		error = msleep((caddr_t)bp, buf_mtxp, PDROP | (PRIBIO + 1), "buf_invalblkno", NULL);
+		error = msleep((caddr_t)bp, &bhb->bhb_lock, PDROP | (PRIBIO + 1), "buf_invalblkno", NULL);
 
 		if (error) {
 			return (error);
@@ -3738,12 +4264,12 @@ relook:
 	bremfree_locked(bp);
 	SET(bp->b_lflags, BL_BUSY);
 	SET(bp->b_flags, B_INVAL);
-	buf_busycount++;
+	OSAddAtomic(1, &buf_busycount);
 #ifdef JOE_DEBUG
 	bp->b_owner = current_thread();
 	bp->b_tag   = 4;
 #endif
-	lck_mtx_unlock(buf_mtxp);
+	bufhash_unlock(bhb);
 	buf_brelse(bp);
 
 	return (0);
@@ -3754,13 +4280,14 @@ void
 buf_drop(buf_t bp)
 {
         int need_wakeup = 0;
+	struct bufhashbucket *bhb;
 
-	lck_mtx_lock_spin(buf_mtxp);
+	bhb = buf_lock_owned(bp);
 
 	if (ISSET(bp->b_lflags, BL_WANTED)) {
 	        /*	
 		 * delay the actual wakeup until after we
-		 * clear BL_BUSY and we've dropped buf_mtxp
+		 * clear BL_BUSY and we've dropped the lock
 		 */
 		need_wakeup = 1;
 	}
@@ -3772,9 +4299,9 @@ buf_drop(buf_t bp)
 	 * Unlock the buffer.
 	 */
 	CLR(bp->b_lflags, (BL_BUSY | BL_WANTED));
-	buf_busycount--;
+	OSAddAtomic(-1, &buf_busycount);
 
-	lck_mtx_unlock(buf_mtxp);
+	buf_unlock_owned(bhb);
 
 	if (need_wakeup) {
 	        /*
@@ -3804,6 +4331,7 @@ buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
 {
 	errno_t error;
 	struct timespec ts;
+	struct bufhashbucket *bhb;
 
 	if (ISSET(bp->b_flags, B_LOCKED)) {
 	        if ((flags & BAC_SKIP_LOCKED))
@@ -3812,20 +4340,42 @@ buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
 	        if ((flags & BAC_SKIP_NONLOCKED))
 			return (EDEADLK);
 	}
+	/*
+	 * buf_mtxp keeps bp from being hashed or unhashed,
+	 * its bucket lock keeps BL_BUSY from changing
+	 */
+	bhb = buf_hash_lock(bp);
+
         if (ISSET(bp->b_lflags, BL_BUSY)) {
 	        /*	
 		 * since the lck_mtx_lock may block, the buffer
 		 * may become BUSY, so we need to
 		 * recheck for a NOWAIT request
 		 */
-	        if (flags & BAC_NOWAIT)
+	        if (flags & BAC_NOWAIT) {
+			if (bhb != NULL)
+				bufhash_unlock(bhb);
 			return (EBUSY);
+		}
 	        SET(bp->b_lflags, BL_WANTED);
 
 		/* the hz value is 100; which leads to 10ms */
 		ts.tv_sec = (slptimeo/100);
 		ts.tv_nsec = (slptimeo % 100) * 10  * NSEC_PER_USEC * 1000;
-		error = msleep((caddr_t)bp, buf_mtxp, slpflag | (PRIBIO + 1), "buf_acquire", &ts);
+
+		if (bhb != NULL) {
+			/*
+			 * the owner wakes us under the bucket lock, so
+			 * sleep on that... buf_mtxp comes first in the
+			 * lock order, so retake it after we wake up
+			 */
+			lck_mtx_unlock(buf_mtxp);
+
+			error = msleep((caddr_t)bp, &bhb->bhb_lock, slpflag | PDROP | (PRIBIO + 1), "buf_acquire", &ts);
+
+			lck_mtx_lock(buf_mtxp);
+		} else
+			error = msleep((caddr_t)bp, buf_mtxp, slpflag | (PRIBIO + 1), "buf_acquire", &ts);
 
 		if (error)
 			return (error);
@@ -3834,7 +4384,10 @@ buf_acquire_locked(buf_t bp, int flags, int slpflag, int slptimeo)
 	if (flags & BAC_REMOVE)
 	        bremfree_locked(bp);
 	SET(bp->b_lflags, BL_BUSY);
-	buf_busycount++;
+	OSAddAtomic(1, &buf_busycount);
+
+	if (bhb != NULL)
+		bufhash_unlock(bhb);
 
 #ifdef JOE_DEBUG
 	bp->b_owner = current_thread();
@@ -4018,9 +4571,15 @@ buf_biodone(buf_t bp)
 		 * they do get to run, their going to re-set
 		 * BL_WANTED and go back to sleep
 		 */
+		struct bufhashbucket *bhb;
+
 	        lck_mtx_lock_spin(buf_mtxp);
 
-		CLR(bp->b_lflags, BL_WANTED);
+		if ((bhb = buf_hash_lock(bp)) != NULL) {
+			CLR(bp->b_lflags, BL_WANTED);
+			bufhash_unlock(bhb);
+		} else
+			CLR(bp->b_lflags, BL_WANTED);
 		SET(bp->b_flags, B_DONE);		/* note that it's done */
 
 	        lck_mtx_unlock(buf_mtxp);
@@ -4052,13 +4611,14 @@ count_lock_queue(void)
 {
 	buf_t	bp;
 	int	n = 0;
+	struct bufqueue *bq = &bufqueues[BQ_LOCKED];
 
-	lck_mtx_lock_spin(buf_mtxp);
+	lck_mtx_lock_spin(&bq->bq_lock);
 
-	for (bp = bufqueues[BQ_LOCKED].tqh_first; bp;
+	for (bp = bq->bq_head.tqh_first; bp;
 	    bp = bp->b_freelist.tqe_next)
 		n++;
-	lck_mtx_unlock(buf_mtxp);
+	lck_mtx_unlock(&bq->bq_lock);
 
 	return (n);
 }
@@ -4084,23 +4644,30 @@ vfs_bufstats()
 {
 	int i, j, count;
 	struct buf *bp;
-	struct bqueues *dp;
+	struct bufqueue *bq;
+	unsigned int cpu, ncpus;
 	int counts[MAXBSIZE/CLBYTES+1];
 	static char *bname[BQUEUES] =
 		{ "LOCKED", "LRU", "AGE", "EMPTY", "META", "LAUNDRY" };
 
-	for (dp = bufqueues, i = 0; dp < &bufqueues[BQUEUES]; dp++, i++) {
+	for (i = 0; i < BQUEUES; i++) {
 		count = 0;
 		for (j = 0; j <= MAXBSIZE/CLBYTES; j++)
 			counts[j] = 0;
 
-		lck_mtx_lock(buf_mtxp);
+		ncpus = BQ_PERCPU(i) ? bufq_ncpus : 1;
 
-		for (bp = dp->tqh_first; bp; bp = bp->b_freelist.tqe_next) {
-			counts[bp->b_bufsize/CLBYTES]++;
-			count++;
+		for (cpu = 0; cpu < ncpus; cpu++) {
+			bq = bufqueue(i, cpu);
+
+			lck_mtx_lock(&bq->bq_lock);
+
+			for (bp = bq->bq_head.tqh_first; bp; bp = bp->b_freelist.tqe_next) {
+				counts[bp->b_bufsize/CLBYTES]++;
+				count++;
+			}
+			lck_mtx_unlock(&bq->bq_lock);
 		}
-		lck_mtx_unlock(buf_mtxp);
 
 		printf("%s: total-%d", bname[i], count);
 		for (j = 0; j <= MAXBSIZE/CLBYTES; j++)
@@ -4252,30 +4819,38 @@ bcleanbuf_thread(void)
 	struct buf *bp;
 	int error = 0;
 	int loopcnt = 0;
+	struct bufhashbucket *bhb;
 
 	for (;;) {
 	        lck_mtx_lock_spin(buf_mtxp);
 
-		while ( (bp = TAILQ_FIRST(&bufqueues[BQ_LAUNDRY])) == NULL) {
-			(void)msleep0(&bufqueues[BQ_LAUNDRY], buf_mtxp, PRIBIO|PDROP, "blaundry", 0, (bcleanbufcontinuation)bcleanbuf_thread);
-		}
-		
 		/*
 		 * Remove from the queue
 		 */
-		bremfree_locked(bp);
+		while ( (bp = bufq_take(BQ_LAUNDRY, 0, &bhb)) == NULL) {
+			if (TAILQ_EMPTY(&bufqueues[BQ_LAUNDRY].bq_head))
+				(void)msleep0(&bufqueues[BQ_LAUNDRY], buf_mtxp, PRIBIO|PDROP, "blaundry", 0, (bcleanbufcontinuation)bcleanbuf_thread);
+			/*
+			 * every buffer on it had its bucket locked by
+			 * a lookup... they don't hold them for long
+			 */
+			lck_mtx_unlock(buf_mtxp);
+			mutex_pause(0);
+			lck_mtx_lock_spin(buf_mtxp);
+		}
 
 		/*
 		 * Buffer is no longer on any free list
 		 */
 		SET(bp->b_lflags, BL_BUSY);
-		buf_busycount++;
+		OSAddAtomic(1, &buf_busycount);
 
 #ifdef JOE_DEBUG
 		bp->b_owner = current_thread();
 		bp->b_tag   = 10;
 #endif
-
+		if (bhb != NULL)
+			bufhash_unlock(bhb);
 		lck_mtx_unlock(buf_mtxp);
 		/*
 		 * do the IO
@@ -4283,22 +4858,22 @@ bcleanbuf_thread(void)
 		error = bawrite_internal(bp, 0);
 
 		if (error) {
-		        bp->b_whichq = BQ_LAUNDRY;
 			bp->b_timestamp = buf_timestamp();
 
 		        lck_mtx_lock_spin(buf_mtxp);
+			bhb = buf_hash_lock(bp);
 
-			binstailfree(bp, &bufqueues[BQ_LAUNDRY], BQ_LAUNDRY);
-			blaundrycnt++;
+			binsfree(bp, BQ_LAUNDRY, FALSE);
 
 			/* we never leave a busy page on the laundry queue */
 			CLR(bp->b_lflags, BL_BUSY);
-			buf_busycount--;
+			OSAddAtomic(-1, &buf_busycount);
 #ifdef JOE_DEBUG
 			bp->b_owner = current_thread();
 			bp->b_tag   = 11;
 #endif
-
+			if (bhb != NULL)
+				bufhash_unlock(bhb);
 			lck_mtx_unlock(buf_mtxp);
 			
 			if (loopcnt > MAXLAUNDRY) {
@@ -4385,6 +4960,10 @@ buffer_cache_gc(int all)
 	uint32_t found = 0;
 	struct bqueues privq;
 	int thresh_hold = BUF_STALE_THRESHHOLD;
+	struct bufqueue *bq = &bufqueues[BQ_META];
+	struct bufqueue *ebq;
+	struct bufhashbucket *bhb;
+	int cpu;
 
 	if (all)
 		thresh_hold = 0;
@@ -4404,13 +4983,30 @@ buffer_cache_gc(int all)
 		TAILQ_INIT(&privq);
 		need_wakeup = FALSE;
 
-		while (((bp = TAILQ_FIRST(&bufqueues[BQ_META]))) && 
-				(now > bp->b_timestamp) &&
-				(now - bp->b_timestamp > thresh_hold) && 
-				(found < BUF_MAX_GC_BATCH_SIZE)) {
+		while (found < BUF_MAX_GC_BATCH_SIZE) {
+			/*
+			 * Remove from free list... it's in timestamp order,
+			 * so stop at the first buffer that isn't stale, and
+			 * pass over any whose bucket is locked by a lookup
+			 */
+			lck_mtx_lock_spin(&bq->bq_lock);
 
-			/* Remove from free list */
-			bremfree_locked(bp);
+			TAILQ_FOREACH(bp, &bq->bq_head, b_freelist) {
+				if (!(now > bp->b_timestamp) ||
+				    !(now - bp->b_timestamp > thresh_hold)) {
+					bp = NULL;
+					break;
+				}
+				if (buf_hash_trylock(bp, &bhb))
+					break;
+			}
+			if (bp != NULL)
+				bufq_remove(bq, bp);
+
+			lck_mtx_unlock(&bq->bq_lock);
+
+			if (bp == NULL)
+				break;
 			found++;
 
 #ifdef JOE_DEBUG
@@ -4425,6 +5021,8 @@ buffer_cache_gc(int all)
 				bmovelaundry(bp);
 				need_wakeup = TRUE;
 
+				if (bhb != NULL)
+					bufhash_unlock(bhb);
 				continue;
 			}
 
@@ -4433,12 +5031,16 @@ buffer_cache_gc(int all)
 			 * away without setting BL_BUSY here.
 			 */
 			SET(bp->b_lflags, BL_BUSY);
-			buf_busycount++;
+			OSAddAtomic(1, &buf_busycount);
 
 			/* 
 			 * Remove from hash and dissociate from vp.
 			 */
-			bremhash(bp);
+			if (bhb != NULL) {
+				bremhash(bp);
+				BLISTNONE(bp);
+				bufhash_unlock(bhb);
+			}
 			if (bp->b_vp) {
 				brelvp_locked(bp);
 			}
@@ -4477,16 +5079,18 @@ buffer_cache_gc(int all)
 			/* Prepare for moving to empty queue */
 			CLR(bp->b_flags, (B_META | B_ZALLOC | B_DELWRI | B_LOCKED 
 						| B_AGE | B_ASYNC | B_NOCACHE | B_FUA));
-			bp->b_whichq = BQ_EMPTY;
-			BLISTNONE(bp);
 		}
 		lck_mtx_lock(buf_mtxp);
 
-		/* Back under lock, move them all to invalid hash and clear busy */
+		cpu = cpu_number();
+		ebq = bufqueue(BQ_EMPTY, cpu);
+
+		/* Back under lock, clear busy */
 		TAILQ_FOREACH(bp, &privq, b_freelist) {
-			binshash(bp, &invalhash);
+			bp->b_whichq = BQ_EMPTY;
+			bp->b_whichcpu = cpu;
 			CLR(bp->b_lflags, BL_BUSY);
-			buf_busycount--;
+			OSAddAtomic(-1, &buf_busycount);
 
 #ifdef JOE_DEBUG
 			if (bp->b_owner != current_thread()) {
@@ -4498,7 +5102,9 @@ buffer_cache_gc(int all)
 		}
 
 		/* And do a big bulk move to the empty queue */
-		TAILQ_CONCAT(&bufqueues[BQ_EMPTY], &privq, b_freelist);
+		lck_mtx_lock_spin(&ebq->bq_lock);
+		TAILQ_CONCAT(&ebq->bq_head, &privq, b_freelist);
+		lck_mtx_unlock(&ebq->bq_lock);
 
 	} while (all && (found == BUF_MAX_GC_BATCH_SIZE));
 
@@ -4539,38 +5145,51 @@ bflushq(int whichq, mount_t mp)
 	int	i, buf_count;
 	int	total_writes = 0;
 	static buf_t flush_table[NFLUSH];
+	struct bufqueue *bq;
+	struct bufhashbucket *bhb;
+	unsigned int cpu, ncpus;
 
 	if (whichq < 0 || whichq >= BQUEUES) {
 	    return (0);
 	}
+	ncpus = BQ_PERCPU(whichq) ? bufq_ncpus : 1;
 
   restart:
 	lck_mtx_lock(buf_mtxp);
 
-	bp = TAILQ_FIRST(&bufqueues[whichq]);
+	buf_count = 0;
 
-	for (buf_count = 0; bp; bp = next) {
+	for (cpu = 0; cpu < ncpus; cpu++) {
+	  bq = bufqueue(whichq, cpu);
+
+	  lck_mtx_lock_spin(&bq->bq_lock);
+
+	  for (bp = TAILQ_FIRST(&bq->bq_head); bp; bp = next) {
 	    next = bp->b_freelist.tqe_next;
 			
 	    if (bp->b_vp == NULL || bp->b_vp->v_mount != mp) {
 		continue;
 	    }
 
-	    if (ISSET(bp->b_flags, B_DELWRI) && !ISSET(bp->b_lflags, BL_BUSY)) {
+	    if (ISSET(bp->b_flags, B_DELWRI) && buf_hash_trylock(bp, &bhb)) {
 
-		bremfree_locked(bp);
+		bufq_remove(bq, bp);
 #ifdef JOE_DEBUG
 		bp->b_owner = current_thread();
 		bp->b_tag   = 7;
 #endif
 		SET(bp->b_lflags, BL_BUSY);
-		buf_busycount++;
+		OSAddAtomic(1, &buf_busycount);
+
+		if (bhb != NULL)
+		    bufhash_unlock(bhb);
 
 		flush_table[buf_count] = bp;
 		buf_count++;
 		total_writes++;
 
 		if (buf_count >= NFLUSH) {
+		    lck_mtx_unlock(&bq->bq_lock);
 		    lck_mtx_unlock(buf_mtxp);
 
 		    qsort(flush_table, buf_count, sizeof(struct buf *), bp_cmp);
@@ -4581,6 +5200,8 @@ bflushq(int whichq, mount_t mp)
 		    goto restart;
 		}
 	    }
+	  }
+	  lck_mtx_unlock(&bq->bq_lock);
 	}
 	lck_mtx_unlock(buf_mtxp);
 
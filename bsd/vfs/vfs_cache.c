@@ -82,6 +82,11 @@
 #include <sys/kauth.h>
 #include <sys/user.h>
 #include <sys/paths.h>
+#include <sys/mcache.h>
+#include <kern/cpu_number.h>
+#include <kern/cpu_data.h>
+#include <machine/machine_routines.h>
+#include <libkern/OSAtomic.h>
 
 #if CONFIG_MACF
 #include <security/mac_framework.h>
@@ -131,6 +136,8 @@ struct	nchstats nchstats;		/* cache effectiveness statistics */
 #define NAME_CACHE_UNLOCK()		name_cache_unlock()
 #define	NAME_CACHE_LOCK_SHARED()	name_cache_lock()
 
+int	nc_lockless = 0;		/* stats are kept under the lock */
+
 #else
 
 #define NCHSTAT(v)
@@ -138,6 +145,8 @@ struct	nchstats nchstats;		/* cache effectiveness statistics */
 #define NAME_CACHE_UNLOCK()		name_cache_unlock()
 #define	NAME_CACHE_LOCK_SHARED()	name_cache_lock_shared()
 
+int	nc_lockless = 1;
+
 #endif
 
 
@@ -157,6 +166,31 @@ lck_rw_t  * strtable_rw_lock;
 
 lck_mtx_t strcache_mtx_locks[NUM_STRCACHE_LOCKS];
 
+/*
+ * Lockless lookups.
+ *
+ * cache_lookup_path() and cache_lookup() can search the cache without
+ * taking namecache_rw_lock, which otherwise has every lookup on every
+ * CPU writing to the same cache line.  A lockless reader marks itself
+ * active in its CPU's slot, with preemption disabled, and then checks
+ * the name cache generation: an odd generation means that a writer has
+ * the lock exclusive, and the reader backs off to the shared lock.
+ *
+ * A writer makes the generation odd as soon as it holds the lock, then
+ * waits for the readers that are still active to leave.  A lockless
+ * reader is thus excluded by writers exactly as a shared lock holder
+ * would be, and taking the lock exclusive still keeps everyone out of
+ * the fast path.  In exchange the reader may not block, so lookups that
+ * need a MAC check or the authorization TTL always take the lock.
+ */
+struct nc_reader {
+	volatile uint32_t	ncr_active;	/* odd while in a lookup */
+} __attribute__((aligned(MAX_CPU_CACHE_LINE_SIZE)));
+
+static struct nc_reader	*nc_readers;		/* one per CPU */
+static unsigned int	nc_nreaders;
+static volatile uint32_t nc_generation;		/* odd while write locked */
+
 
 static vnode_t cache_lookup_locked(vnode_t dvp, struct componentname *cnp);
 static const char *add_name_internal(const char *, uint32_t, u_int, boolean_t, u_int);
@@ -174,6 +208,11 @@ void dump_string_table(void);
 static void init_crc32(void);
 static unsigned int crc32tab[256];
 
+static boolean_t nc_read_enter(struct nc_reader **);
+static void nc_read_exit(struct nc_reader *);
+static boolean_t cache_lookup_lockless_ok(struct componentname *, vfs_context_t);
+static struct namecache *cache_lookup_entry(vnode_t, struct componentname *);
+
 
 #define NCHHASH(dvp, hash_val) \
 	(&nchashtbl[(dvp->v_id ^ (hash_val)) & nchashmask])
@@ -1056,6 +1095,7 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
         mount_t		mp;
 	unsigned int	hash;
 	int		error = 0;
+	struct nc_reader *ncr = NULL;	/* set when walking without the lock */
 
 #if CONFIG_TRIGGERS
 	vnode_t 	trigger_vp;
@@ -1064,12 +1104,13 @@ cache_lookup_path(struct nameidata *ndp, struct componentname *cnp, vnode_t dp,
 	ucred = vfs_context_ucred(ctx);
 	ndp->ni_flag &= ~(NAMEI_TRAILINGSLASH);
 
-	NAME_CACHE_LOCK_SHARED();
-
 	if ( dp->v_mount && (dp->v_mount->mnt_kern_flag & (MNTK_AUTH_OPAQUE | MNTK_AUTH_CACHE_TTL)) ) {
 		ttl_enabled = TRUE;
 		microuptime(&tv);
 	}
+	if (ttl_enabled || !cache_lookup_lockless_ok(cnp, ctx) ||
+	    !nc_read_enter(&ncr))
+		NAME_CACHE_LOCK_SHARED();
 	for (;;) {
 		/*
 		 * Search a directory.
@@ -1159,7 +1200,10 @@ skiprsrcfork:
 		if (!(cnp->cn_flags & DONOTAUTH)) {
 			error = mac_vnode_check_lookup(ctx, dp, cnp);
 			if (error) {
-				NAME_CACHE_UNLOCK();
+				if (ncr != NULL)
+					nc_read_exit(ncr);
+				else
+					NAME_CACHE_UNLOCK();
 				goto errorout;
 			}
 		}
@@ -1282,7 +1326,10 @@ skiprsrcfork:
 	        vvid = vp->v_id;
 	vid = dp->v_id;
 	
-	NAME_CACHE_UNLOCK();
+	if (ncr != NULL)
+		nc_read_exit(ncr);
+	else
+		NAME_CACHE_UNLOCK();
 
 	if ((vp != NULLVP) && (vp->v_type != VLNK) &&
 	    ((cnp->cn_flags & (ISLASTCN | LOCKPARENT | WANTPARENT | SAVESTART)) == ISLASTCN)) {
@@ -1400,17 +1447,17 @@ errorout:
 }
 
 
-static vnode_t
-cache_lookup_locked(vnode_t dvp, struct componentname *cnp)
+/*
+ * Search the hash chain for (dvp, name); called with the name cache
+ * lock held, or from a lockless reader.
+ */
+static struct namecache *
+cache_lookup_entry(vnode_t dvp, struct componentname *cnp)
 {
 	struct namecache *ncp;
 	struct nchashhead *ncpp;
 	long namelen = cnp->cn_namelen;
 	unsigned int hashval = cnp->cn_hash;
-	
-	if (nc_disabled) {
-		return NULL;
-	}
 
 	ncpp = NCHHASH(dvp, cnp->cn_hash);
 	LIST_FOREACH(ncp, ncpp, nc_hash) {
@@ -1419,6 +1466,19 @@ cache_lookup_locked(vnode_t dvp, struct componentname *cnp)
 			        break;
 		}
 	}
+	return (ncp);
+}
+
+static vnode_t
+cache_lookup_locked(vnode_t dvp, struct componentname *cnp)
+{
+	struct namecache *ncp;
+	
+	if (nc_disabled) {
+		return NULL;
+	}
+
+	ncp = cache_lookup_entry(dvp, cnp);
 	if (ncp == 0) {
 		/*
 		 * We failed to find an entry
@@ -1481,35 +1541,35 @@ int
 cache_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp)
 {
 	struct namecache *ncp;
-	struct nchashhead *ncpp;
-	long namelen = cnp->cn_namelen;
-	unsigned int hashval;
 	boolean_t	have_exclusive = FALSE;
 	uint32_t vid;
 	vnode_t	 vp;
+	struct nc_reader *ncr = NULL;	/* set when searching without the lock */
 
 	if (cnp->cn_hash == 0)
 		cnp->cn_hash = hash_string(cnp->cn_nameptr, cnp->cn_namelen);
-	hashval = cnp->cn_hash;
 
 	if (nc_disabled) {
 		return 0;
 	}
 
-	NAME_CACHE_LOCK_SHARED();
+	/*
+	 * Lookups that may have to delete the entry need the lock.
+	 */
+	if (!(cnp->cn_flags & MAKEENTRY) || !cache_lookup_lockless_ok(cnp, NULL) ||
+	    !nc_read_enter(&ncr))
+		NAME_CACHE_LOCK_SHARED();
 
 relook:
-	ncpp = NCHHASH(dvp, cnp->cn_hash);
-	LIST_FOREACH(ncp, ncpp, nc_hash) {
-	        if ((ncp->nc_dvp == dvp) && (ncp->nc_hashval == hashval)) {
-			if (memcmp(ncp->nc_name, cnp->cn_nameptr, namelen) == 0 && ncp->nc_name[namelen] == 0)
-			        break;
-		}
-	}
+	ncp = cache_lookup_entry(dvp, cnp);
+
 	/* We failed to find an entry */
 	if (ncp == 0) {
 		NCHSTAT(ncs_miss);
-		NAME_CACHE_UNLOCK();
+		if (ncr != NULL)
+			nc_read_exit(ncr);
+		else
+			NAME_CACHE_UNLOCK();
 		return (0);
 	}
 
@@ -1533,7 +1593,10 @@ relook:
 		NCHSTAT(ncs_goodhits);
 
 		vid = vp->v_id;
-		NAME_CACHE_UNLOCK();
+		if (ncr != NULL)
+			nc_read_exit(ncr);
+		else
+			NAME_CACHE_UNLOCK();
 
 		if (vnode_getwithvid(vp, vid)) {
 #if COLLECT_STATS
@@ -1555,7 +1618,11 @@ relook:
 			NAME_CACHE_UNLOCK();
 			return (0);
 		}
-		NAME_CACHE_UNLOCK();
+		if (ncr != NULL) {
+			nc_read_exit(ncr);
+			ncr = NULL;
+		} else
+			NAME_CACHE_UNLOCK();
 		NAME_CACHE_LOCK();
 		have_exclusive = TRUE;
 		goto relook;
@@ -1566,7 +1633,10 @@ relook:
 	 */
 	NCHSTAT(ncs_neghits);
 
-	NAME_CACHE_UNLOCK();
+	if (ncr != NULL)
+		nc_read_exit(ncr);
+	else
+		NAME_CACHE_UNLOCK();
 	return (ENOENT);
 }
 
@@ -1812,6 +1882,12 @@ nchinit(void)
 	nchash++;
 
 	init_string_table();
+
+	/* lockless readers; never freed, so CPUs don't share a line */
+	nc_nreaders = ml_get_max_cpus();
+	nc_readers = (struct nc_reader *)P2ROUNDUP((intptr_t)_MALLOC(
+	    nc_nreaders * sizeof (struct nc_reader) + MAX_CPU_CACHE_LINE_SIZE,
+	    M_CACHE, M_WAITOK | M_ZERO), MAX_CPU_CACHE_LINE_SIZE);
 	
 	/* Allocate name cache lock group attribute and group */
 	namecache_lck_grp_attr= lck_grp_attr_alloc_init();
@@ -1849,15 +1925,89 @@ name_cache_lock_shared(void)
 void
 name_cache_lock(void)
 {
+	uint32_t active;
+	unsigned int i;
+
 	lck_rw_lock_exclusive(namecache_rw_lock);
+
+	/*
+	 * Turn new lockless readers away, then wait for the ones still
+	 * walking the cache; they don't block, so this is short.
+	 */
+	nc_generation++;
+	OSMemoryBarrier();
+	for (i = 0; i < nc_nreaders; i++) {
+		active = nc_readers[i].ncr_active;
+		if (active & 1) {
+			while (nc_readers[i].ncr_active == active)
+				continue;
+		}
+	}
 }
 
 void
 name_cache_unlock(void)
 {
+	/* only odd while we hold it exclusive */
+	if (nc_generation & 1) {
+		OSMemoryBarrier();
+		nc_generation++;
+	}
 	lck_rw_done(namecache_rw_lock);
 }
 
+/*
+ * Start a lockless lookup on this CPU.  Returns FALSE, having undone
+ * everything, if a writer holds the lock; the caller then takes it
+ * shared.  Must be paired with nc_read_exit() without blocking in
+ * between.
+ */
+static boolean_t
+nc_read_enter(struct nc_reader **ncrp)
+{
+	struct nc_reader *ncr;
+
+	if (!nc_lockless)
+		return (FALSE);
+
+	disable_preemption();
+	ncr = &nc_readers[cpu_number()];
+	ncr->ncr_active++;
+	OSMemoryBarrier();	/* pairs with the one in name_cache_lock() */
+	if (nc_generation & 1) {
+		ncr->ncr_active++;
+		enable_preemption();
+		return (FALSE);
+	}
+	*ncrp = ncr;
+	return (TRUE);
+}
+
+static void
+nc_read_exit(struct nc_reader *ncr)
+{
+	OSMemoryBarrier();	/* our loads are done before the writer goes */
+	ncr->ncr_active++;
+	enable_preemption();
+}
+
+/*
+ * A lookup may go lockless only if nothing it calls can block; ctx is
+ * NULL for callers that make no MAC check.
+ */
+static boolean_t
+cache_lookup_lockless_ok(struct componentname *cnp, vfs_context_t ctx)
+{
+#if CONFIG_MACF
+	if (ctx != NULL && !(cnp->cn_flags & DONOTAUTH) &&
+	    mac_vnode_check_lookup_needed(ctx))
+		return (FALSE);
+#else
+#pragma unused(cnp, ctx)
+#endif
+	return (nc_readers != NULL);
+}
+
 
 int
 resize_namecache(u_int newsize)
@@ -1868,7 +2018,7 @@ resize_namecache(u_int newsize)
     struct namecache 	*entry, *next;
     uint32_t		i, hashval;
     int			dNodes, dNegNodes;
-    u_long		new_size, old_size;
+    u_long		new_size, old_size, new_mask;
 
     dNegNodes = (newsize / 10);
     dNodes = newsize + dNegNodes;
@@ -1877,8 +2027,8 @@ resize_namecache(u_int newsize)
     if (dNodes <= desiredNodes) {
 	return 0;
     }
-    new_table = hashinit(2 * dNodes, M_CACHE, &nchashmask);
-    new_size  = nchashmask + 1;
+    new_table = hashinit(2 * dNodes, M_CACHE, &new_mask);
+    new_size  = new_mask + 1;
 
     if (new_table == NULL) {
 	return ENOMEM;
@@ -1886,10 +2036,12 @@ resize_namecache(u_int newsize)
 
     NAME_CACHE_LOCK();
     // do the switch!
-    old_table = nchashtbl;
-    nchashtbl = new_table;
-    old_size  = nchash;
-    nchash    = new_size;
+    // the mask goes with the table: no one may see it before the lock
+    old_table  = nchashtbl;
+    nchashtbl  = new_table;
+    nchashmask = new_mask;
+    old_size   = nchash;
+    nchash     = new_size;
 
     // walk the old table and insert all the entries into
     // the new table
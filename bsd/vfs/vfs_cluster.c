@@ -190,7 +190,8 @@ static int cluster_write_contig(vnode_t vp, struct uio *uio, off_t newEOF,
 static int cluster_align_phys_io(vnode_t vp, struct uio *uio, addr64_t usr_paddr, u_int32_t xsize, int flags, int (*)(buf_t, void *), void *callback_arg);
 
 static int 	cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
-static void	cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *ra, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
+static void	cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_rastream *ras, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
+static void	cluster_read_ahead_strided(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_rastream *ras, int (*callback)(buf_t, void *), void *callback_arg, int bflag);
 
 static int	cluster_push_now(vnode_t vp, struct cl_extent *, off_t EOF, int flags, int (*)(buf_t, void *), void *callback_arg);
 
@@ -253,6 +254,19 @@ uint32_t speculative_prefetch_max_iosize = (512 * 1024);	/* maximum I/O size to
 #define MAX_CLUSTER_SIZE(vp)		(cluster_max_io_size(vp->v_mount, CL_WRITE))
 #define MAX_PREFETCH(vp, size, is_ssd)	(size * IO_SCALE(vp, ((is_ssd && !ignore_is_ssd) ? PREFETCH_SSD : PREFETCH)))
 
+/*
+ * read ahead windows start at MAX_PREFETCH and adapt from there...
+ * a stream whose reader keeps catching up with the read ahead doubles
+ * its window, one that throws prefetched pages away halves it.  on
+ * devices whose reads take longer than CL_RA_SLOWDEV usecs on average
+ * a window may grow to CL_RA_SLOWSCALE times MAX_PREFETCH, otherwise
+ * MAX_PREFETCH remains the limit
+ */
+#define CL_RA_MINWIN		4		/* pages */
+#define CL_RA_SLOWDEV		2000		/* usecs */
+#define CL_RA_SLOWSCALE		4
+#define CL_RA_MAXSTRIDE		((16 * 1024 * 1024) / PAGE_SIZE)	/* largest stride recognized, in pages */
+
 int	ignore_is_ssd = 0;
 int	speculative_reads_disabled = 0;
 
@@ -342,6 +356,134 @@ cluster_max_io_size(mount_t mp, int type)
 #define CLW_IONOCACHE		0x04
 #define CLW_IOPASSIVE	0x08
 
+/*
+ * the read ahead window a stream starts out with, in pages
+ */
+static int
+cluster_ra_basewin(vnode_t vp)
+{
+	u_int	max_prefetch;
+
+	max_prefetch = MAX_PREFETCH(vp, cluster_max_io_size(vp->v_mount, CL_READ), (vp->v_mount->mnt_kern_flag & MNTK_SSD));
+
+	if (max_prefetch > speculative_prefetch_max)
+		max_prefetch = speculative_prefetch_max;
+
+	return (max_prefetch / PAGE_SIZE);
+}
+
+
+/*
+ * does this read pick up where the stream left off?
+ */
+static __inline__ int
+cluster_ra_follows(struct cl_rastream *ras, struct cl_extent *extent)
+{
+	if (ras->cl_lastr == -1)
+		return (0);
+
+	if (extent->b_addr == ras->cl_lastr || extent->b_addr == (ras->cl_lastr + 1))
+		return (1);
+
+	return (ras->cl_stride && extent->b_addr == ras->cl_firstr + ras->cl_stride);
+}
+
+
+/*
+ * the stream's read ahead is being abandoned... whatever
+ * it prefetched that hasn't been read by now was wasted,
+ * so give the stream a smaller window to read ahead with
+ */
+static void
+cluster_ra_reset(vnode_t vp, struct cl_rastream *ras)
+{
+	if (ras->cl_pending) {
+		OSAddAtomic64(ras->cl_pending, &vp->v_mount->mnt_ra_waste);
+
+		if (ras->cl_pending > ras->cl_rawin / 4)
+			ras->cl_rawin = max(ras->cl_rawin / 2, CL_RA_MINWIN);
+		ras->cl_pending = 0;
+	}
+	ras->cl_maxra = 0;
+}
+
+
+/*
+ * a reader of the stream had to issue I/O that the read
+ * ahead should have... let the stream read further ahead,
+ * further still on a device that is slow to respond
+ */
+static void
+cluster_ra_grow(vnode_t vp, struct cl_rastream *ras)
+{
+	int	maxwin;
+
+	maxwin = cluster_ra_basewin(vp);
+
+	if (vp->v_mount->mnt_ra_latency >= CL_RA_SLOWDEV)
+		maxwin *= CL_RA_SLOWSCALE;
+
+	if (ras->cl_rawin < maxwin)
+		ras->cl_rawin = min(ras->cl_rawin * 2, maxwin);
+}
+
+
+/*
+ * fold how long a read waited on its own I/O
+ * into the mount's running average
+ */
+static void
+cluster_ra_latency(vnode_t vp, struct timeval *start)
+{
+	struct timeval	now;
+	mount_t		mp;
+	uint32_t	usecs;
+
+	mp = vp->v_mount;
+
+	microuptime(&now);
+	timevalsub(&now, start);
+
+	if (now.tv_sec >= 1)
+		usecs = 1000000;
+	else
+		usecs = now.tv_usec;
+
+	mp->mnt_ra_latency = (mp->mnt_ra_latency * 7 + usecs) / 8;
+}
+
+
+/*
+ * the read has finished with the stream... credit the
+ * pages it found already read ahead, and remember where
+ * it was for the next read to continue from
+ */
+static void
+cluster_ra_done(vnode_t vp, struct cl_rastream *ras, struct cl_extent *extent)
+{
+	daddr64_t	b_addr;
+	daddr64_t	e_addr;
+	int		hits;
+
+	if (ras->cl_pending && extent->b_addr <= ras->cl_maxra) {
+		b_addr = max(extent->b_addr, ras->cl_lastr + 1);
+		e_addr = min(extent->e_addr, ras->cl_maxra);
+
+		if (e_addr >= b_addr) {
+			hits = min((int)(e_addr - b_addr) + 1, ras->cl_pending);
+
+			OSAddAtomic64(hits, &vp->v_mount->mnt_ra_hits);
+			ras->cl_pending -= hits;
+		}
+	}
+	if (extent->e_addr < ras->cl_lastr)
+		cluster_ra_reset(vp, ras);
+
+	ras->cl_firstr = extent->b_addr;
+	ras->cl_lastr = extent->e_addr;
+}
+
+
 /*
  * if the read ahead context doesn't yet exist,
  * allocate and initialize it...
@@ -350,20 +492,25 @@ cluster_max_io_size(mount_t mp, int type)
  * to grab the lock wins... the other callers
  * will release the now unnecessary storage
  * 
- * once the context is present, try to grab (but don't block on)
- * the lock associated with it... if someone
- * else currently owns it, than the read
- * will run without read-ahead.  this allows
- * multiple readers to run in parallel and
- * since there's only 1 read ahead context,
- * there's no real loss in only allowing 1
- * reader to have read-ahead enabled.
+ * once the context is present, claim the stream
+ * this read continues... either sequentially, or
+ * a stride past the last read of a strided stream.
+ * a read that continues none of them takes over the
+ * least recently used stream.  streams are claimed
+ * for the duration of a read, so multiple readers
+ * of the same file each keep their own read ahead...
+ * if every stream is already claimed, the read
+ * runs without read-ahead
  */
-static struct cl_readahead *
-cluster_get_rap(vnode_t vp)
+static struct cl_rastream *
+cluster_get_rap(vnode_t vp, struct cl_extent *extent)
 {
         struct ubc_info		*ubc;
 	struct cl_readahead	*rap;
+	struct cl_rastream	*ras;
+	struct cl_rastream	*victim = NULL;
+	daddr64_t		stride;
+	int			i;
 
 	ubc = vp->v_ubcinfo;
 
@@ -371,7 +518,8 @@ cluster_get_rap(vnode_t vp)
 	        MALLOC_ZONE(rap, struct cl_readahead *, sizeof *rap, M_CLRDAHEAD, M_WAITOK);
 
 		bzero(rap, sizeof *rap);
-		rap->cl_lastr = -1;
+		for (i = 0; i < CL_RASTREAMS; i++)
+			rap->cl_streams[i].cl_lastr = -1;
 		lck_mtx_init(&rap->cl_lockr, cl_mtx_grp, cl_mtx_attr);
 
 		vnode_lock(vp);
@@ -385,10 +533,82 @@ cluster_get_rap(vnode_t vp)
 		}
 		vnode_unlock(vp);
 	}
-	if (lck_mtx_try_lock(&rap->cl_lockr) == TRUE)
-	        return(rap);
-	
-	return ((struct cl_readahead *)NULL);
+	lck_mtx_lock_spin(&rap->cl_lockr);
+
+	for (i = 0; i < CL_RASTREAMS; i++) {
+	        ras = &rap->cl_streams[i];
+
+		if (ras->cl_busy)
+		        continue;
+
+		if (cluster_ra_follows(ras, extent)) {
+		        if (extent->b_addr == ras->cl_lastr || extent->b_addr == (ras->cl_lastr + 1)) {
+			        ras->cl_stride = 0;
+				ras->cl_strideseq = 0;
+			} else if (ras->cl_strideseq < 2)
+			        ras->cl_strideseq++;
+			goto claim;
+		}
+		if (victim == NULL || (victim->cl_lastr != -1 &&
+		    (ras->cl_lastr == -1 || (int32_t)(ras->cl_lastuse - victim->cl_lastuse) < 0)))
+		        victim = ras;
+	}
+	/*
+	 * no stream continues here... a stream that hasn't
+	 * started reading ahead yet and whose last read was
+	 * the same size as this one, a little way before it,
+	 * becomes a strided stream.  random reads of one size
+	 * do this all the time, so the stream doesn't read
+	 * ahead until a third read confirms the stride
+	 */
+	for (i = 0; i < CL_RASTREAMS; i++) {
+	        ras = &rap->cl_streams[i];
+
+		if (ras->cl_busy || ras->cl_lastr == -1 || ras->cl_ralen || ras->cl_stride)
+		        continue;
+
+		stride = extent->b_addr - ras->cl_firstr;
+
+		if (stride > (ras->cl_lastr - ras->cl_firstr) + 1 && stride <= CL_RA_MAXSTRIDE &&
+		    (extent->e_addr - extent->b_addr) == (ras->cl_lastr - ras->cl_firstr)) {
+		        ras->cl_stride = (int)stride;
+			ras->cl_strideseq = 1;
+			goto claim;
+		}
+	}
+	if ((ras = victim) == NULL) {
+	        lck_mtx_unlock(&rap->cl_lockr);
+
+		return ((struct cl_rastream *)NULL);
+	}
+	cluster_ra_reset(vp, ras);
+
+	ras->cl_firstr = 0;
+	ras->cl_lastr = -1;
+	ras->cl_ralen = 0;
+	ras->cl_rawin = 0;
+	ras->cl_stride = 0;
+	ras->cl_strideseq = 0;
+claim:
+	ras->cl_busy = 1;
+	ras->cl_lastuse = ++rap->cl_clock;
+
+	lck_mtx_unlock(&rap->cl_lockr);
+
+	return (ras);
+}
+
+
+static void
+cluster_release_rap(vnode_t vp, struct cl_rastream *ras)
+{
+	struct cl_readahead	*rap;
+
+	rap = vp->v_ubcinfo->cl_rahead;
+
+	lck_mtx_lock_spin(&rap->cl_lockr);
+	ras->cl_busy = 0;
+	lck_mtx_unlock(&rap->cl_lockr);
 }
 
 
@@ -1688,51 +1908,55 @@ cluster_read_prefetch(vnode_t vp, off_t f_offset, u_int size, off_t filesize, in
 
 
 static void
-cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_readahead *rap, int (*callback)(buf_t, void *), void *callback_arg,
+cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_rastream *ras, int (*callback)(buf_t, void *), void *callback_arg,
 		   int bflag)
 {
 	daddr64_t	r_addr;
 	off_t		f_offset;
 	int		size_of_prefetch;
-	u_int		max_prefetch;
+	int		basewin;
 
 
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_START,
-		     (int)extent->b_addr, (int)extent->e_addr, (int)rap->cl_lastr, 0, 0);
+		     (int)extent->b_addr, (int)extent->e_addr, (int)ras->cl_lastr, 0, 0);
 
-	if (extent->b_addr == rap->cl_lastr && extent->b_addr == extent->e_addr) {
+	if (extent->b_addr == ras->cl_lastr && extent->b_addr == extent->e_addr) {
 		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
-			     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 0, 0);
+			     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 0, 0);
 		return;
 	}
-	if (rap->cl_lastr == -1 || (extent->b_addr != rap->cl_lastr && extent->b_addr != (rap->cl_lastr + 1))) {
-	        rap->cl_ralen = 0;
-		rap->cl_maxra = 0;
+	if ( !cluster_ra_follows(ras, extent)) {
+	        ras->cl_ralen = 0;
+		cluster_ra_reset(vp, ras);
 
 		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
-			     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 1, 0);
+			     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 1, 0);
 
 		return;
 	}
-	max_prefetch = MAX_PREFETCH(vp, cluster_max_io_size(vp->v_mount, CL_READ), (vp->v_mount->mnt_kern_flag & MNTK_SSD));
+	basewin = cluster_ra_basewin(vp);
 
-	if (max_prefetch > speculative_prefetch_max)
-		max_prefetch = speculative_prefetch_max;
-
-	if (max_prefetch <= PAGE_SIZE) {
+	if (basewin <= 1) {
 		KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
-			     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 6, 0);
+			     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 6, 0);
+		return;
+	}
+	if (ras->cl_rawin == 0)
+	        ras->cl_rawin = basewin;
+
+	if (ras->cl_stride) {
+	        cluster_read_ahead_strided(vp, extent, filesize, ras, callback, callback_arg, bflag);
 		return;
 	}
-	if (extent->e_addr < rap->cl_maxra && rap->cl_ralen >= 4) {
-	        if ((rap->cl_maxra - extent->e_addr) > (rap->cl_ralen / 4)) {
+	if (extent->e_addr < ras->cl_maxra && ras->cl_ralen >= 4) {
+	        if ((ras->cl_maxra - extent->e_addr) > (ras->cl_ralen / 4)) {
 
 		        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
-				     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 2, 0);
+				     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 2, 0);
 			return;
 		}
 	}
-	r_addr = max(extent->e_addr, rap->cl_maxra) + 1;
+	r_addr = max(extent->e_addr, ras->cl_maxra) + 1;
 	f_offset = (off_t)(r_addr * PAGE_SIZE_64);
 
         size_of_prefetch = 0;
@@ -1741,29 +1965,124 @@ cluster_read_ahead(vnode_t vp, struct cl_extent *extent, off_t filesize, struct
 
 	if (size_of_prefetch) {
 	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
-			     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 3, 0);
+			     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 3, 0);
 		return;
 	}
 	if (f_offset < filesize) {
 	        daddr64_t read_size;
 
-	        rap->cl_ralen = rap->cl_ralen ? min(max_prefetch / PAGE_SIZE, rap->cl_ralen << 1) : 1;
+		if (ras->cl_ralen == 0)
+		        OSAddAtomic64(1, &vp->v_mount->mnt_ra_streams);
+
+	        ras->cl_ralen = ras->cl_ralen ? min(ras->cl_rawin, ras->cl_ralen << 1) : 1;
 
 		read_size = (extent->e_addr + 1) - extent->b_addr;
 
-		if (read_size > rap->cl_ralen) {
-		        if (read_size > max_prefetch / PAGE_SIZE)
-			        rap->cl_ralen = max_prefetch / PAGE_SIZE;
+		if (read_size > ras->cl_ralen) {
+		        if (read_size > ras->cl_rawin)
+			        ras->cl_ralen = ras->cl_rawin;
 			else
-			        rap->cl_ralen = read_size;
+			        ras->cl_ralen = read_size;
 		}
-		size_of_prefetch = cluster_read_prefetch(vp, f_offset, rap->cl_ralen * PAGE_SIZE, filesize, callback, callback_arg, bflag);
+		size_of_prefetch = cluster_read_prefetch(vp, f_offset, ras->cl_ralen * PAGE_SIZE, filesize, callback, callback_arg, bflag);
+
+		if (size_of_prefetch) {
+		        ras->cl_maxra = (r_addr + size_of_prefetch) - 1;
+			ras->cl_pending += size_of_prefetch;
 
-		if (size_of_prefetch)
-		        rap->cl_maxra = (r_addr + size_of_prefetch) - 1;
+			OSAddAtomic64(size_of_prefetch, &vp->v_mount->mnt_ra_pages);
+		}
 	}
 	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
-		     rap->cl_ralen, (int)rap->cl_maxra, (int)rap->cl_lastr, 4, 0);
+		     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 4, 0);
+}
+
+
+/*
+ * read ahead for a stream of equal sized reads a fixed
+ * stride apart... rather than the pages that follow this
+ * read, prefetch the reads the stream will make next,
+ * as many of them as fit in cl_ralen pages.  nothing is
+ * prefetched until three reads in a row have kept to the
+ * stride, or if the stream's window has shrunk below the
+ * size of one read
+ */
+static void
+cluster_read_ahead_strided(vnode_t vp, struct cl_extent *extent, off_t filesize, struct cl_rastream *ras, int (*callback)(buf_t, void *), void *callback_arg,
+			   int bflag)
+{
+	daddr64_t	r_addr;
+	off_t		f_offset;
+	int		size_of_prefetch;
+	int		read_size;
+	int		prefetched;
+
+	read_size = (int)((extent->e_addr + 1) - extent->b_addr);
+
+	if (read_size >= ras->cl_stride || read_size > ras->cl_rawin) {
+	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
+			     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 7, 0);
+		return;
+	}
+	if (ras->cl_strideseq < 2) {
+	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
+			     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 8, 0);
+		return;
+	}
+	/*
+	 * the first read of the stream not yet prefetched
+	 */
+	r_addr = extent->b_addr + ras->cl_stride;
+
+	if (ras->cl_maxra >= r_addr)
+	        r_addr += (((ras->cl_maxra - r_addr) / ras->cl_stride) + 1) * ras->cl_stride;
+
+	if (ras->cl_ralen >= 4) {
+	        if ((((r_addr - extent->b_addr) / ras->cl_stride) - 1) * read_size > (ras->cl_ralen / 4)) {
+
+		        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
+				     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 2, 0);
+			return;
+		}
+	}
+	f_offset = (off_t)(r_addr * PAGE_SIZE_64);
+
+        size_of_prefetch = 0;
+
+	ubc_range_op(vp, f_offset, f_offset + PAGE_SIZE_64, UPL_ROP_PRESENT, &size_of_prefetch);
+
+	if (size_of_prefetch) {
+	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
+			     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 3, 0);
+		return;
+	}
+	if (ras->cl_ralen == 0)
+	        OSAddAtomic64(1, &vp->v_mount->mnt_ra_streams);
+
+	ras->cl_ralen = ras->cl_ralen ? min(ras->cl_rawin, ras->cl_ralen << 1) : read_size;
+
+	if (ras->cl_ralen < read_size)
+	        ras->cl_ralen = read_size;
+
+	for (prefetched = 0; prefetched < ras->cl_ralen; prefetched += read_size) {
+
+	        f_offset = (off_t)(r_addr * PAGE_SIZE_64);
+
+		if (f_offset >= filesize)
+		        break;
+		size_of_prefetch = cluster_read_prefetch(vp, f_offset, read_size * PAGE_SIZE, filesize, callback, callback_arg, bflag);
+
+		if (size_of_prefetch == 0)
+		        break;
+		ras->cl_maxra = (r_addr + size_of_prefetch) - 1;
+		ras->cl_pending += size_of_prefetch;
+
+		OSAddAtomic64(size_of_prefetch, &vp->v_mount->mnt_ra_pages);
+
+		r_addr += ras->cl_stride;
+	}
+	KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 48)) | DBG_FUNC_END,
+		     ras->cl_ralen, (int)ras->cl_maxra, (int)ras->cl_lastr, 5, 0);
 }
 
 
@@ -3487,9 +3806,10 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 	u_int32_t        max_prefetch;
 	u_int            rd_ahead_enabled = 1;
 	u_int            prefetch_enabled = 1;
-	struct cl_readahead *	rap;
+	struct cl_rastream *	ras;
 	struct clios		iostate;
 	struct cl_extent	extent;
+	struct timeval		io_start;
 	int              bflag;
 	int		 take_reference = 1;
 	int		 policy = IOPOL_DEFAULT;
@@ -3529,7 +3849,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 
 	if ((flags & (IO_RAOFF|IO_NOCACHE)) || ((last_request_offset & ~PAGE_MASK_64) == (uio->uio_offset & ~PAGE_MASK_64))) {
 	        rd_ahead_enabled = 0;
-		rap = NULL;
+		ras = NULL;
 	} else {
 	        if (cluster_is_throttled(vp)) {
 			/*
@@ -3542,14 +3862,13 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 
 			max_rd_size = THROTTLE_MAX_IOSIZE;
 		}
-	        if ((rap = cluster_get_rap(vp)) == NULL)
+		extent.b_addr = uio->uio_offset / PAGE_SIZE_64;
+		extent.e_addr = (last_request_offset - 1) / PAGE_SIZE_64;
+
+	        if ((ras = cluster_get_rap(vp, &extent)) == NULL)
 		        rd_ahead_enabled = 0;
-		else {
-			extent.b_addr = uio->uio_offset / PAGE_SIZE_64;
-			extent.e_addr = (last_request_offset - 1) / PAGE_SIZE_64;
-		}
 	}
-	if (rap != NULL && rap->cl_ralen && (rap->cl_lastr == extent.b_addr || (rap->cl_lastr + 1) == extent.b_addr)) {
+	if (ras != NULL && ras->cl_ralen && cluster_ra_follows(ras, &extent)) {
 	        /*
 		 * determine if we already have a read-ahead in the pipe courtesy of the
 		 * last read systemcall that was issued...
@@ -3557,7 +3876,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 		 * with respect to any read-ahead that might be necessary to 
 		 * garner all the data needed to complete this read systemcall
 		 */
-	        last_ioread_offset = (rap->cl_maxra * PAGE_SIZE_64) + PAGE_SIZE_64;
+	        last_ioread_offset = (ras->cl_maxra * PAGE_SIZE_64) + PAGE_SIZE_64;
 
 		if (last_ioread_offset < uio->uio_offset)
 		        last_ioread_offset = (off_t)0;
@@ -3640,17 +3959,14 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 					 * we're already finished the I/O for this read request
 					 * let's see if we should do a read-ahead
 					 */
-				        cluster_read_ahead(vp, &extent, filesize, rap, callback, callback_arg, bflag);
+				        cluster_read_ahead(vp, &extent, filesize, ras, callback, callback_arg, bflag);
 				}
 			}
 			if (retval)
 			        break;
 			if (io_size == 0) {
-				if (rap != NULL) {
-				        if (extent.e_addr < rap->cl_lastr)
-					        rap->cl_maxra = 0;
-					rap->cl_lastr = extent.e_addr;
-				}
+				if (ras != NULL)
+				        cluster_ra_done(vp, ras, &extent);
 			        break;
 			}
 			/*
@@ -3771,19 +4087,26 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 			/*
 			 * issue an asynchronous read to cluster_io
 			 */
+			microuptime(&io_start);
 
 			error = cluster_io(vp, upl, upl_offset, upl_f_offset + upl_offset,
 					   io_size, CL_READ | CL_ASYNC | bflag, (buf_t)NULL, &iostate, callback, callback_arg);
 
-			if (rap) {
-                                if (extent.e_addr < rap->cl_maxra) {
+			if (ras) {
+                                if (extent.e_addr < ras->cl_maxra) {
                                        /*
                                         * we've just issued a read for a block that should have been
                                         * in the cache courtesy of the read-ahead engine... something
                                         * has gone wrong with the pipeline, so reset the read-ahead
                                         * logic which will cause us to restart from scratch
                                         */
-                                        rap->cl_maxra = 0;
+                                        cluster_ra_reset(vp, ras);
+                               } else if (ras->cl_ralen && cluster_ra_follows(ras, &extent)) {
+                                       /*
+                                        * the stream is established but we've caught up with
+                                        * the read-ahead and had to go to the device ourselves
+                                        */
+                                        cluster_ra_grow(vp, ras);
                                }
                         }
 		}
@@ -3856,17 +4179,17 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 				 * explicitly disabled it
 				 */
 			        if (rd_ahead_enabled)
-					cluster_read_ahead(vp, &extent, filesize, rap, callback, callback_arg, bflag);
+					cluster_read_ahead(vp, &extent, filesize, ras, callback, callback_arg, bflag);
 					
-				if (rap != NULL) {
-				        if (extent.e_addr < rap->cl_lastr)
-					        rap->cl_maxra = 0;
-					rap->cl_lastr = extent.e_addr;
-				}
+				if (ras != NULL)
+				        cluster_ra_done(vp, ras, &extent);
 			}
 			if (iolock_inited == TRUE)
 				cluster_iostate_wait(&iostate, 0, "cluster_read_copy");
 
+			if (start_pg < last_pg && ras != NULL)
+			        cluster_ra_latency(vp, &io_start);
+
 			if (iostate.io_error)
 			        error = iostate.io_error;
 			else {
@@ -3955,7 +4278,7 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 					 * coming out of throttled state
 					 */
 					if (policy != THROTTLE_LEVEL_TIER3 && policy != THROTTLE_LEVEL_TIER2) {
-						if (rap != NULL)
+						if (ras != NULL)
 							rd_ahead_enabled = 1;
 						prefetch_enabled = 1;
 					}
@@ -3978,11 +4301,11 @@ cluster_read_copy(vnode_t vp, struct uio *uio, u_int32_t io_req_size, off_t file
 
 		lck_mtx_destroy(&iostate.io_mtxp, cl_mtx_grp);
 	}
-	if (rap != NULL) {
+	if (ras != NULL) {
 	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 32)) | DBG_FUNC_END,
-			     (int)uio->uio_offset, io_req_size, rap->cl_lastr, retval, 0);
+			     (int)uio->uio_offset, io_req_size, ras->cl_lastr, retval, 0);
 
-	        lck_mtx_unlock(&rap->cl_lockr);
+	        cluster_release_rap(vp, ras);
 	} else {
 	        KERNEL_DEBUG((FSDBG_CODE(DBG_FSRW, 32)) | DBG_FUNC_END,
 			     (int)uio->uio_offset, io_req_size, 0, retval, 0);
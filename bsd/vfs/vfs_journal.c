@@ -156,11 +156,17 @@ static void lock_condition(journal *jnl, boolean_t *condition, const char *condi
 static void wait_condition(journal *jnl, boolean_t *condition, const char *condition_name);
 static void unlock_condition(journal *jnl, boolean_t *condition);
 static void finish_end_thread(transaction *tr);
+static void journal_commit_stats(journal *jnl, transaction *tr);
 static void write_header_thread(journal *jnl);
 static int finish_end_transaction(transaction *tr, errno_t (*callback)(void*), void *callback_arg);
 static int end_transaction(transaction *tr, int force_it, errno_t (*callback)(void*), void *callback_arg, boolean_t drop_lock, boolean_t must_wait);
 static void abort_transaction(journal *jnl, transaction *tr);
 static void dump_journal(journal *jnl);
+static int journal_group_commit(journal *jnl, uint32_t seq);
+static uint32_t checkpoint_prepare(journal *jnl, transaction *tr);
+static void checkpoint_begin(journal *jnl, transaction *tr);
+static void checkpoint_end(journal *jnl);
+static void wait_checkpoints(journal *jnl, const char *wait_name);
 
 static __inline__ void  lock_oldstart(journal *jnl);
 static __inline__ void  unlock_oldstart(journal *jnl);
@@ -187,6 +193,16 @@ static int lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full)
 static int do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr);
 static int insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting);
 
+/*
+ * transaction sequence numbers wrap, compare them the way TCP does
+ */
+#define JNL_SEQ_GEQ(a, b)	((int32_t)((a) - (b)) >= 0)
+
+/*
+ * most transactions whose checkpoint writes may be in flight at once
+ */
+#define JNL_MAX_ASYNC_TRS	8
+
 #define CHECK_JOURNAL(jnl) \
 	do {		   \
 	if (jnl == NULL) {					\
@@ -552,6 +568,8 @@ free_old_stuff(journal *jnl)
 
 			KERNEL_DEBUG(0xbbbbc01c, jnl, tr, tr->tbuffer_size, 0, 0);
 		}
+		if (tr->ckpt_extents)
+			kfree(tr->ckpt_extents, tr->ckpt_count * sizeof(dk_extent_t));
 		next = tr->next;
 		FREE_ZONE(tr, sizeof(transaction), M_JNL_TR);
 	}
@@ -559,6 +577,169 @@ free_old_stuff(journal *jnl)
 
 
 
+static int
+checkpoint_extent_cmp(const void *a, const void *b)
+{
+	const dk_extent_t *ext_a = (const dk_extent_t *)a;
+	const dk_extent_t *ext_b = (const dk_extent_t *)b;
+
+	if (ext_a->offset < ext_b->offset)
+		return -1;
+	if (ext_a->offset > ext_b->offset)
+		return 1;
+	return 0;
+}
+
+//
+// record which blocks the checkpoint writes of this transaction
+// will cover, sorted, so checkpoint_begin() can compare them with
+// the blocks of transactions whose writes are still in flight.
+// the extents are in units of the blocks' b_blkno but sized as if
+// those were DEV_BSIZE, which can only make them larger than the
+// real thing.  returns the number of blocks that will be written.
+//
+static uint32_t
+checkpoint_prepare(journal *jnl, transaction *tr)
+{
+	block_list_header *blhdr;
+	dk_extent_t       *extents;
+	uint32_t           count = 0, n = 0;
+	boolean_t          was_vm_privileged = FALSE;
+	int                i;
+
+	for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
+		for (i = 1; i < blhdr->num_blocks; i++) {
+			if (blhdr->binfo[i].bnum != (off_t)-1)
+				count++;
+		}
+	}
+	if (count == 0)
+		return 0;
+
+	if (jnl->fsmount->mnt_kern_flag & MNTK_SWAP_MOUNT)
+		was_vm_privileged = set_vm_privilege(TRUE);
+
+	extents = kalloc(count * sizeof(dk_extent_t));
+
+	if ((jnl->fsmount->mnt_kern_flag & MNTK_SWAP_MOUNT) && (was_vm_privileged == FALSE))
+		set_vm_privilege(FALSE);
+
+	//
+	// if we couldn't get the memory, leave ckpt_extents NULL...
+	// checkpoint_begin() then treats this transaction as
+	// overlapping every other one
+	//
+	if (extents) {
+		for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
+			for (i = 1; i < blhdr->num_blocks; i++) {
+				if (blhdr->binfo[i].bnum == (off_t)-1)
+					continue;
+				extents[n].offset = (uint64_t)blhdr->binfo[i].bnum;
+				extents[n].length = howmany(buf_size(blhdr->binfo[i].u.bp), DEV_BSIZE);
+				n++;
+			}
+		}
+		qsort(extents, count, sizeof(dk_extent_t), checkpoint_extent_cmp);
+	}
+	tr->ckpt_extents = extents;
+	tr->ckpt_count = count;
+
+	return count;
+}
+
+static int
+checkpoint_overlaps(transaction *tr, transaction *ctr)
+{
+	uint32_t i = 0, j = 0;
+
+	if (tr->ckpt_extents == NULL || ctr->ckpt_extents == NULL)
+		return 1;
+
+	while (i < tr->ckpt_count && j < ctr->ckpt_count) {
+		dk_extent_t *a = &tr->ckpt_extents[i];
+		dk_extent_t *b = &ctr->ckpt_extents[j];
+
+		if (a->offset + a->length <= b->offset)
+			i++;
+		else if (b->offset + b->length <= a->offset)
+			j++;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+//
+// wait until the checkpoint writes of this transaction can be
+// issued.  they go out alongside those of earlier transactions
+// still in flight unless they write any of the same blocks (the
+// device is free to complete overlapping writes in either order,
+// which could leave the older copy on disk) or too many
+// transactions are already in flight.
+//
+static void
+checkpoint_begin(journal *jnl, transaction *tr)
+{
+	transaction *ctr;
+
+	lock_flush(jnl);
+
+	for (;;) {
+		lock_oldstart(jnl);
+
+		for (ctr = jnl->ckpt_trs; ctr; ctr = ctr->ckpt_next) {
+			if (checkpoint_overlaps(tr, ctr))
+				break;
+		}
+		if (ctr == NULL && jnl->async_trs < JNL_MAX_ASYNC_TRS) {
+			tr->ckpt_next = jnl->ckpt_trs;
+			jnl->ckpt_trs = tr;
+
+			unlock_oldstart(jnl);
+			break;
+		}
+		unlock_oldstart(jnl);
+
+		jnl->stats.js_ckpt_waits++;
+		msleep(&jnl->async_trs, &jnl->flock, PRIBIO, "checkpoint_begin", NULL);
+	}
+	if ((uint32_t)++jnl->async_trs > jnl->stats.js_ckpt_max)
+		jnl->stats.js_ckpt_max = jnl->async_trs;
+
+	unlock_flush(jnl);
+}
+
+//
+// a transaction's checkpoint writes have all completed... the
+// caller has already taken it off the ckpt_trs list
+//
+static void
+checkpoint_end(journal *jnl)
+{
+	lock_flush(jnl);
+
+	jnl->async_trs--;
+	wakeup(&jnl->async_trs);
+
+	unlock_flush(jnl);
+}
+
+static void
+wait_checkpoints(journal *jnl, const char *wait_name)
+{
+	if (jnl->async_trs == 0)
+		return;
+
+	lock_flush(jnl);
+
+	while (jnl->async_trs)
+		msleep(&jnl->async_trs, &jnl->flock, PRIBIO, wait_name, NULL);
+
+	unlock_flush(jnl);
+}
+
+
+
 //
 // This is our callback that lets us know when a buffer has been
 // flushed to disk.  It's called from deep within the driver stack
@@ -571,6 +752,7 @@ buffer_flushed_callback(struct buf *bp, void *arg)
 	transaction  *tr;
 	journal      *jnl;
 	transaction  *ctr, *prev=NULL, *next;
+	transaction **ctrp;
 	size_t        i;
 	int           bufsize, amt_flushed, total_bytes;
 
@@ -630,6 +812,14 @@ buffer_flushed_callback(struct buf *bp, void *arg)
 	// cleanup for this transaction
 	tr->total_bytes = 0xfbadc0de;
 
+	// its checkpoint writes are done, let overlapping ones go
+	for (ctrp = &jnl->ckpt_trs; *ctrp; ctrp = &(*ctrp)->ckpt_next) {
+		if (*ctrp == tr) {
+			*ctrp = tr->ckpt_next;
+			break;
+		}
+	}
+
 	if (jnl->flags & JOURNAL_INVALID)
 		goto transaction_done;
 
@@ -731,7 +921,7 @@ buffer_flushed_callback(struct buf *bp, void *arg)
 transaction_done:
 	unlock_oldstart(jnl);
 
-	unlock_condition(jnl, &jnl->asyncIO);
+	checkpoint_end(jnl);
 }
 
 
@@ -1792,11 +1982,12 @@ journal_create(struct vnode *jvp,
 
 
 	jnl->flushing = FALSE;
-	jnl->asyncIO = FALSE;
+	jnl->async_trs = 0;
 	jnl->flush_aborted = FALSE;
 	jnl->writing_header = FALSE;
 	jnl->async_trim = NULL;
 	jnl->sequence_num = jnl->jhdr->sequence_num;
+	jnl->committed_seq = jnl->sequence_num;
 	
 	if (write_journal_header(jnl, 1, jnl->jhdr->sequence_num) != 0) {
 		printf("jnl: %s: journal_create: failed to write journal header.\n", jdev_name);
@@ -2048,6 +2239,7 @@ journal_open(struct vnode *jvp,
 	// make sure this is in sync!
 	jnl->active_start = jnl->jhdr->start;
 	jnl->sequence_num = jnl->jhdr->sequence_num;
+	jnl->committed_seq = jnl->sequence_num;
 
 	// set this now, after we've replayed the journal
 	size_up_tbuffer(jnl, tbuffer_size, phys_blksz);
@@ -2291,7 +2483,7 @@ journal_close(journal *jnl)
 			}
 		}
 	}
-	wait_condition(jnl, &jnl->asyncIO, "journal_close");
+	wait_checkpoints(jnl, "journal_close");
 
 	free_old_stuff(jnl);
 
@@ -3771,6 +3963,8 @@ end_transaction(transaction *tr, int force_it, errno_t (*callback)(void*), void
 
 	KERNEL_DEBUG(0xbbbbc018|DBG_FUNC_START, jnl, tr, drop_lock, must_wait, 0);
 
+	microuptime(&tr->commit_start);
+
 	lock_condition(jnl, &jnl->flushing, "end_transaction");
 
 	/*
@@ -3977,9 +4171,12 @@ end_transaction(transaction *tr, int force_it, errno_t (*callback)(void*), void
 		journal_unlock(jnl);
 		drop_lock = FALSE;
 	}
-	if (must_wait == TRUE)
+	if (must_wait == TRUE) {
 		ret_val = finish_end_transaction(tr, callback, callback_arg);
-	else {
+
+		if (ret_val == 0)
+			OSAddAtomic64(1, &jnl->stats.js_sync_commits);
+	} else {
 		thread_t	thread = THREAD_NULL;
 
 		/*
@@ -3998,6 +4195,31 @@ done:
 }
 
 
+static void
+journal_commit_stats(journal *jnl, transaction *tr)
+{
+	struct timeval	now;
+	uint64_t	usecs;
+	int		bucket;
+
+	microuptime(&now);
+	timevalsub(&now, &tr->commit_start);
+	usecs = (uint64_t)now.tv_sec * USEC_PER_SEC + now.tv_usec;
+
+	for (bucket = 0; bucket < JOURNAL_LATENCY_BUCKETS - 1; bucket++) {
+		if (usecs < (1ULL << (bucket + 5)))
+			break;
+	}
+	/*
+	 * only one commit runs at a time (we hold the 'flushing'
+	 * condition), so these need no atomics
+	 */
+	jnl->stats.js_commits++;
+	jnl->stats.js_transactions += tr->num_joined;
+	jnl->stats.js_commit_latency[bucket]++;
+}
+
+
 static void
 finish_end_thread(transaction *tr)
 {
@@ -4194,6 +4416,14 @@ finish_end_transaction(transaction *tr, errno_t (*callback)(void*), void *callba
 		ret_val = -1;
 		goto bad_journal;
 	}
+	/*
+	 * the transaction is now safely in the journal... anyone
+	 * in journal_group_commit() waiting on it can go
+	 */
+	jnl->committed_seq = tr->sequence_num;
+
+	journal_commit_stats(jnl, tr);
+
 	/*
 	 * If the caller supplied a callback, call it now that the blocks have been
 	 * written to the journal.  This is used by journal_relocate so, for example,
@@ -4216,7 +4446,13 @@ finish_end_transaction(transaction *tr, errno_t (*callback)(void*), void *callba
 	//
 	tr->num_flushed = tr->num_blhdrs * jnl->jhdr->blhdr_size;
 
-	lock_condition(jnl, &jnl->asyncIO, "finish_end_transaction");
+	/*
+	 * the checkpoint writes of earlier transactions may still be
+	 * in flight... ours can join them unless they touch the same
+	 * blocks
+	 */
+	if (checkpoint_prepare(jnl, tr))
+		checkpoint_begin(jnl, tr);
 
 	//
 	// setup for looping through all the blhdr's.
@@ -4278,8 +4514,6 @@ finish_end_transaction(transaction *tr, errno_t (*callback)(void*), void *callba
 		jnl->tr_freeme = tr;
 
 		unlock_oldstart(jnl);
-
-		unlock_condition(jnl, &jnl->asyncIO);
 	}
 
 	//printf("jnl: end_tr: tr @ 0x%x, jnl-blocks: 0x%llx - 0x%llx. exit!\n",
@@ -4473,6 +4707,64 @@ abort_transaction(journal *jnl, transaction *tr)
 }
 
 
+/*
+ * Write the transaction with sequence number 'seq', which must be
+ * 'cur_tr' or already on its way out, to the journal and wait for
+ * it to get there.  Called with the journal lock held, which is
+ * dropped on return.
+ *
+ * If a commit is already in progress, end_transaction() would wait
+ * for it with the journal lock held, so nothing else could join
+ * 'cur_tr' in the mean time and every fsync that arrives would end
+ * up doing its own journal write and cache flush.  Instead we wait
+ * for it unlocked, other threads keep adding to 'cur_tr', and the
+ * first of the waiters to get the lock back writes all of their
+ * transactions out together.  The rest find their transaction
+ * committed, or being committed, and only wait.
+ */
+static int
+journal_group_commit(journal *jnl, uint32_t seq)
+{
+	transaction *tr;
+
+	for (;;) {
+		if ((jnl->flags & JOURNAL_INVALID) || jnl->flush_aborted == TRUE) {
+			journal_unlock(jnl);
+			return -1;
+		}
+		if (JNL_SEQ_GEQ(jnl->committed_seq, seq)) {
+			journal_unlock(jnl);
+			OSAddAtomic64(1, &jnl->stats.js_group_waits);
+			return 0;
+		}
+		tr = jnl->cur_tr;
+
+		if (tr == NULL || tr->sequence_num != seq) {
+			/*
+			 * someone else is writing it out... the 'flushing'
+			 * condition is held until it's in the journal
+			 */
+			journal_unlock(jnl);
+			wait_condition(jnl, &jnl->flushing, "journal_group_commit");
+
+			if ((jnl->flags & JOURNAL_INVALID) || jnl->flush_aborted == TRUE)
+				return -1;
+			OSAddAtomic64(1, &jnl->stats.js_group_waits);
+			return 0;
+		}
+		if (jnl->flushing == FALSE)
+			break;
+
+		journal_unlock(jnl);
+		wait_condition(jnl, &jnl->flushing, "journal_group_commit");
+		journal_lock(jnl);
+	}
+	jnl->cur_tr = NULL;
+
+	return end_transaction(tr, 1, NULL, NULL, TRUE, TRUE);
+}
+
+
 int
 journal_end_transaction(journal *jnl)
 {
@@ -4524,14 +4816,20 @@ journal_end_transaction(journal *jnl)
 	// called from end_transaction().
 	// 
 	jnl->active_tr = NULL;
+	tr->num_joined++;
 	
 	/* Examine the force-journal-flush state in the active txn */
 	if (tr->flush_on_completion == TRUE) {
 		/*
-		 * If the FS requested it, disallow group commit and force the
-		 * transaction out to disk immediately.
+		 * If the FS requested it, force the transaction out to disk
+		 * immediately... along with those of anyone else waiting
+		 * to do the same, unless group commit is disabled.
 		 */
-		ret = end_transaction(tr, 1, NULL, NULL, TRUE, TRUE);
+		if ((jnl->flags & JOURNAL_NO_GROUP_COMMIT) == 0) {
+			jnl->cur_tr = tr;
+			ret = journal_group_commit(jnl, tr->sequence_num);
+		} else
+			ret = end_transaction(tr, 1, NULL, NULL, TRUE, TRUE);
 	}
 	else {
 		/* in the common path we can simply use the double-buffered journal */
@@ -4589,14 +4887,22 @@ journal_flush(journal *jnl, boolean_t wait_for_IO)
 	}
 
 	// if we're not active, flush any buffered transactions
-	if (jnl->active_tr == NULL && jnl->cur_tr) {
+	if (jnl->active_tr == NULL && jnl->cur_tr && wait_for_IO == FALSE && drop_lock == TRUE
+	    && (jnl->flags & JOURNAL_NO_GROUP_COMMIT) == 0) {
+		/*
+		 * an fsync... let it share its journal write with
+		 * any others that arrive while one is in progress
+		 */
+		journal_group_commit(jnl, jnl->cur_tr->sequence_num);
+
+	} else if (jnl->active_tr == NULL && jnl->cur_tr) {
 		transaction *tr = jnl->cur_tr;
 
 		jnl->cur_tr = NULL;
 
 		if (wait_for_IO) {
 			wait_condition(jnl, &jnl->flushing, "journal_flush");
-			wait_condition(jnl, &jnl->asyncIO, "journal_flush");
+			wait_checkpoints(jnl, "journal_flush");
 		}
 		/*
 		 * "end_transction" will wait for any current async flush
@@ -4621,7 +4927,7 @@ journal_flush(journal *jnl, boolean_t wait_for_IO)
 		wait_condition(jnl, &jnl->flushing, "journal_flush");
 	}
 	if (wait_for_IO) {
-		wait_condition(jnl, &jnl->asyncIO, "journal_flush");
+		wait_checkpoints(jnl, "journal_flush");
 	}
 
 	KERNEL_DEBUG(DBG_JOURNAL_FLUSH | DBG_FUNC_END, jnl, 0, 0, 0, 0);
@@ -4629,6 +4935,19 @@ journal_flush(journal *jnl, boolean_t wait_for_IO)
 	return 0;
 }
 
+/*
+ * Return a snapshot of the journal's statistics.
+ */
+void
+journal_get_stats(journal *jnl, struct journal_stats *stats)
+{
+	CHECK_JOURNAL(jnl);
+
+	lock_flush(jnl);
+	*stats = jnl->stats;
+	unlock_flush(jnl);
+}
+
 int
 journal_active(journal *jnl)
 {
@@ -4815,6 +5134,12 @@ bad_journal:
 
 #else   // !JOURNALING - so provide stub functions
 
+void
+journal_get_stats(__unused journal *jnl, struct journal_stats *stats)
+{
+	bzero(stats, sizeof(*stats));
+}
+
 int journal_uses_fua(__unused journal *jnl)
 {
 	return 0;
@@ -41,6 +41,7 @@
 #ifdef __APPLE_API_UNSTABLE
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <kern/locks.h>
 #include <sys/disk.h>
 
@@ -100,6 +101,11 @@ typedef struct transaction {
 	struct jnl_trim_list trim;
     boolean_t		delayed_header_write;
 	boolean_t       flush_on_completion; //flush transaction immediately upon txn end.
+    int                 num_joined;    // how many transactions were grouped into this one
+    struct timeval      commit_start;  // when end_transaction() started writing it out
+    struct transaction *ckpt_next;     // list of tr's whose checkpoint writes are in flight
+    dk_extent_t        *ckpt_extents;  // sorted blocks of the checkpoint writes
+    uint32_t            ckpt_count;
 } transaction;
 
 
@@ -133,6 +139,26 @@ typedef struct journal_header {
 #define OLD_JOURNAL_HEADER_MAGIC  0x4a484452   // 'JHDR'
 
 
+/*
+ * Statistics kept for each journal since it was opened.
+ * Commit latencies are bucketed by powers of two: bucket i
+ * counts the commits that took less than 2^(i+5) usecs, the
+ * last bucket the rest.
+ */
+#define JOURNAL_LATENCY_BUCKETS  16
+
+struct journal_stats {
+    uint64_t       js_commits;        // transaction groups written to the journal
+    uint64_t       js_transactions;   // transactions carried by those writes
+    uint64_t       js_sync_commits;   // writes a caller was waiting for
+    uint64_t       js_group_waits;    // flushes satisfied by another thread's write
+    uint64_t       js_ckpt_waits;     // checkpoint writes held back by earlier ones
+    uint32_t       js_ckpt_max;       // most transactions with checkpoint writes in flight
+    uint32_t       js_reserved;
+    uint64_t       js_commit_latency[JOURNAL_LATENCY_BUCKETS];
+};
+
+
 /*
  * In memory structure about the journal.
  */
@@ -156,7 +182,7 @@ typedef struct journal {
     int32_t             tbuffer_size;      // default transaction buffer size
     boolean_t		flush_aborted;
     boolean_t		flushing;
-    boolean_t		asyncIO;
+    int32_t		async_trs;         // transactions with checkpoint writes in flight
     boolean_t		writing_header;
     boolean_t		write_header_failed;
 	
@@ -181,12 +207,16 @@ typedef struct journal {
     void               *owner;             // a ptr that's unique to the calling process
 
     transaction        *tr_freeme;         // transaction structs that need to be free'd
+    transaction        *ckpt_trs;          // tr's with checkpoint writes in flight, protected by old_start_lock
+    uint32_t            committed_seq;     // sequence_num of the last tr written to the journal
 
     volatile off_t      active_start;      // the active start that we only keep in memory
     lck_mtx_t           old_start_lock;    // protects the old_start
     volatile off_t      old_start[16];     // this is how we do lazy start update
 
     int                 last_flush_err;    // last error from flushing the cache
+
+    struct journal_stats stats;
 } journal;
 
 /* internal-only journal flags (top 16 bits) */
@@ -341,6 +371,7 @@ int   journal_active(journal *jnl);
 int   journal_flush(journal *jnl, boolean_t wait_for_IO);
 void *journal_owner(journal *jnl);    // compare against current_thread()
 int   journal_uses_fua(journal *jnl);
+void  journal_get_stats(journal *jnl, struct journal_stats *stats);
 void  journal_lock(journal *jnl);
 void  journal_unlock(journal *jnl);
 
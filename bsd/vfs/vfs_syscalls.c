@@ -9557,6 +9557,20 @@ fsctl_internal(proc_t p, vnode_t *arg_vp, u_long cmd, user_addr_t udata, u_long
 			}
 		}
 		break;
+
+		case FSCTL_READAHEAD_STATS: {
+			struct fsctl_readahead_stats *ras = (struct fsctl_readahead_stats *)data;
+			mount_t mp = vp->v_mount;
+
+			bzero(ras, sizeof(*ras));
+			ras->ra_pages = mp->mnt_ra_pages;
+			ras->ra_hits = mp->mnt_ra_hits;
+			ras->ra_waste = mp->mnt_ra_waste;
+			ras->ra_streams = mp->mnt_ra_streams;
+			ras->ra_latency = mp->mnt_ra_latency;
+			error = 0;
+		}
+		break;
 	   	
 		default: {
 			/* Invoke the filesystem-specific code */
@@ -74,6 +74,7 @@ protected:
     struct ExpansionData
     {
 	uint64_t	fRegistryEntryID;
+	uint32_t	fPropertiesSizeHint;
     };
 
 /*! @var reserved
@@ -797,6 +798,11 @@ private:
 #endif
     static IORegistryEntry * initialize( void );
 
+#ifdef XNU_KERNEL_PRIVATE
+    uint32_t getPropertiesSizeHint( void ) const;
+    void setPropertiesSizeHint( uint32_t size );
+#endif
+
 private:
     inline bool arrayMember( OSArray * set,
                             const IORegistryEntry * member,
@@ -1672,6 +1672,24 @@ bool IORegistryEntry::attachToParent( IORegistryEntry * parent,
     return( ret );
 }
 
+/*
+ * Size of the last serialization of this entry's properties, used to
+ * size the buffer for the next one.
+ */
+uint32_t IORegistryEntry::getPropertiesSizeHint( void ) const
+{
+    if (reserved)
+	return (reserved->fPropertiesSizeHint);
+    else
+	return (0);
+}
+
+void IORegistryEntry::setPropertiesSizeHint( uint32_t size )
+{
+    if (reserved)
+	reserved->fPropertiesSizeHint = size;
+}
+
 uint64_t IORegistryEntry::getRegistryEntryID( void )
 {
     if (reserved)
@@ -2620,6 +2620,26 @@ out:
 
 #endif
 
+/*
+ * Initial serializer capacity for an entry's properties: the size of its
+ * last export, so repeated exports of large entries don't grow the buffer.
+ */
+#define kPropertiesMinCapacity	4096
+#define kPropertiesMaxCapacity	(1024 * 1024)
+
+static unsigned int
+propertiesCapacity(IORegistryEntry * entry)
+{
+    unsigned int capacity = entry->getPropertiesSizeHint();
+
+    if (capacity < kPropertiesMinCapacity)
+	capacity = kPropertiesMinCapacity;
+    else if (capacity > kPropertiesMaxCapacity)
+	capacity = kPropertiesMaxCapacity;
+
+    return (capacity);
+}
+
 /* Routine io_registry_entry_get_properties */
 kern_return_t is_io_registry_entry_get_properties(
 	io_object_t registry_entry,
@@ -2631,7 +2651,7 @@ kern_return_t is_io_registry_entry_get_properties(
 
     CHECK( IORegistryEntry, registry_entry, entry );
 
-    OSSerialize * s = OSSerialize::withCapacity(4096);
+    OSSerialize * s = OSSerialize::withCapacity(propertiesCapacity(entry));
     if( !s)
 	return( kIOReturnNoMemory );
 
@@ -2658,6 +2678,7 @@ kern_return_t is_io_registry_entry_get_properties(
     if (!err) {
 	len = s->getLength();
 	*propertiesCnt = len;
+	entry->setPropertiesSizeHint(len);
 	err = copyoutkdata( s->text(), len, properties );
     }
 
@@ -2723,7 +2744,7 @@ kern_return_t is_io_registry_entry_get_properties_bin(
     }
 #endif
 
-    s = OSSerialize::binaryWithCapacity(4096, editor, editRef);
+    s = OSSerialize::binaryWithCapacity(propertiesCapacity(entry), editor, editRef);
     if (!s) return (kIOReturnNoMemory);
 
     if (!entry->serializeProperties(s)) err = kIOReturnUnsupported;
@@ -2732,6 +2753,7 @@ kern_return_t is_io_registry_entry_get_properties_bin(
     {
 		len = s->getLength();
 		*propertiesCnt = len;
+		entry->setPropertiesSizeHint(len);
 		err = copyoutkdata(s->text(), len, properties);
     }
     s->release();
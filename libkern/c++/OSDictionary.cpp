@@ -61,6 +61,125 @@ extern "C" {
 #define EXT_CAST(obj) \
     reinterpret_cast<OSObject *>(const_cast<OSMetaClassBase *>(obj))
 
+/*
+ * Unsorted dictionaries with at least kHashIndexMinCount keys are indexed by
+ * an open addressed table of entry positions, hashed on the key pointer.
+ * The table is kept at most half full and dropped again once the dictionary
+ * falls below half the threshold, so small dictionaries never pay for it.
+ */
+enum {
+    kHashIndexMinCount = 32,
+    kHashIndexEmpty    = 0
+};
+
+static inline unsigned int
+hashKeyPointer(const OSSymbol *aKey)
+{
+    uint64_t h = (uint64_t)(uintptr_t) aKey;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (unsigned int) h;
+}
+
+void OSDictionary::insertIndex(unsigned int entry)
+{
+    unsigned int mask = reserved->hashSize - 1;
+    unsigned int slot = hashKeyPointer(dictionary[entry].key) & mask;
+
+    while (reserved->hashIndex[slot] != kHashIndexEmpty)
+        slot = (slot + 1) & mask;
+
+    reserved->hashIndex[slot] = entry + 1;
+}
+
+void OSDictionary::freeIndex()
+{
+    if (reserved && reserved->hashIndex) {
+        kfree(reserved->hashIndex, reserved->hashSize * sizeof(unsigned int));
+        ACCUMSIZE( -(reserved->hashSize * sizeof(unsigned int)) );
+        reserved->hashIndex = 0;
+        reserved->hashSize = 0;
+    }
+}
+
+void OSDictionary::buildIndex()
+{
+    unsigned int newSize, allocSize;
+    unsigned int * newIndex;
+
+    if ((fOptions & kSort) || (count < (kHashIndexMinCount / 2))
+     || (!(reserved && reserved->hashIndex) && count < kHashIndexMinCount)) {
+        freeIndex();
+        return;
+    }
+
+    if (!reserved) {
+        reserved = (ExpansionData *) kalloc(sizeof(ExpansionData));
+        if (!reserved)
+            return;
+        bzero(reserved, sizeof(ExpansionData));
+        ACCUMSIZE(sizeof(ExpansionData));
+    }
+
+    // count is bounded by the dictEntry capacity check, so this can't overflow
+    for (newSize = kHashIndexMinCount * 2; newSize < (count * 2); newSize <<= 1)
+        ;
+
+    allocSize = newSize * sizeof(unsigned int);
+    if (reserved->hashIndex && reserved->hashSize == newSize) {
+        newIndex = reserved->hashIndex;
+    } else {
+        // the index is only an accelerator, lookups stay linear without it
+        newIndex = (unsigned int *) kalloc(allocSize);
+        if (!newIndex) {
+            freeIndex();
+            return;
+        }
+        ACCUMSIZE(allocSize);
+        freeIndex();
+        reserved->hashIndex = newIndex;
+        reserved->hashSize = newSize;
+    }
+
+    bzero(newIndex, allocSize);
+    for (unsigned int i = 0; i < count; i++)
+        insertIndex(i);
+}
+
+unsigned int OSDictionary::findIndex(const OSSymbol *aKey) const
+{
+    unsigned int i;
+
+    if (fOptions & kSort) {
+    	i = OSSymbol::bsearch(aKey, &dictionary[0], count, sizeof(dictionary[0]));
+	if ((i < count) && (aKey == dictionary[i].key))
+	    return i;
+	return count;
+    }
+
+    if (reserved && reserved->hashIndex) {
+        unsigned int mask = reserved->hashSize - 1;
+        unsigned int slot = hashKeyPointer(aKey) & mask;
+        unsigned int entry;
+
+        while ((entry = reserved->hashIndex[slot]) != kHashIndexEmpty) {
+            if (aKey == dictionary[entry - 1].key)
+                return entry - 1;
+            slot = (slot + 1) & mask;
+        }
+        return count;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (aKey == dictionary[i].key) break;
+    }
+
+    return i;
+}
+
 bool OSDictionary::initWithCapacity(unsigned int inCapacity)
 {
     if (!super::init())
@@ -189,6 +308,7 @@ bool OSDictionary::initWithDictionary(const OSDictionary *dict,
         dictionary[i].key->taggedRetain(OSTypeID(OSCollection));
         dictionary[i].value->taggedRetain(OSTypeID(OSCollection));
     }
+    buildIndex();
 
     return true;
 }
@@ -256,6 +376,11 @@ void OSDictionary::free()
         kfree(dictionary, capacity * sizeof(dictEntry));
         ACCUMSIZE( -(capacity * sizeof(dictEntry)) );
     }
+    if (reserved) {
+        freeIndex();
+        kfree(reserved, sizeof(ExpansionData));
+        ACCUMSIZE( -sizeof(ExpansionData) );
+    }
 
     super::free();
 }
@@ -319,6 +444,7 @@ void OSDictionary::flushCollection()
         dictionary[i].value->taggedRelease(OSTypeID(OSCollection));
     }
     count = 0;
+    freeIndex();
 }
 
 bool OSDictionary::
@@ -335,8 +461,9 @@ setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject)
     if (fOptions & kSort) {
     	i = OSSymbol::bsearch(aKey, &dictionary[0], count, sizeof(dictionary[0]));
 	exists = (i < count) && (aKey == dictionary[i].key);
-    } else for (exists = false, i = 0; i < count; i++) {
-        if ((exists = (aKey == dictionary[i].key))) break;
+    } else {
+	i = findIndex(aKey);
+	exists = (i < count);
     }
 
     if (exists) {
@@ -365,6 +492,11 @@ setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject)
     dictionary[i].value = anObject;
     count++;
 
+    if (reserved && reserved->hashIndex && (count * 2) <= reserved->hashSize)
+        insertIndex(i);
+    else if (!(fOptions & kSort) && count >= kHashIndexMinCount)
+        buildIndex();
+
     return true;
 }
 
@@ -378,12 +510,8 @@ void OSDictionary::removeObject(const OSSymbol *aKey)
 
     // if the key exists, remove the object
 
-    if (fOptions & kSort) {
-    	i = OSSymbol::bsearch(aKey, &dictionary[0], count, sizeof(dictionary[0]));
-	exists = (i < count) && (aKey == dictionary[i].key);
-    } else for (exists = false, i = 0; i < count; i++) {
-        if ((exists = (aKey == dictionary[i].key))) break;
-    }
+    i = findIndex(aKey);
+    exists = (i < count);
 
     if (exists) {
 	dictEntry oldEntry = dictionary[i];
@@ -393,6 +521,10 @@ void OSDictionary::removeObject(const OSSymbol *aKey)
 	count--;
 	bcopy(&dictionary[i+1], &dictionary[i], (count - i) * sizeof(dictionary[0]));
 
+	// later entries moved down a slot, so their index positions are stale
+	if (reserved && reserved->hashIndex)
+	    buildIndex();
+
 	oldEntry.key->taggedRelease(OSTypeID(OSCollection));
 	oldEntry.value->taggedRelease(OSTypeID(OSCollection));
 	return;
@@ -437,12 +569,8 @@ OSObject *OSDictionary::getObject(const OSSymbol *aKey) const
 
     // if the key exists, return the object
 
-    if (fOptions & kSort) {
-    	i = OSSymbol::bsearch(aKey, &dictionary[0], count, sizeof(dictionary[0]));
-	exists = (i < count) && (aKey == dictionary[i].key);
-    } else for (exists = false, i = 0; i < count; i++) {
-        if ((exists = (aKey == dictionary[i].key))) break;
-    }
+    i = findIndex(aKey);
+    exists = (i < count);
 
     if (exists) {
 	return (const_cast<OSObject *> ((const OSObject *)dictionary[i].value));
@@ -633,6 +761,10 @@ unsigned OSDictionary::setOptions(unsigned options, unsigned mask, void *)
     unsigned old = super::setOptions(options, mask);
     if ((old ^ options) & mask) {
 
+	// sorted dictionaries use a binary search rather than the hash index
+	if ((old ^ fOptions) & kSort)
+	    buildIndex();
+
 	// Value changed need to recurse over all of the child collections
 	for ( unsigned i = 0; i < count; i++ ) {
 	    OSCollection *v = OSDynamicCast(OSCollection, dictionary[i].value);
@@ -153,6 +153,32 @@ void OSObject::taggedRetain(const void *tag) const
     } while (!OSCompareAndSwap(origCount, newCount, const_cast<UInt32 *>(countP)));
 }
 
+bool OSObject::taggedTryRetain(const void *tag) const
+{
+    volatile UInt32 *countP = (volatile UInt32 *) &retainCount;
+    UInt32 inc = 1;
+    UInt32 origCount;
+    UInt32 newCount;
+
+    // Increment the collection bucket.
+    if ((const void *) OSTypeID(OSCollection) == tag)
+	inc |= (1UL<<16);
+
+    do {
+	origCount = *countP;
+        if ( ((UInt16) origCount | 0x1) == 0xffff ) {
+            // 0xffff means we are freeing now, 0xfffe is a pegged count.
+            if (origCount & 0x1)
+                return false;
+            return true;
+        }
+
+	newCount = origCount + inc;
+    } while (!OSCompareAndSwap(origCount, newCount, const_cast<UInt32 *>(countP)));
+
+    return true;
+}
+
 void OSObject::taggedRelease(const void *tag) const
 {
     taggedRelease(tag, 1);
@@ -226,6 +226,11 @@ unsigned int OSSerialize::ensureCapacity(unsigned int newCapacity)
 	if (newCapacity <= capacity)
 		return capacity;
 
+	// grow geometrically, so a large serialization doesn't copy the
+	// whole buffer again every capacityIncrement bytes
+	if (newCapacity < (capacity << 1) && capacity < (UINT_MAX >> 1))
+		newCapacity = capacity << 1;
+
 	// round up
 	newCapacity = round_page_32(newCapacity);
 
@@ -34,6 +34,7 @@
 
 #include <libkern/c++/OSSymbol.h>
 #include <libkern/c++/OSLib.h>
+#include <libkern/OSAtomic.h>
 #include <string.h>
 
 #define super OSString
@@ -54,31 +55,74 @@ extern "C" {
 #define GROW_FACTOR   (1)
 #define SHRINK_FACTOR (3)
 
+/* Old buckets moved into the new table per pool update during a resize */
+#define REHASH_BATCH  (8)
+
 #define GROW_POOL()     do \
-    if (count * GROW_FACTOR > nBuckets) { \
-        reconstructSymbols(true); \
+    if (!oldTable && count * GROW_FACTOR > table->nBuckets) { \
+        startRehash(table->nBuckets + table->nBuckets + 1); \
     } \
 while (0)
 
 #define SHRINK_POOL()     do \
-    if (count * SHRINK_FACTOR < nBuckets && \
-        nBuckets > INITIAL_POOL_SIZE) { \
-        reconstructSymbols(false); \
+    if (!oldTable && count * SHRINK_FACTOR < table->nBuckets && \
+        table->nBuckets > INITIAL_POOL_SIZE) { \
+        startRehash((table->nBuckets - 1) / 2); \
     } \
 while (0)
 
+/*
+ * Lookups do not take the pool gate.  Updates are made under the gate and
+ * publish every change to a bucket or table with a single store.  Memory a
+ * lookup may still be reading (bucket lists, tables and the symbols
+ * themselves) is retired onto the list for the current epoch rather than
+ * freed, and a list is only reclaimed once the lookups counted against its
+ * epoch have drained.  A lookup that misses, or that finds a symbol whose
+ * last reference is being released, falls back to the gated path.
+ *
+ * A resize allocates the new table and then moves REHASH_BATCH buckets
+ * across on each insert or remove, so no caller pays for a full rehash.
+ * Lookups search the old table before the new one, which keeps a symbol
+ * being moved visible in at least one of them.
+ */
 class OSSymbolPool
 {
 private:
     static const unsigned int kInitBucketCount = 16;
-
-    typedef struct { unsigned int count; OSSymbol **symbolP; } Bucket;
-
-    Bucket *buckets;
-    unsigned int nBuckets;
+    static const uintptr_t kBucketList = 1;
+
+    /*
+     * A bucket is empty, a single OSSymbol, or a List tagged with
+     * kBucketList.  Lists are appended to and compacted in place, and
+     * replaced by a larger copy when full.
+     */
+    typedef struct {
+        volatile unsigned int count;
+        unsigned int capacity;
+        OSSymbol *symbols[0];
+    } List;
+
+    typedef struct {
+        unsigned int nBuckets;
+        volatile uintptr_t buckets[0];
+    } Table;
+
+    typedef struct Retired {
+        struct Retired *next;
+        void *mem;
+        vm_size_t size;		// 0 for an OSSymbol
+    } Retired;
+
+    Table * volatile table;
+    Table * volatile oldTable;	// being drained into table
+    unsigned int rehashIndex;
     unsigned int count;
     lck_mtx_t *poolGate;
 
+    volatile UInt32 epoch;
+    volatile SInt32 readers[2];
+    Retired *retired[2];
+
     static inline void hashSymbol(const char *s,
                                   unsigned int *hashP,
                                   unsigned int *lenP)
@@ -97,18 +141,43 @@ private:
         *hashP = hash;
     }
 
+    static inline vm_size_t listSize(unsigned int capacity)
+        { return sizeof(List) + capacity * sizeof(OSSymbol *); };
+    static inline vm_size_t tableSize(unsigned int nBuckets)
+        { return sizeof(Table) + nBuckets * sizeof(uintptr_t); };
+    static inline List *bucketList(uintptr_t bucket)
+        { return (List *) (bucket & ~kBucketList); };
+
+    static unsigned int bucketCount(uintptr_t bucket);
+    static OSSymbol *bucketSymbol(uintptr_t bucket, unsigned int index);
+    static OSSymbol *findInBucket(uintptr_t bucket, const char *cString,
+                                  unsigned int inLen);
+
     static unsigned long log2(unsigned int x);
     static unsigned long exp2ml(unsigned int x);
 
-    void reconstructSymbols(void);
-    void reconstructSymbols(bool grow);
+    static Table *allocTable(unsigned int nBuckets);
+    static void freeTable(Table *thisTable);
+
+    bool bucketInsert(volatile uintptr_t *bucketP, OSSymbol *sym);
+    bool bucketRemove(volatile uintptr_t *bucketP, OSSymbol *sym);
+
+    void startRehash(unsigned int nBuckets);
+    void rehashStep();
+
+    unsigned int enterLookup();
+    void exitLookup(unsigned int slot);
+    void retire(void *mem, vm_size_t size);
+    void reclaimList(unsigned int slot);
+    void reclaim();
+
+    uintptr_t stateBucket(unsigned int i) const;
 
 public:
     static void *operator new(size_t size);
     static void operator delete(void *mem, size_t size);
 
     OSSymbolPool() { };
-    OSSymbolPool(const OSSymbolPool *old);
     virtual ~OSSymbolPool();
 
     bool init();
@@ -116,9 +185,12 @@ public:
     inline void closeGate() { lck_mtx_lock(poolGate); };
     inline void openGate()  { lck_mtx_unlock(poolGate); };
 
+    OSSymbol *lookupSymbol(const char *cString);
     OSSymbol *findSymbol(const char *cString) const;
     OSSymbol *insertSymbol(OSSymbol *sym);
     void removeSymbol(OSSymbol *sym);
+    void retireSymbol(OSSymbol *sym);
+    void synchronize();
 
     OSSymbolPoolState initHashState();
     OSSymbol *nextHashState(OSSymbolPoolState *stateP);
@@ -145,41 +217,24 @@ extern lck_grp_t *IOLockGroup;
 bool OSSymbolPool::init()
 {
     count = 0;
-    nBuckets = INITIAL_POOL_SIZE;
-    buckets = (Bucket *) kalloc(nBuckets * sizeof(Bucket));
-    ACCUMSIZE(nBuckets * sizeof(Bucket));
-    if (!buckets)
+    table = allocTable(INITIAL_POOL_SIZE);
+    if (!table)
         return false;
 
-    bzero(buckets, nBuckets * sizeof(Bucket));
-
     poolGate = lck_mtx_alloc_init(IOLockGroup, LCK_ATTR_NULL);
 
     return poolGate != 0;
 }
 
-OSSymbolPool::OSSymbolPool(const OSSymbolPool *old)
-{
-    count = old->count;
-    nBuckets = old->nBuckets;
-    buckets = old->buckets;
-
-    poolGate = 0;	// Do not duplicate the poolGate
-}
-
 OSSymbolPool::~OSSymbolPool()
 {
-    if (buckets) {
-        Bucket *thisBucket;
-        for (thisBucket = &buckets[0]; thisBucket < &buckets[nBuckets]; thisBucket++) {
-            if (thisBucket->count > 1) {
-                kfree(thisBucket->symbolP, thisBucket->count * sizeof(OSSymbol *));
-                ACCUMSIZE(-(thisBucket->count * sizeof(OSSymbol *)));
-            }
-        }
-        kfree(buckets, nBuckets * sizeof(Bucket));
-        ACCUMSIZE(-(nBuckets * sizeof(Bucket)));
-    }
+    reclaimList(0);
+    reclaimList(1);
+
+    if (oldTable)
+        freeTable(oldTable);
+    if (table)
+        freeTable(table);
 
     if (poolGate)
         lck_mtx_free(poolGate, IOLockGroup);
@@ -199,245 +254,427 @@ unsigned long OSSymbolPool::exp2ml(unsigned int x)
     return (1 << x) - 1;
 }
 
+OSSymbolPool::Table *OSSymbolPool::allocTable(unsigned int nBuckets)
+{
+    Table *newTable;
+
+    newTable = (Table *) kalloc(tableSize(nBuckets));
+    if (!newTable)
+        return 0;
+    ACCUMSIZE(tableSize(nBuckets));
+
+    bzero(newTable, tableSize(nBuckets));
+    newTable->nBuckets = nBuckets;
+
+    return newTable;
+}
+
+void OSSymbolPool::freeTable(Table *thisTable)
+{
+    uintptr_t bucket;
+    unsigned int i;
+
+    for (i = 0; i < thisTable->nBuckets; i++) {
+        bucket = thisTable->buckets[i];
+        if (bucket & kBucketList) {
+            kfree(bucketList(bucket), listSize(bucketList(bucket)->capacity));
+            ACCUMSIZE(-listSize(bucketList(bucket)->capacity));
+        }
+    }
+    kfree(thisTable, tableSize(thisTable->nBuckets));
+    ACCUMSIZE(-tableSize(thisTable->nBuckets));
+}
+
+unsigned int OSSymbolPool::bucketCount(uintptr_t bucket)
+{
+    if (!bucket)
+        return 0;
+    if (bucket & kBucketList)
+        return bucketList(bucket)->count;
+    return 1;
+}
+
+OSSymbol *OSSymbolPool::bucketSymbol(uintptr_t bucket, unsigned int index)
+{
+    if (bucket & kBucketList)
+        return bucketList(bucket)->symbols[index];
+    return (OSSymbol *) bucket;
+}
+
+OSSymbol *OSSymbolPool::findInBucket(uintptr_t bucket, const char *cString,
+                                     unsigned int inLen)
+{
+    unsigned int j;
+    OSSymbol *probeSymbol;
+
+    for (j = bucketCount(bucket); j--; ) {
+        probeSymbol = bucketSymbol(bucket, j);
+        if (inLen == probeSymbol->length
+        &&  (strncmp(probeSymbol->string, cString, probeSymbol->length) == 0))
+            return probeSymbol;
+    }
+
+    return 0;
+}
+
+/*
+ * Lookups count themselves against the epoch they started in.  The
+ * epoch is checked again after the count is taken, so a lookup can
+ * never be counted against an epoch whose retired list is being freed.
+ */
+unsigned int OSSymbolPool::enterLookup()
+{
+    UInt32 thisEpoch;
+
+    for (;;) {
+        thisEpoch = epoch;
+        OSIncrementAtomic(&readers[thisEpoch & 1]);
+        if (epoch == thisEpoch)
+            return thisEpoch & 1;
+        OSDecrementAtomic(&readers[thisEpoch & 1]);
+    }
+}
+
+void OSSymbolPool::exitLookup(unsigned int slot)
+{
+    OSDecrementAtomic(&readers[slot]);
+}
+
+void OSSymbolPool::retire(void *mem, vm_size_t size)
+{
+    Retired *node;
+
+    node = (Retired *) kalloc(sizeof(Retired));
+    if (!node) {
+        // Can't defer it, so wait out the lookups instead.
+        synchronize();
+        if (size) {
+            kfree(mem, size);
+            ACCUMSIZE(-size);
+        } else
+            ((OSSymbol *) mem)->OSString::free();
+        return;
+    }
+    ACCUMSIZE(sizeof(Retired));
+
+    node->mem = mem;
+    node->size = size;
+    node->next = retired[epoch & 1];
+    retired[epoch & 1] = node;
+}
+
+void OSSymbolPool::reclaimList(unsigned int slot)
+{
+    Retired *node;
+
+    while ((node = retired[slot])) {
+        retired[slot] = node->next;
+        if (node->size) {
+            kfree(node->mem, node->size);
+            ACCUMSIZE(-node->size);
+        } else
+            ((OSSymbol *) node->mem)->OSString::free();
+        kfree(node, sizeof(Retired));
+        ACCUMSIZE(-sizeof(Retired));
+    }
+}
+
+/*
+ * Free what was retired in the previous epoch if no lookup from it is
+ * still running, then start a new epoch for what was retired in this one.
+ */
+void OSSymbolPool::reclaim()
+{
+    UInt32 thisEpoch = epoch;
+
+    if (readers[(thisEpoch + 1) & 1])
+        return;
+
+    reclaimList((thisEpoch + 1) & 1);
+
+    if (retired[thisEpoch & 1])
+        OSIncrementAtomic((volatile SInt32 *) &epoch);
+}
+
+/*
+ * Wait for every lookup that started before the call and free everything
+ * retired so far.  Gate must be held.
+ */
+void OSSymbolPool::synchronize()
+{
+    unsigned int pass, slot;
+
+    for (pass = 0; pass < 2; pass++) {
+        slot = (epoch + 1) & 1;
+        while (readers[slot])
+            mutex_pause(0);
+        reclaimList(slot);
+        OSIncrementAtomic((volatile SInt32 *) &epoch);
+    }
+}
+
 OSSymbolPoolState OSSymbolPool::initHashState()
 {
-    OSSymbolPoolState newState = { nBuckets, 0 };
+    OSSymbolPoolState newState = { table->nBuckets, 0 };
+
+    if (oldTable)
+        newState.i += oldTable->nBuckets;
     return newState;
 }
 
-OSSymbol *OSSymbolPool::nextHashState(OSSymbolPoolState *stateP)
+uintptr_t OSSymbolPool::stateBucket(unsigned int i) const
 {
-    Bucket *thisBucket = &buckets[stateP->i];
+    if (i < table->nBuckets)
+        return table->buckets[i];
+    return oldTable->buckets[i - table->nBuckets];
+}
 
+OSSymbol *OSSymbolPool::nextHashState(OSSymbolPoolState *stateP)
+{
     while (!stateP->j) {
         if (!stateP->i)
             return 0;
         stateP->i--;
-        thisBucket--;
-        stateP->j = thisBucket->count;
+        stateP->j = bucketCount(stateBucket(stateP->i));
     }
 
     stateP->j--;
-    if (thisBucket->count == 1)
-        return (OSSymbol *) thisBucket->symbolP;
-    else
-        return thisBucket->symbolP[stateP->j];
+    return bucketSymbol(stateBucket(stateP->i), stateP->j);
 }
 
-void OSSymbolPool::reconstructSymbols(void)
+bool OSSymbolPool::bucketInsert(volatile uintptr_t *bucketP, OSSymbol *sym)
 {
-    this->reconstructSymbols(true);
+    uintptr_t bucket = *bucketP;
+    List *list, *newList;
+    unsigned int j, capacity;
+
+    if (!bucket) {
+        OSMemoryBarrier();	// symbol contents before the symbol
+        *bucketP = (uintptr_t) sym;
+        return true;
+    }
+
+    if (bucket & kBucketList) {
+        list = bucketList(bucket);
+        if (list->count < list->capacity) {
+            list->symbols[list->count] = sym;
+            OSMemoryBarrier();	// slot before the count
+            list->count++;
+            return true;
+        }
+        capacity = list->capacity * 2;
+    } else {
+        list = 0;
+        capacity = 2;
+    }
+
+    newList = (List *) kalloc(listSize(capacity));
+    if (!newList)
+        return false;
+    ACCUMSIZE(listSize(capacity));
+
+    newList->capacity = capacity;
+    if (list) {
+        for (j = 0; j < list->count; j++)
+            newList->symbols[j] = list->symbols[j];
+        newList->count = list->count;
+    } else {
+        newList->symbols[0] = (OSSymbol *) bucket;
+        newList->count = 1;
+    }
+    newList->symbols[newList->count++] = sym;
+
+    OSMemoryBarrier();	// list contents before the list
+    *bucketP = (uintptr_t) newList | kBucketList;
+
+    if (list)
+        retire(list, listSize(list->capacity));
+
+    return true;
 }
 
-void OSSymbolPool::reconstructSymbols(bool grow)
+bool OSSymbolPool::bucketRemove(volatile uintptr_t *bucketP, OSSymbol *sym)
 {
-    unsigned int new_nBuckets = nBuckets;
-    OSSymbol *insert;
-    OSSymbolPoolState state;
+    uintptr_t bucket = *bucketP;
+    List *list;
+    unsigned int j, last;
+
+    if (!(bucket & kBucketList)) {
+        if ((OSSymbol *) bucket != sym)
+            return false;
+        *bucketP = 0;
+        return true;
+    }
 
-    if (grow) {
-        new_nBuckets += new_nBuckets + 1;
-    } else {
-       /* Don't shrink the pool below the default initial size.
-        */
-        if (nBuckets <= INITIAL_POOL_SIZE) {
-            return;
+    list = bucketList(bucket);
+    for (j = 0; j < list->count; j++) {
+        if (list->symbols[j] != sym)
+            continue;
+
+        last = list->count - 1;
+        if (!last) {
+            *bucketP = 0;
+            retire(list, listSize(list->capacity));
+            return true;
         }
-        new_nBuckets = (new_nBuckets - 1) / 2;
+
+        // Fill the hole with the last symbol before dropping it off the end.
+        list->symbols[j] = list->symbols[last];
+        OSMemoryBarrier();
+        list->count = last;
+        return true;
     }
 
-   /* Create old pool to iterate after doing above check, cause it
-    * gets finalized at return.
-    */
-    OSSymbolPool old(this);
+    return false;
+}
 
-    count = 0;
-    nBuckets = new_nBuckets;
-    buckets = (Bucket *) kalloc(nBuckets * sizeof(Bucket));
-    ACCUMSIZE(nBuckets * sizeof(Bucket));
-    /* @@@ gvdl: Zero test and panic if can't set up pool */
-    bzero(buckets, nBuckets * sizeof(Bucket));
+void OSSymbolPool::startRehash(unsigned int nBuckets)
+{
+    Table *newTable;
+
+    newTable = allocTable(nBuckets);
+    if (!newTable)
+        return;		// Keep using the table we have.
 
-    state = old.initHashState();
-    while ( (insert = old.nextHashState(&state)) )
-        insertSymbol(insert);
+    rehashIndex = 0;
+    oldTable = table;
+    OSMemoryBarrier();	// lookups load table before oldTable
+    table = newTable;
 }
 
-OSSymbol *OSSymbolPool::findSymbol(const char *cString) const
+void OSSymbolPool::rehashStep()
 {
-    Bucket *thisBucket;
-    unsigned int j, inLen, hash;
-    OSSymbol *probeSymbol, **list;
-
-    hashSymbol(cString, &hash, &inLen); inLen++;
-    thisBucket = &buckets[hash % nBuckets];
-    j = thisBucket->count;
+    Table *thisOldTable = oldTable;
+    volatile uintptr_t *newBucketP;
+    uintptr_t bucket;
+    unsigned int batch, j, inLen, hash;
+    OSSymbol *sym;
 
-    if (!j)
-        return 0;
+    if (!thisOldTable)
+        return;
 
-    if (j == 1) {
-        probeSymbol = (OSSymbol *) thisBucket->symbolP;
+    for (batch = 0;
+         batch < REHASH_BATCH && rehashIndex < thisOldTable->nBuckets;
+         batch++, rehashIndex++) {
+        bucket = thisOldTable->buckets[rehashIndex];
+        if (!bucket)
+            continue;
+
+        for (j = 0; j < bucketCount(bucket); j++) {
+            sym = bucketSymbol(bucket, j);
+            hashSymbol(sym->string, &hash, &inLen);
+            newBucketP = &table->buckets[hash % table->nBuckets];
+
+            // A previous step may have failed part way through this bucket.
+            if (findInBucket(*newBucketP, sym->string, inLen + 1) == sym)
+                continue;
+            if (!bucketInsert(newBucketP, sym))
+                return;		// Try this bucket again on the next update.
+        }
 
-        if (inLen == probeSymbol->length
-        &&  (strncmp(probeSymbol->string, cString, probeSymbol->length) == 0))
-            return probeSymbol;
-	return 0;
+        thisOldTable->buckets[rehashIndex] = 0;
+        if (bucket & kBucketList)
+            retire(bucketList(bucket), listSize(bucketList(bucket)->capacity));
     }
 
-    for (list = thisBucket->symbolP; j--; list++) {
-        probeSymbol = *list;
-        if (inLen == probeSymbol->length
-        &&  (strncmp(probeSymbol->string, cString, probeSymbol->length) == 0))
-            return probeSymbol;
+    if (rehashIndex == thisOldTable->nBuckets) {
+        oldTable = 0;
+        retire(thisOldTable, tableSize(thisOldTable->nBuckets));
     }
+}
 
-    return 0;
+/*
+ * Returns the symbol retained, or 0 if it has to be looked up
+ * again with the gate closed.
+ */
+OSSymbol *OSSymbolPool::lookupSymbol(const char *cString)
+{
+    OSSymbol *probeSymbol;
+    unsigned int slot;
+
+    slot = enterLookup();
+    probeSymbol = findSymbol(cString);
+    if (probeSymbol && !probeSymbol->taggedTryRetain(0))
+        probeSymbol = 0;
+    exitLookup(slot);
+
+    return probeSymbol;
 }
 
-OSSymbol *OSSymbolPool::insertSymbol(OSSymbol *sym)
+OSSymbol *OSSymbolPool::findSymbol(const char *cString) const
 {
-    const char *cString = sym->string;
-    Bucket *thisBucket;
-    unsigned int j, inLen, hash;
-    OSSymbol *probeSymbol, **list;
+    Table *thisTable, *thisOldTable;
+    unsigned int inLen, hash;
+    OSSymbol *probeSymbol;
 
     hashSymbol(cString, &hash, &inLen); inLen++;
-    thisBucket = &buckets[hash % nBuckets];
-    j = thisBucket->count;
-
-    if (!j) {
-        thisBucket->symbolP = (OSSymbol **) sym;
-        thisBucket->count++;
-        count++;
-        return sym;
-    }
 
-    if (j == 1) {
-        probeSymbol = (OSSymbol *) thisBucket->symbolP;
+    thisTable = table;
+    thisOldTable = oldTable;
 
-        if (inLen == probeSymbol->length
-        &&  strncmp(probeSymbol->string, cString, probeSymbol->length) == 0)
+    if (thisOldTable) {
+        probeSymbol = findInBucket(thisOldTable->buckets[hash % thisOldTable->nBuckets],
+                                   cString, inLen);
+        if (probeSymbol)
             return probeSymbol;
-
-        list = (OSSymbol **) kalloc(2 * sizeof(OSSymbol *));
-        ACCUMSIZE(2 * sizeof(OSSymbol *));
-        /* @@@ gvdl: Zero test and panic if can't set up pool */
-        list[0] = sym;
-        list[1] = probeSymbol;
-        thisBucket->symbolP = list;
-        thisBucket->count++;
-        count++;
-        GROW_POOL();
-
-        return sym;
     }
 
-    for (list = thisBucket->symbolP; j--; list++) {
-        probeSymbol = *list;
-        if (inLen == probeSymbol->length
-        &&  strncmp(probeSymbol->string, cString, probeSymbol->length) == 0)
-            return probeSymbol;
-    }
+    return findInBucket(thisTable->buckets[hash % thisTable->nBuckets], cString, inLen);
+}
+
+OSSymbol *OSSymbolPool::insertSymbol(OSSymbol *sym)
+{
+    unsigned int inLen, hash;
+    OSSymbol *probeSymbol;
+
+    probeSymbol = findSymbol(sym->string);
+    if (probeSymbol)
+        return probeSymbol;
 
-    j = thisBucket->count++;
+    hashSymbol(sym->string, &hash, &inLen);
+    if (!bucketInsert(&table->buckets[hash % table->nBuckets], sym))
+        return 0;
     count++;
-    list = (OSSymbol **) kalloc(thisBucket->count * sizeof(OSSymbol *));
-    ACCUMSIZE(thisBucket->count * sizeof(OSSymbol *));
-    /* @@@ gvdl: Zero test and panic if can't set up pool */
-    list[0] = sym;
-    bcopy(thisBucket->symbolP, list + 1, j * sizeof(OSSymbol *));
-    kfree(thisBucket->symbolP, j * sizeof(OSSymbol *));
-    ACCUMSIZE(-(j * sizeof(OSSymbol *)));
-    thisBucket->symbolP = list;
+
+    rehashStep();
     GROW_POOL();
+    reclaim();
 
     return sym;
 }
 
 void OSSymbolPool::removeSymbol(OSSymbol *sym)
 {
-    Bucket *thisBucket;
-    unsigned int j, inLen, hash;
-    OSSymbol *probeSymbol, **list;
+    unsigned int inLen, hash;
+    bool found = false;
 
-    hashSymbol(sym->string, &hash, &inLen); inLen++;
-    thisBucket = &buckets[hash % nBuckets];
-    j = thisBucket->count;
-    list = thisBucket->symbolP;
+    hashSymbol(sym->string, &hash, &inLen);
 
-    if (!j) {
-	// couldn't find the symbol; probably means string hash changed
-        panic("removeSymbol %s count %d ", sym->string ? sym->string : "no string", count);
-        return;
-    }
-
-    if (j == 1) {
-        probeSymbol = (OSSymbol *) list;
+    // A symbol is in both tables if a rehash step failed part way.
+    if (oldTable)
+        found = bucketRemove(&oldTable->buckets[hash % oldTable->nBuckets], sym);
+    if (bucketRemove(&table->buckets[hash % table->nBuckets], sym))
+        found = true;
 
-        if (probeSymbol == sym) {
-            thisBucket->symbolP = 0;
-            count--;
-            thisBucket->count--;
-            SHRINK_POOL();
-            return;
-        }
+    if (!found) {
 	// couldn't find the symbol; probably means string hash changed
-    	panic("removeSymbol %s count %d ", sym->string ? sym->string : "no string", count);
+        panic("removeSymbol %s count %d ", sym->string ? sym->string : "no string", count);
         return;
     }
 
-    if (j == 2) {
-        probeSymbol = list[0];
-        if (probeSymbol == sym) {
-            thisBucket->symbolP = (OSSymbol **) list[1];
-            kfree(list, 2 * sizeof(OSSymbol *));
-	    ACCUMSIZE(-(2 * sizeof(OSSymbol *)));
-            count--;
-            thisBucket->count--;
-            SHRINK_POOL();
-            return;
-        }
-
-        probeSymbol = list[1];
-        if (probeSymbol == sym) {
-            thisBucket->symbolP = (OSSymbol **) list[0];
-            kfree(list, 2 * sizeof(OSSymbol *));
-	    ACCUMSIZE(-(2 * sizeof(OSSymbol *)));
-            count--;
-            thisBucket->count--;
-            SHRINK_POOL();
-            return;
-        }
-	// couldn't find the symbol; probably means string hash changed
-    	panic("removeSymbol %s count %d ", sym->string ? sym->string : "no string", count);
-        return;
-    }
+    count--;
+    rehashStep();
+    SHRINK_POOL();
+    reclaim();
+}
 
-    for (; j--; list++) {
-        probeSymbol = *list;
-        if (probeSymbol == sym) {
-
-            list = (OSSymbol **)
-                kalloc((thisBucket->count-1) * sizeof(OSSymbol *));
-	    ACCUMSIZE((thisBucket->count-1) * sizeof(OSSymbol *));
-            if (thisBucket->count-1 != j)
-                bcopy(thisBucket->symbolP, list,
-                      (thisBucket->count-1-j) * sizeof(OSSymbol *));
-            if (j)
-                bcopy(thisBucket->symbolP + thisBucket->count-j,
-                      list + thisBucket->count-1-j,
-                      j * sizeof(OSSymbol *));
-            kfree(thisBucket->symbolP, thisBucket->count * sizeof(OSSymbol *));
-	    ACCUMSIZE(-(thisBucket->count * sizeof(OSSymbol *)));
-            thisBucket->symbolP = list;
-            count--;
-            thisBucket->count--;
-            return;
-        }
-    }
-    // couldn't find the symbol; probably means string hash changed
-    panic("removeSymbol %s count %d ", sym->string ? sym->string : "no string", count);
+/*
+ * The symbol has been removed, but lookups may still be comparing
+ * against it, so its storage is only freed once they have drained.
+ */
+void OSSymbolPool::retireSymbol(OSSymbol *sym)
+{
+    retire(sym, 0);
 }
 
 /*
@@ -488,9 +725,14 @@ const OSSymbol *OSSymbol::withString(const OSString *aString)
 
 const OSSymbol *OSSymbol::withCString(const char *cString)
 {
+    // Most symbols already exist, look for them without the gate.
+    OSSymbol *oldSymb = pool->lookupSymbol(cString);
+    if (oldSymb)
+        return oldSymb;
+
     pool->closeGate();
 
-    OSSymbol *oldSymb = pool->findSymbol(cString);
+    oldSymb = pool->findSymbol(cString);
     if (!oldSymb) {
         OSSymbol *newSymb = new OSSymbol;
         if (!newSymb) {
@@ -508,6 +750,11 @@ const OSSymbol *OSSymbol::withCString(const char *cString)
         else
             // Somebody else inserted the new symbol so free our copy
 	    newSymb->OSString::free();
+
+        if (!oldSymb) {
+            pool->openGate();
+            return 0;
+        }
     }
     
     oldSymb->retain();	// Retain the old symbol before releasing the lock.
@@ -518,9 +765,14 @@ const OSSymbol *OSSymbol::withCString(const char *cString)
 
 const OSSymbol *OSSymbol::withCStringNoCopy(const char *cString)
 {
+    // Most symbols already exist, look for them without the gate.
+    OSSymbol *oldSymb = pool->lookupSymbol(cString);
+    if (oldSymb)
+        return oldSymb;
+
     pool->closeGate();
 
-    OSSymbol *oldSymb = pool->findSymbol(cString);
+    oldSymb = pool->findSymbol(cString);
     if (!oldSymb) {
         OSSymbol *newSymb = new OSSymbol;
         if (!newSymb) {
@@ -538,6 +790,11 @@ const OSSymbol *OSSymbol::withCStringNoCopy(const char *cString)
         else
             // Somebody else inserted the new symbol so free our copy
 	    newSymb->OSString::free();
+
+        if (!oldSymb) {
+            pool->openGate();
+            return 0;
+        }
     }
     
     oldSymb->retain();	// Retain the old symbol before releasing the lock.
@@ -563,6 +820,8 @@ void OSSymbol::checkForPageUnload(void *startAddr, void *endAddr)
             probeSymbol->flags &= ~kOSStringNoCopy;
         }
     }
+    // Lookups may still be comparing against the strings being unloaded.
+    pool->synchronize();
     pool->openGate();
 }
 
@@ -581,7 +840,7 @@ void OSSymbol::taggedRelease(const void *tag, const int when) const
 void OSSymbol::free()
 {
     pool->removeSymbol(this);
-    super::free();
+    pool->retireSymbol(this);	// super::free() once lookups have drained
 }
 
 bool OSSymbol::isEqualTo(const char *aCString) const
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Userspace model of the OSDictionary key lookup paths.
+ *
+ * The kernel class can't be linked into a user process, so this harness
+ * carries copies of the linear scan and of the hashed key index from
+ * libkern/c++/OSDictionary.cpp (same hash, probe sequence and sizing) and
+ * times hits and misses against both at a range of dictionary sizes.
+ * Keys are heap allocated objects, like OSSymbols, so the pointer values
+ * have realistic alignment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <err.h>
+
+#include <mach/mach_time.h>
+
+enum {
+    kHashIndexMinCount = 32,
+    kHashIndexEmpty    = 0
+};
+
+struct Symbol {
+    char name[32];
+};
+
+struct dictEntry {
+    const Symbol * key;
+    const void   * value;
+};
+
+static inline unsigned int
+hashKeyPointer(const Symbol *aKey)
+{
+    uint64_t h = (uint64_t)(uintptr_t) aKey;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (unsigned int) h;
+}
+
+struct Dict {
+    dictEntry    * dictionary;
+    unsigned int   count;
+    unsigned int * hashIndex;
+    unsigned int   hashSize;
+
+    void buildIndex()
+    {
+        free(hashIndex);
+        for (hashSize = kHashIndexMinCount * 2; hashSize < (count * 2); hashSize <<= 1)
+            ;
+        hashIndex = (unsigned int *) calloc(hashSize, sizeof(unsigned int));
+        if (!hashIndex)
+            err(1, "calloc");
+
+        unsigned int mask = hashSize - 1;
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int slot = hashKeyPointer(dictionary[i].key) & mask;
+            while (hashIndex[slot] != kHashIndexEmpty)
+                slot = (slot + 1) & mask;
+            hashIndex[slot] = i + 1;
+        }
+    }
+
+    unsigned int findLinear(const Symbol *aKey) const
+    {
+        unsigned int i;
+
+        for (i = 0; i < count; i++) {
+            if (aKey == dictionary[i].key) break;
+        }
+        return i;
+    }
+
+    unsigned int findHashed(const Symbol *aKey) const
+    {
+        unsigned int mask = hashSize - 1;
+        unsigned int slot = hashKeyPointer(aKey) & mask;
+        unsigned int entry;
+
+        while ((entry = hashIndex[slot]) != kHashIndexEmpty) {
+            if (aKey == dictionary[entry - 1].key)
+                return entry - 1;
+            slot = (slot + 1) & mask;
+        }
+        return count;
+    }
+};
+
+static mach_timebase_info_data_t timebase;
+
+static double
+nsPerLookup(uint64_t start, uint64_t end, unsigned int lookups)
+{
+    return (double)(end - start) * timebase.numer / timebase.denom / lookups;
+}
+
+static void
+runSize(unsigned int count, unsigned int lookups)
+{
+    Dict           dict;
+    Symbol      ** keys;
+    Symbol      ** misses;
+    unsigned int * order;
+    unsigned int   i, found;
+    uint64_t       start, end;
+    double         linHit, linMiss, hashHit, hashMiss;
+
+    keys   = (Symbol **) calloc(count, sizeof(Symbol *));
+    misses = (Symbol **) calloc(count, sizeof(Symbol *));
+    order  = (unsigned int *) calloc(lookups, sizeof(unsigned int));
+    dict.dictionary = (dictEntry *) calloc(count, sizeof(dictEntry));
+    dict.hashIndex = NULL;
+    if (!keys || !misses || !order || !dict.dictionary)
+        err(1, "calloc");
+
+    for (i = 0; i < count; i++) {
+        keys[i] = (Symbol *) malloc(sizeof(Symbol));
+        misses[i] = (Symbol *) malloc(sizeof(Symbol));
+        if (!keys[i] || !misses[i])
+            err(1, "malloc");
+        snprintf(keys[i]->name, sizeof(keys[i]->name), "key%u", i);
+        dict.dictionary[i].key = keys[i];
+        dict.dictionary[i].value = keys[i];
+    }
+    dict.count = count;
+    dict.buildIndex();
+
+    for (i = 0; i < lookups; i++)
+        order[i] = arc4random_uniform(count);
+
+    // the linear and hashed lookups must agree before timing means anything
+    for (i = 0; i < count; i++) {
+        if (dict.findLinear(keys[i]) != i || dict.findHashed(keys[i]) != i)
+            errx(1, "lookup mismatch for key %u of %u", i, count);
+        if (dict.findHashed(misses[i]) != count)
+            errx(1, "false hit for missing key %u of %u", i, count);
+    }
+
+    found = 0;
+    start = mach_absolute_time();
+    for (i = 0; i < lookups; i++)
+        found += (dict.findLinear(keys[order[i]]) < count);
+    end = mach_absolute_time();
+    linHit = nsPerLookup(start, end, lookups);
+
+    start = mach_absolute_time();
+    for (i = 0; i < lookups; i++)
+        found += (dict.findLinear(misses[order[i]]) < count);
+    end = mach_absolute_time();
+    linMiss = nsPerLookup(start, end, lookups);
+
+    start = mach_absolute_time();
+    for (i = 0; i < lookups; i++)
+        found += (dict.findHashed(keys[order[i]]) < count);
+    end = mach_absolute_time();
+    hashHit = nsPerLookup(start, end, lookups);
+
+    start = mach_absolute_time();
+    for (i = 0; i < lookups; i++)
+        found += (dict.findHashed(misses[order[i]]) < count);
+    end = mach_absolute_time();
+    hashMiss = nsPerLookup(start, end, lookups);
+
+    if (found != 2 * lookups)
+        errx(1, "unexpected hit count %u", found);
+
+    printf("%8u %12.1f %12.1f %12.1f %12.1f%s\n", count,
+           linHit, linMiss, hashHit, hashMiss,
+           (count < kHashIndexMinCount) ? "   (linear in kernel)" : "");
+
+    for (i = 0; i < count; i++) {
+        free(keys[i]);
+        free(misses[i]);
+    }
+    free(keys);
+    free(misses);
+    free(order);
+    free(dict.dictionary);
+    free(dict.hashIndex);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const unsigned int sizes[] = { 8, 64, 512, 4096 };
+    unsigned int lookups = 1000000;
+
+    if (argc > 1)
+        lookups = (unsigned int) strtoul(argv[1], NULL, 0);
+    if (lookups == 0)
+        errx(1, "usage: %s [lookups]", argv[0]);
+
+    mach_timebase_info(&timebase);
+
+    printf("%u lookups per measurement, times in ns per lookup\n", lookups);
+    printf("%8s %12s %12s %12s %12s\n",
+           "keys", "linear hit", "linear miss", "hash hit", "hash miss");
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        runSize(sizes[i], lookups);
+
+    return 0;
+}
@@ -0,0 +1,750 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Userspace stress test for the OSSymbol pool.
+ *
+ * OSSymbol can't be linked into a user process, so this carries a copy of
+ * OSSymbolPool from libkern/c++/OSSymbol.cpp (bucket lists, incremental
+ * rehash, epoch retirement and the ungated lookup path) on top of a minimal
+ * refcounted Symbol.  Worker threads look up, create and release symbols
+ * from a shared name set that is large enough to make the pool grow and
+ * shrink repeatedly, and check every symbol they get back.  Run it under
+ * the address sanitizer to catch lookups touching reclaimed memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef size_t vm_size_t;
+
+#define kalloc(size)		malloc(size)
+#define kfree(mem, size)	free(mem)
+#define OSIncrementAtomic(p)	OSAtomicIncrement32Barrier((volatile int32_t *)(p))
+#define OSDecrementAtomic(p)	OSAtomicDecrement32Barrier((volatile int32_t *)(p))
+#define mutex_pause(x)		sched_yield()
+#define ACCUMSIZE(s)
+
+static volatile int32_t symbolsAllocated;
+
+struct Symbol {
+    volatile UInt32 retainCount;
+    unsigned int length;		// including the terminating nul
+    char *string;
+
+    bool tryRetain()
+    {
+        UInt32 origCount;
+
+        do {
+            origCount = retainCount;
+            if (origCount == 0xffff)
+                return false;
+        } while (!OSAtomicCompareAndSwap32Barrier(origCount, origCount + 1,
+                                                  (volatile int32_t *) &retainCount));
+        return true;
+    }
+
+    void destroy()
+    {
+        free(string);
+        free(this);
+        OSAtomicDecrement32Barrier(&symbolsAllocated);
+    }
+};
+
+typedef struct { unsigned int i, j; } OSSymbolPoolState;
+
+#define INITIAL_POOL_SIZE  (exp2ml(1 + log2(kInitBucketCount)))
+
+#define GROW_FACTOR   (1)
+#define SHRINK_FACTOR (3)
+
+#define REHASH_BATCH  (8)
+
+#define GROW_POOL()     do \
+    if (!oldTable && count * GROW_FACTOR > table->nBuckets) { \
+        startRehash(table->nBuckets + table->nBuckets + 1); \
+    } \
+while (0)
+
+#define SHRINK_POOL()     do \
+    if (!oldTable && count * SHRINK_FACTOR < table->nBuckets && \
+        table->nBuckets > INITIAL_POOL_SIZE) { \
+        startRehash((table->nBuckets - 1) / 2); \
+    } \
+while (0)
+
+class SymbolPool
+{
+private:
+    static const unsigned int kInitBucketCount = 16;
+    static const uintptr_t kBucketList = 1;
+
+    typedef struct {
+        volatile unsigned int count;
+        unsigned int capacity;
+        Symbol *symbols[0];
+    } List;
+
+    typedef struct {
+        unsigned int nBuckets;
+        volatile uintptr_t buckets[0];
+    } Table;
+
+    typedef struct Retired {
+        struct Retired *next;
+        void *mem;
+        vm_size_t size;
+    } Retired;
+
+    Table * volatile table;
+    Table * volatile oldTable;
+    unsigned int rehashIndex;
+    pthread_mutex_t poolGate;
+
+    volatile UInt32 epoch;
+    volatile SInt32 readers[2];
+    Retired *retired[2];
+
+    static inline void hashSymbol(const char *s,
+                                  unsigned int *hashP,
+                                  unsigned int *lenP)
+    {
+        unsigned int hash = 0;
+        unsigned int len = 0;
+
+        for (;;) {
+            if (!*s) break; len++; hash ^= *s++;
+            if (!*s) break; len++; hash ^= *s++ <<  8;
+            if (!*s) break; len++; hash ^= *s++ << 16;
+            if (!*s) break; len++; hash ^= *s++ << 24;
+        }
+        *lenP = len;
+        *hashP = hash;
+    }
+
+    static inline vm_size_t listSize(unsigned int capacity)
+        { return sizeof(List) + capacity * sizeof(Symbol *); };
+    static inline vm_size_t tableSize(unsigned int nBuckets)
+        { return sizeof(Table) + nBuckets * sizeof(uintptr_t); };
+    static inline List *bucketList(uintptr_t bucket)
+        { return (List *) (bucket & ~kBucketList); };
+
+    static unsigned long log2(unsigned int x)
+    {
+        unsigned long i;
+
+        for (i = 0; x > 1 ; i++)
+            x >>= 1;
+        return i;
+    }
+
+    static unsigned long exp2ml(unsigned int x)
+    {
+        return (1 << x) - 1;
+    }
+
+    static unsigned int bucketCount(uintptr_t bucket)
+    {
+        if (!bucket)
+            return 0;
+        if (bucket & kBucketList)
+            return bucketList(bucket)->count;
+        return 1;
+    }
+
+    static Symbol *bucketSymbol(uintptr_t bucket, unsigned int index)
+    {
+        if (bucket & kBucketList)
+            return bucketList(bucket)->symbols[index];
+        return (Symbol *) bucket;
+    }
+
+    static Symbol *findInBucket(uintptr_t bucket, const char *cString,
+                                unsigned int inLen)
+    {
+        unsigned int j;
+        Symbol *probeSymbol;
+
+        for (j = bucketCount(bucket); j--; ) {
+            probeSymbol = bucketSymbol(bucket, j);
+            if (inLen == probeSymbol->length
+            &&  (strncmp(probeSymbol->string, cString, probeSymbol->length) == 0))
+                return probeSymbol;
+        }
+
+        return 0;
+    }
+
+    static Table *allocTable(unsigned int nBuckets)
+    {
+        Table *newTable;
+
+        newTable = (Table *) kalloc(tableSize(nBuckets));
+        if (!newTable)
+            return 0;
+
+        bzero(newTable, tableSize(nBuckets));
+        newTable->nBuckets = nBuckets;
+
+        return newTable;
+    }
+
+    static void freeTable(Table *thisTable)
+    {
+        uintptr_t bucket;
+        unsigned int i;
+
+        for (i = 0; i < thisTable->nBuckets; i++) {
+            bucket = thisTable->buckets[i];
+            if (bucket & kBucketList)
+                kfree(bucketList(bucket), listSize(bucketList(bucket)->capacity));
+        }
+        kfree(thisTable, tableSize(thisTable->nBuckets));
+    }
+
+    unsigned int enterLookup()
+    {
+        UInt32 thisEpoch;
+
+        for (;;) {
+            thisEpoch = epoch;
+            OSIncrementAtomic(&readers[thisEpoch & 1]);
+            if (epoch == thisEpoch)
+                return thisEpoch & 1;
+            OSDecrementAtomic(&readers[thisEpoch & 1]);
+        }
+    }
+
+    void exitLookup(unsigned int slot)
+    {
+        OSDecrementAtomic(&readers[slot]);
+    }
+
+    void retire(void *mem, vm_size_t size)
+    {
+        Retired *node;
+
+        node = (Retired *) kalloc(sizeof(Retired));
+        if (!node) {
+            synchronize();
+            if (size)
+                kfree(mem, size);
+            else
+                ((Symbol *) mem)->destroy();
+            return;
+        }
+
+        node->mem = mem;
+        node->size = size;
+        node->next = retired[epoch & 1];
+        retired[epoch & 1] = node;
+    }
+
+    void reclaimList(unsigned int slot)
+    {
+        Retired *node;
+
+        while ((node = retired[slot])) {
+            retired[slot] = node->next;
+            if (node->size)
+                kfree(node->mem, node->size);
+            else
+                ((Symbol *) node->mem)->destroy();
+            kfree(node, sizeof(Retired));
+        }
+    }
+
+    void reclaim()
+    {
+        UInt32 thisEpoch = epoch;
+
+        if (readers[(thisEpoch + 1) & 1])
+            return;
+
+        reclaimList((thisEpoch + 1) & 1);
+
+        if (retired[thisEpoch & 1])
+            OSIncrementAtomic(&epoch);
+    }
+
+    bool bucketInsert(volatile uintptr_t *bucketP, Symbol *sym)
+    {
+        uintptr_t bucket = *bucketP;
+        List *list, *newList;
+        unsigned int j, capacity;
+
+        if (!bucket) {
+            OSMemoryBarrier();
+            *bucketP = (uintptr_t) sym;
+            return true;
+        }
+
+        if (bucket & kBucketList) {
+            list = bucketList(bucket);
+            if (list->count < list->capacity) {
+                list->symbols[list->count] = sym;
+                OSMemoryBarrier();
+                list->count++;
+                return true;
+            }
+            capacity = list->capacity * 2;
+        } else {
+            list = 0;
+            capacity = 2;
+        }
+
+        newList = (List *) kalloc(listSize(capacity));
+        if (!newList)
+            return false;
+
+        newList->capacity = capacity;
+        if (list) {
+            for (j = 0; j < list->count; j++)
+                newList->symbols[j] = list->symbols[j];
+            newList->count = list->count;
+        } else {
+            newList->symbols[0] = (Symbol *) bucket;
+            newList->count = 1;
+        }
+        newList->symbols[newList->count++] = sym;
+
+        OSMemoryBarrier();
+        *bucketP = (uintptr_t) newList | kBucketList;
+
+        if (list)
+            retire(list, listSize(list->capacity));
+
+        return true;
+    }
+
+    bool bucketRemove(volatile uintptr_t *bucketP, Symbol *sym)
+    {
+        uintptr_t bucket = *bucketP;
+        List *list;
+        unsigned int j, last;
+
+        if (!(bucket & kBucketList)) {
+            if ((Symbol *) bucket != sym)
+                return false;
+            *bucketP = 0;
+            return true;
+        }
+
+        list = bucketList(bucket);
+        for (j = 0; j < list->count; j++) {
+            if (list->symbols[j] != sym)
+                continue;
+
+            last = list->count - 1;
+            if (!last) {
+                *bucketP = 0;
+                retire(list, listSize(list->capacity));
+                return true;
+            }
+
+            list->symbols[j] = list->symbols[last];
+            OSMemoryBarrier();
+            list->count = last;
+            return true;
+        }
+
+        return false;
+    }
+
+    void startRehash(unsigned int nBuckets)
+    {
+        Table *newTable;
+
+        newTable = allocTable(nBuckets);
+        if (!newTable)
+            return;
+
+        rehashIndex = 0;
+        oldTable = table;
+        OSMemoryBarrier();
+        table = newTable;
+        rehashes++;
+    }
+
+    void rehashStep()
+    {
+        Table *thisOldTable = oldTable;
+        volatile uintptr_t *newBucketP;
+        uintptr_t bucket;
+        unsigned int batch, j, inLen, hash;
+        Symbol *sym;
+
+        if (!thisOldTable)
+            return;
+
+        for (batch = 0;
+             batch < REHASH_BATCH && rehashIndex < thisOldTable->nBuckets;
+             batch++, rehashIndex++) {
+            bucket = thisOldTable->buckets[rehashIndex];
+            if (!bucket)
+                continue;
+
+            for (j = 0; j < bucketCount(bucket); j++) {
+                sym = bucketSymbol(bucket, j);
+                hashSymbol(sym->string, &hash, &inLen);
+                newBucketP = &table->buckets[hash % table->nBuckets];
+
+                if (findInBucket(*newBucketP, sym->string, inLen + 1) == sym)
+                    continue;
+                if (!bucketInsert(newBucketP, sym))
+                    return;
+            }
+
+            thisOldTable->buckets[rehashIndex] = 0;
+            if (bucket & kBucketList)
+                retire(bucketList(bucket), listSize(bucketList(bucket)->capacity));
+        }
+
+        if (rehashIndex == thisOldTable->nBuckets) {
+            oldTable = 0;
+            retire(thisOldTable, tableSize(thisOldTable->nBuckets));
+        }
+    }
+
+    Symbol *findSymbol(const char *cString) const
+    {
+        Table *thisTable, *thisOldTable;
+        unsigned int inLen, hash;
+        Symbol *probeSymbol;
+
+        hashSymbol(cString, &hash, &inLen); inLen++;
+
+        thisTable = table;
+        thisOldTable = oldTable;
+
+        if (thisOldTable) {
+            probeSymbol = findInBucket(thisOldTable->buckets[hash % thisOldTable->nBuckets],
+                                       cString, inLen);
+            if (probeSymbol)
+                return probeSymbol;
+        }
+
+        return findInBucket(thisTable->buckets[hash % thisTable->nBuckets], cString, inLen);
+    }
+
+    Symbol *insertSymbol(Symbol *sym)
+    {
+        unsigned int inLen, hash;
+        Symbol *probeSymbol;
+
+        probeSymbol = findSymbol(sym->string);
+        if (probeSymbol)
+            return probeSymbol;
+
+        hashSymbol(sym->string, &hash, &inLen);
+        if (!bucketInsert(&table->buckets[hash % table->nBuckets], sym))
+            return 0;
+        count++;
+
+        rehashStep();
+        GROW_POOL();
+        reclaim();
+
+        return sym;
+    }
+
+    void removeSymbol(Symbol *sym)
+    {
+        unsigned int inLen, hash;
+        bool found = false;
+
+        hashSymbol(sym->string, &hash, &inLen);
+
+        if (oldTable)
+            found = bucketRemove(&oldTable->buckets[hash % oldTable->nBuckets], sym);
+        if (bucketRemove(&table->buckets[hash % table->nBuckets], sym))
+            found = true;
+
+        if (!found)
+            errx(1, "removeSymbol %s count %u", sym->string, count);
+
+        count--;
+        rehashStep();
+        SHRINK_POOL();
+        reclaim();
+    }
+
+public:
+    unsigned int count;
+    unsigned int rehashes;
+    bool gatedOnly;
+
+    SymbolPool()
+    {
+        bzero(this, sizeof(*this));
+        table = allocTable(INITIAL_POOL_SIZE);
+        if (!table)
+            err(1, "malloc");
+        pthread_mutex_init(&poolGate, NULL);
+    }
+
+    ~SymbolPool()
+    {
+        reclaimList(0);
+        reclaimList(1);
+        if (oldTable)
+            freeTable(oldTable);
+        freeTable(table);
+        pthread_mutex_destroy(&poolGate);
+    }
+
+    void synchronize()
+    {
+        unsigned int pass, slot;
+
+        for (pass = 0; pass < 2; pass++) {
+            slot = (epoch + 1) & 1;
+            while (readers[slot])
+                mutex_pause(0);
+            reclaimList(slot);
+            OSIncrementAtomic(&epoch);
+        }
+    }
+
+    void closeGate() { pthread_mutex_lock(&poolGate); }
+    void openGate()  { pthread_mutex_unlock(&poolGate); }
+
+    Symbol *lookupSymbol(const char *cString)
+    {
+        Symbol *probeSymbol;
+        unsigned int slot;
+
+        slot = enterLookup();
+        probeSymbol = findSymbol(cString);
+        if (probeSymbol && !probeSymbol->tryRetain())
+            probeSymbol = 0;
+        exitLookup(slot);
+
+        return probeSymbol;
+    }
+
+    /* OSSymbol::withCString */
+    Symbol *withCString(const char *cString)
+    {
+        Symbol *oldSymb = gatedOnly ? 0 : lookupSymbol(cString);
+        if (oldSymb)
+            return oldSymb;
+
+        closeGate();
+
+        oldSymb = findSymbol(cString);
+        if (!oldSymb) {
+            Symbol *newSymb = (Symbol *) malloc(sizeof(Symbol));
+            if (!newSymb)
+                err(1, "malloc");
+            newSymb->retainCount = 1;
+            newSymb->length = (unsigned int) strlen(cString) + 1;
+            newSymb->string = strdup(cString);
+            OSAtomicIncrement32Barrier(&symbolsAllocated);
+
+            oldSymb = insertSymbol(newSymb);
+            if (newSymb == oldSymb) {
+                openGate();
+                return newSymb;
+            }
+            newSymb->destroy();
+            if (!oldSymb) {
+                openGate();
+                return 0;
+            }
+        }
+
+        if (!oldSymb->tryRetain())
+            errx(1, "gated lookup found freed symbol %s", cString);
+
+        openGate();
+        return oldSymb;
+    }
+
+    /* OSSymbol::taggedRelease and OSSymbol::free */
+    void release(Symbol *sym)
+    {
+        UInt32 origCount, newCount;
+
+        closeGate();
+        do {
+            origCount = sym->retainCount;
+            newCount = (origCount == 1) ? 0xffff : origCount - 1;
+        } while (!OSAtomicCompareAndSwap32Barrier(origCount, newCount,
+                                                  (volatile int32_t *) &sym->retainCount));
+        if (newCount == 0xffff) {
+            removeSymbol(sym);
+            retire(sym, 0);
+        }
+        openGate();
+    }
+};
+
+enum {
+    kNameCount   = 8192,
+    kHeldPerThread = 64
+};
+
+static SymbolPool *pool;
+static char names[kNameCount][24];
+static unsigned int iterations = 200000;
+static volatile int32_t failures;
+
+static void *
+worker(void *arg)
+{
+    Symbol *held[kHeldPerThread];
+    unsigned int seed = (unsigned int)(uintptr_t) arg;
+    unsigned int i, name, spread, slot;
+    Symbol *sym;
+
+    bzero(held, sizeof(held));
+
+    for (i = 0; i < iterations; i++) {
+        // Alternate between a hot set and the whole name set so the
+        // pool keeps growing and shrinking under the lookups.
+        spread = ((i / 4096) & 1) ? kNameCount : 256;
+        name = rand_r(&seed) % spread;
+
+        sym = pool->withCString(names[name]);
+        if (!sym || strcmp(sym->string, names[name]) != 0 ||
+            sym->retainCount == 0xffff) {
+            OSAtomicIncrement32Barrier(&failures);
+            continue;
+        }
+
+        slot = rand_r(&seed) % kHeldPerThread;
+        if (held[slot])
+            pool->release(held[slot]);
+        held[slot] = sym;
+    }
+
+    for (slot = 0; slot < kHeldPerThread; slot++) {
+        if (held[slot])
+            pool->release(held[slot]);
+    }
+
+    return NULL;
+}
+
+static void
+runThreads(unsigned int nthreads, bool gatedOnly)
+{
+    static mach_timebase_info_data_t timebase;
+    pthread_t threads[nthreads];
+    uint64_t start, end;
+    unsigned int i;
+
+    if (!timebase.denom)
+        mach_timebase_info(&timebase);
+
+    pool = new SymbolPool;
+    pool->gatedOnly = gatedOnly;
+
+    start = mach_absolute_time();
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)(i + 1)))
+            err(1, "pthread_create");
+    }
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    end = mach_absolute_time();
+
+    if (failures)
+        errx(1, "%d lookups returned a bad symbol", failures);
+    if (pool->count != 0)
+        errx(1, "%u symbols left in the pool", pool->count);
+
+    pool->closeGate();
+    pool->synchronize();
+    pool->openGate();
+    if (symbolsAllocated != 0)
+        errx(1, "%d symbols not reclaimed", symbolsAllocated);
+
+    printf("%8u %8s %12.1f %10u\n", nthreads, gatedOnly ? "gated" : "ungated",
+           (double)(end - start) * timebase.numer / timebase.denom / ((double) nthreads * iterations),
+           pool->rehashes);
+
+    delete pool;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const unsigned int threadCounts[] = { 1, 2, 4, 8, 16 };
+    unsigned int i;
+
+    if (argc > 1)
+        iterations = (unsigned int) strtoul(argv[1], NULL, 0);
+    if (iterations == 0)
+        errx(1, "usage: %s [iterations per thread]", argv[0]);
+
+    for (i = 0; i < kNameCount; i++)
+        snprintf(names[i], sizeof(names[i]), "IOSymbolStress%u", i);
+
+    // Every live symbol must be unique: repeated lookups return the same one.
+    pool = new SymbolPool;
+    for (i = 0; i < kNameCount; i++) {
+        Symbol *a = pool->withCString(names[i]);
+        Symbol *b = pool->withCString(names[i]);
+        if (a != b || a->retainCount != 2)
+            errx(1, "duplicate symbol for %s", names[i]);
+    }
+    for (i = 0; i < kNameCount; i++) {
+        Symbol *a = pool->withCString(names[i]);
+        pool->release(a);
+        pool->release(a);
+        pool->release(a);
+    }
+    if (pool->count != 0)
+        errx(1, "%u symbols left in the pool", pool->count);
+    delete pool;
+
+    printf("%u iterations per thread, times in ns per withCString + release\n", iterations);
+    printf("%8s %8s %12s %10s\n", "threads", "lookups", "ns/op", "rehashes");
+
+    for (i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+        runThreads(threadCounts[i], true);
+        runThreads(threadCounts[i], false);
+    }
+
+    return 0;
+}
@@ -91,9 +91,11 @@ class OSString;
  * An OSDictionary also grows as necessary to accommodate new key/value pairs,
  * <i>unlike</i> Core Foundation collections (it does not, however, shrink).
  *
- * <b>Note:</b> OSDictionary currently uses a linear search algorithm,
- * and is not designed for high-performance access of many values.
- * It is intended as a simple associative-storage mechanism only.
+ * <b>Note:</b> Small OSDictionaries use a linear search algorithm.
+ * Once an unsorted dictionary grows past a few dozen keys
+ * it builds a hashed index over its key pointers,
+ * which is discarded again if the dictionary shrinks.
+ * Iteration order is always insertion order, and is unaffected by the index.
  *
  * <b>Use Restrictions</b>
  *
@@ -125,7 +127,15 @@ protected:
     unsigned int   capacity;
     unsigned int   capacityIncrement;
 
-    struct ExpansionData { };
+#ifdef XNU_KERNEL_PRIVATE
+    /* Available within xnu source only */
+    struct ExpansionData {
+        unsigned int * hashIndex;   // open addressed, slot holds entry index + 1
+        unsigned int   hashSize;    // number of slots, power of two
+    };
+#else
+    struct ExpansionData;
+#endif
 
    /* Reserved for future use.  (Internal use only)  */
     ExpansionData * reserved;
@@ -135,6 +145,13 @@ protected:
     virtual bool initIterator(void * iterator) const;
     virtual bool getNextObjectForIterator(void * iterator, OSObject ** ret) const;
 
+private:
+    // Hashed key index, built once a non-sorted dictionary grows large.
+    unsigned int findIndex(const OSSymbol * aKey) const;
+    void         buildIndex();
+    void         freeIndex();
+    void         insertIndex(unsigned int entry);
+
 public:
 
    /*!
@@ -232,6 +232,25 @@ protected:
     */
     virtual void taggedRelease(const void * tag, const int freeWhen) const;
 
+   /*!
+    * @function taggedTryRetain
+    *
+    * @abstract
+    * Retains a tagged reference to an object unless it is being freed.
+    *
+    * @param tag  Used for tracking collection references.
+    *
+    * @result
+    * <code>false</code> if the last reference to the object has already
+    * been released, <code>true</code> if a reference was taken.
+    *
+    * @discussion
+    * Kernel extensions should not use this function.
+    * It is for use by OSSymbol lookups that find an object without
+    * holding the lock that keeps it alive.
+    */
+    bool taggedTryRetain(const void * tag) const;
+
 
    /*!
     * @function init
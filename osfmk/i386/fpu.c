@@ -985,3 +985,40 @@ boolean_t
 ml_fpu_avx_enabled(void) {
 	return (fpu_YMM_present == TRUE);
 }
+
+/*
+ * Bracket a short stretch of kernel code that uses the SSE/AVX registers,
+ * such as the vector checksum routines.  Whatever state of the current
+ * thread is live in the FPU is saved into its PCB first, and CR0.TS is
+ * set again on exit so that the thread reloads it on its next FPU use.
+ * Preemption stays disabled in between; the caller must not block.
+ * Returns FALSE at interrupt level, in which case the caller must fall
+ * back to integer code and must not call ml_fpu_kernel_exit().
+ */
+boolean_t
+ml_fpu_kernel_enter(void)
+{
+	thread_t	thr_act;
+	boolean_t	intr;
+
+	if (get_interrupt_level())
+		return (FALSE);
+
+	disable_preemption();
+	thr_act = current_thread();
+
+	intr = ml_set_interrupts_enabled(FALSE);
+	clear_ts();
+	if (THREAD_TO_PCB(thr_act)->ifps != 0)
+		fp_save(thr_act);
+	(void)ml_set_interrupts_enabled(intr);
+
+	return (TRUE);
+}
+
+void
+ml_fpu_kernel_exit(void)
+{
+	set_ts();
+	enable_preemption();
+}
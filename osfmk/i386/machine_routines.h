@@ -321,6 +321,8 @@ __END_DECLS
 #ifdef	XNU_KERNEL_PRIVATE
 
 boolean_t ml_fpu_avx_enabled(void);
+boolean_t ml_fpu_kernel_enter(void);
+void ml_fpu_kernel_exit(void);
 
 void interrupt_latency_tracker_setup(void);
 void interrupt_reset_latency_stats(void);
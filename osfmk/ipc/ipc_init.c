@@ -173,6 +173,7 @@ ipc_bootstrap(void)
 	/* cant charge callers for port allocations (references passed) */
 	zone_change(ipc_object_zones[IOT_PORT], Z_CALLERACCT, FALSE);
 	zone_change(ipc_object_zones[IOT_PORT], Z_NOENCRYPT, TRUE);
+	zone_change(ipc_object_zones[IOT_PORT], Z_CACHING_ENABLED, TRUE);
 
 	ipc_object_zones[IOT_PORT_SET] =
 		zinit(sizeof(struct ipc_pset),
@@ -191,6 +192,7 @@ ipc_bootstrap(void)
 			      IKM_SAVED_KMSG_SIZE,
 			      "ipc kmsgs");
 	zone_change(ipc_kmsg_zone, Z_CALLERACCT, FALSE);
+	zone_change(ipc_kmsg_zone, Z_CACHING_ENABLED, TRUE);
 
 	/* create special spaces */
 
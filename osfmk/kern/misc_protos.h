@@ -83,6 +83,13 @@ extern int copyin(
 	char                *kernel_addr,
 	vm_size_t           nbytes);
 
+/* Move data from a user space to kernel space, summing it as it goes */
+extern int copyin_cksum(
+	const user_addr_t   user_addr,
+	char                *kernel_addr,
+	vm_size_t           nbytes,
+	uint32_t            *sum);
+
 /* Move a NUL-terminated string from a user space to kernel space */
 extern int copyinstr(
 	const user_addr_t   user_addr,
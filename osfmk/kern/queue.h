@@ -627,13 +627,18 @@ MACRO_END
 #ifdef	MACH_KERNEL_PRIVATE
 
 #include <kern/locks.h>
+#include <libkern/tree.h>
 
 /*----------------------------------------------------------------*/
 /*
  *	Define macros for queues with locks.
  */
+struct timer_call;
+RB_HEAD(timer_call_tree, timer_call);
+
 struct mpqueue_head {
 	struct queue_entry	head;		/* header for queue */
+	struct timer_call_tree	tree;		/* deadline index (timer_call.c) */
 	uint64_t		earliest_soft_deadline;
 	uint64_t		count;
 #if defined(__i386__) || defined(__x86_64__)
@@ -654,6 +659,7 @@ typedef struct mpqueue_head	mpqueue_head_t;
 #define mpqueue_init(q, lck_grp, lck_attr)		\
 MACRO_BEGIN						\
 	queue_init(&(q)->head);				\
+	RB_INIT(&(q)->tree);				\
         lck_mtx_init_ext(&(q)->lock_data,		\
 			 &(q)->lock_data_ext,		\
 			 lck_grp,			\
@@ -667,6 +673,7 @@ MACRO_END
 #define mpqueue_init(q, lck_grp, lck_attr)		\
 MACRO_BEGIN						\
 	queue_init(&(q)->head);				\
+	RB_INIT(&(q)->tree);				\
         lck_spin_init(&(q)->lock_data,			\
 		      lck_grp,				\
 		      lck_attr);			\
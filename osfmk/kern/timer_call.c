@@ -251,7 +251,80 @@ timer_call_setup(
 	call_entry_setup(TCE(call), func, param0);
 	simple_lock_init(&(call)->lock, 0);
 	call->async_dequeue = FALSE;
+	call->tree_linked = FALSE;
 }
+
+/*
+ * Deadline index.
+ *
+ * The per-cpu queues stay sorted lists since the expiry, rescan and
+ * migration paths walk them from the head.  To avoid a linear scan for
+ * the insertion point, entries are also kept in a red-black tree keyed
+ * on deadline and are linked into the list after their tree predecessor.
+ * Entries with equal deadlines are ordered by address; they expire in
+ * the same pass.  The longterm queue is unsorted and is not indexed.
+ */
+static int
+timer_call_tree_compare(
+	timer_call_t		a,
+	timer_call_t		b)
+{
+	uint64_t	da = TCE(a)->deadline;
+	uint64_t	db = TCE(b)->deadline;
+
+	if (da != db)
+		return (da < db) ? -1 : 1;
+	if (a != b)
+		return ((uintptr_t)a < (uintptr_t)b) ? -1 : 1;
+	return 0;
+}
+
+RB_PROTOTYPE_SC_PREV(__private_extern__, timer_call_tree, timer_call,
+		     tree_link, timer_call_tree_compare);
+RB_GENERATE_PREV(timer_call_tree, timer_call, tree_link,
+		 timer_call_tree_compare);
+
+static __inline__ void
+timer_call_tree_remove(
+	timer_call_t		entry,
+	mpqueue_head_t		*queue)
+{
+	if (entry->tree_linked) {
+		RB_REMOVE(timer_call_tree, &queue->tree, entry);
+		entry->tree_linked = FALSE;
+	}
+}
+
+/*
+ * Unlink the entry from its current queue (if any) and insert it into
+ * the given sorted queue.  Replaces call_entry_enqueue_deadline().
+ */
+static __inline__ void
+timer_call_tree_enqueue(
+	timer_call_t		entry,
+	mpqueue_head_t		*old_queue,
+	mpqueue_head_t		*queue,
+	uint64_t		deadline)
+{
+	timer_call_t	prev;
+
+	if (old_queue != NULL) {
+		timer_call_tree_remove(entry, old_queue);
+		(void)remque(qe(entry));
+	}
+
+	TCE(entry)->deadline = deadline;
+	(void)RB_INSERT(timer_call_tree, &queue->tree, entry);
+	entry->tree_linked = TRUE;
+
+	prev = RB_PREV(timer_call_tree, &queue->tree, entry);
+	if (prev == NULL)
+		insque(qe(entry), &queue->head);
+	else
+		insque(qe(entry), qe(prev));
+	TCE(entry)->queue = QUEUE(queue);
+}
+
 #if TIMER_ASSERT
 static __inline__ mpqueue_head_t *
 timer_call_entry_dequeue(
@@ -271,6 +344,7 @@ timer_call_entry_dequeue(
 		panic("_call_entry_dequeue() "
 			"queue %p is not locked\n", old_queue);
 
+	timer_call_tree_remove(entry, old_queue);
 	call_entry_dequeue(TCE(entry));
 	old_queue->count--;
 
@@ -296,7 +370,7 @@ timer_call_entry_enqueue_deadline(
 		panic("_call_entry_enqueue_deadline() "
 			"old_queue %p != queue", old_queue);
 
-	call_entry_enqueue_deadline(TCE(entry), QUEUE(queue), deadline);
+	timer_call_tree_enqueue(entry, old_queue, queue, deadline);
 
 /* For efficiency, track the earliest soft deadline on the queue, so that
  * fuzzy decisions can be made without lock acquisitions.
@@ -320,6 +394,7 @@ timer_call_entry_dequeue(
 {
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 
+	timer_call_tree_remove(entry, old_queue);
 	call_entry_dequeue(TCE(entry));
 	old_queue->count--;
 
@@ -334,7 +409,7 @@ timer_call_entry_enqueue_deadline(
 {
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 
-	call_entry_enqueue_deadline(TCE(entry), QUEUE(queue), deadline);
+	timer_call_tree_enqueue(entry, old_queue, queue, deadline);
 
 	/* For efficiency, track the earliest soft deadline on the queue,
 	 * so that fuzzy decisions can be made without lock acquisitions.
@@ -373,6 +448,7 @@ timer_call_entry_dequeue_async(
 	mpqueue_head_t	*old_queue = MPQUEUE(TCE(entry)->queue);
 	if (old_queue) {
 		old_queue->count--;
+		timer_call_tree_remove(entry, old_queue);
 		(void) remque(qe(entry));
 		entry->async_dequeue = TRUE;
 	}
@@ -534,9 +610,9 @@ timer_call_dequeue_unlocked(
 /*
  * Inlines timer_call_entry_dequeue() and timer_call_entry_enqueue_deadline()
  * cast between pointer types (mpqueue_head_t *) and (queue_t) so that
- * we can use the call_entry_dequeue() and call_entry_enqueue_deadline()
- * methods to operate on timer_call structs as if they are call_entry structs.
- * These structures are identical except for their queue head pointer fields.
+ * we can use the call_entry_dequeue() method to operate on timer_call
+ * structs as if they are call_entry structs.  Sorted insertion goes
+ * through the queue's deadline index, see timer_call_tree_enqueue().
  *
  * In the debug case, we assert that the timer call locking protocol 
  * is being obeyed.
@@ -39,6 +39,7 @@
 
 #include <kern/call_entry.h>
 #include <kern/simple_lock.h>
+#include <libkern/tree.h>
 
 #ifdef MACH_KERNEL_PRIVATE
 #include <kern/queue.h>
@@ -59,6 +60,9 @@ typedef struct timer_call {
 	boolean_t		async_dequeue;	/* this field is protected by
 						   call_entry queue's lock */
 	uint64_t		ttd; /* Time to deadline at creation */
+	RB_ENTRY(timer_call)	tree_link;	/* deadline index linkage */
+	boolean_t		tree_linked;	/* on a deadline index; protected
+						   by call_entry queue's lock */
 } timer_call_data_t, *timer_call_t;
 
 #define EndOfAllTime		0xFFFFFFFFFFFFFFFFULL
@@ -84,6 +84,7 @@
 #include <kern/misc_protos.h>
 #include <kern/thread_call.h>
 #include <kern/zalloc.h>
+#include <kern/zcache.h>
 #include <kern/kalloc.h>
 #include <kern/btlog.h>
 
@@ -1039,6 +1040,8 @@ static int log_records;	/* size of the log, expressed in number of records */
 
 static char zone_name_to_log[MAX_ZONE_NAME] = "";	/* the zone name we're logging, if any */
 
+static char zone_name_to_cache[MAX_ZONE_NAME] = "";	/* zone to give a per-cpu cache, see kern/zcache.c */
+
 /* Log allocations and frees to help debug a zone element corruption */
 boolean_t       corruption_debug_flag    = FALSE;    /* enabled by "-zc" boot-arg */
 
@@ -1778,6 +1781,9 @@ use_this_allocation:
 	z->prio_refill_watermark = 0;
 	z->zone_replenish_thread = NULL;
 	z->zp_count = 0;
+	z->cpu_cache_enable_when_ready = FALSE;
+	z->cpu_cache_enabled = FALSE;
+	z->zcache = NULL;
 #if CONFIG_ZLEAKS
 	z->zleak_capture = 0;
 	z->zleak_on = FALSE;
@@ -1814,6 +1820,10 @@ use_this_allocation:
 	 	zone_of_interest = z;
 	}
 
+	if (log_this_zone(z->zone_name, zone_name_to_cache)) {
+		zone_change(z, Z_CACHING_ENABLED, TRUE);
+	}
+
 	/*
 	 * If we want to log a zone, see if we need to allocate buffer space for the log.  Some vm related zones are
 	 * zinit'ed before we can do a kmem_alloc, so we have to defer allocation in that case.  kmem_alloc_ready is set to
@@ -2111,6 +2121,9 @@ zone_bootstrap(void)
 		}
 	}
 
+	/* zcc_enable_for_zone_name=<zone> opts one more zone into per-cpu caching */
+	(void) PE_parse_boot_argn("zcc_enable_for_zone_name", zone_name_to_cache, sizeof(zone_name_to_cache));
+
 	simple_lock_init(&all_zones_lock, 0);
 
 	first_zone = ZONE_NULL;
@@ -2356,6 +2369,20 @@ zalloc_internal(
 	}
 #endif /* CONFIG_ZLEAKS */
 
+	/*
+	 * Try this processor's magazines before taking the zone lock.  Logged
+	 * and leak-sampled allocations always go through the zone proper.
+	 */
+	if (zone->cpu_cache_enabled && addr == 0 && !DO_LOGGING(zone)
+#if CONFIG_ZLEAKS
+	    && zleak_tracedepth == 0
+#endif /* CONFIG_ZLEAKS */
+	    ) {
+		addr = zcache_alloc_from_cpu_cache(zone);
+		if (addr)
+			goto cached;
+	}
+
 	lock_zone(zone);
 
 	if (zone->async_prio_refill && zone->zone_replenish_thread) {
@@ -2608,6 +2635,7 @@ zalloc_internal(
 		*backup  = ZP_POISON;
 	}
 
+cached:
 	TRACE_MACHLEAKS(ZALLOC_CODE, ZALLOC_CODE_2, zone->elem_size, addr);
 
 	if (addr) {
@@ -2917,6 +2945,14 @@ zfree(
 		return;
 	}
 
+	/* cached elements skip poisoning, they never reach the free list */
+	if (zone->cpu_cache_enabled && !gzfreed && !DO_LOGGING(zone)
+#if CONFIG_ZLEAKS
+	    && !zone->zleak_on
+#endif /* CONFIG_ZLEAKS */
+	    && zcache_free_to_cpu_cache(zone, elem))
+		goto cached;
+
 	if ((zp_factor != 0 || zp_tiny_zone_limit != 0) && !gzfreed) {
 		/*
 		 * Poison the memory before it ends up on the freelist to catch
@@ -3030,6 +3066,7 @@ zfree(
 	}
 	unlock_zone(zone);
 
+cached:
 	{
 		thread_t thr = current_thread();
 		task_t task;
@@ -3087,6 +3124,12 @@ zone_change(
 			gzalloc_reconfigure(zone);
 #endif
 			break;
+		case Z_CACHING_ENABLED:
+			zone->cpu_cache_enable_when_ready = value;
+			/* zones created before kalloc is up are set up by zcache_bootstrap() */
+			if (value && zcache_ready() && !zone->cpu_cache_enabled)
+				zcache_init(zone);
+			break;
 		case Z_ALIGNMENT_REQUIRED:
 			zone->alignment_required = value;
 #if	ZONE_DEBUG			
@@ -3342,6 +3385,12 @@ struct {
 				elems_kept;
 } zgc_stats;
 
+static void
+zcache_drain_element(zone_t zone, vm_offset_t elem)
+{
+	free_to_zone(zone, elem, FALSE);
+}
+
 /*	Zone garbage collection
  *
  *	zone_gc will walk through all the free elements in all the
@@ -3407,6 +3456,10 @@ zone_gc(boolean_t all_zones)
 
 		lock_zone(z);
 
+		/* give elements parked in full depot magazines back to the zone */
+		if (z->cpu_cache_enabled)
+			zcache_drain_depot(z, zcache_drain_element);
+
 		elt_size = z->elem_size;
 
 		/*
@@ -4158,6 +4211,100 @@ mach_zone_info(
 	return KERN_SUCCESS;
 }
 
+kern_return_t
+mach_zone_cache_info(
+	host_priv_t			host,
+	mach_zone_name_array_t		*namesp,
+	mach_msg_type_number_t		*namesCntp,
+	mach_zone_cache_info_array_t	*infop,
+	mach_msg_type_number_t		*infoCntp)
+{
+	mach_zone_name_t	*names;
+	vm_offset_t		names_addr;
+	vm_size_t		names_size;
+	mach_zone_cache_info_t	*info;
+	vm_offset_t		info_addr;
+	vm_size_t		info_size;
+	unsigned int		max_zones, cached_zones, i;
+	zone_t			z;
+	kern_return_t		kr;
+
+	vm_size_t		used;
+	vm_map_copy_t		copy;
+
+
+	if (host == HOST_NULL)
+		return KERN_INVALID_HOST;
+#if CONFIG_DEBUGGER_FOR_ZONE_INFO
+	if (!PE_i_can_has_debugger(NULL))
+		return KERN_INVALID_HOST;
+#endif
+
+	simple_lock(&all_zones_lock);
+	max_zones = num_zones;
+	z = first_zone;
+	simple_unlock(&all_zones_lock);
+
+	names_size = round_page(max_zones * sizeof *names);
+	kr = kmem_alloc_pageable(ipc_kernel_map,
+				 &names_addr, names_size);
+	if (kr != KERN_SUCCESS)
+		return kr;
+	names = (mach_zone_name_t *) names_addr;
+
+	info_size = round_page(max_zones * sizeof *info);
+	kr = kmem_alloc_pageable(ipc_kernel_map,
+				 &info_addr, info_size);
+	if (kr != KERN_SUCCESS) {
+		kmem_free(ipc_kernel_map,
+			  names_addr, names_size);
+		return kr;
+	}
+	info = (mach_zone_cache_info_t *) info_addr;
+
+	/* only zones with a cache are reported; caches are never torn down */
+	cached_zones = 0;
+	for (i = 0; i < max_zones; i++) {
+		assert(z != ZONE_NULL);
+
+		if (z->cpu_cache_enabled) {
+			(void) strncpy(names[cached_zones].mzn_name, z->zone_name,
+				       sizeof names[cached_zones].mzn_name);
+			names[cached_zones].mzn_name[sizeof names[cached_zones].mzn_name - 1] = '\0';
+			zcache_get_info(z, &info[cached_zones]);
+			cached_zones++;
+		}
+
+		simple_lock(&all_zones_lock);
+		z = z->next_zone;
+		simple_unlock(&all_zones_lock);
+	}
+
+	used = cached_zones * sizeof *names;
+	if (used != names_size)
+		bzero((char *) (names_addr + used), names_size - used);
+
+	kr = vm_map_copyin(ipc_kernel_map, (vm_map_address_t)names_addr,
+			   (vm_map_size_t)names_size, TRUE, &copy);
+	assert(kr == KERN_SUCCESS);
+
+	*namesp = (mach_zone_name_t *) copy;
+	*namesCntp = cached_zones;
+
+	used = cached_zones * sizeof *info;
+	if (used != info_size)
+		bzero((char *) (info_addr + used), info_size - used);
+
+	kr = vm_map_copyin(ipc_kernel_map, (vm_map_address_t)info_addr,
+			   (vm_map_size_t)info_size, TRUE, &copy);
+	assert(kr == KERN_SUCCESS);
+
+	*infop = (mach_zone_cache_info_t *) copy;
+	*infoCntp = cached_zones;
+
+	return KERN_SUCCESS;
+}
+
 /*
  * host_zone_info - LEGACY user interface for Mach zone information
  * 		    Should use mach_zone_info() instead!
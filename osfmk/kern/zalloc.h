@@ -95,6 +95,7 @@ typedef struct gzalloc_data {
 
 struct zone_free_element;
 struct zone_page_metadata;
+struct zone_cache;
 
 struct zone {
 	struct zone_free_element *free_elements;	/* free elements directly linked */
@@ -132,7 +133,9 @@ struct zone {
 	/* boolean_t */	gzalloc_exempt     :1,
 	/* boolean_t */	alignment_required :1,
 	/* boolean_t */	use_page_list 	   :1,
-	/* future    */ _reserved          :16;
+	/* boolean_t */	cpu_cache_enable_when_ready :1,	/* enable per-cpu caching once zcache is up */
+	/* boolean_t */	cpu_cache_enabled  :1,	/* allocations go through zcache first */
+	/* future    */ _reserved          :14;
 
 	int		index;		/* index into zone_info arrays for this zone */
 	struct zone	*next_zone;	/* Link for all-zones list */
@@ -150,6 +153,7 @@ struct zone {
 #if	CONFIG_GZALLOC
 	gzalloc_data_t	gz;
 #endif /* CONFIG_GZALLOC */
+	struct zone_cache *zcache;	/* per-cpu magazines, see kern/zcache.c */
 };
 
 /*
@@ -280,6 +284,7 @@ extern void		zone_prio_refill_configure(zone_t, vm_size_t);
 				 */
 #define Z_ALIGNMENT_REQUIRED 8
 #define Z_GZALLOC_EXEMPT 9	/* Not tracked in guard allocation mode */
+#define Z_CACHING_ENABLED 10	/* Serve alloc/free from per-cpu magazines */
 
 /* Preallocate space for zone from zone map */
 extern void		zprealloc(
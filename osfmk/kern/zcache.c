@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*
+ *	File:	kern/zcache.c
+ *
+ *	Per-processor magazine cache for zones, after Bonwick & Adams,
+ *	"Magazines and Vmem" (USENIX 2001).
+ *
+ *	Each processor owns a loaded (current) and a previous magazine,
+ *	each a small stack of free elements.  zalloc and zfree work on the
+ *	current magazine with preemption disabled and without taking the
+ *	zone lock.  When both magazines are exhausted the processor swaps
+ *	one with the zone's depot, which holds full and empty magazines
+ *	under its own spin lock.  Only when the depot cannot help does the
+ *	caller fall back to the locked zone free list.
+ *
+ *	Elements sitting in a magazine are counted as in use by the zone,
+ *	and are neither poisoned nor checked against the free list cookies.
+ *	zone_gc() returns elements held in full depot magazines to the zone.
+ *
+ *	Caching is opt-in per zone (zone_change(Z_CACHING_ENABLED)), and is
+ *	controlled by these boot-args:
+ *	zcache=0: never enable caching, regardless of zone settings
+ *	zcc_magazine_element_count=<n>: elements per magazine
+ *	zcc_depot_element_count=<n>: magazines held by each zone's depot
+ *	zcc_enable_for_zone_name=<name>: also cache the named zone
+ *	(parsed by zone_bootstrap(), with '.' standing in for spaces)
+ */
+
+#include <zone_debug.h>
+
+#include <mach/mach_types.h>
+#include <mach/vm_param.h>
+#include <mach/kern_return.h>
+#include <mach_debug/zone_info.h>
+
+#include <kern/kern_types.h>
+#include <kern/assert.h>
+#include <kern/cpu_data.h>
+#include <kern/cpu_number.h>
+#include <kern/locks.h>
+#include <kern/misc_protos.h>
+#include <kern/simple_lock.h>
+#include <kern/zalloc.h>
+#include <kern/zcache.h>
+#include <kern/kalloc.h>
+
+#include <pexpert/pexpert.h>
+
+#include <machine/machine_routines.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <i386/mp.h>		/* MAX_CPUS */
+#endif
+
+#define ZCC_MAGAZINE_ELEMENT_COUNT_DEFAULT	8
+#define ZCC_MAGAZINE_ELEMENT_COUNT_MAX		256
+#define ZCC_DEPOT_ELEMENT_COUNT_DEFAULT		16
+#define ZCC_DEPOT_ELEMENT_COUNT_MAX		1024
+
+struct zcc_magazine {
+	uint32_t	zcc_magazine_index;	/* number of elements held */
+	uint32_t	zcc_magazine_capacity;	/* number of element slots */
+	vm_offset_t	zcc_elements[0];	/* stack of free elements */
+};
+
+struct zcc_per_cpu_cache {
+	struct zcc_magazine	*current;	/* magazine zalloc/zfree work on */
+	struct zcc_magazine	*previous;	/* swapped in before going to the depot */
+	uint64_t		zcc_alloc_hits;
+	uint64_t		zcc_free_hits;
+} __attribute__((aligned(64)));		/* keep processors off each other's lines */
+
+struct zone_cache {
+	decl_simple_lock_data(,	zcc_depot_lock)	/* protects the depot and its counters */
+	uint32_t		zcc_depot_index;	/* [0, index) full, [index, size) empty */
+	uint32_t		zcc_depot_size;
+	struct zcc_magazine	**zcc_depot_list;
+	uint64_t		zcc_alloc_misses;
+	uint64_t		zcc_free_misses;
+	uint64_t		zcc_depot_exchanges;
+	struct zcc_per_cpu_cache zcc_per_cpu_caches[MAX_CPUS];
+};
+
+extern zone_t		first_zone;
+extern unsigned int	num_zones;
+decl_simple_lock_data(extern, all_zones_lock)
+
+static boolean_t	zcache_is_ready = FALSE;
+static boolean_t	zcache_disabled = FALSE;
+static uint32_t		zcc_magazine_element_count = ZCC_MAGAZINE_ELEMENT_COUNT_DEFAULT;
+static uint32_t		zcc_depot_element_count = ZCC_DEPOT_ELEMENT_COUNT_DEFAULT;
+static zone_t		zcc_magazine_zone = ZONE_NULL;
+static vm_size_t	zcc_magazine_size;
+
+static struct zcc_magazine *
+zcc_magazine_alloc(void)
+{
+	struct zcc_magazine *mag;
+
+	mag = (struct zcc_magazine *) zalloc(zcc_magazine_zone);
+	mag->zcc_magazine_index = 0;
+	mag->zcc_magazine_capacity = zcc_magazine_element_count;
+	return mag;
+}
+
+static inline boolean_t
+zcc_magazine_empty(struct zcc_magazine *mag)
+{
+	return (mag->zcc_magazine_index == 0);
+}
+
+static inline boolean_t
+zcc_magazine_full(struct zcc_magazine *mag)
+{
+	return (mag->zcc_magazine_index == mag->zcc_magazine_capacity);
+}
+
+static inline void
+zcc_swap_magazines(struct zcc_per_cpu_cache *cache)
+{
+	struct zcc_magazine *tmp = cache->current;
+
+	cache->current = cache->previous;
+	cache->previous = tmp;
+}
+
+void
+zcache_bootstrap(void)
+{
+	zone_t		z;
+	unsigned int	i, max_zones;
+
+	if (PE_parse_boot_argn("zcache", &i, sizeof (i)) && i == 0) {
+		zcache_disabled = TRUE;
+		return;
+	}
+
+	if (PE_parse_boot_argn("zcc_magazine_element_count", &i, sizeof (i)) &&
+	    i > 0 && i <= ZCC_MAGAZINE_ELEMENT_COUNT_MAX)
+		zcc_magazine_element_count = i;
+
+	if (PE_parse_boot_argn("zcc_depot_element_count", &i, sizeof (i)) &&
+	    i > 0 && i <= ZCC_DEPOT_ELEMENT_COUNT_MAX)
+		zcc_depot_element_count = i;
+
+	zcc_magazine_size = sizeof (struct zcc_magazine) +
+	    zcc_magazine_element_count * sizeof (vm_offset_t);
+	zcc_magazine_zone = zinit(zcc_magazine_size, 64 * 1024 * 1024,
+	    PAGE_SIZE, "zcc_magazine_zone");
+	zone_change(zcc_magazine_zone, Z_CALLERACCT, FALSE);
+	zone_change(zcc_magazine_zone, Z_NOENCRYPT, TRUE);
+
+	zcache_is_ready = TRUE;
+
+	/*
+	 * Zones created before kalloc was up could only record that they
+	 * want a cache; set those up now.
+	 */
+	simple_lock(&all_zones_lock);
+	max_zones = num_zones;
+	z = first_zone;
+	simple_unlock(&all_zones_lock);
+
+	for (i = 0; i < max_zones; i++) {
+		if (z->cpu_cache_enable_when_ready && !z->cpu_cache_enabled)
+			zcache_init(z);
+
+		simple_lock(&all_zones_lock);
+		z = z->next_zone;
+		simple_unlock(&all_zones_lock);
+	}
+}
+
+boolean_t
+zcache_ready(void)
+{
+	return (zcache_is_ready && !zcache_disabled);
+}
+
+void
+zcache_init(zone_t zone)
+{
+	struct zone_cache	*zcache;
+	unsigned int		i;
+
+	if (!zcache_ready())
+		return;
+
+#if	ZONE_DEBUG
+	/* the active element queue must see every allocation */
+	if (zone_debug_enabled(zone))
+		return;
+#endif
+
+	zcache = (struct zone_cache *) kalloc(sizeof (struct zone_cache));
+	if (zcache == NULL)
+		return;
+	bzero(zcache, sizeof (struct zone_cache));
+
+	zcache->zcc_depot_list = (struct zcc_magazine **)
+	    kalloc(zcc_depot_element_count * sizeof (struct zcc_magazine *));
+	if (zcache->zcc_depot_list == NULL) {
+		kfree(zcache, sizeof (struct zone_cache));
+		return;
+	}
+
+	simple_lock_init(&zcache->zcc_depot_lock, 0);
+	zcache->zcc_depot_size = zcc_depot_element_count;
+	zcache->zcc_depot_index = 0;
+	for (i = 0; i < zcache->zcc_depot_size; i++)
+		zcache->zcc_depot_list[i] = zcc_magazine_alloc();
+
+	for (i = 0; i < MAX_CPUS; i++) {
+		zcache->zcc_per_cpu_caches[i].current = zcc_magazine_alloc();
+		zcache->zcc_per_cpu_caches[i].previous = zcc_magazine_alloc();
+	}
+
+	lock_zone(zone);
+	zone->zcache = zcache;
+	zone->cpu_cache_enabled = TRUE;
+	unlock_zone(zone);
+}
+
+vm_offset_t
+zcache_alloc_from_cpu_cache(zone_t zone)
+{
+	struct zone_cache		*zcache = zone->zcache;
+	struct zcc_per_cpu_cache	*cache;
+	struct zcc_magazine		*mag;
+	vm_offset_t			elem;
+
+	/* the magazines are only protected against preemption */
+	if (ml_at_interrupt_context())
+		return 0;
+
+	disable_preemption();
+	cache = &zcache->zcc_per_cpu_caches[cpu_number()];
+
+	if (zcc_magazine_empty(cache->current)) {
+		if (!zcc_magazine_empty(cache->previous)) {
+			zcc_swap_magazines(cache);
+		} else {
+			/* trade the empty previous magazine for a full one */
+			simple_lock(&zcache->zcc_depot_lock);
+			if (zcache->zcc_depot_index == 0) {
+				zcache->zcc_alloc_misses++;
+				simple_unlock(&zcache->zcc_depot_lock);
+				enable_preemption();
+				return 0;
+			}
+			zcache->zcc_depot_index--;
+			mag = zcache->zcc_depot_list[zcache->zcc_depot_index];
+			zcache->zcc_depot_list[zcache->zcc_depot_index] = cache->previous;
+			zcache->zcc_depot_exchanges++;
+			simple_unlock(&zcache->zcc_depot_lock);
+
+			cache->previous = cache->current;
+			cache->current = mag;
+		}
+	}
+
+	mag = cache->current;
+	elem = mag->zcc_elements[--mag->zcc_magazine_index];
+	cache->zcc_alloc_hits++;
+	enable_preemption();
+
+	return elem;
+}
+
+boolean_t
+zcache_free_to_cpu_cache(zone_t zone, vm_offset_t elem)
+{
+	struct zone_cache		*zcache = zone->zcache;
+	struct zcc_per_cpu_cache	*cache;
+	struct zcc_magazine		*mag;
+
+	if (ml_at_interrupt_context())
+		return FALSE;
+
+	disable_preemption();
+	cache = &zcache->zcc_per_cpu_caches[cpu_number()];
+
+	if (zcc_magazine_full(cache->current)) {
+		if (!zcc_magazine_full(cache->previous)) {
+			zcc_swap_magazines(cache);
+		} else {
+			/* trade the full previous magazine for an empty one */
+			simple_lock(&zcache->zcc_depot_lock);
+			if (zcache->zcc_depot_index == zcache->zcc_depot_size) {
+				zcache->zcc_free_misses++;
+				simple_unlock(&zcache->zcc_depot_lock);
+				enable_preemption();
+				return FALSE;
+			}
+			mag = zcache->zcc_depot_list[zcache->zcc_depot_index];
+			zcache->zcc_depot_list[zcache->zcc_depot_index] = cache->previous;
+			zcache->zcc_depot_index++;
+			zcache->zcc_depot_exchanges++;
+			simple_unlock(&zcache->zcc_depot_lock);
+
+			cache->previous = cache->current;
+			cache->current = mag;
+		}
+	}
+
+	mag = cache->current;
+	mag->zcc_elements[mag->zcc_magazine_index++] = elem;
+	cache->zcc_free_hits++;
+	enable_preemption();
+
+	return TRUE;
+}
+
+void
+zcache_drain_depot(zone_t zone, void (*free_elem)(zone_t, vm_offset_t))
+{
+	struct zone_cache	*zcache = zone->zcache;
+	struct zcc_magazine	*mag;
+	uint32_t		i;
+
+	/*
+	 * Lock order is zone lock, then depot lock.  The fast paths never
+	 * take the zone lock while holding the depot lock.
+	 */
+	simple_lock(&zcache->zcc_depot_lock);
+	for (i = 0; i < zcache->zcc_depot_index; i++) {
+		mag = zcache->zcc_depot_list[i];
+		while (!zcc_magazine_empty(mag))
+			free_elem(zone, mag->zcc_elements[--mag->zcc_magazine_index]);
+	}
+	zcache->zcc_depot_index = 0;
+	simple_unlock(&zcache->zcc_depot_lock);
+}
+
+void
+zcache_get_info(zone_t zone, mach_zone_cache_info_t *info)
+{
+	struct zone_cache	*zcache = zone->zcache;
+	uint64_t		cached = 0, alloc_hits = 0, free_hits = 0;
+	uint32_t		i;
+
+	/* per-cpu state is sampled without synchronization */
+	for (i = 0; i < MAX_CPUS; i++) {
+		struct zcc_per_cpu_cache *cache = &zcache->zcc_per_cpu_caches[i];
+
+		cached += cache->current->zcc_magazine_index;
+		cached += cache->previous->zcc_magazine_index;
+		alloc_hits += cache->zcc_alloc_hits;
+		free_hits += cache->zcc_free_hits;
+	}
+
+	simple_lock(&zcache->zcc_depot_lock);
+	for (i = 0; i < zcache->zcc_depot_index; i++)
+		cached += zcache->zcc_depot_list[i]->zcc_magazine_index;
+	info->mzci_depot_full = zcache->zcc_depot_index;
+	info->mzci_depot_size = zcache->zcc_depot_size;
+	info->mzci_alloc_misses = zcache->zcc_alloc_misses;
+	info->mzci_free_misses = zcache->zcc_free_misses;
+	info->mzci_depot_exchanges = zcache->zcc_depot_exchanges;
+	simple_unlock(&zcache->zcc_depot_lock);
+
+	info->mzci_magazine_size = zcc_magazine_element_count;
+	info->mzci_cached = cached;
+	info->mzci_alloc_hits = alloc_hits;
+	info->mzci_free_hits = free_hits;
+}
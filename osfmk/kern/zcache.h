@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*
+ *	File:	kern/zcache.h
+ *
+ *	Per-processor magazine caching layer for zones.
+ */
+
+#ifdef	MACH_KERNEL_PRIVATE
+
+#ifndef	_KERN_ZCACHE_H_
+#define _KERN_ZCACHE_H_
+
+#include <mach/boolean.h>
+#include <mach/machine/vm_types.h>
+#include <mach_debug/zone_info.h>
+#include <kern/kern_types.h>
+
+struct zone_cache;
+
+/* Set up the magazine zone and enable caching on zones that asked for it */
+extern void		zcache_bootstrap(void);
+
+/* TRUE once zcache_bootstrap() has run and caching was not disabled */
+extern boolean_t	zcache_ready(void);
+
+/* Allocate and attach a cache to the zone */
+extern void		zcache_init(
+				zone_t		zone);
+
+/* Pop an element from this processor's magazines, 0 on a miss */
+extern vm_offset_t	zcache_alloc_from_cpu_cache(
+				zone_t		zone);
+
+/* Push an element onto this processor's magazines, FALSE on a miss */
+extern boolean_t	zcache_free_to_cpu_cache(
+				zone_t		zone,
+				vm_offset_t	elem);
+
+/* Hand every element held in full depot magazines to free_elem; zone is locked */
+extern void		zcache_drain_depot(
+				zone_t		zone,
+				void		(*free_elem)(zone_t, vm_offset_t));
+
+/* Snapshot of a zone's cache statistics for mach_zone_cache_info() */
+extern void		zcache_get_info(
+				zone_t		zone,
+				mach_zone_cache_info_t	*info);
+
+#endif	/* _KERN_ZCACHE_H_ */
+
+#endif	/* MACH_KERNEL_PRIVATE */
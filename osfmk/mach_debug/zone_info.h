@@ -118,6 +118,24 @@ typedef struct mach_zone_info_data {
 
 typedef mach_zone_info_t *mach_zone_info_array_t;
 
+/*
+ *	Per-processor cache statistics, returned by mach_zone_cache_info()
+ *	for each zone that has its magazine cache enabled.
+ */
+typedef struct mach_zone_cache_info_data {
+	uint64_t	mzci_magazine_size;	/* elements per magazine */
+	uint64_t	mzci_depot_size;	/* magazines the depot can hold */
+	uint64_t	mzci_depot_full;	/* full magazines in the depot now */
+	uint64_t	mzci_cached;	/* elements held by the cache now */
+	uint64_t	mzci_alloc_hits;	/* allocations served by a cpu magazine */
+	uint64_t	mzci_alloc_misses;	/* allocations that fell back to the zone */
+	uint64_t	mzci_free_hits;	/* frees absorbed by a cpu magazine */
+	uint64_t	mzci_free_misses;	/* frees that fell back to the zone */
+	uint64_t	mzci_depot_exchanges;	/* magazines swapped with the depot */
+} mach_zone_cache_info_t;
+
+typedef mach_zone_cache_info_t *mach_zone_cache_info_array_t;
+
 typedef struct task_zone_info_data {
 	uint64_t	tzi_count;	/* count of elements in use */
 	uint64_t	tzi_cur_size;	/* current memory utilization */
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vm/lz_page.h>
+
+#define	LZ_MIN_MATCH		4
+#define	LZ_LAST_LITERALS	5	/* the stream always ends with literals */
+#define	LZ_MF_LIMIT		12	/* no match may start this close to the end */
+#define	LZ_RUN_MASK		15
+#define	LZ_SKIP_SHIFT		6	/* speed up on incompressible input */
+
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t	v;
+
+	memcpy(&v, p, sizeof (v));
+	return (v);
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+	return ((v * 2654435761U) >> (32 - LZ_PAGE_HASH_LOG));
+}
+
+static inline uint8_t *
+lz_put_length(uint8_t *op, uint32_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+
+	return (op);
+}
+
+/*
+ * worst case space needed to emit a sequence with
+ * 'lit' literals and an extended match length of 'mlen'
+ */
+#define	LZ_SEQ_BOUND(lit, mlen)	(1 + ((lit) / 255 + 1) + (lit) + 2 + ((mlen) / 255 + 1))
+
+
+int
+lz_page_compress(
+	const uint8_t	*src,
+	uint32_t	src_size,
+	uint8_t		*dst,
+	uint32_t	limit,
+	void		*scratch)
+{
+	uint16_t	*table = (uint16_t *)scratch;
+	const uint8_t	*ip = src;
+	const uint8_t	*anchor = src;
+	const uint8_t	*iend = src + src_size;
+	const uint8_t	*mflimit = iend - LZ_MF_LIMIT;
+	const uint8_t	*matchlimit = iend - LZ_LAST_LITERALS;
+	uint8_t		*op = dst;
+	uint8_t		*oend = dst + limit;
+	uint8_t		*token;
+	uint32_t	lit, mlen;
+
+	if (src_size > LZ_PAGE_MAX_INPUT)
+		return (-1);
+
+	if (src_size >= LZ_MF_LIMIT) {
+		memset(table, 0, LZ_PAGE_SCRATCH_BUF_SIZE);
+
+		ip++;
+
+		while (ip < mflimit) {
+			const uint8_t	*ref;
+			const uint8_t	*mp;
+			uint32_t	seq = lz_read32(ip);
+			uint32_t	h = lz_hash(seq);
+			uint32_t	off;
+
+			ref = src + table[h];
+			table[h] = (uint16_t)(ip - src);
+
+			if (ref >= ip || lz_read32(ref) != seq) {
+				ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+				continue;
+			}
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			mp = ip + LZ_MIN_MATCH;
+			ref += LZ_MIN_MATCH;
+
+			while (mp < matchlimit && *mp == *ref) {
+				mp++;
+				ref++;
+			}
+			lit = (uint32_t)(ip - anchor);
+			mlen = (uint32_t)(mp - ip) - LZ_MIN_MATCH;
+			off = (uint32_t)(mp - ref);
+
+			if (LZ_SEQ_BOUND(lit, mlen) > (uint32_t)(oend - op))
+				return (-1);
+
+			token = op++;
+
+			if (lit >= LZ_RUN_MASK) {
+				*token = LZ_RUN_MASK << 4;
+				op = lz_put_length(op, lit - LZ_RUN_MASK);
+			} else
+				*token = (uint8_t)(lit << 4);
+
+			memcpy(op, anchor, lit);
+			op += lit;
+
+			*op++ = (uint8_t)off;
+			*op++ = (uint8_t)(off >> 8);
+
+			if (mlen >= LZ_RUN_MASK) {
+				*token |= LZ_RUN_MASK;
+				op = lz_put_length(op, mlen - LZ_RUN_MASK);
+			} else
+				*token |= (uint8_t)mlen;
+
+			ip = anchor = mp;
+
+			if (ip < mflimit)
+				table[lz_hash(lz_read32(ip - 2))] = (uint16_t)(ip - 2 - src);
+		}
+	}
+	lit = (uint32_t)(iend - anchor);
+
+	if (LZ_SEQ_BOUND(lit, 0) > (uint32_t)(oend - op))
+		return (-1);
+
+	token = op++;
+
+	if (lit >= LZ_RUN_MASK) {
+		*token = LZ_RUN_MASK << 4;
+		op = lz_put_length(op, lit - LZ_RUN_MASK);
+	} else
+		*token = (uint8_t)(lit << 4);
+
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return ((int)(op - dst));
+}
+
+
+static inline int
+lz_get_length(const uint8_t **ipp, const uint8_t *iend, uint32_t *len)
+{
+	const uint8_t	*ip = *ipp;
+	uint32_t	b;
+
+	do {
+		if (ip >= iend)
+			return (-1);
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+
+	*ipp = ip;
+	return (0);
+}
+
+
+int
+lz_page_decompress(
+	const uint8_t	*src,
+	uint32_t	src_size,
+	uint8_t		*dst,
+	uint32_t	dst_size)
+{
+	const uint8_t	*ip = src;
+	const uint8_t	*iend = src + src_size;
+	uint8_t		*op = dst;
+	uint8_t		*oend = dst + dst_size;
+	const uint8_t	*ref;
+	uint32_t	token, len, off;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == LZ_RUN_MASK && lz_get_length(&ip, iend, &len))
+			return (-1);
+		if (len > (uint32_t)(iend - ip) || len > (uint32_t)(oend - op))
+			return (-1);
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		if (op == oend)
+			return (0);
+
+		if (iend - ip < 2)
+			return (-1);
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (off == 0 || off > (uint32_t)(op - dst))
+			return (-1);
+
+		len = token & LZ_RUN_MASK;
+		if (len == LZ_RUN_MASK && lz_get_length(&ip, iend, &len))
+			return (-1);
+		len += LZ_MIN_MATCH;
+
+		if (len > (uint32_t)(oend - op))
+			return (-1);
+
+		ref = op - off;
+
+		if (off >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+	return (-1);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2014 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ * 
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Byte oriented LZ77 page codec for the VM compressor.
+ *
+ * WKdm works on 32-bit words and does well on pointer and integer
+ * data; this codec finds repeated byte strings and is used for pages
+ * that WKdm handles poorly (text, packed structures, unaligned data).
+ *
+ * The stream is a series of sequences, each a token byte holding a
+ * 4-bit literal length and a 4-bit match length, optional length
+ * extension bytes (255 means more follow), the literals, a 16-bit
+ * little-endian match offset and the match length extension.  The
+ * last sequence holds only literals.  The decoder stops once the
+ * output buffer is full, so trailing padding after the stream is
+ * ignored.
+ */
+
+#ifndef _VM_LZ_PAGE_H_
+#define _VM_LZ_PAGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define	LZ_PAGE_HASH_LOG		11
+#define	LZ_PAGE_SCRATCH_BUF_SIZE	((1 << LZ_PAGE_HASH_LOG) * sizeof(uint16_t))
+#define	LZ_PAGE_MAX_INPUT		65536
+
+/*
+ * Compress src_size (at most LZ_PAGE_MAX_INPUT) bytes into dst, writing
+ * no more than limit bytes.  Returns the compressed size, or -1 if the
+ * data does not fit in limit bytes.  scratch must be at least
+ * LZ_PAGE_SCRATCH_BUF_SIZE bytes.
+ */
+int
+lz_page_compress(const uint8_t	*src,
+		 uint32_t	src_size,
+		 uint8_t	*dst,
+		 uint32_t	limit,
+		 void		*scratch);
+
+/*
+ * Decompress src_size bytes from src, filling exactly dst_size bytes
+ * of dst.  Returns 0 on success or -1 if the stream is malformed.
+ */
+int
+lz_page_decompress(const uint8_t	*src,
+		   uint32_t		src_size,
+		   uint8_t		*dst,
+		   uint32_t		dst_size);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif	/* _VM_LZ_PAGE_H_ */
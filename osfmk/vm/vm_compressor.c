@@ -86,6 +86,14 @@ struct c_slot {
 #define UNPACK_C_SIZE(cs)	((cs->c_size == (PAGE_SIZE-1)) ? PAGE_SIZE : cs->c_size)
 #define PACK_C_SIZE(cs, size)	(cs->c_size = ((size == PAGE_SIZE) ? PAGE_SIZE - 1 : size))
 
+/*
+ * There are no spare bits in c_slot for a codec tag, so the tag lives in
+ * c_size instead: WKdm always produces a whole number of words, while
+ * LZ output is padded (if needed) to a size that is not a multiple of 4.
+ * Slots are rounded up to a word anyway, so the padding costs nothing.
+ */
+#define C_SLOT_CODEC(size)	(((size) & C_SEG_OFFSET_ALIGNMENT_MASK) ? C_CODEC_LZ : C_CODEC_WKDM)
+
 
 struct  c_slot_mapping {
         uint32_t        s_cseg:22, 	/* segment number + 1 */
@@ -203,6 +211,22 @@ uint64_t	first_c_segment_to_warm_generation_id = 0;
 uint64_t	last_c_segment_to_warm_generation_id = 0;
 boolean_t	hibernate_flushing = FALSE;
 
+int		vm_compressor_codec = VM_COMPRESSOR_CODEC_WKDM;
+struct c_codec_stats c_codec_stats[C_CODEC_COUNT] __attribute__((aligned(8)));
+
+/*
+ * Adaptive codec selection keeps a decaying average of the compressed
+ * size each codec achieved recently (an incompressible page counts as
+ * PAGE_SIZE).  LZ is slower than WKdm, so it is only preferred when its
+ * average is at least 1/8 smaller.  Every C_CODEC_PROBE_INTERVAL'th page
+ * goes to the other codec so that its average follows the workload.
+ */
+#define C_CODEC_PROBE_INTERVAL	32
+#define C_CODEC_AVG_SHIFT	3
+
+uint32_t	c_codec_avg_size[C_CODEC_COUNT] = { PAGE_SIZE / 2, PAGE_SIZE / 2 };
+uint32_t	c_codec_probe_count = 0;
+
 int64_t		c_segment_input_bytes __attribute__((aligned(8))) = 0;
 int64_t		c_segment_compressed_bytes __attribute__((aligned(8))) = 0;
 int64_t		compressor_bytes_used __attribute__((aligned(8))) = 0;
@@ -357,6 +381,9 @@ vm_compressor_init(void)
 	assert((C_SEGMENTS_PER_PAGE * sizeof(union c_segu)) == PAGE_SIZE);
 
 	PE_parse_boot_argn("vm_compression_limit", &vm_compression_limit, sizeof (vm_compression_limit));
+	PE_parse_boot_argn("vm_compressor_codec", &vm_compressor_codec, sizeof (vm_compressor_codec));
+
+	assert(LZ_PAGE_SCRATCH_BUF_SIZE <= COMPRESSOR_SCRATCH_BUF_SIZE);
 
 	if (max_mem <= (3ULL * 1024ULL * 1024ULL * 1024ULL)) {
 		vm_compressor_minorcompact_threshold_divisor = 11;
@@ -2394,12 +2421,82 @@ c_seg_swapin(c_segment_t c_seg, boolean_t force_minor_compaction)
 }
 
 
+static int
+c_codec_select(void)
+{
+	int	preferred;
+
+	switch (vm_compressor_codec) {
+	case VM_COMPRESSOR_CODEC_LZ:
+		return (C_CODEC_LZ);
+	case VM_COMPRESSOR_CODEC_ADAPTIVE:
+		break;
+	default:
+		return (C_CODEC_WKDM);
+	}
+	if (c_codec_avg_size[C_CODEC_LZ] + (c_codec_avg_size[C_CODEC_LZ] >> 3) < c_codec_avg_size[C_CODEC_WKDM])
+		preferred = C_CODEC_LZ;
+	else
+		preferred = C_CODEC_WKDM;
+
+	if ((OSIncrementAtomic((volatile SInt32 *)&c_codec_probe_count) % C_CODEC_PROBE_INTERVAL) == 0)
+		return (preferred == C_CODEC_LZ ? C_CODEC_WKDM : C_CODEC_LZ);
+
+	return (preferred);
+}
+
+
+static void
+c_codec_update(int codec, int c_size)
+{
+	int32_t	avg;
+
+	OSAddAtomic64(1, (volatile int64_t *)&c_codec_stats[codec].pages);
+	OSAddAtomic64(PAGE_SIZE, (volatile int64_t *)&c_codec_stats[codec].input_bytes);
+
+	if (c_size == -1) {
+		OSAddAtomic64(1, (volatile int64_t *)&c_codec_stats[codec].failed);
+		c_size = PAGE_SIZE;
+	} else
+		OSAddAtomic64(c_size, (volatile int64_t *)&c_codec_stats[codec].compressed_bytes);
+
+	if (vm_compressor_codec == VM_COMPRESSOR_CODEC_ADAPTIVE) {
+		/*
+		 * racy updates from several compressor threads
+		 * only cost a sample... no lock needed
+		 */
+		avg = (int32_t)c_codec_avg_size[codec];
+		avg += (c_size - avg) >> C_CODEC_AVG_SHIFT;
+		c_codec_avg_size[codec] = (uint32_t)avg;
+	}
+}
+
+
+static int
+c_lz_compress(char *src, char *dst, char *scratch_buf, int limit)
+{
+	int	c_size;
+
+	/*
+	 * leave room for the byte that may be needed
+	 * to tag the slot, see C_SLOT_CODEC
+	 */
+	c_size = lz_page_compress((const uint8_t *)src, PAGE_SIZE, (uint8_t *)dst, limit - 1, scratch_buf);
+
+	if (c_size != -1 && C_SLOT_CODEC(c_size) != C_CODEC_LZ)
+		dst[c_size++] = 0;
+
+	return (c_size);
+}
+
+
 static int
 c_compress_page(char *src, c_slot_mapping_t slot_ptr, c_segment_t *current_chead, char *scratch_buf)
 {
 	int		c_size;
 	int		c_rounded_size;
 	int		max_csize;
+	int		codec;
 	c_slot_t	cs;
 	c_segment_t	c_seg;
 
@@ -2444,9 +2541,16 @@ retry:
 	cs->c_hash_data = hash_string(src, PAGE_SIZE);
 #endif
 
-	c_size = WKdm_compress_new((WK_word *)(uintptr_t)src, (WK_word *)(uintptr_t)&c_seg->c_store.c_buffer[cs->c_offset],
-				  (WK_word *)(uintptr_t)scratch_buf, max_csize - 4);
+	codec = c_codec_select();
+
+	if (codec == C_CODEC_LZ)
+		c_size = c_lz_compress(src, (char *)&c_seg->c_store.c_buffer[cs->c_offset],
+				       scratch_buf, max_csize - 4);
+	else
+		c_size = WKdm_compress_new((WK_word *)(uintptr_t)src, (WK_word *)(uintptr_t)&c_seg->c_store.c_buffer[cs->c_offset],
+					  (WK_word *)(uintptr_t)scratch_buf, max_csize - 4);
 	assert(c_size <= (max_csize - 4) && c_size >= -1);
+	assert(c_size == -1 || C_SLOT_CODEC(c_size) == codec);
 
 	if (c_size == -1) {
 
@@ -2457,10 +2561,13 @@ retry:
 
 			goto retry;
 		}
+		c_codec_update(codec, -1);
+
 		c_size = PAGE_SIZE;
 
 		memcpy(&c_seg->c_store.c_buffer[cs->c_offset], src, c_size);
-	}
+	} else
+		c_codec_update(codec, c_size);
 #if CHECKSUM_THE_COMPRESSED_DATA
 	cs->c_hash_compressed_data = hash_string((char *)&c_seg->c_store.c_buffer[cs->c_offset], c_size);
 #endif
@@ -2597,6 +2704,10 @@ ReTry:
 			 * page wasn't compressible... just copy it out
 			 */
 			memcpy(dst, &c_seg->c_store.c_buffer[cs->c_offset], PAGE_SIZE);
+		} else if (C_SLOT_CODEC(c_size) == C_CODEC_LZ) {
+			if (lz_page_decompress((const uint8_t *)&c_seg->c_store.c_buffer[cs->c_offset], c_size,
+					       (uint8_t *)dst, PAGE_SIZE))
+				panic("c_decompress_page: corrupt LZ data in slot %p of c_seg %p", cs, c_seg);
 		} else {
 			uint32_t	my_cpu_no;
 			char		*scratch_buf;
@@ -2790,6 +2901,28 @@ vm_compressor_put(ppnum_t pn, int *slot, void  **current_chead, char *scratch_bu
 	return (retval);
 }
 
+
+/*
+ * close the segment a compressor worker is filling, so that it
+ * can be compacted and swapped out while the worker is idle
+ */
+void
+vm_compressor_finished_filling(void **current_chead)
+{
+	c_segment_t	c_seg;
+
+	if ((c_seg = *(c_segment_t *)current_chead) == NULL)
+		return;
+
+	PAGE_REPLACEMENT_DISALLOWED(TRUE);
+
+	lck_mtx_lock_spin_always(&c_seg->c_lock);
+
+	c_current_seg_filled(c_seg, (c_segment_t *)current_chead);
+
+	PAGE_REPLACEMENT_DISALLOWED(FALSE);
+}
+
 void
 vm_compressor_transfer(
 	int	*dst_slot_p,
@@ -32,6 +32,7 @@
 #include <vm/vm_page.h>
 #include <vm/vm_protos.h>
 #include <vm/WKdm_new.h>
+#include <vm/lz_page.h>
 #include <vm/vm_object.h>
 #include <machine/pmap.h>
 #include <kern/locks.h>
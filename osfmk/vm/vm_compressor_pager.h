@@ -113,6 +113,7 @@ extern memory_object_offset_t vm_compressor_pager_next_compressed(
 
 extern void vm_compressor_init(void);
 extern int vm_compressor_put(ppnum_t pn, int *slot, void **current_chead, char *scratch_buf);
+extern void vm_compressor_finished_filling(void **current_chead);
 extern int vm_compressor_get(ppnum_t pn, int *slot, int flags);
 extern int vm_compressor_free(int *slot, int flags);
 extern unsigned int vm_compressor_pager_reap_pages(memory_object_t mem_obj, int flags);
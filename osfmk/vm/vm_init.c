@@ -67,6 +67,7 @@
 #include <mach/vm_map.h>
 #include <kern/zalloc.h>
 #include <kern/kalloc.h>
+#include <kern/zcache.h>
 #include <kern/kext_alloc.h>
 #include <sys/kdebug.h>
 #include <vm/vm_object.h>
@@ -198,6 +199,9 @@ vm_mem_bootstrap(void)
 	vm_mem_bootstrap_log("kalloc_init");
 	kalloc_init();
 
+	vm_mem_bootstrap_log("zcache_bootstrap");
+	zcache_bootstrap();
+
 	vm_mem_bootstrap_log("vm_fault_init");
 	vm_fault_init();
 
@@ -644,6 +644,7 @@ vm_map_init(
 	zone_change(vm_map_entry_zone, Z_NOENCRYPT, TRUE);
 	zone_change(vm_map_entry_zone, Z_NOCALLOUT, TRUE);
 	zone_change(vm_map_entry_zone, Z_GZALLOC_EXEMPT, TRUE);
+	zone_change(vm_map_entry_zone, Z_CACHING_ENABLED, TRUE);
 
 	vm_map_entry_reserved_zone = zinit((vm_map_size_t) sizeof(struct vm_map_entry),
 				   kentry_data_size * 64, kentry_data_size,
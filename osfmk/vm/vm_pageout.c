@@ -290,6 +290,11 @@ struct cq {
 	struct vm_pageout_queue *q;
 	void			*current_chead;
 	char			*scratch_buf;
+	int			id;
+	uint64_t		pages_compressed;
+	uint64_t		pages_failed;
+	uint64_t		batches;
+	uint64_t		busy_time;	/* mach absolute time units */
 };
 
 
@@ -3174,12 +3179,12 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 	int	    local_batch_size;
 	kern_return_t	retval;
 	int		compressed_count_delta;
+	uint64_t	batch_start;
 
 
 	KERNEL_DEBUG(0xe040000c | DBG_FUNC_END, 0, 0, 0, 0, 0);
 
 	q = cq->q;
-	local_batch_size = q->pgo_maxlaundry / (vm_compressor_thread_count * 4);
 
 	while (TRUE) {
 
@@ -3192,6 +3197,37 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 
 		KERNEL_DEBUG(0xe0400014 | DBG_FUNC_END, 0, 0, 0, 0, 0);
 
+		if (cq->id >= vm_compressor_thread_count) {
+			/*
+			 * this worker has been parked by lowering
+			 * vm.compressor_thread_count... leave the
+			 * queue state to the active workers
+			 */
+			if (cq->current_chead != NULL) {
+				/*
+				 * don't hold a partially filled segment
+				 * open while parked, since it can't be
+				 * compacted or swapped until it's closed...
+				 * the close may depopulate pages, so drop
+				 * the page queues lock and recheck
+				 */
+				vm_page_unlock_queues();
+
+				vm_compressor_finished_filling(&cq->current_chead);
+				continue;
+			}
+			assert_wait((event_t) &q->pgo_pending, THREAD_UNINT);
+			vm_page_unlock_queues();
+
+			thread_block_parameter((thread_continue_t)vm_pageout_iothread_internal_continue, (void *) cq);
+			/*NOTREACHED*/
+		}
+		/*
+		 * the active worker count can change underneath us,
+		 * so size each batch from the current value
+		 */
+		local_batch_size = q->pgo_maxlaundry / (vm_compressor_thread_count * 4);
+
 		KERNEL_DEBUG(0xe0400018 | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 		while ( !queue_empty(&q->pgo_pending) && local_cnt <  local_batch_size) {
@@ -3219,6 +3255,8 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 
 		KERNEL_DEBUG(0xe0400018 | DBG_FUNC_END, 0, 0, 0, 0, 0);
 
+		batch_start = mach_absolute_time();
+
 		while (local_q) {
 		
 			m = local_q;
@@ -3381,6 +3419,7 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 				vm_page_compressions_failing = FALSE;
 				
 				VM_STAT_INCR(compressions);
+				cq->pages_compressed++;
 			
 				if (m->tabled)
 					vm_page_remove(m, TRUE);
@@ -3398,6 +3437,7 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 
 				vm_page_activate(m);
 				vm_compressor_failed++;
+				cq->pages_failed++;
 
 				vm_page_compressions_failing = TRUE;
 
@@ -3413,6 +3453,9 @@ vm_pageout_iothread_internal_continue(struct cq *cq)
 			local_freeq = NULL;
 			local_freed = 0;
 		}
+		cq->batches++;
+		cq->busy_time += mach_absolute_time() - batch_start;
+
 		if (pgo_draining == TRUE) {
 			vm_page_lockspin_queues();
 			vm_pageout_throttle_up_batch(q, local_cnt);
@@ -4238,17 +4281,55 @@ vm_pageout(void)
 
 
 
-#define MAX_COMRPESSOR_THREAD_COUNT	8
-
 struct cq ciq[MAX_COMRPESSOR_THREAD_COUNT];
 
 int vm_compressor_thread_count = 2;
 
+/*
+ * vm_compressor_thread_count workers are started at boot; more can be
+ * started later (up to vm_compressor_thread_max) through
+ * vm.compressor_thread_count.  Workers whose id is at or above the
+ * current count stay parked.  Both are protected by the page queues lock.
+ */
+int vm_compressor_thread_max = 1;
+int vm_compressor_threads_started = 0;
+
+static kern_return_t
+vm_pageout_compressor_threads_start(int count)
+{
+	kern_return_t	result = KERN_SUCCESS;
+	thread_t	thread;
+	int		i;
+
+	vm_page_lock_queues();
+
+	while (vm_compressor_threads_started < count) {
+		i = vm_compressor_threads_started++;
+		vm_page_unlock_queues();
+
+		ciq[i].id = i;
+		result = kernel_thread_start_priority((thread_continue_t)vm_pageout_iothread_internal, (void *)&ciq[i], BASEPRI_PREEMPT - 1, &thread);
+		if (result == KERN_SUCCESS) {
+			vm_pageout_internal_iothread = thread;
+			thread_deallocate(thread);
+		}
+		vm_page_lock_queues();
+
+		if (result != KERN_SUCCESS) {
+			if (vm_compressor_threads_started == i + 1)
+				vm_compressor_threads_started = i;
+			break;
+		}
+	}
+	vm_page_unlock_queues();
+
+	return result;
+}
+
 kern_return_t
 vm_pageout_internal_start(void)
 {
 	kern_return_t	result;
-	int		i;
 	host_basic_info_data_t hinfo;
 
 	if (COMPRESSED_PAGER_IS_ACTIVE || DEFAULT_FREEZER_COMPRESSED_PAGER_IS_ACTIVE) {
@@ -4258,30 +4339,90 @@ vm_pageout_internal_start(void)
 
 		assert(hinfo.max_cpus > 0);
 
-		if (vm_compressor_thread_count >= hinfo.max_cpus)
-			vm_compressor_thread_count = hinfo.max_cpus - 1;
+		vm_compressor_thread_max = hinfo.max_cpus - 1;
+		if (vm_compressor_thread_max <= 0)
+			vm_compressor_thread_max = 1;
+		else if (vm_compressor_thread_max > MAX_COMRPESSOR_THREAD_COUNT)
+			vm_compressor_thread_max = MAX_COMRPESSOR_THREAD_COUNT;
+
+		if (vm_compressor_thread_count > vm_compressor_thread_max)
+			vm_compressor_thread_count = vm_compressor_thread_max;
 		if (vm_compressor_thread_count <= 0)
 			vm_compressor_thread_count = 1;
-		else if (vm_compressor_thread_count > MAX_COMRPESSOR_THREAD_COUNT)
-			vm_compressor_thread_count = MAX_COMRPESSOR_THREAD_COUNT;
 
 		vm_pageout_queue_internal.pgo_maxlaundry = (vm_compressor_thread_count * 4) * VM_PAGE_LAUNDRY_MAX;
 	} else {
 		vm_compressor_thread_count = 1;
+		vm_compressor_thread_max = 1;
 		vm_pageout_queue_internal.pgo_maxlaundry = VM_PAGE_LAUNDRY_MAX;
 	}
 
-	for (i = 0; i < vm_compressor_thread_count; i++) {
+	result = vm_pageout_compressor_threads_start(vm_compressor_thread_count);
+
+	return result;
+}
+
+/*
+ * Change the number of active compressor workers.  Raising the count
+ * starts any workers not yet created; lowering it parks the workers
+ * with the highest ids once they finish their current batch.
+ */
+kern_return_t
+vm_pageout_compressor_thread_count_set(int count)
+{
+	kern_return_t	result;
+
+	if ( !(COMPRESSED_PAGER_IS_ACTIVE || DEFAULT_FREEZER_COMPRESSED_PAGER_IS_ACTIVE))
+		return KERN_NOT_SUPPORTED;
+	if (count <= 0 || count > vm_compressor_thread_max)
+		return KERN_INVALID_ARGUMENT;
+
+	result = vm_pageout_compressor_threads_start(count);
+
+	vm_page_lock_queues();
+
+	if (count > vm_compressor_threads_started)
+		count = vm_compressor_threads_started;
+
+	vm_compressor_thread_count = count;
+	vm_pageout_queue_internal.pgo_maxlaundry = (count * 4) * VM_PAGE_LAUNDRY_MAX;
+
+	thread_wakeup((event_t) &vm_pageout_queue_internal.pgo_pending);
+
+	vm_page_unlock_queues();
 
-		result = kernel_thread_start_priority((thread_continue_t)vm_pageout_iothread_internal, (void *)&ciq[i], BASEPRI_PREEMPT - 1, &vm_pageout_internal_iothread);
-		if (result == KERN_SUCCESS)
-			thread_deallocate(vm_pageout_internal_iothread);
-		else
-			break;
-	}
 	return result;
 }
 
+/*
+ * Snapshot the per-worker counters; returns the number of entries filled.
+ */
+int
+vm_pageout_compressor_thread_stats(struct vm_compressor_thread_stats *stats, int max)
+{
+	uint64_t	busy_ns;
+	int		i, n;
+
+	vm_page_lock_queues();
+	n = vm_compressor_threads_started;
+	vm_page_unlock_queues();
+
+	if (n > max)
+		n = max;
+
+	for (i = 0; i < n; i++) {
+		absolutetime_to_nanoseconds(ciq[i].busy_time, &busy_ns);
+
+		stats[i].vcts_id = i;
+		stats[i].vcts_active = (i < vm_compressor_thread_count);
+		stats[i].vcts_compressed = ciq[i].pages_compressed;
+		stats[i].vcts_failed = ciq[i].pages_failed;
+		stats[i].vcts_batches = ciq[i].batches;
+		stats[i].vcts_busy_ns = busy_ns;
+	}
+	return n;
+}
+
 #if CONFIG_IOSCHED
 /*
  * To support I/O Expedite for compressed files we mark the upls with special flags.
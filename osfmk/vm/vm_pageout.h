@@ -499,8 +499,47 @@ extern int hibernate_flush_memory(void);
 extern void hibernate_reset_stats(void);
 extern void hibernate_create_paddr_map(void);
 
+#define MAX_COMRPESSOR_THREAD_COUNT	8
+
 extern int vm_compressor_mode;
 extern int vm_compressor_thread_count;
+extern int vm_compressor_thread_max;
+
+/*
+ * Per compressor worker counters, exported via vm.compressor_thread_stats
+ */
+struct vm_compressor_thread_stats {
+	uint32_t	vcts_id;
+	uint32_t	vcts_active;		/* worker is not parked */
+	uint64_t	vcts_compressed;	/* pages compressed */
+	uint64_t	vcts_failed;		/* compressions that failed */
+	uint64_t	vcts_batches;		/* batches taken from the internal queue */
+	uint64_t	vcts_busy_ns;		/* time spent working on batches */
+};
+
+extern kern_return_t vm_pageout_compressor_thread_count_set(int count);
+extern int vm_pageout_compressor_thread_stats(struct vm_compressor_thread_stats *stats, int max);
+
+/*
+ * Codec selection for the VM compressor, see c_codec_select()
+ */
+#define VM_COMPRESSOR_CODEC_WKDM	0	/* WKdm only (default) */
+#define VM_COMPRESSOR_CODEC_LZ		1	/* byte oriented LZ only */
+#define VM_COMPRESSOR_CODEC_ADAPTIVE	2	/* pick by recent compression ratio */
+
+#define C_CODEC_WKDM	0
+#define C_CODEC_LZ	1
+#define C_CODEC_COUNT	2
+
+struct c_codec_stats {
+	uint64_t	pages;		/* pages handed to the codec */
+	uint64_t	failed;		/* pages the codec could not compress */
+	uint64_t	input_bytes;
+	uint64_t	compressed_bytes;
+};
+
+extern int			vm_compressor_codec;
+extern struct c_codec_stats	c_codec_stats[C_CODEC_COUNT];
 
 #define VM_PAGER_DEFAULT				0x1	/* Use default pager. */
 #define VM_PAGER_COMPRESSOR_NO_SWAP			0x2	/* In-core compressor only. */
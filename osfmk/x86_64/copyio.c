@@ -41,7 +41,7 @@
 
 #include <sys/kdebug.h>
 
-static int copyio(int, user_addr_t, char *, vm_size_t, vm_size_t *, int);
+static int copyio(int, user_addr_t, char *, vm_size_t, vm_size_t *, uint32_t *, int);
 static int copyio_phys(addr64_t, addr64_t, vm_size_t, int);
 
 /*
@@ -63,6 +63,7 @@ static int copyio_phys(addr64_t, addr64_t, vm_size_t, int);
  */
 extern int _bcopy(const void *, void *, vm_size_t);
 extern int _bcopystr(const void *, void *, vm_size_t, vm_size_t *);
+extern int _bcopy_cksum(const void *, void *, vm_size_t, uint32_t *);
 
 
 /*
@@ -73,10 +74,11 @@ extern int _bcopystr(const void *, void *, vm_size_t, vm_size_t *);
 #define COPYINSTR	2	/* string variant of copyout */
 #define COPYINPHYS	3	/* from user virtual to kernel physical */
 #define COPYOUTPHYS	4	/* from kernel physical to user virtual */
+#define COPYINCKSUM	5	/* copyin, also summing the data */
 
 static int
 copyio(int copy_type, user_addr_t user_addr, char *kernel_addr,
-       vm_size_t nbytes, vm_size_t *lencopied, int use_kernel_map)
+       vm_size_t nbytes, vm_size_t *lencopied, uint32_t *sump, int use_kernel_map)
 {
         thread_t	thread;
 	pmap_t		pmap;
@@ -157,6 +159,13 @@ copyio(int copy_type, user_addr_t user_addr, char *kernel_addr,
 				nbytes);
 		break;
 
+	case COPYINCKSUM:
+	        error = _bcopy_cksum((const void *) user_addr,
+				kernel_addr,
+				nbytes,
+				sump);
+		break;
+
 	case COPYINPHYS:
 	        error = _bcopy((const void *) user_addr,
 				PHYSMAP_PTOV(kernel_addr),
@@ -244,19 +253,31 @@ copyio_phys(addr64_t source, addr64_t sink, vm_size_t csize, int which)
 		vaddr  = (user_addr_t)sink;
 		ctype  = COPYOUTPHYS;
 	}
-	return copyio(ctype, vaddr, paddr, csize, NULL, which & cppvKmap);
+	return copyio(ctype, vaddr, paddr, csize, NULL, NULL, which & cppvKmap);
 }
 
 int
 copyinmsg(const user_addr_t user_addr, char *kernel_addr, mach_msg_size_t nbytes)
 {
-    return copyio(COPYIN, user_addr, kernel_addr, nbytes, NULL, 0);
+    return copyio(COPYIN, user_addr, kernel_addr, nbytes, NULL, NULL, 0);
 }    
 
 int
 copyin(const user_addr_t user_addr, char *kernel_addr, vm_size_t nbytes)
 {
-    return copyio(COPYIN, user_addr, kernel_addr, nbytes, NULL, 0);
+    return copyio(COPYIN, user_addr, kernel_addr, nbytes, NULL, NULL, 0);
+}
+
+/*
+ * copyin() that also returns the 16-bit 1's complement sum of the
+ * data copied (as in_cksum computes it) in *sump, in one pass
+ */
+int
+copyin_cksum(const user_addr_t user_addr, char *kernel_addr, vm_size_t nbytes, uint32_t *sump)
+{
+    *sump = 0;
+
+    return copyio(COPYINCKSUM, user_addr, kernel_addr, nbytes, NULL, sump, 0);
 }
 
 int
@@ -264,19 +285,19 @@ copyinstr(const user_addr_t user_addr,  char *kernel_addr, vm_size_t nbytes, vm_
 {
     *lencopied = 0;
 
-    return copyio(COPYINSTR, user_addr, kernel_addr, nbytes, lencopied, 0);
+    return copyio(COPYINSTR, user_addr, kernel_addr, nbytes, lencopied, NULL, 0);
 }
 
 int
 copyoutmsg(const char *kernel_addr, user_addr_t user_addr, mach_msg_size_t nbytes)
 {
-    return copyio(COPYOUT, user_addr, (char *)(uintptr_t)kernel_addr, nbytes, NULL, 0);
+    return copyio(COPYOUT, user_addr, (char *)(uintptr_t)kernel_addr, nbytes, NULL, NULL, 0);
 }
 
 int
 copyout(const void *kernel_addr, user_addr_t user_addr, vm_size_t nbytes)
 {
-    return copyio(COPYOUT, user_addr, (char *)(uintptr_t)kernel_addr, nbytes, NULL, 0);
+    return copyio(COPYOUT, user_addr, (char *)(uintptr_t)kernel_addr, nbytes, NULL, NULL, 0);
 }
 
 
@@ -307,6 +307,76 @@ _bcopystr_fail:
 	movl	$(EFAULT),%eax		/* return error for failure */
 	ret
 
+/*
+ * Copyin from user space, also returning the 16-bit 1's complement
+ * sum of the data, so that it is only read once.
+ * rdi:	source address
+ * rsi:	destination address
+ * rdx:	byte count
+ * rcx:	sum (OUT)
+ */
+Entry(_bcopy_cksum)
+	movq	%rcx, %r9		/* sum pointer */
+	xorl	%eax, %eax		/* 64-bit 1's complement accumulator */
+	movq	%rdx, %rcx		/* sum longwords first */
+	shrq	$3, %rcx
+	jz	2f
+	clc
+1:
+	RECOVERY_SECTION
+	RECOVER(_bcopy_cksum_fail)
+	movq	(%rdi), %r8
+	movq	%r8, (%rsi)
+	adcq	%r8, %rax		/* dec and lea leave CF alone */
+	leaq	8(%rdi), %rdi
+	leaq	8(%rsi), %rsi
+	decq	%rcx
+	jnz	1b
+	adcq	$0, %rax
+	adcq	$0, %rax
+2:
+	movl	%edx, %ecx		/* then the remaining bytes, */
+	andl	$7, %ecx		/* gathered last to first */
+	jz	4f
+	xorl	%r8d, %r8d
+3:
+	RECOVERY_SECTION
+	RECOVER(_bcopy_cksum_fail)
+	movzbl	-1(%rdi,%rcx), %r10d
+	movb	%r10b, -1(%rsi,%rcx)
+	shlq	$8, %r8
+	orq	%r10, %r8
+	decl	%ecx
+	jnz	3b
+	addq	%r8, %rax
+	adcq	$0, %rax
+	adcq	$0, %rax
+4:
+	movq	%rax, %r8		/* fold to 16 bits */
+	shrq	$32, %r8
+	movl	%eax, %eax
+	addq	%r8, %rax
+	movq	%rax, %r8
+	shrq	$16, %r8
+	andl	$0xffff, %eax
+	addq	%r8, %rax
+	movl	%eax, %r8d
+	shrl	$16, %r8d
+	andl	$0xffff, %eax
+	addl	%r8d, %eax
+	movl	%eax, %r8d
+	shrl	$16, %r8d
+	andl	$0xffff, %eax
+	addl	%r8d, %eax
+	movl	%eax, (%r9)
+
+	xorl	%eax,%eax		/* return 0 for success */
+	ret				/* and return */
+
+_bcopy_cksum_fail:
+	movl	$(EFAULT),%eax		/* return error for failure */
+	ret
+
 /*
  * Done with recovery table.
  */
@@ -492,6 +492,7 @@ int	mac_vnode_check_link(vfs_context_t ctx, struct vnode *dvp,
 int	mac_vnode_check_listextattr(vfs_context_t ctx, struct vnode *vp);
 int	mac_vnode_check_lookup(vfs_context_t ctx, struct vnode *dvp,
 	    struct componentname *cnp);
+int	mac_vnode_check_lookup_needed(vfs_context_t ctx);
 int	mac_vnode_check_open(vfs_context_t ctx, struct vnode *vp,
 	    int acc_mode);
 int	mac_vnode_check_read(vfs_context_t ctx,
@@ -965,6 +965,18 @@ mac_vnode_check_lookup(vfs_context_t ctx, struct vnode *dvp,
 	return (error);
 }
 
+/*
+ * Whether mac_vnode_check_lookup() would consult the policies for this
+ * context; if not, the name cache can do the whole lookup without
+ * blocking.
+ */
+int
+mac_vnode_check_lookup_needed(vfs_context_t ctx)
+{
+	return (mac_vnode_enforce &&
+	    mac_context_check_enforce(ctx, MAC_VNODE_ENFORCE));
+}
+
 int
 mac_vnode_check_open(vfs_context_t ctx, struct vnode *vp, int acc_mode)
 {
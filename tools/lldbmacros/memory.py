@@ -159,7 +159,8 @@ def GetZoneSummary(zone):
             ["zleak_on",           "L"],
             ["doing_alloc",        "A"],
             ["waiting",            "W"],
-            ["doing_gc",           "G"]
+            ["doing_gc",           "G"],
+            ["cpu_cache_enabled",  "P"]
             ]
     if kern.arch == 'x86_64':
         marks.append(["gzalloc_exempt",     "M"])
@@ -200,6 +201,7 @@ def Zprint(cmd_args=None):
         W - another thread is waiting for more memory
         L - zone is being monitored by zleaks
         G - currently running GC
+        P - allocations and frees go through per-cpu magazines first
     """
     global kern
     print GetZoneSummary.header
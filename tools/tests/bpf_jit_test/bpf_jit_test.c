@@ -0,0 +1,350 @@
+/*
+ * Differential test and benchmark for the BPF JIT.
+ *
+ * Builds bsd/net/bpf_filter.c and bsd/net/bpf_jit.c as they are and
+ * runs the same programs through the interpreter and the generated
+ * code.  Random programs cover every opcode the validator accepts,
+ * forward branches, the scratch memory store and packet loads near and
+ * past the end of the buffer (including offsets that overflow 32 bits);
+ * they are run over synthetic Ethernet/IPv4/IPv6 frames and random
+ * bytes, with capture lengths shorter than the wire length.  Any
+ * difference in the returned snap length is reported.
+ *
+ * The benchmark then times a few programs as emitted by tcpdump -dd.
+ *
+ * Usage: bpf_jit_test [-p programs] [-n packets] [-s seed]
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#include <net/bpf.h>
+#include <net/bpf_jit.h>
+
+#define	MAXPKT		256
+#define	MAXPROG		64
+
+/* tcpdump -dd 'tcp port 80' */
+static struct bpf_insn prog_tcp80[] = {
+	{ 0x28, 0, 0, 0x0000000c },
+	{ 0x15, 0, 6, 0x000086dd },
+	{ 0x30, 0, 0, 0x00000014 },
+	{ 0x15, 0, 15, 0x00000006 },
+	{ 0x28, 0, 0, 0x00000036 },
+	{ 0x15, 12, 0, 0x00000050 },
+	{ 0x28, 0, 0, 0x00000038 },
+	{ 0x15, 10, 11, 0x00000050 },
+	{ 0x15, 0, 10, 0x00000800 },
+	{ 0x30, 0, 0, 0x00000017 },
+	{ 0x15, 0, 8, 0x00000006 },
+	{ 0x28, 0, 0, 0x00000014 },
+	{ 0x45, 6, 0, 0x00001fff },
+	{ 0xb1, 0, 0, 0x0000000e },
+	{ 0x48, 0, 0, 0x0000000e },
+	{ 0x15, 2, 0, 0x00000050 },
+	{ 0x48, 0, 0, 0x00000010 },
+	{ 0x15, 0, 1, 0x00000050 },
+	{ 0x6, 0, 0, 0x00040000 },
+	{ 0x6, 0, 0, 0x00000000 },
+};
+
+/* tcpdump -dd 'tcp[tcpflags] & tcp-syn != 0' */
+static struct bpf_insn prog_syn[] = {
+	{ 0x28, 0, 0, 0x0000000c },
+	{ 0x15, 0, 7, 0x00000800 },
+	{ 0x30, 0, 0, 0x00000017 },
+	{ 0x15, 0, 5, 0x00000006 },
+	{ 0x28, 0, 0, 0x00000014 },
+	{ 0x45, 3, 0, 0x00001fff },
+	{ 0xb1, 0, 0, 0x0000000e },
+	{ 0x50, 0, 0, 0x0000001b },
+	{ 0x45, 0, 1, 0x00000002 },
+	{ 0x6, 0, 0, 0x00040000 },
+	{ 0x6, 0, 0, 0x00000000 },
+};
+
+/* tcpdump -dd 'udp and len > 100', plus a scratch store round trip */
+static struct bpf_insn prog_udplen[] = {
+	{ 0x28, 0, 0, 0x0000000c },
+	{ 0x15, 0, 2, 0x000086dd },
+	{ 0x30, 0, 0, 0x00000014 },
+	{ 0x15, 3, 7, 0x00000011 },
+	{ 0x15, 0, 6, 0x00000800 },
+	{ 0x30, 0, 0, 0x00000017 },
+	{ 0x15, 0, 4, 0x00000011 },
+	{ 0x80, 0, 0, 0x00000000 },
+	{ 0x02, 0, 0, 0x00000003 },
+	{ 0x60, 0, 0, 0x00000003 },
+	{ 0x25, 1, 0, 0x00000064 },
+	{ 0x6, 0, 0, 0x00000000 },
+	{ 0x6, 0, 0, 0x00040000 },
+};
+
+static struct {
+	const char	*name;
+	struct bpf_insn	*prog;
+	u_int		len;
+} canned[] = {
+	{ "tcp port 80", prog_tcp80, sizeof (prog_tcp80) / sizeof (prog_tcp80[0]) },
+	{ "tcp syn", prog_syn, sizeof (prog_syn) / sizeof (prog_syn[0]) },
+	{ "udp and len > 100", prog_udplen, sizeof (prog_udplen) / sizeof (prog_udplen[0]) },
+};
+
+/* Everything bpf_filter() implements */
+static const u_short opcodes[] = {
+	BPF_LD|BPF_W|BPF_ABS, BPF_LD|BPF_H|BPF_ABS, BPF_LD|BPF_B|BPF_ABS,
+	BPF_LD|BPF_W|BPF_IND, BPF_LD|BPF_H|BPF_IND, BPF_LD|BPF_B|BPF_IND,
+	BPF_LD|BPF_W|BPF_LEN, BPF_LDX|BPF_W|BPF_LEN, BPF_LDX|BPF_MSH|BPF_B,
+	BPF_LD|BPF_IMM, BPF_LDX|BPF_IMM, BPF_LD|BPF_MEM, BPF_LDX|BPF_MEM,
+	BPF_ST, BPF_STX, BPF_JMP|BPF_JA,
+	BPF_JMP|BPF_JGT|BPF_K, BPF_JMP|BPF_JGE|BPF_K, BPF_JMP|BPF_JEQ|BPF_K,
+	BPF_JMP|BPF_JSET|BPF_K, BPF_JMP|BPF_JGT|BPF_X, BPF_JMP|BPF_JGE|BPF_X,
+	BPF_JMP|BPF_JEQ|BPF_X, BPF_JMP|BPF_JSET|BPF_X,
+	BPF_ALU|BPF_ADD|BPF_X, BPF_ALU|BPF_SUB|BPF_X, BPF_ALU|BPF_MUL|BPF_X,
+	BPF_ALU|BPF_DIV|BPF_X, BPF_ALU|BPF_AND|BPF_X, BPF_ALU|BPF_OR|BPF_X,
+	BPF_ALU|BPF_LSH|BPF_X, BPF_ALU|BPF_RSH|BPF_X,
+	BPF_ALU|BPF_ADD|BPF_K, BPF_ALU|BPF_SUB|BPF_K, BPF_ALU|BPF_MUL|BPF_K,
+	BPF_ALU|BPF_DIV|BPF_K, BPF_ALU|BPF_AND|BPF_K, BPF_ALU|BPF_OR|BPF_K,
+	BPF_ALU|BPF_LSH|BPF_K, BPF_ALU|BPF_RSH|BPF_K, BPF_ALU|BPF_NEG,
+	BPF_MISC|BPF_TAX, BPF_MISC|BPF_TXA,
+	BPF_RET|BPF_K, BPF_RET|BPF_A,
+};
+#define	NOPCODES	(sizeof (opcodes) / sizeof (opcodes[0]))
+
+static mach_timebase_info_data_t tb;
+
+static double
+to_ns(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom;
+}
+
+static u_int32_t
+rand_k(void)
+{
+	switch (random() % 8) {
+	case 0:
+		return (random());
+	case 1:
+		return (0xffffffff - random() % 8);	/* wraps with X */
+	case 2:
+		return (random() % 8);
+	default:
+		return (random() % (MAXPKT + 16));	/* near the end */
+	}
+}
+
+static u_int
+gen_prog(struct bpf_insn *prog)
+{
+	u_int i, n = 2 + random() % (MAXPROG - 2), left;
+	struct bpf_insn *pc;
+
+	for (i = 0; i < n - 1; i++) {
+		pc = &prog[i];
+		pc->code = opcodes[random() % NOPCODES];
+		pc->k = rand_k();
+		pc->jt = pc->jf = 0;
+		left = n - i - 1;		/* instructions after this one */
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(pc->code) == BPF_MEM)
+				pc->k %= BPF_MEMWORDS;
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			/* out of range stores return 0 */
+			if (random() % 16 != 0)
+				pc->k %= BPF_MEMWORDS;
+			break;
+		case BPF_JMP:
+			pc->jt = random() % left;
+			pc->jf = random() % left;
+			if (BPF_OP(pc->code) == BPF_JA)
+				pc->k = random() % left;
+			break;
+		case BPF_ALU:
+			if (BPF_OP(pc->code) == BPF_DIV && pc->k == 0)
+				pc->k = 1;
+			/* constant shifts of 32 or more are undefined in C */
+			if ((BPF_OP(pc->code) == BPF_LSH ||
+			    BPF_OP(pc->code) == BPF_RSH) &&
+			    BPF_SRC(pc->code) == BPF_K)
+				pc->k %= 32;
+			/* so are variable ones; keep X small first */
+			if ((BPF_OP(pc->code) == BPF_LSH ||
+			    BPF_OP(pc->code) == BPF_RSH) &&
+			    BPF_SRC(pc->code) == BPF_X) {
+				pc->code = BPF_LDX|BPF_IMM;
+				pc->k %= 32;
+			}
+			break;
+		}
+	}
+	prog[n - 1].code = (random() & 1) ? BPF_RET|BPF_A : BPF_RET|BPF_K;
+	prog[n - 1].jt = prog[n - 1].jf = 0;
+	prog[n - 1].k = random();
+	return (n);
+}
+
+static void
+gen_packet(u_char *p, u_int *wirelen, u_int *buflen)
+{
+	u_int i, len = 14 + random() % (MAXPKT - 14), hl;
+
+	for (i = 0; i < len; i++)
+		p[i] = random();
+
+	switch (random() % 4) {
+	case 0:		/* IPv4 */
+		p[12] = 0x08; p[13] = 0x00;
+		hl = 5 + random() % 3;
+		p[14] = 0x40 | hl;
+		p[20] = random() % 4 == 0 ? 0x20 : 0;	/* fragments */
+		p[21] = 0;
+		p[23] = (random() & 1) ? 6 : 17;
+		if (14 + hl * 4 + 4 <= len) {
+			p[14 + hl * 4 + 2] = 0;
+			p[14 + hl * 4 + 3] = (random() & 1) ? 80 : 53;
+		}
+		break;
+	case 1:		/* IPv6 */
+		p[12] = 0x86; p[13] = 0xdd;
+		p[20] = (random() & 1) ? 6 : 17;
+		if (len > 57) {
+			p[54] = 0;
+			p[55] = (random() & 1) ? 80 : 53;
+		}
+		break;
+	default:
+		break;
+	}
+	*wirelen = len;
+	*buflen = (random() % 4 == 0) ? random() % (len + 1) : len;
+}
+
+static void
+dump(const struct bpf_insn *prog, u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n; i++)
+		fprintf(stderr, "\t{ 0x%x, %u, %u, 0x%08x },\n", prog[i].code,
+		    prog[i].jt, prog[i].jf, prog[i].k);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bpf_insn		prog[MAXPROG];
+	struct bpf_jit		*bj;
+	u_char			(*pkts)[MAXPKT];
+	u_int			*wire, *buf;
+	u_int			nprogs = 20000, npkts = 256, n, i, j;
+	u_int64_t		bad = 0, runs = 0, start, tint, tjit;
+	volatile u_int		sink = 0;
+	unsigned int		seed = 1;
+	int			ch;
+
+	while ((ch = getopt(argc, argv, "p:n:s:")) != -1) {
+		switch (ch) {
+		case 'p':
+			nprogs = atoi(optarg);
+			break;
+		case 'n':
+			npkts = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-p programs] [-n packets] "
+			    "[-s seed]\n", argv[0]);
+			return (1);
+		}
+	}
+
+	mach_timebase_info(&tb);
+	srandom(seed);
+
+	pkts = malloc(npkts * MAXPKT);
+	wire = malloc(npkts * sizeof (u_int));
+	buf = malloc(npkts * sizeof (u_int));
+	assert(pkts != NULL && wire != NULL && buf != NULL);
+	for (j = 0; j < npkts; j++)
+		gen_packet(pkts[j], &wire[j], &buf[j]);
+
+	for (i = 0; i < nprogs; i++) {
+		n = gen_prog(prog);
+		if ((bj = bpf_jit_compile(prog, n)) == NULL) {
+			fprintf(stderr, "program %u did not compile:\n", i);
+			dump(prog, n);
+			bad++;
+			continue;
+		}
+		for (j = 0; j < npkts; j++) {
+			u_int a = bpf_filter(prog, pkts[j], wire[j], buf[j]);
+			u_int b = bpf_jit_filter(bj, pkts[j], wire[j], buf[j]);
+
+			runs++;
+			if (a != b) {
+				if (bad++ < 10) {
+					fprintf(stderr, "program %u packet %u "
+					    "(wirelen %u buflen %u): "
+					    "interpreter %u jit %u\n", i, j,
+					    wire[j], buf[j], a, b);
+					dump(prog, n);
+				}
+			}
+		}
+		bpf_jit_free(bj);
+	}
+	printf("%u random programs, %llu runs, %llu mismatches\n", nprogs,
+	    (unsigned long long)runs, (unsigned long long)bad);
+
+	for (i = 0; i < sizeof (canned) / sizeof (canned[0]); i++) {
+		u_int reps = 20000;
+
+		bj = bpf_jit_compile(canned[i].prog, canned[i].len);
+		assert(bj != NULL);
+		for (j = 0; j < npkts; j++) {
+			if (bpf_filter(canned[i].prog, pkts[j], wire[j], buf[j]) !=
+			    bpf_jit_filter(bj, pkts[j], wire[j], buf[j]))
+				bad++;
+		}
+
+		start = mach_absolute_time();
+		for (n = 0; n < reps; n++)
+			for (j = 0; j < npkts; j++)
+				sink += bpf_filter(canned[i].prog, pkts[j],
+				    wire[j], buf[j]);
+		tint = mach_absolute_time() - start;
+
+		start = mach_absolute_time();
+		for (n = 0; n < reps; n++)
+			for (j = 0; j < npkts; j++)
+				sink += bpf_jit_filter(bj, pkts[j], wire[j],
+				    buf[j]);
+		tjit = mach_absolute_time() - start;
+
+		printf("%-20s interpreter %6.1f ns/pkt  jit %6.1f ns/pkt  "
+		    "(%.1fx)\n", canned[i].name,
+		    to_ns(tint) / ((double)reps * npkts),
+		    to_ns(tjit) / ((double)reps * npkts),
+		    (double)tint / (tjit ? tjit : 1));
+		bpf_jit_free(bj);
+	}
+
+	free(pkts);
+	free(wire);
+	free(buf);
+	return (bad != 0);
+}
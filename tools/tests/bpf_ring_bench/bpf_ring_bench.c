@@ -0,0 +1,289 @@
+/*
+ * Capture throughput of the BPF read(2) path against the shared ring
+ * (BIOCSETRING).
+ *
+ * Each mode opens a BPF device on the given interface (lo0 by default)
+ * and consumes packets for the given number of seconds while, unless
+ * -n is given, a thread sends UDP datagrams to 127.0.0.1 as fast as it
+ * can.  The read(2) mode uses the classic double buffer with a read
+ * timeout; the ring mode waits on a kqueue and walks the records in
+ * place.  For both, the packets and bytes seen by the consumer and the
+ * kernel's receive and drop counts (BIOCGSTATS) are reported.
+ *
+ * Must be run as root.
+ *
+ * Usage: bpf_ring_bench [-i ifname] [-t seconds] [-b bufsize]
+ *	      [-r ringsize] [-l payload] [-n]
+ */
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <net/bpf.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#ifndef BIOCSETRING
+/* From the private part of <net/bpf.h> */
+struct bpf_ring {
+	volatile u_int64_t	br_head;
+	u_int64_t		_br_pad0[7];
+	volatile u_int64_t	br_tail;
+	u_int64_t		_br_pad1[7];
+	u_int32_t		br_size;
+	u_int32_t		br_off;
+};
+
+#define	BPF_RING_MINREC		20
+
+struct bpf_ring_req {
+	u_int32_t	brr_size;
+	u_int32_t	brr_pad;
+	u_int64_t	brr_addr;
+};
+
+#define	BIOCSETRING	_IOWR('B', 128, struct bpf_ring_req)
+#endif /* BIOCSETRING */
+
+struct result {
+	u_int64_t	pkts;
+	u_int64_t	bytes;
+	u_int64_t	wakeups;
+	u_int64_t	sent;
+	struct bpf_stat	stat;
+	double		secs;
+};
+
+static const char	*ifname = "lo0";
+static u_int		 seconds = 5, bufsize = 512 * 1024, payload = 256;
+static u_int		 ringsize = 8 * 1024 * 1024;
+static int		 generate = 1;
+static volatile int	 stop;
+static volatile u_int64_t sent;
+static mach_timebase_info_data_t tb;
+
+static double
+to_secs(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e9;
+}
+
+static void *
+sender(void *arg)
+{
+	struct sockaddr_in	sin;
+	char			buf[65536];
+	int			s;
+
+	(void)arg;
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		err(1, "socket");
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9);		/* discard */
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	memset(buf, 0xa5, sizeof (buf));
+
+	while (!stop) {
+		if (sendto(s, buf, payload, 0, (struct sockaddr *)&sin,
+		    sizeof (sin)) == (ssize_t)payload)
+			sent++;
+	}
+	close(s);
+	return (NULL);
+}
+
+static int
+open_bpf(void)
+{
+	struct ifreq	ifr;
+	struct timeval	tv = { 0, 100000 };
+	char		dev[32];
+	int		fd = -1, i;
+
+	for (i = 0; i < 256; i++) {
+		snprintf(dev, sizeof (dev), "/dev/bpf%d", i);
+		if ((fd = open(dev, O_RDWR)) >= 0 || errno != EBUSY)
+			break;
+	}
+	if (fd < 0)
+		err(1, "open bpf");
+	if (ioctl(fd, BIOCSBLEN, &bufsize) < 0)
+		err(1, "BIOCSBLEN");
+	memset(&ifr, 0, sizeof (ifr));
+	strlcpy(ifr.ifr_name, ifname, sizeof (ifr.ifr_name));
+	if (ioctl(fd, BIOCSETIF, &ifr) < 0)
+		err(1, "BIOCSETIF %s", ifname);
+	if (ioctl(fd, BIOCSRTIMEOUT, &tv) < 0)
+		err(1, "BIOCSRTIMEOUT");
+	return (fd);
+}
+
+static void
+run_read(int fd, struct result *r, uint64_t end)
+{
+	char	*buf, *p;
+	ssize_t	n;
+
+	if ((buf = malloc(bufsize)) == NULL)
+		err(1, "malloc");
+	while (mach_absolute_time() < end) {
+		if ((n = read(fd, buf, bufsize)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "read");
+		}
+		r->wakeups++;
+		for (p = buf; p < buf + n; ) {
+			struct bpf_hdr *hp = (struct bpf_hdr *)(void *)p;
+
+			r->pkts++;
+			r->bytes += hp->bh_caplen;
+			p += BPF_WORDALIGN(hp->bh_hdrlen + hp->bh_caplen);
+		}
+	}
+	free(buf);
+}
+
+static void
+run_ring(int fd, struct result *r, uint64_t end)
+{
+	struct bpf_ring_req	brr;
+	struct bpf_ring		*br;
+	struct kevent		kev;
+	struct timespec		ts = { 0, 100000000 };
+	u_char			*data;
+	u_int64_t		head, tail;
+	u_int32_t		off;
+	int			kq;
+
+	memset(&brr, 0, sizeof (brr));
+	brr.brr_size = ringsize;
+	if (ioctl(fd, BIOCSETRING, &brr) < 0)
+		err(1, "BIOCSETRING");
+	br = (struct bpf_ring *)(uintptr_t)brr.brr_addr;
+	data = (u_char *)br + br->br_off;
+
+	if ((kq = kqueue()) < 0)
+		err(1, "kqueue");
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (kevent(kq, &kev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+
+	tail = br->br_tail;
+	while (mach_absolute_time() < end) {
+		if (kevent(kq, NULL, 0, &kev, 1, &ts) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "kevent");
+		}
+		r->wakeups++;
+		head = br->br_head;
+		while (tail != head) {
+			struct bpf_hdr *hp;
+
+			off = tail & (br->br_size - 1);
+			hp = (struct bpf_hdr *)(void *)(data + off);
+			if (br->br_size - off < BPF_RING_MINREC ||
+			    hp->bh_hdrlen == 0) {
+				tail += br->br_size - off;
+				continue;
+			}
+			r->pkts++;
+			r->bytes += hp->bh_caplen;
+			tail += BPF_WORDALIGN(hp->bh_hdrlen + hp->bh_caplen);
+		}
+		br->br_tail = tail;
+	}
+	close(kq);
+}
+
+static void
+run(const char *name, void (*fn)(int, struct result *, uint64_t))
+{
+	struct result	r;
+	pthread_t	thr;
+	uint64_t	start, end;
+	int		fd;
+
+	memset(&r, 0, sizeof (r));
+	fd = open_bpf();
+	stop = 0;
+	sent = 0;
+	if (generate && pthread_create(&thr, NULL, sender, NULL) != 0)
+		errx(1, "pthread_create");
+
+	start = mach_absolute_time();
+	end = start + (uint64_t)((double)seconds * 1e9 * tb.denom / tb.numer);
+	(*fn)(fd, &r, end);
+	r.secs = to_secs(mach_absolute_time() - start);
+
+	stop = 1;
+	if (generate)
+		pthread_join(thr, NULL);
+	r.sent = sent;
+	if (ioctl(fd, BIOCGSTATS, &r.stat) < 0)
+		err(1, "BIOCGSTATS");
+	close(fd);
+
+	printf("%-6s %10.0f pkts/s %8.1f MB/s  recv %u drop %u (%.2f%%)  "
+	    "sent %llu  wakeups %llu\n", name, r.pkts / r.secs,
+	    r.bytes / r.secs / 1e6, r.stat.bs_recv, r.stat.bs_drop,
+	    r.stat.bs_recv ? 100.0 * r.stat.bs_drop / r.stat.bs_recv : 0.0,
+	    (unsigned long long)r.sent, (unsigned long long)r.wakeups);
+}
+
+int
+main(int argc, char **argv)
+{
+	int	ch;
+
+	while ((ch = getopt(argc, argv, "i:t:b:r:l:n")) != -1) {
+		switch (ch) {
+		case 'i':
+			ifname = optarg;
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			bufsize = atoi(optarg);
+			break;
+		case 'r':
+			ringsize = atoi(optarg);
+			break;
+		case 'l':
+			payload = atoi(optarg);
+			if (payload > 65507)
+				payload = 65507;
+			break;
+		case 'n':
+			generate = 0;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-i ifname] [-t seconds] "
+			    "[-b bufsize] [-r ringsize] [-l payload] [-n]\n",
+			    argv[0]);
+			return (1);
+		}
+	}
+
+	mach_timebase_info(&tb);
+	run("read", run_read);
+	run("ring", run_ring);
+	return (0);
+}
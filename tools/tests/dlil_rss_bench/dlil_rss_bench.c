@@ -0,0 +1,211 @@
+/*
+ * Loopback receive throughput with DLIL receive-side steering.
+ *
+ * Runs the given number of UDP flows over lo0 for the given number of
+ * seconds.  Each flow has a sender thread, which sends sequenced
+ * datagrams to 127.0.0.1 as fast as it can, and a receiver thread on
+ * its own port.  The aggregate receive rate is reported along with the
+ * datagrams that arrived out of order; the latter must be 0, since
+ * steering keeps every packet of a flow on the same input thread.
+ *
+ * Run once on a kernel booted with dlil_rss=<n> and once without to
+ * compare; net.link.generic.system.dlil_rss_queues shows the mode in
+ * effect.  The kdebug events DBG_DLIL_STATIC 4 and 5 trace per-queue
+ * enqueues and dequeues with the queue occupancy.
+ *
+ * Usage: dlil_rss_bench [-f flows] [-t seconds] [-l payload]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#define	MAXFLOWS	256
+
+struct flow {
+	int		rs;		/* receive socket */
+	int		ss;		/* send socket */
+	struct sockaddr_in sin;		/* receiver address */
+	pthread_t	rthr;
+	pthread_t	sthr;
+	u_int64_t	sent;
+	u_int64_t	pkts;
+	u_int64_t	bytes;
+	u_int64_t	ooo;		/* out of order */
+	u_int64_t	last;		/* last sequence number seen */
+};
+
+static u_int		 nflows = 8, seconds = 5, payload = 64;
+static struct flow	 flows[MAXFLOWS];
+static volatile int	 stop;
+static mach_timebase_info_data_t tb;
+
+static double
+to_secs(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e9;
+}
+
+static void *
+sender(void *arg)
+{
+	struct flow	*f = arg;
+	char		 buf[65536];
+	u_int64_t	 seq = 0;
+
+	memset(buf, 0xa5, sizeof (buf));
+	while (!stop) {
+		seq++;
+		memcpy(buf, &seq, sizeof (seq));
+		if (sendto(f->ss, buf, payload, 0, (struct sockaddr *)&f->sin,
+		    sizeof (f->sin)) == (ssize_t)payload)
+			f->sent++;
+		else
+			seq--;
+	}
+	return (NULL);
+}
+
+static void *
+receiver(void *arg)
+{
+	struct flow	*f = arg;
+	char		 buf[65536];
+	u_int64_t	 seq;
+	ssize_t		 n;
+
+	while (!stop) {
+		if ((n = recv(f->rs, buf, sizeof (buf), 0)) < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err(1, "recv");
+		}
+		if (n < (ssize_t)sizeof (seq))
+			continue;
+		memcpy(&seq, buf, sizeof (seq));
+		if (seq <= f->last)
+			f->ooo++;
+		else
+			f->last = seq;
+		f->pkts++;
+		f->bytes += n;
+	}
+	return (NULL);
+}
+
+static void
+setup(struct flow *f)
+{
+	struct timeval	tv = { 0, 100000 };
+	socklen_t	len = sizeof (f->sin);
+	int		rcvbuf = 4 * 1024 * 1024;
+
+	if ((f->rs = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	    (f->ss = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		err(1, "socket");
+	memset(&f->sin, 0, sizeof (f->sin));
+	f->sin.sin_len = sizeof (f->sin);
+	f->sin.sin_family = AF_INET;
+	f->sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(f->rs, (struct sockaddr *)&f->sin, sizeof (f->sin)) < 0)
+		err(1, "bind");
+	if (getsockname(f->rs, (struct sockaddr *)&f->sin, &len) < 0)
+		err(1, "getsockname");
+	(void) setsockopt(f->rs, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+	    sizeof (rcvbuf));
+	if (setsockopt(f->rs, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0)
+		err(1, "SO_RCVTIMEO");
+}
+
+int
+main(int argc, char **argv)
+{
+	u_int64_t	 pkts = 0, bytes = 0, ooo = 0, sent = 0;
+	u_int32_t	 queues = 0;
+	size_t		 len = sizeof (queues);
+	uint64_t	 start;
+	double		 secs;
+	u_int		 i;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "f:t:l:")) != -1) {
+		switch (ch) {
+		case 'f':
+			nflows = atoi(optarg);
+			if (nflows < 1)
+				nflows = 1;
+			if (nflows > MAXFLOWS)
+				nflows = MAXFLOWS;
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			payload = atoi(optarg);
+			if (payload < sizeof (u_int64_t))
+				payload = sizeof (u_int64_t);
+			if (payload > 65507)
+				payload = 65507;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f flows] [-t seconds] "
+			    "[-l payload]\n", argv[0]);
+			return (1);
+		}
+	}
+
+	mach_timebase_info(&tb);
+	if (sysctlbyname("net.link.generic.system.dlil_rss_queues",
+	    &queues, &len, NULL, 0) < 0)
+		queues = 0;
+
+	for (i = 0; i < nflows; i++)
+		setup(&flows[i]);
+
+	start = mach_absolute_time();
+	for (i = 0; i < nflows; i++) {
+		if (pthread_create(&flows[i].rthr, NULL, receiver,
+		    &flows[i]) != 0 ||
+		    pthread_create(&flows[i].sthr, NULL, sender,
+		    &flows[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nflows; i++) {
+		pthread_join(flows[i].sthr, NULL);
+		pthread_join(flows[i].rthr, NULL);
+	}
+	secs = to_secs(mach_absolute_time() - start);
+
+	for (i = 0; i < nflows; i++) {
+		pkts += flows[i].pkts;
+		bytes += flows[i].bytes;
+		ooo += flows[i].ooo;
+		sent += flows[i].sent;
+		close(flows[i].rs);
+		close(flows[i].ss);
+	}
+
+	printf("rss queues %u  flows %u  payload %u\n", queues, nflows,
+	    payload);
+	printf("%10.0f pkts/s %8.1f MB/s  recv %llu sent %llu (%.2f%% lost)  "
+	    "out of order %llu\n", pkts / secs, bytes / secs / 1e6,
+	    (unsigned long long)pkts, (unsigned long long)sent,
+	    sent ? 100.0 * (sent - pkts) / sent : 0.0,
+	    (unsigned long long)ooo);
+
+	return (ooo != 0);
+}
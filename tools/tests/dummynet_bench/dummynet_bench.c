@@ -0,0 +1,416 @@
+/*
+ * Packet rate and scheduling jitter of dummynet with many pipes.
+ *
+ * Configures a range of dummynet pipes (10000 by default), each with the
+ * same delay and bandwidth, and loads one pf dummynet rule per pipe into
+ * an anchor under com.apple, matching UDP from one source port to the
+ * receiver.  Sender threads each own a share of the source sockets and
+ * send to the receiver on the loopback address round robin, optionally
+ * paced to an aggregate rate; every packet carries its send time.
+ *
+ * The receiver reports the packets per second that came out of the
+ * pipes and how late they came out: the excess of the measured latency
+ * over the configured delay, at the median, 99th and 99.9th percentiles
+ * and the maximum.  pf has to walk its dummynet rules for every packet,
+ * which is part of the cost; rerun with -n to see how that and the
+ * scheduler scale with the number of pipes.
+ *
+ * The pipes, the anchor and the pf enable reference are removed on exit.
+ * Needs root and a kernel built with DUMMYNET.
+ *
+ * Usage: dummynet_bench [-n pipes] [-b first pipe] [-p first port]
+ *        [-d delay ms] [-B bandwidth kbit/s] [-q qsize] [-s size]
+ *        [-T threads] [-r packets/s] [-t seconds]
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip_dummynet.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#define	ANCHOR		"com.apple/dummynet_bench"
+#define	RPORT		9		/* receiver port */
+#define	MAXTHREADS	64
+#define	HIST_US		1000000		/* latency histogram, 1us buckets */
+
+struct payload {
+	uint64_t	sent;		/* mach_absolute_time() */
+	uint32_t	pipe;
+};
+
+struct sender {
+	pthread_t	thr;
+	u_int		first, count;	/* pipes, relative to pipe_base */
+	u_int64_t	sent;
+	u_int64_t	fails;
+};
+
+static u_int		 npipes = 10000, pipe_base = 20000, port_base = 30000;
+static u_int		 delay_ms = 10, bw_kbit = 0, qsize = 50, pktsize = 64;
+static u_int		 nthreads = 4, rate = 0, seconds = 5;
+static int		*socks;
+static struct sockaddr_in dst;
+static struct sender	 senders[MAXTHREADS];
+static volatile int	 stop, draining;
+static u_int64_t	*hist, received, late;
+static u_int64_t	 max_excess;
+static char		 token[64];
+static mach_timebase_info_data_t tb;
+
+static uint64_t
+to_us(uint64_t t)
+{
+	return (t * tb.numer / tb.denom / 1000);
+}
+
+static uint64_t
+from_us(uint64_t us)
+{
+	return (us * 1000 * tb.denom / tb.numer);
+}
+
+static void
+pipe_op(int s, int op, u_int nr)
+{
+	struct dn_pipe p;
+
+	memset(&p, 0, sizeof (p));
+	p.pipe_nr = nr;
+	if (op == IP_DUMMYNET_CONFIGURE) {
+		p.bandwidth = bw_kbit * 1000;
+		p.delay = delay_ms;
+		p.fs.qsize = qsize;
+	}
+	if (setsockopt(s, IPPROTO_IP, op, &p, sizeof (p)) < 0 &&
+	    op == IP_DUMMYNET_CONFIGURE)
+		err(1, "IP_DUMMYNET_CONFIGURE pipe %u", nr);
+}
+
+static void
+pipes(int op)
+{
+	u_int i;
+	int s;
+
+	if ((s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0)
+		err(1, "raw socket");
+	for (i = 0; i < npipes; i++)
+		pipe_op(s, op, pipe_base + i);
+	close(s);
+}
+
+static void
+pf_setup(void)
+{
+	char	 path[] = "/tmp/dummynet_bench.XXXXXX", cmd[256], line[256];
+	FILE	*f;
+	u_int	 i;
+	int	 fd;
+
+	if ((fd = mkstemp(path)) < 0 || (f = fdopen(fd, "w")) == NULL)
+		err(1, "%s", path);
+	for (i = 0; i < npipes; i++)
+		fprintf(f, "dummynet out proto udp from any port %u "
+		    "to any port %u pipe %u\n", port_base + i, RPORT,
+		    pipe_base + i);
+	fclose(f);
+
+	snprintf(cmd, sizeof (cmd), "pfctl -q -a %s -f %s", ANCHOR, path);
+	if (system(cmd) != 0)
+		errx(1, "%s failed", cmd);
+	unlink(path);
+
+	/* take a reference on pf being enabled, dropped again on exit */
+	if ((f = popen("pfctl -E 2>&1", "r")) == NULL)
+		err(1, "pfctl -E");
+	while (fgets(line, sizeof (line), f) != NULL)
+		if (sscanf(line, "Token : %63s", token) == 1)
+			break;
+	pclose(f);
+	if (token[0] == '\0')
+		errx(1, "pfctl -E: no enable token");
+}
+
+static void
+cleanup(void)
+{
+	char cmd[256];
+
+	if (token[0] != '\0') {
+		snprintf(cmd, sizeof (cmd), "pfctl -q -X %s", token);
+		(void) system(cmd);
+	}
+	snprintf(cmd, sizeof (cmd), "pfctl -q -a %s -F all 2>/dev/null",
+	    ANCHOR);
+	(void) system(cmd);
+	pipes(IP_DUMMYNET_DEL);
+}
+
+static void
+sockets(void)
+{
+	struct sockaddr_in	sin;
+	struct rlimit		rl;
+	u_int			i;
+
+	rl.rlim_cur = rl.rlim_max = npipes + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+		err(1, "setrlimit(RLIMIT_NOFILE, %u)", npipes + 64);
+
+	if ((socks = calloc(npipes, sizeof (*socks))) == NULL)
+		err(1, "calloc");
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (i = 0; i < npipes; i++) {
+		if ((socks[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+			err(1, "socket");
+		sin.sin_port = htons(port_base + i);
+		if (bind(socks[i], (struct sockaddr *)&sin, sizeof (sin)) < 0)
+			err(1, "bind port %u", port_base + i);
+	}
+}
+
+static void *
+sender(void *arg)
+{
+	struct sender	*w = arg;
+	char		*buf;
+	struct payload	*pl;
+	uint64_t	 gap = 0, next;
+	u_int		 i;
+
+	if ((buf = calloc(1, pktsize)) == NULL)
+		err(1, "calloc");
+	pl = (struct payload *)(void *)buf;
+	/* each thread paces its share of the aggregate rate */
+	if (rate != 0)
+		gap = from_us(1000000ULL * nthreads / rate);
+	next = mach_absolute_time();
+
+	while (!stop) {
+		for (i = w->first; i < w->first + w->count && !stop; i++) {
+			if (gap != 0) {
+				while (mach_absolute_time() < next)
+					;
+				next += gap;
+			}
+			pl->pipe = pipe_base + i;
+			pl->sent = mach_absolute_time();
+			if (sendto(socks[i], buf, pktsize, 0,
+			    (struct sockaddr *)&dst, sizeof (dst)) < 0)
+				w->fails++;
+			else
+				w->sent++;
+		}
+	}
+	free(buf);
+	return (NULL);
+}
+
+static void *
+receiver(void *arg)
+{
+	int		 s = *(int *)arg;
+	char		 buf[2048];
+	struct payload	*pl = (struct payload *)(void *)buf;
+	uint64_t	 now, lat, excess, delay_us = delay_ms * 1000ULL;
+	ssize_t		 n;
+
+	while (!draining) {
+		if ((n = recv(s, buf, sizeof (buf), 0)) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			err(1, "recv");
+		}
+		if (n < (ssize_t)sizeof (*pl))
+			continue;
+		now = mach_absolute_time();
+		lat = to_us(now - pl->sent);
+		excess = lat > delay_us ? lat - delay_us : 0;
+		if (excess >= HIST_US)
+			late++;
+		else
+			hist[excess]++;
+		if (excess > max_excess)
+			max_excess = excess;
+		received++;
+	}
+	return (NULL);
+}
+
+static u_int64_t
+percentile(double pct)
+{
+	u_int64_t want, seen = 0;
+	u_int i;
+
+	want = (u_int64_t)(received * pct / 100.0);
+	for (i = 0; i < HIST_US; i++) {
+		seen += hist[i];
+		if (seen > want)
+			return (i);
+	}
+	return (HIST_US);
+}
+
+static void
+sigexit(int sig)
+{
+	cleanup();
+	_exit(128 + sig);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in	 sin;
+	struct timeval		 tv = { 0, 100000 };
+	pthread_t		 rthr;
+	u_int64_t		 sent = 0, fails = 0;
+	uint64_t		 start, end;
+	double			 secs;
+	u_int			 i, per;
+	int			 ch, rs, bufsize = 4 * 1024 * 1024;
+
+	while ((ch = getopt(argc, argv, "n:b:p:d:B:q:s:T:r:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			npipes = atoi(optarg);
+			break;
+		case 'b':
+			pipe_base = atoi(optarg);
+			break;
+		case 'p':
+			port_base = atoi(optarg);
+			break;
+		case 'd':
+			delay_ms = atoi(optarg);
+			break;
+		case 'B':
+			bw_kbit = atoi(optarg);
+			break;
+		case 'q':
+			qsize = atoi(optarg);
+			break;
+		case 's':
+			pktsize = atoi(optarg);
+			break;
+		case 'T':
+			nthreads = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n pipes] [-b first pipe] "
+			    "[-p first port] [-d delay ms] [-B bandwidth kbit/s] "
+			    "[-q qsize] [-s size] [-T threads] [-r packets/s] "
+			    "[-t seconds]\n", argv[0]);
+			return (1);
+		}
+	}
+	if (npipes < 1 || pipe_base < 1 || pipe_base + npipes > 65536 ||
+	    port_base < 1 || port_base + npipes > 65536)
+		errx(1, "pipes %u-%u or ports %u-%u out of range", pipe_base,
+		    pipe_base + npipes - 1, port_base, port_base + npipes - 1);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MAXTHREADS)
+		nthreads = MAXTHREADS;
+	if (nthreads > npipes)
+		nthreads = npipes;
+	if (pktsize < sizeof (struct payload))
+		pktsize = sizeof (struct payload);
+	if (pktsize > 1472)
+		pktsize = 1472;
+
+	mach_timebase_info(&tb);
+	if ((hist = calloc(HIST_US, sizeof (*hist))) == NULL)
+		err(1, "calloc");
+
+	memset(&sin, 0, sizeof (sin));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(RPORT);
+	dst = sin;
+	if ((rs = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		err(1, "socket");
+	if (bind(rs, (struct sockaddr *)&sin, sizeof (sin)) < 0)
+		err(1, "bind port %u", RPORT);
+	(void) setsockopt(rs, SOL_SOCKET, SO_RCVBUF, &bufsize,
+	    sizeof (bufsize));
+	if (setsockopt(rs, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0)
+		err(1, "SO_RCVTIMEO");
+	sockets();
+
+	signal(SIGINT, sigexit);
+	signal(SIGTERM, sigexit);
+	start = mach_absolute_time();
+	pipes(IP_DUMMYNET_CONFIGURE);
+	end = mach_absolute_time();
+	printf("configured %u pipes in %.1f ms\n", npipes,
+	    to_us(end - start) / 1000.0);
+	pf_setup();
+
+	if (pthread_create(&rthr, NULL, receiver, &rs) != 0)
+		errx(1, "pthread_create");
+	per = npipes / nthreads;
+	start = mach_absolute_time();
+	for (i = 0; i < nthreads; i++) {
+		senders[i].first = i * per;
+		senders[i].count = i == nthreads - 1 ? npipes - i * per : per;
+		if (pthread_create(&senders[i].thr, NULL, sender,
+		    &senders[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(senders[i].thr, NULL);
+		sent += senders[i].sent;
+		fails += senders[i].fails;
+	}
+	end = mach_absolute_time();
+	/* let the delay lines empty before counting */
+	usleep((delay_ms + 100) * 1000);
+	draining = 1;
+	pthread_join(rthr, NULL);
+	secs = to_us(end - start) / 1e6;
+
+	cleanup();
+
+	printf("pipes %u  delay %u ms  bandwidth %u kbit/s  size %u  "
+	    "threads %u\n", npipes, delay_ms, bw_kbit, pktsize, nthreads);
+	printf("%10.0f pkts/s sent  %10.0f pkts/s received  "
+	    "(sent %llu received %llu send errors %llu)\n", sent / secs,
+	    received / secs, (unsigned long long)sent,
+	    (unsigned long long)received, (unsigned long long)fails);
+	printf("excess latency us: p50 %llu  p99 %llu  p99.9 %llu  max %llu"
+	    "  (over 1s: %llu)\n", (unsigned long long)percentile(50),
+	    (unsigned long long)percentile(99),
+	    (unsigned long long)percentile(99.9),
+	    (unsigned long long)max_excess, (unsigned long long)late);
+
+	return (0);
+}
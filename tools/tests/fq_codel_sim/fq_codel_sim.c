@@ -0,0 +1,699 @@
+/*
+ * Userspace model of the FQ-CoDel classq discipline.
+ *
+ * Simulates one bottleneck link fed by a few bulk TCP-like flows and a
+ * few sparse interactive flows, and reports the queueing delay each
+ * kind of flow sees behind a plain drop-tail FIFO (what a class without
+ * a queue algorithm does) and behind FQ-CoDel as classq_fq_codel.c
+ * implements it: per-flow queues served deficit round robin with a
+ * quantum of one MTU, new flows ahead of old ones, and CoDel run on the
+ * head of each flow as it is dequeued.
+ *
+ * Bulk flows are window based: a flow keeps cwnd packets outstanding,
+ * grows the window by one packet per round trip (per packet in slow
+ * start), and halves it at most once a round trip when one of its
+ * packets is dropped.  The whole round trip delay is on the return
+ * path, so a packet reaches the queue as soon as the window allows.
+ * Interactive flows send small packets at random intervals without
+ * any reaction to loss.
+ *
+ * Usage: fq_codel_sim [-b bulk] [-i interactive] [-r Mbit/s] [-R rtt_ms]
+ *        [-q qlimit] [-t seconds] [-T target_ms] [-I interval_ms]
+ *        [-s seed]
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define	NSEC_PER_MSEC	1000000ULL
+#define	NSEC_PER_SEC	1000000000ULL
+
+#define	MTU		1514		/* bytes on the wire, with header */
+#define	SMALL		120		/* interactive packet size */
+#define	NBUCKETS	256		/* FQ_CODEL_FLOWS */
+#define	MAXFLOWS	256
+#define	QLIMIT		1000		/* packets, for either queue */
+
+/* simulation parameters */
+static u_int		 nbulk = 4, ninter = 4;
+static uint64_t		 rate = 20;		/* Mbit/s */
+static uint64_t		 rtt = 40 * NSEC_PER_MSEC;
+static u_int		 qlimit = QLIMIT;
+static uint64_t		 duration = 30 * NSEC_PER_SEC;
+static uint64_t		 target = 10 * NSEC_PER_MSEC;	/* IFQ_TARGET_DELAY */
+static uint64_t		 interval = 100 * NSEC_PER_MSEC; /* IFQ_UPDATE_INTERVAL */
+static uint64_t		 inter_gap = 20 * NSEC_PER_MSEC; /* mean */
+
+struct pkt {
+	struct pkt	*next;
+	u_int		 flow;
+	u_int		 len;
+	uint64_t	 enq;		/* time it was queued */
+};
+
+struct pktq {
+	struct pkt	*head;
+	struct pkt	**tail;
+	u_int		 qlen;
+	u_int		 bytes;
+};
+
+static void
+pq_init(struct pktq *q)
+{
+	q->head = NULL;
+	q->tail = &q->head;
+	q->qlen = q->bytes = 0;
+}
+
+static void
+pq_put(struct pktq *q, struct pkt *p)
+{
+	p->next = NULL;
+	*q->tail = p;
+	q->tail = &p->next;
+	q->qlen++;
+	q->bytes += p->len;
+}
+
+static struct pkt *
+pq_get(struct pktq *q)
+{
+	struct pkt *p;
+
+	if ((p = q->head) == NULL)
+		return (NULL);
+	if ((q->head = p->next) == NULL)
+		q->tail = &q->head;
+	q->qlen--;
+	q->bytes -= p->len;
+	return (p);
+}
+
+/*
+ * Sources
+ */
+struct flow {
+	int		 bulk;
+	double		 cwnd;
+	double		 ssthresh;
+	u_int		 inflight;
+	uint64_t	 last_cut;	/* last window reduction */
+	uint64_t	 delivered;	/* bytes through the link */
+	uint64_t	 drops;
+};
+
+static struct flow	 flows[MAXFLOWS];
+static u_int		 nflows;
+
+/* sojourn time samples, per kind of flow */
+struct samples {
+	uint64_t	*v;
+	size_t		 n, size;
+};
+
+static struct samples	 bulk_sj, inter_sj;
+
+static void
+sample_add(struct samples *s, uint64_t v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->v = realloc(s->v, s->size * sizeof (s->v[0]));
+		assert(s->v != NULL);
+	}
+	s->v[s->n++] = v;
+}
+
+static int
+u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static double
+pct(struct samples *s, double p)
+{
+	size_t i;
+
+	if (s->n == 0)
+		return (0);
+	i = (size_t)(p / 100.0 * (s->n - 1));
+	return ((double)s->v[i] / NSEC_PER_MSEC);
+}
+
+/*
+ * Events
+ */
+enum { EV_TXDONE, EV_ACK, EV_LOSS, EV_INTER };
+
+struct ev {
+	uint64_t	 t;
+	u_int		 type;
+	u_int		 flow;
+};
+
+static struct ev	*evs;
+static size_t		 nevs, evsize;
+
+static void
+ev_push(uint64_t t, u_int type, u_int flow)
+{
+	size_t i, parent;
+
+	if (nevs == evsize) {
+		evsize = evsize ? evsize * 2 : 1024;
+		evs = realloc(evs, evsize * sizeof (evs[0]));
+		assert(evs != NULL);
+	}
+	for (i = nevs++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (evs[parent].t <= t)
+			break;
+		evs[i] = evs[parent];
+	}
+	evs[i].t = t;
+	evs[i].type = type;
+	evs[i].flow = flow;
+}
+
+static struct ev
+ev_pop(void)
+{
+	struct ev top = evs[0], last = evs[--nevs];
+	size_t i = 0, c;
+
+	for (;;) {
+		c = 2 * i + 1;
+		if (c >= nevs)
+			break;
+		if (c + 1 < nevs && evs[c + 1].t < evs[c].t)
+			c++;
+		if (last.t <= evs[c].t)
+			break;
+		evs[i] = evs[c];
+		i = c;
+	}
+	if (nevs > 0)
+		evs[i] = last;
+	return (top);
+}
+
+/*
+ * A dropped packet; a bulk sender finds out a round trip later.
+ */
+static uint64_t	 ndrops;
+
+static void
+drop(struct pkt *p, uint64_t now)
+{
+	flows[p->flow].drops++;
+	ndrops++;
+	if (flows[p->flow].bulk)
+		ev_push(now + rtt, EV_LOSS, p->flow);
+	free(p);
+}
+
+/*
+ * Drop-tail FIFO
+ */
+static struct pktq	 fifo;
+
+static void
+fifo_enq(struct pkt *p, uint64_t now)
+{
+	if (fifo.qlen >= qlimit) {
+		drop(p, now);
+		return;
+	}
+	pq_put(&fifo, p);
+}
+
+static struct pkt *
+fifo_deq(uint64_t now)
+{
+	(void)now;
+	return (pq_get(&fifo));
+}
+
+/*
+ * FQ-CoDel, following classq_fq_codel.c
+ */
+#define	FQFF_NEW	0x01
+#define	FQFF_OLD	0x02
+#define	FQFF_DROPPING	0x04
+
+struct fqf {
+	struct pktq	 q;
+	struct fqf	*link;
+	int32_t		 deficit;
+	u_int		 flags;
+	uint32_t	 count, lastcount;
+	uint64_t	 first_above, drop_next;
+};
+
+struct fqlist {
+	struct fqf	*head, **tail;
+};
+
+static struct fqf	 buckets[NBUCKETS];
+static struct fqlist	 newl, oldl;
+static u_int		 fq_qlen;
+static int32_t		 quantum = MTU;
+
+static void
+fl_init(struct fqlist *l)
+{
+	l->head = NULL;
+	l->tail = &l->head;
+}
+
+static void
+fl_put(struct fqlist *l, struct fqf *f)
+{
+	f->link = NULL;
+	*l->tail = f;
+	l->tail = &f->link;
+}
+
+static void
+fl_remove_head(struct fqlist *l)
+{
+	if ((l->head = l->head->link) == NULL)
+		l->tail = &l->head;
+}
+
+static uint32_t
+isqrt(uint32_t x)
+{
+	uint32_t r = 0, b = (1U << 30);
+
+	while (b > x)
+		b >>= 2;
+	while (b != 0) {
+		if (x >= r + b) {
+			x -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+		b >>= 2;
+	}
+	return (r);
+}
+
+static uint64_t
+control_law(uint64_t t, uint32_t count)
+{
+	if (count == 0)
+		count = 1;
+	else if (count > 0xffff)
+		count = 0xffff;
+	return (t + ((interval << 8) / isqrt(count << 16)));
+}
+
+static void
+fq_drop_head(struct fqf *f, uint64_t now)
+{
+	fq_qlen--;
+	drop(pq_get(&f->q), now);
+}
+
+static void
+fq_enq(struct pkt *p, uint64_t now)
+{
+	struct fqf *f = &buckets[(p->flow * 2654435761U) % NBUCKETS];
+	struct fqf *fat;
+	u_int i;
+
+	if (fq_qlen >= qlimit) {
+		/* make room by dropping from the head of the fattest flow */
+		fat = &buckets[0];
+		for (i = 1; i < NBUCKETS; i++) {
+			if (buckets[i].q.bytes > fat->q.bytes)
+				fat = &buckets[i];
+		}
+		if (fat == f) {
+			drop(p, now);
+			return;
+		}
+		fq_drop_head(fat, now);
+	}
+
+	pq_put(&f->q, p);
+	fq_qlen++;
+	if (!(f->flags & (FQFF_NEW | FQFF_OLD))) {
+		f->flags |= FQFF_NEW;
+		f->deficit = quantum;
+		fl_put(&newl, f);
+	}
+}
+
+static int
+should_drop(struct fqf *f, uint64_t now)
+{
+	uint64_t sojourn = now - f->q.head->enq;
+
+	if (sojourn < target || f->q.bytes <= (u_int)quantum ||
+	    fq_qlen <= 1) {
+		f->first_above = 0;
+		return (0);
+	}
+	if (f->first_above == 0) {
+		f->first_above = now + interval;
+		return (0);
+	}
+	return (now >= f->first_above);
+}
+
+/* returns non-zero if the flow still has a packet at its head */
+static int
+flow_codel(struct fqf *f, uint64_t now)
+{
+	uint32_t delta;
+	int ok;
+
+	if (f->q.head == NULL) {
+		f->flags &= ~FQFF_DROPPING;
+		return (0);
+	}
+
+	ok = should_drop(f, now);
+	if (f->flags & FQFF_DROPPING) {
+		if (!ok) {
+			f->flags &= ~FQFF_DROPPING;
+			return (1);
+		}
+		while (now >= f->drop_next && (f->flags & FQFF_DROPPING)) {
+			f->count++;
+			fq_drop_head(f, now);
+			if (!should_drop(f, now))
+				f->flags &= ~FQFF_DROPPING;
+			else
+				f->drop_next = control_law(f->drop_next,
+				    f->count);
+		}
+	} else if (ok) {
+		fq_drop_head(f, now);
+		f->flags |= FQFF_DROPPING;
+		delta = f->count - f->lastcount;
+		if (delta > 1 &&
+		    (int64_t)(now - f->drop_next) < (int64_t)(interval << 4))
+			f->count = delta;
+		else
+			f->count = 1;
+		f->lastcount = f->count;
+		f->drop_next = control_law(now, f->count);
+	}
+	return (f->q.head != NULL);
+}
+
+static struct pkt *
+fq_deq(uint64_t now)
+{
+	struct fqlist *l;
+	struct fqf *f;
+	struct pkt *p;
+
+	for (;;) {
+		l = &newl;
+		if ((f = l->head) == NULL) {
+			l = &oldl;
+			if ((f = l->head) == NULL)
+				return (NULL);
+		}
+		if (f->deficit <= 0) {
+			f->deficit += quantum;
+			fl_remove_head(l);
+			f->flags = (f->flags & ~FQFF_NEW) | FQFF_OLD;
+			fl_put(&oldl, f);
+			continue;
+		}
+		if (flow_codel(f, now))
+			break;
+		fl_remove_head(l);
+		if (l == &newl && oldl.head != NULL) {
+			f->flags = (f->flags & ~FQFF_NEW) | FQFF_OLD;
+			fl_put(&oldl, f);
+		} else {
+			f->flags &= ~(FQFF_NEW | FQFF_OLD);
+		}
+	}
+	p = pq_get(&f->q);
+	fq_qlen--;
+	f->deficit -= p->len;
+	return (p);
+}
+
+/*
+ * The simulation
+ */
+static const struct disc {
+	const char	*name;
+	void		(*enq)(struct pkt *, uint64_t);
+	struct pkt	*(*deq)(uint64_t);
+} discs[] = {
+	{ "droptail", fifo_enq, fifo_deq },
+	{ "fq_codel", fq_enq, fq_deq },
+};
+
+static const struct disc *disc;
+static struct pkt	*on_wire;
+
+static uint64_t
+txtime(u_int len)
+{
+	return ((uint64_t)len * 8 * 1000 / rate);	/* rate in Mbit/s */
+}
+
+static void
+link_kick(uint64_t now)
+{
+	struct pkt *p;
+
+	if (on_wire != NULL || (p = disc->deq(now)) == NULL)
+		return;
+	sample_add(flows[p->flow].bulk ? &bulk_sj : &inter_sj, now - p->enq);
+	on_wire = p;
+	ev_push(now + txtime(p->len), EV_TXDONE, p->flow);
+}
+
+static void
+send_pkt(u_int i, u_int len, uint64_t now)
+{
+	struct pkt *p = malloc(sizeof (*p));
+
+	assert(p != NULL);
+	p->flow = i;
+	p->len = len;
+	p->enq = now;
+	disc->enq(p, now);
+}
+
+static void
+bulk_send(u_int i, uint64_t now)
+{
+	struct flow *f = &flows[i];
+
+	while (f->inflight < (u_int)f->cwnd) {
+		f->inflight++;
+		send_pkt(i, MTU, now);
+	}
+}
+
+static void
+run(void)
+{
+	struct ev e;
+	struct flow *f;
+	u_int i;
+
+	for (i = 0; i < nflows; i++) {
+		if (flows[i].bulk)
+			bulk_send(i, 0);
+		else
+			ev_push(random() % inter_gap, EV_INTER, i);
+	}
+	link_kick(0);
+
+	while (nevs > 0) {
+		e = ev_pop();
+		if (e.t > duration)
+			break;
+		f = &flows[e.flow];
+
+		switch (e.type) {
+		case EV_TXDONE:
+			f->delivered += on_wire->len;
+			free(on_wire);
+			on_wire = NULL;
+			if (f->bulk)
+				ev_push(e.t + rtt, EV_ACK, e.flow);
+			break;
+
+		case EV_ACK:
+			f->inflight--;
+			if (f->cwnd < f->ssthresh)
+				f->cwnd += 1;
+			else
+				f->cwnd += 1 / f->cwnd;
+			bulk_send(e.flow, e.t);
+			break;
+
+		case EV_LOSS:
+			f->inflight--;
+			if (e.t - f->last_cut > rtt + txtime(MTU) * f->cwnd) {
+				f->cwnd /= 2;
+				if (f->cwnd < 2)
+					f->cwnd = 2;
+				f->ssthresh = f->cwnd;
+				f->last_cut = e.t;
+			}
+			bulk_send(e.flow, e.t);
+			break;
+
+		case EV_INTER:
+			send_pkt(e.flow, SMALL, e.t);
+			/* uniform over [0, 2 * mean) */
+			ev_push(e.t + 1 + random() % (2 * inter_gap),
+			    EV_INTER, e.flow);
+			break;
+		}
+		link_kick(e.t);
+	}
+}
+
+static void
+reset(void)
+{
+	struct pkt *p;
+	u_int i;
+
+	while ((p = pq_get(&fifo)) != NULL)
+		free(p);
+	for (i = 0; i < NBUCKETS; i++) {
+		while ((p = pq_get(&buckets[i].q)) != NULL)
+			free(p);
+	}
+	free(on_wire);
+	on_wire = NULL;
+
+	pq_init(&fifo);
+	memset(buckets, 0, sizeof (buckets));
+	for (i = 0; i < NBUCKETS; i++)
+		pq_init(&buckets[i].q);
+	fl_init(&newl);
+	fl_init(&oldl);
+	fq_qlen = 0;
+
+	nevs = 0;
+	ndrops = 0;
+	bulk_sj.n = inter_sj.n = 0;
+
+	memset(flows, 0, sizeof (flows));
+	nflows = nbulk + ninter;
+	for (i = 0; i < nflows; i++) {
+		flows[i].bulk = (i < nbulk);
+		flows[i].cwnd = 2;
+		flows[i].ssthresh = 1e9;
+	}
+}
+
+static void
+report(void)
+{
+	uint64_t bytes = 0;
+	u_int i;
+
+	for (i = 0; i < nbulk; i++)
+		bytes += flows[i].delivered;
+
+	qsort(bulk_sj.v, bulk_sj.n, sizeof (uint64_t), u64_cmp);
+	qsort(inter_sj.v, inter_sj.n, sizeof (uint64_t), u64_cmp);
+
+	printf("%-9s %7.2f %7.2f %7.2f %7.2f   %7.2f %7.2f %7.2f   %7.2f %8llu\n",
+	    disc->name,
+	    pct(&inter_sj, 50), pct(&inter_sj, 95), pct(&inter_sj, 99),
+	    pct(&inter_sj, 100),
+	    pct(&bulk_sj, 50), pct(&bulk_sj, 95), pct(&bulk_sj, 99),
+	    (double)bytes * 8 / ((double)duration / NSEC_PER_SEC) / 1e6,
+	    (unsigned long long)ndrops);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int seed = 1;
+	u_int k;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:i:r:R:q:t:T:I:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			nbulk = atoi(optarg);
+			break;
+		case 'i':
+			ninter = atoi(optarg);
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'R':
+			rtt = atoi(optarg) * NSEC_PER_MSEC;
+			break;
+		case 'q':
+			qlimit = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg) * NSEC_PER_SEC;
+			break;
+		case 'T':
+			target = atoi(optarg) * NSEC_PER_MSEC;
+			break;
+		case 'I':
+			interval = atoi(optarg) * NSEC_PER_MSEC;
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b bulk] [-i interactive] "
+			    "[-r Mbit/s] [-R rtt_ms] [-q qlimit] [-t seconds] "
+			    "[-T target_ms] [-I interval_ms] [-s seed]\n",
+			    argv[0]);
+			return (1);
+		}
+	}
+	if (nbulk + ninter > MAXFLOWS || rate == 0 || qlimit == 0) {
+		fprintf(stderr, "%s: bad parameters\n", argv[0]);
+		return (1);
+	}
+
+	printf("%u bulk + %u interactive flows, %llu Mbit/s, rtt %llu ms, "
+	    "qlimit %u, target %llu ms, interval %llu ms\n", nbulk, ninter,
+	    (unsigned long long)rate,
+	    (unsigned long long)(rtt / NSEC_PER_MSEC), qlimit,
+	    (unsigned long long)(target / NSEC_PER_MSEC),
+	    (unsigned long long)(interval / NSEC_PER_MSEC));
+	printf("%-9s %31s   %23s   %7s %8s\n", "",
+	    "interactive sojourn (ms)", "bulk sojourn (ms)", "bulk", "");
+	printf("%-9s %7s %7s %7s %7s   %7s %7s %7s   %7s %8s\n", "queue",
+	    "p50", "p95", "p99", "max", "p50", "p95", "p99", "Mbit/s",
+	    "drops");
+
+	for (k = 0; k < sizeof (discs) / sizeof (discs[0]); k++) {
+		srandom(seed);
+		disc = &discs[k];
+		reset();
+		run();
+		report();
+	}
+	return (0);
+}
@@ -0,0 +1,549 @@
+/*
+ * Allocation latency and file fragmentation on a fragmented HFS+ volume.
+ *
+ * Creates a scratch journaled HFS+ disk image and fragments its free
+ * space by filling it with files of random sizes and deleting a random
+ * half of them.  An image given with -i is used as it is, on the
+ * assumption that it is already in the state of interest; it is only
+ * ever attached through a shadow file, so it is not modified.
+ *
+ * An allocation trace is then replayed against the volume: files are
+ * created with a contiguous F_PREALLOCATE, grown with non-contiguous
+ * ones and deleted.  The trace is generated from the seed, sized to fill
+ * about half of the free space, or read from a file with -r; -w saves
+ * the generated trace.  Trace lines are "c id bytes" (create), "x id
+ * bytes" (extend) and "d id" (delete).
+ *
+ * The trace is replayed once with vfs.generic.hfs.extent_tree off and
+ * once with it on, each time on a fresh attach of the image through a
+ * new shadow file, so both runs start from the same free space and the
+ * volume is mounted (and its bitmap scanned) with the setting in effect.
+ * Each run reports F_PREALLOCATE latency percentiles, the number of
+ * allocations that failed, and how many extents the files that are left
+ * at the end of the trace are in, as F_LOG2PHYS_EXT sees them.  The
+ * files are F_FULLFSYNCed before they are mapped, which zero fills them,
+ * so that takes a while for large traces.  Must be run as root.
+ *
+ * Usage: hfs_frag_bench [-i image] [-m image_mb] [-n ops] [-f files]
+ *        [-s seed] [-r trace] [-w trace]
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#define	TREE_SYSCTL	"vfs.generic.hfs.extent_tree"
+#define	MAXFILES	65536		/* file ids in a trace */
+#define	MB		(1024 * 1024)
+
+struct op {
+	char		 type;		/* 'c', 'x' or 'd' */
+	u_int		 id;
+	off_t		 bytes;
+};
+
+static u_int		 image_mb = 1024, nops = 20000, nfiles = 2000;
+static unsigned int	 seed = 1;
+static struct op	*ops;
+static u_int		 nops_trace, ops_size;
+static char		 tmpdir[MAXPATHLEN], image[MAXPATHLEN];
+static char		 shadow[MAXPATHLEN], mnt[MAXPATHLEN];
+static int		 user_image;
+static mach_timebase_info_data_t tb;
+
+static double
+to_usecs(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e3;
+}
+
+static void
+sh(const char *fmt, ...)
+{
+	char	 cmd[4 * MAXPATHLEN];
+	va_list	 ap;
+	int	 rv;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, sizeof (cmd), fmt, ap);
+	va_end(ap);
+
+	if ((rv = system(cmd)) != 0)
+		errx(1, "%s: exit status %d", cmd, rv);
+}
+
+static void
+set_sysctl(const char *name, int val)
+{
+	if (sysctlbyname(name, NULL, NULL, &val, sizeof (val)) < 0)
+		err(1, "%s", name);
+}
+
+static void
+attach(int use_shadow)
+{
+	if (use_shadow) {
+		(void) unlink(shadow);
+		sh("hdiutil attach -quiet -nobrowse -noverify -noautofsck "
+		    "-owners on -mountpoint '%s' -shadow '%s' '%s'",
+		    mnt, shadow, image);
+	} else {
+		sh("hdiutil attach -quiet -nobrowse -noverify -noautofsck "
+		    "-owners on -mountpoint '%s' '%s'", mnt, image);
+	}
+}
+
+static void
+detach(void)
+{
+	sh("hdiutil detach -quiet '%s'", mnt);
+}
+
+/*
+ * Allocate bytes more for fd past its physical EOF, contiguously if
+ * asked, and extend the file over the new space.  Returns 0 or the
+ * errno of the F_PREALLOCATE, and its latency in *t.
+ */
+static int
+prealloc(int fd, off_t bytes, int contig, uint64_t *t)
+{
+	fstore_t	 fst;
+	struct stat	 st;
+	uint64_t	 start;
+	int		 rv;
+
+	memset(&fst, 0, sizeof (fst));
+	fst.fst_flags = F_ALLOCATEALL | (contig ? F_ALLOCATECONTIG : 0);
+	fst.fst_posmode = F_PEOFPOSMODE;
+	fst.fst_offset = 0;
+	fst.fst_length = bytes;
+
+	start = mach_absolute_time();
+	rv = fcntl(fd, F_PREALLOCATE, &fst);
+	*t = mach_absolute_time() - start;
+	if (rv < 0)
+		return (errno);
+
+	if (fstat(fd, &st) < 0)
+		err(1, "fstat");
+	if (ftruncate(fd, st.st_size + fst.fst_bytesalloc) < 0)
+		err(1, "ftruncate");
+	return (0);
+}
+
+/*
+ * Fill the volume to 90% with files of 4KB to 2MB and delete about half
+ * of them, leaving free extents of all sizes behind.
+ */
+static void
+fragment(void)
+{
+	char		 path[MAXPATHLEN];
+	struct statfs	 sfs;
+	uint64_t	 t;
+	off_t		 size;
+	u_int		 i, n, deleted = 0;
+	int		 fd;
+
+	snprintf(path, sizeof (path), "%s/frag", mnt);
+	if (mkdir(path, 0755) < 0)
+		err(1, "%s", path);
+
+	for (n = 0; ; n++) {
+		if (statfs(mnt, &sfs) < 0)
+			err(1, "statfs");
+		if (sfs.f_bavail < sfs.f_blocks / 10)
+			break;
+		size = ((off_t)4096 << (rand_r(&seed) % 9)) +
+		    (off_t)(rand_r(&seed) % 16) * 4096;
+		snprintf(path, sizeof (path), "%s/frag/%u", mnt, n);
+		if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+			err(1, "%s", path);
+		if (prealloc(fd, size, 0, &t) != 0) {
+			close(fd);
+			(void) unlink(path);
+			break;
+		}
+		close(fd);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (rand_r(&seed) & 1)
+			continue;
+		snprintf(path, sizeof (path), "%s/frag/%u", mnt, i);
+		if (unlink(path) < 0)
+			err(1, "%s", path);
+		deleted++;
+	}
+	printf("fragmented: %u files written, %u deleted\n", n, deleted);
+}
+
+static void
+add_op(char type, u_int id, off_t bytes)
+{
+	if (nops_trace == ops_size) {
+		ops_size = ops_size ? ops_size * 2 : 1024;
+		if ((ops = realloc(ops, ops_size * sizeof (*ops))) == NULL)
+			err(1, "realloc");
+	}
+	ops[nops_trace].type = type;
+	ops[nops_trace].id = id;
+	ops[nops_trace].bytes = bytes;
+	nops_trace++;
+}
+
+/* Mostly small files, some large ones and the odd very large one */
+static off_t
+random_size(void)
+{
+	u_int	 r = rand_r(&seed) % 100;
+
+	if (r < 70)
+		return ((off_t)16384 << (rand_r(&seed) % 5));
+	if (r < 95)
+		return ((off_t)MB << (rand_r(&seed) % 5));
+	return ((off_t)32 * MB << (rand_r(&seed) % 3));
+}
+
+static void
+gen_trace(off_t budget)
+{
+	off_t	*live, total = 0, bytes;
+	u_int	 i, id;
+
+	if ((live = calloc(nfiles, sizeof (*live))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < nops; i++) {
+		id = rand_r(&seed) % nfiles;
+		if (live[id] == 0) {
+			bytes = random_size();
+			if (total + bytes > budget)
+				continue;
+			add_op('c', id, bytes);
+		} else if (rand_r(&seed) % 10 < 6 &&
+		    total + (bytes = random_size() / 4) <= budget) {
+			add_op('x', id, bytes);
+		} else {
+			add_op('d', id, 0);
+			total -= live[id];
+			live[id] = 0;
+			continue;
+		}
+		live[id] += bytes;
+		total += bytes;
+	}
+	free(live);
+}
+
+static void
+read_trace(const char *path)
+{
+	char		 line[128], type;
+	long long	 bytes;
+	u_int		 id;
+	FILE		*f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while (fgets(line, sizeof (line), f) != NULL) {
+		bytes = 0;
+		if (sscanf(line, " %c %u %lld", &type, &id, &bytes) < 2)
+			continue;
+		if (type != 'c' && type != 'x' && type != 'd')
+			errx(1, "%s: bad line: %s", path, line);
+		if (id >= MAXFILES)
+			errx(1, "%s: file id %u too large", path, id);
+		if (type != 'd' && bytes <= 0)
+			errx(1, "%s: bad size: %s", path, line);
+		add_op(type, id, bytes);
+	}
+	fclose(f);
+}
+
+static void
+write_trace(const char *path)
+{
+	FILE	*f;
+	u_int	 i;
+
+	if ((f = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	for (i = 0; i < nops_trace; i++) {
+		if (ops[i].type == 'd')
+			fprintf(f, "d %u\n", ops[i].id);
+		else
+			fprintf(f, "%c %u %lld\n", ops[i].type, ops[i].id,
+			    (long long)ops[i].bytes);
+	}
+	if (fclose(f) != 0)
+		err(1, "%s", path);
+}
+
+/* Number of physically discontiguous runs backing the file */
+static u_int
+count_extents(const char *path)
+{
+	struct log2phys	 l2p;
+	struct stat	 st;
+	off_t		 off, next = -1;
+	u_int		 n = 0;
+	int		 fd;
+
+	if ((fd = open(path, O_RDWR)) < 0)
+		err(1, "%s", path);
+	/* zero fill the preallocated space, or it maps to nothing */
+	if (fcntl(fd, F_FULLFSYNC) < 0)
+		err(1, "F_FULLFSYNC %s", path);
+	if (fstat(fd, &st) < 0)
+		err(1, "fstat");
+
+	for (off = 0; off < st.st_size; off += l2p.l2p_contigbytes) {
+		memset(&l2p, 0, sizeof (l2p));
+		l2p.l2p_contigbytes = st.st_size - off;
+		l2p.l2p_devoffset = off;
+		if (fcntl(fd, F_LOG2PHYS_EXT, &l2p) < 0)
+			err(1, "F_LOG2PHYS_EXT %s", path);
+		if (l2p.l2p_contigbytes <= 0)
+			break;
+		if (l2p.l2p_devoffset != next)
+			n++;
+		next = l2p.l2p_devoffset + l2p.l2p_contigbytes;
+	}
+	close(fd);
+	return (n);
+}
+
+static int
+cmp_time(const void *a, const void *b)
+{
+	uint64_t	 x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void
+report(const char *what, uint64_t *lat, u_int n, u_int fails)
+{
+	if (n == 0)
+		return;
+	qsort(lat, n, sizeof (*lat), cmp_time);
+	printf("  %-6s %7u  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %9.1f us"
+	    "  failed %u\n", what, n, to_usecs(lat[n / 2]),
+	    to_usecs(lat[n * 9 / 10]), to_usecs(lat[n * 99 / 100]),
+	    to_usecs(lat[n - 1]), fails);
+}
+
+static void
+run(int tree)
+{
+	char		 path[MAXPATHLEN];
+	uint64_t	*clat, *xlat, t;
+	u_int		 nc = 0, nx = 0, cfails = 0, xfails = 0;
+	u_int		 i, files = 0, single = 0, extents = 0, most = 0, n;
+	char		*live;
+	struct op	*op;
+	int		 fd;
+
+	if ((live = calloc(MAXFILES, 1)) == NULL ||
+	    (clat = calloc(nops_trace, sizeof (*clat))) == NULL ||
+	    (xlat = calloc(nops_trace, sizeof (*xlat))) == NULL)
+		err(1, "calloc");
+
+	set_sysctl(TREE_SYSCTL, tree);
+	attach(1);
+
+	/*
+	 * The bitmap scan that starts at mount holds the bitmap lock, so
+	 * the first allocation waits for it; keep that out of the numbers.
+	 */
+	snprintf(path, sizeof (path), "%s/warmup", mnt);
+	if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+		err(1, "%s", path);
+	(void) prealloc(fd, 4096, 1, &t);
+	close(fd);
+	(void) unlink(path);
+
+	snprintf(path, sizeof (path), "%s/replay", mnt);
+	if (mkdir(path, 0755) < 0)
+		err(1, "%s", path);
+
+	for (i = 0; i < nops_trace; i++) {
+		op = &ops[i];
+		snprintf(path, sizeof (path), "%s/replay/%u", mnt, op->id);
+		switch (op->type) {
+		case 'c':
+			if (live[op->id])
+				break;
+			if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR,
+			    0644)) < 0)
+				err(1, "%s", path);
+			if (prealloc(fd, op->bytes, 1, &clat[nc++]) == 0) {
+				live[op->id] = 1;
+				close(fd);
+			} else {
+				cfails++;
+				close(fd);
+				(void) unlink(path);
+			}
+			break;
+		case 'x':
+			if (!live[op->id])
+				break;
+			if ((fd = open(path, O_RDWR)) < 0)
+				err(1, "%s", path);
+			if (prealloc(fd, op->bytes, 0, &xlat[nx++]) != 0)
+				xfails++;
+			close(fd);
+			break;
+		case 'd':
+			if (!live[op->id])
+				break;
+			if (unlink(path) < 0)
+				err(1, "%s", path);
+			live[op->id] = 0;
+			break;
+		}
+	}
+
+	for (i = 0; i < MAXFILES; i++) {
+		if (!live[i])
+			continue;
+		snprintf(path, sizeof (path), "%s/replay/%u", mnt, i);
+		n = count_extents(path);
+		files++;
+		extents += n;
+		if (n <= 1)
+			single++;
+		if (n > most)
+			most = n;
+	}
+
+	printf("extent tree %s\n", tree ? "on" : "off");
+	report("create", clat, nc, cfails);
+	report("extend", xlat, nx, xfails);
+	printf("  %u files in %u extents, %.2f per file, at most %u, "
+	    "%.1f%% in one\n", files, extents,
+	    files ? (double)extents / files : 0.0, most,
+	    files ? 100.0 * single / files : 0.0);
+
+	detach();
+	free(live);
+	free(clat);
+	free(xlat);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-i image] [-m image_mb] [-n ops] "
+	    "[-f files] [-s seed] [-r trace] [-w trace]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*rtrace = NULL, *wtrace = NULL;
+	struct statfs	 sfs;
+	size_t		 len;
+	int		 ch, otree;
+
+	while ((ch = getopt(argc, argv, "i:m:n:f:s:r:w:")) != -1) {
+		switch (ch) {
+		case 'i':
+			if (realpath(optarg, image) == NULL)
+				err(1, "%s", optarg);
+			user_image = 1;
+			break;
+		case 'm':
+			image_mb = atoi(optarg);
+			if (image_mb < 64)
+				image_mb = 64;
+			break;
+		case 'n':
+			nops = atoi(optarg);
+			break;
+		case 'f':
+			nfiles = atoi(optarg);
+			if (nfiles < 1)
+				nfiles = 1;
+			if (nfiles > MAXFILES)
+				nfiles = MAXFILES;
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 'r':
+			rtrace = optarg;
+			break;
+		case 'w':
+			wtrace = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	mach_timebase_info(&tb);
+
+	len = sizeof (otree);
+	if (sysctlbyname(TREE_SYSCTL, &otree, &len, NULL, 0) < 0)
+		err(1, TREE_SYSCTL);
+
+	strlcpy(tmpdir, "/tmp/hfs_frag_bench.XXXXXX", sizeof (tmpdir));
+	if (mkdtemp(tmpdir) == NULL)
+		err(1, "mkdtemp");
+	snprintf(mnt, sizeof (mnt), "%s/mnt", tmpdir);
+	snprintf(shadow, sizeof (shadow), "%s/shadow", tmpdir);
+	if (mkdir(mnt, 0755) < 0)
+		err(1, "%s", mnt);
+
+	if (!user_image) {
+		snprintf(image, sizeof (image), "%s/image.dmg", tmpdir);
+		sh("hdiutil create -quiet -size %um -fs HFS+J "
+		    "-volname hfs_frag_bench -layout NONE '%s'", image_mb,
+		    image);
+		attach(0);
+		fragment();
+	} else {
+		attach(1);
+	}
+	if (statfs(mnt, &sfs) < 0)
+		err(1, "statfs");
+	detach();
+
+	if (rtrace != NULL) {
+		read_trace(rtrace);
+	} else {
+		gen_trace((off_t)sfs.f_bavail * sfs.f_bsize / 2);
+		if (wtrace != NULL)
+			write_trace(wtrace);
+	}
+	printf("image %s, %llu MB free, %u trace operations\n", image,
+	    (unsigned long long)sfs.f_bavail * sfs.f_bsize / MB, nops_trace);
+
+	run(0);
+	run(1);
+
+	set_sysctl(TREE_SYSCTL, otree);
+	(void) unlink(shadow);
+	if (!user_image)
+		(void) unlink(image);
+	(void) rmdir(mnt);
+	(void) rmdir(tmpdir);
+
+	return (0);
+}
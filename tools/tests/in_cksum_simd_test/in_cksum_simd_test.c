@@ -0,0 +1,436 @@
+/*
+ * Test and benchmark for the SSE2/AVX2 Internet checksum routines.
+ *
+ * Builds bsd/netinet/in_cksum_simd.c as it is and checks every vector
+ * routine the CPU supports against a plain RFC 1071 loop, over random
+ * buffers, lengths and source and destination alignments.  Like the
+ * kernel, the vector routines do the leading 64-byte blocks and the
+ * integer loop does the tail; the copy variants must also leave an
+ * exact copy behind without touching the bytes around it.
+ *
+ * It also checks UDP_SEGMENT with a payload summed by sosend(): the
+ * datagrams udp_segment() makes of a send may only carry that sum if
+ * the send was not split, and the uh_sum udp_output() finishes from
+ * it must match a checksum of the pseudo header, UDP header and
+ * payload computed in full.
+ *
+ * The benchmark then times, for each buffer size, the integer loop of
+ * in_cksumdata() against the vector sums, and a memcpy() followed by
+ * a sum against the fused copy and sum.
+ *
+ * Usage: in_cksum_simd_test [-n iterations] [-s seed]
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#include <netinet/in_cksum_simd.h>
+
+#define	MAXLEN		(64 * 1024)
+#define	SLACK		128		/* room for offsets and guard bytes */
+#define	GUARD		0xa5
+#define	UDP_MAXSEG	1472		/* payload of a 1500-byte datagram */
+#define	UDP_NSEGS	4		/* segments per send, at most */
+#define	UDP_HDRS	20		/* pseudo header and UDP header */
+
+static mach_timebase_info_data_t tb;
+
+static double
+to_ns(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom;
+}
+
+/* RFC 1071, 16-bit words in memory order, as b_sum16() returns it */
+static uint16_t
+ref_sum(const uint8_t *p, int len)
+{
+	uint32_t sum = 0;
+
+	for (; len > 1; p += 2, len -= 2)
+		sum += p[0] | (p[1] << 8);
+	if (len == 1)
+		sum += p[0];
+	while (sum >> 16)
+		sum = (sum >> 16) + (sum & 0xffff);
+	return (sum);
+}
+
+static uint16_t
+fold(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (sum);
+}
+
+/* the integer loop of the 64-bit in_cksumdata(), minus its alignment */
+static uint64_t
+int_sum(const uint8_t *data, int len)
+{
+	uint64_t partial = 0;
+	int i;
+
+	for (; len >= 64; data += 64, len -= 64) {
+		for (i = 0; i < 64; i += 4)
+			partial += *(const uint32_t *)(const void *)(data + i);
+	}
+	for (; len >= 4; data += 4, len -= 4)
+		partial += *(const uint32_t *)(const void *)data;
+	if (len >= 2) {
+		partial += *(const uint16_t *)(const void *)data;
+		data += 2;
+		len -= 2;
+	}
+	if (len)
+		partial += *data;
+	return (partial);
+}
+
+static const struct impl {
+	const char	*name;
+	uint64_t	(*sum)(const void *, int);
+	uint64_t	(*copy)(const void *, void *, int);
+	int		avx2;
+} impls[] = {
+	{ "sse2", in_cksum_sse2, in_cksum_copy_sse2, 0 },
+	{ "avx2", in_cksum_avx2, in_cksum_copy_avx2, 1 },
+};
+
+#define	NIMPLS	(sizeof (impls) / sizeof (impls[0]))
+
+static uint16_t
+vec_sum(const struct impl *im, const uint8_t *p, int len)
+{
+	int n = len & ~63;
+
+	return (fold(im->sum(p, len) + int_sum(p + n, len - n)));
+}
+
+static uint16_t
+vec_copy(const struct impl *im, const uint8_t *src, uint8_t *dst, int len)
+{
+	int n = len & ~63;
+
+	memcpy(dst + n, src + n, len - n);
+	return (fold(im->copy(src, dst, len) + int_sum(src + n, len - n)));
+}
+
+static int
+has_avx2(void)
+{
+	size_t len;
+	int v = 0;
+
+	len = sizeof (v);
+	if (sysctlbyname("hw.optional.avx2_0", &v, &len, NULL, 0) != 0)
+		return (0);
+	return (v);
+}
+
+static int
+rand_len(void)
+{
+	/* favour short spans and the 64-byte block boundaries */
+	switch (random() % 4) {
+	case 0:
+		return (random() % 512);
+	case 1:
+		return ((random() % (MAXLEN / 64)) * 64 + (random() % 3) - 1);
+	default:
+		return (random() % MAXLEN);
+	}
+}
+
+static u_int64_t
+verify(const struct impl *im, uint8_t *src, uint8_t *dst, u_int iters)
+{
+	u_int64_t bad = 0;
+	uint16_t want, got;
+	u_int i;
+	int len, soff, doff, j;
+
+	for (i = 0; i < iters; i++) {
+		len = rand_len();
+		if (len < 0)
+			len = 0;
+		soff = random() % 64;
+		doff = random() % 64;
+		for (j = 0; j < len; j++)
+			src[soff + j] = random();
+		want = ref_sum(src + soff, len);
+
+		got = vec_sum(im, src + soff, len);
+		if (got != want && bad++ < 10)
+			fprintf(stderr, "%s sum: len %d offset %d: "
+			    "got 0x%04x want 0x%04x\n", im->name, len, soff,
+			    got, want);
+
+		memset(dst, GUARD, MAXLEN + SLACK);
+		got = vec_copy(im, src + soff, dst + doff, len);
+		if (got != want && bad++ < 10)
+			fprintf(stderr, "%s copy: len %d offsets %d/%d: "
+			    "got 0x%04x want 0x%04x\n", im->name, len, soff,
+			    doff, got, want);
+		if (memcmp(dst + doff, src + soff, len) != 0 &&
+		    bad++ < 10)
+			fprintf(stderr, "%s copy: len %d offsets %d/%d: "
+			    "data differs\n", im->name, len, soff, doff);
+		for (j = 0; j < MAXLEN + SLACK; j++) {
+			if (j == doff)
+				j += len;
+			if (j < MAXLEN + SLACK && dst[j] != GUARD) {
+				if (bad++ < 10)
+					fprintf(stderr, "%s copy: len %d "
+					    "offsets %d/%d: wrote outside "
+					    "at %d\n", im->name, len, soff,
+					    doff, j);
+				break;
+			}
+		}
+	}
+	return (bad);
+}
+
+struct udp_seg {
+	const uint8_t	*data;
+	int		 len;
+	int32_t		 presum;	/* -1 if the datagram has none */
+};
+
+/*
+ * udp_segment() as far as the payload sum goes: it covers the whole
+ * send, so only a send that is not split may keep it.
+ */
+static int
+udp_segment(const uint8_t *p, int len, int segsz, int32_t presum,
+    struct udp_seg *segs)
+{
+	int n = 0;
+
+	if (len > segsz)
+		presum = -1;
+	do {
+		segs[n].data = p;
+		segs[n].len = MIN(len, segsz);
+		segs[n].presum = presum;
+		p += segs[n].len;
+		len -= segs[n].len;
+		n++;
+	} while (len > 0);
+	return (n);
+}
+
+/* uh_sum as udp_output() finishes it from the payload sum */
+static uint16_t
+udp_finish(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport,
+    int dlen, uint16_t presum)
+{
+	uint16_t ulen = htons(dlen + 8);
+	uint32_t sum;
+
+	sum = fold((uint64_t)src + dst + htons(dlen + 8 + IPPROTO_UDP));
+	sum += sport + dport + ulen + presum;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = ~sum & 0xffff;
+	return (sum == 0 ? 0xffff : sum);
+}
+
+/* uh_sum computed over the whole datagram, as a reference */
+static uint16_t
+udp_ref(uint8_t *buf, uint32_t src, uint32_t dst, uint16_t sport,
+    uint16_t dport, const uint8_t *data, int dlen)
+{
+	uint16_t ulen = htons(dlen + 8), sum;
+
+	memset(buf, 0, UDP_HDRS);
+	memcpy(buf, &src, 4);
+	memcpy(buf + 4, &dst, 4);
+	buf[9] = IPPROTO_UDP;
+	memcpy(buf + 10, &ulen, 2);
+	memcpy(buf + 12, &sport, 2);
+	memcpy(buf + 14, &dport, 2);
+	memcpy(buf + 16, &ulen, 2);
+	memcpy(buf + UDP_HDRS, data, dlen);
+	sum = ~ref_sum(buf, UDP_HDRS + dlen) & 0xffff;
+	return (sum == 0 ? 0xffff : sum);
+}
+
+static u_int64_t
+verify_segment(const struct impl *im, uint8_t *src, uint8_t *dst,
+    u_int iters)
+{
+	static uint8_t buf[UDP_HDRS + UDP_MAXSEG * UDP_NSEGS];
+	struct udp_seg segs[UDP_NSEGS];
+	u_int64_t bad = 0;
+	uint32_t saddr, daddr;
+	uint16_t sport, dport, want, got;
+	u_int i;
+	int len, segsz, n, k, j;
+
+	for (i = 0; i < iters; i++) {
+		segsz = 1 + random() % UDP_MAXSEG;
+		len = random() % (segsz * UDP_NSEGS + 1);
+		for (j = 0; j < len; j++)
+			src[j] = random();
+		saddr = random();
+		daddr = random();
+		sport = random();
+		dport = random();
+
+		/* sosend() sums the send as it copies it in */
+		n = udp_segment(dst, len, segsz,
+		    vec_copy(im, src, dst, len), segs);
+
+		for (k = 0; k < n; k++) {
+			if (segs[k].presum == -1)
+				continue;	/* IP sums it in full */
+			if (segs[k].presum != ref_sum(segs[k].data,
+			    segs[k].len) && bad++ < 10)
+				fprintf(stderr, "%s segment: len %d segsz %d: "
+				    "datagram %d carries the wrong sum\n",
+				    im->name, len, segsz, k);
+			want = udp_ref(buf, saddr, daddr, sport, dport,
+			    segs[k].data, segs[k].len);
+			got = udp_finish(saddr, daddr, sport, dport,
+			    segs[k].len, segs[k].presum);
+			if (got != want && bad++ < 10)
+				fprintf(stderr, "%s segment: len %d segsz %d: "
+				    "datagram %d got 0x%04x want 0x%04x\n",
+				    im->name, len, segsz, k, got, want);
+		}
+	}
+	return (bad);
+}
+
+static void
+bench(const struct impl **ims, u_int nims, uint8_t *src, uint8_t *dst)
+{
+	static const int sizes[] = { 256, 1500, 4096, 9000, 16384, 65536 };
+	volatile uint64_t sink = 0;
+	uint64_t start, t;
+	u_int i, k, r, reps;
+	int len;
+
+	printf("%8s %10s", "bytes", "integer");
+	for (k = 0; k < nims; k++)
+		printf(" %10s", ims[k]->name);
+	printf(" %10s", "memcpy+int");
+	for (k = 0; k < nims; k++)
+		printf("   copy+%4s", ims[k]->name);
+	printf("   (GB/s)\n");
+
+	for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+		len = sizes[i];
+		reps = (256 * 1024 * 1024) / len;
+
+		printf("%8d", len);
+		start = mach_absolute_time();
+		for (r = 0; r < reps; r++)
+			sink += int_sum(src, len);
+		t = mach_absolute_time() - start;
+		printf(" %10.2f", (double)len * reps / to_ns(t));
+
+		for (k = 0; k < nims; k++) {
+			start = mach_absolute_time();
+			for (r = 0; r < reps; r++)
+				sink += ims[k]->sum(src, len);
+			t = mach_absolute_time() - start;
+			printf(" %10.2f", (double)len * reps / to_ns(t));
+		}
+
+		start = mach_absolute_time();
+		for (r = 0; r < reps; r++) {
+			memcpy(dst, src, len);
+			sink += int_sum(dst, len);
+		}
+		t = mach_absolute_time() - start;
+		printf(" %10.2f", (double)len * reps / to_ns(t));
+
+		for (k = 0; k < nims; k++) {
+			start = mach_absolute_time();
+			for (r = 0; r < reps; r++)
+				sink += ims[k]->copy(src, dst, len);
+			t = mach_absolute_time() - start;
+			printf(" %10.2f", (double)len * reps / to_ns(t));
+		}
+		printf("\n");
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct impl	*ims[NIMPLS];
+	uint8_t			*src, *dst;
+	u_int64_t		 bad = 0;
+	u_int			 iters = 100000, nims = 0, k;
+	unsigned int		 seed = 1;
+	int			 ch, avx2;
+
+	while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n iterations] [-s seed]\n",
+			    argv[0]);
+			return (1);
+		}
+	}
+
+	mach_timebase_info(&tb);
+	srandom(seed);
+
+	src = malloc(MAXLEN + SLACK);
+	dst = malloc(MAXLEN + SLACK);
+	assert(src != NULL && dst != NULL);
+
+	avx2 = has_avx2();
+	for (k = 0; k < NIMPLS; k++) {
+		if (impls[k].avx2 && !avx2)
+			continue;
+		ims[nims++] = &impls[k];
+	}
+
+	for (k = 0; k < nims; k++) {
+		u_int64_t n = verify(ims[k], src, dst, iters);
+
+		printf("%s: %u random spans, %llu mismatches\n", ims[k]->name,
+		    iters, (unsigned long long)n);
+		bad += n;
+
+		n = verify_segment(ims[k], src, dst, iters);
+		printf("%s: %u segmented sends, %llu mismatches\n",
+		    ims[k]->name, iters, (unsigned long long)n);
+		bad += n;
+	}
+	if (!avx2)
+		printf("avx2: not supported by this CPU, skipped\n");
+
+	for (k = 0; k < MAXLEN + SLACK; k++)
+		src[k] = random();
+	bench(ims, nims, src, dst);
+
+	free(src);
+	free(dst);
+	return (bad != 0);
+}
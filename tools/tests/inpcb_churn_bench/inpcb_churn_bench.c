@@ -0,0 +1,229 @@
+/*
+ * Connection setup and teardown rate over loopback.
+ *
+ * Each client thread loops creating a TCP socket, connecting it to a
+ * listener on the loopback address and closing it, while acceptor
+ * threads accept and close the other ends.  Every iteration binds an
+ * ephemeral port, rehashes the pcb on connect, inserts the accepted pcb
+ * and removes both again, which is what the inpcb hash locking has to
+ * scale with.  Clients close with a zero linger time so that their
+ * ports are not held in TIME_WAIT.  With -u the clients instead churn
+ * UDP sockets, connecting each to the loopback address and closing it,
+ * which exercises port allocation and rehashing without a peer.
+ *
+ * The aggregate connections per second are reported along with the
+ * number of failed connects; rerun with different thread counts to see
+ * how the rate scales.
+ *
+ * Usage: inpcb_churn_bench [-6] [-u] [-c clients] [-a acceptors]
+ *        [-t seconds]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#define	MAXTHREADS	256
+
+struct worker {
+	pthread_t	thr;
+	u_int64_t	conns;
+	u_int64_t	fails;
+};
+
+static u_int		 nclients = 8, nacceptors = 2, seconds = 5;
+static int		 af = AF_INET, udp;
+static int		 ls = -1;
+static struct sockaddr_storage dst;
+static struct worker	 clients[MAXTHREADS], acceptors[MAXTHREADS];
+static volatile int	 stop;
+static mach_timebase_info_data_t tb;
+
+static double
+to_secs(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e9;
+}
+
+static void *
+client(void *arg)
+{
+	struct worker	*w = arg;
+	struct linger	 l = { 1, 0 };
+	int		 s;
+
+	while (!stop) {
+		if ((s = socket(af, udp ? SOCK_DGRAM : SOCK_STREAM, 0)) < 0) {
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS) {
+				w->fails++;
+				continue;
+			}
+			err(1, "socket");
+		}
+		if (!udp)
+			(void) setsockopt(s, SOL_SOCKET, SO_LINGER, &l,
+			    sizeof (l));
+		if (connect(s, (struct sockaddr *)&dst, dst.ss_len) < 0)
+			w->fails++;
+		else
+			w->conns++;
+		close(s);
+	}
+	return (NULL);
+}
+
+static void *
+acceptor(void *arg)
+{
+	struct worker	*w = arg;
+	int		 s;
+
+	while (!stop) {
+		if ((s = accept(ls, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EWOULDBLOCK || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		w->conns++;
+		close(s);
+	}
+	return (NULL);
+}
+
+static void
+setup(void)
+{
+	struct timeval	tv = { 0, 100000 };
+	socklen_t	len = sizeof (dst);
+	int		on = 1;
+
+	memset(&dst, 0, sizeof (dst));
+	if (af == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&dst;
+
+		sin6->sin6_len = sizeof (*sin6);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = in6addr_loopback;
+		/* a port that nothing listens on is fine for UDP */
+		sin6->sin6_port = htons(9);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&dst;
+
+		sin->sin_len = sizeof (*sin);
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin->sin_port = htons(9);
+	}
+	if (udp)
+		return;
+
+	if ((ls = socket(af, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	(void) setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+	if (af == AF_INET6)
+		((struct sockaddr_in6 *)&dst)->sin6_port = 0;
+	else
+		((struct sockaddr_in *)&dst)->sin_port = 0;
+	if (bind(ls, (struct sockaddr *)&dst, dst.ss_len) < 0)
+		err(1, "bind");
+	if (getsockname(ls, (struct sockaddr *)&dst, &len) < 0)
+		err(1, "getsockname");
+	if (listen(ls, 1024) < 0)
+		err(1, "listen");
+	if (setsockopt(ls, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0)
+		err(1, "SO_RCVTIMEO");
+}
+
+int
+main(int argc, char **argv)
+{
+	u_int64_t	 conns = 0, fails = 0, accepted = 0;
+	uint64_t	 start;
+	double		 secs;
+	u_int		 i;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "6uc:a:t:")) != -1) {
+		switch (ch) {
+		case '6':
+			af = AF_INET6;
+			break;
+		case 'u':
+			udp = 1;
+			break;
+		case 'c':
+			nclients = atoi(optarg);
+			if (nclients < 1)
+				nclients = 1;
+			if (nclients > MAXTHREADS)
+				nclients = MAXTHREADS;
+			break;
+		case 'a':
+			nacceptors = atoi(optarg);
+			if (nacceptors < 1)
+				nacceptors = 1;
+			if (nacceptors > MAXTHREADS)
+				nacceptors = MAXTHREADS;
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-6] [-u] [-c clients] "
+			    "[-a acceptors] [-t seconds]\n", argv[0]);
+			return (1);
+		}
+	}
+	if (udp)
+		nacceptors = 0;
+
+	mach_timebase_info(&tb);
+	setup();
+
+	start = mach_absolute_time();
+	for (i = 0; i < nacceptors; i++) {
+		if (pthread_create(&acceptors[i].thr, NULL, acceptor,
+		    &acceptors[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	for (i = 0; i < nclients; i++) {
+		if (pthread_create(&clients[i].thr, NULL, client,
+		    &clients[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nclients; i++) {
+		pthread_join(clients[i].thr, NULL);
+		conns += clients[i].conns;
+		fails += clients[i].fails;
+	}
+	for (i = 0; i < nacceptors; i++) {
+		pthread_join(acceptors[i].thr, NULL);
+		accepted += acceptors[i].conns;
+	}
+	secs = to_secs(mach_absolute_time() - start);
+	if (ls != -1)
+		close(ls);
+
+	printf("%s%s  clients %u  acceptors %u\n", udp ? "udp" : "tcp",
+	    af == AF_INET6 ? "6" : "4", nclients, nacceptors);
+	printf("%10.0f conns/s  connected %llu accepted %llu failed %llu\n",
+	    conns / secs, (unsigned long long)conns,
+	    (unsigned long long)accepted, (unsigned long long)fails);
+
+	return (0);
+}
@@ -0,0 +1,143 @@
+/*
+ * Time a full export of the IORegistry properties.
+ *
+ * Every entry of the service plane is visited and its properties are
+ * fetched once as XML (io_registry_entry_get_properties) and once in
+ * the binary serialization format (io_registry_entry_get_properties_bin).
+ * The time spent in the kernel routines and the number of bytes returned
+ * are summed per pass, so the two formats can be compared on the same
+ * registry and the cost of an "ioreg -l" style walk tracked over time.
+ *
+ * Usage: ioreg_export_bench [-i passes]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <IOKit/IOKitLib.h>
+
+/* MIG routines, as generated from iokit/DeviceMIG/device.defs */
+extern kern_return_t io_registry_entry_get_properties(mach_port_t registry_entry,
+	io_buf_ptr_t *properties, mach_msg_type_number_t *propertiesCnt);
+extern kern_return_t io_registry_entry_get_properties_bin(mach_port_t registry_entry,
+	io_buf_ptr_t *properties, mach_msg_type_number_t *propertiesCnt);
+
+typedef kern_return_t (*get_properties_t)(mach_port_t, io_buf_ptr_t *,
+	mach_msg_type_number_t *);
+
+struct export_result {
+	uint64_t	entries;
+	uint64_t	failed;
+	uint64_t	bytes;
+	uint64_t	time;
+};
+
+static mach_timebase_info_data_t tb;
+
+static double
+to_ms(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e6;
+}
+
+static void
+export_entry(io_registry_entry_t entry, get_properties_t get,
+	struct export_result *res)
+{
+	io_buf_ptr_t		props = NULL;
+	mach_msg_type_number_t	len = 0;
+	kern_return_t		kr;
+	uint64_t		start;
+
+	start = mach_absolute_time();
+	kr = get(entry, &props, &len);
+	res->time += mach_absolute_time() - start;
+
+	res->entries++;
+	if (kr != KERN_SUCCESS) {
+		res->failed++;
+		return;
+	}
+	res->bytes += len;
+	vm_deallocate(mach_task_self(), (vm_address_t)props, len);
+}
+
+static int
+export_registry(get_properties_t xml, get_properties_t bin,
+	struct export_result *xml_res, struct export_result *bin_res)
+{
+	io_iterator_t		iter;
+	io_registry_entry_t	entry;
+	kern_return_t		kr;
+
+	kr = IORegistryCreateIterator(kIOMasterPortDefault, kIOServicePlane,
+	    kIORegistryIterateRecursively, &iter);
+	if (kr != KERN_SUCCESS) {
+		fprintf(stderr, "IORegistryCreateIterator: 0x%x\n", kr);
+		return (-1);
+	}
+
+	while ((entry = IOIteratorNext(iter)) != IO_OBJECT_NULL) {
+		export_entry(entry, xml, xml_res);
+		export_entry(entry, bin, bin_res);
+		IOObjectRelease(entry);
+	}
+	IOObjectRelease(iter);
+
+	return (0);
+}
+
+static void
+print_result(const char *name, struct export_result *res)
+{
+	printf("  %-6s %6llu entries %4llu failed %10llu bytes %9.3f ms\n",
+	    name, res->entries, res->failed, res->bytes, to_ms(res->time));
+}
+
+int
+main(int argc, char **argv)
+{
+	struct export_result	xml, bin;
+	uint64_t		xml_total = 0, bin_total = 0;
+	int			passes = 5;
+	int			ch, i;
+
+	while ((ch = getopt(argc, argv, "i:")) != -1) {
+		switch (ch) {
+		case 'i':
+			passes = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-i passes]\n", argv[0]);
+			return (1);
+		}
+	}
+	if (passes < 1)
+		passes = 1;
+
+	mach_timebase_info(&tb);
+
+	for (i = 0; i < passes; i++) {
+		bzero(&xml, sizeof(xml));
+		bzero(&bin, sizeof(bin));
+		if (export_registry(io_registry_entry_get_properties,
+		    io_registry_entry_get_properties_bin, &xml, &bin))
+			return (1);
+
+		printf("pass %d:\n", i);
+		print_result("xml", &xml);
+		print_result("binary", &bin);
+		xml_total += xml.time;
+		bin_total += bin.time;
+	}
+
+	printf("average: xml %.3f ms, binary %.3f ms (%.2fx)\n",
+	    to_ms(xml_total) / passes, to_ms(bin_total) / passes,
+	    bin_total ? (double)xml_total / bin_total : 0.0);
+
+	return (0);
+}
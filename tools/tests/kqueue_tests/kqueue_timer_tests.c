@@ -212,6 +212,77 @@ test_updated_kevent(int first, int second)
 		failed++;
 }
 
+/*
+ * Arm many oneshot timers with shuffled deadlines, cancel a quarter of
+ * them, and check that exactly the remaining ones fire.  This exercises
+ * sorted insertion and removal on the kernel timer queues.
+ */
+void
+test_many_kevents(int count)
+{
+	struct kevent64_s *kevs, kev;
+	struct timespec timeout;
+	struct timeval before, after;
+	char *fired;
+	int i, ret, nfired = 0, bad = 0;
+	uint64_t arm_usecs;
+
+	printf("Testing %d timers armed in random order...\n", count);
+
+	kevs = calloc(count, sizeof(*kevs));
+	fired = calloc(count, 1);
+	assert(kevs != NULL && fired != NULL);
+
+	/* deadlines between 100 and 300 msecs, shuffled */
+	for (i = 0; i < count; i++)
+		EV_SET64(&kevs[i], 100 + i, EVFILT_TIMER, EV_ADD | EV_ONESHOT,
+				NOTE_USECONDS, 100 * 1000 + (random() % (200 * 1000)),
+				0, 0, 0);
+
+	gettimeofday(&before, NULL);
+	ret = kevent64(kq, kevs, count, NULL, 0, 0, NULL);
+	gettimeofday(&after, NULL);
+	if (ret != 0) {
+		printf("\tfailure: kevent64 returned %d\n", ret);
+		failed++;
+		goto out;
+	}
+	arm_usecs = (after.tv_sec - before.tv_sec) * (1000 * 1000) + 
+		(after.tv_usec - before.tv_usec);
+
+	for (i = 0; i < count; i += 4) {
+		EV_SET64(&kev, 100 + i, EVFILT_TIMER, EV_DELETE, 0, 0, 0, 0, 0);
+		if (kevent64(kq, &kev, 1, NULL, 0, 0, NULL) != 0)
+			bad++;
+	}
+
+	timeout.tv_sec = 1;
+	timeout.tv_nsec = 0;
+	while ((ret = kevent64(kq, NULL, 0, kevs, count, 0, &timeout)) > 0) {
+		for (i = 0; i < ret; i++) {
+			int idx = (int)kevs[i].ident - 100;
+
+			if (idx < 0 || idx >= count || fired[idx] || (idx % 4) == 0)
+				bad++;
+			else
+				fired[idx] = 1;
+			nfired++;
+		}
+	}
+
+	if (bad || nfired != count - (count + 3) / 4) {
+		printf("\tfailure: %d of %d timers fired, %d unexpected.\n",
+				nfired, count - (count + 3) / 4, bad);
+		failed++;
+	} else {
+		printf("\tsuccess: armed in %lld usec.\n", arm_usecs);
+		passed++;
+	}
+out:
+	free(kevs);
+	free(fired);
+}
+
 int
 main(void)
 {
@@ -249,6 +320,9 @@ main(void)
 	test_updated_kevent(2000, 1000);
 	test_updated_kevent(1000, -1);
 
+	test_many_kevents(1000);
+	test_many_kevents(20000);
+
 	printf("\nFinished: %d tests passed, %d failed.\n", passed, failed);
 
 	exit(EXIT_SUCCESS);
@@ -0,0 +1,85 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * Create/unlink storm: every thread creates files in its own directory
+ * and unlinks each one CREATE_UNLINK_WINDOW creates later, so that the
+ * directories stay small and nearly all of the time goes to catalog and
+ * journal metadata in the buffer cache.
+ */
+#define CREATE_UNLINK_WINDOW 64
+
+char tempdir[MAXPATHLEN];
+
+static void churn_path(char* buf, size_t len, int thread_id, long long file) {
+    snprintf(buf, len, "%s/churn-%d/file-%lld", tempdir, thread_id, file % (2 * CREATE_UNLINK_WINDOW));
+}
+
+DECL_SETUP {
+    char path[MAXPATHLEN];
+    char* retval;
+    int i;
+
+    retval = setup_tempdir(tempdir);
+
+    VERIFY(retval, "tempdir setup failed");
+
+    printf("tempdir: %s\n", tempdir);
+
+    for(i = 0; i < num_threads; i++) {
+        snprintf(path, sizeof(path), "%s/churn-%d", tempdir, i);
+        VERIFY(mkdir(path, 0755) == 0, "mkdir failed");
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_TEST {
+    char path[MAXPATHLEN];
+    long long i, max;
+    int fd;
+
+    max = length / num_threads;
+
+    for(i = 0; i < max; i++) {
+        churn_path(path, sizeof(path), thread_id, i);
+        fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        VERIFY(fd >= 0, "open failed");
+        close(fd);
+
+        if(i >= CREATE_UNLINK_WINDOW) {
+            churn_path(path, sizeof(path), thread_id, i - CREATE_UNLINK_WINDOW);
+            VERIFY(unlink(path) == 0, "unlink failed");
+        }
+    }
+
+    /* leave the directory empty for the cleanup */
+    for(i = (max > CREATE_UNLINK_WINDOW ? max - CREATE_UNLINK_WINDOW : 0); i < max; i++) {
+        churn_path(path, sizeof(path), thread_id, i);
+        VERIFY(unlink(path) == 0, "unlink failed");
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    char path[MAXPATHLEN];
+    int i;
+    int retval;
+
+    for(i = 0; i < num_threads; i++) {
+        snprintf(path, sizeof(path), "%s/churn-%d", tempdir, i);
+        VERIFY(rmdir(path) == 0, "rmdir failed");
+    }
+
+    retval = cleanup_tempdir(tempdir);
+    VERIFY(retval == 0, "cleanup_tempdir failed");
+
+    return PERFINDEX_SUCCESS;
+}
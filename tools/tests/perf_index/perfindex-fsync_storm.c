@@ -0,0 +1,100 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include <sys/param.h>
+#include <sys/fsctl.h>
+#include <hfs/hfs_fsctl.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Fsync storm: every thread appends small records to its own file and
+ * F_FULLFSYNCs after each one, so every record is a journal transaction
+ * (the file grew) that its writer waits to see committed.  Files are
+ * truncated every FSYNC_STORM_RECORDS records to keep them small.  The
+ * volume's journal statistics are printed at the end, if it has any.
+ */
+#define FSYNC_STORM_RECORD_SIZE 512
+#define FSYNC_STORM_RECORDS 256
+
+char tempdir[MAXPATHLEN];
+
+static void print_journal_stats(void) {
+    struct hfs_journal_stats stats;
+    int i;
+
+    if(fsctl(tempdir, HFSIOC_GET_JOURNAL_STATS, &stats, 0) != 0) {
+        printf("journal statistics not available\n");
+        return;
+    }
+    printf("%llu journal writes, %llu transactions (%.2f per write), %llu waited for, %llu fsyncs shared a write\n",
+           stats.commits, stats.transactions,
+           stats.commits ? (double)stats.transactions / stats.commits : 0.0,
+           stats.sync_commits, stats.group_waits);
+    printf("checkpoints: %llu waits, at most %u in flight\n", stats.ckpt_waits, stats.ckpt_max);
+    printf("commit latency:\n");
+    for(i = 0; i < HFS_JOURNAL_LATENCY_BUCKETS; i++) {
+        if(stats.commit_latency[i] == 0)
+            continue;
+        if(i < HFS_JOURNAL_LATENCY_BUCKETS - 1)
+            printf("  < %8d us: %llu\n", 1 << (i + 5), stats.commit_latency[i]);
+        else
+            printf("  >= %7d us: %llu\n", 1 << (i + 4), stats.commit_latency[i]);
+    }
+}
+
+DECL_SETUP {
+    char* retval;
+
+    retval = setup_tempdir(tempdir);
+
+    VERIFY(retval, "tempdir setup failed");
+
+    printf("tempdir: %s\n", tempdir);
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_TEST {
+    char path[MAXPATHLEN];
+    char record[FSYNC_STORM_RECORD_SIZE];
+    long long i, max;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/fsync-%d", tempdir, thread_id);
+    fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+    VERIFY(fd >= 0, "open failed");
+
+    memset(record, thread_id, sizeof(record));
+    max = length / num_threads;
+
+    for(i = 0; i < max; i++) {
+        if(i % FSYNC_STORM_RECORDS == 0)
+            VERIFY(ftruncate(fd, 0) == 0, "ftruncate failed");
+        VERIFY(write(fd, record, sizeof(record)) == sizeof(record), "write failed");
+        VERIFY(fcntl(fd, F_FULLFSYNC) == 0, "F_FULLFSYNC failed");
+    }
+    close(fd);
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    char path[MAXPATHLEN];
+    int i;
+    int retval;
+
+    print_journal_stats();
+
+    for(i = 0; i < num_threads; i++) {
+        snprintf(path, sizeof(path), "%s/fsync-%d", tempdir, i);
+        VERIFY(unlink(path) == 0, "unlink failed");
+    }
+
+    retval = cleanup_tempdir(tempdir);
+    VERIFY(retval == 0, "cleanup_tempdir failed");
+
+    return PERFINDEX_SUCCESS;
+}
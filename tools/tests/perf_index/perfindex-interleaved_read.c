@@ -0,0 +1,134 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include <sys/param.h>
+#include <sys/fsctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * Interleaved readers: all threads read the same file, each from its own
+ * region of it.  Even numbered threads read their region sequentially,
+ * odd numbered threads read one record out of every INTERLEAVED_STRIDE
+ * bytes, so the file sees several sequential and strided streams at
+ * once.  The volume's read ahead statistics are printed at the end.
+ */
+#define INTERLEAVED_MAX_FILE_SIZE (1024LL * 1024 * 1024)
+#define INTERLEAVED_READ_SIZE (64 * 1024)
+#define INTERLEAVED_RECORD_SIZE (16 * 1024)
+#define INTERLEAVED_STRIDE (256 * 1024)
+
+char tempdir[MAXPATHLEN];
+char filepath[MAXPATHLEN];
+long long region_size;
+
+static void print_readahead_stats(const char* when) {
+    fsctl_readahead_stats_t stats;
+
+    if(fsctl(filepath, FSIOC_READAHEAD_STATS, &stats, 0) != 0) {
+        printf("%s: read ahead statistics not available\n", when);
+        return;
+    }
+    printf("%s: %llu pages read ahead, %llu hit, %llu wasted, %llu streams, %u usecs average latency\n",
+           when, stats.ra_pages, stats.ra_hits, stats.ra_waste, stats.ra_streams, stats.ra_latency);
+}
+
+DECL_SETUP {
+    char* retval;
+    char* buf;
+    void* map;
+    long long filesize, left;
+    size_t writelen;
+    int fd;
+
+    retval = setup_tempdir(tempdir);
+
+    VERIFY(retval, "tempdir setup failed");
+
+    printf("tempdir: %s\n", tempdir);
+
+    filesize = MIN(length, INTERLEAVED_MAX_FILE_SIZE);
+    region_size = (filesize / num_threads) & ~((long long)INTERLEAVED_STRIDE - 1);
+    VERIFY(region_size > 0, "file too small for the number of threads");
+    filesize = region_size * num_threads;
+
+    snprintf(filepath, sizeof(filepath), "%s/interleaved_read", tempdir);
+    fd = open(filepath, O_CREAT | O_EXCL | O_RDWR, 0644);
+    VERIFY(fd >= 0, "open failed");
+
+    buf = calloc(1, INTERLEAVED_READ_SIZE);
+    VERIFY(buf, "calloc failed");
+
+    for(left = filesize; left > 0; left -= writelen) {
+        writelen = MIN(INTERLEAVED_READ_SIZE, left);
+        VERIFY(write(fd, buf, writelen) == writelen, "write failed");
+    }
+    free(buf);
+    VERIFY(fsync(fd) == 0, "fsync failed");
+
+    /* push the file out of the cache so the readers go to the disk */
+    map = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, 0);
+    VERIFY(map != MAP_FAILED, "mmap failed");
+    VERIFY(msync(map, filesize, MS_INVALIDATE) == 0, "msync failed");
+    munmap(map, filesize);
+    close(fd);
+
+    print_readahead_stats("before");
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_TEST {
+    char* buf;
+    off_t base, offset;
+    long long left;
+    ssize_t readlen;
+    int strided;
+    int fd;
+
+    fd = open(filepath, O_RDONLY);
+    VERIFY(fd >= 0, "open failed");
+
+    buf = malloc(INTERLEAVED_READ_SIZE);
+    VERIFY(buf, "malloc failed");
+
+    strided = thread_id & 1;
+    base = region_size * thread_id;
+    offset = 0;
+
+    for(left = length / num_threads; left > 0; left -= readlen) {
+        if(offset >= region_size)
+            offset = 0;
+
+        if(strided) {
+            readlen = pread(fd, buf, INTERLEAVED_RECORD_SIZE, base + offset);
+            offset += INTERLEAVED_STRIDE;
+        } else {
+            readlen = pread(fd, buf, INTERLEAVED_READ_SIZE, base + offset);
+            offset += INTERLEAVED_READ_SIZE;
+        }
+        VERIFY(readlen > 0, "read failed");
+    }
+
+    free(buf);
+    close(fd);
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    int retval;
+
+    print_readahead_stats("after");
+
+    VERIFY(unlink(filepath) == 0, "unlink failed");
+
+    retval = cleanup_tempdir(tempdir);
+    VERIFY(retval == 0, "cleanup_tempdir failed");
+
+    return PERFINDEX_SUCCESS;
+}
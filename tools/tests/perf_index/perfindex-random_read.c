@@ -0,0 +1,122 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include <sys/param.h>
+#include <sys/fsctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * Random readers: all threads read RANDOM_READ_SIZE records at random
+ * record aligned offsets of one file, the way a database does.  Nothing
+ * here can be read ahead, so the pages read ahead and wasted in the
+ * read ahead statistics printed at the end should stay close to zero.
+ */
+#define RANDOM_MAX_FILE_SIZE (1024LL * 1024 * 1024)
+#define RANDOM_READ_SIZE (4 * 1024)
+#define RANDOM_WRITE_SIZE (64 * 1024)
+
+char tempdir[MAXPATHLEN];
+char filepath[MAXPATHLEN];
+long long nrecords;
+
+static void print_readahead_stats(const char* when) {
+    fsctl_readahead_stats_t stats;
+
+    if(fsctl(filepath, FSIOC_READAHEAD_STATS, &stats, 0) != 0) {
+        printf("%s: read ahead statistics not available\n", when);
+        return;
+    }
+    printf("%s: %llu pages read ahead, %llu hit, %llu wasted, %llu streams, %u usecs average latency\n",
+           when, stats.ra_pages, stats.ra_hits, stats.ra_waste, stats.ra_streams, stats.ra_latency);
+}
+
+DECL_SETUP {
+    char* retval;
+    char* buf;
+    void* map;
+    long long filesize, left;
+    size_t writelen;
+    int fd;
+
+    retval = setup_tempdir(tempdir);
+
+    VERIFY(retval, "tempdir setup failed");
+
+    printf("tempdir: %s\n", tempdir);
+
+    filesize = MIN(length, RANDOM_MAX_FILE_SIZE) & ~((long long)RANDOM_WRITE_SIZE - 1);
+    VERIFY(filesize > 0, "file too small");
+    nrecords = filesize / RANDOM_READ_SIZE;
+
+    snprintf(filepath, sizeof(filepath), "%s/random_read", tempdir);
+    fd = open(filepath, O_CREAT | O_EXCL | O_RDWR, 0644);
+    VERIFY(fd >= 0, "open failed");
+
+    buf = calloc(1, RANDOM_WRITE_SIZE);
+    VERIFY(buf, "calloc failed");
+
+    for(left = filesize; left > 0; left -= writelen) {
+        writelen = MIN(RANDOM_WRITE_SIZE, left);
+        VERIFY(write(fd, buf, writelen) == writelen, "write failed");
+    }
+    free(buf);
+    VERIFY(fsync(fd) == 0, "fsync failed");
+
+    /* push the file out of the cache so the readers go to the disk */
+    map = mmap(NULL, filesize, PROT_READ, MAP_SHARED, fd, 0);
+    VERIFY(map != MAP_FAILED, "mmap failed");
+    VERIFY(msync(map, filesize, MS_INVALIDATE) == 0, "msync failed");
+    munmap(map, filesize);
+    close(fd);
+
+    print_readahead_stats("before");
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_TEST {
+    char* buf;
+    off_t offset;
+    long long left;
+    ssize_t readlen;
+    unsigned int seed;
+    int fd;
+
+    fd = open(filepath, O_RDONLY);
+    VERIFY(fd >= 0, "open failed");
+
+    buf = malloc(RANDOM_READ_SIZE);
+    VERIFY(buf, "malloc failed");
+
+    seed = thread_id + 1;
+
+    for(left = length / num_threads; left > 0; left -= readlen) {
+        offset = (off_t)((((long long)rand_r(&seed) << 31) | rand_r(&seed)) % nrecords) * RANDOM_READ_SIZE;
+
+        readlen = pread(fd, buf, RANDOM_READ_SIZE, offset);
+        VERIFY(readlen > 0, "read failed");
+    }
+
+    free(buf);
+    close(fd);
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    int retval;
+
+    print_readahead_stats("after");
+
+    VERIFY(unlink(filepath) == 0, "unlink failed");
+
+    retval = cleanup_tempdir(tempdir);
+    VERIFY(retval == 0, "cleanup_tempdir failed");
+
+    return PERFINDEX_SUCCESS;
+}
@@ -0,0 +1,104 @@
+#include "perf_index.h"
+#include "fail.h"
+#include "test_file_helper.h"
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Parallel stat(2) of files a few directories deep, all of which stay in
+ * the name cache, so that nearly all of the time goes to path lookup.
+ */
+#define STAT_DIRS 16
+#define STAT_FILES 64
+#define STAT_PATHLEN 128
+
+char tempdir[MAXPATHLEN];
+
+static void stat_path(char* buf, size_t len, int dir, int file) {
+    snprintf(buf, len, "%s/stat-%d/usr/local/include/file-%d", tempdir, dir, file);
+}
+
+static const char* stat_subdirs[] = { "", "/usr", "/usr/local", "/usr/local/include" };
+#define STAT_NSUBDIRS (sizeof(stat_subdirs) / sizeof(stat_subdirs[0]))
+
+DECL_SETUP {
+    char path[MAXPATHLEN];
+    char* retval;
+    int dir, file, fd, i;
+
+    retval = setup_tempdir(tempdir);
+
+    VERIFY(retval, "tempdir setup failed");
+
+    printf("tempdir: %s\n", tempdir);
+
+    for(dir = 0; dir < STAT_DIRS; dir++) {
+        for(i = 0; i < STAT_NSUBDIRS; i++) {
+            snprintf(path, sizeof(path), "%s/stat-%d%s", tempdir, dir, stat_subdirs[i]);
+            VERIFY(mkdir(path, 0755) == 0, "mkdir failed");
+        }
+        for(file = 0; file < STAT_FILES; file++) {
+            stat_path(path, sizeof(path), dir, file);
+            fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+            VERIFY(fd >= 0, "open failed");
+            close(fd);
+        }
+    }
+
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_TEST {
+    char (*paths)[STAT_PATHLEN];
+    struct stat sb;
+    long long i;
+    int n, retval;
+
+    /* build the paths up front so that the loop is all lookups */
+    paths = malloc(STAT_DIRS * STAT_FILES * STAT_PATHLEN);
+    VERIFY(paths, "malloc failed");
+    for(n = 0; n < STAT_DIRS * STAT_FILES; n++)
+        stat_path(paths[n], STAT_PATHLEN, n / STAT_FILES, n % STAT_FILES);
+
+    /* each thread starts in a different directory */
+    n = (thread_id * STAT_FILES) % (STAT_DIRS * STAT_FILES);
+    for(i = 0; i < length; i++) {
+        retval = stat(paths[n], &sb);
+        if(retval != 0) {
+            free(paths);
+            FAIL("stat failed");
+        }
+        if(++n == STAT_DIRS * STAT_FILES)
+            n = 0;
+    }
+
+    free(paths);
+    return PERFINDEX_SUCCESS;
+}
+
+DECL_CLEANUP {
+    char path[MAXPATHLEN];
+    int dir, file, i;
+    int retval;
+
+    for(dir = 0; dir < STAT_DIRS; dir++) {
+        for(file = 0; file < STAT_FILES; file++) {
+            stat_path(path, sizeof(path), dir, file);
+            retval = unlink(path);
+            VERIFY(retval == 0, "unlink failed");
+        }
+        for(i = STAT_NSUBDIRS - 1; i >= 0; i--) {
+            snprintf(path, sizeof(path), "%s/stat-%d%s", tempdir, dir, stat_subdirs[i]);
+            VERIFY(rmdir(path) == 0, "rmdir failed");
+        }
+    }
+
+    retval = cleanup_tempdir(tempdir);
+    VERIFY(retval == 0, "cleanup_tempdir failed");
+
+    return PERFINDEX_SUCCESS;
+}
@@ -0,0 +1,1120 @@
+/*
+ * Userspace model of the pf filter rule index.
+ *
+ * Carries a copy of the index in bsd/net/pf_ruleindex.c (prefix tables
+ * per address family, segment tree over destination ports, candidate
+ * bitmap) together with the part of pf_test_rule() it interacts with:
+ * the in-order walk with first-match/quick and last-match semantics.
+ * Every packet tuple is evaluated by the plain linear walk and by the
+ * indexed walk; the matching rule and action must be identical.
+ *
+ * Tuples come from pcap files (Ethernet, loopback or raw IP link types;
+ * IPv4 and IPv6, TCP, UDP and others) or are generated.  The ruleset is
+ * generated from the same address pool, mixing prefixes of all lengths,
+ * port operators, negation, table-like addresses and quick rules.
+ *
+ * Usage: pf_rule_index_sim [-r rules] [-n tuples] [-s seed] [file.pcap ...]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#define	PF_OP_NONE	0
+#define	PF_OP_IRG	1
+#define	PF_OP_EQ	2
+#define	PF_OP_NE	3
+#define	PF_OP_LT	4
+#define	PF_OP_LE	5
+#define	PF_OP_GT	6
+#define	PF_OP_GE	7
+#define	PF_OP_XRG	8
+#define	PF_OP_RRG	9
+
+#define	PF_ADDR_ADDRMASK	0
+#define	PF_ADDR_TABLE		1	/* stands for any non-indexed type */
+
+struct pf_addr {
+	union {
+		u_int8_t	addr8[16];
+		u_int32_t	addr32[4];
+	} pfa;
+#define	addr8	pfa.addr8
+#define	addr32	pfa.addr32
+};
+
+struct rule_addr {
+	int		type;
+	struct pf_addr	addr;
+	struct pf_addr	mask;
+	u_int32_t	table_seed;	/* PF_ADDR_TABLE membership */
+	u_int8_t	neg;
+};
+
+struct rule {
+	u_int32_t	nr;
+	sa_family_t	af;
+	u_int8_t	proto;
+	u_int8_t	quick;
+	u_int8_t	action;
+	struct rule_addr src, dst;
+	struct {
+		u_int8_t	op;
+		u_int16_t	port[2];	/* network order */
+	} sport, dport;
+};
+
+struct tuple {
+	sa_family_t	af;
+	u_int8_t	proto;
+	struct pf_addr	src, dst;
+	u_int16_t	sport, dport;	/* network order */
+};
+
+static mach_timebase_info_data_t tb;
+
+static double
+to_ms(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e6;
+}
+
+/* ------------------------------------------------------------------ */
+/* rule tests, as in pf_test_rule()                                   */
+
+static int
+pf_match(u_int8_t op, u_int32_t a1, u_int32_t a2, u_int32_t p)
+{
+	switch (op) {
+	case PF_OP_IRG:
+		return ((p > a1) && (p < a2));
+	case PF_OP_XRG:
+		return ((p < a1) || (p > a2));
+	case PF_OP_RRG:
+		return ((p >= a1) && (p <= a2));
+	case PF_OP_EQ:
+		return (p == a1);
+	case PF_OP_NE:
+		return (p != a1);
+	case PF_OP_LT:
+		return (p < a1);
+	case PF_OP_LE:
+		return (p <= a1);
+	case PF_OP_GT:
+		return (p > a1);
+	case PF_OP_GE:
+		return (p >= a1);
+	}
+	return (0);
+}
+
+static int
+pf_match_port(u_int8_t op, u_int16_t a1, u_int16_t a2, u_int16_t p)
+{
+	return (pf_match(op, ntohs(a1), ntohs(a2), ntohs(p)));
+}
+
+static int
+addr_mismatch(struct rule_addr *ra, struct pf_addr *a, sa_family_t af)
+{
+	int	i, nw = (af == AF_INET) ? 1 : 4, match = 1, zero = 1;
+
+	if (ra->type == PF_ADDR_TABLE) {
+		/* arbitrary but stable membership */
+		u_int32_t h = ra->table_seed;
+		for (i = 0; i < nw; i++)
+			h = (h ^ a->addr32[i]) * 16777619;
+		match = (h & 3) == 0;
+	} else {
+		for (i = 0; i < nw; i++) {
+			if (ra->mask.addr32[i] != 0)
+				zero = 0;
+			if ((ra->addr.addr32[i] & ra->mask.addr32[i]) !=
+			    (a->addr32[i] & ra->mask.addr32[i]))
+				match = 0;
+		}
+		if (zero)
+			match = 1;
+	}
+	return (!match != !!ra->neg);
+}
+
+static int
+rule_mismatch(struct rule *r, struct tuple *t)
+{
+	if (r->af && r->af != t->af)
+		return (1);
+	if (r->proto && r->proto != t->proto)
+		return (1);
+	if (addr_mismatch(&r->src, &t->src, t->af))
+		return (1);
+	if (r->proto == t->proto &&
+	    (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) &&
+	    r->sport.op && !pf_match_port(r->sport.op, r->sport.port[0],
+	    r->sport.port[1], t->sport))
+		return (1);
+	if (addr_mismatch(&r->dst, &t->dst, t->af))
+		return (1);
+	if (r->proto == t->proto &&
+	    (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) &&
+	    r->dport.op && !pf_match_port(r->dport.op, r->dport.port[0],
+	    r->dport.port[1], t->dport))
+		return (1);
+	return (0);
+}
+
+/* ------------------------------------------------------------------ */
+/* copy of bsd/net/pf_ruleindex.c                                     */
+
+#define	PF_RI_INET		0
+#define	PF_RI_INET6		1
+#define	PF_RI_NAF		2
+#define	PF_RI_MAXPLEN		128
+#define	PF_RI_SPARSE		0xffffffffU
+
+struct pf_rule_index_prefix {
+	struct pf_addr		 addr;
+	u_int32_t		 first;
+	u_int32_t		 count;
+	u_int32_t		 dense;
+};
+
+struct pf_rule_index_atab {
+	u_int32_t		 nlens;
+	u_int8_t		 plen[PF_RI_MAXPLEN + 1];
+	u_int32_t		 start[PF_RI_MAXPLEN + 2];
+	struct pf_rule_index_prefix *prefix;
+	u_int32_t		*nrs;
+	u_int32_t		*bitmaps;
+};
+
+struct pf_rule_index_ports {
+	u_int32_t		 nsegs;
+	u_int32_t		 size;
+	u_int16_t		*lo;
+	u_int32_t		*node;
+	u_int32_t		*nrs;
+	u_int32_t		*dense;
+	u_int32_t		*bitmaps;
+};
+
+struct pf_rule_index {
+	u_int32_t		 nrules;
+	u_int32_t		 words;
+	struct rule		**rules;
+	struct pf_rule_index_atab src[PF_RI_NAF];
+	struct pf_rule_index_atab dst[PF_RI_NAF];
+	struct pf_rule_index_ports dport;
+	u_int32_t		*bits;
+	u_int32_t		*src_any;
+	u_int32_t		*dst_any;
+	u_int32_t		*dport_any;
+	u_int32_t		*cand;
+	u_int32_t		*tmp;
+	u_int64_t		 gen;
+};
+
+struct pf_rule_index_ent {
+	struct pf_addr		 addr;
+	u_int32_t		 nr;
+	u_int8_t		 plen;
+};
+
+struct pf_rule_index_range {
+	u_int32_t		 lo, hi;
+	u_int32_t		 nr;
+};
+
+static u_int64_t pf_rule_index_gen;
+
+#define	PF_RI_SETBIT(b, n)	((b)[(n) >> 5] |= (1U << ((n) & 31)))
+
+static int
+pf_rule_index_af(sa_family_t af)
+{
+	switch (af) {
+	case AF_INET:
+		return (PF_RI_INET);
+	case AF_INET6:
+		return (PF_RI_INET6);
+	}
+	return (-1);
+}
+
+static void
+pf_rule_index_free(struct pf_rule_index *ri)
+{
+	int	f;
+
+	for (f = 0; f < PF_RI_NAF; f++) {
+		free(ri->src[f].prefix);
+		free(ri->src[f].nrs);
+		free(ri->dst[f].prefix);
+		free(ri->dst[f].nrs);
+		free(ri->src[f].bitmaps);
+		free(ri->dst[f].bitmaps);
+	}
+	free(ri->dport.lo);
+	free(ri->dport.node);
+	free(ri->dport.nrs);
+	free(ri->dport.dense);
+	free(ri->dport.bitmaps);
+	free(ri->bits);
+	free(ri->rules);
+	free(ri);
+}
+
+static int
+pf_rule_index_prefix(struct rule_addr *ra, sa_family_t af,
+    struct pf_addr *addr, u_int8_t *plen)
+{
+	u_int32_t	m;
+	int		i, nw, bits;
+
+	if (ra->neg || ra->type != PF_ADDR_ADDRMASK)
+		return (0);
+
+	nw = (af == AF_INET) ? 1 : 4;
+	bzero(addr, sizeof (*addr));
+	*plen = 0;
+	for (i = 0; i < nw; i++) {
+		m = ntohl(ra->mask.addr32[i]);
+		if (m == 0xffffffff) {
+			*plen += 32;
+			addr->addr32[i] = ra->addr.addr32[i];
+			continue;
+		}
+		for (bits = 0; bits < 32 && (m & (0x80000000U >> bits));
+		    bits++)
+			;
+		if (bits != 0 && m != (0xffffffffU << (32 - bits)))
+			return (0);
+		if (bits == 0 && m != 0)
+			return (0);
+		*plen += bits;
+		addr->addr32[i] = ra->addr.addr32[i] & ra->mask.addr32[i];
+		for (i++; i < nw; i++)
+			if (ra->mask.addr32[i] != 0)
+				return (0);
+		break;
+	}
+
+	return (*plen != 0);
+}
+
+static int
+pf_rule_index_ent_cmp(const void *a, const void *b)
+{
+	const struct pf_rule_index_ent *ea = a, *eb = b;
+	int	c;
+
+	if ((ea->nr >> 31) != (eb->nr >> 31))
+		return ((ea->nr >> 31) < (eb->nr >> 31) ? -1 : 1);
+	if (ea->plen != eb->plen)
+		return (ea->plen > eb->plen ? -1 : 1);
+	if ((c = memcmp(&ea->addr, &eb->addr, sizeof (ea->addr))) != 0)
+		return (c);
+	if (ea->nr != eb->nr)
+		return (ea->nr < eb->nr ? -1 : 1);
+	return (0);
+}
+
+static int
+pf_rule_index_build_atab(struct pf_rule_index *ri,
+    struct pf_rule_index_atab *at, struct pf_rule_index_ent *ent, u_int32_t n)
+{
+	u_int32_t	i, np;
+
+	bzero(at, sizeof (*at));
+	if (n == 0)
+		return (0);
+
+	at->prefix = malloc(n * sizeof (*at->prefix));
+	at->nrs = malloc(n * sizeof (*at->nrs));
+	if (at->prefix == NULL || at->nrs == NULL)
+		return (1);
+
+	np = 0;
+	for (i = 0; i < n; i++) {
+		at->nrs[i] = ent[i].nr & ~(1U << 31);
+		assert(at->nrs[i] < ri->nrules);
+		if (i > 0 && ent[i].plen == ent[i - 1].plen &&
+		    memcmp(&ent[i].addr, &ent[i - 1].addr,
+		    sizeof (ent[i].addr)) == 0) {
+			at->prefix[np - 1].count++;
+			continue;
+		}
+		if (i == 0 || ent[i].plen != ent[i - 1].plen) {
+			at->plen[at->nlens] = ent[i].plen;
+			at->start[at->nlens] = np;
+			at->nlens++;
+		}
+		at->prefix[np].addr = ent[i].addr;
+		at->prefix[np].first = i;
+		at->prefix[np].count = 1;
+		np++;
+	}
+	at->start[at->nlens] = np;
+
+	/* prefixes shared by more rules than a bitmap has words get one */
+	for (i = 0, n = 0; i < np; i++)
+		at->prefix[i].dense = (at->prefix[i].count > ri->words) ?
+		    n++ : PF_RI_SPARSE;
+	if (n == 0)
+		return (0);
+	at->bitmaps = calloc(n * ri->words, sizeof (u_int32_t));
+	if (at->bitmaps == NULL)
+		return (1);
+	for (i = 0; i < np; i++) {
+		struct pf_rule_index_prefix *p = &at->prefix[i];
+		u_int32_t j;
+
+		if (p->dense == PF_RI_SPARSE)
+			continue;
+		for (j = p->first; j < p->first + p->count; j++)
+			PF_RI_SETBIT(&at->bitmaps[p->dense * ri->words],
+			    at->nrs[j]);
+	}
+
+	return (0);
+}
+
+static inline void
+pf_rule_index_set(struct pf_rule_index *ri, u_int32_t dense,
+    u_int32_t *bitmaps, u_int32_t *nrs, u_int32_t count, u_int32_t *bits)
+{
+	u_int32_t	*b, i;
+
+	if (dense != PF_RI_SPARSE) {
+		b = &bitmaps[dense * ri->words];
+		for (i = 0; i < ri->words; i++)
+			bits[i] |= b[i];
+		return;
+	}
+	for (i = 0; i < count; i++)
+		PF_RI_SETBIT(bits, nrs[i]);
+}
+
+static void
+pf_rule_index_atab_lookup(struct pf_rule_index *ri,
+    struct pf_rule_index_atab *at,
+    struct pf_addr *addr, int nw, u_int32_t *bits)
+{
+	struct pf_rule_index_prefix	*p;
+	struct pf_addr			 key;
+	u_int32_t			 l, lo, hi, mid;
+	int				 c, w, plen;
+
+	bzero(&key, sizeof (key));
+	for (l = 0; l < at->nlens; l++) {
+		plen = at->plen[l];
+		for (w = 0; w < nw && plen > 0; w++, plen -= 32) {
+			key.addr32[w] = addr->addr32[w];
+			if (plen < 32)
+				key.addr32[w] &= htonl(0xffffffffU << (32 - plen));
+		}
+
+		lo = at->start[l];
+		hi = at->start[l + 1];
+		while (lo < hi) {
+			mid = (lo + hi) >> 1;
+			p = &at->prefix[mid];
+			/* the words past nw are zero in both */
+			c = memcmp(&key, &p->addr, nw * sizeof (u_int32_t));
+			if (c == 0) {
+				pf_rule_index_set(ri, p->dense, at->bitmaps,
+				    &at->nrs[p->first], p->count, bits);
+				break;
+			}
+			if (c < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+	}
+}
+
+static int
+pf_rule_index_port_cmp(const void *a, const void *b)
+{
+	u_int32_t	pa = *(const u_int32_t *)a, pb = *(const u_int32_t *)b;
+
+	return (pa < pb ? -1 : (pa > pb ? 1 : 0));
+}
+
+static u_int32_t
+pf_rule_index_segment(struct pf_rule_index_ports *pt, u_int32_t port)
+{
+	u_int32_t	lo = 0, hi = pt->nsegs, mid;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) >> 1;
+		if (pt->lo[mid] <= port)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+static int
+pf_rule_index_build_ports(struct pf_rule_index *ri,
+    struct pf_rule_index_range *range, u_int32_t nrange)
+{
+	struct pf_rule_index_ports	*pt = &ri->dport;
+	u_int32_t			*bounds, *fill;
+	u_int32_t			 i, n, l, h, pass;
+
+	bzero(pt, sizeof (*pt));
+	if (nrange == 0)
+		return (0);
+
+	bounds = malloc((2 * nrange + 1) * sizeof (*bounds));
+	if (bounds == NULL)
+		return (1);
+	n = 0;
+	bounds[n++] = 0;
+	for (i = 0; i < nrange; i++) {
+		bounds[n++] = range[i].lo;
+		if (range[i].hi < 65535)
+			bounds[n++] = range[i].hi + 1;
+	}
+	qsort(bounds, n, sizeof (*bounds), pf_rule_index_port_cmp);
+
+	pt->lo = malloc(n * sizeof (*pt->lo));
+	if (pt->lo == NULL) {
+		free(bounds);
+		return (1);
+	}
+	for (i = 0; i < n; i++)
+		if (i == 0 || bounds[i] != bounds[i - 1])
+			pt->lo[pt->nsegs++] = bounds[i];
+	free(bounds);
+
+	for (pt->size = 1; pt->size < pt->nsegs; pt->size <<= 1)
+		;
+	pt->node = calloc(2 * pt->size + 1, sizeof (*pt->node));
+	fill = calloc(2 * pt->size, sizeof (*fill));
+	if (pt->node == NULL || fill == NULL) {
+		free(fill);
+		return (1);
+	}
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nrange; i++) {
+			l = pf_rule_index_segment(pt, range[i].lo) + pt->size;
+			h = pf_rule_index_segment(pt, range[i].hi) + pt->size + 1;
+			for (; l < h; l >>= 1, h >>= 1) {
+				if (l & 1) {
+					if (pass == 0)
+						pt->node[l + 1]++;
+					else
+						pt->nrs[fill[l]++] = range[i].nr;
+					l++;
+				}
+				if (h & 1) {
+					h--;
+					if (pass == 0)
+						pt->node[h + 1]++;
+					else
+						pt->nrs[fill[h]++] = range[i].nr;
+				}
+			}
+		}
+		if (pass == 0) {
+			for (i = 1; i <= 2 * pt->size; i++)
+				pt->node[i] += pt->node[i - 1];
+			pt->nrs = malloc((pt->node[2 * pt->size] + 1) *
+			    sizeof (*pt->nrs));
+			if (pt->nrs == NULL) {
+				free(fill);
+				return (1);
+			}
+			bcopy(pt->node, fill, 2 * pt->size * sizeof (*fill));
+		}
+	}
+	free(fill);
+
+	pt->dense = malloc(2 * pt->size * sizeof (*pt->dense));
+	if (pt->dense == NULL)
+		return (1);
+	for (i = 0, n = 0; i < 2 * pt->size; i++)
+		pt->dense[i] = (pt->node[i + 1] - pt->node[i] > ri->words) ?
+		    n++ : PF_RI_SPARSE;
+	if (n == 0)
+		return (0);
+	pt->bitmaps = calloc(n * ri->words, sizeof (u_int32_t));
+	if (pt->bitmaps == NULL)
+		return (1);
+	for (i = 0; i < 2 * pt->size; i++) {
+		if (pt->dense[i] == PF_RI_SPARSE)
+			continue;
+		for (l = pt->node[i]; l < pt->node[i + 1]; l++)
+			PF_RI_SETBIT(&pt->bitmaps[pt->dense[i] * ri->words],
+			    pt->nrs[l]);
+	}
+
+	return (0);
+}
+
+static void
+pf_rule_index_ports_lookup(struct pf_rule_index *ri, u_int32_t port,
+    u_int32_t *bits)
+{
+	struct pf_rule_index_ports	*pt = &ri->dport;
+	u_int32_t			 i;
+
+	if (pt->nsegs == 0)
+		return;
+	for (i = pf_rule_index_segment(pt, port) + pt->size; i > 0; i >>= 1) {
+		pf_rule_index_set(ri, pt->dense[i], pt->bitmaps,
+		    &pt->nrs[pt->node[i]], pt->node[i + 1] - pt->node[i], bits);
+	}
+}
+
+static struct pf_rule_index *
+pf_rule_index_build(struct rule *rules, u_int32_t n)
+{
+	struct pf_rule_index		*ri;
+	struct pf_rule_index_ent	*ent = NULL;
+	struct pf_rule_index_range	*range = NULL;
+	struct rule			*r;
+	u_int32_t			 nr, nent[2][PF_RI_NAF], nrange;
+	int				 f;
+
+	ri = calloc(1, sizeof (*ri));
+	if (ri == NULL)
+		return (NULL);
+	ri->nrules = n;
+	ri->words = (n + 31) >> 5;
+	ri->rules = malloc(n * sizeof (*ri->rules));
+	ri->bits = calloc(5 * ri->words, sizeof (u_int32_t));
+	ent = calloc(2 * n, sizeof (*ent));
+	range = malloc(2 * n * sizeof (*range));
+	if (ri->rules == NULL || ri->bits == NULL || ent == NULL ||
+	    range == NULL)
+		goto fail;
+	ri->src_any = ri->bits;
+	ri->dst_any = ri->src_any + ri->words;
+	ri->dport_any = ri->dst_any + ri->words;
+	ri->cand = ri->dport_any + ri->words;
+	ri->tmp = ri->cand + ri->words;
+
+	bzero(nent, sizeof (nent));
+	nrange = 0;
+	for (nr = 0; nr < n; nr++) {
+		struct pf_rule_index_ent	*e;
+		u_int16_t			 a1, a2;
+
+		r = &rules[nr];
+		if (r->nr != nr)
+			goto fail;
+		ri->rules[nr] = r;
+
+		f = pf_rule_index_af(r->af);
+		e = &ent[nent[0][0] + nent[0][1]];
+		if (f >= 0 && pf_rule_index_prefix(&r->src, r->af, &e->addr,
+		    &e->plen)) {
+			e->nr = nr | ((u_int32_t)f << 31);
+			nent[0][f]++;
+		} else {
+			PF_RI_SETBIT(ri->src_any, nr);
+		}
+		e = &ent[2 * n - 1 - nent[1][0] - nent[1][1]];
+		if (f >= 0 && pf_rule_index_prefix(&r->dst, r->af, &e->addr,
+		    &e->plen)) {
+			e->nr = nr | ((u_int32_t)f << 31);
+			nent[1][f]++;
+		} else {
+			PF_RI_SETBIT(ri->dst_any, nr);
+		}
+
+		if ((r->proto != IPPROTO_TCP && r->proto != IPPROTO_UDP) ||
+		    r->dport.op == PF_OP_NONE) {
+			PF_RI_SETBIT(ri->dport_any, nr);
+			continue;
+		}
+		a1 = ntohs(r->dport.port[0]);
+		a2 = ntohs(r->dport.port[1]);
+#define	PF_RI_RANGE(l, h) do {						\
+	if ((int)(l) <= (int)(h)) {					\
+		range[nrange].lo = (l);					\
+		range[nrange].hi = (h);					\
+		range[nrange].nr = nr;					\
+		nrange++;						\
+	}								\
+} while (0)
+		switch (r->dport.op) {
+		case PF_OP_IRG:
+			PF_RI_RANGE(a1 + 1, a2 - 1);
+			break;
+		case PF_OP_XRG:
+			PF_RI_RANGE(0, a1 - 1);
+			PF_RI_RANGE(a2 + 1, 65535);
+			break;
+		case PF_OP_RRG:
+			PF_RI_RANGE(a1, a2);
+			break;
+		case PF_OP_EQ:
+			PF_RI_RANGE(a1, a1);
+			break;
+		case PF_OP_NE:
+			PF_RI_RANGE(0, a1 - 1);
+			PF_RI_RANGE(a1 + 1, 65535);
+			break;
+		case PF_OP_LT:
+			PF_RI_RANGE(0, a1 - 1);
+			break;
+		case PF_OP_LE:
+			PF_RI_RANGE(0, a1);
+			break;
+		case PF_OP_GT:
+			PF_RI_RANGE(a1 + 1, 65535);
+			break;
+		case PF_OP_GE:
+			PF_RI_RANGE(a1, 65535);
+			break;
+		default:
+			PF_RI_SETBIT(ri->dport_any, nr);
+			break;
+		}
+#undef PF_RI_RANGE
+	}
+
+	qsort(ent, nent[0][0] + nent[0][1], sizeof (*ent),
+	    pf_rule_index_ent_cmp);
+	qsort(&ent[2 * n - nent[1][0] - nent[1][1]], nent[1][0] + nent[1][1],
+	    sizeof (*ent), pf_rule_index_ent_cmp);
+
+	if (pf_rule_index_build_atab(ri, &ri->src[PF_RI_INET], ent,
+	    nent[0][PF_RI_INET]) ||
+	    pf_rule_index_build_atab(ri, &ri->src[PF_RI_INET6],
+	    &ent[nent[0][PF_RI_INET]], nent[0][PF_RI_INET6]) ||
+	    pf_rule_index_build_atab(ri, &ri->dst[PF_RI_INET],
+	    &ent[2 * n - nent[1][0] - nent[1][1]], nent[1][PF_RI_INET]) ||
+	    pf_rule_index_build_atab(ri, &ri->dst[PF_RI_INET6],
+	    &ent[2 * n - nent[1][PF_RI_INET6]], nent[1][PF_RI_INET6]) ||
+	    pf_rule_index_build_ports(ri, range, nrange))
+		goto fail;
+
+	free(ent);
+	free(range);
+	return (ri);
+
+fail:
+	free(ent);
+	free(range);
+	pf_rule_index_free(ri);
+	return (NULL);
+}
+
+static void
+pf_rule_index_compute(struct pf_rule_index *ri, struct tuple *t)
+{
+	u_int32_t	w;
+	int		f, nw;
+
+	bcopy(ri->src_any, ri->cand, ri->words * sizeof (u_int32_t));
+	bcopy(ri->dst_any, ri->tmp, ri->words * sizeof (u_int32_t));
+	if ((f = pf_rule_index_af(t->af)) >= 0) {
+		nw = (f == PF_RI_INET) ? 1 : 4;
+		pf_rule_index_atab_lookup(ri, &ri->src[f], &t->src, nw, ri->cand);
+		pf_rule_index_atab_lookup(ri, &ri->dst[f], &t->dst, nw, ri->tmp);
+	}
+	for (w = 0; w < ri->words; w++)
+		ri->cand[w] &= ri->tmp[w];
+
+	if (t->proto != IPPROTO_TCP && t->proto != IPPROTO_UDP)
+		return;
+	bcopy(ri->dport_any, ri->tmp, ri->words * sizeof (u_int32_t));
+	pf_rule_index_ports_lookup(ri, ntohs(t->dport), ri->tmp);
+	for (w = 0; w < ri->words; w++)
+		ri->cand[w] &= ri->tmp[w];
+}
+
+static struct rule *
+pf_rule_index_next(struct pf_rule_index *ri, struct rule *r, struct tuple *t)
+{
+	u_int32_t	nr = r->nr, w, bits;
+
+	if (nr >= ri->nrules || ri->rules[nr] != r)
+		return (r);
+
+	if (ri->gen != pf_rule_index_gen) {
+		pf_rule_index_compute(ri, t);
+		ri->gen = pf_rule_index_gen;
+	}
+
+	w = nr >> 5;
+	bits = ri->cand[w] & (0xffffffffU << (nr & 31));
+	while (bits == 0) {
+		if (++w == ri->words)
+			return (NULL);
+		bits = ri->cand[w];
+	}
+	return (ri->rules[(w << 5) + ffs(bits) - 1]);
+}
+
+/* ------------------------------------------------------------------ */
+/* evaluators                                                         */
+
+static struct rule default_rule = { .nr = (u_int32_t)-1, .action = 0 };
+
+static struct rule *
+eval(struct rule *rules, u_int32_t n, struct pf_rule_index *ri,
+    struct tuple *t, u_int64_t *evaluated)
+{
+	struct rule	*r, *rm = &default_rule;
+
+	pf_rule_index_gen++;
+	r = n ? &rules[0] : NULL;
+	while (r != NULL) {
+		if (ri != NULL && (r = pf_rule_index_next(ri, r, t)) == NULL)
+			break;
+		(*evaluated)++;
+		if (!rule_mismatch(r, t)) {
+			rm = r;
+			if (r->quick)
+				break;
+		}
+		r = (r->nr + 1 < n) ? r + 1 : NULL;
+	}
+	return (rm);
+}
+
+/* ------------------------------------------------------------------ */
+/* tuples                                                             */
+
+static struct tuple	*tuples;
+static u_int32_t	 ntuples, maxtuples;
+
+static void
+add_tuple(struct tuple *t)
+{
+	if (ntuples == maxtuples) {
+		maxtuples = maxtuples ? 2 * maxtuples : 1024;
+		tuples = realloc(tuples, maxtuples * sizeof (*tuples));
+		assert(tuples != NULL);
+	}
+	tuples[ntuples++] = *t;
+}
+
+static void
+parse_ip(const u_int8_t *p, size_t len)
+{
+	struct tuple	t;
+	size_t		hl;
+
+	bzero(&t, sizeof (t));
+	if (len >= 20 && (p[0] >> 4) == 4) {
+		hl = (p[0] & 0xf) * 4;
+		if (hl < 20 || len < hl)
+			return;
+		t.af = AF_INET;
+		t.proto = p[9];
+		bcopy(p + 12, &t.src.addr32[0], 4);
+		bcopy(p + 16, &t.dst.addr32[0], 4);
+		/* only first fragments carry ports */
+		if ((p[6] & 0x1f) != 0 || p[7] != 0)
+			hl = len;
+	} else if (len >= 40 && (p[0] >> 4) == 6) {
+		hl = 40;
+		t.af = AF_INET6;
+		t.proto = p[6];
+		bcopy(p + 8, &t.src, 16);
+		bcopy(p + 24, &t.dst, 16);
+	} else {
+		return;
+	}
+	if ((t.proto == IPPROTO_TCP || t.proto == IPPROTO_UDP) &&
+	    len >= hl + 4) {
+		bcopy(p + hl, &t.sport, 2);
+		bcopy(p + hl + 2, &t.dport, 2);
+	}
+	add_tuple(&t);
+}
+
+static u_int32_t
+swap32(u_int32_t v, int swap)
+{
+	return (swap ? __builtin_bswap32(v) : v);
+}
+
+static int
+read_pcap(const char *path)
+{
+	FILE		*fp;
+	u_int32_t	 hdr[6], rec[4], linktype, caplen;
+	u_int8_t	*buf;
+	int		 swap;
+	size_t		 off;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		return (-1);
+	}
+	if (fread(hdr, sizeof (hdr), 1, fp) != 1 ||
+	    (hdr[0] != 0xa1b2c3d4 && hdr[0] != 0xd4c3b2a1)) {
+		fprintf(stderr, "%s: not a pcap file\n", path);
+		fclose(fp);
+		return (-1);
+	}
+	swap = (hdr[0] == 0xd4c3b2a1);
+	linktype = swap32(hdr[5], swap);
+	buf = malloc(65536);
+	assert(buf != NULL);
+
+	while (fread(rec, sizeof (rec), 1, fp) == 1) {
+		caplen = swap32(rec[2], swap);
+		if (caplen > 65536 || fread(buf, caplen, 1, fp) != 1)
+			break;
+		switch (linktype) {
+		case 0:		/* DLT_NULL */
+			off = 4;
+			break;
+		case 1:		/* DLT_EN10MB */
+			off = 14;
+			if (caplen >= 18 && buf[12] == 0x81 && buf[13] == 0x00)
+				off = 18;
+			break;
+		case 12:	/* DLT_RAW */
+		case 101:	/* LINKTYPE_RAW */
+			off = 0;
+			break;
+		default:
+			fprintf(stderr, "%s: unsupported link type %u\n",
+			    path, linktype);
+			free(buf);
+			fclose(fp);
+			return (-1);
+		}
+		if (caplen > off)
+			parse_ip(buf + off, caplen - off);
+	}
+	free(buf);
+	fclose(fp);
+	return (0);
+}
+
+static void
+gen_tuples(u_int32_t n)
+{
+	struct tuple	t;
+	u_int32_t	i;
+	static const u_int8_t protos[] = { IPPROTO_TCP, IPPROTO_TCP,
+	    IPPROTO_UDP, IPPROTO_ICMP };
+
+	for (i = 0; i < n; i++) {
+		bzero(&t, sizeof (t));
+		t.proto = protos[random() % 4];
+		if (random() % 4 == 0) {
+			t.af = AF_INET6;
+			t.src.addr32[0] = htonl(0x20010db8);
+			t.src.addr32[3] = htonl(random() % 1024);
+			t.dst.addr32[0] = htonl(0x20010db8);
+			t.dst.addr32[2] = htonl(random() % 4);
+			t.dst.addr32[3] = htonl(random() % 1024);
+		} else {
+			t.af = AF_INET;
+			t.src.addr32[0] = htonl(0x0a000000 | (random() & 0xffff));
+			t.dst.addr32[0] = htonl(0xc0a80000 | (random() & 0x3ff));
+		}
+		if (t.proto == IPPROTO_TCP || t.proto == IPPROTO_UDP) {
+			t.sport = htons(1024 + random() % 64512);
+			t.dport = htons(random() % 4 ? random() % 1024 :
+			    random() % 65536);
+		}
+		add_tuple(&t);
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* rules                                                              */
+
+static void
+gen_addr(struct rule_addr *ra, struct tuple *t)
+{
+	struct pf_addr	*a = (random() % 2) ? &t->src : &t->dst;
+	int		 i, plen, nw = (t->af == AF_INET) ? 1 : 4;
+
+	bzero(ra, sizeof (*ra));
+	switch (random() % 16) {
+	case 0:
+	case 1:
+		return;		/* any */
+	case 2:
+		ra->type = PF_ADDR_TABLE;
+		ra->table_seed = random();
+		break;
+	default:
+		/* mostly the usual lengths, some arbitrary ones */
+		if (random() % 4 == 0)
+			plen = random() % (nw * 32 + 1);
+		else
+			plen = nw * 8 * (1 + random() % 4);
+		for (i = 0; i < nw; i++, plen -= 32) {
+			if (plen >= 32)
+				ra->mask.addr32[i] = 0xffffffff;
+			else if (plen > 0)
+				ra->mask.addr32[i] = htonl(0xffffffffU <<
+				    (32 - plen));
+			ra->addr.addr32[i] = a->addr32[i];
+		}
+		if (random() % 32 == 0)		/* non-contiguous mask */
+			ra->mask.addr32[0] ^= htonl(0x00ff0000);
+		break;
+	}
+	ra->neg = (random() % 16 == 0);
+}
+
+static void
+gen_port(u_int8_t *op, u_int16_t *port, struct tuple *t)
+{
+	u_int16_t	p = ntohs(t->dport), a1, a2;
+
+	if (random() % 3 == 0) {
+		*op = PF_OP_NONE;
+		return;
+	}
+	*op = 1 + random() % 9;
+	a1 = (random() % 2) ? p : random() % 1024;
+	a2 = a1 + random() % 256;
+	if (random() % 64 == 0)
+		a1 = (random() % 2) ? 0 : 65535;
+	port[0] = htons(a1);
+	port[1] = htons(a2);
+}
+
+static struct rule *
+gen_rules(u_int32_t n)
+{
+	struct rule	*rules, *r;
+	struct tuple	*t;
+	u_int32_t	 i;
+
+	rules = calloc(n, sizeof (*rules));
+	assert(rules != NULL);
+	for (i = 0; i < n; i++) {
+		r = &rules[i];
+		t = &tuples[random() % ntuples];
+		r->nr = i;
+		r->af = (random() % 8) ? t->af : 0;
+		switch (random() % 4) {
+		case 0:
+			r->proto = 0;
+			break;
+		case 1:
+			r->proto = (random() % 2) ? IPPROTO_TCP : IPPROTO_UDP;
+			break;
+		default:
+			r->proto = t->proto;
+			break;
+		}
+		if (r->af != 0) {
+			gen_addr(&r->src, t);
+			gen_addr(&r->dst, t);
+		}
+		if (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) {
+			gen_port(&r->dport.op, r->dport.port, t);
+			if (random() % 4 == 0)
+				gen_port(&r->sport.op, r->sport.port, t);
+		}
+		r->quick = (random() % 16 == 0);
+		r->action = 1 + random() % 2;
+	}
+	return (rules);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pf_rule_index	*ri;
+	struct rule		*rules, *a, *b;
+	u_int64_t		 start, tlin, tidx, elin = 0, eidx = 0;
+	u_int32_t		 nrules = 4096, ngen = 100000, i, bad = 0;
+	unsigned int		 seed = 1;
+	int			 ch;
+
+	while ((ch = getopt(argc, argv, "r:n:s:")) != -1) {
+		switch (ch) {
+		case 'r':
+			nrules = atoi(optarg);
+			break;
+		case 'n':
+			ngen = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-r rules] [-n tuples] "
+			    "[-s seed] [file.pcap ...]\n", argv[0]);
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	mach_timebase_info(&tb);
+	srandom(seed);
+
+	for (; argc > 0; argc--, argv++)
+		if (read_pcap(argv[0]))
+			return (1);
+	if (ntuples == 0)
+		gen_tuples(ngen);
+	if (nrules == 0)
+		nrules = 1;
+	rules = gen_rules(nrules);
+
+	start = mach_absolute_time();
+	ri = pf_rule_index_build(rules, nrules);
+	printf("%u rules, %u tuples, index built in %.3f ms\n", nrules,
+	    ntuples, to_ms(mach_absolute_time() - start));
+	if (ri == NULL) {
+		fprintf(stderr, "index build failed\n");
+		return (1);
+	}
+
+	start = mach_absolute_time();
+	for (i = 0; i < ntuples; i++)
+		eval(rules, nrules, NULL, &tuples[i], &elin);
+	tlin = mach_absolute_time() - start;
+
+	start = mach_absolute_time();
+	for (i = 0; i < ntuples; i++)
+		eval(rules, nrules, ri, &tuples[i], &eidx);
+	tidx = mach_absolute_time() - start;
+
+	for (i = 0; i < ntuples; i++) {
+		a = eval(rules, nrules, NULL, &tuples[i], &elin);
+		b = eval(rules, nrules, ri, &tuples[i], &eidx);
+		if (a != b || a->action != b->action) {
+			if (bad++ < 10)
+				printf("tuple %u: linear rule %d, indexed "
+				    "rule %d\n", i, (int)a->nr, (int)b->nr);
+		}
+	}
+
+	printf("linear:  %9.3f ms  %8.1f rules/packet\n", to_ms(tlin),
+	    (double)elin / 2 / ntuples);
+	printf("indexed: %9.3f ms  %8.1f rules/packet\n", to_ms(tidx),
+	    (double)eidx / 2 / ntuples);
+	printf("(the model's rule test is far cheaper than pf_test_rule's; "
+	    "compare rules/packet)\n");
+	printf("%u mismatches\n", bad);
+
+	pf_rule_index_free(ri);
+	free(rules);
+	free(tuples);
+	return (bad != 0);
+}
@@ -0,0 +1,296 @@
+/*
+ * Route lookup rate with a large routing table.
+ *
+ * Installs a set of host routes (100000 by default) in 198.18.0.0/15
+ * through a PF_ROUTE socket, all with the loopback address as gateway,
+ * then has sender threads sendto() small UDP datagrams from unconnected
+ * sockets to random destinations in the set.  Every datagram needs a
+ * route lookup in ip_output(), as an unconnected socket has no route
+ * cached in its pcb.
+ *
+ * With -f net.inet.ip.forwarding is turned on for the run and the
+ * datagrams are sent with a TTL of -T hops: each one comes back in on
+ * the loopback interface and goes through ip_forward() and its route
+ * lookup again until the TTL runs out, so the rate then mostly measures
+ * forwarding lookups.
+ *
+ * Each run is done with net.route.cache off and then on, and reports
+ * datagrams per second along with the route cache statistics.  The
+ * routes are removed again on exit.  Must be run as root.
+ *
+ * Usage: route_cache_bench [-f] [-n routes] [-c senders] [-t seconds]
+ *        [-T ttl]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#define	MAXTHREADS	256
+#define	MAXROUTES	(1 << 17)	/* size of 198.18.0.0/15 */
+#define	BASEADDR	0xc6120000	/* 198.18.0.0 */
+
+/* private to the kernel headers; see struct rtcache_stat */
+struct rc_stat {
+	u_int64_t	hits;
+	u_int64_t	misses;
+	u_int64_t	stale;
+	u_int64_t	fills;
+	u_int64_t	purged;
+};
+
+struct worker {
+	pthread_t	thr;
+	unsigned int	seed;
+	u_int64_t	sent;
+	u_int64_t	fails;
+};
+
+static u_int		 nroutes = 100000, nsenders = 4, seconds = 5;
+static int		 forward, ttl = 16;
+static u_int		 added;
+static int		 rs = -1, rseq;
+static struct worker	 senders[MAXTHREADS];
+static volatile int	 stop;
+static mach_timebase_info_data_t tb;
+
+static double
+to_secs(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e9;
+}
+
+static int
+route_msg(int type, u_int idx)
+{
+	struct {
+		struct rt_msghdr	rtm;
+		struct sockaddr_in	dst;
+		struct sockaddr_in	gw;
+	} m;
+
+	memset(&m, 0, sizeof (m));
+	m.rtm.rtm_msglen = sizeof (m);
+	m.rtm.rtm_version = RTM_VERSION;
+	m.rtm.rtm_type = type;
+	m.rtm.rtm_flags = RTF_UP | RTF_HOST | RTF_GATEWAY | RTF_STATIC;
+	m.rtm.rtm_addrs = RTA_DST | RTA_GATEWAY;
+	m.rtm.rtm_pid = getpid();
+	m.rtm.rtm_seq = ++rseq;
+	m.dst.sin_len = sizeof (m.dst);
+	m.dst.sin_family = AF_INET;
+	m.dst.sin_addr.s_addr = htonl(BASEADDR + idx);
+	m.gw.sin_len = sizeof (m.gw);
+	m.gw.sin_family = AF_INET;
+	m.gw.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (write(rs, &m, sizeof (m)) < 0)
+		return (errno);
+	return (0);
+}
+
+static void
+del_routes(void)
+{
+	while (added > 0)
+		(void) route_msg(RTM_DELETE, --added);
+}
+
+static void
+add_routes(void)
+{
+	uint64_t	start;
+	int		error;
+
+	if ((rs = socket(PF_ROUTE, SOCK_RAW, 0)) < 0)
+		err(1, "PF_ROUTE socket");
+	/* we never read the replies; don't let them fill the buffer */
+	(void) shutdown(rs, SHUT_RD);
+
+	start = mach_absolute_time();
+	for (added = 0; added < nroutes; added++) {
+		error = route_msg(RTM_ADD, added);
+		if (error != 0 && error != EEXIST) {
+			del_routes();
+			errc(1, error, "RTM_ADD");
+		}
+	}
+	printf("added %u routes in %.2f s\n", nroutes,
+	    to_secs(mach_absolute_time() - start));
+}
+
+static void *
+sender(void *arg)
+{
+	struct worker		*w = arg;
+	struct sockaddr_in	 sin;
+	char			 buf[16];
+	int			 s;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		err(1, "socket");
+	if (forward && setsockopt(s, IPPROTO_IP, IP_TTL, &ttl,
+	    sizeof (ttl)) < 0)
+		err(1, "IP_TTL");
+
+	memset(&sin, 0, sizeof (sin));
+	memset(buf, 0, sizeof (buf));
+	sin.sin_len = sizeof (sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9);
+
+	while (!stop) {
+		sin.sin_addr.s_addr =
+		    htonl(BASEADDR + rand_r(&w->seed) % nroutes);
+		if (sendto(s, buf, sizeof (buf), 0, (struct sockaddr *)&sin,
+		    sizeof (sin)) < 0)
+			w->fails++;
+		else
+			w->sent++;
+	}
+	close(s);
+	return (NULL);
+}
+
+static void
+get_stats(struct rc_stat *st)
+{
+	size_t len = sizeof (*st);
+
+	memset(st, 0, sizeof (*st));
+	if (sysctlbyname("net.route.cache_stats", st, &len, NULL, 0) < 0)
+		warn("net.route.cache_stats");
+}
+
+static void
+set_sysctl(const char *name, int val)
+{
+	if (sysctlbyname(name, NULL, NULL, &val, sizeof (val)) < 0)
+		err(1, "%s", name);
+}
+
+static void
+run(int cache)
+{
+	struct rc_stat	 st0, st1;
+	u_int64_t	 sent = 0, fails = 0, lookups;
+	uint64_t	 start;
+	double		 secs;
+	u_int		 i;
+
+	set_sysctl("net.route.cache", cache);
+	get_stats(&st0);
+
+	stop = 0;
+	start = mach_absolute_time();
+	for (i = 0; i < nsenders; i++) {
+		senders[i].seed = i + 1;
+		senders[i].sent = senders[i].fails = 0;
+		if (pthread_create(&senders[i].thr, NULL, sender,
+		    &senders[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nsenders; i++) {
+		pthread_join(senders[i].thr, NULL);
+		sent += senders[i].sent;
+		fails += senders[i].fails;
+	}
+	secs = to_secs(mach_absolute_time() - start);
+	get_stats(&st1);
+
+	lookups = (st1.hits - st0.hits) + (st1.misses - st0.misses) +
+	    (st1.stale - st0.stale);
+	printf("cache %-3s %10.0f pkts/s  sent %llu failed %llu  "
+	    "hits %.1f%%  fills %llu\n", cache ? "on" : "off", sent / secs,
+	    (unsigned long long)sent, (unsigned long long)fails,
+	    lookups ? 100.0 * (st1.hits - st0.hits) / lookups : 0.0,
+	    (unsigned long long)(st1.fills - st0.fills));
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t	len;
+	int	ch, ocache = 1, ofwd = 0;
+
+	while ((ch = getopt(argc, argv, "fn:c:t:T:")) != -1) {
+		switch (ch) {
+		case 'f':
+			forward = 1;
+			break;
+		case 'n':
+			nroutes = atoi(optarg);
+			if (nroutes < 1)
+				nroutes = 1;
+			if (nroutes > MAXROUTES)
+				nroutes = MAXROUTES;
+			break;
+		case 'c':
+			nsenders = atoi(optarg);
+			if (nsenders < 1)
+				nsenders = 1;
+			if (nsenders > MAXTHREADS)
+				nsenders = MAXTHREADS;
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'T':
+			ttl = atoi(optarg);
+			if (ttl < 1 || ttl > 255)
+				ttl = 16;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-f] [-n routes] "
+			    "[-c senders] [-t seconds] [-T ttl]\n", argv[0]);
+			return (1);
+		}
+	}
+
+	mach_timebase_info(&tb);
+	signal(SIGPIPE, SIG_IGN);
+
+	len = sizeof (ocache);
+	if (sysctlbyname("net.route.cache", &ocache, &len, NULL, 0) < 0)
+		err(1, "net.route.cache");
+	len = sizeof (ofwd);
+	if (sysctlbyname("net.inet.ip.forwarding", &ofwd, &len, NULL, 0) < 0)
+		err(1, "net.inet.ip.forwarding");
+
+	add_routes();
+	if (forward)
+		set_sysctl("net.inet.ip.forwarding", 1);
+
+	printf("%s  routes %u  senders %u", forward ? "forward" : "sendto",
+	    nroutes, nsenders);
+	if (forward)
+		printf("  ttl %d", ttl);
+	printf("\n");
+	run(0);
+	run(1);
+
+	if (forward)
+		set_sysctl("net.inet.ip.forwarding", ofwd);
+	set_sysctl("net.route.cache", ocache);
+	del_routes();
+	close(rs);
+
+	return (0);
+}
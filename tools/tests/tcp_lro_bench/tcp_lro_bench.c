@@ -0,0 +1,328 @@
+/*
+ * TCP receive throughput and software LRO coalescing ratio.
+ *
+ * Run the receiver on the machine under test, with net.inet.tcp.lro=1,
+ * and the sender on a peer across a real interface (LRO leaves loopback
+ * and cellular traffic alone).  The sender opens the given number of
+ * connections and writes a steady stream of fixed-size segments on
+ * each; the receiver sinks them for the given number of seconds and
+ * reports the throughput along with the change in net.inet.tcp.lro_stats
+ * over the run: segments seen, packets handed to TCP, the coalescing
+ * ratio and how the coalesced packets were pushed up (end of input
+ * batch, timer or ejection).
+ *
+ * The receiving sockets use the SO_TC_AV traffic class, which is what
+ * makes a connection eligible for LRO.  Rerun with a different
+ * net.inet.tcp.lro_flows to compare table sizes; the new size applies
+ * to interfaces that have not received TCP traffic yet.
+ *
+ * Usage: tcp_lro_bench -r [-6] [-p port] [-t seconds]
+ *        tcp_lro_bench -s host [-p port] [-c conns] [-l seglen] [-t seconds]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#ifndef SO_TRAFFIC_CLASS
+#define	SO_TRAFFIC_CLASS	0x1086
+#endif
+#ifndef SO_TC_AV
+#define	SO_TC_AV		500
+#endif
+
+#define	MAXCONNS	256
+
+/* mirrors struct tcp_lro_stat in <netinet/tcp_var.h> */
+struct lro_stat {
+	u_int64_t	lro_segs_in;
+	u_int64_t	lro_pkts_out;
+	u_int64_t	lro_segs_coalesced;
+	u_int64_t	lro_flush_batch;
+	u_int64_t	lro_flush_timer;
+	u_int64_t	lro_flush_eject;
+	u_int64_t	lro_flows_added;
+	u_int64_t	lro_flows_evicted;
+	u_int64_t	lro_chain_max;
+	u_int32_t	lro_tables;
+	u_int32_t	lro_flows;
+};
+
+struct conn {
+	int		s;
+	pthread_t	thr;
+	u_int64_t	bytes;
+};
+
+static u_int		 nconns = 4, seconds = 10, seglen = 1448;
+static u_short		 port = 5201;
+static struct conn	 conns[MAXCONNS];
+static volatile int	 stop;
+static mach_timebase_info_data_t tb;
+
+static double
+to_secs(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom / 1e9;
+}
+
+static int
+get_stats(struct lro_stat *st)
+{
+	size_t len = sizeof (*st);
+
+	memset(st, 0, sizeof (*st));
+	return (sysctlbyname("net.inet.tcp.lro_stats", st, &len, NULL, 0));
+}
+
+static void *
+sink(void *arg)
+{
+	struct conn	*c = arg;
+	char		 buf[256 * 1024];
+	ssize_t		 n;
+
+	while (!stop) {
+		if ((n = recv(c->s, buf, sizeof (buf), 0)) < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			break;
+		}
+		if (n == 0)
+			break;
+		c->bytes += n;
+	}
+	return (NULL);
+}
+
+static void *
+source(void *arg)
+{
+	struct conn	*c = arg;
+	char		 buf[65536];
+	ssize_t		 n;
+
+	memset(buf, 0x5a, sizeof (buf));
+	while (!stop) {
+		if ((n = send(c->s, buf, seglen, 0)) < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			break;
+		}
+		c->bytes += n;
+	}
+	return (NULL);
+}
+
+static void
+receiver(int af)
+{
+	struct sockaddr_storage ss;
+	struct lro_stat	 before, after;
+	struct timeval	 tv = { 0, 100000 };
+	u_int64_t	 bytes = 0, segs, coal;
+	uint64_t	 start;
+	double		 secs;
+	int		 ls, on = 1, tc = SO_TC_AV;
+	u_int		 i, n = 0;
+
+	if ((ls = socket(af, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	(void) setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+	/* accepted sockets inherit the traffic class */
+	if (setsockopt(ls, SOL_SOCKET, SO_TRAFFIC_CLASS, &tc, sizeof (tc)) < 0)
+		warn("SO_TRAFFIC_CLASS");
+
+	memset(&ss, 0, sizeof (ss));
+	if (af == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+
+		sin6->sin6_len = sizeof (*sin6);
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+		sin->sin_len = sizeof (*sin);
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+	}
+	if (bind(ls, (struct sockaddr *)&ss, ss.ss_len) < 0)
+		err(1, "bind");
+	if (listen(ls, MAXCONNS) < 0)
+		err(1, "listen");
+
+	/* the first connection starts the clock */
+	if ((conns[n].s = accept(ls, NULL, NULL)) < 0)
+		err(1, "accept");
+	(void) get_stats(&before);
+	start = mach_absolute_time();
+	(void) setsockopt(ls, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+	for (;;) {
+		(void) setsockopt(conns[n].s, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof (tv));
+		if (pthread_create(&conns[n].thr, NULL, sink, &conns[n]) != 0)
+			errx(1, "pthread_create");
+		n++;
+		while (n < MAXCONNS &&
+		    to_secs(mach_absolute_time() - start) < seconds) {
+			if ((conns[n].s = accept(ls, NULL, NULL)) >= 0)
+				break;
+		}
+		if (n == MAXCONNS ||
+		    to_secs(mach_absolute_time() - start) >= seconds)
+			break;
+	}
+	stop = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(conns[i].thr, NULL);
+		bytes += conns[i].bytes;
+		close(conns[i].s);
+	}
+	secs = to_secs(mach_absolute_time() - start);
+	(void) get_stats(&after);
+	close(ls);
+
+	segs = after.lro_segs_in - before.lro_segs_in;
+	coal = after.lro_segs_coalesced - before.lro_segs_coalesced;
+	printf("conns %u  %.1f MB/s over %.1f s\n", n, bytes / secs / 1e6,
+	    secs);
+	printf("lro: tables %u flows %u  segs %llu pkts out %llu  "
+	    "ratio %.2f\n", after.lro_tables, after.lro_flows,
+	    (unsigned long long)segs, (unsigned long long)(segs - coal),
+	    segs != coal ? (double)segs / (segs - coal) : 0.0);
+	printf("lro: flushed batch %llu timer %llu eject %llu  "
+	    "flows added %llu evicted %llu  max chain %llu\n",
+	    (unsigned long long)(after.lro_flush_batch -
+	    before.lro_flush_batch),
+	    (unsigned long long)(after.lro_flush_timer -
+	    before.lro_flush_timer),
+	    (unsigned long long)(after.lro_flush_eject -
+	    before.lro_flush_eject),
+	    (unsigned long long)(after.lro_flows_added -
+	    before.lro_flows_added),
+	    (unsigned long long)(after.lro_flows_evicted -
+	    before.lro_flows_evicted),
+	    (unsigned long long)after.lro_chain_max);
+}
+
+static void
+sender(const char *host)
+{
+	struct addrinfo	 hints, *res;
+	char		 pstr[8];
+	u_int64_t	 bytes = 0;
+	uint64_t	 start;
+	int		 error, on = 1;
+	u_int		 i;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(pstr, sizeof (pstr), "%u", port);
+	if ((error = getaddrinfo(host, pstr, &hints, &res)) != 0)
+		errx(1, "%s: %s", host, gai_strerror(error));
+
+	for (i = 0; i < nconns; i++) {
+		if ((conns[i].s = socket(res->ai_family, SOCK_STREAM, 0)) < 0)
+			err(1, "socket");
+		(void) setsockopt(conns[i].s, IPPROTO_TCP, TCP_NODELAY, &on,
+		    sizeof (on));
+		if (connect(conns[i].s, res->ai_addr, res->ai_addrlen) < 0)
+			err(1, "connect");
+	}
+	freeaddrinfo(res);
+
+	start = mach_absolute_time();
+	for (i = 0; i < nconns; i++) {
+		if (pthread_create(&conns[i].thr, NULL, source,
+		    &conns[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	sleep(seconds);
+	stop = 1;
+	for (i = 0; i < nconns; i++) {
+		shutdown(conns[i].s, SHUT_RDWR);
+		pthread_join(conns[i].thr, NULL);
+		bytes += conns[i].bytes;
+		close(conns[i].s);
+	}
+	printf("conns %u  seglen %u  %.1f MB/s\n", nconns, seglen,
+	    bytes / to_secs(mach_absolute_time() - start) / 1e6);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s -r [-6] [-p port] [-t seconds]\n"
+	    "       %s -s host [-p port] [-c conns] [-l seglen] "
+	    "[-t seconds]\n", prog, prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*host = NULL;
+	int		 ch, recv_mode = 0, af = AF_INET;
+
+	while ((ch = getopt(argc, argv, "r6s:p:c:l:t:")) != -1) {
+		switch (ch) {
+		case 'r':
+			recv_mode = 1;
+			break;
+		case '6':
+			af = AF_INET6;
+			break;
+		case 's':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			nconns = atoi(optarg);
+			if (nconns < 1)
+				nconns = 1;
+			if (nconns > MAXCONNS)
+				nconns = MAXCONNS;
+			break;
+		case 'l':
+			seglen = atoi(optarg);
+			if (seglen < 1)
+				seglen = 1;
+			if (seglen > 65536)
+				seglen = 65536;
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (recv_mode == (host != NULL))
+		usage(argv[0]);
+
+	mach_timebase_info(&tb);
+	if (recv_mode)
+		receiver(af);
+	else
+		sender(host);
+
+	return (0);
+}
@@ -0,0 +1,260 @@
+/*
+ * Userspace model of the per-cpu timer_call queue.
+ *
+ * Compares the cost of arming, cancelling and expiring timers on a
+ * sorted list with a linear insertion scan (the old
+ * call_entry_enqueue_deadline() behavior) against the same list with a
+ * red-black tree deadline index (timer_call_tree_enqueue()).
+ *
+ * Usage: timer_queue_sim [-n armed] [-o ops] [-c cancel_pct]
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#include "../../../libkern/libkern/tree.h"
+
+struct tc {
+	struct tc	*next;
+	struct tc	*prev;
+	uint64_t	deadline;
+	int		queued;
+	int		tree_linked;
+	RB_ENTRY(tc)	tree_link;
+};
+
+static int
+tc_compare(struct tc *a, struct tc *b)
+{
+	if (a->deadline != b->deadline)
+		return (a->deadline < b->deadline) ? -1 : 1;
+	if (a != b)
+		return ((uintptr_t)a < (uintptr_t)b) ? -1 : 1;
+	return 0;
+}
+
+RB_HEAD(tc_tree, tc);
+RB_PROTOTYPE_PREV(tc_tree, tc, tree_link, tc_compare);
+RB_GENERATE_PREV(tc_tree, tc, tree_link, tc_compare);
+
+struct tq {
+	struct tc	head;
+	struct tc_tree	tree;
+	int		indexed;
+	uint64_t	count;
+};
+
+static void
+tq_init(struct tq *q, int indexed)
+{
+	q->head.next = q->head.prev = &q->head;
+	RB_INIT(&q->tree);
+	q->indexed = indexed;
+	q->count = 0;
+}
+
+static void
+insque_after(struct tc *e, struct tc *pred)
+{
+	e->next = pred->next;
+	e->prev = pred;
+	pred->next->prev = e;
+	pred->next = e;
+}
+
+static void
+tq_remove(struct tq *q, struct tc *e)
+{
+	if (!e->queued)
+		return;
+	if (e->tree_linked) {
+		RB_REMOVE(tc_tree, &q->tree, e);
+		e->tree_linked = 0;
+	}
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->queued = 0;
+	q->count--;
+}
+
+static void
+tq_enqueue(struct tq *q, struct tc *e, uint64_t deadline)
+{
+	struct tc	*cur;
+
+	tq_remove(q, e);
+	e->deadline = deadline;
+
+	if (q->indexed) {
+		RB_INSERT(tc_tree, &q->tree, e);
+		e->tree_linked = 1;
+		cur = RB_PREV(tc_tree, &q->tree, e);
+		insque_after(e, cur ? cur : &q->head);
+	} else {
+		cur = q->head.next;
+		while (cur != &q->head && cur->deadline <= deadline)
+			cur = cur->next;
+		insque_after(e, cur->prev);
+	}
+	e->queued = 1;
+	q->count++;
+}
+
+static struct tc *
+tq_first(struct tq *q)
+{
+	return (q->head.next == &q->head) ? NULL : q->head.next;
+}
+
+static void
+tq_check(struct tq *q)
+{
+	struct tc	*e;
+	uint64_t	last = 0, n = 0;
+
+	for (e = q->head.next; e != &q->head; e = e->next) {
+		assert(e->deadline >= last);
+		last = e->deadline;
+		n++;
+	}
+	assert(n == q->count);
+}
+
+static uint64_t
+rnd64(void)
+{
+	return ((uint64_t)random() << 31) ^ (uint64_t)random();
+}
+
+struct result {
+	double	arm_ns;
+	double	cancel_ns;
+	double	expire_ns;
+};
+
+static mach_timebase_info_data_t tb;
+
+static double
+to_ns(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom;
+}
+
+/*
+ * Fill the queue with 'armed' timers, then run 'ops' rounds of
+ * re-arming a random timer, cancelling one with probability cancel_pct,
+ * and expiring everything due as simulated time advances.
+ */
+static void
+run(int indexed, int armed, int ops, int cancel_pct, unsigned seed,
+    struct result *r)
+{
+	struct tq	q;
+	struct tc	*calls, *e;
+	uint64_t	now = 0, t, t_arm = 0, t_cancel = 0, t_expire = 0;
+	uint64_t	n_arm = 0, n_cancel = 0, n_expire = 0;
+	int		i;
+
+	srandom(seed);
+	tq_init(&q, indexed);
+	calls = calloc(armed, sizeof(*calls));
+	assert(calls != NULL);
+
+	for (i = 0; i < armed; i++)
+		tq_enqueue(&q, &calls[i], 1 + rnd64() % (100 * (uint64_t)armed));
+
+	for (i = 0; i < ops; i++) {
+		e = &calls[random() % armed];
+		/* mostly near-term deadlines, some far out, as in practice */
+		uint64_t delta = (random() % 8) ? rnd64() % 1000 :
+		    rnd64() % (100 * (uint64_t)armed);
+
+		t = mach_absolute_time();
+		tq_enqueue(&q, e, now + 1 + delta);
+		t_arm += mach_absolute_time() - t;
+		n_arm++;
+
+		if ((random() % 100) < cancel_pct) {
+			e = &calls[random() % armed];
+			t = mach_absolute_time();
+			tq_remove(&q, e);
+			t_cancel += mach_absolute_time() - t;
+			n_cancel++;
+		}
+
+		now += 10;
+		t = mach_absolute_time();
+		while ((e = tq_first(&q)) != NULL && e->deadline <= now) {
+			tq_remove(&q, e);
+			n_expire++;
+		}
+		t_expire += mach_absolute_time() - t;
+	}
+
+	tq_check(&q);
+	free(calls);
+
+	r->arm_ns = n_arm ? to_ns(t_arm) / n_arm : 0;
+	r->cancel_ns = n_cancel ? to_ns(t_cancel) / n_cancel : 0;
+	r->expire_ns = n_expire ? to_ns(t_expire) / n_expire : 0;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-n armed] [-o ops] [-c cancel_pct]\n",
+	    progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int default_sizes[] = { 100, 1000, 10000, 50000 };
+	int		sizes[4], nsizes = 4;
+	int		ops = 200000, cancel_pct = 25;
+	int		ch, i;
+	struct result	list, tree;
+
+	memcpy(sizes, default_sizes, sizeof(sizes));
+
+	while ((ch = getopt(argc, argv, "n:o:c:")) != -1) {
+		switch (ch) {
+		case 'n':
+			sizes[0] = atoi(optarg);
+			nsizes = 1;
+			break;
+		case 'o':
+			ops = atoi(optarg);
+			break;
+		case 'c':
+			cancel_pct = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (ops <= 0 || sizes[0] <= 0 || cancel_pct < 0 || cancel_pct > 100)
+		usage(argv[0]);
+
+	mach_timebase_info(&tb);
+
+	printf("%8s  %-6s %10s %10s %10s\n",
+	    "armed", "queue", "arm(ns)", "cancel(ns)", "expire(ns)");
+	for (i = 0; i < nsizes; i++) {
+		run(0, sizes[i], ops, cancel_pct, 42, &list);
+		run(1, sizes[i], ops, cancel_pct, 42, &tree);
+		printf("%8d  %-6s %10.1f %10.1f %10.1f\n", sizes[i], "list",
+		    list.arm_ns, list.cancel_ns, list.expire_ns);
+		printf("%8d  %-6s %10.1f %10.1f %10.1f\n", sizes[i], "tree",
+		    tree.arm_ns, tree.cancel_ns, tree.expire_ns);
+	}
+
+	return 0;
+}
@@ -0,0 +1,275 @@
+/*
+ * Replay page corpora through the VM compressor codecs.
+ *
+ * Each input file is split into 4K pages which are compressed and
+ * decompressed with WKdm and with the LZ page codec; the round trip is
+ * verified and the compression ratio and throughput of each codec are
+ * reported, together with the ratio an adaptive per-page choice of the
+ * smaller result would reach.  Without input files a synthetic corpus
+ * of pointer, integer, text, zero and random pages is used.
+ *
+ * Any raw memory image (e.g. the segments of a core file) can serve
+ * as a corpus.
+ *
+ * Usage: vm_codec_bench [-i iterations] [file ...]
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#include <vm/WKdm_new.h>
+#include <vm/lz_page.h>
+
+#define BENCH_PAGE_SIZE	4096
+#define DST_SIZE	(BENCH_PAGE_SIZE * 2)	/* WKdm may write past its budget */
+
+struct codec_result {
+	uint64_t	pages;
+	uint64_t	failed;
+	uint64_t	bytes;
+	uint64_t	compress_time;
+	uint64_t	decompress_time;
+};
+
+static mach_timebase_info_data_t tb;
+
+static double
+to_ns(uint64_t t)
+{
+	return (double)t * tb.numer / tb.denom;
+}
+
+static char *
+load_file(const char *path, size_t *npages)
+{
+	struct stat	st;
+	char		*buf;
+	ssize_t		n;
+	int		fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	*npages = st.st_size / BENCH_PAGE_SIZE;
+	if (*npages == 0) {
+		fprintf(stderr, "%s: shorter than a page\n", path);
+		exit(1);
+	}
+	buf = valloc(*npages * BENCH_PAGE_SIZE);
+	assert(buf != NULL);
+
+	n = read(fd, buf, *npages * BENCH_PAGE_SIZE);
+	if (n != (ssize_t)(*npages * BENCH_PAGE_SIZE)) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+
+	return buf;
+}
+
+static char *
+synthetic_corpus(size_t *npages)
+{
+	static const char	*words[] = {
+		"kernel", "page", "the", "compressor", "segment", "of",
+		"memory", "object", "and", "vnode", "thread", "a",
+	};
+	char		*buf;
+	size_t		i, j;
+
+	*npages = 1000;
+	buf = valloc(*npages * BENCH_PAGE_SIZE);
+	assert(buf != NULL);
+
+	srandom(1);
+
+	for (i = 0; i < *npages; i++) {
+		char		*page = buf + i * BENCH_PAGE_SIZE;
+		uint64_t	*q = (uint64_t *)(void *)page;
+		uint32_t	*w = (uint32_t *)(void *)page;
+
+		switch (i % 5) {
+		case 0:		/* heap pointers */
+			for (j = 0; j < BENCH_PAGE_SIZE / 8; j++)
+				q[j] = 0x00007f8a4c000000ULL + ((random() % 4096) << 4);
+			break;
+		case 1:		/* small integers */
+			for (j = 0; j < BENCH_PAGE_SIZE / 4; j++)
+				w[j] = random() % 1000;
+			break;
+		case 2:		/* text */
+			for (j = 0; j < BENCH_PAGE_SIZE; ) {
+				const char *s = words[random() % 12];
+				while (*s && j < BENCH_PAGE_SIZE)
+					page[j++] = *s++;
+				if (j < BENCH_PAGE_SIZE)
+					page[j++] = ' ';
+			}
+			break;
+		case 3:		/* mostly zero, unaligned records */
+			memset(page, 0, BENCH_PAGE_SIZE);
+			for (j = 3; j + 7 < BENCH_PAGE_SIZE; j += 37)
+				memcpy(&page[j], "\x01\x02rec\x00\xff", 7);
+			break;
+		default:	/* incompressible */
+			for (j = 0; j < BENCH_PAGE_SIZE; j++)
+				page[j] = random();
+			break;
+		}
+	}
+	return buf;
+}
+
+static int
+run_wkdm(char *src, char *dst, char *scratch, char *out, struct codec_result *r)
+{
+	uint64_t	t;
+	int		size;
+
+	t = mach_absolute_time();
+	size = WKdm_compress_new((WK_word *)(void *)src, (WK_word *)(void *)dst,
+	    (WK_word *)(void *)scratch, BENCH_PAGE_SIZE - 4);
+	r->compress_time += mach_absolute_time() - t;
+	r->pages++;
+
+	if (size == -1) {
+		r->failed++;
+		r->bytes += BENCH_PAGE_SIZE;
+		return BENCH_PAGE_SIZE;
+	}
+	t = mach_absolute_time();
+	WKdm_decompress_new((WK_word *)(void *)dst, (WK_word *)(void *)out,
+	    (WK_word *)(void *)scratch, size);
+	r->decompress_time += mach_absolute_time() - t;
+
+	if (memcmp(src, out, BENCH_PAGE_SIZE)) {
+		fprintf(stderr, "WKdm round trip mismatch\n");
+		exit(1);
+	}
+	r->bytes += size;
+	return size;
+}
+
+static int
+run_lz(char *src, char *dst, char *scratch, char *out, struct codec_result *r)
+{
+	uint64_t	t;
+	int		size;
+
+	t = mach_absolute_time();
+	size = lz_page_compress((uint8_t *)src, BENCH_PAGE_SIZE, (uint8_t *)dst,
+	    BENCH_PAGE_SIZE - 5, scratch);
+	r->compress_time += mach_absolute_time() - t;
+	r->pages++;
+
+	if (size == -1) {
+		r->failed++;
+		r->bytes += BENCH_PAGE_SIZE;
+		return BENCH_PAGE_SIZE;
+	}
+	t = mach_absolute_time();
+	if (lz_page_decompress((uint8_t *)dst, size, (uint8_t *)out, BENCH_PAGE_SIZE)) {
+		fprintf(stderr, "LZ stream corrupt\n");
+		exit(1);
+	}
+	r->decompress_time += mach_absolute_time() - t;
+
+	if (memcmp(src, out, BENCH_PAGE_SIZE)) {
+		fprintf(stderr, "LZ round trip mismatch\n");
+		exit(1);
+	}
+	r->bytes += size;
+	return size;
+}
+
+static void
+report(const char *name, struct codec_result *r, uint64_t input)
+{
+	double	c_ns = to_ns(r->compress_time);
+	double	d_ns = to_ns(r->decompress_time);
+
+	printf("%-8s %8llu %7llu %8.3f %10.1f %10.1f\n", name,
+	    (unsigned long long)r->pages, (unsigned long long)r->failed,
+	    (double)input / r->bytes,
+	    c_ns ? (double)input / c_ns * 1000 : 0,
+	    d_ns ? (double)(r->pages - r->failed) * BENCH_PAGE_SIZE / d_ns * 1000 : 0);
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-i iterations] [file ...]\n", progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct codec_result	wkdm, lz;
+	uint64_t		best_bytes = 0, input = 0;
+	char			*corpus, *dst, *scratch, *out;
+	size_t			npages, p;
+	int			ch, iterations = 10, it, f;
+
+	while ((ch = getopt(argc, argv, "i:")) != -1) {
+		switch (ch) {
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (iterations <= 0)
+		usage(argv[-optind]);
+
+	mach_timebase_info(&tb);
+
+	dst = valloc(DST_SIZE);
+	out = valloc(BENCH_PAGE_SIZE);
+	scratch = valloc(WKdm_SCRATCH_BUF_SIZE > LZ_PAGE_SCRATCH_BUF_SIZE ?
+	    WKdm_SCRATCH_BUF_SIZE : LZ_PAGE_SCRATCH_BUF_SIZE);
+	assert(dst != NULL && out != NULL && scratch != NULL);
+
+	memset(&wkdm, 0, sizeof(wkdm));
+	memset(&lz, 0, sizeof(lz));
+
+	for (f = 0; f < (argc ? argc : 1); f++) {
+		corpus = argc ? load_file(argv[f], &npages) : synthetic_corpus(&npages);
+
+		for (it = 0; it < iterations; it++) {
+			for (p = 0; p < npages; p++) {
+				char	*src = corpus + p * BENCH_PAGE_SIZE;
+				int	w, l;
+
+				w = run_wkdm(src, dst, scratch, out, &wkdm);
+				l = run_lz(src, dst, scratch, out, &lz);
+
+				best_bytes += (w < l) ? w : l;
+				input += BENCH_PAGE_SIZE;
+			}
+		}
+		free(corpus);
+	}
+
+	printf("%-8s %8s %7s %8s %10s %10s\n",
+	    "codec", "pages", "failed", "ratio", "comp MB/s", "decomp MB/s");
+	report("WKdm", &wkdm, input);
+	report("LZ", &lz, input);
+	printf("%-8s %8s %7s %8.3f\n", "best", "", "", (double)input / best_bytes);
+
+	return 0;
+}
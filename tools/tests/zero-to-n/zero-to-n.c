@@ -33,6 +33,7 @@
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/ptrace.h>
+#include <sys/sysctl.h>
 #include <semaphore.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -417,10 +418,13 @@ main(int argc, char **argv)
 	uint64_t	*worst_latencies_ns;
 	uint64_t	*worst_latencies_from_first_ns;
 	uint64_t 	last_end;
+	uint64_t	total_ns = 0;
 	uint64_t	max, min;
 	uint64_t	traceworthy_latency_ns = TRACEWORTHY_NANOS;
 	float		avg, stddev;
 	boolean_t	seen_apptype = FALSE;
+	char		sched_name[48];
+	size_t		sched_name_len = sizeof(sched_name);
 
 	srand(time(NULL));
 
@@ -566,6 +570,7 @@ main(int argc, char **argv)
 		}
 	
 		worst_latencies_ns[i] = abs_to_nanos(worst_abs);
+		total_ns += worst_latencies_ns[i];
 
 		worst_abs = 0;
 		for (j = 1; j < g_numthreads; j++) {
@@ -602,6 +607,11 @@ main(int argc, char **argv)
 		assert(res == 0, fail);
 	}
 
+	if (sysctlbyname("kern.sched", sched_name, &sched_name_len, NULL, 0) == 0) {
+		printf("Scheduler:\t%s\n", sched_name);
+		putchar('\n');
+	}
+
 	compute_stats(worst_latencies_ns, g_iterations, &avg, &max, &min, &stddev);
 	printf("Results (from a stop):\n");
 	printf("Max:\t\t%.2f us\n", ((float)max) / 1000.0);
@@ -618,6 +628,12 @@ main(int argc, char **argv)
 	printf("Avg:\t\t%.2f us\n", avg / 1000.0);
 	printf("Stddev:\t\t%.2f us\n", stddev / 1000.0);
 
+	putchar('\n');
+
+	/* Wakeups completed per second of time spent waking the workers */
+	printf("Throughput:\t%.0f wakeups/s\n",
+	    total_ns ? ((double)g_numthreads * g_iterations * NSEC_PER_SEC) / total_ns : 0.0);
+
 #if 0
 	for (i = 0; i < g_iterations; i++) {
 		printf("Iteration %d: %f us\n", i, worst_latencies_ns[i] / 1000.0);
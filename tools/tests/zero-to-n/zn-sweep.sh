@@ -0,0 +1,27 @@
+#!/bin/sh
+#
+# Run zn over 2..64 threads and print one line per thread count, so the
+# wakeup latency and throughput of two schedulers (e.g. boot-args
+# sched=multiq and sched=dualq) can be compared side by side.
+#
+# Usage: zn-sweep.sh [wakeup pattern] [policy] [iterations]
+#
+
+ZN=${ZN:-`dirname $0`/zn}
+PATTERN=${1:-broadcast-single-sem}
+POLICY=${2:-timeshare}
+ITERATIONS=${3:-1000}
+
+echo "Scheduler: `sysctl -n kern.sched`  Pattern: $PATTERN  Policy: $POLICY  Iterations: $ITERATIONS"
+printf "%8s %12s %12s %12s %16s\n" threads "avg (us)" "max (us)" "stddev (us)" "wakeups/s"
+
+for n in 2 4 8 16 32 64; do
+	$ZN $n $PATTERN $POLICY $ITERATIONS | awk -v n=$n '
+		/^Results \(from a stop\)/	{ section = 1 }
+		/^Results \(relative/		{ section = 2 }
+		section == 1 && /^Avg:/		{ avg = $2 }
+		section == 1 && /^Max:/		{ max = $2 }
+		section == 1 && /^Stddev:/	{ dev = $2 }
+		/^Throughput:/			{ tput = $2 }
+		END { printf("%8d %12s %12s %12s %16s\n", n, avg, max, dev, tput) }'
+done